@@ -0,0 +1,293 @@
+#ifndef CPP_BINARY_MRPT_H_
+#define CPP_BINARY_MRPT_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "Mrpt.h"
+#include "mrpt_kernels.h"
+
+/*
+ * An index of binary codes, such as the 256-bit or 1024-bit hashes of images,
+ * searched by Hamming distance. The codes are stored packed, bits / 64 words
+ * of 64 bits each, instead of one float per bit, and are read in place.
+ *
+ * By default the trees split the codes by bit sampling, the locality-sensitive
+ * hashing of Hamming distance: each level of a tree is split by a random bit,
+ * so the codes in a leaf agree on depth bits. A split can instead be a hashed
+ * projection on split_bits random bits with random signs, the number of bits
+ * of a code set among the positive ones minus among the negative ones. Both
+ * are computed from the Hamming distances of the code to the masks of the two
+ * sets of bits, with the popcount kernel of the linear search, which is
+ * selected at runtime like the distance kernels of Mrpt. On clustered codes,
+ * sampled bits reach a higher recall with the same trees.
+ *
+ * The votes of a query are counted by sorting the points of its leaves, so a
+ * query needs memory in proportion to the size of its leaves, not to the
+ * number of codes, which can be up to 2^31 - 1.
+ */
+class BinaryMrpt {
+ public:
+    /**
+    * Creates an index of the n_samples_ codes at codes_. The trees are built
+    * with grow.
+    * @param codes_ - The codes, each of words() consecutive 64-bit words, the
+    * code of point i starting at codes_ + i * words(). The bits of a code past
+    * bits_ must be zero. The codes must outlive the index.
+    * @param n_samples_ - The number of codes
+    * @param bits_ - The number of bits of a code
+    * @param n_trees_ - The number of trees to be used in the index
+    * @param depth_ - The depth of the trees
+    * @param split_bits_ - The number of random bits the projection of a level
+    * is made of, 1 for bit sampling
+    * @param seed_ - The seed of the random projections. If 0, every build draws a
+    * new random seed.
+    */
+    BinaryMrpt(const uint64_t *codes_, int n_samples_, int bits_, int n_trees_, int depth_,
+               int split_bits_ = 1, unsigned seed_ = 0) :
+        codes(codes_),
+        n_samples(n_samples_),
+        bits(bits_),
+        n_words((bits_ + 63) / 64),
+        n_trees(n_trees_),
+        depth(depth_),
+        split_bits(std::max(1, std::min(split_bits_, bits_))),
+        seed(seed_),
+        hamming(mrpt_kernels::distance_kernels().hamming) { }
+
+    BinaryMrpt(const BinaryMrpt &) = delete;
+
+    /**
+    * Returns the number of 64-bit words of a code.
+    */
+    int words() const {
+        return n_words;
+    }
+
+    /**
+    * Generates the random vectors and builds the trees, in parallel over the
+    * trees. A tree takes n_samples ints of working memory besides its leaves.
+    */
+    void grow() {
+        const unsigned build_seed = seed ? seed : std::random_device()();
+        const int n_leaves = 1 << depth;
+        if (split_bits == 1)
+            sampled_bits.assign((size_t) n_trees * depth, 0);
+        else
+            masks.assign((size_t) n_trees * depth * 2 * n_words, 0);
+        split_points = MatrixXi(n_leaves, n_trees);
+        leaf_first = MatrixXi(n_leaves + 1, n_trees);
+        leaf_ids = MatrixXi(n_samples, n_trees);
+
+        #pragma omp parallel for
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            std::seed_seq seq{build_seed, static_cast<unsigned>(n_tree)};
+            std::mt19937 gen(seq);
+            random_masks(gen, n_tree);
+
+            std::vector<int> projections(n_samples);
+            int *indices = leaf_ids.col(n_tree).data();
+            std::iota(indices, indices + n_samples, 0);
+            grow_subtree(indices, indices + n_samples, 0, 0, n_tree, projections);
+            leaf_first(n_leaves, n_tree) = n_samples;
+        }
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q: the points in the leaves of
+    * q that get at least votes_required votes are searched for the nearest ones.
+    * @param q - The query code of words() words
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for the Hamming distances of the k approximate nearest neighbors (optional
+    * parameter)
+    */
+    void query(const uint64_t *q, int k, int votes_required, int *out, float *out_distances = nullptr) const {
+        std::vector<int> found;
+        query(q, k, votes_required, out, out_distances, found);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the n_queries codes
+    * at Q, in parallel over the queries.
+    * @param Q - The query codes, each of words() words
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_batch(const uint64_t *Q, int n_queries, int k, int votes_required, int *out,
+                     float *out_distances = nullptr) const {
+        #pragma omp parallel
+        {
+            std::vector<int> found;
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n_queries; ++i) {
+                query(Q + (size_t) i * n_words, k, votes_required, out + (size_t) i * k,
+                      out_distances ? out_distances + (size_t) i * k : nullptr, found);
+            }
+        }
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of q among all the points.
+    * @param q - The query code of words() words
+    * @param k - The number of neighbors searched for
+    * @param out - Output buffer for the indices of the k nearest neighbors
+    * @param out_distances - Output buffer for the Hamming distances of the k nearest neighbors (optional parameter)
+    */
+    void exact_knn(const uint64_t *q, int k, int *out, float *out_distances = nullptr) const {
+        Mrpt::TopK heap(k);
+        for (int j = 0; j < n_samples; ++j)
+            heap.push(hamming(q, codes + (size_t) j * n_words, n_words), j);
+        heap.extract(out, out_distances);
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of each of the n_queries codes at Q,
+    * in parallel over the queries.
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void exact_knn_batch(const uint64_t *Q, int n_queries, int k, int *out, float *out_distances = nullptr) const {
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < n_queries; ++i) {
+            exact_knn(Q + (size_t) i * n_words, k, out + (size_t) i * k,
+                      out_distances ? out_distances + (size_t) i * k : nullptr);
+        }
+    }
+
+ private:
+    /**
+    * Draws split_bits distinct bits for each level of a tree into its positive
+    * and its negative mask, each with a random sign, or the one bit of bit
+    * sampling into sampled_bits.
+    */
+    void random_masks(std::mt19937 &gen, int n_tree) {
+        std::uniform_int_distribution<int> bit_dist(0, bits - 1);
+        std::bernoulli_distribution sign_dist(0.5);
+        for (int level = 0; level < depth; ++level) {
+            if (split_bits == 1) {
+                sampled_bits[(size_t) n_tree * depth + level] = bit_dist(gen);
+                continue;
+            }
+            uint64_t *positive = mask(n_tree, level), *negative = positive + n_words;
+            for (int drawn = 0; drawn < split_bits; ) {
+                const int b = bit_dist(gen);
+                const uint64_t bit = uint64_t(1) << (b & 63);
+                if ((positive[b >> 6] | negative[b >> 6]) & bit) continue;
+                (sign_dist(gen) ? positive : negative)[b >> 6] |= bit;
+                ++drawn;
+            }
+        }
+    }
+
+    uint64_t *mask(int n_tree, int level) {
+        return masks.data() + ((size_t) n_tree * depth + level) * 2 * n_words;
+    }
+
+    const uint64_t *mask(int n_tree, int level) const {
+        return masks.data() + ((size_t) n_tree * depth + level) * 2 * n_words;
+    }
+
+    /**
+    * Returns the projection of the code x on the random vector of a level,
+    * doubled and offset by a constant of the level: since |x ^ m| = |x| + |m| -
+    * 2 |x & m| for the popcounts, |x ^ negative| - |x ^ positive| is
+    * 2 (|x & positive| - |x & negative|) + |negative| - |positive|, and the
+    * splits compare the projections only with each other. A sampled bit is
+    * read directly.
+    */
+    int project(const uint64_t *x, int n_tree, int level) const {
+        if (split_bits == 1) {
+            const int b = sampled_bits[(size_t) n_tree * depth + level];
+            return (x[b >> 6] >> (b & 63)) & 1;
+        }
+        const uint64_t *positive = mask(n_tree, level);
+        return hamming(x, positive + n_words, n_words) - hamming(x, positive, n_words);
+    }
+
+    /**
+    * Splits the points in [begin, end) at the median of their projections on
+    * level tree_level and recurses into both halves down to the leaves. The
+    * projections are small integers with many ties, so the points at the
+    * median all go to the side that makes the halves closer in size, and the
+    * queries routed like them are routed with them.
+    * @param i - The index of the node in the array of the tree
+    * @param projections - Scratch of n_samples ints, indexed by point
+    */
+    void grow_subtree(int *begin, int *end, int tree_level, int i, int n_tree, std::vector<int> &projections) {
+        const int n_leaves = 1 << depth;
+        if (tree_level == depth) {
+            leaf_first(i - n_leaves + 1, n_tree) = begin - leaf_ids.col(n_tree).data();
+            return;
+        }
+
+        const int n = end - begin;
+        int split = 0;
+        int *middle = begin;
+        if (n > 0) {
+            for (int *p = begin; p < end; ++p)
+                projections[*p] = project(codes + (size_t) *p * n_words, n_tree, tree_level);
+            auto by_projection = [&projections](int i1, int i2) { return projections[i1] < projections[i2]; };
+            std::nth_element(begin, begin + (n - 1) / 2, end, by_projection);
+            const int median = projections[begin[(n - 1) / 2]];
+            const int below = std::count_if(begin, end, [&](int j) { return projections[j] < median; });
+            const int at = std::count_if(begin, end, [&](int j) { return projections[j] == median; });
+            split = std::abs(2 * (below + at) - n) <= std::abs(2 * below - n) ? median : median - 1;
+            middle = std::partition(begin, end, [&](int j) { return projections[j] <= split; });
+        }
+        split_points(i, n_tree) = split;
+
+        grow_subtree(begin, middle, tree_level + 1, 2 * i + 1, n_tree, projections);
+        grow_subtree(middle, end, tree_level + 1, 2 * i + 2, n_tree, projections);
+    }
+
+    /**
+    * Queries with found as the scratch of the points of the leaves of q.
+    */
+    void query(const uint64_t *q, int k, int votes_required, int *out, float *out_distances,
+               std::vector<int> &found) const {
+        const int n_leaves = 1 << depth;
+        found.clear();
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            int idx_tree = 0;
+            for (int d = 0; d < depth; ++d)
+                idx_tree = 2 * idx_tree + (project(q, n_tree, d) <= split_points(idx_tree, n_tree) ? 1 : 2);
+            const int leaf = idx_tree - n_leaves + 1;
+            const int *ids = leaf_ids.col(n_tree).data();
+            found.insert(found.end(), ids + leaf_first(leaf, n_tree), ids + leaf_first(leaf + 1, n_tree));
+        }
+
+        // the votes of a point are the length of its run in the sorted points of the leaves
+        std::sort(found.begin(), found.end());
+        Mrpt::TopK heap(k);
+        for (size_t j = 0, run; j < found.size(); j += run) {
+            for (run = 1; j + run < found.size() && found[j + run] == found[j]; ++run) { }
+            if ((int) run >= votes_required)
+                heap.push(hamming(q, codes + (size_t) found[j] * n_words, n_words), found[j]);
+        }
+        heap.extract(out, out_distances);
+    }
+
+    const uint64_t *codes; // the codes, n_words words each
+    const int n_samples; // number of codes
+    const int bits; // number of bits of a code
+    const int n_words; // number of 64-bit words of a code
+    const int n_trees; // number of RP-trees
+    const int depth; // depth of an RP-tree
+    const int split_bits; // number of bits of the projection of a level
+    const unsigned seed; // seed of the random projections, 0 if every build is random
+    const mrpt_kernels::HammingFunction hamming; // the popcount kernel of the CPU
+    std::vector<int> sampled_bits; // the bit of each level of each tree, with bit sampling
+    std::vector<uint64_t> masks; // the positive and the negative mask of each level of each tree, otherwise
+    MatrixXi split_points; // the split points of the inner nodes of each tree, one tree per column
+    MatrixXi leaf_first; // the first position of each leaf in leaf_ids, followed by n_samples
+    MatrixXi leaf_ids; // the points of each tree in the order of its leaves
+};
+
+#endif // CPP_BINARY_MRPT_H_
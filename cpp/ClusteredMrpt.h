@@ -0,0 +1,477 @@
+#ifndef CPP_CLUSTERED_MRPT_H_
+#define CPP_CLUSTERED_MRPT_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Mrpt.h"
+
+/*
+ * A two-level index for data too large for one forest. The points are divided
+ * into clusters by k-means, and each cluster has an Mrpt index of its own over
+ * a copy of its points. A query is routed to the n_probe clusters whose
+ * centroids are nearest to it, and the k nearest neighbors found in them are
+ * merged. The trees, the vote counts and the candidates then span one cluster,
+ * so the trees stay shallow and the vote arrays small however large the data.
+ * The depth of the trees of a cluster is limited by the size of the cluster.
+ * All clusters are built with one seed, and those whose trees have the same
+ * depth share one random matrix, so a query is projected once for each depth.
+ *
+ * The points are clustered by their Euclidean distances, for COSINE after
+ * normalizing them. A query is routed by its Euclidean distances to the
+ * centroids too, except with INNER_PRODUCT by its inner products with them:
+ * clustering by inner products would put most points in the cluster of the
+ * centroid of the largest norm.
+ */
+class ClusteredMrpt {
+ public:
+    /**
+    * Creates an index over the columns of X, built with grow or loaded with load.
+    * @param X_ - The data. The points are copied into the clusters, so the data
+    * need only outlive the calls to grow and load.
+    * @param n_clusters_ - The number of clusters
+    * @param n_trees_ - The number of trees of each cluster
+    * @param depth_ - The largest depth of the trees; a cluster of n points gets trees
+    * of depth at most log2(n)
+    * @param density_ - Expected ratio of non-zero components in a projection matrix
+    * @param seed_ - The seed of k-means and of the random projections of all
+    * clusters. If 0, a random seed is drawn for the index.
+    * @param projection_ - The distribution of the components of the projection matrix
+    * @param metric_ - The similarity the nearest neighbors are searched by
+    */
+    ClusteredMrpt(const Map<const MatrixXf> *X_, int n_clusters_, int n_trees_, int depth_, float density_,
+                  unsigned seed_ = 0, Mrpt::Projection projection_ = Mrpt::GAUSSIAN,
+                  Mrpt::Metric metric_ = Mrpt::EUCLIDEAN) :
+        X(X_), n_trees(n_trees_), depth(depth_), density(density_),
+        seed(seed_ ? seed_ : std::random_device()() | 1), projection(projection_), metric(metric_),
+        centroids(X_->rows(), std::max<int64_t>(1, std::min<int64_t>(n_clusters_, X_->cols()))) { }
+
+    ClusteredMrpt(const ClusteredMrpt &) = delete;
+
+    /**
+    * Clusters the data with k-means on a sample of it, assigns every point to its
+    * nearest centroid and builds the index of each cluster. The clusters are
+    * divided between the threads, each building its clusters alone.
+    * @param memory_limit - See Mrpt::grow; the limit applies to each cluster
+    * @param n_iterations - The number of iterations of k-means
+    * @param sample_size - The number of points k-means is run on, or 0 for 256
+    * points for each cluster
+    */
+    void grow(size_t memory_limit = 0, int n_iterations = 10, int64_t sample_size = 0) {
+        kmeans(n_iterations, sample_size > 0 ? sample_size : (int64_t) 256 * n_clusters());
+        assign_points();
+        gather_points();
+
+        const int n = n_clusters();
+        #pragma omp parallel for schedule(dynamic)
+        for (int c = 0; c < n; ++c) {
+            if (clusters[c])
+                clusters[c]->grow(1, memory_limit);
+        }
+        share_random_matrices();
+    }
+
+    /**
+    * Saves the index. The centroids and the ids of the points of each cluster are
+    * written to path, and the index of cluster i to path followed by a dot and i.
+    * @return false if writing any of the files fails
+    */
+    bool save(const char *path) const {
+        FILE *fd = std::fopen(path, "wb");
+        if (!fd)
+            return false;
+        const int32_t shape[2] = {(int32_t) centroids.rows(), (int32_t) centroids.cols()};
+        bool ok = std::fwrite(shape, sizeof(shape), 1, fd) == 1 &&
+                  std::fwrite(centroids.data(), sizeof(float), centroids.size(), fd) == (size_t) centroids.size();
+        for (const std::vector<int> &ids : cluster_ids) {
+            const int64_t size = ids.size();
+            ok = ok && std::fwrite(&size, sizeof(size), 1, fd) == 1 &&
+                 std::fwrite(ids.data(), sizeof(int), size, fd) == (size_t) size;
+        }
+        ok = std::fclose(fd) == 0 && ok;
+
+        for (size_t c = 0; c < clusters.size(); ++c)
+            ok = (!clusters[c] || clusters[c]->save(cluster_path(path, c).c_str())) && ok;
+        return ok;
+    }
+
+    /**
+    * Loads an index saved by save with the same path, for the same data and the
+    * same number of clusters. The points of the clusters are copied from the data.
+    * @param map_file - See Mrpt::load
+    * @return false if loading any of the files fails
+    */
+    bool load(const char *path, bool map_file = false) {
+        FILE *fd = std::fopen(path, "rb");
+        if (!fd)
+            return false;
+        int32_t shape[2];
+        bool ok = std::fread(shape, sizeof(shape), 1, fd) == 1 && shape[0] == centroids.rows() &&
+                  shape[1] == centroids.cols() &&
+                  std::fread(centroids.data(), sizeof(float), centroids.size(), fd) == (size_t) centroids.size();
+        cluster_ids.assign(n_clusters(), std::vector<int>());
+        for (std::vector<int> &ids : cluster_ids) {
+            int64_t size;
+            ok = ok && std::fread(&size, sizeof(size), 1, fd) == 1 && size >= 0 && size <= X->cols();
+            if (!ok)
+                break;
+            ids.resize(size);
+            ok = std::fread(ids.data(), sizeof(int), size, fd) == (size_t) size &&
+                 std::all_of(ids.begin(), ids.end(), [this](int id) { return id >= 0 && id < X->cols(); });
+        }
+        std::fclose(fd);
+        if (!ok)
+            return false;
+
+        centroid_norms = centroids.colwise().squaredNorm();
+        gather_points();
+        for (size_t c = 0; c < clusters.size() && ok; ++c)
+            ok = !clusters[c] || clusters[c]->load(cluster_path(path, c).c_str(), map_file);
+        if (ok)
+            share_random_matrices();
+        return ok;
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q in the n_probe clusters whose
+    * centroids are nearest to q.
+    * @param q - The query object whose neighbors the function finds
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param n_probe - The number of clusters searched
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    */
+    void query(const Ref<const VectorXf> &q, int k, int votes_required, int n_probe, int *out,
+               float *out_distances = nullptr) const {
+        std::vector<int> probed;
+        nearest_clusters(q, n_probe, probed);
+        query_clusters(q, probed, k, votes_required, out, out_distances);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the queries stored as
+    * the columns of Q. The queries are routed with one matrix product for each
+    * block of them, and the blocks are divided between the threads.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_batch(const Map<const MatrixXf> &Q, int k, int votes_required, int n_probe, int *out,
+                     float *out_distances = nullptr) const {
+        const int n_queries = Q.cols(), block_size = 256;
+        const int n_blocks = (n_queries + block_size - 1) / block_size;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < n_blocks; ++b) {
+            const int first = b * block_size, n = std::min(block_size, n_queries - first);
+            const MatrixXf scores = centroid_scores(Q.middleCols(first, n), true);
+            std::vector<int> probed;
+            for (int i = first; i < first + n; ++i) {
+                nearest_columns(scores.col(i - first), n_probe, probed);
+                query_clusters(Q.col(i), probed, k, votes_required, out + (size_t) i * k,
+                               out_distances ? out_distances + (size_t) i * k : nullptr);
+            }
+        }
+    }
+
+    /**
+    * Returns the number of clusters.
+    */
+    int n_clusters() const {
+        return centroids.cols();
+    }
+
+    /**
+    * Returns the number of points in cluster i.
+    */
+    int64_t cluster_size(int i) const {
+        return cluster_ids[i].size();
+    }
+
+    /**
+    * Returns the index of cluster i, or nullptr if the cluster is empty, for
+    * example to change its settings with set_prefetch.
+    */
+    Mrpt *cluster(int i) {
+        return clusters[i].get();
+    }
+
+    /**
+    * Returns the centroids of the clusters as the columns of a dim x n_clusters matrix.
+    */
+    const MatrixXf &cluster_centroids() const {
+        return centroids;
+    }
+
+ private:
+    /**
+    * Runs Lloyd's k-means on an evenly spread random sample of the data. The
+    * centroids start at random points of the sample, and a centroid left
+    * without points moves to another random point of it.
+    */
+    void kmeans(int n_iterations, int64_t sample_size) {
+        const int64_t n_points = X->cols(), m = std::max<int64_t>(n_clusters(), std::min(sample_size, n_points));
+        const int dim = X->rows(), n = n_clusters();
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        MatrixXf sample(dim, m);
+        for (int64_t i = 0; i < m; ++i)
+            sample.col(i) = X->col(std::min<int64_t>(n_points - 1, (i + uniform(rng)) * n_points / m));
+        if (metric == Mrpt::COSINE)
+            sample = normalized(sample);
+
+        std::vector<int64_t> order(m);
+        for (int64_t i = 0; i < m; ++i)
+            order[i] = i;
+        std::shuffle(order.begin(), order.end(), rng);
+        for (int c = 0; c < n; ++c)
+            centroids.col(c) = sample.col(order[c]);
+        centroid_norms = centroids.colwise().squaredNorm();
+
+        std::vector<int> assignment(m);
+        std::uniform_int_distribution<int64_t> random_point(0, m - 1);
+        for (int iteration = 0; iteration < n_iterations; ++iteration) {
+            assign(sample, assignment.data());
+            MatrixXf sums = MatrixXf::Zero(dim, n);
+            std::vector<int64_t> counts(n);
+            for (int64_t i = 0; i < m; ++i) {
+                sums.col(assignment[i]) += sample.col(i);
+                ++counts[assignment[i]];
+            }
+            for (int c = 0; c < n; ++c)
+                centroids.col(c) = counts[c] ? VectorXf(sums.col(c) / counts[c])
+                                             : VectorXf(sample.col(random_point(rng)));
+            centroid_norms = centroids.colwise().squaredNorm();
+        }
+    }
+
+    /**
+    * Writes the nearest centroid of each column of points to assignment, in
+    * blocks divided between the threads.
+    */
+    void assign(const Ref<const MatrixXf> &points, int *assignment) const {
+        const int64_t n_points = points.cols(), block_size = 4096;
+        const int64_t n_blocks = (n_points + block_size - 1) / block_size;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int64_t b = 0; b < n_blocks; ++b) {
+            const int64_t first = b * block_size, n = std::min(block_size, n_points - first);
+            const MatrixXf scores = centroid_scores(points.middleCols(first, n), false);
+            for (int64_t i = 0; i < n; ++i)
+                scores.col(i).minCoeff(&assignment[first + i]);
+        }
+    }
+
+    /**
+    * Divides the ids of all points between the clusters of their nearest centroids.
+    */
+    void assign_points() {
+        const int64_t n_points = X->cols(), block_size = (int64_t) 1 << 20;
+        std::vector<int> assignment(n_points);
+        for (int64_t first = 0; first < n_points; first += block_size) {
+            const int64_t n = std::min(block_size, n_points - first);
+            if (metric == Mrpt::COSINE)
+                assign(normalized(X->middleCols(first, n)), assignment.data() + first);
+            else
+                assign(X->middleCols(first, n), assignment.data() + first);
+        }
+
+        std::vector<int64_t> counts(n_clusters());
+        for (int c : assignment)
+            ++counts[c];
+        cluster_ids.assign(n_clusters(), std::vector<int>());
+        for (int c = 0; c < n_clusters(); ++c)
+            cluster_ids[c].reserve(counts[c]);
+        for (int64_t i = 0; i < n_points; ++i)
+            cluster_ids[assignment[i]].push_back(i);
+    }
+
+    /**
+    * Copies the points of each cluster, listed in cluster_ids, into a matrix of
+    * its own and creates its index.
+    */
+    void gather_points() {
+        const int n = n_clusters();
+        clusters.clear();
+        clusters.resize(n);
+        cluster_data.clear();
+        cluster_data.resize(n);
+        cluster_points.clear();
+        cluster_points.resize(n);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int c = 0; c < n; ++c) {
+            const std::vector<int> &ids = cluster_ids[c];
+            if (ids.empty())
+                continue;
+            cluster_points[c].reset(new MatrixXf(X->rows(), ids.size()));
+            for (size_t i = 0; i < ids.size(); ++i)
+                cluster_points[c]->col(i) = X->col(ids[i]);
+            cluster_data[c].reset(new Map<const MatrixXf>(cluster_points[c]->data(), X->rows(), ids.size()));
+            clusters[c].reset(new Mrpt(cluster_data[c].get(), n_trees, cluster_depth(ids.size()), density, seed,
+                                       projection, metric));
+        }
+    }
+
+    /**
+    * Returns the depth of the trees of a cluster of n points.
+    */
+    int cluster_depth(int64_t n) const {
+        int limit = 0;
+        while (limit < depth && ((int64_t) 2 << limit) <= n)
+            ++limit;
+        return limit;
+    }
+
+    /**
+    * Lets each cluster use the random matrix of the first cluster with trees of
+    * the same depth.
+    */
+    void share_random_matrices() {
+        std::map<int, int> first_of_depth;
+        matrix_source.assign(n_clusters(), -1);
+        for (int c = 0; c < n_clusters(); ++c) {
+            if (!clusters[c])
+                continue;
+            const int d = cluster_depth(cluster_ids[c].size());
+            const auto first = first_of_depth.emplace(d, c).first;
+            matrix_source[c] = first->second == c || clusters[c]->share_random_matrix(*clusters[first->second])
+                               ? first->second : c;
+        }
+    }
+
+    /**
+    * Returns the scores of the columns of Q against the centroids as an
+    * n_clusters x Q.cols() matrix, the lowest for the nearest centroid: the
+    * squared Euclidean distance less the squared norm of the column, and for
+    * INNER_PRODUCT queries the negated inner product. The columns are points
+    * that have been normalized for COSINE, or queries if routing is set.
+    */
+    MatrixXf centroid_scores(const Ref<const MatrixXf> &Q, bool routing) const {
+        const MatrixXf products = centroids.transpose() *
+            (routing && metric == Mrpt::COSINE ? normalized(Q) : MatrixXf(Q));
+        if (routing && metric == Mrpt::INNER_PRODUCT)
+            return -products;
+        return (-2 * products).colwise() + centroid_norms.transpose();
+    }
+
+    void nearest_clusters(const Ref<const VectorXf> &q, int n_probe, std::vector<int> &probed) const {
+        const MatrixXf scores = centroid_scores(q, true);
+        nearest_columns(scores.col(0), n_probe, probed);
+    }
+
+    /**
+    * Writes the n_probe clusters of the lowest scores, empty ones excluded, to probed.
+    */
+    void nearest_columns(const Ref<const VectorXf> &scores, int n_probe, std::vector<int> &probed) const {
+        std::vector<std::pair<float, int>> order;
+        order.reserve(n_clusters());
+        for (int c = 0; c < n_clusters(); ++c) {
+            if (clusters[c])
+                order.emplace_back(scores(c), c);
+        }
+        const int n = std::max(0, std::min<int>(n_probe, order.size()));
+        std::partial_sort(order.begin(), order.begin() + n, order.end());
+        probed.resize(n);
+        for (int i = 0; i < n; ++i)
+            probed[i] = order[i].second;
+    }
+
+    /**
+    * Queries the clusters in probed and merges the k nearest neighbors found in
+    * them into out. The projections of q are computed once for each random
+    * matrix and routed in all the clusters sharing it.
+    */
+    void query_clusters(const Ref<const VectorXf> &q, const std::vector<int> &probed, int k, int votes_required,
+                        int *out, float *out_distances) const {
+        const int n = probed.size();
+        std::vector<int> ids((size_t) n * k);
+        std::vector<float> distances((size_t) n * k);
+        std::vector<std::pair<int, VectorXf>> projections;
+        for (int i = 0; i < n; ++i) {
+            const int c = probed[i], source = matrix_source[c];
+            auto projected = std::find_if(projections.begin(), projections.end(),
+                                          [source](const std::pair<int, VectorXf> &p) { return p.first == source; });
+            if (projected == projections.end()) {
+                projections.emplace_back(source, clusters[source]->project_query(q));
+                projected = projections.end() - 1;
+            }
+            int *cluster_out = ids.data() + (size_t) i * k;
+            clusters[c]->query_projected(q, projected->second.data(), k, votes_required, cluster_out,
+                                         distances.data() + (size_t) i * k);
+            for (int j = 0; j < k; ++j)
+                cluster_out[j] = cluster_out[j] >= 0 ? cluster_ids[c][cluster_out[j]] : -1;
+        }
+        merge(ids.data(), distances.data(), n, k, out, out_distances);
+    }
+
+    /**
+    * Merges the k nearest neighbors found in n clusters, laid out one cluster
+    * after another in ids and distances, into the k nearest neighbors of all of
+    * them. If fewer than k neighbors were found, the remaining output slots are
+    * set to -1. The similarities of the INNER_PRODUCT and COSINE metrics are
+    * merged the largest first.
+    */
+    void merge(const int *ids, const float *distances, int n, int k, int *out, float *out_distances) const {
+        std::vector<std::pair<float, int>> candidates;
+        for (size_t i = 0; i < (size_t) n * k; ++i) {
+            if (ids[i] >= 0)
+                candidates.emplace_back(distances[i], ids[i]);
+        }
+
+        const int n_found = std::min<int>(k, candidates.size());
+        if (metric == Mrpt::EUCLIDEAN)
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end());
+        else
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end(),
+                              std::greater<std::pair<float, int>>());
+        for (int j = 0; j < k; ++j) {
+            out[j] = j < n_found ? candidates[j].second : -1;
+            if (out_distances)
+                out_distances[j] = j < n_found ? candidates[j].first : -1;
+        }
+    }
+
+    /**
+    * Returns the columns of A scaled to unit norm, the zero columns as they are.
+    */
+    static MatrixXf normalized(const Ref<const MatrixXf> &A) {
+        MatrixXf B = A;
+        for (Index i = 0; i < B.cols(); ++i) {
+            const float norm = B.col(i).norm();
+            if (norm > 0)
+                B.col(i) /= norm;
+        }
+        return B;
+    }
+
+    static std::string cluster_path(const char *path, size_t i) {
+        return std::string(path) + "." + std::to_string(i);
+    }
+
+    const Map<const MatrixXf> *X; // the data, used by grow and load only
+    const int n_trees, depth;
+    const float density;
+    const unsigned seed; // the seed of k-means and of the random matrices of all clusters
+    const Mrpt::Projection projection;
+    const Mrpt::Metric metric;
+    MatrixXf centroids; // dim x n_clusters
+    RowVectorXf centroid_norms; // the squared norms of the centroids
+    std::vector<std::vector<int>> cluster_ids; // the ids of the points of each cluster, in the order of its index
+    std::vector<std::unique_ptr<MatrixXf>> cluster_points; // the copies of the points of the clusters
+    std::vector<std::unique_ptr<Map<const MatrixXf>>> cluster_data; // the maps the indexes of the clusters hold
+    std::vector<std::unique_ptr<Mrpt>> clusters; // the index of each cluster, nullptr for an empty cluster
+    std::vector<int> matrix_source; // the cluster whose random matrix each cluster uses
+};
+
+#endif // CPP_CLUSTERED_MRPT_H_
@@ -1,526 +1,12130 @@
-#ifndef CPP_MRPT_H_
-#define CPP_MRPT_H_
-
-#include <algorithm>
-#include <functional>
-#include <numeric>
-#include <random>
-#include <string>
-#include <vector>
-#include <cmath>
-#include <iostream>
-#include <map>
-#include <mutex>
-
-#include <Eigen/Dense>
-#include <Eigen/SparseCore>
-
-using namespace Eigen;
-
-class Mrpt {
- public:
-    /**
-    * The constructor of the index. The inputs are the data for which the index
-    * will be built and additional parameters that affect the accuracy of the NN
-    * approximation. Concisely, larger n_trees_ or smaller depth values improve
-    * accuracy but slow down the queries. A general rule for the right balance is
-    * not known. The constructor does not actually build the trees, but that is
-    * done by a separate function 'grow' that has to be called before queries can
-    * be made.
-    * @param X_ - Pointer to a matrix containing the data.
-    * @param n_trees_ - The number of trees to be used in the index.
-    * @param depth_ - The depth of the trees.
-    * @param density_ - Expected ratio of non-zero components in a projection matrix.
-    */
-    Mrpt(Map<const MatrixXf> *X_, int n_trees_, int depth_, float density_) :
-        X(X_),
-        n_samples(X_->cols()),
-        dim(X_->rows()),
-        n_trees(n_trees_),
-        depth(depth_),
-        density(density_),
-        n_pool(n_trees_ * depth_),
-        n_array(1 << (depth_ + 1))
-    { }
-
-    ~Mrpt() {}
-
-    /**
-    * The function whose call starts the actual index construction. Initializes
-    * arrays to store the tree structures and computes all the projections needed
-    * later. Then repeatedly calls method grow_subtree that builds a single RP-tree.
-    */
-    void grow(int keep_data) {
-        // generate the random matrix
-        density < 1 ? build_sparse_random_matrix() : build_dense_random_matrix();
-
-        split_points = MatrixXf(n_array, n_trees);
-        VectorXi indices(n_samples);
-        std::iota(indices.data(), indices.data() + n_samples, 0);
-
-        tree_leaves = std::vector<std::vector<VectorXi>>(n_trees);
-
-        #pragma omp parallel for
-        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
-            std::cout<<"Building tree "<<n_tree<<"\n";
-            MatrixXf tree_projections;
-
-            if (density < 1)
-                tree_projections.noalias() = sparse_random_matrix.middleRows(n_tree * depth, depth) * *X;
-            else
-                tree_projections.noalias() = dense_random_matrix.middleRows(n_tree * depth, depth) * *X;
-
-            std::vector<VectorXi> t = grow_subtree(indices, 0, 0, n_tree, tree_projections);
-            tree_leaves[n_tree] = t;
-        }
-
-        if(!keep_data) {
-        	X->resize(0,0);
-    	}
-    }
-
-    /**
-    * This function finds the k approximate nearest neighbors of the query object
-    * q from a set of candidate leaves. The accuracy of the query depends on both the parameters used for index
-    * construction and additional parameters given to this function. This
-    * function implements two tricks to improve performance. The voting trick
-    * interprets each index object in leaves returned by tree traversals as votes,
-    * and only performs the final linear search with the 'elect' most voted
-    * objects.
-    * @param q - The query object whose neighbors the function finds
-    * @param k - The number of neighbors the user wants the function to return
-    * @param votes_required - The number of votes required for an object to be included in the linear search step
-    * @param out - The output buffer for the indices of the k approximate nearest neighbors
-    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
-    * @param leaves - Array containing candidate leaves
-    * @param num_leaves - Size of the array containing candidate leaves
-    * @return
-    */
-    void query_from_leaves(const Map<VectorXf> &q, const int *leaves, int num_leaves, int k, 
-        int votes_required, int *out, float *out_distances = nullptr) const {
-
-        int n_elected = 0, max_leaf_size = n_samples / (1 << depth) + 1;
-        VectorXi elected(n_trees * max_leaf_size);
-        VectorXi votes = VectorXi::Zero(n_samples);
-
-        // count votes
-        for (int i=0;i<num_leaves;++i, ++leaves) {
-            if (++votes(*leaves) == votes_required) {
-                elected(n_elected++) = *leaves;
-            }
-        }
-
-        if (n_elected < k) {
-            /*
-            * If not enough samples had at least votes_required
-            * votes, find the maximum amount of votes needed such
-            * that the final search set size has at least k samples
-            */
-            VectorXf::Index max_index;
-            votes.maxCoeff(&max_index);
-            int max_votes = votes(max_index);
-
-            VectorXi vote_count = VectorXi::Zero(max_votes + 1);
-            for (int i = 0; i < n_samples; ++i)
-                vote_count(votes(i))++;
-
-            for (int would_elect = 0; max_votes; --max_votes) {
-                would_elect += vote_count(max_votes);
-                if (would_elect >= k) break;
-            }
-
-            for (int i = 0; i < n_samples; ++i) {
-                if (votes(i) >= max_votes && votes(i) < votes_required)
-                    elected(n_elected++) = i;
-            }
-        }
-
-        exact_knn(q, k, elected, n_elected, out, out_distances);
-    }
-
-    /**
-    * This function finds the dimensions corresponding to a leaf index.
-    * @param leaf_index - Index of the leaf whose coordinates are to be found
-    * @param coordinates - Pointer to array containing all the dimensions
-    */
-    void get_leaf_info(int leaf_index, float* coordinates) {
-        std::vector<float> v(X->col(leaf_index).data(), X->col(leaf_index).data() + X->col(leaf_index).size());
-        int index=0;
-        for(auto &x : v) {
-            coordinates[index++] = x;
-        }
-    }
-
-    void filter_leaves_by_votes(const int *leaves, int num_leaves,std::vector<int> *voted_leaves, int votes_required) const {
-        VectorXi votes = VectorXi::Zero(n_samples);   
-        for(int i=0;i<num_leaves;i++) {
-            if(++votes(leaves[i]) == votes_required){
-                voted_leaves->push_back(leaves[i]);
-            }
-        }
-    }
-
-    /**
-    * This function finds all the leaves that correspond to a query q.
-    * @param q - The query object whose leaves are to be returned
-    * @param leaf_indices - The vector that will contain the leaf indices on returning
-    */
-    void get_leaf_indices(const Map<VectorXf> &q, std::vector<int> *leaf_indices) const {
-        VectorXi found_leaves = find_leaves(q); 
-        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
-            const VectorXi &idx_one_tree = tree_leaves[n_tree][found_leaves(n_tree)];
-            const int nn = idx_one_tree.size(), *data = idx_one_tree.data();
-            for (int i = 0; i < nn; ++i, ++data) {
-                leaf_indices->push_back(*data);
-            }
-        }
-    }
-
-    VectorXi find_leaves(const Map<VectorXf> &q) const {
-        VectorXf projected_query(n_pool);
-        if (density < 1)
-            projected_query.noalias() = sparse_random_matrix * q;
-        else
-            projected_query.noalias() = dense_random_matrix * q;
-
-        VectorXi found_leaves(n_trees);
-
-        /*
-        * The following loops over all trees, and routes the query to exactly one
-        * leaf in each.
-        */
-        #pragma omp parallel for
-        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
-            int idx_tree = 0;
-            for (int d = 0; d < depth; ++d) {
-                const int j = n_tree * depth + d;
-                const int idx_left = 2 * idx_tree + 1;
-                const int idx_right = idx_left + 1;
-                const float split_point = split_points(idx_tree, n_tree);
-                if (projected_query(j) <= split_point) {
-                    idx_tree = idx_left;
-                } else {
-                    idx_tree = idx_right;
-                }
-            }
-            found_leaves(n_tree) = idx_tree - (1 << depth) + 1;
-        }
-
-        return found_leaves;
-    }
-
-    /**
-    * This function finds the k approximate nearest neighbors of the query object
-    * q. The accuracy of the query depends on both the parameters used for index
-    * construction and additional parameters given to this function. This
-    * function implements two tricks to improve performance. The voting trick
-    * interprets each index object in leaves returned by tree traversals as votes,
-    * and only performs the final linear search with the 'elect' most voted
-    * objects.
-    * @param q - The query object whose neighbors the function finds
-    * @param k - The number of neighbors the user wants the function to return
-    * @param votes_required - The number of votes required for an object to be included in the linear search step
-    * @param out - The output buffer for the indices of the k approximate nearest neighbors
-    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
-    * @return
-    */
-    void query(const Map<VectorXf> &q, int k, int votes_required, int *out, float *out_distances = nullptr) const {
-        VectorXi found_leaves = find_leaves(q);
-        
-        int n_elected = 0, max_leaf_size = n_samples / (1 << depth) + 1;
-        VectorXi elected(n_trees * max_leaf_size);
-        VectorXi votes = VectorXi::Zero(n_samples);
-
-        // count votes
-        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
-            const VectorXi &idx_one_tree = tree_leaves[n_tree][found_leaves(n_tree)];
-            const int nn = idx_one_tree.size(), *data = idx_one_tree.data();
-            for (int i = 0; i < nn; ++i, ++data) {
-                if (++votes(*data) == votes_required) {
-                    elected(n_elected++) = *data;
-                }
-            }
-        }
-
-        if (n_elected < k) {
-            /*
-            * If not enough samples had at least votes_required
-            * votes, find the maximum amount of votes needed such
-            * that the final search set size has at least k samples
-            */
-            VectorXf::Index max_index;
-            votes.maxCoeff(&max_index);
-            int max_votes = votes(max_index);
-
-            VectorXi vote_count = VectorXi::Zero(max_votes + 1);
-            for (int i = 0; i < n_samples; ++i)
-                vote_count(votes(i))++;
-
-            for (int would_elect = 0; max_votes; --max_votes) {
-                would_elect += vote_count(max_votes);
-                if (would_elect >= k) break;
-            }
-
-            for (int i = 0; i < n_samples; ++i) {
-                if (votes(i) >= max_votes && votes(i) < votes_required)
-                    elected(n_elected++) = i;
-            }
-        }
-
-        exact_knn(q, k, elected, n_elected, out, out_distances);
-
-    }
-
-    /**
-    * find k nearest neighbors from data for the query point
-    * @param q - query point as a vector
-    * @param k - number of neighbors searched for
-    * @param indices - indices of the points in the original matrix where the search is made
-    * @param out - output buffer for the indices of the k approximate nearest neighbors
-    * @param out_distances - output buffer for distances of the k approximate nearest neighbors (optional parameter)
-    * @return
-    */
-    void exact_knn(const Map<VectorXf> &q, int k, const VectorXi &indices, int n_elected, int *out, float *out_distances = nullptr) const {
-        VectorXf distances(n_elected);
-
-        #pragma omp parallel for
-        for (int i = 0; i < n_elected; ++i)
-            distances(i) = (X->col(indices(i)) - q).squaredNorm();
-
-        if (k == 1) {
-            MatrixXf::Index index;
-            distances.minCoeff(&index);
-            out[0] = indices(index);
-            return;
-        }
-
-        VectorXi idx(n_elected);
-        std::iota(idx.data(), idx.data() + n_elected, 0);
-        std::partial_sort(idx.data(), idx.data() + k, idx.data() + n_elected,
-                         [&distances](int i1, int i2) {return distances(i1) < distances(i2);});
-
-        for (int i = 0; i < k; ++i) out[i] = indices(idx(i));
-
-        if(out_distances) {
-          std::partial_sort(distances.data(), distances.data() + k, distances.data() + n_elected);
-          for(int i = 0; i < k; ++i) out_distances[i] = std::sqrt(distances(i));
-        }
-    }
-
-    /**
-    * Saves the index to a file.
-    * @param path - Filepath to the output file.
-    * @return True if saving succeeded, false otherwise.
-    */
-    bool save(const char *path) const {
-        FILE *fd;
-        if ((fd = fopen(path, "wb")) == NULL)
-            return false;
-
-        fwrite(split_points.data(), sizeof(float), n_array * n_trees, fd);
-
-        // save tree leaves
-        for (int i = 0; i < n_trees; ++i) {
-            int sz = tree_leaves[i].size();
-            fwrite(&sz, sizeof(int), 1, fd);
-            for (int j = 0; j < sz; ++j) {
-                int lsz = tree_leaves[i][j].size();
-                fwrite(&lsz, sizeof(int), 1, fd);
-                fwrite(tree_leaves[i][j].data(), sizeof(int), lsz, fd);
-            }
-        }
-
-        // save random matrix
-        if (density < 1) {
-            int non_zeros = sparse_random_matrix.nonZeros();
-            fwrite(&non_zeros, sizeof(int), 1, fd);
-            for (int k = 0; k < sparse_random_matrix.outerSize(); ++k) {
-                for (SparseMatrix<float, RowMajor>::InnerIterator it(sparse_random_matrix, k); it; ++it) {
-                    float val = it.value();
-                    int row = it.row(), col = it.col();
-                    fwrite(&row, sizeof(int), 1, fd);
-                    fwrite(&col, sizeof(int), 1, fd);
-                    fwrite(&val, sizeof(float), 1, fd);
-                }
-            }
-        } else {
-            fwrite(dense_random_matrix.data(), sizeof(float), n_pool * dim, fd);
-        }
-
-        fclose(fd);
-        return true;
-    }
-
-    /**
-    * Loads the index from a file.
-    * @param path - Filepath to the index file.
-    * @return True if loading succeeded, false otherwise.
-    */
-    bool load(const char *path) {
-        FILE *fd;
-        if ((fd = fopen(path, "rb")) == NULL)
-            return false;
-
-        split_points = MatrixXf(n_array, n_trees);
-        fread(split_points.data(), sizeof(float), n_array * n_trees, fd);
-
-        // load tree leaves
-        tree_leaves = std::vector<std::vector<VectorXi>>(n_trees);
-        for (int i = 0; i < n_trees; ++i) {
-            int sz;
-            fread(&sz, sizeof(int), 1, fd);
-            std::vector<VectorXi> leaves(sz);
-            for (int j = 0; j < sz; ++j) {
-                int leaf_size;
-                fread(&leaf_size, sizeof(int), 1, fd);
-                VectorXi samples(leaf_size);
-                fread(samples.data(), sizeof(int), leaf_size, fd);
-                leaves[j] = samples;
-            }
-            tree_leaves[i] = leaves;
-        }
-
-        // load random matrix
-        if (density < 1) {
-            int non_zeros;
-            fread(&non_zeros, sizeof(int), 1, fd);
-
-            sparse_random_matrix = SparseMatrix<float>(n_pool, dim);
-            std::vector<Triplet<float>> triplets;
-            for (int k = 0; k < non_zeros; ++k) {
-                int row, col;
-                float val;
-                fread(&row, sizeof(int), 1, fd);
-                fread(&col, sizeof(int), 1, fd);
-                fread(&val, sizeof(float), 1, fd);
-                triplets.push_back(Triplet<float>(row, col, val));
-            }
-
-            sparse_random_matrix.setFromTriplets(triplets.begin(), triplets.end());
-            sparse_random_matrix.makeCompressed();
-        } else {
-            dense_random_matrix = Matrix<float, Dynamic, Dynamic, RowMajor>(n_pool, dim);
-            fread(dense_random_matrix.data(), sizeof(float), n_pool * dim, fd);
-        }
-
-        fclose(fd);
-        return true;
-    }
-
- private:
-    /**
-    * Builds a single random projection tree. The tree is constructed by recursively
-    * projecting the data on a random vector and splitting into two by the median.
-    * @param indices - The indices left in this branch
-    * @param tree_level - The level in tree where the recursion is at
-    * @param i - The index within the tree where we are at
-    * @param n_tree - The index of the tree within the index
-    * @param tree_projections - Precalculated projection values for the current tree
-    * @return The leaves as a vector of VectorXis
-    */
-    std::vector<VectorXi> grow_subtree(const VectorXi &indices, int tree_level, int i, int n_tree, const MatrixXf &tree_projections) {
-        int n = indices.size();
-        int idx_left = 2 * i + 1;
-        int idx_right = idx_left + 1;
-
-        if (tree_level == depth) {
-            std::vector<VectorXi> v;
-            v.push_back(indices);
-            return v;
-        }
-
-        VectorXf projections(n);
-        for (int i = 0; i < n; ++i)
-            projections(i) = tree_projections(tree_level, indices(i));
-
-        // sort indices of the projections based on their values
-        VectorXi ordered(n);
-        std::iota(ordered.data(), ordered.data() + n, 0);
-        std::sort(ordered.data(), ordered.data() + ordered.size(),
-                [&projections](int i1, int i2) {return projections(i1) < projections(i2);});
-
-        int split_point = (n % 2) ? n / 2 : n / 2 - 1; // median split
-        int idx_split_point = ordered(split_point);
-        int idx_split_point2 = ordered(split_point + 1);
-
-        split_points(i, n_tree) = (n % 2) ? projections(idx_split_point) :
-                                  (projections(idx_split_point) + projections(idx_split_point2)) / 2;
-        VectorXi left_indices = ordered.head(split_point + 1);
-        VectorXi right_indices = ordered.tail(n - split_point - 1);
-
-        VectorXi left_elems = VectorXi(left_indices.size());
-        VectorXi right_elems = VectorXi(right_indices.size());
-
-        for (int i = 0; i < left_indices.size(); ++i)
-            left_elems(i) = indices(left_indices(i));
-        for (int i = 0; i < right_indices.size(); ++i)
-            right_elems(i) = indices(right_indices(i));
-
-        std::vector<VectorXi> v = grow_subtree(left_elems, tree_level + 1, idx_left, n_tree, tree_projections);
-        std::vector<VectorXi> w = grow_subtree(right_elems, tree_level + 1, idx_right, n_tree, tree_projections);
-        v.insert(v.end(), w.begin(), w.end());
-        return v;
-    }
-
-    /**
-    * Builds a random sparse matrix for use in random projection. The components of
-    * the matrix are drawn from the distribution
-    *
-    *       0 w.p. 1 - a
-    * N(0, 1) w.p. a
-    *
-    * where a = density.
-    */
-    void build_sparse_random_matrix() {
-        sparse_random_matrix = SparseMatrix<float, RowMajor>(n_pool, dim);
-
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_real_distribution<float> uni_dist(0, 1);
-        std::normal_distribution<float> norm_dist(0, 1);
-
-        std::vector<Triplet<float>> triplets;
-        for (int j = 0; j < n_pool; ++j) {
-            for (int i = 0; i < dim; ++i) {
-                if (uni_dist(gen) > density) continue;
-                triplets.push_back(Triplet<float>(j, i, norm_dist(gen)));
-            }
-        }
-
-        sparse_random_matrix.setFromTriplets(triplets.begin(), triplets.end());
-        sparse_random_matrix.makeCompressed();
-    }
-
-    /*
-    * Builds a random dense matrix for use in random projection. The components of
-    * the matrix are drawn from the standard normal distribution.
-    */
-    void build_dense_random_matrix() {
-        dense_random_matrix = Matrix<float, Dynamic, Dynamic, RowMajor>(n_pool, dim);
-
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::normal_distribution<float> normal_dist(0, 1);
-
-        std::generate(dense_random_matrix.data(), dense_random_matrix.data() + n_pool * dim,
-                      [&normal_dist, &gen] { return normal_dist(gen); });
-    }
-
-    Map<const MatrixXf> *X; // the data matrix
-    MatrixXf split_points; // all split points in all trees
-    std::vector<std::vector<VectorXi>> tree_leaves; // contains all leaves of all trees,
-                                                    // indexed as tree_leaves[tree number][leaf number][index in leaf]
-    Matrix<float, Dynamic, Dynamic, RowMajor> dense_random_matrix; // random vectors needed for all the RP-trees
-    SparseMatrix<float, RowMajor> sparse_random_matrix; // random vectors needed for all the RP-trees
-
-    const int n_samples; // sample size of data
-    const int dim; // dimension of data
-    const int n_trees; // number of RP-trees
-    const int depth; // depth of an RP-tree with median split
-    const float density; // expected ratio of non-zero components in a projection matrix
-    const int n_pool; // amount of random vectors needed for all the RP-trees
-    const int n_array; // length of the one RP-tree as array
-};
-
-#endif // CPP_MRPT_H_
-
+#ifndef CPP_MRPT_H_
+#define CPP_MRPT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <Eigen/Dense>
+#include <Eigen/SparseCore>
+
+#include "mrpt_compress.h"
+#include "mrpt_data.h"
+#include "mrpt_executor.h"
+#include "mrpt_kernels.h"
+#include "mrpt_metrics.h"
+#include "mrpt_mmap.h"
+#include "mrpt_trace.h"
+
+using namespace Eigen;
+
+class Mrpt {
+ public:
+    /**
+    * The distributions the components of the random projections are drawn from.
+    * RADEMACHER components are +-1, hashed from the seed of the build and their
+    * position, so the index files store the seed instead of the random matrix.
+    * Sparse RADEMACHER projections keep the columns of the +1 and of the -1
+    * components of each row apart, and project by adding and subtracting the
+    * gathered components of a point, without multiplications.
+    * HADAMARD projections are the structured fast Johnson-Lindenstrauss transform:
+    * random sign flips followed by a Walsh-Hadamard transform and a random subset
+    * of its outputs. A single query is then projected in O(dim log dim) time per
+    * block of dim projections. They are always dense and also stored as their seed.
+    */
+    enum Projection {
+        GAUSSIAN,
+        RADEMACHER,
+        HADAMARD
+    };
+
+    /**
+    * The copies of the data the linear search of the queries can score the
+    * candidates against before re-ranking the nearest of them with the data
+    * itself. INT8 codes each component with 8 bits, in 256 steps between the
+    * smallest and the largest value of that dimension in the data. FLOAT16 keeps
+    * the components as half precision floats. PQ is product quantization: the
+    * dimensions are split into subspaces, k-means finds 256 centroids for each
+    * subspace, and a vector is coded with one byte per subspace, the centroid
+    * nearest to it in the subspace. A query is scored against the codes with a
+    * table of its distances to all centroids. BINARY keeps a bit per random
+    * vector of the trees, whether the projection of the point onto it is above
+    * the median projection of the data, and scores a query by the number of
+    * bits in which its code differs, a cheap first stage only: its scores are
+    * not distances, so the shortlist is always re-ranked with the data. PCA
+    * keeps the projections of the points onto the principal components of the
+    * data, the directions of its largest variance, and scores a query by the
+    * distances between the projections, which leave out only the variance of
+    * the data in the other directions.
+    */
+    enum Quantization {
+        FLOAT32,
+        INT8,
+        FLOAT16,
+        PQ,
+        BINARY,
+        PCA
+    };
+
+    /**
+    * The similarity the nearest neighbors are searched by. EUCLIDEAN finds the
+    * points with the smallest Euclidean distances to the query. INNER_PRODUCT
+    * finds the points with the largest inner products with the query: the trees
+    * split the data scaled into the unit ball and given an extra dimension that
+    * brings every point onto the unit sphere, where the largest inner products
+    * are the smallest distances. COSINE finds the points with the largest cosine
+    * similarities, and the trees split the normalized data. The queries are
+    * normalized for both. The distances returned for these metrics are the inner
+    * products or cosine similarities, the largest first.
+    */
+    enum Metric {
+        EUCLIDEAN,
+        INNER_PRODUCT,
+        COSINE
+    };
+
+    /**
+    * How query_set ranks a candidate by its distances to the vectors of the set:
+    * by the distance to the nearest of them, or by the mean of the distances.
+    */
+    enum SetAggregation {
+        MIN_DISTANCE,
+        MEAN_DISTANCE
+    };
+
+    /**
+    * A bounded max-heap keeping the k (distance, index) pairs with the smallest
+    * distances among all pairs pushed into it.
+    */
+    class TopK {
+     public:
+        explicit TopK(int k_ = 0) {
+            reset(k_);
+        }
+
+        /**
+        * Empties the heap and sets its capacity to k_.
+        */
+        void reset(int k_) {
+            k = k_;
+            heap.clear();
+            heap.reserve(k);
+        }
+
+        /**
+        * Returns the number of pairs the heap keeps.
+        */
+        int capacity() const {
+            return k;
+        }
+
+        /**
+        * Returns the distance a new pair has to beat to enter the heap.
+        */
+        float threshold() const {
+            return static_cast<int>(heap.size()) < k ? std::numeric_limits<float>::infinity() : heap.front().first;
+        }
+
+        void push(float distance, int index) {
+            if (static_cast<int>(heap.size()) < k) {
+                heap.emplace_back(distance, index);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (distance < heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = std::make_pair(distance, index);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+
+        /**
+        * Returns the pairs in the heap, in the order of the heap.
+        */
+        const std::vector<std::pair<float, int>> &items() const {
+            return heap;
+        }
+
+        /**
+        * Returns whether a pair with the given index is in the heap.
+        */
+        bool contains(int index) const {
+            for (const std::pair<float, int> &p : heap)
+                if (p.second == index) return true;
+            return false;
+        }
+
+        /**
+        * Writes the pairs in ascending order of distance to the output buffers
+        * and empties the heap. If the heap holds less than k pairs, the
+        * remaining output slots are set to -1.
+        * @return The number of pairs written
+        */
+        int extract(int *out, float *out_distances) {
+            std::sort_heap(heap.begin(), heap.end());
+            const int n = heap.size();
+            for (int i = 0; i < n; ++i) {
+                out[i] = heap[i].second;
+                if (out_distances) out_distances[i] = heap[i].first;
+            }
+            std::fill(out + n, out + k, -1);
+            if (out_distances) std::fill(out_distances + n, out_distances + k, -1);
+            heap.clear();
+            return n;
+        }
+
+     private:
+        int k;
+        std::vector<std::pair<float, int>> heap;
+    };
+
+    /**
+    * A configuration of the index and the queries found by autotune, with the
+    * estimated recall and query time of the queries made with it.
+    */
+    struct Parameters {
+        int n_trees; // number of trees used
+        int depth; // depth of the trees
+        int votes; // votes_required of the queries
+        double estimated_qtime; // estimated time of one query in seconds
+        double estimated_recall; // estimated average recall of the k nearest neighbors
+    };
+
+    /**
+    * The bytes of memory the parts of an index take, reported by memory_usage
+    * or predicted by estimate_memory. The vectors are counted with their spare
+    * capacity and the std::vector objects themselves.
+    */
+    struct MemoryUsage {
+        uint64_t data = 0; // the data matrix the index was given, which its caller owns
+        uint64_t mapped_data = 0; // the data file the index owns mapped, see Data::adopt and set_data_file
+        uint64_t owned_data = 0; // the data the index owns: given, inserted, reordered, norms, the
+                                 // leading dimensions of set_leading_dimensions and the labels of set_labels
+        uint64_t quantized_data = 0; // the codes of set_quantization and their tables
+        uint64_t split_points = 0; // the split points of the trees
+        uint64_t leaves = 0; // the leaf offsets and ids, the lists of inserted points, the deleted points,
+                             // the leaf bounds of set_leaf_bounds and the duplicates of collapse_duplicates
+        uint64_t random_matrix = 0; // the random vectors, also if shared with other indexes
+        uint64_t graph = 0; // the k-nearest-neighbor graph of set_graph
+        uint64_t mapped_index = 0; // the part of split_points, leaves and random_matrix read from a mapped file
+        uint64_t far_memory = 0; // the part of leaves and owned_data in far memory, see MemoryTiers
+        uint64_t scratch = 0; // the working memory of a query, one of which every querying thread keeps
+        uint64_t build_peak = 0; // the most memory grow uses at once besides the data, by estimate_memory only
+
+        /**
+        * Returns the bytes of the index itself, without the data of the caller
+        * and the working memory of the queries.
+        */
+        uint64_t index_bytes() const {
+            return owned_data + quantized_data + split_points + leaves + random_matrix + graph;
+        }
+    };
+
+    /**
+    * The shape of the trees of an index, reported by stats, for finding the
+    * degenerate trees whose large leaves blow up the candidates of the queries.
+    * The leaves count the inserted points and the deleted points not yet
+    * compacted away. The margins are those of set_margin_votes, the smallest
+    * distance between a projection of a point and a split point on its way
+    * down a tree, of a sample of the data, and are empty without the data.
+    */
+    struct IndexStats {
+        MatrixXi leaf_histogram; // n_trees x (depth + 2): the leaves of each tree by size, column 0 for the
+                                 // empty leaves and column b > 0 for the sizes in [2^(b - 1), 2^b), the last
+                                 // column also for all larger sizes
+        VectorXi max_leaf_size; // the largest leaf of each tree
+        VectorXf imbalance; // the largest leaf of each tree over the leaf size of a balanced tree; a tree
+                            // split by heavily tied projections has leaves much larger than balanced
+        VectorXf expected_leaf_size; // the mean size of the leaf of a point of each tree, which the
+                                     // candidates of the queries grow with
+        VectorXf median_margin; // the median margin of each tree; a tree with tiny margins splits
+                                // dense clusters and sends their neighbors to different leaves
+        std::vector<float> margin_quantiles; // the 10th, 25th, 50th, 75th and 90th percentiles of
+                                             // the margins of all trees
+        MatrixXf leaf_overlap; // n_trees x n_trees: the mean Jaccard similarity of the leaves of a
+                               // sampled point in two trees; correlated trees add few new candidates
+    };
+
+    /**
+    * The configuration and the storage fit_memory_budget cut an index down to,
+    * with the memory predicted for it.
+    */
+    struct StoragePlan {
+        Parameters parameters; // the trees and depth the index was pruned to, and the votes of its queries
+        Quantization quantization; // FLOAT32 if the queries score the data, or the FLOAT16 or INT8 copy
+                                   // they score instead, without re-ranking
+        bool compressed_leaves; // whether the leaves were compressed with compress_leaves
+        double recall; // the recall on the test queries, estimated by autotune for FLOAT32 and
+                       // measured with the quantized copy otherwise
+        MemoryUsage memory; // the predicted memory, with data the bytes of the data the queries read,
+                            // owned or not, and scratch that of one querying thread
+    };
+
+    /**
+    * The comparisons of the attribute values of the points with a value that
+    * filter_where makes filters by.
+    */
+    enum Comparison {
+        EQUAL,
+        NOT_EQUAL,
+        LESS,
+        LESS_EQUAL,
+        GREATER,
+        GREATER_EQUAL
+    };
+
+    /**
+    * The points a filtered query may return, a bit per point in the order the
+    * index stores the points. Made by the index with make_filter or filter_where,
+    * and combined with &= and |=. A filter stays valid until the data of the
+    * index is reordered; the points inserted after it was made never pass it.
+    */
+    class Filter {
+     public:
+        /**
+        * Makes a filter passed by no point.
+        */
+        Filter() { }
+
+        /**
+        * Returns whether the point with the internal id passes the filter.
+        */
+        bool test(int id) const {
+            return id < n_bits && ((bits[id >> 6] >> (id & 63)) & 1);
+        }
+
+        /**
+        * Returns the number of points that pass the filter.
+        */
+        int count() const {
+            return n_set;
+        }
+
+        Filter &operator&=(const Filter &other) {
+            bits.resize(std::min(bits.size(), other.bits.size()));
+            n_bits = std::min(n_bits, other.n_bits);
+            for (size_t i = 0; i < bits.size(); ++i)
+                bits[i] &= other.bits[i];
+            recount();
+            return *this;
+        }
+
+        Filter &operator|=(const Filter &other) {
+            bits.resize(std::max(bits.size(), other.bits.size()), 0);
+            n_bits = std::max(n_bits, other.n_bits);
+            for (size_t i = 0; i < other.bits.size(); ++i)
+                bits[i] |= other.bits[i];
+            recount();
+            return *this;
+        }
+
+     private:
+        friend class Mrpt;
+
+        explicit Filter(int n) : bits((n + 63) / 64, 0), n_bits(n) { }
+
+        void set(int id) {
+            bits[id >> 6] |= uint64_t(1) << (id & 63);
+        }
+
+        void recount() {
+            n_set = 0;
+            for (uint64_t word : bits)
+                n_set += std::bitset<64>(word).count();
+        }
+
+        std::vector<uint64_t> bits;
+        int n_bits = 0;
+        int n_set = 0;
+    };
+
+    /**
+    * Counters of the work done by queries, summed over all queries made with a
+    * QueryScratch whose stats point to them, or over the queries of query_batch.
+    * The times are in nanoseconds per phase: projecting the query, routing it
+    * down the trees, counting the votes including the fallback election, and the
+    * linear search. The traversal of query_multiprobe is counted as voting, and
+    * the projection and routing of the queries of a block of query_batch are timed
+    * as one. Defining MRPT_NO_QUERY_STATS removes the code that gathers them.
+    */
+    struct QueryStats {
+        int64_t n_queries = 0; // the number of queries counted
+        int64_t n_touched = 0; // the samples that got at least one vote
+        int64_t n_elected = 0; // the candidates scored by the linear search
+        int64_t n_fallbacks = 0; // the queries that elected fewer than k samples by votes_required
+        int64_t n_truncated = 0; // the queries cut short by the budgets of query_budgeted
+        int64_t n_brute_force = 0; // the queries the planner of set_query_planner answered by brute force
+        int64_t projection_ns = 0;
+        int64_t routing_ns = 0;
+        int64_t voting_ns = 0;
+        int64_t search_ns = 0;
+
+        void add(const QueryStats &other) {
+            n_queries += other.n_queries;
+            n_touched += other.n_touched;
+            n_elected += other.n_elected;
+            n_fallbacks += other.n_fallbacks;
+            n_truncated += other.n_truncated;
+            n_brute_force += other.n_brute_force;
+            projection_ns += other.projection_ns;
+            routing_ns += other.routing_ns;
+            voting_ns += other.voting_ns;
+            search_ns += other.search_ns;
+        }
+    };
+
+    /**
+    * Signals of how hard a query was, filled by query_confidence, for sending
+    * only the hard queries to a second, more expensive pass, such as one with
+    * more trees or with multi-probe. They are by-products of the query.
+    */
+    struct QueryConfidence {
+        int n_voted = 0; // the samples that got at least one vote
+        int n_elected = 0; // the candidates scored by the linear search
+        float vote_concentration = 0; // the mean votes of the neighbors found over the most votes a sample
+                                      // can get, in [0, 1]: low when the trees disagree on the neighbors
+        float distance_gap = -1; // the distance of the (k + 1)th nearest candidate minus that of the kth,
+                                 // small when the kth neighbor is hard to tell apart from the next;
+                                 // -1 with fewer than k + 1 candidates
+    };
+
+    /**
+    * The costs the query planner of set_query_planner estimates the two ways of
+    * answering a query with, in nanoseconds: a multiply-add of the projection
+    * of the query, the vote of a point of a leaf, a component of the distance
+    * to a candidate gathered from the data, and a component of a distance in
+    * the sequential scan of the data by brute force. calibrate_planner measures
+    * them on the running machine; the defaults are those of a recent x86 core.
+    */
+    struct PlannerCosts {
+        double projection_ns = 0.1;
+        double vote_ns = 1.5;
+        double gather_ns = 0.15;
+        double scan_ns = 0.06;
+    };
+
+    /**
+    * The settings of the batches of query_batch that calibrate_batch chooses:
+    * the most queries of a block projected with one matrix product, and the
+    * groups of set_query_interleave and set_batch_rerank.
+    */
+    struct BatchTuning {
+        int block_size = 64;
+        int interleave = 1;
+        bool leaf_major = false;
+        bool rerank = false;
+    };
+
+    /**
+    * The ways the query planner of set_query_planner answers a query.
+    */
+    enum QueryPlan {
+        PLAN_INDEX, // the trees elect the candidates, which are scored
+        PLAN_BRUTE_FORCE // all the points, or all that pass the filter, are scored
+    };
+
+    /**
+    * The phases of the last grow, for planning the capacity of the builds. The
+    * times are the wall times in nanoseconds of generating the random matrix,
+    * projecting the data onto the random vectors of the trees, splitting the
+    * nodes of the trees, and assembling the index from the leaves: laying out
+    * the split points, the leaf bounds and the binary codes. The projections of
+    * the trees built from a sample or one level at a time under a memory limit
+    * are computed along with their splits and timed with them.
+    */
+    struct BuildStats {
+        int64_t matrix_ns = 0;
+        int64_t projection_ns = 0;
+        int64_t tree_ns = 0;
+        int64_t assembly_ns = 0;
+        int n_threads = 0; // the threads the build could use
+        int n_groups = 0; // the groups of trees whose projections were held in memory together
+        int64_t projection_bytes = 0; // the most bytes of projections held at once
+    };
+
+    /**
+    * Working memory of a single query: a vote counter for every sample, the
+    * list of samples that received votes, a buffer for the elected candidates
+    * and a heap for selecting the nearest of them. The vote counters are
+    * returned to zero at the end of each query by resetting only the touched
+    * entries, so the same object can be reused for any number of queries
+    * without reallocating or clearing O(n_samples) memory. An object must not
+    * be used by two threads at the same time.
+    *
+    * The counters are as narrow as the number of votes a sample can get allows,
+    * usually a byte per sample since there are fewer than 256 trees, and when a
+    * single vote elects a sample they are replaced by a bit per sample. When the
+    * leaves are large, the votes are instead counted bit-sliced: the leaf of
+    * each tree is set in a bitmap, and the bitmaps are summed into the bits of
+    * the counts of 64 samples at a time, see elect_sliced. When the leaves are
+    * sorted and few samples get votes out of many, the ids of the leaves are
+    * merged instead, and the votes of a sample are the length of its run, see
+    * elect_merged, without memory for every sample.
+    */
+    struct QueryScratch {
+        std::vector<uint64_t> voted; // a bit per sample telling whether it has a vote, all zero between queries
+        std::vector<uint8_t> votes8; // vote counts of all samples when none can get 256 votes, all zero between queries
+        std::vector<uint16_t> votes16; // vote counts of all samples when none can get 65536 votes, all zero between queries
+        VectorXi votes; // vote counts of all samples otherwise, all zero between queries
+        std::vector<uint64_t> tree_bits; // a bitmap of the samples in the leaf of each tree, in rows of
+                                         // sliced_words(n_samples) words, all zero between queries
+        std::vector<uint64_t> vote_planes; // the n_planes bits of the bit-sliced vote counts of each word of
+                                           // 64 samples side by side, all zero between queries
+        int n_planes = 0; // the bits of a bit-sliced vote count
+        int counter_bytes = 4; // the counters of the current query: 0 for voted, -1 for the bit-sliced
+                               // counters, -2 for the merged leaves, or the bytes of a vote count
+        std::vector<int> merge_ids; // the sorted runs of ids of the leaves of the current query, merged
+        std::vector<int> merge_buffer; // the runs merged by a pass of elect_merged
+        std::vector<int> merge_first; // where each run of merge_ids starts, and the end of the last
+        std::vector<int> merged_votes; // the votes of each touched sample, in the order of touched, when merged
+        int n_merged = 0; // the touched samples of the merged leaves, sorted by id
+        QueryStats *stats = nullptr; // if set, the queries made with this memory add their counters to it
+        const Filter *filter = nullptr; // if set, the votes of the samples that do not pass it are not counted
+        const uint64_t *excluded = nullptr; // if set, a bit per sample whose votes are not counted, see query_excluding
+        std::vector<uint64_t> excluded_bits; // the bits of query_excluding, all zero between queries
+        int pruned_levels = 0; // the levels cut from the trees: a found leaf j is the leaves j * 2^pruned_levels, ...
+        VectorXi touched; // indices of the samples that have at least one vote
+        VectorXi elected; // indices of the samples elected to the linear search
+        TopK heap; // the nearest of the elected samples found so far
+        std::vector<std::pair<float, int>> probes; // the unvisited branches of a multi-probe query
+        TopK shortlist; // the nearest candidates by the quantized data, re-ranked with the data itself
+        VectorXi shortlisted; // the ids of the candidates in shortlist
+        std::vector<TopK> partial_heaps; // the heaps of the threads scoring the candidates of one query
+        std::vector<int> union_ids; // the union of the candidates of a group of queries, for rerank_group
+        std::vector<int> union_columns; // the column of each sample of union_ids in the block of rerank_group,
+                                        // -1 for the others
+        VectorXi ranked; // the elected samples ordered by their votes, for a query with a budget, or by
+                         // the bounds of their leaves, for a multi-probe query with leaf bounds
+        std::vector<std::pair<int, int>> visited_leaves; // the leaves a multi-probe query with leaf bounds visited,
+                                                         // at n_tree * 2^depth + leaf, and the end of their elected
+        std::vector<std::pair<float, int>> leaf_order; // the lower bounds of the visited leaves and their positions
+        std::vector<float> lower_bounds; // the lower bounds of the distances of the samples in ranked, ascending
+        VectorXf quantized_query; // the query minus the offsets of INT8 codes, its distance tables for PQ codes or its PCA code
+        std::vector<uint64_t> binary_query; // the BINARY code of the query
+        const float *projected_query = nullptr; // the projections of the query onto all random vectors, if
+                                                // known, from which its BINARY code is made
+        std::vector<uint64_t> walked; // a bit per sample telling whether the graph walk has scored it, all zero
+                                      // between queries
+        std::vector<int> walked_ids; // the samples whose bits are set in walked
+        std::vector<std::pair<float, int>> frontier; // the samples the graph walk has yet to expand, a min-heap
+        TopK beam; // the nearest samples the graph walk has found
+        std::vector<float> leading_query; // the leading dimensions of set_leading_dimensions of the query
+
+        /**
+        * Grows the buffers to fit a query that gives votes to at most
+        * max_candidates samples. The touched and elected samples are kept, so
+        * the buffers can also grow during a query.
+        */
+        void reserve(int max_candidates) {
+            if (elected.size() < max_candidates) {
+                touched.conservativeResize(max_candidates);
+                elected.conservativeResize(max_candidates);
+            }
+        }
+
+        /**
+        * Chooses the vote counters of a query over n_samples samples in which no
+        * sample gets more than max_votes votes, and grows them to fit.
+        * @param dedupe - Whether a single vote elects a sample, so that only the
+        * samples having a vote have to be known
+        * @param sliced - Whether the votes are counted bit-sliced, unless dedupe is
+        * set, with a bitmap for each of max_votes trees
+        * @param merged - Whether the votes are counted by merging the sorted leaves,
+        * which takes precedence over the others
+        */
+        void select_counters(int n_samples, int max_votes, bool dedupe, bool sliced = false, bool merged = false) {
+            counter_bytes = merged ? -2 : dedupe ? 0 : sliced ? -1 : max_votes < 256 ? 1 : max_votes < 65536 ? 2 : 4;
+            if (counter_bytes == -2) {
+                merge_ids.clear();
+                merge_first.assign(1, 0);
+                n_merged = 0;
+            } else if (counter_bytes == -1) {
+                const size_t n_words = sliced_words(n_samples);
+                int planes = 1;
+                while (max_votes >> planes)
+                    ++planes;
+                if (tree_bits.size() < n_words * max_votes)
+                    tree_bits.resize(n_words * max_votes);
+                // the planes are all zero between queries, so they can be laid out anew
+                if (planes != n_planes || vote_planes.size() < n_words * planes) {
+                    n_planes = planes;
+                    vote_planes.assign(n_words * planes, 0);
+                }
+            } else if (counter_bytes == 0 && voted.size() < (size_t) (n_samples + 63) / 64)
+                voted.resize((n_samples + 63) / 64);
+            else if (counter_bytes == 1 && votes8.size() < (size_t) n_samples)
+                votes8.resize(n_samples);
+            else if (counter_bytes == 2 && votes16.size() < (size_t) n_samples)
+                votes16.resize(n_samples);
+            else if (counter_bytes == 4 && votes.size() < n_samples)
+                votes = VectorXi::Zero(n_samples);
+        }
+
+        /**
+        * Returns the words of a bitmap of n_samples samples, rounded up to whole
+        * blocks of sliced_block words.
+        */
+        static size_t sliced_words(int n_samples) {
+            const size_t n_words = ((size_t) n_samples + 63) / 64;
+            return (n_words + sliced_block - 1) / sliced_block * sliced_block;
+        }
+
+        static const int sliced_block = 8; // the words of the bitmaps summed at once by elect_sliced
+    };
+
+    /**
+    * A query answered a page at a time, see start_session and next_page. The
+    * candidates elected for the query are scored once and kept in a heap, from
+    * which each page pops the nearest of those not yet returned, so the pages
+    * after the first cost no projection, voting or distance computations until
+    * the candidates run out. An object must not be used by two threads at the
+    * same time.
+    */
+    struct QuerySession {
+        VectorXf q; // the query
+        VectorXf projected_query; // its projections onto all random vectors, for visiting more leaves
+        int votes_required = 1;
+        int max_candidates = 0; // the candidate budget of the last visit of the leaves
+        bool exhausted = false; // whether all the leaves have been visited
+        uint64_t changes = 0; // the change_count of the index when the session was started
+        int n_returned = 0; // the neighbors returned so far
+        std::vector<std::pair<float, int>> heap; // the scores and internal ids of the scored candidates not yet
+                                                 // returned, a min-heap
+        std::vector<int> scored; // the internal ids of the elected candidates scored so far, sorted
+    };
+
+    /**
+    * The data an index is built from and searches, a dim x n matrix of floats in
+    * column-major order. The index either borrows the data from its caller, who
+    * keeps it alive and unchanged as long as the index uses it, or owns it: a
+    * copy, a buffer given with the function that frees it, or a mapped file. A
+    * Data can be moved but not copied, and frees what it owns when it is
+    * destroyed or released.
+    */
+    class Data {
+     public:
+        Data() : values(nullptr), rows(0), cols(0), mapped(false) { }
+
+        /**
+        * Returns data that stays owned by the caller.
+        */
+        static Data borrow(const float *data, int dim, int n) {
+            return Data(data, dim, n, nullptr, false);
+        }
+
+        /**
+        * Returns an owned copy of the data.
+        */
+        static Data copy(const float *data, int dim, int n) {
+            float *values = new float[(size_t) dim * n];
+            std::copy(data, data + (size_t) dim * n, values);
+            return Data(values, dim, n, [values] { delete[] values; }, false);
+        }
+
+        /**
+        * Returns data that takes over a buffer, which is freed with release.
+        * @param release - The function freeing the buffer, such as unmapping a file or
+        * releasing a buffer of another language; called once, when the data is released
+        * @param mapped_file - Whether the buffer is a mapped file, which memory_usage
+        * counts apart from the memory the index allocates
+        */
+        static Data adopt(const float *data, int dim, int n, std::function<void()> release,
+                          bool mapped_file = false) {
+            return Data(data, dim, n, std::move(release), mapped_file);
+        }
+
+        Data(Data &&other) : values(nullptr), rows(0), cols(0), mapped(false) {
+            swap(other);
+        }
+
+        Data &operator=(Data &&other) {
+            if (this != &other) {
+                release();
+                swap(other);
+            }
+            return *this;
+        }
+
+        Data(const Data &) = delete;
+        Data &operator=(const Data &) = delete;
+
+        ~Data() {
+            release();
+        }
+
+        /**
+        * Frees the data if it is owned, and leaves this empty.
+        */
+        void release() {
+            if (releaser)
+                releaser();
+            releaser = nullptr;
+            values = nullptr;
+            cols = 0;
+            mapped = false;
+        }
+
+        const float *data() const {
+            return values;
+        }
+
+        int dim() const {
+            return rows;
+        }
+
+        int size() const {
+            return cols;
+        }
+
+        bool owned() const {
+            return static_cast<bool>(releaser);
+        }
+
+        bool mapped_file() const {
+            return mapped;
+        }
+
+     private:
+        Data(const float *values_, int rows_, int cols_, std::function<void()> releaser_, bool mapped_) :
+            values(values_), rows(rows_), cols(cols_), releaser(std::move(releaser_)), mapped(mapped_) { }
+
+        void swap(Data &other) {
+            std::swap(values, other.values);
+            std::swap(rows, other.rows);
+            std::swap(cols, other.cols);
+            std::swap(releaser, other.releaser);
+            std::swap(mapped, other.mapped);
+        }
+
+        const float *values;
+        int rows, cols;
+        std::function<void()> releaser; // frees owned data, empty for borrowed data
+        bool mapped; // whether the owned data is a mapped file
+    };
+
+    /**
+    * The constructor of the index. The inputs are the data for which the index
+    * will be built and additional parameters that affect the accuracy of the NN
+    * approximation. Concisely, larger n_trees_ or smaller depth values improve
+    * accuracy but slow down the queries. A general rule for the right balance is
+    * not known. The constructor does not actually build the trees, but that is
+    * done by a separate function 'grow' that has to be called before queries can
+    * be made.
+    * @param X_ - Pointer to a matrix containing the data, which the index borrows:
+    * the matrix object itself is not needed afterwards, but the data it maps is.
+    * @param n_trees_ - The number of trees to be used in the index.
+    * @param depth_ - The depth of the trees.
+    * @param density_ - Expected ratio of non-zero components in a projection matrix.
+    * @param seed_ - The seed of the random projections, so that builds with the same
+    * seed give the same index. If 0, every build draws a new random seed.
+    * @param projection_ - The distribution of the components of the projection matrix.
+    * With HADAMARD projections density_ is ignored.
+    * @param metric_ - The similarity the nearest neighbors are searched by.
+    */
+    Mrpt(Map<const MatrixXf> *X_, int n_trees_, int depth_, float density_, unsigned seed_ = 0,
+         Projection projection_ = GAUSSIAN, Metric metric_ = EUCLIDEAN) :
+        Mrpt(Data::borrow(X_->data(), X_->rows(), X_->cols()), n_trees_, depth_, density_, seed_, projection_,
+             metric_) { }
+
+    /**
+    * Same as above, with data the index borrows or owns; owned data is freed
+    * with the index, by release_data, or once insert has copied it.
+    */
+    Mrpt(Data data_, int n_trees_, int depth_, float density_, unsigned seed_ = 0,
+         Projection projection_ = GAUSSIAN, Metric metric_ = EUCLIDEAN) :
+        given_data(std::move(data_)),
+        given_matrix(given_data.data(), given_data.dim(), given_data.size()),
+        X(&given_matrix),
+        stored_data(nullptr, 0, 0),
+        n_labeled(0),
+        search_data(X->data()),
+        split_data(nullptr),
+        leaf_first_data(nullptr),
+        leaf_ids_data(nullptr),
+        n_unmerged(0),
+        tree_points(X->cols()),
+        n_deleted(0),
+        n_stale(0),
+        mapped_index(nullptr),
+        mapped_index_bytes(0),
+        index_allocated(false),
+        far_leaves_block(nullptr),
+        far_leaves_bytes(0),
+        far_data_bytes(0),
+        tiered_load(false),
+        random_matrix_mapped(false),
+        random_matrix_shared(false),
+        n_ready_trees(0),
+        blocked_layout(false),
+        blocked_data(nullptr),
+        blocked_stride(0),
+        blocked_ready(false),
+        loading_ok(true),
+        load_failure(nullptr),
+        n_changes(0),
+        sorted_leaves_change(~(uint64_t) 0),
+        dense_matrix(nullptr, 0, 0),
+        sparse_matrix(0, 0, 0, nullptr, nullptr, nullptr),
+        n_samples(X->cols()),
+        dim(X->rows()),
+        dim_kernels(&mrpt_kernels::distance_kernels(dim)),
+        n_trees(n_trees_),
+        depth(depth_),
+        density(projection_ == HADAMARD ? 1 : density_),
+        n_pool(n_trees_ * depth_),
+        n_array(1 << (depth_ + 1)),
+        seed(seed_),
+        projection(projection_),
+        metric(metric_),
+        max_norm(0),
+        build_seed(0),
+        first_tree(0),
+        forest_trees(n_trees_),
+        split_sample_size(0),
+        build_sample_size(0),
+        leaf_size_limit(0),
+        n_split_candidates(1),
+        direction_sample_size(20000),
+        hadamard_size(0),
+        prefetch_distance(-1),
+        advise_pages(false),
+        sort_candidates(false),
+        interleave_size(1),
+        leaf_major_votes(false),
+        batch_rerank(false),
+        batch_block_size(64),
+        parallel_scoring_min(0),
+        n_query_threads(0),
+        huge_pages(false),
+        verify_checksums(true),
+        quantization(FLOAT32),
+        shortlist_size(0),
+        byte_data(false),
+        pq_subspaces(0),
+        projection_precision(FLOAT32),
+        graph_hops(0),
+        graph_beam(0),
+        query_planner(false),
+        progress_interval_ns(1000000000),
+        n_built_trees(0),
+        last_progress_ns(0),
+        reporting_progress(false),
+        build_duty_cycle(1),
+        data_fill(nullptr)
+    { }
+
+    /**
+    * Same as above, with 8-bit data such as the SIFT descriptors of .bvecs files
+    * or quantized embeddings, which the index copies into a byte per component
+    * instead of the caller widening it to floats. The bytes are kept as lossless
+    * INT8 codes with a step of 1 (see set_quantization with a negative
+    * shortlist), so the queries and the exact searches score the candidates on
+    * them with the SIMD kernels of the codes and return exact distances. The
+    * builds widen the data to floats in chunks, and the split points are floats
+    * as for float data. Only the EUCLIDEAN metric is supported. Since there is
+    * no float data, set_quantization, insert, merge, set_leaf_bounds,
+    * regrow_trees and the deltas return false, reorder_data does nothing, and
+    * the methods that read the float data otherwise, such as knn_graph, the
+    * radius queries and set_leading_dimensions, must not be called.
+    * @param data_ - The first component of the first point, the components of a
+    * point consecutive
+    * @param dim_ - The dimension of the data
+    * @param n_ - The number of points
+    * @param is_signed - Whether the components are int8_t rather than uint8_t
+    * @param row_stride - The bytes from one point to the next, at least dim_; 0 for
+    * dim_. The points of a .bvecs file are dim_ + 4 bytes apart, after the dimension
+    * stored before each of them.
+    */
+    Mrpt(const uint8_t *data_, int dim_, int n_, bool is_signed, size_t row_stride, int n_trees_, int depth_,
+         float density_, unsigned seed_ = 0, Projection projection_ = GAUSSIAN) :
+        Mrpt(Data::borrow(nullptr, dim_, 0), n_trees_, depth_, density_, seed_, projection_, EUCLIDEAN) {
+        n_samples = tree_points = n_;
+        byte_data = true;
+        quantization = INT8;
+        shortlist_size = -1;
+        code_offset = VectorXf::Constant(dim, is_signed ? -128 : 0);
+        code_scale = VectorXf::Ones(dim);
+        if (!row_stride)
+            row_stride = dim;
+
+        // signed components are stored offset by 128, as the codes are unsigned
+        codes.resize((size_t) dim * n_samples);
+        parallel_for(n_samples, [&](int i) {
+            const uint8_t *x = data_ + row_stride * i;
+            uint8_t *code = codes.data() + (size_t) dim * i;
+            for (int j = 0; j < dim; ++j)
+                code[j] = is_signed ? x[j] ^ 0x80 : x[j];
+        }, 1024);
+    }
+
+    ~Mrpt() {
+        wait_load();
+        release_mapped_index();
+    }
+
+    Mrpt(const Mrpt &) = delete;
+
+    /**
+    * The function whose call starts the actual index construction. Initializes
+    * arrays to store the tree structures and computes all the projections needed
+    * later. Then repeatedly calls method grow_subtree that builds a single RP-tree.
+    * @param keep_data - If zero, release_data is called after the index is built
+    * @param memory_limit - The maximum number of bytes used for the projections of the
+    * trees under construction, or 0 for no limit. A tree needs depth * n_samples floats
+    * to be projected at once; when not even one tree fits, the trees are projected one
+    * level at a time, and if needed fewer threads are used.
+    * @param stream_data - If true, the trees are built with grow_streaming, reading the data in
+    * sequential passes. Meant for data that does not fit in memory, such as a memory mapped file.
+    * Ignored when the trees are grown from a sample set with set_build_sample, which reads the
+    * data sequentially anyway.
+    */
+    void grow(int keep_data, size_t memory_limit = 0, bool stream_data = false) {
+        wait_load();
+        ++n_changes;
+        MRPT_TRACE_SCOPE(trace, "mrpt.grow");
+        const int64_t start = metrics_clock();
+        BuildScope build_scope(*this);
+        release_mapped_index();
+        n_ready_trees = 0;
+        blocked_ready = false;
+
+        // the trees are built in the original order of the data
+        data_order.resize(0);
+        data_position.resize(0);
+        reordered_data.resize(0, 0);
+        set_search_data(X->data());
+        clear_updates();
+
+        last_build = BuildStats();
+        last_build.n_threads = available_threads();
+        int64_t phase_start = mrpt_metrics::now_ns();
+        MRPT_TRACE_SCOPE(matrix_trace, "mrpt.random_matrix");
+
+        // generate the random matrix
+        build_seed = seed ? seed : std::random_device()();
+        density < 1 ? build_sparse_random_matrix() : build_dense_random_matrix();
+        use_owned_random_matrix();
+
+        split_points = MatrixXf(n_array, n_trees);
+
+        const int n_leaves = 1 << depth;
+        leaf_ids = MatrixXi(n_samples, n_trees);
+        leaf_first = MatrixXi(n_leaves + 1, n_trees);
+        advise_huge_pages(leaf_ids.data(), sizeof(int) * leaf_ids.size());
+        if (metric == INNER_PRODUCT)
+            max_norm = n_samples ? std::sqrt(X->colwise().squaredNorm().maxCoeff()) : 0;
+        if (n_split_candidates > 1 && projection == GAUSSIAN && metric != INNER_PRODUCT)
+            choose_split_directions();
+        last_build.matrix_ns = mrpt_metrics::now_ns() - phase_start;
+        MRPT_TRACE_END(matrix_trace);
+
+        n_built_trees = 0;
+        last_progress_ns = phase_start = mrpt_metrics::now_ns();
+        if (build_sample_size > 0 && build_sample_size < n_samples)
+            grow_from_sample(memory_limit);
+        else if (stream_data)
+            grow_streaming(memory_limit);
+        else
+            grow_trees(memory_limit);
+        last_build.tree_ns = mrpt_metrics::now_ns() - phase_start - last_build.projection_ns;
+
+        phase_start = mrpt_metrics::now_ns();
+        use_owned_trees();
+        n_ready_trees = n_trees;
+        layout_splits();
+        if (leaf_radii.size())
+            compute_leaf_bounds();
+        if (quantization == BINARY)
+            quantize_binary();
+        last_build.assembly_ns = mrpt_metrics::now_ns() - phase_start;
+        if (progress_callback)
+            progress_callback(n_trees, n_trees);
+        if (metrics)
+            metrics->builds.record(mrpt_metrics::now_ns() - start);
+
+        if (!keep_data)
+            release_data();
+    }
+
+    /**
+    * Same as grow, for data that is still being written, for example read from
+    * a file by other threads while the trees are built, so that the reading
+    * overlaps with the projections. The trees are built with grow_streaming:
+    * the projections of the first group of trees are computed chunk by chunk
+    * as the chunks of the data arrive, in the order of the data, and the other
+    * groups read the data once it is all written. The trees are the same as
+    * those of grow with stream_data. The INNER_PRODUCT metric, split
+    * candidates and a build sample look at all of the data before the trees
+    * are built, so with them the whole data is waited for first.
+    * @param keep_data - As in grow
+    * @param memory_limit - As in grow; 0 limits the projections of a group to
+    * the bytes of the data
+    * @param wait_points - Called with a number of points, from the threads of
+    * the build, to wait until at least that many first points of the data are
+    * written. Returns false if they never will be, for example because the
+    * file cannot be read; the build then goes on over the data as it is.
+    * @return false if wait_points failed, true otherwise
+    */
+    bool grow_pipelined(int keep_data, size_t memory_limit, const std::function<bool(int)> &wait_points) {
+        if (!memory_limit)
+            memory_limit = std::max<size_t>(1, (byte_data ? 1 : sizeof(float)) * (size_t) dim * n_samples);
+        const bool reads_all = metric == INNER_PRODUCT || n_split_candidates > 1 ||
+                               (build_sample_size > 0 && build_sample_size < n_samples);
+        if (reads_all && !wait_points(n_samples)) {
+            grow(keep_data, memory_limit, true);
+            return false;
+        }
+        data_fill = &wait_points;
+        grow(keep_data, memory_limit, true);
+        data_fill = nullptr;
+        return wait_points(n_samples);
+    }
+
+    /**
+    * Grows only the trees first, ..., last - 1 of the n_trees trees grow would
+    * grow, so that a large forest can be built a part at a time on separate
+    * machines. Every tree has random streams of its own, seeded from the seed
+    * and the number of the tree in the forest, and the samples of the build
+    * come from streams numbered by the size of the forest, so the trees are the
+    * same as those of grow with the same data, seed and settings. The index
+    * then holds the last - first trees of the part, and it can be saved and
+    * loaded as any index constructed with that many trees; the file records
+    * the number of its first tree. append_trees joins the parts, in order, into
+    * the index of the whole forest. Must not be called concurrently with
+    * queries.
+    * @param first - The first tree of the part
+    * @param last - One past the last tree of the part
+    * @param keep_data, memory_limit, stream_data - As in grow
+    * @return false if the trees are out of range, if the index has no fixed
+    * seed, or if the projection is HADAMARD, whose transforms span trees, in
+    * which case nothing is grown; true otherwise
+    */
+    bool grow_part(int first, int last, int keep_data, size_t memory_limit = 0, bool stream_data = false) {
+        wait_load();
+        if (first < 0 || first >= last || last > n_trees || !seed || projection == HADAMARD)
+            return false;
+        forest_trees = n_trees;
+        first_tree = first;
+        n_trees = last - first;
+        n_pool = n_trees * depth;
+        grow(keep_data, memory_limit, stream_data);
+        return true;
+    }
+
+    /**
+    * Same as grow, saving the trees to the directory dir as they are built, so
+    * that a build interrupted, for example by the preemption of its machine,
+    * resumes where it stopped when called again. The forest is grown in parts
+    * of checkpoint_trees trees with grow_part, and each part is saved to a file
+    * of dir named by its trees, written under a temporary name and renamed when
+    * complete. The parts already in dir, saved with the same data size and
+    * parameters, are not grown again, and since every tree has random streams
+    * of its own, the trees are the same as those of grow. The index is then
+    * loaded from the parts with append_trees. The files are left in dir.
+    * @param dir - An existing directory for the parts
+    * @param checkpoint_trees - The number of trees in each part
+    * @param keep_data, memory_limit, stream_data - As in grow
+    * @return false if the index has no fixed seed, if the projection is
+    * HADAMARD, or if a part cannot be saved or loaded, in which case the index
+    * has no trees; a part that fails to load is removed, so that the next call
+    * grows it again. True otherwise.
+    */
+    bool grow_checkpointed(const std::string &dir, int checkpoint_trees, int keep_data, size_t memory_limit = 0,
+                           bool stream_data = false) {
+        wait_load();
+        const int total = n_trees;
+        if (checkpoint_trees < 1 || !seed || projection == HADAMARD)
+            return false;
+        auto part_path = [&](int first) {
+            return dir + "/trees-" + std::to_string(first) + "-" +
+                   std::to_string(std::min(total, first + checkpoint_trees)) + ".mrpt";
+        };
+        auto unbuilt = [&] {
+            n_trees = forest_trees = total;
+            n_pool = n_trees * depth;
+            first_tree = 0;
+            n_ready_trees = 0;
+            return false;
+        };
+
+        for (int first = 0; first < total; first += checkpoint_trees) {
+            const int last = std::min(total, first + checkpoint_trees);
+            const std::string path = part_path(first), temporary = path + ".tmp";
+            IndexFileInfo info;
+            if (read_file_info(path.c_str(), info) && info.n_samples == n_samples && info.dim == dim &&
+                info.n_trees == last - first && info.depth == depth && info.density == density &&
+                info.seed == seed && info.projection == projection && info.metric == metric &&
+                info.first_tree == first)
+                continue;
+            n_trees = total;
+            if (!grow_part(first, last, true, memory_limit, stream_data) || !save(temporary.c_str()) ||
+                std::rename(temporary.c_str(), path.c_str()))
+                return unbuilt();
+        }
+
+        // the index is loaded from the parts in the order of their trees
+        for (int first = 0; first < total; first += checkpoint_trees) {
+            const int last = std::min(total, first + checkpoint_trees);
+            const std::string path = part_path(first);
+            bool loaded;
+            if (!first) {
+                n_trees = last;
+                n_pool = n_trees * depth;
+                loaded = load(path.c_str());
+            } else {
+                Mrpt part(Data::borrow(X->data(), dim, X->cols()), last - first, depth, density, seed, projection,
+                          metric);
+                part.n_samples = part.tree_points = n_samples;
+                loaded = part.load(path.c_str()) && append_trees(part);
+            }
+            if (!loaded) {
+                std::remove(path.c_str());
+                return unbuilt();
+            }
+        }
+        forest_trees = total;
+
+        if (!keep_data)
+            release_data();
+        return true;
+    }
+
+    /**
+    * Copies the data into the order of the leaves of the first tree, so that
+    * the points of each leaf are next to each other in memory, and renumbers
+    * the points in the leaves of all trees by their positions in the copy. The
+    * points of each leaf are also sorted, so the linear search of a query reads
+    * memory mostly in increasing order instead of at random. The ids taken and
+    * returned by all public methods are still the columns of the original
+    * data matrix, which the index no longer reads afterwards. Needs to be
+    * called again after the trees are grown or loaded, and uses as much memory
+    * as the data itself. Does nothing for 8-bit data.
+    */
+    void reorder_data() {
+        wait_load();
+        if (byte_data)
+            return;
+
+        // the leaves are renumbered, so an index in a mapped file needs a copy
+        copy_mapped_index();
+        compact_leaves();
+
+        // the deleted points are in no tree, and go after the others
+        data_order.resize(n_samples);
+        data_order.head(tree_points) = leaf_ids.col(0);
+        for (int i = 0, j = tree_points; i < n_samples && n_deleted; ++i)
+            if (is_deleted(i)) data_order(j++) = i;
+
+        data_position.resize(n_samples);
+        for (int i = 0; i < n_samples; ++i)
+            data_position(data_order(i)) = i;
+
+        reordered_data.resize(dim, n_samples);
+        advise_huge_pages(reordered_data.data(), sizeof(float) * reordered_data.size());
+        parallel_for(n_samples, [&](int i) { reordered_data.col(i) = X->col(data_order(i)); }, 1024);
+
+        parallel_for(n_trees, [&](int n_tree) {
+            int *ids = leaf_ids.col(n_tree).data();
+            for (int i = 0; i < tree_points; ++i)
+                ids[i] = data_position(ids[i]);
+            for (int j = 0; j < (1 << depth); ++j)
+                std::sort(ids + leaf_first(j, n_tree), ids + leaf_first(j + 1, n_tree));
+        });
+
+        if (n_deleted) {
+            std::vector<uint64_t> bits(deleted_bits.size(), 0);
+            for (int i = tree_points; i < n_samples; ++i)
+                bits[i >> 6] |= uint64_t(1) << (i & 63);
+            deleted_bits.swap(bits);
+        }
+        if (!duplicate_ids.empty()) {
+            std::vector<int> first(n_samples + 1, 0), ids(duplicate_ids.size());
+            for (int i = 0; i < n_samples; ++i)
+                first[data_position(i) + 1] = duplicate_first[i + 1] - duplicate_first[i];
+            std::partial_sum(first.begin(), first.end(), first.begin());
+            for (int i = 0; i < n_samples; ++i)
+                for (int j = duplicate_first[i], l = first[data_position(i)]; j < duplicate_first[i + 1]; ++j)
+                    ids[l++] = data_position(duplicate_ids[j]);
+            duplicate_first.swap(first);
+            duplicate_ids.swap(ids);
+        }
+
+        set_search_data(reordered_data.data(), true);
+    }
+
+    /**
+    * Stores each group of identical points once in the trees: the point with the
+    * smallest id stays in its leaves and the others, its duplicates, are left out
+    * of them. With data that repeats the same vectors many times the leaves get
+    * smaller, and each vector is scored once. The queries return the duplicates
+    * of a neighbor right after it, at the same distance, as long as there is
+    * room among the k neighbors, and the exact searches do the same. The
+    * duplicates are put back into the trees before points are inserted or
+    * removed, and save writes them into the leaves like the other points. Needs
+    * to be called again after the trees are grown or loaded. Does nothing for
+    * 8-bit data or without the data.
+    * @return The number of points left out of the trees
+    */
+    int collapse_duplicates() {
+        wait_load();
+        ++n_changes;
+        if (byte_data || X->cols() != n_samples || !duplicate_ids.empty())
+            return duplicate_ids.size();
+
+        // the points are grouped by a checksum of their vectors, and compared in full within a group
+        std::vector<std::pair<uint32_t, int>> keys;
+        keys.reserve(n_samples - n_deleted);
+        for (int i = 0; i < n_samples; ++i)
+            if (!n_deleted || !is_deleted(i)) keys.emplace_back(0, i);
+        parallel_for((int) keys.size(), [&](int i) {
+            keys[i].first = mrpt_kernels::crc32c(0, column(keys[i].second), sizeof(float) * dim);
+        }, 1024);
+        std::sort(keys.begin(), keys.end());
+
+        std::vector<int> original(n_samples, -1);
+        int n_duplicates = 0;
+        for (size_t first = 0, last; first < keys.size(); first = last) {
+            for (last = first + 1; last < keys.size() && keys[last].first == keys[first].first; ++last) {}
+            for (size_t a = first; a < last; ++a) {
+                const int id = keys[a].second;
+                if (original[id] >= 0) continue;
+                for (size_t b = a + 1; b < last; ++b) {
+                    const int other = keys[b].second;
+                    if (original[other] < 0 && !memcmp(column(id), column(other), sizeof(float) * dim)) {
+                        original[other] = id;
+                        ++n_duplicates;
+                    }
+                }
+            }
+        }
+        if (!n_duplicates)
+            return 0;
+
+        duplicate_first.assign(n_samples + 1, 0);
+        duplicate_ids.resize(n_duplicates);
+        for (int i = 0; i < n_samples; ++i)
+            if (original[i] >= 0) ++duplicate_first[original[i] + 1];
+        std::partial_sum(duplicate_first.begin(), duplicate_first.end(), duplicate_first.begin());
+        std::vector<int> position(duplicate_first.begin(), duplicate_first.end() - 1);
+        if (deleted_bits.empty())
+            deleted_bits.assign((n_samples + 63) / 64, 0);
+        for (int i = 0; i < n_samples; ++i) {
+            if (original[i] < 0) continue;
+            duplicate_ids[position[original[i]]++] = i;
+            deleted_bits[i >> 6] |= uint64_t(1) << (i & 63);
+        }
+        n_deleted += n_duplicates;
+        n_stale += n_duplicates;
+        compact_leaves();
+        return n_duplicates;
+    }
+
+    /**
+    * Sets how the linear search of the queries loads the candidate vectors
+    * ahead of scoring them. Must not be called concurrently with queries.
+    * @param distance - How many candidates ahead are prefetched into the cache;
+    * 0 disables prefetching, and -1 (the default) picks a distance based on
+    * the dimension of the data.
+    * @param madvise - If true, the memory pages of all candidates of a query
+    * are requested from the operating system with madvise(MADV_WILLNEED)
+    * before scoring. Useful when the data is memory mapped from a file and may
+    * not be resident. Ignored on Windows.
+    * @param sort - If true, the candidates of a query are sorted by id before
+    * scoring, so that the data is read in increasing order of address, which
+    * the hardware prefetchers and the readahead of memory mapped files follow.
+    * The neighbors found are the same, but the order of equally distant ones
+    * may change.
+    */
+    void set_prefetch(int distance, bool madvise = false, bool sort = false) {
+        prefetch_distance = distance;
+        advise_pages = madvise;
+        sort_candidates = sort;
+    }
+
+    /**
+    * Sets how many threads the functions answering a batch of queries divide it
+    * between: query_batch, query_radius_batch, query_from_leaves_batch,
+    * filter_leaves_by_votes_batch, find_leaves_batch, count_leaf_points,
+    * copy_leaf_points and exact_knn_batch. A single query is always answered on
+    * the calling thread alone, so query can be called from a thread pool of the
+    * caller's own; a batch called from such a pool is best answered serially,
+    * with 1 thread. Only a query with the candidates of set_parallel_scoring
+    * scores them on these threads. The builds and knn_graph use all threads of OpenMP. Must not
+    * be called concurrently with queries.
+    * @param n_threads - The number of threads, 1 to answer a batch serially on the
+    * calling thread, or 0 for omp_get_max_threads() of the calling thread (the default)
+    */
+    void set_query_threads(int n_threads) {
+        n_query_threads = std::max(0, n_threads);
+    }
+
+    /**
+    * Sets the executor that runs the parallel loops of the index instead of
+    * OpenMP: those of grow and the other builds, of the batch queries, of
+    * knn_graph and of the loads. A ThreadPool of mrpt_executor needs no OpenMP,
+    * and an application can run the loops on a thread pool of its own by
+    * implementing mrpt_executor::Executor. The batch queries are still divided
+    * between at most the threads of set_query_threads. Must not be called
+    * concurrently with queries or changes of the index.
+    * @param executor_ - The executor, shared with the caller, or null for OpenMP (the default)
+    */
+    void set_executor(std::shared_ptr<mrpt_executor::Executor> executor_) {
+        wait_load();
+        executor = std::move(executor_);
+    }
+
+    /**
+    * Sets grow and regrow_trees to build the trees in the background of a
+    * process that keeps serving queries, typically from the previous index,
+    * which the new one then replaces with a mrpt_snapshot::SnapshotHandle. The
+    * build runs on a thread pool of its own, of n_threads threads lowered by
+    * niceness on Linux, instead of the executor of set_executor or OpenMP, and
+    * the calling thread only waits for it. With a duty cycle below one, each
+    * thread pauses after every tree it builds, so that it works only that share
+    * of the time and leaves the cores and the memory bandwidth to the queries
+    * for the rest; the build then takes about 1 / duty_cycle times as long. The
+    * memory of the build is bounded with the memory_limit of grow. The trees
+    * are the same as those of a build on as many threads without these
+    * settings.
+    * @param n_threads - The threads of the build, or 0 to build as usual (the default)
+    * @param niceness - How much lower than the calling thread the build threads
+    * run, 0 to 19; ignored outside Linux
+    * @param duty_cycle - The share of the time each build thread works, in (0, 1]
+    */
+    void set_build_priority(int n_threads, int niceness = 10, double duty_cycle = 1) {
+        wait_load();
+        build_executor.reset();
+        if (n_threads > 0)
+            build_executor = std::make_shared<mrpt_executor::ThreadPool>(n_threads, std::max(0, niceness));
+        build_duty_cycle = n_threads > 0 ? std::min(1.0, std::max(0.01, duty_cycle)) : 1;
+    }
+
+    /**
+    * Sets query_batch to count the votes of group_size queries at a time in
+    * turns: each query prefetches the vote counters of its next few candidates
+    * and gives way to the next query of the group, so the cache misses of the
+    * counters of different queries overlap instead of stalling one query after
+    * another. The candidates of each query are then scored as usual, with the
+    * prefetching of set_prefetch. The results are the same. Each thread keeps
+    * working memory for group_size queries, n_samples bytes or more each, so
+    * the groups pay off only where the counters of a single query already miss
+    * the cache, on large indexes; measure before turning them on. Not used
+    * with max_candidates. Must not be called concurrently with queries.
+    *
+    * With leaf_major, the votes of a group are instead counted leaf by leaf:
+    * the queries are grouped by the leaf they reach in each tree, and the ids
+    * of each leaf are read once for all the queries that reach it, in chunks
+    * that stay in the L1 cache while the counters of each query are updated.
+    * The memory traffic of the leaves then falls with the number of queries
+    * that share them, which pays off for clustered queries and large leaves.
+    * The results are the same.
+    * @param group_size - The number of queries interleaved, such as 8, at most
+    * 32, or 1 to answer the queries one by one (the default)
+    * @param leaf_major - Whether the votes of a group are counted leaf by leaf
+    */
+    void set_query_interleave(int group_size, bool leaf_major = false) {
+        interleave_size = std::max(1, std::min(group_size, (int) max_interleave));
+        leaf_major_votes = leaf_major;
+    }
+
+    /**
+    * Sets query_batch to score the candidates of a group of queries together,
+    * for offline batches whose queries share most of their candidates: the
+    * union of the candidates of the group is gathered once and multiplied by
+    * the queries in one matrix product, from which each query ranks its own
+    * candidates. The groups are those of set_query_interleave, or groups of 32
+    * queries if it is not set. A group whose candidates overlap too little,
+    * so that the product would compute more than four times the pairs scored
+    * one query at a time, is scored as usual, as are all the queries of an
+    * index with a quantized copy, leading dimensions or a graph walk. The
+    * neighbors are the same up to the rounding of the distances. Not used with
+    * max_candidates. Must not be called concurrently with queries.
+    * @param enable - Whether the candidates of the groups are scored together
+    */
+    void set_batch_rerank(bool enable) {
+        batch_rerank = enable;
+    }
+
+    /**
+    * Sets the most queries of a block of query_batch, which are projected with
+    * one matrix-matrix product and then answered by one thread. Larger blocks
+    * make the product more efficient until the projections and the vectors of
+    * the block spill out of the cache; the best size depends on the caches,
+    * dim and n_trees, and is measured by calibrate_batch. The results are the
+    * same. Must not be called concurrently with queries.
+    * @param block_size - The most queries of a block, 64 by default
+    */
+    void set_batch_block_size(int block_size) {
+        batch_block_size = std::max(1, block_size);
+    }
+
+    /**
+    * Returns the settings of the batches of query_batch.
+    */
+    BatchTuning batch_tuning() const {
+        BatchTuning tuning;
+        tuning.block_size = batch_block_size;
+        tuning.interleave = interleave_size;
+        tuning.leaf_major = leaf_major_votes;
+        tuning.rerank = batch_rerank;
+        return tuning;
+    }
+
+    /**
+    * Sets the settings of the batches of query_batch, such as those chosen by
+    * calibrate_batch on another index of the same shape on this host. Must not
+    * be called concurrently with queries.
+    */
+    void set_batch_tuning(const BatchTuning &tuning) {
+        set_batch_block_size(tuning.block_size);
+        set_query_interleave(tuning.interleave, tuning.leaf_major);
+        set_batch_rerank(tuning.rerank);
+    }
+
+    /**
+    * Chooses the settings of the batches of query_batch by timing them on this
+    * index with up to 1024 points of the data as queries: the block sizes 8 to
+    * 256 first, then no groups, groups of 8 and 16 counted in turns or leaf by
+    * leaf, and then the scoring of the groups by one matrix product, keeping
+    * each choice that answers the batch fastest. Takes about a second.
+    * With cache_path, the settings are read from that file instead if it was
+    * written for an index of the same shape on as many threads, and written to
+    * it otherwise, so that the timing runs once per host, for example on the
+    * first load of an index. Must not be called concurrently with queries.
+    * @param k - The number of neighbors of the queries timed
+    * @param votes_required - The votes_required of the queries timed
+    * @param cache_path - A file for the settings, or nullptr to time them every time
+    * @return The settings set, the current ones if the data is not available
+    */
+    BatchTuning calibrate_batch(int k, int votes_required, const char *cache_path = nullptr) {
+        wait_load();
+        if (cache_path && read_batch_tuning(cache_path))
+            return batch_tuning();
+        if (!scannable() || !n_samples || !trees_loaded())
+            return batch_tuning();
+
+        const int n_queries = std::min(n_samples, 1024);
+        MatrixXf Q(dim, n_queries), buffer;
+        for (int i = 0; i < n_queries; ++i)
+            Q.col(i) = data_columns((int) ((int64_t) i * n_samples / n_queries), 1, buffer).col(0);
+        std::vector<int> out((size_t) n_queries * k);
+        // the fastest of three runs of the batch with the settings of tuning
+        auto time_ns = [&](const BatchTuning &tuning) {
+            set_batch_tuning(tuning);
+            int64_t best = std::numeric_limits<int64_t>::max();
+            for (int run = 0; run < 3; ++run) {
+                const int64_t start = mrpt_metrics::now_ns();
+                query_batch(Q, k, votes_required, out.data());
+                best = std::min(best, mrpt_metrics::now_ns() - start);
+            }
+            return best;
+        };
+
+        BatchTuning best = batch_tuning(), tried = best;
+        int64_t best_ns = time_ns(best);
+        auto consider = [&]() {
+            const int64_t ns = time_ns(tried);
+            if (ns < best_ns) {
+                best_ns = ns;
+                best = tried;
+            }
+            tried = best;
+        };
+        for (int block_size = 8; block_size <= 256; block_size *= 2) {
+            tried.block_size = block_size;
+            consider();
+        }
+        const std::pair<int, bool> groups[] = {{1, false}, {8, false}, {16, false}, {8, true}, {16, true}};
+        for (const std::pair<int, bool> &group : groups) {
+            tried.interleave = group.first;
+            tried.leaf_major = group.second;
+            consider();
+        }
+        tried.rerank = !best.rerank;
+        consider();
+
+        set_batch_tuning(best);
+        if (cache_path)
+            write_batch_tuning(cache_path);
+        return best;
+    }
+
+    /**
+    * Sets a single query that elects at least min_candidates candidates, such
+    * as one with few votes required in a dense region, to score them on the
+    * threads of set_query_threads, each keeping the k nearest of its share.
+    * The queries with fewer candidates are scored serially, as the threads
+    * would only add the cost of starting and joining them. The threshold is
+    * best measured by calibrate_parallel_scoring. Not used by the queries of
+    * a batch, which already run in parallel, by a query called from a
+    * parallel loop, or by a query with a deadline. The results are the same.
+    * Must not be called concurrently with queries.
+    * @param min_candidates - The fewest candidates scored in parallel, or 0 to
+    * score all queries serially (the default)
+    */
+    void set_parallel_scoring(int min_candidates) {
+        parallel_scoring_min = std::max(0, min_candidates);
+    }
+
+    /**
+    * Makes each tree vote by how far a query lies from the boundaries of its
+    * leaf, as a tree whose leaf the query lands deep inside is more likely to
+    * hold its neighbors than one where the query grazed a split. The margin of
+    * a tree is the smallest distance between a projection of the query and the
+    * split point it is compared with on the way down, and the tree gives each
+    * point of the leaf from 1 to levels votes, by which of levels equal shares
+    * of the margins of a sample of the data the margin falls in. The samples
+    * are then elected by these weighted votes, up to levels * n_trees, so
+    * votes_required is best tuned again, higher than with one vote per tree.
+    * Used by query, query_projected, query_budgeted, query_filtered and
+    * query_batch without groups of set_query_interleave; the other queries
+    * still give one vote per tree. The shares are measured here on up to 1000
+    * points of the data, and need to be measured again after the trees are
+    * grown or loaded again. Must not be called concurrently with queries.
+    * @param levels - The most votes of a tree, at most 16, or 1 for one vote per tree (the default)
+    * @return False if the data or the trees are not available or levels is out of range
+    */
+    bool set_margin_votes(int levels) {
+        wait_load();
+        margin_thresholds.clear();
+        if (levels == 1)
+            return true;
+        if (levels < 1 || levels > 16 || (X->cols() != n_samples && !byte_data) || trees_loaded() < n_trees ||
+            !n_trees || !n_samples)
+            return false;
+
+        const int n_sample = std::min(n_samples, 1000);
+        MatrixXf sample(dim, n_sample), buffer;
+        for (int i = 0; i < n_sample; ++i)
+            sample.col(i) = data_columns((int) ((int64_t) i * n_samples / n_sample), 1, buffer).col(0);
+        const MatrixXf projected = project_queries(sample);
+        std::vector<float> margins;
+        margins.reserve((size_t) n_sample * n_trees);
+        for (int i = 0; i < n_sample; ++i)
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+                margins.push_back(tree_margin(n_tree, projected.col(i).data()));
+        std::sort(margins.begin(), margins.end());
+        for (int j = 1; j < levels; ++j)
+            margin_thresholds.push_back(margins[margins.size() * j / levels]);
+        return true;
+    }
+
+    /**
+    * Measures the threshold of set_parallel_scoring on this index and sets it:
+    * a random sample of candidates, 1024 and then twice as many at a time, is
+    * scored serially and in parallel, and the threshold is the first number of
+    * candidates the threads score faster, or 0 if they never do, as with a
+    * single thread. Takes a fraction of a second, and needs the data of the
+    * index. Must not be called concurrently with queries.
+    * @return The threshold set, 0 for none
+    */
+    int calibrate_parallel_scoring() {
+        wait_load();
+        parallel_scoring_min = 0;
+        if (n_samples < 2048 || query_threads() < 2 || (!search_data && !byte_data))
+            return 0;
+        std::vector<int> ids(n_samples);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::mt19937 gen(build_seed);
+        std::shuffle(ids.begin(), ids.end(), gen);
+
+        MatrixXf buffer;
+        const VectorXf q = byte_data ? VectorXf(data_columns(0, 1, buffer).col(0))
+                                     : VectorXf(Map<const VectorXf>(column(0), dim));
+        QueryScratch scratch;
+        const int k = 10;
+        std::vector<int> out(k);
+        // the fastest of a few runs with the given threshold
+        auto time_ns = [&](int n, int threshold) {
+            parallel_scoring_min = threshold;
+            int64_t best = std::numeric_limits<int64_t>::max();
+            for (int run = 0; run < 5; ++run) {
+                const int64_t start = mrpt_metrics::now_ns();
+                exact_knn(q, k, ids.data(), n, scratch, out.data(), nullptr);
+                best = std::min(best, mrpt_metrics::now_ns() - start);
+            }
+            return best;
+        };
+        int threshold = 0;
+        for (int n = 1024; n <= n_samples && !threshold; n *= 2) {
+            if (time_ns(n, 1) < time_ns(n, 0))
+                threshold = n;
+        }
+        parallel_scoring_min = threshold;
+        return threshold;
+    }
+
+    /**
+    * Makes the queries route through a copy of the split points laid out in
+    * blocks of four levels. A block holds the 15 split points of a subtree of
+    * four levels in one cache line of 64 bytes, and the blocks of each level of
+    * subtrees follow each other, so a descent reads a line per four levels
+    * instead of a line per level below the top few, and the trees are
+    * descended four at a time to overlap the misses. The root block holds the
+    * depth % 4 top levels when depth is not a multiple of four. Pays off for
+    * deep trees whose split points do not fit in the cache, such as 12 levels
+    * or more over hundreds of trees; the results are the same. The copy takes
+    * about half the memory of the split points, which keep unused room for the
+    * leaves. It is made here and whenever the trees are grown, loaded, pruned or
+    * regrown, and after load_async once all the trees are read. Must not be
+    * called concurrently with queries.
+    * @param enable - Whether the queries use the blocked copy
+    */
+    void set_blocked_splits(bool enable) {
+        wait_load();
+        ++n_changes;
+        blocked_layout = enable;
+        layout_splits();
+    }
+
+    /**
+    * Sets the trees built from now on to split every node of more than
+    * sample_size points by the median of the projections of a uniform sample of
+    * sample_size of its points, which are then partitioned in one linear pass,
+    * instead of by the exact median. Near the root of a tree over a large data
+    * set the estimate is nearly as good and much cheaper to find, but the two
+    * children of a node are then only about, not exactly, as large.
+    * @param sample_size - The number of points sampled, such as 100000, or 0 to
+    * split every node by its exact median (the default)
+    */
+    void set_split_sample(int sample_size) {
+        split_sample_size = std::max(0, sample_size);
+    }
+
+    /**
+    * Sets the trees built from now on to be grown from a uniform sample of
+    * sample_size points of the data: the split points are computed from the
+    * sample only, and then all the points are routed through the finished
+    * trees to fill the leaves in one sequential pass over the data. The memory
+    * and time of the splits then depend on the sample size instead of the size
+    * of the data, which makes the build several times faster on large data
+    * sets, but the leaves are only about, not exactly, equally large.
+    * @param sample_size - The number of points sampled, or 0 to grow the trees
+    * from all the points (the default)
+    */
+    void set_build_sample(int sample_size) {
+        build_sample_size = std::max(0, sample_size);
+    }
+
+    /**
+    * Sets the trees built from now on to choose the random vector of each of
+    * their levels from n_candidates random vectors: the one along which a
+    * sample of the data varies the most within the nodes of the level. The
+    * splits then separate the data better, so fewer trees and candidates give
+    * the same recall, at the cost of projecting the sample n_candidates times
+    * during the build. Only GAUSSIAN random matrices, which are stored in full
+    * in index files, can be chosen; other projections are left random. So are
+    * the vectors of INNER_PRODUCT trees, which split the data better where
+    * they split it by the norms of the points than by the variance.
+    * @param n_candidates - The number of random vectors tried for each level,
+    * or 1 to use the first one (the default)
+    * @param sample_size - The number of points the vectors are compared on
+    */
+    void set_split_candidates(int n_candidates, int sample_size = 20000) {
+        n_split_candidates = std::max(1, n_candidates);
+        direction_sample_size = std::max(2, sample_size);
+    }
+
+    /**
+    * Sets the largest leaf the trees built or rebuilt from now on may have,
+    * which bounds the number of candidates a query gets from each tree. Trees
+    * split by exact medians have leaves of at most ceil(n_samples / 2^depth)
+    * points anyway, but the estimated splits of set_split_sample and
+    * set_build_sample and the points inserted later make the leaves uneven:
+    * with a limit, a sampled split that would leave a child too large for
+    * its leaves to fit is made by the exact median instead, a tree grown from
+    * a sample with a larger leaf is grown again from all the points, and
+    * insert grows again the trees that get a larger leaf.
+    * @param limit - The largest leaf size, at least ceil(n_samples / 2^depth)
+    * to have an effect, or 0 for no limit (the default). An insert still
+    * grows again only the trees with leaves above twice the balanced size if
+    * that is larger.
+    */
+    void set_leaf_size_limit(int limit) {
+        leaf_size_limit = std::max(0, limit);
+    }
+
+    /**
+    * Sets whether the large arrays the index allocates from now on, the leaves
+    * of the trees, the reordered and inserted data and the mapping of an index
+    * file, are backed by transparent huge pages. The random accesses of the
+    * linear search then miss the TLB less often. The pages are requested with
+    * madvise(MADV_HUGEPAGE), which is only a hint: where huge pages are
+    * disabled or unavailable normal pages are used. Ignored on Windows.
+    * Must be called before grow, load or reorder_data to have an effect on them.
+    */
+    void set_huge_pages(bool enable) {
+        huge_pages = enable;
+    }
+
+    /**
+    * Sets whether load, load_async and load_from_memory check the CRC-32C checksums
+    * of the sections of an index file, which they do by default. Checking reads the
+    * whole file, so a mapped file is then read at load instead of as the queries
+    * need it. The sizes of the sections are checked against the file either way.
+    */
+    void set_verify_checksums(bool verify) {
+        verify_checksums = verify;
+    }
+
+    /**
+    * A function that is told the number of trees built so far and the number of
+    * trees in the index.
+    */
+    typedef std::function<void(int n_built, int n_trees)> ProgressCallback;
+
+    /**
+    * Sets a function that grow calls to report its progress: at most once per
+    * min_interval seconds while the trees are being built, and once when all of
+    * them are built. It is called from one of the threads building the trees,
+    * never from two threads at the same time, and must not call the methods of
+    * the index. An empty function, the default, builds silently.
+    * @param min_interval - The least time in seconds between two reports
+    */
+    void set_progress_callback(ProgressCallback callback, double min_interval = 1) {
+        progress_callback = callback;
+        progress_interval_ns = min_interval * 1e9;
+    }
+
+    /**
+    * Makes the index keep a quantized copy of the data, against which the linear
+    * search of the queries scores all candidates. Only the shortlist nearest of
+    * them are then scored with the data itself, which can stay in a memory mapped
+    * file as the quantized copy is a half (FLOAT16), a quarter (INT8) or, with PQ
+    * codes, a fraction 1 / (4 * dim / subspaces) of its size; BINARY codes take
+    * n_trees * depth bits rounded up to 64, and PCA codes 4 * subspaces bytes.
+    * The copy is made, and the PQ codebooks, BINARY medians and principal
+    * components of PCA trained, here and whenever the index is
+    * grown, loaded or reordered, and BINARY codes also when the random vectors
+    * change; it is not saved in index files. Must not be called concurrently
+    * with queries.
+    * @param type - The quantization of the copy, or FLOAT32 to release it and
+    * score all candidates with the data
+    * @param shortlist - The number of candidates re-ranked with the data, at least k;
+    * 0 re-ranks 4 * k of them. If negative, nothing is re-ranked and the queries
+    * return the distances by the quantized copy, so the data is not read at all.
+    * @param subspaces - The number of subspaces, and bytes per vector, of PQ codes;
+    * 0 uses dim / 8 rounded up. For PCA the number of principal components,
+    * 0 using dim / 4 rounded up
+    * @return false if the quantized copy cannot score the metric of the index,
+    * which is then left unquantized; the copy scores Euclidean distances only.
+    * Also false for BINARY codes with a negative shortlist, and for 8-bit data,
+    * which is its own INT8 copy.
+    */
+    bool set_quantization(Quantization type, int shortlist = 0, int subspaces = 0) {
+        if ((type != FLOAT32 && metric != EUCLIDEAN) || (type == BINARY && shortlist < 0) || byte_data)
+            return false;
+        wait_load();
+        ++n_changes;
+        quantization = type;
+        shortlist_size = shortlist;
+        pq_subspaces = std::min(dim, subspaces > 0 ? subspaces : type == PCA ? (dim + 3) / 4 : (dim + 7) / 8);
+        quantize_data();
+        return true;
+    }
+
+    /**
+    * Makes the index keep a copy of the n_dimensions dimensions of the data of
+    * the largest variance, in decreasing order of variance and side by side for
+    * each point, and makes the linear search of the EUCLIDEAN metric score a
+    * candidate on them first once k candidates are found. The partial sum is a
+    * lower bound of the squared distance, so a candidate whose partial sum does
+    * not beat the k-th nearest so far is rejected without reading its vector,
+    * and only the others are scored with the data. The neighbors found are the
+    * same. It pays off when the variance of the data is concentrated in a few
+    * of its dimensions, and the copy takes n_dimensions / dim of the memory of
+    * the data. The dimensions are ranked and the copy made here and whenever the
+    * index is grown or loaded, and the copy follows the reordering and the
+    * insertions of the data; neither is saved in index files. Must not be
+    * called concurrently with queries.
+    * @param n_dimensions - The number of leading dimensions, at most dim, or 0
+    * to release the copy
+    */
+    void set_leading_dimensions(int n_dimensions) {
+        wait_load();
+        ++n_changes;
+        leading_dimensions.resize(std::max(0, std::min(dim, n_dimensions)));
+        copy_leading_dimensions(0, true);
+    }
+
+    /**
+    * Makes the single queries project onto a copy of the dense random matrix
+    * rounded to half precision floats (FLOAT16) or to 8-bit codes with a step
+    * per row (INT8), which the matrix-vector product of a query reads in a half
+    * or a quarter of the bytes with the SIMD kernels. The trees grown from now
+    * on are built with the random matrix rounded the same way, so that their
+    * split points match the projections of the queries; the builds and the
+    * batch queries still multiply by it in float. In trees grown before, the
+    * queries are routed with the rounded matrix against the split points of
+    * the exact one, which loses a little recall near the splits. The copy is
+    * made here and whenever the random matrix changes, by growing, loading or
+    * pruning. The precision is not saved in index files, but a rounded random
+    * matrix is, and setting the precision again after loading rounds it to the
+    * same copy. Must not be called concurrently with queries.
+    * @param type - FLOAT16 or INT8, or FLOAT32 to release the copy (the default)
+    * @return false for other types, and for sparse or HADAMARD projections,
+    * which have no dense matrix to round; the precision is then left as it was
+    */
+    bool set_projection_precision(Quantization type) {
+        if ((type != FLOAT32 && type != FLOAT16 && type != INT8) ||
+            (type != FLOAT32 && (density < 1 || projection == HADAMARD)))
+            return false;
+        wait_load();
+        ++n_changes;
+        projection_precision = type;
+        quantize_projection();
+        return true;
+    }
+
+    /**
+    * Makes the index keep the centroid of every leaf and the radius of the ball
+    * around it that holds the points of the leaf, together with the squared
+    * norms of the data. The multi-probe queries with votes_required 1 then
+    * score the leaves they visit in ascending order of the lower bound the ball
+    * gives for the distance of their points, and stop at the first leaf whose
+    * bound is past the k-th nearest point found so far; the results are the
+    * same. The bounds take dim + 1 floats per leaf of every tree. They are made
+    * here and whenever the trees are grown, pruned or regrown, kept up to date
+    * by insert, and saved in index files, from which load reads them. Not used
+    * with a quantized copy of the data. Must not be called concurrently with
+    * queries.
+    * @param enable - Whether the bounds are kept
+    * @return false if the metric of the index is not EUCLIDEAN or the index
+    * has no data or trees, and then no bounds are kept
+    */
+    bool set_leaf_bounds(bool enable) {
+        wait_load();
+        leaf_centroids.resize(0, 0);
+        leaf_radii.resize(0);
+        if (!enable)
+            return true;
+        if (metric != EUCLIDEAN || X->cols() != n_samples || !trees_loaded())
+            return false;
+        compute_leaf_bounds();
+        return true;
+    }
+
+    /**
+    * Gives the index a k-nearest-neighbor graph of the data, such as one made by
+    * knn_graph, that the queries walk after the linear search to find the near
+    * neighbors the trees missed; see set_graph_walk. The graph is copied into
+    * the index and is not saved in index files. Points inserted after it was
+    * made have no neighbors in it, and removed points are skipped. Must not be
+    * called concurrently with queries.
+    * @param n - The number of points the graph has neighbors for, the first n
+    * points; 0 releases the graph
+    * @param indptr - Offsets of size n + 1; the neighbors of point i are
+    * neighbors[indptr[i], indptr[i + 1])
+    * @param neighbors - The ids of the neighbors
+    * @return false if n is past the number of points or an id is out of range,
+    * and then the graph is left as it was
+    */
+    bool set_graph(int n, const int64_t *indptr, const int *neighbors) {
+        if (n < 0 || n > n_samples)
+            return false;
+        for (int i = 0; i < n; ++i) {
+            if (indptr[i + 1] < indptr[i])
+                return false;
+        }
+        const int64_t n_edges = n ? indptr[n] - indptr[0] : 0;
+        for (int64_t e = 0; e < n_edges; ++e) {
+            if (neighbors[indptr[0] + e] < 0 || neighbors[indptr[0] + e] >= n_samples)
+                return false;
+        }
+        wait_load();
+        ++n_changes;
+        graph_indptr.assign(n ? n + 1 : 0, 0);
+        for (int i = 0; n && i <= n; ++i)
+            graph_indptr[i] = indptr[i] - indptr[0];
+        graph_neighbors.assign(neighbors + (n ? indptr[0] : 0), neighbors + (n ? indptr[n] : 0));
+        return true;
+    }
+
+    /**
+    * Builds a k-nearest-neighbor graph of the data with knn_graph and gives it
+    * to the index with set_graph. Must not be called concurrently with queries.
+    * @param degree - The number of neighbors of each point
+    * @param votes_required - See knn_graph
+    * @return The number of edges of the graph
+    */
+    int64_t build_graph(int degree, int votes_required = 1) {
+        wait_load();
+        std::vector<int64_t> indptr(n_samples + 1);
+        std::vector<int> neighbors((size_t) n_samples * degree);
+        const int64_t n_edges = knn_graph(degree, votes_required, indptr.data(), neighbors.data());
+        neighbors.resize(n_edges);
+        neighbors.shrink_to_fit();
+        ++n_changes;
+        graph_indptr.swap(indptr);
+        graph_neighbors.swap(neighbors);
+        return n_edges;
+    }
+
+    /**
+    * Makes the queries walk the graph of set_graph or build_graph from the
+    * neighbors their linear search found, as the search layer of HNSW walks
+    * from its entry point: the walk takes the nearest point found whose
+    * neighbors in the graph it has not scored yet, scores them, and keeps the
+    * beam nearest points found. It stops after expanding n_hops points, or
+    * when the nearest point left to expand is farther than all those kept.
+    * Around a high recall, a few hops find more of the true neighbors than
+    * adding trees does at the same cost. The walk is skipped by queries with a
+    * deadline and when the quantized copy of the data is not re-ranked. Must
+    * not be called concurrently with queries.
+    * @param n_hops - The most points a query expands, 0 for no walk (the default)
+    * @param beam - The number of nearest points kept, at least k; 0 keeps k
+    */
+    void set_graph_walk(int n_hops, int beam = 0) {
+        wait_load();
+        ++n_changes;
+        graph_hops = std::max(0, n_hops);
+        graph_beam = std::max(0, beam);
+    }
+
+    /**
+    * This function finds the k approximate nearest neighbors of the query object
+    * q from a set of candidate leaves. The accuracy of the query depends on both the parameters used for index
+    * construction and additional parameters given to this function. This
+    * function implements two tricks to improve performance. The voting trick
+    * interprets each index object in leaves returned by tree traversals as votes,
+    * and only performs the final linear search with the 'elect' most voted
+    * objects.
+    * @param q - The query object whose neighbors the function finds
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    * @param leaves - Array containing candidate leaves
+    * @param num_leaves - Size of the array containing candidate leaves
+    * @return
+    */
+    void query_from_leaves(const Ref<const VectorXf> &q, const int *leaves, int num_leaves, int k,
+        int votes_required, int *out, float *out_distances = nullptr) const {
+        query_from_leaves(q, leaves, num_leaves, k, votes_required, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_from_leaves(const Ref<const VectorXf> &q, const int *leaves, int num_leaves, int k,
+        int votes_required, int *out, float *out_distances, QueryScratch &scratch) const {
+
+        int n_elected = 0, n_touched = 0;
+        scratch.reserve(std::min(num_leaves, n_samples));
+        scratch.select_counters(n_samples, num_leaves, votes_required == 1);
+
+        std::vector<int> internal_leaves;
+        leaves = to_internal(leaves, num_leaves, internal_leaves);
+
+        count_votes(leaves, num_leaves, votes_required, scratch, n_elected, n_touched);
+        if (n_elected < k)
+            elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+        clear_votes(scratch, n_touched);
+        if (sort_candidates)
+            sort_ids(scratch.elected.data(), n_elected, scratch.touched.data());
+
+        exact_knn(q, k, scratch.elected.data(), n_elected, scratch, out, out_distances);
+    }
+
+    /**
+    * This function finds the dimensions corresponding to a leaf index.
+    * @param leaf_index - Index of the leaf whose coordinates are to be found
+    * @param coordinates - Pointer to array containing all the dimensions
+    */
+    void get_leaf_info(int leaf_index, float* coordinates) {
+        const float *x = column(to_internal(leaf_index));
+        std::copy(x, x + dim, coordinates);
+    }
+
+    void filter_leaves_by_votes(const int *leaves, int num_leaves,std::vector<int> *voted_leaves, int votes_required) const {
+        const size_t first = voted_leaves->size();
+        voted_leaves->resize(first + num_leaves);
+        const int n_elected = filter_votes(leaves, num_leaves, votes_required, voted_leaves->data() + first,
+                                           thread_scratch());
+        voted_leaves->resize(first + n_elected);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each query from a set of
+    * candidate leaves of its own, like query_from_leaves, with the queries
+    * divided between the threads.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param indptr - The candidates of query i are leaves[indptr[i], indptr[i + 1])
+    * @param leaves - The candidates of all the queries
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer of size k * n_queries, laid out as in query_batch
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_from_leaves_batch(const Ref<const MatrixXf> &Q, const int64_t *indptr, const int *leaves, int k,
+                                 int votes_required, int *out, float *out_distances = nullptr) const {
+        const int n_queries = Q.cols();
+
+        parallel_for(n_queries, [&](int i) {
+            query_from_leaves(Q.col(i), leaves + indptr[i], indptr[i + 1] - indptr[i], k, votes_required,
+                              out + (size_t) i * k, out_distances ? out_distances + (size_t) i * k : nullptr,
+                              thread_scratch());
+        }, 1, query_threads());
+    }
+
+    /**
+    * Keeps the candidates with at least votes_required votes for each of several
+    * candidate sets, like filter_leaves_by_votes, with the sets divided between
+    * the threads. The sets and the result are compressed sparse rows.
+    * @param n_queries - The number of candidate sets
+    * @param indptr - Set i is leaves[indptr[i], indptr[i + 1])
+    * @param leaves - The candidates of all the sets
+    * @param votes_required - The number of times a candidate must appear in its set
+    * @param out_indptr - Output buffer for the n_queries + 1 offsets of the kept candidates
+    * @param out - Output buffer of indptr[n_queries] ids; the kept candidates of set i
+    * are written to out[out_indptr[i], out_indptr[i + 1])
+    * @return The number of candidates kept, out_indptr[n_queries]
+    */
+    int64_t filter_leaves_by_votes_batch(int n_queries, const int64_t *indptr, const int *leaves,
+                                         int votes_required, int64_t *out_indptr, int *out) const {
+        // each set is filtered in place of its own candidates, and the kept ones are then packed
+        parallel_for(n_queries, [&](int i) {
+            out_indptr[i + 1] = filter_votes(leaves + indptr[i], indptr[i + 1] - indptr[i], votes_required,
+                                             out + indptr[i], thread_scratch());
+        }, 1, query_threads());
+
+        out_indptr[0] = 0;
+        for (int i = 0; i < n_queries; ++i) {
+            const int64_t n_kept = out_indptr[i + 1];
+            std::copy(out + indptr[i], out + indptr[i] + n_kept, out + out_indptr[i]);
+            out_indptr[i + 1] = out_indptr[i] + n_kept;
+        }
+        return out_indptr[n_queries];
+    }
+
+    /**
+    * This function finds all the leaves that correspond to a query q.
+    * @param q - The query object whose leaves are to be returned
+    * @param leaf_indices - The vector that will contain the leaf indices on returning
+    */
+    void get_leaf_indices(const Ref<const VectorXf> &q, std::vector<int> *leaf_indices) const {
+        VectorXi found_leaves = find_leaves(q);
+        for_each_leaf_point(found_leaves.data(), [&](int id) { leaf_indices->push_back(to_external(id)); });
+    }
+
+    VectorXi find_leaves(const Ref<const VectorXf> &q) const {
+        const VectorXf projected_query = project_query(q);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        return found_leaves;
+    }
+
+    /**
+    * Same as find_leaves, from the projections of q computed with project_query.
+    * @param found_leaves - Output buffer for the leaf of q in each of the n_trees trees
+    */
+    void find_leaves_projected(const float *projected_query, int *found_leaves) const {
+        route(projected_query, found_leaves);
+    }
+
+    /**
+    * Finds the leaves that insert would put the points stored as the columns of
+    * P into: the points are projected and transformed like the data of the
+    * metric, unlike the queries of find_leaves_batch.
+    * @return n_trees x n_points matrix whose column i has the leaves of point i
+    */
+    MatrixXi find_point_leaves(const Ref<const MatrixXf> &P) const {
+        MatrixXf projected = project_points(P);
+        transform_projections(0, projected, P.colwise().squaredNorm().transpose());
+        MatrixXi found_leaves(n_trees, P.cols());
+        for (int i = 0; i < P.cols(); ++i)
+            route(projected.col(i).data(), found_leaves.col(i).data());
+        return found_leaves;
+    }
+
+    /**
+    * This function finds the leaves of all trees for each of the queries stored
+    * as the columns of Q. The whole block of queries is projected with a single
+    * matrix-matrix product, so that the random matrix is read once per block
+    * instead of once per query.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @return n_trees x n_queries matrix whose column i has the leaves of query i
+    */
+    MatrixXi find_leaves_batch(const Ref<const MatrixXf> &Q) const {
+        const int n_queries = Q.cols(), block_size = 64;
+        MatrixXi found_leaves(n_trees, n_queries);
+
+        parallel_for((n_queries + block_size - 1) / block_size, [&](int b) {
+            const int first = b * block_size, n = std::min(block_size, n_queries - first);
+            const MatrixXf projected_queries = project_queries(Q.middleCols(first, n));
+            for (int i = 0; i < n; ++i)
+                route(projected_queries.col(i).data(), found_leaves.col(first + i).data());
+        }, 1, query_threads());
+        return found_leaves;
+    }
+
+    /**
+    * Counts the points in the leaves found by find_leaves_batch, as the offsets of
+    * compressed sparse rows: the points of query i are to be written to
+    * [indptr[i], indptr[i + 1]) by copy_leaf_points. Deleted points are not counted.
+    * @param found_leaves - The leaves of the queries returned by find_leaves_batch
+    * @param indptr - Output buffer for the n_queries + 1 offsets, the first of which is 0
+    * @return The number of points in all the leaves, indptr[n_queries]
+    */
+    int64_t count_leaf_points(const MatrixXi &found_leaves, int64_t *indptr) const {
+        const int n_queries = found_leaves.cols();
+        indptr[0] = 0;
+
+        parallel_for(n_queries, [&](int i) {
+            int64_t count = 0;
+            if (n_stale) {
+                for_each_leaf_point(found_leaves.col(i).data(), [&](int) { ++count; });
+            } else {
+                // without deleted points the counts are the sizes of the leaves
+                for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                    const int leaf = found_leaves(n_tree, i);
+                    if (leaf < 0)
+                        continue;
+                    count += leaf_size(n_tree, leaf);
+                    if (!inserted_leaves.empty())
+                        count += inserted_leaves[n_tree * (1 << depth) + leaf].size();
+                }
+            }
+            indptr[i + 1] = count;
+        }, 64, n_queries > 64 ? query_threads() : 1);
+        for (int i = 0; i < n_queries; ++i)
+            indptr[i + 1] += indptr[i];
+        return indptr[n_queries];
+    }
+
+    /**
+    * Writes the original ids of the points in the leaves of each query into the
+    * rows of compressed sparse rows counted by count_leaf_points, a point once for
+    * every tree in which it is in the leaf of the query. The queries are divided
+    * between the threads.
+    * @param found_leaves - The leaves of the queries returned by find_leaves_batch
+    * @param indptr - The offsets filled by count_leaf_points
+    * @param indices - Output buffer of indptr[n_queries] ids
+    */
+    void copy_leaf_points(const MatrixXi &found_leaves, const int64_t *indptr, int *indices) const {
+        const int n_queries = found_leaves.cols();
+
+        parallel_for(n_queries, [&](int i) {
+            int *out = indices + indptr[i];
+            for_each_leaf_point(found_leaves.col(i).data(), [&](int id) { *out++ = to_external(id); });
+        }, 64, n_queries > 64 ? query_threads() : 1);
+    }
+
+    /**
+    * Writes the original ids of the points in the leaves of tree n_tree, leaf
+    * after leaf, as compressed sparse rows: the points of leaf i are written to
+    * [indptr[i], indptr[i + 1]) of ids. The points inserted into a leaf follow
+    * the others, and deleted points are left out. Used for example to lay the
+    * data out on disk by the leaves.
+    * @param n_tree - The tree, in [0, trees_loaded())
+    */
+    void leaf_points(int n_tree, std::vector<int64_t> &indptr, std::vector<int> &ids) const {
+        std::vector<int> found_leaves(n_trees, -1);
+        indptr.assign(1, 0);
+        ids.clear();
+        for (int leaf = 0; leaf < (1 << depth); ++leaf) {
+            found_leaves[n_tree] = leaf;
+            for_each_leaf_point(found_leaves.data(), [&](int id) { ids.push_back(to_external(id)); });
+            indptr.push_back(ids.size());
+        }
+    }
+
+    /**
+    * Projects the query q onto all n_pool random vectors, or only onto the
+    * first n_rows of them if n_rows is not negative, except with HADAMARD
+    * projections. With the INNER_PRODUCT and COSINE metrics the query is
+    * normalized first.
+    */
+    VectorXf project_query(const Ref<const VectorXf> &q, int n_rows = -1) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.project_query");
+        if (n_rows < 0 || projection == HADAMARD)
+            n_rows = n_pool;
+        VectorXf projected_query(n_rows);
+        if (projection == HADAMARD)
+            hadamard_project(q.data(), projected_query.data());
+        else if (density < 1)
+            multiply_sparse(0, n_rows, q, projected_query);
+        else if (projection_half.size() || projection_int8.size())
+            project_rounded(q, n_rows, projected_query.data());
+        else
+            projected_query.noalias() = dense_matrix.topRows(n_rows) * q;
+        if (metric != EUCLIDEAN)
+            projected_query *= inverse_norm(q.squaredNorm());
+        return projected_query;
+    }
+
+    /**
+    * Projects the queries stored as the columns of Q onto all n_pool random
+    * vectors with a single matrix-matrix product. With the INNER_PRODUCT and
+    * COSINE metrics the queries are normalized first.
+    */
+    MatrixXf project_queries(const Ref<const MatrixXf> &Q) const {
+        MatrixXf projected_queries = project_points(Q);
+        if (metric != EUCLIDEAN) {
+            for (int i = 0; i < Q.cols(); ++i)
+                projected_queries.col(i) *= inverse_norm(Q.col(i).squaredNorm());
+        }
+        return projected_queries;
+    }
+
+    /**
+    * This function finds the k approximate nearest neighbors of the query object
+    * q. The accuracy of the query depends on both the parameters used for index
+    * construction and additional parameters given to this function. This
+    * function implements two tricks to improve performance. The voting trick
+    * interprets each index object in leaves returned by tree traversals as votes,
+    * and only performs the final linear search with the 'elect' most voted
+    * objects.
+    * @param q - The query object whose neighbors the function finds
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    * @return
+    */
+    void query(const Ref<const VectorXf> &q, int k, int votes_required, int *out, float *out_distances = nullptr) const {
+        query(q, k, votes_required, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query(const Ref<const VectorXf> &q, int k, int votes_required, int *out, float *out_distances,
+               QueryScratch &scratch) const {
+        if (query_planner && plan_query(k, votes_required, scratch.filter) == PLAN_BRUTE_FORCE) {
+            brute_force_query(q, k, out, out_distances, scratch);
+            return;
+        }
+        const int64_t start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+        scratch.projected_query = projected_query.data();
+        query_from_found_leaves(q, found_leaves.data(), k, votes_required, out, out_distances, scratch);
+        scratch.projected_query = nullptr;
+        record_query(start);
+        monitor_recall(q, k, out);
+    }
+
+    /**
+    * Same as query, but takes the projections of q computed earlier with
+    * project_query, of this index or of another one whose random matrix this
+    * index shares through share_random_matrix.
+    * @param projected_query - The projections of q onto all n_pool random vectors
+    */
+    void query_projected(const Ref<const VectorXf> &q, const float *projected_query, int k, int votes_required,
+                         int *out, float *out_distances = nullptr) const {
+        const int64_t start = metrics_clock();
+        QueryScratch &scratch = thread_scratch();
+        int64_t time = stats_clock(scratch);
+        VectorXi found_leaves(n_trees);
+        route(projected_query, found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+        scratch.projected_query = projected_query;
+        query_from_found_leaves(q, found_leaves.data(), k, votes_required, out, out_distances, scratch);
+        scratch.projected_query = nullptr;
+        record_query(start);
+    }
+
+    /**
+    * Same as query, but answers as the smaller index cut from this one by
+    * prune(n_trees_used, depth_used) would: only the first n_trees_used trees
+    * vote, and each with the leaf of q in the tree cut at level depth_used,
+    * which holds the points of 2^(depth - depth_used) leaves of the full tree.
+    * One index can so serve queries of several speeds and recalls, with the
+    * configurations of autotune, without pruning copies of it.
+    * @param n_trees_used - The number of trees used, 1 <= n_trees_used <= n_trees
+    * @param depth_used - The depth the trees are used to, 1 <= depth_used <= depth
+    */
+    void query_pruned(const Ref<const VectorXf> &q, int k, int votes_required, int n_trees_used, int depth_used,
+                      int *out, float *out_distances = nullptr) const {
+        query_pruned(q, k, votes_required, n_trees_used, depth_used, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_pruned(const Ref<const VectorXf> &q, int k, int votes_required, int n_trees_used, int depth_used,
+                      int *out, float *out_distances, QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        n_trees_used = std::max(1, std::min(n_trees_used, n_trees));
+        depth_used = std::max(1, std::min(depth_used, depth));
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q, n_trees_used * depth);
+        add_time(scratch, &QueryStats::projection_ns, time);
+
+        VectorXi found_leaves = VectorXi::Constant(n_trees, -1);
+        const int n_routed = std::min(n_trees_used, trees_loaded());
+        for (int n_tree = 0; n_tree < n_routed; ++n_tree) {
+            const float *split = split_data + (size_t) n_tree * n_array;
+            const float *projections = projected_query.data() + n_tree * depth;
+            int idx_tree = 0;
+            for (int d = 0; d < depth_used; ++d)
+                idx_tree = 2 * idx_tree + 2 - (projections[d] <= split[idx_tree]);
+            found_leaves(n_tree) = idx_tree - (1 << depth_used) + 1;
+        }
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        scratch.pruned_levels = depth - depth_used;
+        query_from_found_leaves(q, found_leaves.data(), k, votes_required, out, out_distances, scratch);
+        scratch.pruned_levels = 0;
+        record_query(start);
+    }
+
+    /**
+    * Same as query, but votes only with the n_trees_used trees most confident
+    * of the leaf of q: those with the largest margins, the smallest distance
+    * between a projection of q and a split point it is compared with on the
+    * way down. A tree where q grazed a split is the likeliest to have put it
+    * in the wrong leaf, so dropping such trees takes out noisy candidates as
+    * well as the work of counting their votes. Each query chooses its own
+    * trees; votes_required counts the votes of the trees used.
+    * @param n_trees_used - The number of trees that vote, 1 <= n_trees_used <= n_trees
+    */
+    void query_confident(const Ref<const VectorXf> &q, int k, int votes_required, int n_trees_used, int *out,
+                         float *out_distances = nullptr) const {
+        query_confident(q, k, votes_required, n_trees_used, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_confident(const Ref<const VectorXf> &q, int k, int votes_required, int n_trees_used, int *out,
+                         float *out_distances, QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        n_trees_used = std::max(1, std::min(n_trees_used, n_trees));
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+
+        if (n_trees_used < n_trees) {
+            // the trees not loaded yet have no margin and are dropped first
+            std::vector<std::pair<float, int>> margins(n_trees);
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+                margins[n_tree] = std::make_pair(found_leaves(n_tree) < 0 ? -1.0f
+                                                 : tree_margin(n_tree, projected_query.data()), n_tree);
+            std::nth_element(margins.begin(), margins.begin() + n_trees_used, margins.end(),
+                             std::greater<std::pair<float, int>>());
+            for (int i = n_trees_used; i < n_trees; ++i)
+                found_leaves(margins[i].second) = -1;
+        }
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        scratch.projected_query = projected_query.data();
+        query_from_found_leaves(q, found_leaves.data(), k, votes_required, out, out_distances, scratch);
+        scratch.projected_query = nullptr;
+        record_query(start);
+    }
+
+    /**
+    * Same as query, and fills confidence with signals of how hard the query
+    * was, see QueryConfidence. The linear search keeps the k + 1 nearest
+    * candidates to measure the gap after the kth, and the votes of the
+    * neighbors are counted, so the query costs about as much as query.
+    * @param confidence - Filled with the signals of the query
+    */
+    void query_confidence(const Ref<const VectorXf> &q, int k, int votes_required, int *out, float *out_distances,
+                          QueryConfidence &confidence) const {
+        query_confidence(q, k, votes_required, out, out_distances, confidence, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_confidence(const Ref<const VectorXf> &q, int k, int votes_required, int *out, float *out_distances,
+                          QueryConfidence &confidence, QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        std::vector<int> ids(k + 1), votes(k + 1);
+        std::vector<float> distances(k + 1);
+        scratch.projected_query = projected_query.data();
+        query_from_found_leaves(q, found_leaves.data(), k + 1, votes_required, ids.data(), distances.data(), scratch,
+                                0, 0, votes.data(), &confidence);
+        scratch.projected_query = nullptr;
+        std::copy(ids.begin(), ids.begin() + k, out);
+        if (out_distances)
+            std::copy(distances.begin(), distances.begin() + k, out_distances);
+
+        // the votes are weighted by the margins where query_from_found_leaves weights them
+        const int n_voting = (found_leaves.array() >= 0).count();
+        const int max_votes = n_voting * (margin_thresholds.size() ? margin_levels() : 1);
+        int n_found = 0;
+        int64_t found_votes = 0;
+        for (int i = 0; i < k && ids[i] >= 0; ++i, ++n_found)
+            found_votes += votes[i];
+        confidence.vote_concentration = n_found && max_votes ? (float) found_votes / ((float) n_found * max_votes) : 0;
+        confidence.distance_gap = ids[k] >= 0 ? distances[k] - distances[k - 1] : -1;
+        record_query(start);
+        monitor_recall(q, k, out);
+    }
+
+    /**
+    * Same as query, but visits the trees one at a time and stops once the
+    * answer has settled: the candidates elected by each tree are scored right
+    * away into the k nearest so far, and the query stops when these have not
+    * changed for patience trees in a row, or after max_trees trees. An easy
+    * query, whose nearest neighbors are found by the first trees, so visits
+    * only a few more, while a hard one visits up to max_trees. The fallback to
+    * the most voted samples applies to the trees visited. With a quantized
+    * copy of the data or with 8-bit data, all trees are visited, as by query,
+    * and the graph walk of set_graph_walk is not used.
+    * @param patience - The number of trees in a row that leave the k nearest unchanged after
+    * which the query stops, counted once k candidates have been scored
+    * @param max_trees - The most trees visited, or 0 for all of them
+    * @return The number of trees visited
+    */
+    int query_early_stop(const Ref<const VectorXf> &q, int k, int votes_required, int patience, int *out,
+                         float *out_distances = nullptr, int max_trees = 0) const {
+        return query_early_stop(q, k, votes_required, patience, out, out_distances, max_trees, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    int query_early_stop(const Ref<const VectorXf> &q, int k, int votes_required, int patience, int *out,
+                         float *out_distances, int max_trees, QueryScratch &scratch) const {
+        if (codes.size()) {
+            query(q, k, votes_required, out, out_distances, scratch);
+            return n_trees;
+        }
+        const int64_t start = metrics_clock();
+        const int n_used = max_trees > 0 ? std::min(max_trees, n_trees) : n_trees;
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q, n_used * depth);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves = VectorXi::Constant(n_used, -1);
+        for (int n_tree = 0; n_tree < std::min(n_used, trees_loaded()); ++n_tree) {
+            const float *split = split_data + (size_t) n_tree * n_array;
+            const float *projections = projected_query.data() + n_tree * depth;
+            int idx_tree = 0;
+            for (int d = 0; d < depth; ++d)
+                idx_tree = 2 * idx_tree + 2 - (projections[d] <= split[idx_tree]);
+            found_leaves(n_tree) = idx_tree - (1 << depth) + 1;
+        }
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        const int max_leaf_size = n_samples / (1 << depth) + 1;
+        scratch.reserve(std::min<int64_t>((int64_t) n_used * max_leaf_size, n_samples));
+        scratch.select_counters(n_samples, n_used, votes_required == 1);
+        const mrpt_kernels::DistanceFunction distance = metric == EUCLIDEAN ? dim_kernels->l2
+                                                                            : dim_kernels->dot;
+        const float *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const float query_scale = metric == COSINE ? inverse_norm(q.squaredNorm()) : 1;
+        TopK &heap = scratch.heap;
+        heap.reset(k);
+        // scores the candidates elected since the last call, and returns whether any entered the k nearest
+        int n_elected = 0, n_touched = 0, n_scored = 0;
+        auto score_elected = [&]() {
+            bool changed = false;
+            for (; n_scored < n_elected; ++n_scored) {
+                const int id = scratch.elected(n_scored);
+                const float value = score(distance(q.data(), column(id), dim), id, norms, query_scale);
+                changed |= value < heap.threshold();
+                heap.push(value, id);
+            }
+            return changed;
+        };
+
+        int n_visited = 0;
+        for (int unchanged = 0; n_visited < n_used && (heap.items().size() < (size_t) k || unchanged < patience);) {
+            const int leaf = found_leaves(n_visited++);
+            if (leaf >= 0)
+                count_leaf_votes(n_visited - 1, leaf, votes_required, scratch, n_elected, n_touched);
+            unchanged = score_elected() ? 0 : unchanged + 1;
+        }
+        const bool fallback = n_elected < k && votes_required > 1;
+        if (fallback) {
+            elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+            score_elected();
+        }
+        clear_votes(scratch, n_touched);
+        extract_knn(heap, out, out_distances);
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_touched, n_elected, fallback);
+        record_query(start);
+        return n_visited;
+    }
+
+    /**
+    * Same as query, but returns only points that pass filter. The points that
+    * do not pass are skipped while the votes are counted, so the linear search
+    * scores only points that do. A filter passed by at most as many points as
+    * the leaves of q hold in total is searched by brute force instead, which
+    * then finds the exact nearest neighbors among them at a similar cost.
+    * @param filter - The points that may be returned, from make_filter or filter_where
+    */
+    void query_filtered(const Ref<const VectorXf> &q, int k, int votes_required, const Filter &filter, int *out,
+                        float *out_distances = nullptr) const {
+        query_filtered(q, k, votes_required, filter, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_filtered(const Ref<const VectorXf> &q, int k, int votes_required, const Filter &filter, int *out,
+                        float *out_distances, QueryScratch &scratch) const {
+        const int max_leaf_size = n_samples / (1 << depth) + 1;
+        scratch.filter = &filter;
+        if (!query_planner && filter.count() <= (int64_t) n_trees * max_leaf_size)
+            brute_force_query(q, k, out, out_distances, scratch);
+        else
+            query(q, k, votes_required, out, out_distances, scratch);
+        scratch.filter = nullptr;
+    }
+
+    /**
+    * Same as query, but never returns the points in excluded, such as the
+    * indexed point a query was made from and the items a user has already
+    * seen. The excluded points get no votes, so they are neither elected nor
+    * scored, and the query finds k other neighbors without asking for
+    * k + n_excluded and dropping them afterwards. Ids out of range are ignored.
+    * @param excluded - The ids of the points not returned, in any order
+    * @param n_excluded - The number of ids in excluded
+    */
+    void query_excluding(const Ref<const VectorXf> &q, int k, int votes_required, const int *excluded, int n_excluded,
+                         int *out, float *out_distances = nullptr) const {
+        query_excluding(q, k, votes_required, excluded, n_excluded, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_excluding(const Ref<const VectorXf> &q, int k, int votes_required, const int *excluded, int n_excluded,
+                         int *out, float *out_distances, QueryScratch &scratch) const {
+        std::vector<uint64_t> &bits = scratch.excluded_bits;
+        if (bits.size() < (size_t) (n_samples + 63) / 64)
+            bits.resize((n_samples + 63) / 64);
+        for (int i = 0; i < n_excluded; ++i) {
+            if (excluded[i] >= 0 && excluded[i] < n_samples) {
+                const int id = to_internal(excluded[i]);
+                bits[id >> 6] |= (uint64_t) 1 << (id & 63);
+            }
+        }
+        scratch.excluded = bits.data();
+        query(q, k, votes_required, out, out_distances, scratch);
+        scratch.excluded = nullptr;
+        for (int i = 0; i < n_excluded; ++i) {
+            if (excluded[i] >= 0 && excluded[i] < n_samples)
+                bits[to_internal(excluded[i]) >> 6] = 0;
+        }
+    }
+
+    /**
+    * Makes query, query_filtered and query_batch choose for each query between
+    * the trees and brute force, by the plan of plan_query, so that small
+    * indexes, filters passed by few points and low votes_required are answered
+    * by the cheaper way. The queries the planner answers by brute force are
+    * counted in QueryStats::n_brute_force. Without the planner, query_filtered
+    * searches a filter by brute force if it passes at most as many points as
+    * the leaves of a query hold, and the other queries always use the trees.
+    */
+    void set_query_planner(bool enabled) {
+        query_planner = enabled;
+    }
+
+    /**
+    * Sets the costs plan_query estimates the plans with.
+    */
+    void set_planner_costs(const PlannerCosts &costs) {
+        plan_costs = costs;
+    }
+
+    /**
+    * Returns the costs plan_query estimates the plans with.
+    */
+    PlannerCosts planner_costs() const {
+        return plan_costs;
+    }
+
+    /**
+    * Measures the costs of PlannerCosts on this machine with the data of the
+    * index, in a few milliseconds, and sets them for plan_query. The index has
+    * to be built. Keeps the costs as they are for 8-bit data and for an index
+    * whose data was released.
+    * @return The costs set
+    */
+    PlannerCosts calibrate_planner() {
+        if (byte_data || !scannable() || !n_samples || !trees_loaded())
+            return plan_costs;
+        const int m = std::min(n_samples, 1 << 16);
+        const VectorXf q = Map<const VectorXf>(column(0), dim);
+        std::mt19937 rng(1);
+        std::uniform_int_distribution<int> uniform(0, n_samples - 1);
+        std::vector<int> ids(m);
+        for (int &id : ids)
+            id = uniform(rng);
+        // each measurement is repeated for at least a millisecond
+        auto time_ns = [](const std::function<void()> &f) {
+            const int64_t start = mrpt_metrics::now_ns();
+            int64_t reps = 0, elapsed;
+            do {
+                f();
+                ++reps;
+            } while ((elapsed = mrpt_metrics::now_ns() - start) < 1000000);
+            return (double) elapsed / reps;
+        };
+        volatile float sink = 0;
+
+        plan_costs.projection_ns = time_ns([&] { sink = sink + project_query(q)(0); }) /
+                                   ((double) n_pool * dim * (density < 1 ? density : 1));
+        std::vector<uint8_t> counters(n_samples);
+        plan_costs.vote_ns = time_ns([&] {
+            for (int id : ids)
+                ++counters[id];
+        }) / m;
+        sink = sink + counters[ids[0]];
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        plan_costs.gather_ns = time_ns([&] {
+            float sum = 0;
+            for (int id : ids)
+                sum += kernels.l2(q.data(), column(id), dim);
+            sink = sink + sum;
+        }) / ((double) m * dim);
+        TopK heap(10);
+        plan_costs.scan_ns = time_ns([&] {
+            const VectorXf dots = Map<const MatrixXf>(column(0), dim, m).transpose() * q;
+            for (int i = 0; i < m; ++i)
+                heap.push(-2 * dots(i), i);
+        }) / ((double) m * dim);
+        return plan_costs;
+    }
+
+    /**
+    * Chooses how set_query_planner answers a query for k neighbors with
+    * votes_required, by the costs of PlannerCosts. The trees cost the
+    * projection of the query, the votes of the points of its leaves and the
+    * distances to the candidates, of which there are at most the votes over
+    * votes_required, and fewer by the share of the points that pass filter.
+    * Brute force costs a scan of all the points, or the distances to the
+    * points that pass filter. With the data released, the trees are used.
+    * @param filter - The filter of the query, or nullptr for none
+    */
+    QueryPlan plan_query(int k, int votes_required, const Filter *filter = nullptr) const {
+        if (!scannable() || !n_samples)
+            return PLAN_INDEX;
+        const double passed = filter ? filter->count() : n_samples - n_deleted;
+        const double voted = (double) trees_loaded() * (tree_points + n_unmerged) / (1 << depth);
+        const double elected = std::min(passed, std::max<double>(k, voted / std::max(1, votes_required) *
+                                                                     passed / n_samples));
+        const double index_cost = plan_costs.projection_ns * n_pool * dim * (density < 1 ? density : 1) +
+                                  plan_costs.vote_ns * voted + plan_costs.gather_ns * dim * elected;
+        const double brute_cost = filter ? plan_costs.vote_ns * n_samples / 64 + plan_costs.gather_ns * dim * passed
+                                         : plan_costs.scan_ns * dim * n_samples;
+        return brute_cost < index_cost ? PLAN_BRUTE_FORCE : PLAN_INDEX;
+    }
+
+    /**
+    * Attaches an integer attribute to the points, such as a category, for
+    * filter_where to make filters by. Setting an attribute again replaces its
+    * values. The attributes are not saved with the index.
+    * @param name - The name of the attribute
+    * @param values - The value of every point, by the original ids, n_samples of them
+    */
+    void set_attribute(const std::string &name, const int *values) {
+        attributes[name].assign(values, values + n_samples);
+    }
+
+    /**
+    * Makes a filter passed by the points whose value of an attribute compares
+    * to value as op tells, such as filter_where("category", EQUAL, 3, f).
+    * @return false if there is no such attribute, in which case filter is not changed
+    */
+    bool filter_where(const std::string &name, Comparison op, int value, Filter &filter) const {
+        const auto attribute = attributes.find(name);
+        if (attribute == attributes.end())
+            return false;
+        const std::vector<int> &values = attribute->second;
+        Filter passed(n_samples);
+        for (int i = 0; i < (int) values.size(); ++i) {
+            const int v = values[i];
+            const bool pass = op == EQUAL ? v == value : op == NOT_EQUAL ? v != value : op == LESS ? v < value
+                            : op == LESS_EQUAL ? v <= value : op == GREATER ? v > value : v >= value;
+            if (pass) passed.set(to_internal(i));
+        }
+        passed.recount();
+        filter = std::move(passed);
+        return true;
+    }
+
+    /**
+    * Makes a filter passed by the points i for which mask[i] is nonzero.
+    * @param mask - A byte for every point, by the original ids, n_samples of them
+    */
+    Filter make_filter(const uint8_t *mask) const {
+        Filter passed(n_samples);
+        for (int i = 0; i < n_samples; ++i)
+            if (mask[i]) passed.set(to_internal(i));
+        passed.recount();
+        return passed;
+    }
+
+    /**
+    * Makes a filter passed by the n points in ids.
+    * @return A filter passed by no point if an id is out of range
+    */
+    Filter make_filter(const int *ids, int n) const {
+        Filter passed(n_samples);
+        for (int i = 0; i < n; ++i) {
+            if (ids[i] < 0 || ids[i] >= n_samples)
+                return Filter(n_samples);
+            passed.set(to_internal(ids[i]));
+        }
+        passed.recount();
+        return passed;
+    }
+
+    /**
+    * Same as query, but with budgets for answering within a bounded latency.
+    * The elected candidates are scored in decreasing order of their votes, and
+    * the linear search stops when max_distances of them are scored or when
+    * time_budget seconds have passed since the start of the query, returning
+    * the nearest neighbors found until then. The clock is read after every 256
+    * candidates scored, and with a time budget the candidates are not sorted by
+    * id as set with set_prefetch.
+    * The votes of the neighbors, which tell how many trees agree on them, can
+    * be returned too, for example as features for re-ranking the neighbors.
+    * @param max_distances - The most candidates scored, at least k, or 0 for no limit
+    * @param time_budget - The time in seconds the query may take, or 0 for no limit
+    * @param out_votes - If given, output buffer of size k for the number of
+    * trees in which each neighbor shares a leaf with q, 0 where out is -1
+    * @return True if the query was cut short by either budget
+    */
+    bool query_budgeted(const Ref<const VectorXf> &q, int k, int votes_required, int max_distances,
+                        double time_budget, int *out, float *out_distances = nullptr, int *out_votes = nullptr) const {
+        return query_budgeted(q, k, votes_required, max_distances, time_budget, out, out_distances, thread_scratch(),
+                              out_votes);
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    bool query_budgeted(const Ref<const VectorXf> &q, int k, int votes_required, int max_distances,
+                        double time_budget, int *out, float *out_distances, QueryScratch &scratch,
+                        int *out_votes = nullptr) const {
+        const int64_t start = mrpt_metrics::now_ns();
+        const int64_t deadline = time_budget > 0 ? start + (int64_t) (time_budget * 1e9) : 0;
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+        scratch.projected_query = projected_query.data();
+        const bool truncated = query_from_found_leaves(q, found_leaves.data(), k, votes_required, out, out_distances,
+                                                       scratch, max_distances, deadline, out_votes);
+        scratch.projected_query = nullptr;
+        record_query(start);
+        return truncated;
+    }
+
+    /**
+    * Same as query, but chooses the votes required for each query instead of
+    * taking them as a parameter: the highest number of votes that at least
+    * n_candidates samples reach. The threshold is found from a histogram of
+    * the votes of the samples that got one, and where more samples than
+    * n_candidates reach it, those with the fewest votes are left out, so the
+    * linear search of every query scores n_candidates candidates and its
+    * latency varies less than with a fixed votes_required. Fewer are scored
+    * only if fewer samples got a vote.
+    * @param n_candidates - The number of candidates to score, at least k
+    */
+    void query_target(const Ref<const VectorXf> &q, int k, int n_candidates, int *out,
+                      float *out_distances = nullptr) const {
+        query_target(q, k, n_candidates, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_target(const Ref<const VectorXf> &q, int k, int n_candidates, int *out, float *out_distances,
+                      QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        // no sample reaches n_trees + 1 votes, so the counting elects none and
+        // elect_by_max_votes then elects by the histogram of the touched samples
+        int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+        scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+        scratch.select_counters(n_samples, n_trees, false);
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            if (found_leaves(n_tree) >= 0)
+                count_leaf_votes(n_tree, found_leaves(n_tree), n_trees + 1, scratch, n_elected, n_touched);
+        }
+        n_candidates = std::max(k, n_candidates);
+        elect_by_max_votes(n_candidates, n_trees + 1, scratch, n_elected, n_touched);
+        if (n_elected > n_candidates) {
+            // of the samples tied at the threshold, those voted first fill the rest
+            rank_by_votes(scratch, n_elected);
+            n_elected = n_candidates;
+        }
+        clear_votes(scratch, n_touched);
+        add_time(scratch, &QueryStats::voting_ns, time);
+        if (sort_candidates)
+            sort_ids(scratch.elected.data(), n_elected, scratch.touched.data());
+
+        scratch.projected_query = projected_query.data();
+        exact_knn(q, k, scratch.elected.data(), n_elected, scratch, out, out_distances);
+        scratch.projected_query = nullptr;
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_touched, n_elected, false);
+        record_query(start);
+    }
+
+    /**
+    * Returns whether other projects the queries onto the same random vectors as
+    * this index, so that the projections of other, by project_query or
+    * project_queries, can be given to query_projected and query_batch_projected
+    * of this index: whether the indexes have the same dim, n_trees, depth,
+    * density, projection, metric and seed of the random matrix, whether or not
+    * they share the matrix itself through share_random_matrix.
+    */
+    bool same_projection(const Mrpt &other) const {
+        return &other == this ||
+               (other.dim == dim && other.n_trees == n_trees && other.depth == depth && other.density == density &&
+                other.projection == projection && other.metric == metric && other.build_seed == build_seed &&
+                build_seed && other.first_tree == first_tree);
+    }
+
+    /**
+    * Returns the number of random vectors the queries are projected onto, the
+    * length of the projections of project_query.
+    */
+    int projection_size() const {
+        return n_pool;
+    }
+
+    /**
+    * Makes the projections use the random matrix of source instead of a copy of
+    * their own, which is released. Indexes with the same parameters whose random
+    * matrices were generated from the same seed have the same matrix, so they can
+    * keep only one of them, and a query projected by one of them can be routed in
+    * all of them with query_projected. The matrix is reference counted: it is
+    * freed with the last index using it, in whatever order the indexes are
+    * destroyed, and an index that changes it by growing, loading or pruning
+    * gets a matrix of its own, so many small indexes can be served with the
+    * memory of one random matrix. If the random matrix of source is mapped
+    * from an index file, though, the source must outlive this index or until
+    * this index is grown or loaded again.
+    * @param source - Another index with the same dim, n_trees, depth, density,
+    * projection, metric and seed of the random matrix
+    * @return false if the random matrices of the indexes differ, true otherwise
+    */
+    bool share_random_matrix(const Mrpt &source) {
+        wait_load();
+        if (&source == this)
+            return true;
+        if (!same_projection(source) || source.trees_loaded() != source.n_trees)
+            return false;
+
+        // the trees of a mapped index stay mapped
+        random_matrix_mapped = false;
+        if (!source.random_matrix_mapped && !source.random_matrix_shared) {
+            random_matrix = source.random_matrix;
+            use_owned_random_matrix();
+            return true;
+        }
+
+        random_matrix = std::make_shared<RandomMatrix>();
+        new (&dense_matrix) Map<const Matrix<float, Dynamic, Dynamic, RowMajor>>(
+            source.dense_matrix.data(), source.dense_matrix.rows(), source.dense_matrix.cols());
+        new (&sparse_matrix) Map<const SparseMatrix<float, RowMajor>>(
+            source.sparse_matrix.rows(), source.sparse_matrix.cols(), source.sparse_matrix.nonZeros(),
+            source.sparse_matrix.outerIndexPtr(), source.sparse_matrix.innerIndexPtr(),
+            source.sparse_matrix.valuePtr());
+        prepare_projection();
+        random_matrix_shared = true;
+        return true;
+    }
+
+    /**
+    * This function finds the k approximate nearest neighbors of the query object
+    * q like query, but visits several leaves in each tree. After the leaf of q in
+    * every tree, the traversal continues to the branches not taken, in increasing
+    * order of the largest margin |projection of q - split point| at which the path
+    * to the branch deviates from the path of q. The branches of all trees share one
+    * priority queue, so the extra leaves go to the trees in which q lies closest to
+    * a split. The same recall is then reached with fewer trees.
+    * @param q - The query object whose neighbors the function finds
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param max_candidates - The candidate budget: leaves are visited until they hold at least
+    * this many samples in total. The leaf of q in every tree is always visited, so a budget of
+    * 0 gives the same results as query.
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    * @return
+    */
+    void query_multiprobe(const Ref<const VectorXf> &q, int k, int votes_required, int max_candidates, int *out,
+                          float *out_distances = nullptr) const {
+        query_multiprobe(q, k, votes_required, max_candidates, out, out_distances, thread_scratch());
+    }
+
+    /**
+    * Same as above, but uses the caller-owned working memory in scratch
+    * instead of the working memory of the calling thread.
+    */
+    void query_multiprobe(const Ref<const VectorXf> &q, int k, int votes_required, int max_candidates, int *out,
+                          float *out_distances, QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        query_from_probes(q, projected_query.data(), k, votes_required, max_candidates, out, out_distances, scratch);
+        record_query(start);
+    }
+
+    /**
+    * Starts a query whose neighbors are then taken a page at a time with
+    * next_page, for results shown 20 at a time, say. The leaves are visited as
+    * by query_multiprobe, and all the elected candidates are scored and kept
+    * in session, so a page costs only popping the heap of their scores. When
+    * fewer candidates are left than a page needs, the candidate budget is
+    * doubled and more leaves are visited, scoring only the candidates not
+    * scored before.
+    * @param q - The query object whose neighbors are searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param session - The session started, replacing any earlier one it held
+    * @param max_candidates - The candidate budget of the first visit of the leaves, see
+    * query_multiprobe; 0 elects the same candidates as query (optional parameter)
+    * @return
+    */
+    void start_session(const Ref<const VectorXf> &q, int votes_required, QuerySession &session,
+                       int max_candidates = 0) const {
+        const int64_t start = metrics_clock();
+        session.q = q;
+        session.projected_query = project_query(q);
+        session.votes_required = votes_required;
+        session.max_candidates = max_candidates;
+        session.exhausted = false;
+        session.changes = n_changes;
+        session.n_returned = 0;
+        session.heap.clear();
+        session.scored.clear();
+        score_session(session, 1, false, thread_scratch());
+        record_query(start);
+    }
+
+    /**
+    * Returns the next page of the neighbors of the query of session, in order
+    * of distance. The first page holds the same neighbors as query with the
+    * same k when the trees elect at least k candidates. A page for which more
+    * candidates were elected may hold neighbors nearer than those of the
+    * earlier pages, which did not see them. Every point of the index is
+    * returned before a page holds fewer than k.
+    * @param session - A session started by start_session of this index
+    * @param k - The number of neighbors in the page
+    * @param out - The output buffer for the indices of the neighbors
+    * @param out_distances - Output buffer for their distances (optional parameter)
+    * @return The number of neighbors written, fewer than k at the end of the
+    * results, or -1 if the index has changed since the session was started
+    */
+    int next_page(QuerySession &session, int k, int *out, float *out_distances = nullptr) const {
+        if (session.changes != n_changes)
+            return -1;
+        const std::greater<std::pair<float, int>> nearest_first;
+        // the candidates grow before the page is taken, so that it is in order
+        while ((int) session.heap.size() < k && !session.exhausted)
+            score_session(session, k - (int) session.heap.size(), true, thread_scratch());
+        int n = 0;
+        for (; n < k && !session.heap.empty(); ++n) {
+            std::pop_heap(session.heap.begin(), session.heap.end(), nearest_first);
+            const std::pair<float, int> found = session.heap.back();
+            session.heap.pop_back();
+            out[n] = to_external(found.second);
+            if (out_distances)
+                out_distances[n] = metric == EUCLIDEAN ? std::sqrt(found.first) : -found.first;
+        }
+        session.n_returned += n;
+        return n;
+    }
+
+    /**
+    * This function finds the k approximate nearest neighbors of each of the
+    * queries stored as the columns of Q. The queries are split into blocks that
+    * are divided between the threads of set_query_threads. Each block is
+    * projected with one matrix-matrix product, each thread uses its own working
+    * memory, and the work within a single query is done serially.
+    * @param Q - The query objects as a dim x n_queries matrix, whose columns may be
+    * any distance apart, such as the rows of a slice of a larger row-major array
+    * @param k - The number of neighbors the user wants the function to return for each query
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    * @param max_candidates - If positive, each query visits several leaves per tree until they
+    * hold this many samples, as in query_multiprobe (optional parameter)
+    * @param stats - If given, the counters of all the queries are added to it (optional parameter)
+    * @return
+    */
+    void query_batch(const Ref<const MatrixXf> &Q, int k, int votes_required, int *out,
+                     float *out_distances = nullptr, int max_candidates = 0, QueryStats *stats = nullptr) const {
+        query_batch_blocks(Q, nullptr, k, votes_required, out, out_distances, max_candidates, stats);
+    }
+
+    /**
+    * Same as query_batch, but takes the projections of the queries computed
+    * earlier with project_queries, of this index or of another one with the
+    * same_projection. A batch of queries searched in many indexes with the same
+    * random vectors, such as the partitions of the data by tenant or by time,
+    * is so projected once instead of once for each index, which leaves each
+    * index only the routing, the voting and the scoring of the candidates.
+    * @param projected_queries - The projections of the queries, projection_size()
+    * floats for each query one after another, the layout of the matrix of project_queries
+    */
+    void query_batch_projected(const Ref<const MatrixXf> &Q, const float *projected_queries, int k,
+                               int votes_required, int *out, float *out_distances = nullptr, int max_candidates = 0,
+                               QueryStats *stats = nullptr) const {
+        query_batch_blocks(Q, projected_queries, k, votes_required, out, out_distances, max_candidates, stats);
+    }
+
+    /**
+    * Finds the k nearest neighbors of a set of query vectors, such as the items
+    * of a session, stored as the columns of Q. The set is projected with one
+    * matrix-matrix product and each vector routed down the trees; a tree gives
+    * a point one vote if it shares a leaf with any vector of the set, so that
+    * votes_required means the same as in query. The candidates elected are
+    * gathered once, scored against all the vectors of the set with another
+    * matrix product, and ranked by the nearest or the mean of their distances.
+    * With INNER_PRODUCT and COSINE, the largest or the mean of the similarities.
+    * The data is read in float32 or 8-bit, without a quantized copy or graph walk.
+    * @param Q - The query vectors as a dim x n_vectors matrix
+    * @param aggregation - MIN_DISTANCE or MEAN_DISTANCE
+    * @param out - Output buffer of size k, -1 where fewer neighbors are found
+    * @param out_distances - Output buffer of size k for the aggregated distances (optional parameter)
+    * @return False, with out set to -1, if the data was released or Q has no columns
+    */
+    bool query_set(const Ref<const MatrixXf> &Q, int k, int votes_required, SetAggregation aggregation, int *out,
+                   float *out_distances = nullptr) const {
+        std::fill(out, out + k, -1);
+        if (out_distances)
+            std::fill(out_distances, out_distances + k, -1);
+        if (!Q.cols() || !scannable())
+            return false;
+        const int64_t start = metrics_clock();
+        QueryScratch &scratch = thread_scratch();
+        const int n_vectors = Q.cols(), max_leaf_size = n_samples / (1 << depth) + 1;
+        int64_t time = stats_clock(scratch);
+        const MatrixXf projected_queries = project_queries(Q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        MatrixXi found_leaves(n_trees, n_vectors);
+        for (int i = 0; i < n_vectors; ++i)
+            route(projected_queries.col(i).data(), found_leaves.col(i).data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+
+        // a point is in one leaf of a tree, so counting each distinct leaf of a tree once
+        // gives it at most one vote per tree
+        int n_elected = 0, n_touched = 0;
+        scratch.reserve(std::min<int64_t>((int64_t) n_trees * n_vectors * max_leaf_size, n_samples));
+        scratch.select_counters(n_samples, n_trees, votes_required == 1);
+        std::vector<int> leaves(n_vectors);
+        for (int n_tree = 0; n_tree < trees_loaded(); ++n_tree) {
+            for (int i = 0; i < n_vectors; ++i)
+                leaves[i] = found_leaves(n_tree, i);
+            std::sort(leaves.begin(), leaves.end());
+            for (int i = 0; i < n_vectors; ++i)
+                if (leaves[i] >= 0 && (!i || leaves[i] != leaves[i - 1]))
+                    count_leaf_votes(n_tree, leaves[i], votes_required, scratch, n_elected, n_touched);
+        }
+        const bool fallback = n_elected < k && votes_required > 1;
+        if (fallback)
+            elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+        clear_votes(scratch, n_touched);
+        add_time(scratch, &QueryStats::voting_ns, time);
+
+        // the candidates are gathered in the order of the data and scored against the whole set
+        const int *elected = scratch.elected.data();
+        std::sort(scratch.elected.data(), scratch.elected.data() + n_elected);
+        MatrixXf block(dim, n_elected);
+        for (int c = 0; c < n_elected; ++c) {
+            if (byte_data)
+                block.col(c) = (Map<const Matrix<uint8_t, Dynamic, 1>>(codes.data() + (size_t) dim * elected[c], dim)
+                                    .cast<float>().array() * code_scale.array() + code_offset.array()).matrix();
+            else
+                block.col(c) = Map<const VectorXf>(column(elected[c]), dim);
+        }
+        MatrixXf products(n_elected, n_vectors);
+        products.noalias() = block.transpose() * Q;
+        const VectorXf norms = block.colwise().squaredNorm();
+        VectorXf query_norms = Q.colwise().squaredNorm();
+        if (metric == COSINE)
+            query_norms = query_norms.unaryExpr([this](float x) { return inverse_norm(x); });
+
+        TopK &heap = scratch.heap;
+        heap.reset(k);
+        for (int c = 0; c < n_elected; ++c) {
+            if (n_deleted && is_deleted(elected[c]))
+                continue;
+            float aggregate = aggregation == MIN_DISTANCE ? std::numeric_limits<float>::max() : 0;
+            for (int i = 0; i < n_vectors; ++i) {
+                const float product = products(c, i);
+                // smaller is nearer, as in the heaps of the other queries
+                const float value = metric == EUCLIDEAN ? std::sqrt(std::max(0.0f, norms(c) - 2 * product + query_norms(i)))
+                                  : metric == INNER_PRODUCT ? -product
+                                  : -product * query_norms(i) * inverse_norm(norms(c));
+                aggregate = aggregation == MIN_DISTANCE ? std::min(aggregate, value) : aggregate + value;
+            }
+            heap.push(aggregation == MIN_DISTANCE ? aggregate : aggregate / n_vectors, elected[c]);
+        }
+        const int n_found = add_duplicates(heap.extract(out, out_distances), k, out, out_distances);
+        for (int i = 0; i < n_found; ++i) {
+            out[i] = to_external(out[i]);
+            if (out_distances && metric != EUCLIDEAN)
+                out_distances[i] = -out_distances[i];
+        }
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_touched, n_elected, fallback);
+        record_query(start);
+        return true;
+    }
+
+    /**
+    * Finds all elected candidates of q within distance radius of it, instead of
+    * a fixed number of nearest neighbors. The votes are counted as in query, and
+    * the candidates are scored with the data in the order they are elected,
+    * without selecting or sorting them. With the EUCLIDEAN metric the squared
+    * distance of a candidate is summed a block of dimensions at a time, and the
+    * candidate is abandoned as soon as the partial sum exceeds radius^2. With
+    * INNER_PRODUCT and COSINE the distances are the inner products and cosine
+    * similarities, as in query, and the candidates with at least radius are kept.
+    * A quantized copy of the data is not used.
+    * @param q - The query object whose neighbors the function finds
+    * @param radius - The largest distance, or the smallest similarity, of a neighbor
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The neighbors are appended to out, in no particular order
+    * @param out_distances - The distances of the neighbors are appended to out_distances (optional parameter)
+    * @return The number of neighbors found
+    */
+    int query_radius(const Ref<const VectorXf> &q, float radius, int votes_required, std::vector<int> *out,
+                     std::vector<float> *out_distances = nullptr) const {
+        const int64_t start = metrics_clock();
+        QueryScratch &scratch = thread_scratch();
+        int64_t time = stats_clock(scratch);
+        const VectorXf projected_query = project_query(q);
+        add_time(scratch, &QueryStats::projection_ns, time);
+        VectorXi found_leaves(n_trees);
+        route(projected_query.data(), found_leaves.data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+        const int n_found = radius_from_found_leaves(q, found_leaves.data(), radius, votes_required, out,
+                                                     out_distances, scratch);
+        record_query(start);
+        return n_found;
+    }
+
+    /**
+    * Finds the neighbors within distance radius of each of the queries stored as
+    * the columns of Q, as query_radius does, with the queries divided between the
+    * threads in blocks that are projected with one matrix-matrix product. The
+    * neighbors of all the queries are returned as compressed sparse rows.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param radius - The largest distance, or the smallest similarity, of a neighbor
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param indptr - Resized to n_queries + 1 offsets; the neighbors of query i are out[indptr[i], indptr[i + 1])
+    * @param out - Resized to hold the neighbors of all the queries
+    * @param out_distances - Resized to hold the distances, laid out as out (optional parameter)
+    * @return The number of neighbors found, indptr[n_queries]
+    */
+    int64_t query_radius_batch(const Ref<const MatrixXf> &Q, float radius, int votes_required,
+                               std::vector<int64_t> *indptr, std::vector<int> *out,
+                               std::vector<float> *out_distances = nullptr) const {
+        const int n_queries = Q.cols(), max_block_size = 64;
+        const int block_size = std::max(1, std::min(max_block_size, n_queries / query_threads()));
+        const int n_blocks = (n_queries + block_size - 1) / block_size;
+        // the neighbors of each block, concatenated once the sizes are known
+        std::vector<std::vector<int>> block_ids(n_blocks);
+        std::vector<std::vector<float>> block_distances(out_distances ? n_blocks : 0);
+        indptr->assign(n_queries + 1, 0);
+
+        parallel_for(n_blocks, [&](int b) {
+            QueryScratch &scratch = thread_scratch();
+            const int first = b * block_size, n = std::min(block_size, n_queries - first);
+            const int64_t block_start = metrics_clock();
+            int64_t time = stats_clock(scratch);
+            const MatrixXf projected_queries = project_queries(Q.middleCols(first, n));
+            add_time(scratch, &QueryStats::projection_ns, time);
+            MatrixXi found_leaves(n_trees, n);
+            for (int i = 0; i < n; ++i)
+                route(projected_queries.col(i).data(), found_leaves.col(i).data());
+            add_time(scratch, &QueryStats::routing_ns, time);
+            int64_t start = metrics_clock();
+            const int64_t setup_share = (start - block_start) / n;
+            for (int i = first; i < first + n; ++i) {
+                (*indptr)[i + 1] = radius_from_found_leaves(Q.col(i), found_leaves.col(i - first).data(), radius,
+                                                            votes_required, &block_ids[b],
+                                                            out_distances ? &block_distances[b] : nullptr, scratch);
+                start = record_query(start, setup_share);
+            }
+        }, 1, query_threads());
+
+        for (int i = 0; i < n_queries; ++i)
+            (*indptr)[i + 1] += (*indptr)[i];
+        out->resize((*indptr)[n_queries]);
+        if (out_distances)
+            out_distances->resize((*indptr)[n_queries]);
+        parallel_for(n_blocks, [&](int b) {
+            const int64_t offset = (*indptr)[b * block_size];
+            std::copy(block_ids[b].begin(), block_ids[b].end(), out->begin() + offset);
+            if (out_distances)
+                std::copy(block_distances[b].begin(), block_distances[b].end(), out_distances->begin() + offset);
+        }, 1, query_threads());
+        return (*indptr)[n_queries];
+    }
+
+    /**
+    * find k nearest neighbors from data for the query point
+    * @param q - query point as a vector
+    * @param k - number of neighbors searched for
+    * @param indices - indices of the points in the original matrix where the search is made
+    * @param out - output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    * @return
+    */
+    void exact_knn(const Ref<const VectorXf> &q, int k, const VectorXi &indices, int n_elected, int *out, float *out_distances = nullptr) const {
+        VectorXf distances(n_elected);
+
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const mrpt_kernels::DistanceFunction distance = metric == EUCLIDEAN ? kernels.l2 : kernels.dot;
+        const float *query = q.data();
+        const float *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const float query_scale = inverse_norm(q.squaredNorm());
+
+        if (byte_data) {
+            const VectorXf shifted = q - code_offset;
+            for (int i = 0; i < n_elected; ++i)
+                distances(i) = kernels.l2_int8(shifted.data(), code_scale.data(),
+                                               codes.data() + (size_t) dim * to_internal(indices(i)), dim);
+        } else {
+            for (int i = 0; i < n_elected; ++i) {
+                const int index = to_internal(indices(i));
+                distances(i) = score(distance(query, column(index), dim), index, norms, query_scale);
+            }
+        }
+
+        TopK heap(k);
+        for (int i = 0; i < n_elected; ++i) {
+            if (n_deleted && is_deleted(to_internal(indices(i)))) continue;
+            heap.push(distances(i), to_internal(indices(i)));
+        }
+        extract_knn(heap, out, out_distances);
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of each of the queries stored as the
+    * columns of Q by brute force. The squared distances are computed as
+    * ||x||^2 - 2 x^T q + ||q||^2 for tiles of queries and data points, so that
+    * the inner products of a tile come from one matrix-matrix product, and the
+    * k best points of each query are kept in a bounded heap. The squared norms
+    * of the data points are computed on the first call and cached. With the
+    * INNER_PRODUCT and COSINE metrics the inner products are used as they are.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param k - The number of neighbors searched for each query
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    * @return
+    */
+    void exact_knn_batch(const Ref<const MatrixXf> &Q, int k, int *out, float *out_distances = nullptr) const {
+        exact_knn_batch(Q, k, out, out_distances, query_threads());
+    }
+
+    /**
+    * Same as above, with the queries divided between n_threads threads.
+    */
+    void exact_knn_batch(const Ref<const MatrixXf> &Q, int k, int *out, float *out_distances, int n_threads) const {
+        const VectorXf &norms = data_norms();
+        const int n_queries = Q.cols(), max_block_size = 128, data_block_size = 1024;
+        const int block_size = std::max(1, std::min(max_block_size, n_queries / n_threads));
+        const int n_blocks = (n_queries + block_size - 1) / block_size;
+
+        parallel_for(n_blocks, [&](int b) {
+            const int first = b * block_size, n = std::min(block_size, n_queries - first);
+            std::vector<TopK> heaps(n, TopK(k));
+            MatrixXf dots(data_block_size, n), widened;
+
+            for (int j = 0; j < n_samples; j += data_block_size) {
+                const int m = std::min(data_block_size, n_samples - j);
+                const Map<const MatrixXf> points = byte_data ? data_columns(j, m, widened)
+                                                             : Map<const MatrixXf>(column(j), dim, m);
+                dots.topRows(m).noalias() = points.transpose() * Q.middleCols(first, n);
+
+                for (int i = 0; i < n; ++i) {
+                    TopK &heap = heaps[i];
+                    const float *dot = dots.col(i).data();
+                    if (metric != EUCLIDEAN) {
+                        const float query_scale = inverse_norm(Q.col(first + i).squaredNorm());
+                        for (int l = 0; l < m; ++l)
+                            if (!n_deleted || !is_deleted(j + l)) heap.push(score(dot[l], j + l, norms.data(), query_scale), j + l);
+                        continue;
+                    }
+                    if (n_deleted) {
+                        for (int l = 0; l < m; ++l)
+                            if (!is_deleted(j + l)) heap.push(norms(j + l) - 2 * dot[l], j + l);
+                        continue;
+                    }
+                    for (int l = 0; l < m; ++l)
+                        heap.push(norms(j + l) - 2 * dot[l], j + l);
+                }
+            }
+
+            for (int i = 0; i < n; ++i) {
+                const int n_query = first + i;
+                int *ids = out + (size_t) n_query * k;
+                float *dist = out_distances ? out_distances + (size_t) n_query * k : nullptr;
+                const int n_found = add_duplicates(heaps[i].extract(ids, dist), k, ids, dist);
+                for (int j = 0; j < n_found; ++j)
+                    ids[j] = to_external(ids[j]);
+                if (!dist) continue;
+                if (metric != EUCLIDEAN) {
+                    for (int j = 0; j < n_found; ++j)
+                        dist[j] = -dist[j];
+                    continue;
+                }
+                const float q_norm = Q.col(n_query).squaredNorm();
+                for (int j = 0; j < n_found; ++j)
+                    dist[j] = std::sqrt(std::max(0.0f, dist[j] + q_norm));
+            }
+        }, 1, n_threads);
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of each of the queries stored as the
+    * columns of Q among the points of a data file, like exact_knn_batch but
+    * without an index or the data in memory, for data larger than the memory.
+    * The file is read in one sequential pass, in blocks of block_bytes read by
+    * a mrpt_data::PipelinedReader into one of two buffers while the block read
+    * before is scored from the other, and each block is scored against all the
+    * queries by matrix-matrix products while a bounded heap per query keeps its
+    * k best points. The threads divide the queries of each block between them,
+    * with OpenMP; built without it the blocks are scored on the calling thread.
+    * @param path - A data file of float32 points, with the header of mrpt_data
+    * or only the rows, of dimension Q.rows()
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param k - The number of neighbors searched for each query
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i, as the rows of the file,
+    * are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    * @param metric - The similarity the neighbors are searched by
+    * @param block_bytes - The bytes of a block, of which two are held in memory at once
+    * @param n_threads - The number of threads, 0 for all
+    * @return False if the file cannot be read, its dimension is not that of the queries or it has more
+    * points than an int can number
+    */
+    static bool exact_knn_file(const char *path, const Ref<const MatrixXf> &Q, int k, int *out,
+                               float *out_distances = nullptr, Metric metric = EUCLIDEAN,
+                               uint64_t block_bytes = 256 << 20, int n_threads = 0) {
+        const int dim = Q.rows(), n_queries = Q.cols();
+        const uint64_t row_bytes = (uint64_t) dim * sizeof(float);
+        FILE *fd = dim ? std::fopen(path, "rb") : nullptr;
+        if (!fd)
+            return false;
+        mrpt_data::DataFileHeader header;
+        const int has_header = mrpt_data::read_header(fd, header);
+        const uint64_t size = file_size(fd);
+        std::fclose(fd);
+        if (has_header < 0 || (has_header && header.dim != dim))
+            return false;
+        const uint64_t offset = has_header ? header.data_offset : 0;
+        const int64_t n = has_header ? header.n : size / row_bytes;
+        if (offset + n * row_bytes > size || n > std::numeric_limits<int>::max())
+            return false;
+
+        const int64_t block_rows = std::max<int64_t>(1, std::min<int64_t>(n, block_bytes / row_bytes));
+        const int n_blocks = (n + block_rows - 1) / block_rows;
+        std::vector<float> buffers[2];
+        for (std::vector<float> &buffer : buffers)
+            buffer.resize(block_rows * dim);
+        auto read_block = [&](int b) {
+            const int64_t first = b * block_rows, m = std::min(block_rows, n - first);
+            return new mrpt_data::PipelinedReader(path, offset + first * row_bytes, buffers[b % 2].data(),
+                                                  m * row_bytes, row_bytes);
+        };
+
+        // the queries scaled to unit norm for COSINE, whose data points are scaled as they are scored
+        MatrixXf queries = Q;
+        if (metric == COSINE)
+            for (int i = 0; i < n_queries; ++i)
+                queries.col(i) *= inverse_norm(Q.col(i).squaredNorm());
+
+        if (n_threads <= 0)
+            n_threads = max_threads();
+        const int max_block_size = 128, tile_size = 1024;
+        const int block_size = std::max(1, std::min(max_block_size, n_queries / n_threads));
+        const int n_query_blocks = (n_queries + block_size - 1) / block_size;
+        std::vector<TopK> heaps(n_queries, TopK(k));
+
+        std::unique_ptr<mrpt_data::PipelinedReader> reader(n_blocks ? read_block(0) : nullptr);
+        for (int b = 0; b < n_blocks; ++b) {
+            if (!reader->join())
+                return false;
+            reader.reset(b + 1 < n_blocks ? read_block(b + 1) : nullptr);
+            const int first = b * block_rows, m = std::min<int64_t>(block_rows, n - first);
+            const float *block = buffers[b % 2].data();
+
+            #pragma omp parallel for schedule(dynamic) num_threads(n_threads)
+            for (int qb = 0; qb < n_query_blocks; ++qb) {
+                const int first_query = qb * block_size, n_block = std::min(block_size, n_queries - first_query);
+                MatrixXf dots(tile_size, n_block);
+                VectorXf norms(tile_size);
+                for (int j = 0; j < m; j += tile_size) {
+                    const int t = std::min(tile_size, m - j);
+                    const Map<const MatrixXf> points(block + (size_t) j * dim, dim, t);
+                    norms.head(t) = points.colwise().squaredNorm().transpose();
+                    dots.topRows(t).noalias() = points.transpose() * queries.middleCols(first_query, n_block);
+                    for (int i = 0; i < n_block; ++i) {
+                        TopK &heap = heaps[first_query + i];
+                        const float *dot = dots.col(i).data();
+                        if (metric == EUCLIDEAN) {
+                            for (int l = 0; l < t; ++l)
+                                heap.push(norms(l) - 2 * dot[l], first + j + l);
+                        } else if (metric == INNER_PRODUCT) {
+                            for (int l = 0; l < t; ++l)
+                                heap.push(-dot[l], first + j + l);
+                        } else {
+                            for (int l = 0; l < t; ++l)
+                                heap.push(-dot[l] * inverse_norm(norms(l)), first + j + l);
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < n_queries; ++i) {
+            int *ids = out + (size_t) i * k;
+            float *dist = out_distances ? out_distances + (size_t) i * k : nullptr;
+            const int n_found = heaps[i].extract(ids, dist);
+            if (!dist) continue;
+            const float q_norm = Q.col(i).squaredNorm();
+            for (int j = 0; j < n_found; ++j)
+                dist[j] = metric == EUCLIDEAN ? std::sqrt(std::max(0.0f, dist[j] + q_norm)) : -dist[j];
+        }
+        return true;
+    }
+
+    /**
+    * Finds approximate k nearest neighbors of every indexed point among the
+    * points it shares leaves with, the edges of a k-nearest-neighbor graph of
+    * the data. With votes_required = 1 the leaves are joined with themselves:
+    * the distances between the points of a leaf come from one matrix product,
+    * each is offered to both points of the pair, and as a point is in one leaf
+    * per tree the leaves of a tree are divided between the threads. With more
+    * votes the neighbors of a point are chosen among the points in at least
+    * votes_required of its leaves, with the points divided between the threads.
+    * Deleted points have no neighbors and are nobody's neighbor. Should not be
+    * called while load_async is loading the index.
+    * @param k - The number of neighbors searched for each point
+    * @param votes_required - The number of leaves of a point a neighbor must share
+    * @param indptr - Output buffer of n_samples + 1 offsets; the neighbors of
+    * point i are written to out[indptr[i], indptr[i + 1]) in ascending order of distance
+    * @param out - Output buffer of size k * n_samples
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    * @return The number of neighbors found, indptr[n_samples]
+    */
+    int64_t knn_graph(int k, int votes_required, int64_t *indptr, int *out, float *out_distances = nullptr) const {
+        const int n_tuned = trees_loaded(), n_leaves = 1 << depth;
+        const VectorXf &norms = data_norms();
+        std::vector<TopK> heaps(n_samples, TopK(k)); // the neighbors of each point by internal id
+
+        if (votes_required <= 1) {
+            for (int n_tree = 0; n_tree < n_tuned; ++n_tree) {
+                parallel_for(n_leaves, [&](int leaf) {
+                    join_leaf(n_tree, leaf, norms, heaps);
+                });
+            }
+        } else {
+            // the leaf of each point in each tree
+            std::vector<int> point_leaves((size_t) n_tuned * n_samples, -1);
+            parallel_for(n_tuned, [&](int n_tree) {
+                int *leaf_of = point_leaves.data() + (size_t) n_tree * n_samples;
+                for (int leaf = 0; leaf < n_leaves; ++leaf) {
+                    visit_leaves(n_tree, leaf, leaf + 1, [&](const int *ids, int n) {
+                        for (const int *p = ids; p < ids + n; ++p)
+                            leaf_of[*p] = leaf;
+                    });
+                    for (int id = 0; !inserted_leaves.empty() && id < (int) inserted_leaves[n_tree * n_leaves + leaf].size(); ++id)
+                        leaf_of[inserted_leaves[n_tree * n_leaves + leaf][id]] = leaf;
+                }
+            });
+
+            const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+            const mrpt_kernels::DistanceFunction distance = metric == EUCLIDEAN ? kernels.l2 : kernels.dot;
+
+            parallel_for(n_samples, [&](int i) {
+                if (n_deleted && is_deleted(i)) return;
+                QueryScratch &scratch = thread_scratch();
+                scratch.select_counters(n_samples, n_tuned, false);
+                int n_elected = 0, n_touched = 0;
+                for (int n_tree = 0; n_tree < n_tuned; ++n_tree) {
+                    const int leaf = point_leaves[(size_t) n_tree * n_samples + i];
+                    if (leaf >= 0)
+                        count_leaf_votes(n_tree, leaf, votes_required, scratch, n_elected, n_touched);
+                }
+                const float scale = inverse_norm(norms(i));
+                for (int j = 0; j < n_elected; ++j) {
+                    const int id = scratch.elected(j);
+                    if (id != i)
+                        heaps[i].push(score(distance(column(i), column(id), dim), id, norms.data(), scale), id);
+                }
+                clear_votes(scratch, n_touched);
+            }, 64);
+        }
+
+        // the neighbors of point i are written after those of the points before it
+        parallel_for(n_samples, [&](int i) {
+            int *ids = out + (size_t) i * k;
+            extract_knn(heaps[to_internal(i)], ids, out_distances ? out_distances + (size_t) i * k : nullptr);
+            indptr[i + 1] = std::find(ids, ids + k, -1) - ids;
+        }, 1024);
+        indptr[0] = 0;
+        for (int i = 0; i < n_samples; ++i) {
+            const int64_t n_found = indptr[i + 1];
+            std::copy(out + (size_t) i * k, out + (size_t) i * k + n_found, out + indptr[i]);
+            if (out_distances)
+                std::copy(out_distances + (size_t) i * k, out_distances + (size_t) i * k + n_found, out_distances + indptr[i]);
+            indptr[i + 1] = indptr[i] + n_found;
+        }
+        return indptr[n_samples];
+    }
+
+    /**
+    * Measures the recall and estimates the query time of all the smaller indexes
+    * that can be cut from this one, to find the parameters for a recall target.
+    * The trees of an index with n_trees' <= n_trees trees of depth depth' <= depth
+    * are the first n_trees' trees cut at level depth', so one pass over the test
+    * queries gives the candidates of every n_trees', depth' and votes_required.
+    * The recall is the fraction of the true k nearest neighbors that are elected
+    * to the linear search. The query time is estimated from the number of
+    * projections, votes and candidates of each configuration by the time these
+    * steps take per unit on the test queries. Should not be called while
+    * load_async is loading the index.
+    * @param Q - The test queries as a dim x n_test matrix. They should come from
+    * the same distribution as the queries but not from the data of the index.
+    * @param k - The number of neighbors the queries will search for
+    * @param min_depth - The smallest depth considered. The tuning reads n_trees
+    * leaves of n_samples / 2^min_depth points per test query, so a small
+    * min_depth makes it slow on large data.
+    * @return The Pareto front: the configurations for which no other is both
+    * faster and more accurate, in increasing order of time and recall
+    */
+    std::vector<Parameters> autotune(const Ref<const MatrixXf> &Q, int k, int min_depth = 1) const {
+        const int n_test = Q.cols(), n_tuned = trees_loaded();
+        min_depth = std::max(1, std::min(min_depth, depth));
+        const int n_depths = depth - min_depth + 1, n_cells = n_tuned * (n_tuned + 1);
+
+        std::vector<int> true_knn((size_t) n_test * k);
+        exact_knn_batch(Q, k, true_knn.data());
+
+        // hits[d][t * (n_tuned + 1) + v]: true neighbors with at least v votes from the first t + 1 trees, and
+        // candidates[d][...] all such points, summed over the queries; votes[d][t]: the votes of the first t + 1 trees
+        std::vector<std::vector<int64_t>> hits(n_depths), candidates(n_depths), votes(n_depths);
+        MatrixXf projected_queries = project_queries(Q);
+
+        parallel_for(n_depths, [&](int d) {
+            hits[d].assign(n_cells, 0);
+            candidates[d].assign(n_cells, 0);
+            votes[d].assign(n_tuned, 0);
+            std::vector<int> vote_count(n_samples, 0), touched;
+            std::vector<char> is_neighbor(n_samples, 0);
+            std::vector<int64_t> hits_at(n_tuned + 1), candidates_at(n_tuned + 1);
+            const int level = min_depth + d, shift = depth - level;
+
+            for (int i = 0; i < n_test; ++i) {
+                const int *neighbors = true_knn.data() + (size_t) i * k;
+                for (int j = 0; j < k; ++j)
+                    if (neighbors[j] >= 0) is_neighbor[to_internal(neighbors[j])] = 1;
+                std::fill(hits_at.begin(), hits_at.end(), 0);
+                std::fill(candidates_at.begin(), candidates_at.end(), 0);
+                const float *projected_query = projected_queries.col(i).data();
+                int64_t n_votes = 0;
+
+                for (int n_tree = 0; n_tree < n_tuned; ++n_tree) {
+                    int idx_tree = 0;
+                    for (int l = 0; l < level; ++l) {
+                        const float split_point = split_data[n_tree * n_array + idx_tree];
+                        idx_tree = 2 * idx_tree + (projected_query[n_tree * depth + l] <= split_point ? 1 : 2);
+                    }
+                    // the node covers the leaves first_leaf, ..., first_leaf + 2^shift - 1 of the full tree
+                    const int first_leaf = (idx_tree - (1 << level) + 1) << shift;
+                    auto vote = [&](int id) {
+                        if (n_stale && is_deleted(id)) return;
+                        const int v = ++vote_count[id];
+                        if (v == 1) touched.push_back(id);
+                        ++candidates_at[v];
+                        if (is_neighbor[id]) ++hits_at[v];
+                    };
+                    visit_leaves(n_tree, first_leaf, first_leaf + (1 << shift), [&](const int *ids, int n) {
+                        std::for_each(ids, ids + n, vote);
+                        n_votes += n;
+                    });
+                    for (int j = first_leaf; j < first_leaf + (1 << shift) && !inserted_leaves.empty(); ++j) {
+                        const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + j];
+                        std::for_each(inserted.begin(), inserted.end(), vote);
+                        n_votes += inserted.size();
+                    }
+
+                    int64_t *h = hits[d].data() + n_tree * (n_tuned + 1), *c = candidates[d].data() + n_tree * (n_tuned + 1);
+                    for (int v = 1; v <= n_tree + 1; ++v) {
+                        h[v] += hits_at[v];
+                        c[v] += candidates_at[v];
+                    }
+                    votes[d][n_tree] += n_votes;
+                }
+
+                for (int id : touched)
+                    vote_count[id] = 0;
+                touched.clear();
+                for (int j = 0; j < k; ++j)
+                    if (neighbors[j] >= 0) is_neighbor[to_internal(neighbors[j])] = 0;
+            }
+        });
+
+        double projection_cost, vote_cost, distance_cost;
+        measure_query_costs(Q, projection_cost, vote_cost, distance_cost);
+
+        std::vector<Parameters> configurations;
+        for (int d = 0; d < n_depths; ++d) {
+            for (int t = 0; t < n_tuned; ++t) {
+                for (int v = 1; v <= t + 1; ++v) {
+                    const int64_t n_candidates = candidates[d][t * (n_tuned + 1) + v];
+                    Parameters p;
+                    p.n_trees = t + 1;
+                    p.depth = min_depth + d;
+                    p.votes = v;
+                    p.estimated_recall = hits[d][t * (n_tuned + 1) + v] / ((double) n_test * k);
+                    p.estimated_qtime = projection_cost * p.n_trees * p.depth
+                        + (vote_cost * votes[d][t] + distance_cost * n_candidates) / n_test;
+                    configurations.push_back(p);
+                }
+            }
+        }
+
+        std::sort(configurations.begin(), configurations.end(), [](const Parameters &a, const Parameters &b) {
+            return a.estimated_qtime < b.estimated_qtime
+                || (a.estimated_qtime == b.estimated_qtime && a.estimated_recall > b.estimated_recall);
+        });
+        std::vector<Parameters> pareto_front;
+        for (const Parameters &p : configurations) {
+            if (pareto_front.empty() || p.estimated_recall > pareto_front.back().estimated_recall)
+                pareto_front.push_back(p);
+        }
+        return pareto_front;
+    }
+
+    /**
+    * Cuts the index down to the fastest configuration that reaches a recall
+    * target and fits a memory budget together with the data its queries read,
+    * picking how the data and the leaves are stored. The configurations are
+    * those of autotune, and the storage options are tried from the most
+    * accurate and fastest to the smallest: the data kept, then also the leaves
+    * compressed, then a FLOAT16 and lastly an INT8 copy of the data that the
+    * queries score without re-ranking, so that the data is no longer read,
+    * each with plain and then compressed leaves. The recall of the quantized
+    * copies is measured on the test queries. The index is then pruned, and
+    * quantized, compressed and its data released as planned; data the index
+    * does not own is left to the caller, who can free it when the plan is
+    * quantized. Grow the index with more and deeper trees than needed, as it
+    * is only ever cut down. Needs the data, and must not be called
+    * concurrently with queries.
+    * @param Q - The test queries as a dim x n_test matrix, as for autotune
+    * @param k - The number of neighbors the queries will search for
+    * @param target_recall - The recall the queries should reach
+    * @param budget - The bytes the index and the data its queries read may take
+    * @param min_depth - The smallest depth considered, as for autotune
+    * @param plan - If not null, receives the configuration and storage picked
+    * @return false if no configuration reaches the recall within the budget, or
+    * the data is not kept, in which case the index is left as it was
+    */
+    bool fit_memory_budget(const Ref<const MatrixXf> &Q, int k, double target_recall, uint64_t budget,
+                           int min_depth = 1, StoragePlan *plan = nullptr) {
+        wait_load();
+        if (X->cols() != n_samples || !n_samples || trees_loaded() < n_trees || Q.rows() != dim || !Q.cols())
+            return false;
+        const std::vector<Parameters> front = autotune(Q, k, min_depth);
+        const int n_test = Q.cols();
+        std::vector<int> true_knn;
+
+        const Quantization saved_quantization = quantization;
+        const int saved_shortlist = shortlist_size, saved_subspaces = pq_subspaces;
+        const Quantization types[] = {FLOAT32, FLOAT16, INT8};
+        for (Quantization type : types) {
+            if (type != FLOAT32 && (metric != EUCLIDEAN || byte_data))
+                break;
+            for (int compressed = 0; compressed < 2; ++compressed) {
+                for (const Parameters &p : front) {
+                    if (p.estimated_recall < target_recall)
+                        continue;
+                    const MemoryUsage memory = predict_storage(p, type, compressed);
+                    if (memory.data + memory.index_bytes() > budget)
+                        continue;
+
+                    double recall = p.estimated_recall;
+                    if (type != FLOAT32) {
+                        if (true_knn.empty()) {
+                            true_knn.resize((size_t) n_test * k);
+                            exact_knn_batch(Q, k, true_knn.data());
+                        }
+                        if (quantization != type || shortlist_size >= 0)
+                            set_quantization(type, -1);
+                        recall = pruned_recall(Q, k, p, true_knn.data());
+                        if (recall < target_recall)
+                            continue;
+                    } else if (quantization != FLOAT32 && !byte_data) {
+                        set_quantization(FLOAT32);
+                    }
+
+                    if (p.n_trees < n_trees || p.depth < depth)
+                        prune(p.n_trees, p.depth);
+                    if (compressed)
+                        compress_leaves();
+                    if (type != FLOAT32)
+                        release_data();
+                    if (plan) {
+                        plan->parameters = p;
+                        plan->quantization = type;
+                        plan->compressed_leaves = compressed;
+                        plan->recall = recall;
+                        plan->memory = memory;
+                    }
+                    return true;
+                }
+            }
+        }
+
+        if (quantization != saved_quantization || shortlist_size != saved_shortlist)
+            set_quantization(saved_quantization, saved_shortlist, saved_subspaces);
+        return false;
+    }
+
+    /**
+    * Cuts the index down to its first n_trees_ trees and the first depth_ levels
+    * of each tree, for example to the configuration autotune picked. The leaves of
+    * the cut trees are the unions of the leaves below them, so the queries give
+    * the same results as those of an index grown with the same random vectors
+    * and the smaller parameters. An index mapped from a file is copied into
+    * memory. If the depth is cut, a RADEMACHER or HADAMARD index keeps its
+    * random vectors as an explicit matrix and is saved as a GAUSSIAN one.
+    * @param n_trees_ - The number of trees kept, 1 <= n_trees_ <= n_trees
+    * @param depth_ - The depth the trees are cut to, 1 <= depth_ <= depth
+    * @return false if the parameters are out of range, true otherwise
+    */
+    bool prune(int n_trees_, int depth_) {
+        wait_load();
+        ++n_changes;
+        if (n_trees_ < 1 || n_trees_ > n_trees || depth_ < 1 || depth_ > depth)
+            return false;
+
+        copy_mapped_index();
+        own_random_matrix();
+        compact_leaves();
+        blocked_ready = false;
+        const int shift = depth - depth_, n_leaves = 1 << depth_, n_array_ = 1 << (depth_ + 1);
+
+        split_points = split_points.topLeftCorner(n_array_, n_trees_).eval();
+        leaf_ids = leaf_ids.leftCols(n_trees_).eval();
+        MatrixXi first(n_leaves + 1, n_trees_);
+        for (int n_tree = 0; n_tree < n_trees_; ++n_tree)
+            for (int j = 0; j <= n_leaves; ++j)
+                first(j, n_tree) = leaf_first(j << shift, n_tree);
+        leaf_first = first;
+
+        // row l of tree n_tree moves from n_tree * depth + l to n_tree * depth_ + l
+        if (density < 1) {
+            std::vector<Triplet<float>> triplets;
+            for (int n_tree = 0; n_tree < n_trees_; ++n_tree)
+                for (int l = 0; l < depth_; ++l)
+                    for (SparseMatrix<float, RowMajor>::InnerIterator it(random_matrix->sparse, n_tree * depth + l); it; ++it)
+                        triplets.push_back(Triplet<float>(n_tree * depth_ + l, it.col(), it.value()));
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n_trees_ * depth_, dim);
+            random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+            random_matrix->sparse.makeCompressed();
+        } else {
+            Matrix<float, Dynamic, Dynamic, RowMajor> rows(n_trees_ * depth_, dim);
+            for (int n_tree = 0; n_tree < n_trees_; ++n_tree)
+                rows.middleRows(n_tree * depth_, depth_) = random_matrix->dense.middleRows(n_tree * depth, depth_);
+            random_matrix->dense.swap(rows);
+        }
+
+        // the seed gives the same vectors for fewer trees, but not for shallower ones
+        if (shift > 0)
+            projection = GAUSSIAN;
+        n_trees = n_trees_;
+        forest_trees = first_tree + n_trees_;
+        depth = depth_;
+        n_pool = n_trees_ * depth_;
+        n_array = n_array_;
+        n_ready_trees = n_trees;
+
+        use_owned_trees();
+        use_owned_random_matrix();
+        layout_splits();
+        // the leaves of the first trees keep their bounds, the merged leaves of cut trees need new ones
+        if (leaf_radii.size() && shift == 0) {
+            leaf_centroids.conservativeResize(dim, n_trees * n_leaves);
+            leaf_radii.conservativeResize(n_trees * n_leaves);
+        } else if (leaf_radii.size()) {
+            set_leaf_bounds(X->cols() == n_samples);
+        }
+        if (quantization == BINARY)
+            quantize_data();
+        return true;
+    }
+
+    /**
+    * Keeps only the given trees of the index, in the given order, with their
+    * split points, leaves and rows of the random matrix, like prune keeps the
+    * first trees. The leaf bounds of set_leaf_bounds follow their trees. An
+    * index mapped from a file is copied into memory. Unless the trees kept are
+    * the first ones in order, the random vectors are kept as an explicit matrix
+    * and the index is saved as a GAUSSIAN one.
+    * @param tree_ids - The trees to keep, each in 0, ..., n_trees - 1 and none twice
+    * @param n - The number of trees, at least 1
+    * @return false if a tree is out of range or repeated, or if the trees kept
+    * are not the first ones of an INNER_PRODUCT index, whose trees are tied to
+    * their numbers, in which case nothing changes, true otherwise
+    */
+    bool keep_trees(const int *tree_ids, int n) {
+        wait_load();
+        ++n_changes;
+        std::vector<char> kept(n_trees, 0);
+        bool first_ones = n >= 1;
+        for (int t = 0; t < n; ++t) {
+            if (tree_ids[t] < 0 || tree_ids[t] >= n_trees || kept[tree_ids[t]])
+                return false;
+            kept[tree_ids[t]] = 1;
+            first_ones = first_ones && tree_ids[t] == t;
+        }
+        if (n < 1 || (metric == INNER_PRODUCT && !first_ones))
+            return false;
+        if (first_ones)
+            return prune(n, depth);
+
+        copy_mapped_index();
+        own_random_matrix();
+        compact_leaves();
+        blocked_ready = false;
+        const int n_leaves = 1 << depth;
+
+        MatrixXf splits(n_array, n);
+        MatrixXi first(n_leaves + 1, n), ids(tree_points, n);
+        for (int t = 0; t < n; ++t) {
+            splits.col(t) = split_points.col(tree_ids[t]);
+            first.col(t) = leaf_first.col(tree_ids[t]);
+            ids.col(t) = leaf_ids.col(tree_ids[t]);
+        }
+        split_points.swap(splits);
+        leaf_first.swap(first);
+        leaf_ids.swap(ids);
+        if (leaf_radii.size()) {
+            MatrixXf centroids(dim, (size_t) n * n_leaves);
+            VectorXf radii((size_t) n * n_leaves);
+            for (int t = 0; t < n; ++t) {
+                centroids.middleCols(t * n_leaves, n_leaves) = leaf_centroids.middleCols(tree_ids[t] * n_leaves, n_leaves);
+                radii.segment(t * n_leaves, n_leaves) = leaf_radii.segment(tree_ids[t] * n_leaves, n_leaves);
+            }
+            leaf_centroids.swap(centroids);
+            leaf_radii.swap(radii);
+        }
+
+        // the rows of tree tree_ids[t] move to t * depth, ..., (t + 1) * depth - 1
+        if (density < 1) {
+            std::vector<Triplet<float>> triplets;
+            for (int t = 0; t < n; ++t)
+                for (int l = 0; l < depth; ++l)
+                    for (SparseMatrix<float, RowMajor>::InnerIterator it(random_matrix->sparse, tree_ids[t] * depth + l); it; ++it)
+                        triplets.push_back(Triplet<float>(t * depth + l, it.col(), it.value()));
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n * depth, dim);
+            random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+            random_matrix->sparse.makeCompressed();
+        } else {
+            Matrix<float, Dynamic, Dynamic, RowMajor> rows(n * depth, dim);
+            for (int t = 0; t < n; ++t)
+                rows.middleRows(t * depth, depth) = random_matrix->dense.middleRows(tree_ids[t] * depth, depth);
+            random_matrix->dense.swap(rows);
+        }
+
+        projection = GAUSSIAN;
+        n_trees = n;
+        forest_trees = first_tree + n;
+        n_pool = n * depth;
+        n_ready_trees = n_trees;
+
+        use_owned_trees();
+        use_owned_random_matrix();
+        layout_splits();
+        if (quantization == BINARY)
+            quantize_data();
+        return true;
+    }
+
+    /**
+    * Drops the trees that add the least to the recall of a sample of validation
+    * queries, one at a time, while the estimated recall of the trees left stays
+    * at least target_recall, and keeps the others with keep_trees. The recall is
+    * estimated as the share of the exact k nearest neighbors of the queries that
+    * get votes_required votes from the trees, which the linear search of the
+    * queries then finds. The tree dropped next is the one whose votes the fewest
+    * of these neighbors need, and among those the one fewest neighbors would need
+    * after it. Trees correlated with the others are dropped first, so that the
+    * index is smaller and its queries faster at about the same recall. The trees
+    * of an INNER_PRODUCT index are dropped from the last one, see keep_trees.
+    * Needs the data, and must not be called concurrently with queries.
+    * @param Q - The validation queries as a dim x n_queries matrix, which should
+    * follow the distribution of the queries served
+    * @param k - The number of nearest neighbors of the queries
+    * @param votes_required - The vote threshold of the queries served
+    * @param target_recall - The smallest estimated recall of the trees kept
+    * @param min_trees - The fewest trees kept
+    * @return The number of trees kept, or 0 if the data is not kept or the
+    * parameters are out of range, in which case nothing changes
+    */
+    int prune_trees(const Ref<const MatrixXf> &Q, int k, int votes_required, double target_recall,
+                    int min_trees = 1) {
+        wait_load();
+        const int n_queries = Q.cols();
+        if (X->cols() != n_samples || Q.rows() != dim || !n_queries || k < 1 || k > n_samples ||
+            votes_required < 1 || min_trees < 1 || min_trees > n_trees)
+            return 0;
+
+        copy_mapped_index();
+        compact_leaves();
+        MatrixXi truth(k, n_queries);
+        exact_knn_batch(Q, k, truth.data());
+        const MatrixXi found_leaves = find_leaves_batch(Q);
+        for (int64_t p = 0; p < truth.size(); ++p)
+            if (truth.data()[p] >= 0) truth.data()[p] = to_internal(truth.data()[p]);
+
+        // hit[n_tree * n_pairs + p] is 1 if the neighbor p is in the leaf of its query in tree n_tree
+        const int64_t n_pairs = truth.size();
+        const int n_leaves = 1 << depth;
+        std::vector<char> hit((size_t) n_trees * n_pairs, 0);
+        parallel_for(n_trees, [&](int n_tree) {
+            std::vector<int> leaf_of(n_samples, -1);
+            for (int j = 0; j < n_leaves; ++j)
+                visit_leaves(n_tree, j, j + 1, [&](const int *points, int n) {
+                    for (int i = 0; i < n; ++i) {
+                        leaf_of[points[i]] = j;
+                        // the duplicates of collapse_duplicates are found with the point
+                        for (int d = duplicate_ids.empty() ? 0 : duplicate_first[points[i]];
+                             !duplicate_ids.empty() && d < duplicate_first[points[i] + 1]; ++d)
+                            leaf_of[duplicate_ids[d]] = j;
+                    }
+                });
+            char *tree_hit = hit.data() + (size_t) n_tree * n_pairs;
+            for (int64_t p = 0; p < n_pairs; ++p) {
+                const int id = truth.data()[p];
+                tree_hit[p] = id >= 0 && leaf_of[id] == found_leaves(n_tree, p / k);
+            }
+        });
+
+        std::vector<int> votes(n_pairs, 0);
+        int64_t n_neighbors = 0, n_found = 0;
+        for (int64_t p = 0; p < n_pairs; ++p) {
+            n_neighbors += truth.data()[p] >= 0;
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+                votes[p] += hit[(size_t) n_tree * n_pairs + p];
+            n_found += votes[p] >= votes_required;
+        }
+
+        std::vector<int> kept(n_trees);
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+            kept[n_tree] = n_tree;
+        while ((int) kept.size() > min_trees) {
+            int64_t best_lost = n_pairs + 1, best_close = 0;
+            int best = -1;
+            for (int t = metric == INNER_PRODUCT ? kept.size() - 1 : 0; t < (int) kept.size(); ++t) {
+                const char *tree_hit = hit.data() + (size_t) kept[t] * n_pairs;
+                int64_t lost = 0, close = 0;
+                for (int64_t p = 0; p < n_pairs; ++p) {
+                    lost += tree_hit[p] && votes[p] == votes_required;
+                    close += tree_hit[p] && votes[p] == votes_required + 1;
+                }
+                if (lost < best_lost || (lost == best_lost && close < best_close)) {
+                    best_lost = lost;
+                    best_close = close;
+                    best = t;
+                }
+            }
+            if (n_found - best_lost < target_recall * n_neighbors)
+                break;
+            const char *tree_hit = hit.data() + (size_t) kept[best] * n_pairs;
+            for (int64_t p = 0; p < n_pairs; ++p)
+                votes[p] -= tree_hit[p];
+            n_found -= best_lost;
+            kept.erase(kept.begin() + best);
+        }
+
+        if ((int) kept.size() < n_trees)
+            keep_trees(kept.data(), kept.size());
+        return n_trees;
+    }
+
+    /**
+    * Grows some of the trees again with new random vectors from all the points
+    * that are not deleted, and leaves the other trees as they are, so that the
+    * worst trees can be replaced after many inserts a few at a time instead of
+    * rebuilding the index. The rows of the random matrix of the trees, the rows
+    * n_tree * depth, ..., (n_tree + 1) * depth - 1 for tree n_tree, are drawn
+    * again from a seed derived from the seed of the build and the trees, so the
+    * index is saved as a GAUSSIAN one, and it shares its random matrix only with
+    * indexes grown with the same seed whose same trees were regrown. The inserted
+    * points are merged into the trees first, and an index mapped from a file is
+    * copied into memory. Needs the data, and must not be called concurrently
+    * with queries; to keep serving while the trees are regrown, regrow a copy of
+    * the index and swap it in with a mrpt_snapshot::SnapshotHandle.
+    * @param tree_ids - The trees to grow again, each in 0, ..., n_trees - 1
+    * @param n - The number of trees
+    * @return false if a tree is out of range or the data is not kept, in which
+    * case nothing changes, true otherwise
+    */
+    bool regrow_trees(const int *tree_ids, int n) {
+        wait_load();
+        ++n_changes;
+        if (X->cols() != n_samples)
+            return false;
+        for (int i = 0; i < n; ++i)
+            if (tree_ids[i] < 0 || tree_ids[i] >= n_trees)
+                return false;
+        std::vector<int> trees(tree_ids, tree_ids + n);
+        std::sort(trees.begin(), trees.end());
+        trees.erase(std::unique(trees.begin(), trees.end()), trees.end());
+        if (trees.empty())
+            return true;
+        BuildScope build_scope(*this);
+
+        copy_mapped_index();
+        own_random_matrix();
+        compact_leaves();
+        blocked_ready = false;
+
+        std::vector<unsigned> seeds = {build_seed};
+        seeds.insert(seeds.end(), trees.begin(), trees.end());
+        std::seed_seq seq(seeds.begin(), seeds.end());
+        seq.generate(&build_seed, &build_seed + 1);
+
+        if (density < 1) {
+            std::vector<Triplet<float>> triplets;
+            for (int n_tree = 0, t = 0; n_tree < n_trees; ++n_tree) {
+                if (t < (int) trees.size() && trees[t] == n_tree) {
+                    draw_sparse_rows(n_tree, triplets);
+                    ++t;
+                    continue;
+                }
+                for (int l = 0; l < depth; ++l)
+                    for (SparseMatrix<float, RowMajor>::InnerIterator it(random_matrix->sparse, n_tree * depth + l); it; ++it)
+                        triplets.push_back(Triplet<float>(it.row(), it.col(), it.value()));
+            }
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool, dim);
+            random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+            random_matrix->sparse.makeCompressed();
+        } else {
+            for (int n_tree : trees)
+                draw_dense_rows(n_tree, random_matrix->dense.data() + (size_t) n_tree * depth * dim);
+            round_random_matrix();
+        }
+        projection = GAUSSIAN;
+        use_owned_random_matrix();
+
+        for (int n_tree : trees) {
+            regrow_tree(n_tree);
+            if (leaf_radii.size())
+                bound_tree(n_tree);
+        }
+        layout_splits();
+        if (quantization == BINARY)
+            quantize_data();
+        return true;
+    }
+
+    /**
+    * Keeps the data of the index, and the points inserted into it afterwards, in
+    * a data file at path, with the header of mrpt_data.h, instead of in memory.
+    * The file is mapped read-write into an address range reserved for max_bytes,
+    * and grows at its end in extents of extent_bytes as points are inserted, so
+    * an insert writes only the new points and the pointers into the data stay
+    * valid. The file always holds the points of the index in the order of their
+    * ids, and can be given to a new index as its data. If the file cannot grow
+    * any more, the next insert moves the data into memory and closes the file.
+    * Undoes reorder_data. Must not be called concurrently with queries.
+    * @param path - The file, which is created or truncated
+    * @param extent_bytes - The bytes the mapping grows by at a time
+    * @param max_bytes - The largest size of the file
+    * @return false if the index does not have its data, holds 8-bit data, or if
+    * the file cannot be created, mapped or written, in which case the data is
+    * left where it was; true otherwise.
+    */
+    bool set_data_file(const char *path, size_t extent_bytes = 64 << 20, size_t max_bytes = size_t(1) << 40) {
+        wait_load();
+        if (byte_data || X->cols() != n_samples || !n_samples)
+            return false;
+        ++n_changes;
+        const size_t offset = sizeof(mrpt_data::DataFileHeader);
+        mrpt_mmap::GrowableFile file;
+        if (!file.open(path, std::max(max_bytes, offset + sizeof(float) * dim * (size_t) n_samples), extent_bytes) ||
+            !file.resize(offset + sizeof(float) * dim * (size_t) n_samples))
+            return false;
+        const mrpt_data::DataFileHeader header = mrpt_data::make_header(n_samples, dim);
+        std::memcpy(file.data(), &header, sizeof(header));
+        float *rows = reinterpret_cast<float *>(file.data() + offset);
+        std::copy(X->data(), X->data() + (size_t) dim * n_samples, rows);
+
+        const bool searched = search_data == X->data();
+        // a file set before is closed with file
+        data_file.swap(file);
+        std::vector<float>().swap(data_storage);
+        given_data.release();
+        new (&given_matrix) Map<const MatrixXf>(nullptr, dim, 0);
+        new (&stored_data) Map<const MatrixXf>(rows, dim, n_samples);
+        X = &stored_data;
+        // the same points in the same order, so the norms and codes of the data are kept
+        if (searched)
+            search_data = rows;
+        return true;
+    }
+
+    /**
+    * Inserts new points into the built index without rebuilding it. The points
+    * are projected with the random vectors of the index and routed down the
+    * trees with the existing split points, and get the ids n_samples,
+    * n_samples + 1, ... in the order of the columns of X_new. The first insert
+    * copies the data into storage owned by the index, which then grows
+    * geometrically, so the data the index was built from is no longer needed;
+    * with set_data_file the points are appended to a data file instead.
+    * The inserted points are kept in lists of their own for each leaf, until
+    * they are more than an eighth of all points and are merged into the trees.
+    * A tree in which a leaf grows beyond twice the size n_samples / 2^depth its
+    * leaves have after a build is built again from all the data, so that its
+    * split points follow the data if it drifts. This is done within the call.
+    * Undoes reorder_data, which can be called again afterwards. Must not be
+    * called concurrently with queries.
+    * @param X_new - The new points as a dim x n_new matrix
+    * @return false if the points have the wrong dimension or would make the
+    * index hold 2^31 points or more, or if the index holds 8-bit data, true otherwise
+    */
+    bool insert(const Ref<const MatrixXf> &X_new) {
+        wait_load();
+        ++n_changes;
+        const int n_old = n_samples;
+        if (byte_data || X_new.rows() != dim || (int64_t) n_old + X_new.cols() > std::numeric_limits<int>::max())
+            return false;
+        const int n_new = X_new.cols(), n_leaves = 1 << depth;
+        append_points(X_new);
+        MatrixXf projected = project_points(X_new);
+        transform_projections(0, projected, X_new.colwise().squaredNorm().transpose());
+
+        parallel_for(n_trees, [&](int n_tree) {
+            for (int i = 0; i < n_new; ++i) {
+                const float *projected_point = projected.col(i).data();
+                int idx_tree = 0;
+                for (int d = 0; d < depth; ++d) {
+                    const float split_point = split_data[n_tree * n_array + idx_tree];
+                    idx_tree = 2 * idx_tree + (projected_point[n_tree * depth + d] <= split_point ? 1 : 2);
+                }
+                inserted_leaves[n_tree * n_leaves + idx_tree - n_leaves + 1].push_back(n_old + i);
+                if (leaf_radii.size())
+                    extend_leaf_bound(n_tree * n_leaves + idx_tree - n_leaves + 1, X_new.col(i).data());
+            }
+        });
+
+        regrow_drifted_trees();
+        return true;
+    }
+
+    /**
+    * Deletes points from the index. The deleted points are marked in a bitmap
+    * that the vote counting consults, so they are never elected to the linear
+    * search, and the exact searches skip them too. Once more than an eighth of
+    * the points in the trees are deleted, the leaves are rewritten without them.
+    * Queries pay for the bitmap only while some deleted points are still in the
+    * trees. The ids of the other points do not change. Must not be called
+    * concurrently with queries.
+    * @param ids - The ids of the points to delete. Points already deleted are skipped.
+    * @param n - The number of ids
+    * @return false if an id is out of range, in which case nothing is deleted
+    */
+    bool remove(const int *ids, int n) {
+        wait_load();
+        ++n_changes;
+        for (int i = 0; i < n; ++i)
+            if (ids[i] < 0 || ids[i] >= n_samples)
+                return false;
+
+        expand_duplicates();
+        if (deleted_bits.empty())
+            deleted_bits.assign((n_samples + 63) / 64, 0);
+        for (int i = 0; i < n; ++i) {
+            const int id = to_internal(ids[i]);
+            if (is_deleted(id)) continue;
+            deleted_bits[id >> 6] |= uint64_t(1) << (id & 63);
+            ++n_deleted;
+            ++n_stale;
+        }
+
+        if (8 * (int64_t) n_stale > tree_points + n_unmerged)
+            compact_leaves();
+        for (int i = 0; i < n && labels.size(); ++i)
+            unlabel(ids[i]);
+        return true;
+    }
+
+    /**
+    * Replaces the vectors of existing points, keeping their ids. The new vectors
+    * are routed down the trees with the existing split points, and a point is
+    * moved only in the trees in which its leaf changes, so an update that barely
+    * moves a vector leaves most trees as they are. The vectors are overwritten
+    * in the data owned by the index, with their codes and the other copies of
+    * the data, so the first update copies the data as insert does. A tree in
+    * which a leaf grows too large is built again as by insert. Undoes
+    * reorder_data. Must not be called concurrently with queries.
+    * @param ids - The original ids of the points, each at most once
+    * @param X_new - The new vectors as a dim x n matrix, in the order of ids
+    * @return false if an id is out of range, repeated or deleted, if the vectors
+    * have the wrong dimension, or if the index holds 8-bit data, in which case
+    * nothing is changed
+    */
+    bool update(const int *ids, const Ref<const MatrixXf> &X_new) {
+        wait_load();
+        ++n_changes;
+        const int n = X_new.cols(), n_leaves = 1 << depth;
+        if (byte_data || X_new.rows() != dim)
+            return false;
+        expand_duplicates();
+        // the ids sorted, with the columns of their vectors
+        std::vector<std::pair<int, int>> order(n);
+        for (int i = 0; i < n; ++i) {
+            if (ids[i] < 0 || ids[i] >= n_samples || (n_deleted && is_deleted(to_internal(ids[i]))))
+                return false;
+            order[i] = std::make_pair(ids[i], i);
+        }
+        std::sort(order.begin(), order.end());
+        for (int i = 1; i < n; ++i)
+            if (order[i].first == order[i - 1].first)
+                return false;
+        if (!n)
+            return true;
+
+        append_points(MatrixXf(dim, 0));
+        compact_leaves();
+        const int n_leading = leading_dimensions.size();
+        std::vector<uint64_t> updated((n_samples + 63) / 64, 0);
+        for (const auto &p : order) {
+            const float *x = X_new.col(p.second).data();
+            std::copy(x, x + dim, stored_points() + (size_t) p.first * dim);
+            updated[p.first >> 6] |= uint64_t(1) << (p.first & 63);
+            if (data_squared_norms.size())
+                data_squared_norms(p.first) = X_new.col(p.second).squaredNorm();
+            for (int d = 0; d < n_leading; ++d)
+                leading_data[(size_t) n_leading * p.first + d] = x[leading_dimensions(d)];
+        }
+        // the codes of each run of consecutive ids at once
+        for (int i = 0, j = 1; i < n && codes.size(); i = j++) {
+            while (j < n && order[j].first == order[j - 1].first + 1)
+                ++j;
+            quantize_points(order[i].first, order[j - 1].first + 1);
+        }
+
+        MatrixXf projected = project_points(X_new);
+        transform_projections(0, projected, X_new.colwise().squaredNorm().transpose());
+        parallel_for(n_trees, [&](int n_tree) {
+            // the new leaf of each point, by its position in order
+            std::vector<int> new_leaf(n);
+            for (int k = 0; k < n; ++k) {
+                const float *projected_point = projected.col(order[k].second).data();
+                int idx_tree = 0;
+                for (int d = 0; d < depth; ++d) {
+                    const float split_point = split_data[n_tree * n_array + idx_tree];
+                    idx_tree = 2 * idx_tree + (projected_point[n_tree * depth + d] <= split_point ? 1 : 2);
+                }
+                new_leaf[k] = idx_tree - n_leaves + 1;
+                if (leaf_radii.size())
+                    extend_leaf_bound(n_tree * n_leaves + new_leaf[k], X_new.col(order[k].second).data());
+            }
+            int *first = leaf_first.col(n_tree).data(), *tree = leaf_ids.col(n_tree).data();
+            auto position = [&](int id) {
+                return std::lower_bound(order.begin(), order.end(), std::make_pair(id, 0)) - order.begin();
+            };
+            auto is_updated = [&](int id) { return (updated[id >> 6] >> (id & 63)) & 1; };
+
+            // the points that change leaves, sorted by their new leaves
+            std::vector<int> old_leaf(n);
+            for (int j = 0; j < n_leaves; ++j)
+                for (int i = first[j]; i < first[j + 1]; ++i)
+                    if (is_updated(tree[i]))
+                        old_leaf[position(tree[i])] = j;
+            std::vector<std::pair<int, int>> moved;
+            for (int k = 0; k < n; ++k)
+                if (new_leaf[k] != old_leaf[k])
+                    moved.push_back(std::make_pair(new_leaf[k], order[k].first));
+            if (moved.empty())
+                return;
+            std::sort(moved.begin(), moved.end());
+
+            // the tree is written again with the points that left a leaf taken out of
+            // it and those that entered it after its other points
+            std::vector<int> rewritten(tree_points);
+            int *out = rewritten.data();
+            auto next = moved.begin();
+            for (int j = 0; j < n_leaves; ++j) {
+                const int start = out - rewritten.data();
+                for (int i = first[j]; i < first[j + 1]; ++i)
+                    if (!is_updated(tree[i]) || new_leaf[position(tree[i])] == j)
+                        *out++ = tree[i];
+                for (; next != moved.end() && next->first == j; ++next)
+                    *out++ = next->second;
+                first[j] = start;
+            }
+            std::copy(rewritten.begin(), rewritten.end(), tree);
+        });
+
+        regrow_drifted_trees();
+        return true;
+    }
+
+    /**
+    * Gives the points labels, such as the 64-bit keys of the items in a
+    * database, so that the queries can answer in the labels (see to_labels) and
+    * find_label maps a label back to its point, without a map kept by the
+    * caller. The reverse lookup is a hash table of the ids, probed by the
+    * labels, which takes 8 bytes per point besides the labels. Points inserted
+    * later get no label unless insert is given theirs, deleted points lose
+    * theirs, and save stores the labels with the index.
+    * @param values - The label of every point, by the original ids, n_samples of
+    * them, or -1 for a point without a label
+    * @return false if two points have the same label, in which case the labels
+    * are not changed
+    */
+    bool set_labels(const int64_t *values) {
+        wait_load();
+        ++n_changes;
+        std::vector<int64_t> old_labels(values, values + n_samples);
+        labels.swap(old_labels);
+        if (index_labels())
+            return true;
+        labels.swap(old_labels);
+        index_labels();
+        return false;
+    }
+
+    /**
+    * Removes the labels of set_labels.
+    */
+    void clear_labels() {
+        wait_load();
+        ++n_changes;
+        labels = std::vector<int64_t>();
+        label_slots = std::vector<int>();
+        n_labeled = 0;
+    }
+
+    /**
+    * Returns true if the points have labels, see set_labels.
+    */
+    bool has_labels() const {
+        return !labels.empty();
+    }
+
+    /**
+    * Returns the label of a point given its original id, or -1 if it has none.
+    */
+    int64_t label(int id) const {
+        return id >= 0 && id < (int) labels.size() ? labels[id] : -1;
+    }
+
+    /**
+    * Returns the original id of the point with a label, or -1 if no point has
+    * it. A probe of the hash table, usually touching one or two slots.
+    */
+    int find_label(int64_t value) const {
+        if (value == -1 || label_slots.empty())
+            return -1;
+        const size_t mask = label_slots.size() - 1;
+        for (size_t slot = mix_bits(value) & mask;; slot = (slot + 1) & mask) {
+            const int id = label_slots[slot];
+            if (id < 0 || labels[id] == value)
+                return id;
+        }
+    }
+
+    /**
+    * Writes the labels of the n points with the original ids ids into out,
+    * such as the neighbors returned by the queries, with -1 for the ids -1 of
+    * missing neighbors and for points without a label.
+    */
+    void to_labels(const int *ids, size_t n, int64_t *out) const {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = label(ids[i]);
+    }
+
+    /**
+    * Inserts new points with labels, as insert does without them.
+    * @param X_new - The new points as a dim x n_new matrix
+    * @param new_labels - The labels of the new points, n_new of them, or -1 for
+    * a point without a label
+    * @return false if a label is already used or repeated, or as insert, in
+    * which case nothing is inserted
+    */
+    bool insert(const Ref<const MatrixXf> &X_new, const int64_t *new_labels) {
+        if (!new_labels_valid(new_labels, X_new.cols(), false))
+            return false;
+        const int n_old = n_samples;
+        if (!insert(X_new))
+            return false;
+        if (labels.empty())
+            labels.assign(n_samples, -1);
+        for (int i = 0; i < X_new.cols(); ++i) {
+            labels[n_old + i] = new_labels[i];
+            index_label(n_old + i);
+        }
+        return true;
+    }
+
+    /**
+    * Inserts new points with labels, first deleting the points that already
+    * have their labels, so that a changed item replaces its old point.
+    * @return false if a label is repeated in new_labels, or as insert, in which
+    * case nothing is changed
+    */
+    bool upsert(const Ref<const MatrixXf> &X_new, const int64_t *new_labels) {
+        wait_load();
+        if (byte_data || X_new.rows() != dim || (int64_t) n_samples + X_new.cols() > std::numeric_limits<int>::max() ||
+            !new_labels_valid(new_labels, X_new.cols(), true))
+            return false;
+        std::vector<int> replaced;
+        for (int i = 0; i < X_new.cols(); ++i) {
+            const int id = find_label(new_labels[i]);
+            if (id >= 0)
+                replaced.push_back(id);
+        }
+        return remove(replaced.data(), replaced.size()) && insert(X_new, new_labels);
+    }
+
+    /**
+    * Deletes the points with the given labels as remove does, skipping the
+    * labels no point has.
+    * @return The number of points deleted
+    */
+    int remove_labels(const int64_t *values, int n) {
+        std::vector<int> ids;
+        for (int i = 0; i < n; ++i) {
+            const int id = find_label(values[i]);
+            if (id >= 0)
+                ids.push_back(id);
+        }
+        remove(ids.data(), ids.size());
+        return ids.size();
+    }
+
+    /**
+    * Adds the points of another index to this one, so that indexes built apart
+    * over parts of the data, such as one per day, can be combined without
+    * growing an index over all of it. The points of other are inserted into the
+    * trees of this index as by insert, so it pays to merge the smaller index
+    * into the larger one, and the point i of other gets the id n_samples + i.
+    * The points deleted from other are deleted here too, and the attributes set
+    * on both indexes for all their points get the values of other for its points,
+    * as do the labels of other, which must not be used here. Only the data of
+    * other is read, so its trees and random vectors may be anything. Must not
+    * be called concurrently with queries on this index.
+    * @param other - Another index with the same dim and metric
+    * @return false if other is this index, if the indexes differ in dim or
+    * metric, if other does not keep its data or has duplicates collapsed by
+    * collapse_duplicates, if the indexes have labels in common, or if this index
+    * would hold 2^31 points or more, true otherwise
+    */
+    bool merge(const Mrpt &other) {
+        if (&other == this || other.dim != dim || other.metric != metric || other.X->cols() != other.n_samples ||
+            !other.duplicate_ids.empty() ||
+            (other.labels.size() && !new_labels_valid(other.labels.data(), other.n_samples, false)))
+            return false;
+        const int n_old = n_samples;
+
+        // the data of other in the order of its ids
+        MatrixXf reordered;
+        if (other.data_order.size()) {
+            reordered.resize(dim, other.n_samples);
+            for (int i = 0; i < other.n_samples; ++i)
+                reordered.col(i) = Map<const VectorXf>(other.column(other.to_internal(i)), dim);
+        }
+        Map<const MatrixXf> points(other.data_order.size() ? reordered.data() : other.search_data, dim, other.n_samples);
+        if (!insert(points))
+            return false;
+
+        for (auto &attribute : attributes) {
+            const auto values = other.attributes.find(attribute.first);
+            if (values == other.attributes.end() || (int) attribute.second.size() != n_old)
+                continue;
+            attribute.second.insert(attribute.second.end(), values->second.begin(), values->second.end());
+        }
+        if (other.labels.size()) {
+            labels.resize(n_samples, -1);
+            std::copy(other.labels.begin(), other.labels.end(), labels.begin() + n_old);
+            index_labels();
+        }
+
+        std::vector<int> deleted;
+        for (int i = 0; other.n_deleted && i < other.n_samples; ++i)
+            if (other.is_deleted(other.to_internal(i)))
+                deleted.push_back(n_old + i);
+        return remove(deleted.data(), deleted.size());
+    }
+
+    /**
+    * Appends the trees of another index over the same points to the trees of
+    * this one, such as the parts of a forest grown with grow_part, which are
+    * appended in the order of their trees. The random vectors of the trees come
+    * along, and the index is saved as a GAUSSIAN one unless the trees of other
+    * continue those of this index in the same forest. INNER_PRODUCT trees have
+    * to do so, as their extra dimension is drawn from the number of the tree.
+    * The leaves are copied with the inserted points merged and the deleted
+    * points left out, so other must hold the same points as this index, which
+    * is copied into memory if it is mapped. Must not be called concurrently with
+    * queries on this index.
+    * @param other - An index with the same data, depth, density and metric
+    * @return false if other is this index, if the indexes differ in their
+    * points or parameters, if either projection is HADAMARD or if the trees are
+    * not loaded, in which case nothing changes, true otherwise
+    */
+    bool append_trees(const Mrpt &other) {
+        wait_load();
+        ++n_changes;
+        const bool continues = other.build_seed == build_seed && other.first_tree == first_tree + n_trees;
+        if (&other == this || other.dim != dim || other.n_samples != n_samples || other.depth != depth ||
+            other.density != density || other.metric != metric || projection == HADAMARD ||
+            other.projection == HADAMARD || !n_trees || trees_loaded() < n_trees ||
+            other.trees_loaded() < other.n_trees || other.tree_points + other.n_unmerged - other.n_stale !=
+            tree_points + n_unmerged - n_stale || (metric == INNER_PRODUCT && (!continues || other.max_norm != max_norm)))
+            return false;
+
+        copy_mapped_index();
+        own_random_matrix();
+        compact_leaves();
+        blocked_ready = false;
+        const int n_other = other.n_trees, n_leaves = 1 << depth;
+
+        // the leaves of other in the internal ids of this index
+        MatrixXi first, ids;
+        other.merged_leaves(first, ids);
+        if (other.data_order.size() || data_order.size()) {
+            for (int64_t i = 0; i < ids.size(); ++i)
+                ids.data()[i] = to_internal(other.to_external(ids.data()[i]));
+        }
+        split_points.conservativeResize(n_array, n_trees + n_other);
+        split_points.rightCols(n_other) = Map<const MatrixXf>(other.split_data, n_array, n_other);
+        leaf_first.conservativeResize(n_leaves + 1, n_trees + n_other);
+        leaf_first.rightCols(n_other) = first;
+        leaf_ids.conservativeResize(tree_points, n_trees + n_other);
+        leaf_ids.rightCols(n_other) = ids;
+
+        if (density < 1) {
+            std::vector<Triplet<float>> triplets;
+            for (int k = 0; k < random_matrix->sparse.outerSize(); ++k)
+                for (SparseMatrix<float, RowMajor>::InnerIterator it(random_matrix->sparse, k); it; ++it)
+                    triplets.push_back(Triplet<float>(it.row(), it.col(), it.value()));
+            for (int k = 0; k < other.sparse_matrix.outerSize(); ++k)
+                for (Map<const SparseMatrix<float, RowMajor>>::InnerIterator it(other.sparse_matrix, k); it; ++it)
+                    triplets.push_back(Triplet<float>(n_pool + it.row(), it.col(), it.value()));
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool + other.n_pool, dim);
+            random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+            random_matrix->sparse.makeCompressed();
+        } else {
+            random_matrix->dense.conservativeResize(n_pool + other.n_pool, dim);
+            random_matrix->dense.bottomRows(other.n_pool) = other.dense_matrix;
+        }
+
+        if (!continues || other.projection != projection)
+            projection = GAUSSIAN;
+        n_trees += n_other;
+        n_pool = n_trees * depth;
+        forest_trees = std::max(forest_trees, first_tree + n_trees);
+        n_ready_trees = n_trees;
+
+        use_owned_trees();
+        use_owned_random_matrix();
+        layout_splits();
+        if (leaf_radii.size())
+            set_leaf_bounds(X->cols() == n_samples);
+        if (quantization == BINARY)
+            quantize_data();
+        return true;
+    }
+
+    /**
+    * A function that receives the bytes of a saved index in order, and returns
+    * false if it could not take them.
+    */
+    typedef std::function<bool(const void *data, size_t bytes)> IndexWriter;
+
+    /**
+    * Saves the index to a file. The file starts with an IndexFileHeader and has the
+    * split points, the leaf offsets, the leaves, the random matrix, the deleted points,
+    * the leaf bounds and the checksums of these in sections aligned to 64 bytes, so
+    * that load can map the trees straight from the file.
+    * @param path - Filepath to the output file.
+    * @return True if saving succeeded, false otherwise.
+    */
+    bool save(const char *path) const {
+        FILE *fd;
+        if ((fd = fopen(path, "wb")) == NULL)
+            return false;
+
+        const bool ok = save([fd](const void *data, size_t bytes) {
+            return fwrite(data, 1, bytes, fd) == bytes;
+        });
+        return fclose(fd) == 0 && ok;
+    }
+
+    /**
+    * Saves the index to a compressed file of mrpt_compress.h, which load and
+    * load_from_memory decompress, for copying the index between machines: the
+    * file written by save is cut into blocks of 4 MB that are compressed with
+    * zstd by all threads. The leaves and a Gaussian random matrix compress
+    * little, but the split points and the leaf offsets of deep trees do, and
+    * decompressing is faster than the network. Needs zstd, see mrpt_compress.h.
+    * @param path - Filepath to the output file.
+    * @param level - The zstd compression level, from 1, the fastest, to 19, the smallest
+    * @return True if saving succeeded, false otherwise, and always without zstd.
+    */
+    bool save_compressed(const char *path, int level = 3) const {
+        if (!mrpt_compress::available())
+            return false;
+        std::vector<char> raw;
+        if (!save([&raw](const void *data, size_t bytes) {
+                raw.insert(raw.end(), static_cast<const char *>(data), static_cast<const char *>(data) + bytes);
+                return true;
+            }))
+            return false;
+
+        const size_t block_size = (size_t) 4 << 20;
+        const size_t n_blocks = (raw.size() + block_size - 1) / block_size;
+        std::vector<std::vector<char>> blocks(n_blocks);
+        std::vector<uint64_t> sizes(n_blocks);
+        std::atomic<bool> ok(true);
+        parallel_for((int) n_blocks, [&](int b) {
+            const size_t first = b * block_size, bytes = std::min(block_size, raw.size() - first);
+            blocks[b].resize(mrpt_compress::compress_bound(bytes));
+            sizes[b] = mrpt_compress::compress_block(raw.data() + first, bytes, blocks[b].data(), blocks[b].size(),
+                                                     level);
+            if (!sizes[b])
+                ok = false;
+        });
+        if (!ok)
+            return false;
+
+        mrpt_compress::CompressedFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, mrpt_compress::compressed_file_magic(), sizeof(header.magic));
+        header.version = mrpt_compress::compressed_file_version();
+        header.raw_size = raw.size();
+        header.block_size = block_size;
+        header.n_blocks = n_blocks;
+        FILE *fd;
+        if ((fd = fopen(path, "wb")) == NULL)
+            return false;
+        bool written = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+                       fwrite(sizes.data(), sizeof(uint64_t), n_blocks, fd) == n_blocks;
+        for (size_t b = 0; b < n_blocks && written; ++b)
+            written = fwrite(blocks[b].data(), 1, sizes[b], fd) == sizes[b];
+        return fclose(fd) == 0 && written;
+    }
+
+    /**
+    * Saves the changes of the index since base to a delta file, which turns an
+    * index loaded from the same file as base into this one with apply_delta, so
+    * that after inserts, removals and regrown trees only the changes are copied
+    * to the machines serving the index instead of the whole index and data. The
+    * delta holds the vectors of the new points and their leaves in the trees
+    * whose split points and random vectors did not change, the ids of the
+    * points deleted since base, and the whole of the trees that did change,
+    * grown again by insert or regrow_trees, with the random matrix if it changed.
+    * base is typically the index file the servers have, loaded into another
+    * index, which needs no data; this index needs its data if it has new points.
+    * @param path - Filepath to the delta file.
+    * @param base - The index this one was changed from, with the same dim,
+    * trees, depth, density and metric and with no more points
+    * @return False if the file cannot be written, or if this index cannot have
+    * been changed from base: its parameters differ, it has fewer points, or it
+    * no longer deletes a point deleted from base, or if either index has
+    * duplicates collapsed by collapse_duplicates. True otherwise.
+    */
+    bool save_delta(const char *path, const Mrpt &base) const {
+        const int n_leaves = 1 << depth, n_new = n_samples - base.n_samples;
+        if (base.dim != dim || base.n_trees != n_trees || base.depth != depth || base.density != density ||
+            base.metric != metric || n_new < 0 || (n_new && X->cols() != n_samples) || !duplicate_ids.empty() ||
+            !base.duplicate_ids.empty())
+            return false;
+
+        std::vector<int> tombstones;
+        for (int i = 0; i < n_samples; ++i) {
+            const bool deleted = n_deleted && is_deleted(to_internal(i));
+            const bool base_deleted = i < base.n_samples && base.n_deleted && base.is_deleted(base.to_internal(i));
+            if (base_deleted && !deleted)
+                return false;
+            if (deleted && !base_deleted)
+                tombstones.push_back(i);
+        }
+        const int n_points = tree_points + n_unmerged - n_stale;
+        if (n_points != n_samples - n_deleted)
+            return false;
+
+        // the trees whose split points or random vectors changed are written whole
+        std::vector<int> regrown, kept;
+        bool matrix_changed = false;
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            const bool same_rows = same_random_rows(base, n_tree);
+            matrix_changed = matrix_changed || !same_rows;
+            const bool same_splits = std::equal(split_data + (size_t) n_tree * n_array,
+                                                split_data + (size_t) (n_tree + 1) * n_array,
+                                                base.split_data + (size_t) n_tree * n_array);
+            (same_rows && same_splits ? kept : regrown).push_back(n_tree);
+        }
+
+        // the new points are found in the leaves of the other trees; deleted ones may be left out of them
+        std::vector<int> new_leaves((size_t) n_new * kept.size(), 0);
+        parallel_for((int) kept.size(), [&](int t) {
+            const int n_tree = kept[t];
+            int *leaves = new_leaves.data() + (size_t) t * n_new;
+            auto note = [&](const int *ids, int n, int leaf) {
+                for (int i = 0; i < n; ++i) {
+                    const int id = to_external(ids[i]);
+                    if (id >= base.n_samples) leaves[id - base.n_samples] = leaf;
+                }
+            };
+            for (int j = 0; j < n_leaves; ++j) {
+                visit_leaves(n_tree, j, j + 1, [&](const int *ids, int n) { note(ids, n, j); });
+                if (!inserted_leaves.empty()) {
+                    const std::vector<int> &inserted = inserted_leaves[n_tree * n_leaves + j];
+                    note(inserted.data(), inserted.size(), j);
+                }
+            }
+        });
+
+        DeltaFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, delta_file_magic(), sizeof(header.magic));
+        header.version = 1;
+        header.dim = dim;
+        header.n_trees = n_trees;
+        header.depth = depth;
+        header.density = density;
+        header.metric = metric;
+        header.base_n_samples = base.n_samples;
+        header.base_fingerprint = base.delta_fingerprint();
+        header.n_samples = n_samples;
+        header.n_tombstones = tombstones.size();
+        header.n_regrown = regrown.size();
+        header.projection = projection;
+        header.seed = build_seed;
+        header.max_norm = max_norm;
+        header.random_matrix_bytes = matrix_changed ? random_matrix_bytes() : 0;
+        header.file_size = sizeof(header) + sizeof(float) * (uint64_t) n_new * dim +
+                           sizeof(int) * ((uint64_t) n_new * kept.size() + tombstones.size() + regrown.size()) +
+                           (sizeof(float) * n_array + sizeof(int) * (n_leaves + 1 + (uint64_t) n_points)) * regrown.size() +
+                           header.random_matrix_bytes + sizeof(uint32_t);
+
+        FILE *fd;
+        if ((fd = fopen(path, "wb")) == NULL)
+            return false;
+        uint32_t crc = 0;
+        bool ok = true;
+        const IndexWriter put = [&](const void *data, size_t bytes) {
+            ok = ok && fwrite(data, 1, bytes, fd) == bytes;
+            crc = mrpt_kernels::crc32c(crc, data, bytes);
+            return ok;
+        };
+        put(&header, sizeof(header));
+        for (int i = base.n_samples; i < n_samples; ++i)
+            put(column(to_internal(i)), sizeof(float) * dim);
+        put(new_leaves.data(), sizeof(int) * new_leaves.size());
+        put(tombstones.data(), sizeof(int) * tombstones.size());
+        put(regrown.data(), sizeof(int) * regrown.size());
+        if (!regrown.empty()) {
+            VectorXi first(n_leaves + 1), ids(n_points);
+            for (int n_tree : regrown) {
+                merge_tree(n_tree, first.data(), ids.data());
+                for (int i = 0; i < n_points && data_order.size(); ++i)
+                    ids(i) = to_external(ids(i));
+                put(split_data + (size_t) n_tree * n_array, sizeof(float) * n_array);
+                put(first.data(), sizeof(int) * (n_leaves + 1));
+                put(ids.data(), sizeof(int) * n_points);
+            }
+        }
+        if (matrix_changed)
+            write_random_matrix(put);
+        const uint32_t checksum = crc;
+        put(&checksum, sizeof(checksum));
+        return fclose(fd) == 0 && ok;
+    }
+
+    /**
+    * Applies a delta file written by save_delta to the index, which has to be
+    * in the state of the base the delta was made against, as checked by its
+    * fingerprint: loaded from the same file, or from it and the same earlier
+    * deltas. The new points are appended to the data as by insert and put into
+    * the leaves the delta gives, the deleted points are deleted as by remove, and
+    * the changed trees and random vectors are replaced, so the index answers the
+    * queries as the index the delta was saved from. An index mapped from a file
+    * is copied into memory. Needs the data, and must not be called concurrently
+    * with queries.
+    * @param path - Filepath to the delta file.
+    * @return False if the file cannot be read, is corrupted, or was not made
+    * against the current state of the index, in which case nothing changes.
+    */
+    bool apply_delta(const char *path) {
+        wait_load();
+        ++n_changes;
+        expand_duplicates();
+        FILE *fd;
+        if ((fd = fopen(path, "rb")) == NULL)
+            return false;
+        const size_t bytes = file_size(fd);
+        std::vector<char> file(bytes);
+        const bool read = seek(fd, 0) && fread(file.data(), 1, bytes, fd) == bytes;
+        fclose(fd);
+
+        DeltaFileHeader header;
+        uint32_t checksum;
+        if (!read || bytes < sizeof(header) + sizeof(checksum))
+            return false;
+        memcpy(&header, file.data(), sizeof(header));
+        memcpy(&checksum, file.data() + bytes - sizeof(checksum), sizeof(checksum));
+        if (memcmp(header.magic, delta_file_magic(), sizeof(header.magic)) || header.version != 1 ||
+            header.file_size != bytes || mrpt_kernels::crc32c(0, file.data(), bytes - sizeof(checksum)) != checksum)
+            return false;
+        if (header.dim != dim || header.n_trees != n_trees || header.depth != depth || header.density != density ||
+            header.metric != metric || header.base_n_samples != n_samples || header.n_samples < n_samples ||
+            header.n_regrown < 0 || header.n_regrown > n_trees || header.n_tombstones < 0 ||
+            header.n_tombstones > header.n_samples - n_deleted || X->cols() != n_samples ||
+            header.base_fingerprint != delta_fingerprint())
+            return false;
+
+        const int n_leaves = 1 << depth, n_old = n_samples, n_new = header.n_samples - n_samples;
+        const int n_kept = n_trees - header.n_regrown, n_points = header.n_samples - n_deleted - header.n_tombstones;
+        if (header.file_size != sizeof(header) + sizeof(float) * (uint64_t) n_new * dim +
+                                sizeof(int) * ((uint64_t) n_new * n_kept + header.n_tombstones + header.n_regrown) +
+                                (sizeof(float) * n_array + sizeof(int) * (n_leaves + 1 + (uint64_t) n_points)) *
+                                header.n_regrown + header.random_matrix_bytes + sizeof(uint32_t))
+            return false;
+        const char *section = file.data() + sizeof(header);
+        const float *points = reinterpret_cast<const float *>(section);
+        const int *new_leaves = reinterpret_cast<const int *>(points + (size_t) n_new * dim);
+        const int *tombstones = new_leaves + (size_t) n_new * n_kept;
+        const int *regrown = tombstones + header.n_tombstones;
+        const char *trees = reinterpret_cast<const char *>(regrown + header.n_regrown);
+        const size_t tree_bytes = sizeof(float) * n_array + sizeof(int) * (n_leaves + 1 + (size_t) n_points);
+        const char *matrix = trees + tree_bytes * header.n_regrown;
+
+        // everything is checked before the index is changed
+        for (size_t i = 0; i < (size_t) n_new * n_kept; ++i)
+            if (new_leaves[i] < 0 || new_leaves[i] >= n_leaves)
+                return false;
+        std::vector<bool> deleted(header.n_samples, false);
+        for (int i = 0; i < header.n_tombstones; ++i) {
+            const int id = tombstones[i];
+            if (id < 0 || id >= header.n_samples || deleted[id] || (id < n_samples && n_deleted && is_deleted(to_internal(id))))
+                return false;
+            deleted[id] = true;
+        }
+        for (int t = 0; t < header.n_regrown; ++t) {
+            if (regrown[t] < (t ? regrown[t - 1] + 1 : 0) || regrown[t] >= n_trees)
+                return false;
+            const int *first = reinterpret_cast<const int *>(trees + tree_bytes * t + sizeof(float) * n_array);
+            const int *ids = first + n_leaves + 1;
+            bool ok = first[0] == 0 && first[n_leaves] == n_points;
+            for (int j = 0; j < n_leaves && ok; ++j)
+                ok = first[j] <= first[j + 1];
+            for (int i = 0; i < n_points && ok; ++i)
+                ok = ids[i] >= 0 && ids[i] < header.n_samples;
+            if (!ok)
+                return false;
+        }
+        if (header.projection < 0 || header.projection > HADAMARD ||
+            (header.random_matrix_bytes && header.projection != GAUSSIAN && header.random_matrix_bytes != sizeof(unsigned)))
+            return false;
+
+        // a Gaussian random matrix is checked as it is read, before anything else changes
+        copy_mapped_index();
+        if (header.random_matrix_bytes && header.projection == GAUSSIAN) {
+            const Projection old_projection = projection;
+            projection = GAUSSIAN;
+            if (!map_random_matrix(matrix, header.random_matrix_bytes)) {
+                projection = old_projection;
+                return false;
+            }
+            random_matrix_mapped = true;
+            own_random_matrix();
+        } else if (header.random_matrix_bytes) {
+            projection = static_cast<Projection>(header.projection);
+            build_seed = header.seed;
+            density < 1 ? build_sparse_random_matrix() : build_dense_random_matrix();
+            use_owned_random_matrix();
+        }
+        projection = static_cast<Projection>(header.projection);
+        build_seed = header.seed;
+        max_norm = header.max_norm;
+
+        if (n_new) {
+            append_points(Map<const MatrixXf>(points, dim, n_new));
+            // the trees grown again are replaced below, so their new points only hold a place in leaf 0
+            for (int n_tree = 0, t = 0, k = 0; n_tree < n_trees; ++n_tree) {
+                const bool replaced = t < header.n_regrown && regrown[t] == n_tree;
+                for (int i = 0; i < n_new; ++i) {
+                    const int leaf = replaced ? 0 : new_leaves[(size_t) k * n_new + i];
+                    inserted_leaves[n_tree * n_leaves + leaf].push_back(n_old + i);
+                    if (leaf_radii.size() && !replaced)
+                        extend_leaf_bound(n_tree * n_leaves + leaf, points + (size_t) i * dim);
+                }
+                replaced ? ++t : ++k;
+            }
+        }
+        if (header.n_tombstones && deleted_bits.empty())
+            deleted_bits.assign((n_samples + 63) / 64, 0);
+        for (int i = 0; i < header.n_tombstones; ++i) {
+            const int id = to_internal(tombstones[i]);
+            deleted_bits[id >> 6] |= uint64_t(1) << (id & 63);
+            ++n_deleted;
+            ++n_stale;
+        }
+        if (header.n_regrown || 8 * (int64_t) n_unmerged > n_samples || 8 * (int64_t) n_stale > tree_points + n_unmerged)
+            compact_leaves();
+
+
+        for (int t = 0; t < header.n_regrown; ++t) {
+            const int n_tree = regrown[t];
+            const float *split = reinterpret_cast<const float *>(trees + tree_bytes * t);
+            const int *first = reinterpret_cast<const int *>(split + n_array), *ids = first + n_leaves + 1;
+            std::copy(split, split + n_array, split_points.col(n_tree).data());
+            std::copy(first, first + n_leaves + 1, leaf_first.col(n_tree).data());
+            int *indices = leaf_ids.col(n_tree).data();
+            for (int i = 0; i < n_points; ++i)
+                indices[i] = to_internal(ids[i]);
+            if (data_order.size())
+                for (int j = 0; j < n_leaves; ++j)
+                    std::sort(indices + first[j], indices + first[j + 1]);
+            if (leaf_radii.size())
+                bound_tree(n_tree);
+        }
+        if (header.n_regrown) {
+            layout_splits();
+            if (quantization == BINARY)
+                quantize_data();
+        }
+        return true;
+    }
+
+    /**
+    * Saves the index to a stream in the format of the files written by save, for
+    * example into a buffer that is sent over the network and loaded with
+    * load_from_memory.
+    * @param out - The stream, which should be opened in binary mode.
+    * @return True if saving succeeded, false otherwise.
+    */
+    bool save(std::ostream &out) const {
+        return save([&out](const void *data, size_t bytes) {
+            return static_cast<bool>(out.write(static_cast<const char *>(data), bytes));
+        });
+    }
+
+    /**
+    * Saves the index in the format of the files written by save, passing its bytes
+    * in order to write. The whole header is written first, so the bytes can go to
+    * a socket or a buffer as well as to a file.
+    * @param write - The function receiving the bytes.
+    * @return True if every call of write succeeded, false otherwise.
+    */
+    bool save(const IndexWriter &write) const {
+        const int n_leaves = 1 << depth;
+        IndexFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, index_file_magic(), sizeof(header.magic));
+        header.version = index_file_version();
+        header.n_samples = n_samples;
+        header.dim = dim;
+        header.n_trees = n_trees;
+        header.depth = depth;
+        header.density = density;
+        header.seed = build_seed;
+        header.projection = projection;
+        header.metric = metric;
+        header.max_norm = max_norm;
+        header.first_tree = first_tree;
+        header.split_points_offset = align_section(sizeof(header));
+        header.leaf_first_offset = align_section(header.split_points_offset + sizeof(float) * n_array * n_trees);
+        header.leaf_ids_offset = align_section(header.leaf_first_offset + sizeof(int) * (n_leaves + 1) * n_trees);
+
+        // the inserted points are stored in the leaves they were inserted into, and the deleted points are left out;
+        // collapsed duplicates are stored as the other points
+        const int *first_data = leaf_first_data, *ids_data = leaf_ids_data;
+        MatrixXi merged_first, merged_ids;
+        if (n_unmerged || n_stale || !duplicate_ids.empty()) {
+            merged_leaves(merged_first, merged_ids, true);
+            first_data = merged_first.data();
+            ids_data = merged_ids.data();
+        }
+        const int n_points = tree_points + n_unmerged - n_stale + duplicate_ids.size();
+        header.n_tree_points = n_points;
+        header.random_matrix_offset = align_section(header.leaf_ids_offset + sizeof(int) * n_points * n_trees);
+        header.file_size = header.random_matrix_offset + random_matrix_bytes();
+
+        std::vector<uint64_t> bits;
+        if (n_deleted > (int) duplicate_ids.size()) {
+            bits.assign(deleted_bits.size(), 0);
+            for (int i = 0; i < n_samples; ++i) {
+                const int id = to_external(i);
+                if (is_deleted(i)) bits[id >> 6] |= uint64_t(1) << (id & 63);
+            }
+            for (int i : duplicate_ids) {
+                const int id = to_external(i);
+                bits[id >> 6] &= ~(uint64_t(1) << (id & 63));
+            }
+            header.deleted_offset = align_section(header.file_size);
+            header.file_size = header.deleted_offset + sizeof(uint64_t) * bits.size();
+        }
+        if (leaf_radii.size()) {
+            header.leaf_bounds_offset = align_section(header.file_size);
+            header.file_size = header.leaf_bounds_offset + leaf_bounds_bytes();
+        }
+        if (labels.size()) {
+            header.labels_offset = align_section(header.file_size);
+            header.file_size = header.labels_offset + sizeof(int64_t) * labels.size();
+        }
+        header.checksums_offset = align_section(header.file_size);
+        header.file_size = header.checksums_offset + sizeof(IndexFileChecksums);
+        header.header_checksum = header_checksum(header);
+
+        IndexFileChecksums checksums;
+        memset(&checksums, 0, sizeof(checksums));
+        uint64_t position = 0;
+        uint32_t crc = 0;
+        bool ok = true;
+        const IndexWriter put = [&](const void *data, size_t bytes) {
+            ok = ok && (!bytes || write(data, bytes));
+            crc = mrpt_kernels::crc32c(crc, data, bytes);
+            position += bytes;
+            return ok;
+        };
+        // pads with zeros up to a section, whose checksum starts from there
+        auto start_section = [&](uint64_t offset) {
+            static const char zeros[64] = {};
+            while (position < offset)
+                put(zeros, std::min<uint64_t>(sizeof(zeros), offset - position));
+            crc = 0;
+        };
+
+        put(&header, sizeof(header));
+        start_section(header.split_points_offset);
+        put(split_data, sizeof(float) * n_array * n_trees);
+        checksums.split_points = crc;
+        start_section(header.leaf_first_offset);
+        put(first_data, sizeof(int) * (n_leaves + 1) * n_trees);
+        checksums.leaf_first = crc;
+
+        // the file always stores the original ids, and plain ones
+        start_section(header.leaf_ids_offset);
+        if (data_order.size() || !ids_data) {
+            VectorXi ids(n_points);
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                if (ids_data) {
+                    std::copy(ids_data + (size_t) n_tree * n_points, ids_data + (size_t) (n_tree + 1) * n_points,
+                              ids.data());
+                } else {
+                    int *out = ids.data();
+                    visit_leaves(n_tree, 0, n_leaves, [&](const int *points, int n) {
+                        out = std::copy(points, points + n, out);
+                    });
+                }
+                for (int i = 0; i < n_points && data_order.size(); ++i)
+                    ids(i) = to_external(ids(i));
+                put(ids.data(), sizeof(int) * n_points);
+            }
+        } else {
+            put(ids_data, sizeof(int) * n_points * n_trees);
+        }
+        checksums.leaf_ids = crc;
+
+        start_section(header.random_matrix_offset);
+        write_random_matrix(put);
+        checksums.random_matrix = crc;
+        if (!bits.empty()) {
+            start_section(header.deleted_offset);
+            put(bits.data(), sizeof(uint64_t) * bits.size());
+            checksums.deleted = crc;
+        }
+        if (leaf_radii.size()) {
+            start_section(header.leaf_bounds_offset);
+            write_leaf_bounds(put);
+            checksums.leaf_bounds = crc;
+        }
+        if (labels.size()) {
+            start_section(header.labels_offset);
+            put(labels.data(), sizeof(int64_t) * labels.size());
+            checksums.labels = crc;
+        }
+        start_section(header.checksums_offset);
+        put(&checksums, sizeof(checksums));
+        return ok;
+    }
+
+    /**
+    * Loads the index from a file written by save, or from a file in the older format
+    * that has no header. A compressed file written by save_compressed is read and
+    * decompressed as by load_from_memory. The index is then placed in the tiers
+    * of memory of set_memory_tiers, if they are set.
+    * @param path - Filepath to the index file.
+    * @param map_file - If true, the file is memory mapped and the split points and the
+    * leaves are used straight from the mapping instead of being read into memory. Only
+    * files with a header can be mapped; compressed files are decompressed anyway.
+    * @return True if loading succeeded, false otherwise, and then load_error tells why.
+    */
+    bool load(const char *path, bool map_file = false) {
+        wait_load();
+        ++n_changes;
+        MRPT_TRACE_SCOPE(trace, "mrpt.load");
+        const int64_t start = metrics_clock();
+        load_failure = nullptr;
+        FILE *fd;
+        if ((fd = fopen(path, "rb")) == NULL)
+            return record_load(start, load_failed("cannot open the index file"));
+
+        char magic[8];
+        if (fread(magic, sizeof(magic), 1, fd) == 1 && !memcmp(magic, mrpt_compress::compressed_file_magic(), 8)) {
+            const size_t bytes = file_size(fd);
+            std::vector<char> file(bytes);
+            const bool read = seek(fd, 0) && fread(file.data(), 1, bytes, fd) == bytes;
+            fclose(fd);
+            if (!read)
+                return record_load(start, load_failed("cannot read the index file"));
+            const bool loaded = load_from_memory(file.data(), bytes);
+            if (loaded && tiered_load)
+                compact(memory_tiers);
+            return loaded;
+        }
+        if (!seek(fd, 0)) {
+            fclose(fd);
+            return record_load(start, load_failed("cannot read the index file"));
+        }
+
+        clear_for_load();
+        IndexFileHeader header;
+        bool ok;
+        if (fread(&header, sizeof(header), 1, fd) == 1 && !memcmp(header.magic, index_file_magic(), sizeof(header.magic))) {
+            ok = load_sections(path, fd, header, map_file);
+        } else {
+            ok = !map_file && metric == EUCLIDEAN && seek(fd, 0) && load_headerless(fd);
+        }
+
+        fclose(fd);
+        if (ok) {
+            n_ready_trees = n_trees;
+            layout_splits();
+        }
+        if (ok && quantization == BINARY)
+            quantize_binary();
+        // a failed placement leaves the index loaded where it is
+        if (ok && tiered_load)
+            compact(memory_tiers);
+        return record_load(start, ok);
+    }
+
+    /**
+    * Starts loading the index from a file written by save in the background, and
+    * returns as soon as the random matrix is loaded. The trees are then loaded in
+    * parallel, and the queries meanwhile use the trees 0, ..., trees_loaded() - 1,
+    * with fewer candidates and so lower recall. Files without a header are loaded
+    * before returning. Methods other than the queries and trees_loaded wait for the
+    * loading to finish.
+    * @param path - Filepath to the index file.
+    * @param map_file - If true, the file is memory mapped as by load, and opened
+    * in a time independent of its size: nothing is read before returning but the
+    * header, a random matrix that is not Gaussian and the leaf offsets of the
+    * first tree. Those of the other trees are then checked one tree at a time
+    * in the background, and the pages of the split points and the leaves are
+    * read as the queries first need them. The first queries so run at once on
+    * the trees checked so far, which is enough for a quick look at a large
+    * index. The checksums, if verified, read the whole file in the background.
+    * @return False if the file cannot be loaded, true if loading started. The checksums
+    * are checked once all the trees are read, and wait_load reports a mismatch.
+    */
+    bool load_async(const char *path, bool map_file = false) {
+        wait_load();
+        ++n_changes;
+        const int64_t start = metrics_clock();
+        load_failure = nullptr;
+        FILE *fd;
+        if ((fd = fopen(path, "rb")) == NULL)
+            return record_load(start, load_failed("cannot open the index file"));
+
+        IndexFileHeader header;
+        if (fread(&header, sizeof(header), 1, fd) != 1 || memcmp(header.magic, index_file_magic(), sizeof(header.magic))) {
+            fclose(fd);
+            return load(path);
+        }
+
+        clear_for_load();
+        IndexFileChecksums checksums;
+        bool ok = check_file(fd, header) && read_checksums(fd, header, checksums);
+        if (map_file)
+            ok = ok && map_index_file(fd, header, false);
+        else
+            ok = ok && seek(fd, header.random_matrix_offset) && read_random_matrix(fd, header.version >= 3);
+        fclose(fd);
+        if (!ok) {
+            release_mapped_index();
+            return record_load(start, false);
+        }
+        if (quantization == BINARY)
+            quantize_binary();
+
+        if (map_file) {
+            // the first tree is checked at once, so that the queries can use it on return
+            tree_ready.assign(n_trees, 0);
+            if (!check_mapped_trees(0, std::min(n_trees, 1))) {
+                release_mapped_index();
+                return record_load(start, false);
+            }
+        } else {
+            allocate_trees();
+        }
+        loading_ok = true;
+        const std::string file(path);
+        loader = std::thread([this, file, header, checksums, start, map_file] {
+            loading_ok = (map_file ? check_mapped_trees(1, n_trees) : load_trees(file.c_str(), header)) &&
+                         checksums_match(header, checksums);
+            if (loading_ok)
+                layout_splits();
+            record_load(start, loading_ok);
+        });
+        return true;
+    }
+
+    /**
+    * Loads the index from a buffer holding an index file written by save, for
+    * example one received over the network, or a compressed file written by
+    * save_compressed, which is decompressed by all threads into a block of
+    * memory the index keeps, like the block of compact.
+    * @param data - The start of the index file.
+    * @param bytes - The length of the buffer.
+    * @param zero_copy - If true and data is aligned to 4 bytes, the split points, the
+    * leaves and a Gaussian random matrix are used straight from the buffer, like
+    * from a mapped file, so the buffer must stay valid and unchanged until the index
+    * is loaded again, rebuilt or destroyed, or reorder_data is called. Otherwise the
+    * index is copied from the buffer.
+    * @return True if loading succeeded, false otherwise, and then load_error tells why.
+    */
+    bool load_from_memory(const void *data, size_t bytes, bool zero_copy = false) {
+        MRPT_TRACE_SCOPE(trace, "mrpt.load");
+        if (mrpt_compress::is_compressed(data, bytes))
+            return load_compressed(static_cast<const char *>(data), bytes);
+        if (reinterpret_cast<uintptr_t>(data) % sizeof(float)) {
+            // the sections are read in place, so a misaligned buffer is copied to an aligned one first
+            std::vector<uint64_t> aligned((bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+            if (bytes)
+                memcpy(aligned.data(), data, bytes);
+            return load_from_memory(aligned.data(), bytes);
+        }
+
+        wait_load();
+        ++n_changes;
+        const int64_t start = metrics_clock();
+        load_failure = nullptr;
+        clear_for_load();
+
+        IndexFileHeader header;
+        const char *base = static_cast<const char *>(data);
+        if (bytes < sizeof(header) || memcmp(base, index_file_magic(), sizeof(header.magic)))
+            return record_load(start, load_failed("the buffer does not hold an index file"));
+        memcpy(&header, base, sizeof(header));
+        if (!read_header(header))
+            return record_load(start, false);
+        if (header.file_size > bytes)
+            return record_load(start, load_failed("the index file is truncated"));
+
+        // the buffer is used like a mapping that is not unmapped
+        mapped_index = const_cast<char *>(base);
+        IndexFileChecksums checksums;
+        bool ok = use_file_sections(base, header, checksums) && checksums_match(header, checksums);
+        if (ok && !zero_copy)
+            copy_mapped_index();
+        if (!ok) {
+            release_mapped_index();
+        } else {
+            n_ready_trees = n_trees;
+            layout_splits();
+        }
+        if (ok && quantization == BINARY)
+            quantize_binary();
+        return record_load(start, ok);
+    }
+
+    /**
+    * A function that reads length bytes at offset of an index file into buffer,
+    * for example with a range GET of an object in object storage, and returns
+    * false if it could not. It is called from several threads at once.
+    */
+    typedef std::function<bool(uint64_t offset, void *buffer, uint64_t length)> RangeReader;
+
+    /**
+    * Loads the index from an index file written by save that read gives by
+    * ranges, for example an object in object storage read with
+    * mrpt_http::RangeClient, without copying the whole file to a local disk
+    * first. The header is read first, then all the other sections but the
+    * leaves, with up to n_streams ranges read in parallel, and the method
+    * returns. The leaves are then read in the background in the order of the
+    * trees, with n_streams ranges in flight, and as with load_async the queries
+    * meanwhile use the trees 0, ..., trees_loaded() - 1. The file is kept in
+    * a block of memory like that of compact. Compressed files and files
+    * without a header cannot be read by ranges.
+    * @param read - Reads the ranges of the file; it is copied, and what it refers
+    * to must stay valid until the loading has finished
+    * @param n_streams - The most ranges read at once
+    * @param range_bytes - The most bytes read by one call of read
+    * @return False if the file cannot be loaded, true if loading started. The checksums
+    * are checked once all the trees are read, and wait_load reports a mismatch.
+    */
+    bool load_ranges(const RangeReader &read, int n_streams = 16, uint64_t range_bytes = 8 << 20) {
+        wait_load();
+        ++n_changes;
+        const int64_t start = metrics_clock();
+        load_failure = nullptr;
+        IndexFileHeader header;
+        if (!read(0, &header, sizeof(header)))
+            return record_load(start, load_failed("cannot read the index file"));
+        if (memcmp(header.magic, index_file_magic(), sizeof(header.magic)))
+            return record_load(start, load_failed("the index file is compressed or has no header"));
+
+        clear_for_load();
+        if (!read_header(header))
+            return record_load(start, false);
+        // the leaves of the trees, the bulk of the file, are [leaf_ids_offset, leaves_end)
+        const int64_t n_tree_points = header.version >= 4 ? header.n_tree_points : n_samples;
+        const uint64_t tree_bytes = sizeof(int) * (uint64_t) std::max<int64_t>(0, n_tree_points);
+        const uint64_t leaves_end = header.leaf_ids_offset + tree_bytes * n_trees;
+        if (n_tree_points < 0 || n_tree_points > n_samples || header.leaf_ids_offset < sizeof(header) ||
+            leaves_end > header.file_size)
+            return record_load(start, load_failed("the sections of the index file are invalid"));
+
+        char *block = static_cast<char *>(mrpt_mmap::allocate_pages(header.file_size));
+        if (!block)
+            return record_load(start, load_failed("cannot allocate memory for the index"));
+        mapped_index = block;
+        mapped_index_bytes = header.file_size;
+        index_allocator = Allocator();
+        index_allocated = true;
+        memcpy(block, &header, sizeof(header));
+
+        IndexFileChecksums checksums;
+        bool ok = (read_ranges(read, block, sizeof(header), header.leaf_ids_offset, n_streams, range_bytes) &&
+                   read_ranges(read, block, leaves_end, header.file_size, n_streams, range_bytes)) ||
+                  load_failed("cannot read the index file");
+        ok = ok && use_file_sections(block, header, checksums, false);
+        if (!ok) {
+            release_mapped_index();
+            return record_load(start, false);
+        }
+        if (quantization == BINARY)
+            quantize_binary();
+
+        tree_ready.assign(n_trees, 0);
+        loading_ok = true;
+        loader = std::thread([this, read, header, checksums, start, n_streams, range_bytes, tree_bytes] {
+            loading_ok = read_trees(read, header, tree_bytes, n_streams, range_bytes) &&
+                         checksums_match(header, checksums);
+            if (loading_ok)
+                layout_splits();
+            record_load(start, loading_ok);
+        });
+        return true;
+    }
+
+    /**
+    * Waits until the loading started by load_async has finished, and until the
+    * recall monitor of set_recall_monitor, if any, has checked the queries it
+    * is checking; the queries waiting to be checked are dropped.
+    * @return True if there was no loading or it succeeded, false otherwise.
+    */
+    bool wait_load() {
+        if (loader.joinable())
+            loader.join();
+        if (metrics && metrics->recall)
+            metrics->recall->drain();
+        return loading_ok;
+    }
+
+    /**
+    * Returns why the last load, load_async or load_from_memory failed, for example
+    * because the index file is truncated, corrupted or was saved with other
+    * parameters, or nullptr if it succeeded. Waits for load_async to finish.
+    */
+    const char *load_error() {
+        wait_load();
+        return load_failure;
+    }
+
+    /**
+    * The parameters an index file was saved with, which the index that loads it
+    * must be constructed with.
+    */
+    struct IndexFileInfo {
+        int n_samples, dim, n_trees, depth;
+        float density;
+        unsigned seed;
+        Projection projection;
+        Metric metric;
+        int first_tree; // the number of the first tree in its forest, 0 unless grown by grow_part
+    };
+
+    /**
+    * Reads the parameters of an index file written by save without loading it, for
+    * programs that serve saved indexes.
+    * @param path - Filepath to the index file.
+    * @param info - Filled with the parameters of the file.
+    * @return False if the file cannot be read or has no header of a known version.
+    */
+    static bool read_file_info(const char *path, IndexFileInfo &info) {
+        FILE *fd;
+        if ((fd = fopen(path, "rb")) == NULL)
+            return false;
+        IndexFileHeader header;
+        const bool read = fread(&header, sizeof(header), 1, fd) == 1;
+        fclose(fd);
+        return read && file_info(header, info);
+    }
+
+    /**
+    * Reads the parameters of an index file like above, from a file read by
+    * ranges as by load_ranges.
+    */
+    static bool read_file_info(const RangeReader &read, IndexFileInfo &info) {
+        IndexFileHeader header;
+        return read(0, &header, sizeof(header)) && file_info(header, info);
+    }
+
+    /**
+    * The allocator of the block of memory compact moves an index into, for
+    * example one that takes the block from shared memory or from a pool of huge
+    * pages. allocate returns a block of the given bytes aligned to 64 bytes, or
+    * nullptr if it cannot, and deallocate frees a block allocate returned, and
+    * may be empty if the caller frees the blocks itself. If allocate is empty,
+    * the block is mapped anonymously from the system.
+    */
+    struct Allocator {
+        std::function<void *(size_t bytes)> allocate;
+        std::function<void(void *block, size_t bytes)> deallocate;
+    };
+
+    /**
+    * Returns an allocator of blocks bound to the NUMA node node, such as the
+    * CPU-less node of a pool of memory attached over CXL, for compact and
+    * MemoryTiers. Where the system cannot bind memory to nodes, the blocks come
+    * from any node.
+    */
+    static Allocator node_allocator(int node) {
+        Allocator allocator;
+        allocator.allocate = [node](size_t bytes) { return mrpt_mmap::allocate_pages_on_node(bytes, node); };
+        allocator.deallocate = [](void *block, size_t bytes) { mrpt_mmap::free_pages(block, bytes); };
+        return allocator;
+    }
+
+    enum MemoryTier {
+        NEAR_MEMORY, // the local memory of the cores, DRAM
+        FAR_MEMORY // memory of a higher latency, such as a CXL pool or persistent memory
+    };
+
+    /**
+    * Where compact puts the parts of an index on hosts with a tier of memory
+    * slower than the local DRAM. The split points and the random matrix, which
+    * every query reads at every level of every tree, are small and always go to
+    * near memory. The leaves are read once per tree by a query, and the data
+    * only for the candidates, which the quantized copy of set_quantization
+    * with a negative shortlist scores in near memory, so the full vectors are
+    * read only for the shortlist or not at all.
+    */
+    struct MemoryTiers {
+        Allocator near; // the allocator of near memory, by default mapped anonymously from the system
+        Allocator far; // the allocator of far memory, such as node_allocator of a CXL node
+        MemoryTier leaves = NEAR_MEMORY; // the tier of the leaves
+        MemoryTier data = FAR_MEMORY; // the tier of the data, which compact copies there
+    };
+
+    /**
+    * Compresses the leaves of the trees, for indexes whose leaves take more
+    * memory than the data. The ids of each leaf are sorted and stored as the
+    * differences of consecutive ids, bit-packed in blocks of 128 ids with the
+    * width of the largest difference in the block, which is about depth + 2
+    * bits instead of the 32 bits of an id. Leaves of a hundred points or more
+    * take half the memory or less; smaller ones gain less, as every block has
+    * a header of two words and rounds its bits up to words. The queries unpack the blocks of a
+    * leaf one at a time into a buffer on the stack as they count its votes,
+    * with AVX2 where the CPU has it. The candidates are the same, in a different
+    * order, so only neighbors at equal distances can differ. An index mapped
+    * from a file or compacted is copied into memory first. The methods that
+    * change the trees, such as insert, prune, regrow_trees, reorder_data and
+    * compact, unpack the leaves again, after which they can be compressed
+    * again; save writes plain ids. Must not be called concurrently with queries.
+    * @return false if the trees are not grown or loaded, true otherwise
+    */
+    bool compress_leaves() {
+        wait_load();
+        ++n_changes;
+        if (!n_trees || trees_loaded() < n_trees)
+            return false;
+        if (!packed_first.empty())
+            return true;
+        copy_mapped_index();
+        const int n_leaves = 1 << depth;
+
+        // the words of each leaf after its tree is sorted, and then where the leaves start
+        std::vector<uint64_t> first((size_t) n_trees * n_leaves + 1, 0);
+        parallel_for(n_trees, [&](int n_tree) {
+            int *ids = leaf_ids.col(n_tree).data();
+            for (int leaf = 0; leaf < n_leaves; ++leaf) {
+                int *begin = ids + leaf_first(leaf, n_tree), *end = ids + leaf_first(leaf + 1, n_tree);
+                std::sort(begin, end);
+                uint64_t words = 0;
+                for (int *block = begin; block < end; block += mrpt_kernels::pack_block) {
+                    const int n = std::min<int64_t>(mrpt_kernels::pack_block, end - block);
+                    words += mrpt_kernels::packed_words(n, mrpt_kernels::difference_width(block, n));
+                }
+                first[(size_t) n_tree * n_leaves + leaf + 1] = words;
+            }
+        });
+        std::partial_sum(first.begin(), first.end(), first.begin());
+
+        std::vector<uint32_t> packed(first.back());
+        parallel_for(n_trees, [&](int n_tree) {
+            const int *ids = leaf_ids.col(n_tree).data();
+            for (int leaf = 0; leaf < n_leaves; ++leaf) {
+                uint32_t *words = packed.data() + first[(size_t) n_tree * n_leaves + leaf];
+                for (int j = leaf_first(leaf, n_tree); j < leaf_first(leaf + 1, n_tree); j += mrpt_kernels::pack_block)
+                    words = mrpt_kernels::pack_ids(ids + j, std::min(mrpt_kernels::pack_block,
+                                                                     leaf_first(leaf + 1, n_tree) - j), words);
+            }
+        });
+        packed_ids.swap(packed);
+        packed_first.swap(first);
+        leaf_ids.resize(0, 0);
+        leaf_ids_data = nullptr;
+        return true;
+    }
+
+    /**
+    * Sorts the ids of each leaf of the trees, so that the queries that give
+    * votes to few samples out of many, such as those of large indexes of deep
+    * trees, count the votes by merging the leaves instead of with a counter for
+    * every sample, see use_merged_votes. The candidates are the same, in the
+    * order of their ids. An index mapped from a file or compacted is copied
+    * into memory first. The leaves stay sorted until the trees are changed, by
+    * insert, prune, load or other methods that change the index, after which
+    * they can be sorted again. Compressed leaves are always sorted. Must not be
+    * called concurrently with queries.
+    * @return false if the trees are not grown or loaded, true otherwise
+    */
+    bool sort_leaves() {
+        wait_load();
+        ++n_changes;
+        if (!n_trees || trees_loaded() < n_trees)
+            return false;
+        if (packed_first.empty()) {
+            copy_mapped_index();
+            const int n_leaves = 1 << depth;
+            parallel_for(n_trees, [&](int n_tree) {
+                int *ids = leaf_ids.col(n_tree).data();
+                for (int leaf = 0; leaf < n_leaves; ++leaf)
+                    std::sort(ids + leaf_first(leaf, n_tree), ids + leaf_first(leaf + 1, n_tree));
+            });
+        }
+        sorted_leaves_change = n_changes;
+        return true;
+    }
+
+    /**
+    * Returns true if the ids of each leaf are sorted, by sort_leaves or
+    * compress_leaves.
+    */
+    bool leaves_sorted() const {
+        return !packed_first.empty() || sorted_leaves_change == n_changes;
+    }
+
+    /**
+    * Returns true if the leaves are compressed by compress_leaves.
+    */
+    bool leaves_compressed() const {
+        return !packed_first.empty();
+    }
+
+    /**
+    * Moves the trees and the random matrix of an index into one block of memory,
+    * so that a built index is a few large allocations instead of its matrices
+    * and the lists of the inserted points. The inserted points are merged into
+    * the leaves and the deleted points removed from them first. The block is
+    * freed with one call when the index is destroyed, it is given transparent
+    * huge pages if set_huge_pages is enabled, and it can come from an allocator
+    * of the caller. The queries use the block like a mapped index file and give
+    * the same results; the methods that change the trees copy them out of it
+    * again. Compressed leaves are unpacked into the block. Must not be called
+    * concurrently with queries.
+    * @param allocator - The allocator of the block
+    * @return False if the index has no trees or the block cannot be allocated,
+    * in which case the index is not moved.
+    */
+    bool compact(const Allocator &allocator = Allocator()) {
+        MemoryTiers tiers;
+        tiers.near = allocator;
+        tiers.data = NEAR_MEMORY;
+        return compact(tiers);
+    }
+
+    /**
+    * Same as above, but splits the index between the tiers of memory of tiers:
+    * the block of the trees and the random matrix comes from near memory, the
+    * leaves go to a block of far memory of their own if they are placed there,
+    * and the data placed in far memory is copied into a block of far memory,
+    * which the index then owns. The reordered copy of reorder_data, the
+    * quantized copy of the data and the data file of set_data_file stay where
+    * they are.
+    * @return False if the index has no trees or a block cannot be allocated, in
+    * which case the index is not moved.
+    */
+    bool compact(const MemoryTiers &tiers) {
+        wait_load();
+        if (!n_trees || trees_loaded() < n_trees)
+            return false;
+        expand_leaves();
+        compact_leaves();
+
+        // the sections are laid out as in an index file, so the random matrix is mapped the same way
+        const int n_leaves = 1 << depth;
+        const int non_zeros = density < 1 ? sparse_matrix.nonZeros() : 0;
+        const bool far_leaves = tiers.leaves == FAR_MEMORY;
+        const uint64_t leaf_bytes = sizeof(int) * (uint64_t) tree_points * n_trees;
+        const uint64_t leaf_first_offset = align_section(sizeof(float) * n_array * n_trees);
+        const uint64_t leaf_ids_offset = align_section(leaf_first_offset + sizeof(int) * (n_leaves + 1) * n_trees);
+        const uint64_t random_matrix_offset = align_section(leaf_ids_offset + (far_leaves ? 0 : leaf_bytes));
+        const uint64_t matrix_bytes = density < 1 ?
+            sizeof(int) * (n_pool + 2) + (sizeof(int) + sizeof(float)) * (uint64_t) non_zeros :
+            sizeof(float) * (uint64_t) n_pool * dim;
+        const size_t bytes = random_matrix_offset + matrix_bytes;
+        const bool far_data = tiers.data == FAR_MEMORY && !byte_data && X->cols() == n_samples && n_samples &&
+                              !data_file.is_open();
+        const size_t data_bytes = far_data ? sizeof(float) * dim * (size_t) n_samples : 0;
+        char *block = static_cast<char *>(allocate_block(tiers.near, bytes));
+        char *leaf_block = far_leaves && block ? static_cast<char *>(allocate_block(tiers.far, leaf_bytes)) : nullptr;
+        float *data_block = far_data && block && (leaf_block || !far_leaves) ?
+                            static_cast<float *>(allocate_block(tiers.far, data_bytes)) : nullptr;
+        if (!block || (far_leaves && !leaf_block) || (far_data && !data_block)) {
+            free_block(tiers.near, block, bytes);
+            free_block(tiers.far, leaf_block, leaf_bytes);
+            return false;
+        }
+        advise_huge_pages(block, bytes);
+
+        memcpy(block, split_data, sizeof(float) * n_array * n_trees);
+        memcpy(block + leaf_first_offset, leaf_first_data, sizeof(int) * (n_leaves + 1) * n_trees);
+        memcpy(far_leaves ? leaf_block : block + leaf_ids_offset, leaf_ids_data, leaf_bytes);
+        char *matrix = block + random_matrix_offset;
+        if (density < 1) {
+            memcpy(matrix, &non_zeros, sizeof(int));
+            memcpy(matrix + sizeof(int), sparse_matrix.outerIndexPtr(), sizeof(int) * (n_pool + 1));
+            memcpy(matrix + sizeof(int) * (n_pool + 2), sparse_matrix.innerIndexPtr(), sizeof(int) * non_zeros);
+            memcpy(matrix + sizeof(int) * (n_pool + 2 + (uint64_t) non_zeros), sparse_matrix.valuePtr(),
+                   sizeof(float) * non_zeros);
+        } else {
+            memcpy(matrix, dense_matrix.data(), sizeof(float) * (uint64_t) n_pool * dim);
+        }
+
+        // the previous block or mapping, the trees and the random matrix are released
+        release_mapped_index();
+        split_points.resize(0, 0);
+        leaf_first.resize(0, 0);
+        leaf_ids.resize(0, 0);
+        random_matrix = std::make_shared<RandomMatrix>();
+        random_matrix_shared = false;
+
+        mapped_index = block;
+        mapped_index_bytes = bytes;
+        index_allocator = tiers.near;
+        index_allocated = true;
+        if (far_leaves) {
+            far_leaves_block = leaf_block;
+            far_leaves_bytes = leaf_bytes;
+            far_allocator = tiers.far;
+        }
+        split_data = reinterpret_cast<const float *>(block);
+        leaf_first_data = reinterpret_cast<const int *>(block + leaf_first_offset);
+        leaf_ids_data = reinterpret_cast<const int *>(far_leaves ? leaf_block : block + leaf_ids_offset);
+        random_matrix_mapped = map_random_matrix(matrix, matrix_bytes);
+
+        if (far_data) {
+            // the index owns the copy, which insert moves back into memory of its own
+            std::copy(X->data(), X->data() + (size_t) dim * n_samples, data_block);
+            const bool searched = search_data == X->data();
+            const Allocator far = tiers.far;
+            given_data = Data::adopt(data_block, dim, n_samples,
+                                     [far, data_block, data_bytes] { free_block(far, data_block, data_bytes); });
+            std::vector<float>().swap(data_storage);
+            new (&given_matrix) Map<const MatrixXf>(data_block, dim, n_samples);
+            X = &given_matrix;
+            far_data_bytes = data_bytes;
+            if (searched)
+                search_data = data_block;
+        }
+        return true;
+    }
+
+    /**
+    * Makes load place the index it loads in the tiers of memory of tiers, as
+    * compact does, so that a large index takes the cheap tier from the start.
+    * Not applied by load_async, whose trees are read in the background.
+    */
+    void set_memory_tiers(const MemoryTiers &tiers) {
+        wait_load();
+        memory_tiers = tiers;
+        tiered_load = true;
+    }
+
+    /**
+    * Reads one byte of every page of a mapped index file and of the data the
+    * queries read, so that the first queries do not fault the pages in. The
+    * pages are first requested from the operating system with
+    * madvise(MADV_WILLNEED), and then read by all threads in chunks of 4 MB,
+    * which keeps several reads of the disk in flight where MAP_POPULATE is not
+    * supported or was not asked for. Meant for an index loaded in the
+    * background before it starts to serve queries, see mrpt_snapshot.h. Can be
+    * called concurrently with the queries.
+    */
+    void prefault() const {
+        const size_t page = 4096, chunk = (size_t) 1 << 22;
+        const std::vector<std::pair<const unsigned char *, size_t>> ranges = query_memory(false);
+        std::vector<std::pair<const unsigned char *, size_t>> chunks;
+        for (const std::pair<const unsigned char *, size_t> &range : ranges) {
+#ifndef _WIN32
+            advise_range(range.first, range.second, MADV_WILLNEED);
+#endif
+            for (size_t offset = 0; offset < range.second; offset += chunk)
+                chunks.emplace_back(range.first + offset, std::min(chunk, range.second - offset));
+        }
+        parallel_for((int) chunks.size(), [&](int c) {
+            unsigned char sum = 0;
+            for (size_t i = 0; i < chunks[c].second; i += page)
+                sum += chunks[c].first[i];
+            // the reads must not be optimized away
+            volatile unsigned char sink = sum;
+            (void) sink;
+        });
+    }
+
+    /**
+    * Locks the memory the queries read in RAM with mlock, so that it is never
+    * paged out: the data or its reordered copy, the quantized copy and the
+    * leading dimensions of set_leading_dimensions, and the trees and random
+    * matrix when they are in one block, mapped from an index file by load or
+    * moved there by compact. Locking faults the pages in like prefault. The lock covers the memory as
+    * it is now: the memory of later changes to the index, such as insert or
+    * set_quantization, is not locked. A locked mapping is unlocked when it is
+    * unmapped. The locked bytes count against RLIMIT_MEMLOCK unless the process
+    * has CAP_IPC_LOCK. Not supported on Windows.
+    * @param lock - If false, the memory is unlocked instead
+    * @return False if some of the memory could not be locked or unlocked.
+    */
+    bool lock_memory(bool lock = true) {
+        wait_load();
+#ifndef _WIN32
+        bool ok = true;
+        for (const std::pair<const unsigned char *, size_t> &range : query_memory(true)) {
+            const size_t page = sysconf(_SC_PAGESIZE);
+            const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(range.first) & ~(page - 1);
+            const size_t bytes = reinterpret_cast<std::uintptr_t>(range.first) + range.second - begin;
+            void *address = reinterpret_cast<void *>(begin);
+            ok &= (lock ? mlock(address, bytes) : munlock(address, bytes)) == 0;
+        }
+        return ok;
+#else
+        (void) lock;
+        return false;
+#endif
+    }
+
+    /**
+    * Returns true if the queries read the data the index was constructed with.
+    * They do not after reorder_data, which makes a copy of its own, or when they
+    * score the candidates with a quantized copy only (a negative shortlist of
+    * set_quantization), so that the data can be released after grow. A FLOAT16
+    * copy then halves, and an INT8 copy quarters, the memory of the data. The
+    * methods that build or change the index, and the exact searches without a
+    * reordered copy, still need the data.
+    */
+    bool uses_data() const {
+        return !reordered_data.size() && !(codes.size() && shortlist_size < 0);
+    }
+
+    /**
+    * Frees the data the index was constructed with if the index owns it and the
+    * queries no longer read it (see uses_data), for example after reorder_data.
+    * Borrowed data is left to its caller. The methods that need the data, such
+    * as grow, insert and the exact searches without a reordered copy, must not
+    * be called afterwards. Must not be called concurrently with queries.
+    * @return True if the data was freed.
+    */
+    bool release_data() {
+        wait_load();
+        if (!given_data.owned() || X != &given_matrix || uses_data())
+            return false;
+        given_data.release();
+        new (&given_matrix) Map<const MatrixXf>(nullptr, dim, 0);
+        return true;
+    }
+
+    /**
+    * Returns the phases of the last grow of the index.
+    */
+    const BuildStats &build_stats() const {
+        return last_build;
+    }
+
+    /**
+    * Reports the shape of the trees of the index, see IndexStats: the sizes of
+    * the leaves of every tree, and with the data, the margins of up to 1000
+    * sampled points and the overlap of the leaves of up to 256 sampled points
+    * in every pair of trees, fewer for many trees with large leaves so that
+    * the report takes at most a few seconds. The trees and the samples are
+    * divided between the threads. Can be called concurrently with queries.
+    */
+    IndexStats stats() const {
+        const int n_used = trees_loaded(), n_leaves = 1 << depth, n_buckets = depth + 2;
+        IndexStats stats;
+        stats.leaf_histogram = MatrixXi::Zero(n_used, n_buckets);
+        stats.max_leaf_size = VectorXi::Zero(n_used);
+        stats.imbalance = VectorXf::Zero(n_used);
+        stats.expected_leaf_size = VectorXf::Zero(n_used);
+        const double balanced = std::max(1.0, (double) (tree_points + n_unmerged) / n_leaves);
+
+        parallel_for(n_used, [&](int n_tree) {
+            double squares = 0, total = 0;
+            for (int leaf = 0; leaf < n_leaves; ++leaf) {
+                const int size = leaf_size(n_tree, leaf) +
+                    (inserted_leaves.empty() ? 0 : (int) inserted_leaves[n_tree * n_leaves + leaf].size());
+                int bucket = 0;
+                while (bucket < n_buckets - 1 && size >> bucket)
+                    ++bucket;
+                stats.leaf_histogram(n_tree, bucket)++;
+                stats.max_leaf_size(n_tree) = std::max(stats.max_leaf_size(n_tree), size);
+                squares += (double) size * size;
+                total += size;
+            }
+            stats.imbalance(n_tree) = stats.max_leaf_size(n_tree) / balanced;
+            stats.expected_leaf_size(n_tree) = total ? squares / total : 0;
+        });
+        if (!scannable() || !n_samples || !n_used)
+            return stats;
+
+        // the margins and leaves of a sample of the data spread over the ids
+        const int n_sample = std::min(n_samples, 1000);
+        MatrixXf sample(dim, n_sample), buffer;
+        for (int i = 0; i < n_sample; ++i)
+            sample.col(i) = data_columns((int) ((int64_t) i * n_samples / n_sample), 1, buffer).col(0);
+        const MatrixXf projected = project_queries(sample);
+        MatrixXf margins(n_used, n_sample);
+        MatrixXi found_leaves(n_trees, n_sample);
+        parallel_for(n_sample, [&](int i) {
+            for (int n_tree = 0; n_tree < n_used; ++n_tree)
+                margins(n_tree, i) = tree_margin(n_tree, projected.col(i).data());
+            route(projected.col(i).data(), found_leaves.col(i).data());
+        });
+        stats.median_margin.resize(n_used);
+        std::vector<float> row(n_sample);
+        for (int n_tree = 0; n_tree < n_used; ++n_tree) {
+            for (int i = 0; i < n_sample; ++i)
+                row[i] = margins(n_tree, i);
+            std::nth_element(row.begin(), row.begin() + n_sample / 2, row.end());
+            stats.median_margin(n_tree) = row[n_sample / 2];
+        }
+        std::vector<float> all(margins.data(), margins.data() + margins.size());
+        std::sort(all.begin(), all.end());
+        for (double quantile : {0.1, 0.25, 0.5, 0.75, 0.9})
+            stats.margin_quantiles.push_back(all[(size_t) (quantile * (all.size() - 1))]);
+
+        // each pair of trees costs about the sizes of two leaves per sampled point
+        const double pair_cost = (double) n_used * n_used * balanced;
+        const int n_overlap = std::max(1, std::min(n_sample, std::min(256, (int) (2e8 / pair_cost))));
+        stats.leaf_overlap = MatrixXf::Zero(n_used, n_used);
+        std::mutex overlap_mutex;
+        parallel_for(n_overlap, [&](int s) {
+            const int i = (int) ((int64_t) s * n_sample / n_overlap);
+            std::vector<std::vector<int>> leaves(n_used);
+            for (int n_tree = 0; n_tree < n_used; ++n_tree) {
+                std::vector<int> &ids = leaves[n_tree];
+                const int leaf = found_leaves(n_tree, i);
+                visit_leaves(n_tree, leaf, leaf + 1, [&](const int *p, int m) {
+                    ids.insert(ids.end(), p, p + m);
+                });
+                if (!inserted_leaves.empty()) {
+                    const std::vector<int> &inserted = inserted_leaves[n_tree * n_leaves + leaf];
+                    ids.insert(ids.end(), inserted.begin(), inserted.end());
+                }
+                std::sort(ids.begin(), ids.end());
+            }
+            MatrixXf similarity = MatrixXf::Identity(n_used, n_used);
+            std::vector<int> common;
+            for (int a = 0; a < n_used; ++a) {
+                for (int b = a + 1; b < n_used; ++b) {
+                    common.clear();
+                    std::set_intersection(leaves[a].begin(), leaves[a].end(), leaves[b].begin(), leaves[b].end(),
+                                          std::back_inserter(common));
+                    const size_t n_union = leaves[a].size() + leaves[b].size() - common.size();
+                    similarity(a, b) = similarity(b, a) = n_union ? (float) common.size() / n_union : 0;
+                }
+            }
+            std::lock_guard<std::mutex> lock(overlap_mutex);
+            stats.leaf_overlap += similarity;
+        });
+        stats.leaf_overlap /= n_overlap;
+        return stats;
+    }
+
+    /**
+    * Returns the number of trees the queries use, which is n_trees unless the index
+    * is being loaded by load_async or its loading has failed.
+    */
+    int trees_loaded() const {
+        return n_ready_trees.load(std::memory_order_acquire);
+    }
+
+    /**
+    * Returns the bytes of memory the parts of the index take. Can be called
+    * concurrently with queries.
+    */
+    MemoryUsage memory_usage() const {
+        MemoryUsage usage;
+        const int n_leaves = 1 << depth;
+        const uint64_t given_bytes = sizeof(float) * (uint64_t) given_matrix.size();
+        if (!given_data.owned())
+            usage.data = given_bytes;
+        else if (given_data.mapped_file())
+            usage.mapped_data = given_bytes;
+        else
+            usage.owned_data += given_bytes;
+        usage.mapped_data += data_file.size();
+        usage.owned_data += sizeof(float) * ((uint64_t) data_storage.capacity() + reordered_data.size() +
+                                            data_squared_norms.size());
+        usage.owned_data += sizeof(float) * (uint64_t) leading_data.capacity() + sizeof(int) * leading_dimensions.size();
+        usage.owned_data += sizeof(int64_t) * (uint64_t) labels.capacity() + sizeof(int) * (uint64_t) label_slots.capacity();
+        usage.quantized_data = codes.capacity() + sizeof(float) * (code_offset.size() + code_scale.size() +
+                               pq_centroids.size() + binary_thresholds.size() + pca_mean.size() +
+                               pca_components.size()) + sizeof(int) * pq_first.size();
+
+        usage.split_points = sizeof(float) * (uint64_t) n_array * n_trees;
+        usage.leaves = sizeof(int) * (uint64_t) (n_leaves + 1) * n_trees +
+                       (packed_first.empty() ? sizeof(int) * (uint64_t) tree_points * n_trees :
+                        sizeof(uint32_t) * packed_ids.capacity() + sizeof(uint64_t) * packed_first.capacity()) +
+                       sizeof(uint64_t) * deleted_bits.capacity() +
+                       sizeof(std::vector<int>) * inserted_leaves.capacity();
+        for (const std::vector<int> &leaf : inserted_leaves)
+            usage.leaves += sizeof(int) * leaf.capacity();
+        usage.leaves += sizeof(float) * ((uint64_t) leaf_centroids.size() + leaf_radii.size()) +
+                        sizeof(int) * ((uint64_t) duplicate_first.capacity() + duplicate_ids.capacity());
+        usage.random_matrix = random_matrix_size(n_pool, dim, density < 1 ? sparse_matrix.nonZeros() : -1) +
+                              sizeof(float) * hadamard_signs.size() + sizeof(int) * hadamard_rows.size();
+        usage.graph = sizeof(int64_t) * graph_indptr.capacity() + sizeof(int) * graph_neighbors.capacity();
+        if (mapped_index && !index_allocated)
+            usage.mapped_index = usage.split_points + sizeof(int) * ((uint64_t) (n_leaves + 1) + tree_points) * n_trees;
+        if (random_matrix_mapped && !index_allocated)
+            usage.mapped_index += usage.random_matrix;
+        usage.far_memory = far_leaves_bytes + (given_data.data() && given_data.data() == given_matrix.data() ?
+                                               far_data_bytes : 0);
+
+        usage.scratch = scratch_size(n_samples, n_trees, depth);
+        return usage;
+    }
+
+    /**
+    * Predicts the memory an index takes before it is built, for planning the
+    * capacity of the hosts. The predictions are for the defaults of grow, with
+    * the data kept and neither inserts nor quantization; build_peak counts the
+    * finished index and the projections of as many trees as there are threads.
+    * @param n - The number of points
+    * @param dim - The dimension of the points
+    * @param n_trees - The number of trees
+    * @param depth - The depth of the trees
+    * @param density - The expected ratio of nonzero components in the random vectors
+    */
+    static MemoryUsage estimate_memory(int n, int dim, int n_trees, int depth, float density) {
+        MemoryUsage usage;
+        const uint64_t n_pool = (uint64_t) n_trees * depth;
+        const int64_t non_zeros = density < 1 ? std::llround((double) density * n_pool * dim) : -1;
+        usage.data = sizeof(float) * (uint64_t) n * dim;
+        usage.split_points = sizeof(float) * ((uint64_t) 1 << (depth + 1)) * n_trees;
+        usage.leaves = sizeof(int) * (((uint64_t) 1 << depth) + 1 + n) * n_trees;
+        usage.random_matrix = random_matrix_size(n_pool, dim, non_zeros);
+        usage.scratch = scratch_size(n, n_trees, depth);
+
+        // the projections of the trees built in parallel, and the triplets a sparse matrix is made of
+        const uint64_t projections = sizeof(float) * (uint64_t) depth * n * std::min(n_trees, max_threads());
+        const uint64_t triplets = non_zeros > 0 ? sizeof(Triplet<float>) * (uint64_t) non_zeros : 0;
+        usage.build_peak = usage.index_bytes() + std::max(projections, triplets);
+        return usage;
+    }
+
+    /**
+    * Sets whether the index keeps metrics of itself for monitoring: latency
+    * histograms of the single queries, including each query of query_batch,
+    * of grow and of load and load_async, and the number of failed loads. The
+    * histograms are recorded into without locks, see mrpt_metrics.h. Enabling
+    * the metrics resets them. Must not be called concurrently with other methods.
+    */
+    void set_metrics(bool enable) {
+        metrics.reset(enable ? new mrpt_metrics::IndexMetrics : nullptr);
+    }
+
+    /**
+    * Returns the metrics of the index, or nullptr if they are not enabled. They
+    * can be read concurrently with the queries, for example for percentiles of
+    * get_metrics()->queries.snapshot().
+    */
+    const mrpt_metrics::IndexMetrics *get_metrics() const {
+        return metrics.get();
+    }
+
+    /**
+    * Returns the metrics in the text exposition format of Prometheus, or an
+    * empty string if they are not enabled. Can be called concurrently with the
+    * queries.
+    * @param prefix - The beginning of the names of the metrics
+    * @param labels - Labels added to every sample, such as index="main"
+    */
+    std::string metrics_text(const std::string &prefix = "mrpt", const std::string &labels = "") const {
+        return metrics ? metrics->prometheus_text(prefix, labels) : std::string();
+    }
+
+    /**
+    * Starts estimating the recall of the queries online, or stops it. A
+    * fraction of the queries of query and query_batch, drawn at random, are
+    * searched again exactly with exact_knn_batch on a thread of the monitor,
+    * and the mean recall of the last window of them is kept with the metrics,
+    * which this enables, and exported by metrics_text. The queries only copy
+    * themselves for the monitor, and are dropped rather than wait when it is
+    * busy. The methods that modify the index first drop the queries waiting to
+    * be checked and wait for those being checked. Disabling the metrics stops
+    * the monitor too. Must not be called concurrently with other methods.
+    * @param sample_rate - The fraction of the queries checked, 0 to stop the monitor
+    * @param window - The number of the last queries checked the recall is the mean of
+    * @param n_threads - The number of OpenMP threads of the exact searches, the cores left
+    * over by the queries
+    */
+    void set_recall_monitor(double sample_rate, int window = 1000, int n_threads = 1) {
+        wait_load();
+        if (!metrics)
+            metrics.reset(new mrpt_metrics::IndexMetrics);
+        metrics->recall.reset();
+        if (sample_rate <= 0)
+            return;
+        metrics->recall.reset(new mrpt_metrics::RecallMonitor(dim, sample_rate, window,
+            [this, n_threads](const float *queries, int n, int k, int *out) {
+                exact_knn_batch(Map<const MatrixXf>(queries, dim, n), k, out, nullptr, std::max(1, n_threads));
+            }));
+    }
+
+    /**
+    * Returns the recall estimated by the monitor of set_recall_monitor, all
+    * zero if there is none. Can be called concurrently with the queries.
+    */
+    mrpt_metrics::RecallSnapshot recall_estimate() const {
+        return metrics && metrics->recall ? metrics->recall->snapshot() : mrpt_metrics::RecallSnapshot();
+    }
+
+    /**
+    * Returns the number of times the answers to the queries may have changed:
+    * the builds, loads, insertions, removals, prunings, regrowths and changes of
+    * quantization of the index. A cache of query results, such as the QueryCache
+    * of mrpt_cache.h, is stale when this changes.
+    */
+    uint64_t change_count() const {
+        return n_changes;
+    }
+
+    /**
+    * Returns the number of points of the index, the deleted ones included, which
+    * have the ids 0, ..., size() - 1.
+    */
+    int size() const {
+        return n_samples;
+    }
+
+    /**
+    * Writes the vectors of the points with the n original ids into out, one
+    * after another, dim floats each, gathering them with all threads. They are
+    * read from the data or its reordered copy while the index has either, and
+    * from the 8-bit data exactly. Once the data is released, they are decoded
+    * from the quantized copy: exactly up to rounding for FLOAT16 and INT8, and
+    * as the nearest centroids or principal components for PQ and PCA.
+    * @param ids - The original ids of the points
+    * @param n - The number of ids
+    * @param out - The dim x n output buffer
+    * @return false if an id is out of range, or if the index has neither the
+    * data nor a copy it can be decoded from, such as BINARY codes
+    */
+    bool reconstruct(const int *ids, int n, float *out) const {
+        for (int i = 0; i < n; ++i)
+            if (ids[i] < 0 || ids[i] >= n_samples)
+                return false;
+        const bool has_data = !byte_data && (X->cols() == n_samples || reordered_data.size());
+        if (!has_data && (!codes.size() || quantization == BINARY))
+            return false;
+
+        const size_t code_bytes = byte_data ? dim : code_size();
+        parallel_for(n, [&](int i) {
+            const int id = to_internal(ids[i]);
+            Map<VectorXf> x(out + (size_t) dim * i, dim);
+            const uint8_t *code = codes.data() + code_bytes * id;
+            if (has_data) {
+                x = Map<const VectorXf>(column(id), dim);
+            } else if (byte_data || quantization == INT8) {
+                x = Map<const Matrix<uint8_t, Dynamic, 1>>(code, dim).cast<float>().cwiseProduct(code_scale) + code_offset;
+            } else if (quantization == FLOAT16) {
+                const uint16_t *half = reinterpret_cast<const uint16_t *>(code);
+                for (int j = 0; j < dim; ++j)
+                    x(j) = mrpt_kernels::half_to_float(half[j]);
+            } else if (quantization == PCA) {
+                x = pca_mean + pca_components * Map<const VectorXf>(reinterpret_cast<const float *>(code), pq_subspaces);
+            } else {
+                for (int s = 0; s < pq_subspaces; ++s) {
+                    const int first = pq_first(s), length = pq_first(s + 1) - first;
+                    x.segment(first, length) = pq_centroids.block(first, code[s], length, 1);
+                }
+            }
+        }, 256);
+        return true;
+    }
+
+    /**
+    * The arrays an index is queried with, in a flat layout for copying the index
+    * to another device, such as a GPU with the DeviceIndex of mrpt_cuda.h. The
+    * points are numbered by their internal ids, the columns of data.
+    */
+    struct FlatIndex {
+        int n_samples = 0;
+        int dim = 0;
+        int n_trees = 0;
+        int depth = 0;
+        int tree_points = 0; // the number of points in each tree
+        Metric metric = EUCLIDEAN;
+        const float *data = nullptr; // the dim x n_samples search data, valid while the index is not modified
+        std::vector<int> original_ids; // the original id of each internal id, empty if they are the same
+        std::vector<uint64_t> deleted; // bit i is set if the point i is deleted, empty if none is
+        std::vector<float> random_matrix; // the n_trees * depth random vectors as the rows of a row-major matrix
+        std::vector<float> split_points; // the 2^(depth + 1) split points of each tree, tree after tree
+        std::vector<int> leaf_first; // the 2^depth + 1 leaf offsets of each tree, tree after tree
+        std::vector<int> leaf_ids; // the tree_points points of each tree, leaf after leaf, tree after tree
+    };
+
+    /**
+    * Copies the index into the flat layout of FlatIndex. The inserted points are
+    * merged into the leaves and the deleted points left out, so the leaves hold
+    * the points the queries vote for, and the random vectors of any projection
+    * are written as an explicit matrix. Must not be called
+    * concurrently with the methods that modify the index.
+    * @return false if the index has no data or no trees, true otherwise
+    */
+    bool flatten(FlatIndex &flat) const {
+        if (X->cols() != n_samples || trees_loaded() < n_trees || !n_trees)
+            return false;
+        flat.n_samples = n_samples;
+        flat.dim = dim;
+        flat.n_trees = n_trees;
+        flat.depth = depth;
+        flat.metric = metric;
+        flat.data = search_data;
+        flat.original_ids.assign(data_order.data(), data_order.data() + data_order.size());
+        flat.deleted = n_deleted > (int) duplicate_ids.size() ? deleted_bits : std::vector<uint64_t>();
+        for (int id : duplicate_ids)
+            if (!flat.deleted.empty()) flat.deleted[id >> 6] &= ~(uint64_t(1) << (id & 63));
+
+        // HADAMARD projections keep the dense matrix they are equivalent to
+        flat.random_matrix.resize((size_t) n_pool * dim);
+        Map<Matrix<float, Dynamic, Dynamic, RowMajor>> vectors(flat.random_matrix.data(), n_pool, dim);
+        if (density < 1)
+            vectors = sparse_matrix;
+        else
+            vectors = dense_matrix;
+        flat.split_points.assign(split_data, split_data + (size_t) n_array * n_trees);
+
+        MatrixXi first, ids;
+        merged_leaves(first, ids, true);
+        flat.tree_points = ids.rows();
+        flat.leaf_first.assign(first.data(), first.data() + first.size());
+        flat.leaf_ids.assign(ids.data(), ids.data() + ids.size());
+        return true;
+    }
+
+    /**
+    * The hot routines of the queries and of the build, which run_kernel runs
+    * one at a time for the microbenchmarks of cpp/microbenchmark.cpp.
+    */
+    enum Kernel {
+        KERNEL_PROJECTION, // project_query of each query, dense or sparse by the density
+        KERNEL_ROUTING, // route of the projections of each query down the trees
+        KERNEL_VOTING, // count_leaf_votes of the leaves of each query and clear_votes
+        KERNEL_FALLBACK, // the voting and elect_by_max_votes of the queries with fewer than k candidates
+        KERNEL_SCORING, // exact_knn of each query over its candidates
+        KERNEL_SELECTION, // the heap of the k nearest of the scores of the candidates of each query
+        KERNEL_SPLITTING // split_tree_node of the nodes of one level of the first tree
+    };
+
+    /**
+    * The inputs of every kernel, computed by prepare_kernels with the steps
+    * before the kernel, so that run_kernel times the kernel alone.
+    */
+    struct KernelInputs {
+        MatrixXf queries;
+        int k = 0, votes_required = 1, level = 0;
+        MatrixXf projected_queries; // n_pool x n_queries
+        MatrixXi found_leaves; // n_trees x n_queries
+        std::vector<int> fallback_queries; // the queries with fewer than k candidates
+        std::vector<std::vector<int>> candidates;
+        std::vector<std::vector<float>> scores; // of the candidates, as exact_knn ranks them
+        MatrixXf tree_projections; // depth x n_samples, of the first tree
+        std::vector<int> level_ids; // the ids of the first tree as they are before level is split
+        std::vector<int> level_nodes; // the offsets of the nodes of level in level_ids
+        std::vector<int> work_ids;
+        QueryScratch scratch;
+        std::vector<int> out;
+        std::vector<float> out_distances;
+    };
+
+    /**
+    * Computes the inputs of run_kernel for the queries Q, and for splitting the
+    * nodes of level of the first tree. Needs the data.
+    * @param level - The level of the tree split by KERNEL_SPLITTING, 0 <= level < depth
+    */
+    void prepare_kernels(const Ref<const MatrixXf> &Q, int k, int votes_required, int level,
+                         KernelInputs &inputs) const {
+        const int n_queries = Q.cols();
+        inputs.queries = Q;
+        inputs.k = k;
+        inputs.votes_required = votes_required;
+        inputs.level = level;
+        inputs.projected_queries.resize(n_pool, n_queries);
+        inputs.found_leaves.resize(n_trees, n_queries);
+        inputs.fallback_queries.clear();
+        inputs.candidates.assign(n_queries, std::vector<int>());
+        inputs.scores.assign(n_queries, std::vector<float>());
+        inputs.out.resize(k);
+        inputs.out_distances.resize(k);
+
+        QueryScratch &scratch = inputs.scratch;
+        const int max_leaf_size = n_samples / (1 << depth) + 1;
+        const float *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const mrpt_kernels::DistanceFunction distance = metric == EUCLIDEAN ? kernels.l2 : kernels.dot;
+        for (int i = 0; i < n_queries; ++i) {
+            inputs.projected_queries.col(i) = project_query(Q.col(i));
+            route(inputs.projected_queries.col(i).data(), inputs.found_leaves.col(i).data());
+
+            int n_elected = 0, n_touched = 0;
+            scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+            scratch.select_counters(n_samples, n_trees, false);
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                if (inputs.found_leaves(n_tree, i) >= 0)
+                    count_leaf_votes(n_tree, inputs.found_leaves(n_tree, i), votes_required, scratch, n_elected,
+                                     n_touched);
+            }
+            if (n_elected < k && votes_required > 1) {
+                inputs.fallback_queries.push_back(i);
+                elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+            }
+            clear_votes(scratch, n_touched);
+
+            const float query_scale = metric == COSINE ? inverse_norm(Q.col(i).squaredNorm()) : 1;
+            inputs.candidates[i].assign(scratch.elected.data(), scratch.elected.data() + n_elected);
+            for (int id : inputs.candidates[i])
+                inputs.scores[i].push_back(score(distance(Q.col(i).data(), column(id), dim), id, norms, query_scale));
+        }
+
+        // the first tree is split down to level as grow_subtree splits it
+        project_data(0, depth, inputs.tree_projections);
+        inputs.level_ids.resize(n_samples);
+        std::iota(inputs.level_ids.begin(), inputs.level_ids.end(), 0);
+        inputs.level_nodes.assign(1, 0);
+        inputs.level_nodes.push_back(n_samples);
+        for (int l = 0; l < level; ++l) {
+            std::vector<int> nodes(1, 0);
+            for (int j = 0; j + 1 < (int) inputs.level_nodes.size(); ++j) {
+                int *begin = inputs.level_ids.data() + inputs.level_nodes[j];
+                int *end = inputs.level_ids.data() + inputs.level_nodes[j + 1], *middle;
+                split_tree_node(begin, end, inputs.tree_projections.data() + l, depth, (1 << l) - 1 + j, 0, middle);
+                nodes.push_back(middle - inputs.level_ids.data());
+                nodes.push_back(inputs.level_nodes[j + 1]);
+            }
+            inputs.level_nodes.swap(nodes);
+        }
+        inputs.work_ids.resize(n_samples);
+    }
+
+    /**
+    * Runs one kernel over the inputs of prepare_kernels, in the calling thread.
+    * The outputs of the kernel are written into the working memory of inputs.
+    * @return The units of work done, by which the time of the kernel is divided:
+    * the random vectors projected on and routed through, the votes counted, the
+    * queries that fell back to the most voted, the candidates scored and
+    * selected, or the points split
+    */
+    int64_t run_kernel(Kernel kernel, KernelInputs &inputs) const {
+        const int n_queries = inputs.queries.cols(), k = inputs.k, max_leaf_size = n_samples / (1 << depth) + 1;
+        QueryScratch &scratch = inputs.scratch;
+        int64_t units = 0;
+        switch (kernel) {
+            case KERNEL_PROJECTION:
+                for (int i = 0; i < n_queries; ++i)
+                    inputs.projected_queries.col(i) = project_query(inputs.queries.col(i));
+                return (int64_t) n_queries * n_pool;
+            case KERNEL_ROUTING:
+                for (int i = 0; i < n_queries; ++i)
+                    route(inputs.projected_queries.col(i).data(), inputs.found_leaves.col(i).data());
+                return (int64_t) n_queries * n_trees * depth;
+            case KERNEL_VOTING:
+            case KERNEL_FALLBACK: {
+                const bool fallback = kernel == KERNEL_FALLBACK;
+                const int n = fallback ? inputs.fallback_queries.size() : n_queries;
+                for (int j = 0; j < n; ++j) {
+                    const int i = fallback ? inputs.fallback_queries[j] : j;
+                    int n_elected = 0, n_touched = 0;
+                    scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+                    scratch.select_counters(n_samples, n_trees, false);
+                    for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                        if (inputs.found_leaves(n_tree, i) >= 0)
+                            units += count_leaf_votes(n_tree, inputs.found_leaves(n_tree, i), inputs.votes_required,
+                                                      scratch, n_elected, n_touched);
+                    }
+                    if (fallback)
+                        elect_by_max_votes(k, inputs.votes_required, scratch, n_elected, n_touched);
+                    clear_votes(scratch, n_touched);
+                }
+                return fallback ? n : units;
+            }
+            case KERNEL_SCORING:
+                for (int i = 0; i < n_queries; ++i) {
+                    const std::vector<int> &candidates = inputs.candidates[i];
+                    exact_knn(inputs.queries.col(i), k, candidates.data(), candidates.size(), scratch,
+                              inputs.out.data(), inputs.out_distances.data());
+                    units += candidates.size();
+                }
+                return units;
+            case KERNEL_SELECTION:
+                for (int i = 0; i < n_queries; ++i) {
+                    const std::vector<int> &candidates = inputs.candidates[i];
+                    const std::vector<float> &scores = inputs.scores[i];
+                    scratch.heap.reset(k);
+                    for (size_t j = 0; j < candidates.size(); ++j)
+                        scratch.heap.push(scores[j], candidates[j]);
+                    extract_knn(scratch.heap, inputs.out.data(), inputs.out_distances.data());
+                    units += candidates.size();
+                }
+                return units;
+            case KERNEL_SPLITTING:
+                std::copy(inputs.level_ids.begin(), inputs.level_ids.end(), inputs.work_ids.begin());
+                for (int j = 0; j + 1 < (int) inputs.level_nodes.size(); ++j) {
+                    int *middle;
+                    split_tree_node(inputs.work_ids.data() + inputs.level_nodes[j],
+                                    inputs.work_ids.data() + inputs.level_nodes[j + 1],
+                                    inputs.tree_projections.data() + inputs.level, depth,
+                                    (1 << inputs.level) - 1 + j, 0, middle);
+                }
+                return n_samples;
+        }
+        return 0;
+    }
+
+ private:
+    /**
+    * Returns the squared norms of the data points, computing them on the
+    * first call.
+    */
+    const VectorXf &data_norms() const {
+        std::call_once(data_norms_computed, [this] {
+            data_squared_norms = compute_data_norms();
+        });
+        return data_squared_norms;
+    }
+
+    /**
+    * Returns the squared norms of the search data, for 8-bit data widened a block
+    * of points at a time.
+    */
+    VectorXf compute_data_norms() const {
+        if (!byte_data)
+            return search_matrix().colwise().squaredNorm().transpose();
+        const int block_size = 1024;
+        VectorXf norms(n_samples);
+        parallel_for((n_samples + block_size - 1) / block_size, [&](int b) {
+            const int first = b * block_size, n = std::min(block_size, n_samples - first);
+            MatrixXf widened;
+            norms.segment(first, n) = data_columns(first, n, widened).colwise().squaredNorm().transpose();
+        });
+        return norms;
+    }
+
+    /**
+    * Switches the linear search to read the data from data, and updates the
+    * cached data norms and the quantized copy of the data if there are any.
+    * @param reordered - Whether data holds the same points as before in another
+    * order, so that the INT8 ranges and PQ codebooks are kept
+    */
+    void set_search_data(const float *data, bool reordered = false) {
+        search_data = data;
+        if (data_squared_norms.size())
+            data_squared_norms = compute_data_norms();
+        quantize_data(!reordered);
+        if (leading_dimensions.size())
+            copy_leading_dimensions(0, !reordered);
+    }
+
+    /**
+    * Copies the leading dimensions of set_leading_dimensions of the points with
+    * internal ids first, ..., n_samples - 1 into leading_data.
+    * @param rank - Whether the dimensions are ranked again by their variance in
+    * a sample of the data, drawn with a stride, before copying
+    */
+    void copy_leading_dimensions(int first, bool rank) {
+        const int n_leading = leading_dimensions.size();
+        if (rank && n_leading) {
+            const int step = std::max(1, n_samples / 4096);
+            const Map<const MatrixXf> data = search_matrix();
+            const VectorXf mean = data.rowwise().mean();
+            VectorXf variance = VectorXf::Zero(dim);
+            for (int i = 0; i < n_samples; i += step)
+                variance += (data.col(i) - mean).cwiseAbs2();
+            std::vector<int> order(dim);
+            std::iota(order.begin(), order.end(), 0);
+            std::partial_sort(order.begin(), order.begin() + n_leading, order.end(),
+                              [&variance](int a, int b) { return variance(a) > variance(b); });
+            leading_dimensions = Map<VectorXi>(order.data(), n_leading);
+        }
+        leading_data.resize((size_t) n_leading * n_samples);
+        leading_data.shrink_to_fit();
+        parallel_for(n_samples - first, [&](int j) {
+            const float *x = column(first + j);
+            float *leading = leading_data.data() + (size_t) n_leading * (first + j);
+            for (int d = 0; d < n_leading; ++d)
+                leading[d] = x[leading_dimensions(d)];
+        }, 1024);
+    }
+
+    /**
+    * Makes the quantized copy of the search data for the quantization set with
+    * set_quantization. The INT8 codes of each dimension span the range of the
+    * values of the dimension. BINARY codes are made only once the trees are,
+    * since grow and load make the random vectors after the search data.
+    * The codes of 8-bit data are the data itself, and are kept.
+    * @param train - If false, the INT8 ranges, PQ codebooks, principal components
+    * and BINARY medians made earlier are used
+    */
+    void quantize_data(bool train = true) {
+        if (byte_data)
+            return;
+        codes.clear();
+        codes.shrink_to_fit();
+        if (quantization == FLOAT32)
+            return;
+        if (quantization == BINARY) {
+            if (n_ready_trees)
+                quantize_binary(train);
+            return;
+        }
+        const bool trained = quantization == INT8 ? code_scale.size() == dim :
+                             quantization == PCA ? pca_components.cols() == pq_subspaces
+                                                 : pq_first.size() == pq_subspaces + 1;
+        if (quantization == INT8 && (train || !trained)) {
+            const Map<const MatrixXf> data = search_matrix();
+            code_offset = data.rowwise().minCoeff();
+            code_scale = (data.rowwise().maxCoeff() - code_offset) / 255;
+            code_scale = (code_scale.array() > 0).select(code_scale, 1);
+        } else if (quantization == PQ && (train || !trained)) {
+            train_pq_codebooks();
+        } else if (quantization == PCA && (train || !trained)) {
+            train_pca();
+        }
+        quantize_points(0, n_samples);
+    }
+
+    /**
+    * Makes the BINARY codes of the search data from the random vectors of the
+    * index, whose thresholds are the medians of the projections of a sample of
+    * the data, drawn by the original ids.
+    * @param train - If false, the medians made earlier are used if the number
+    * of random vectors has not changed
+    */
+    void quantize_binary(bool train = true) {
+        codes.clear();
+        if (train || binary_thresholds.size() != n_pool) {
+            const int n_train = std::min(n_samples, 16384);
+            std::mt19937 gen(build_seed);
+            std::vector<int> sample(n_samples);
+            std::iota(sample.begin(), sample.end(), 0);
+            for (int i = 0; i < n_train; ++i)
+                std::swap(sample[i], sample[std::uniform_int_distribution<int>(i, n_samples - 1)(gen)]);
+            MatrixXf train_points(dim, n_train);
+            for (int i = 0; i < n_train; ++i)
+                train_points.col(i) = Map<const VectorXf>(column(to_internal(sample[i])), dim);
+            const Matrix<float, Dynamic, Dynamic, RowMajor> projected = project_points(train_points);
+
+            binary_thresholds.resize(n_pool);
+            parallel_for(n_pool, [&](int r) {
+                std::vector<float> row(projected.row(r).data(), projected.row(r).data() + n_train);
+                std::nth_element(row.begin(), row.begin() + n_train / 2, row.end());
+                binary_thresholds(r) = n_train ? row[n_train / 2] : 0;
+            }, 16);
+        }
+        quantize_points(0, n_samples);
+    }
+
+    /**
+    * Writes the BINARY code of the projections of a point onto the random vectors.
+    */
+    void binary_code(const float *projected, uint64_t *code) const {
+        std::fill(code, code + binary_words(), 0);
+        for (int r = 0; r < n_pool; ++r)
+            code[r >> 6] |= uint64_t(projected[r] > binary_thresholds(r)) << (r & 63);
+    }
+
+    /**
+    * Returns the number of 64-bit words of a BINARY code.
+    */
+    int binary_words() const {
+        return (n_pool + 63) / 64;
+    }
+
+    /**
+    * Returns the number of bytes of the quantized copy of a vector.
+    */
+    size_t code_size() const {
+        if (quantization == BINARY)
+            return sizeof(uint64_t) * binary_words();
+        if (quantization == PCA)
+            return sizeof(float) * pq_subspaces;
+        return quantization == INT8 ? dim : quantization == FLOAT16 ? sizeof(uint16_t) * dim : pq_subspaces;
+    }
+
+    /**
+    * Trains the codebooks of PQ codes with 256 centroids per subspace by k-means,
+    * starting from random points, on a sample of the data. The sample is drawn by
+    * the original ids, so reordering the data does not change the codebooks.
+    */
+    void train_pq_codebooks() {
+        const int n_centroids = 256, n_iterations = 10;
+        const int n_train = std::min(n_samples, 64 * n_centroids);
+        pq_first.resize(pq_subspaces + 1);
+        for (int s = 0; s <= pq_subspaces; ++s)
+            pq_first(s) = (int64_t) s * dim / pq_subspaces;
+
+        std::mt19937 gen(build_seed);
+        std::vector<int> sample(n_samples);
+        std::iota(sample.begin(), sample.end(), 0);
+        for (int i = 0; i < n_train; ++i)
+            std::swap(sample[i], sample[std::uniform_int_distribution<int>(i, n_samples - 1)(gen)]);
+        MatrixXf train(dim, n_train);
+        for (int i = 0; i < n_train; ++i)
+            train.col(i) = Map<const VectorXf>(column(to_internal(sample[i])), dim);
+
+        pq_centroids = MatrixXf(dim, n_centroids);
+        for (int c = 0; c < n_centroids; ++c)
+            pq_centroids.col(c) = train.col(c % n_train);
+
+        parallel_for(pq_subspaces, [&](int s) {
+            const int first = pq_first(s), length = pq_first(s + 1) - first;
+            std::mt19937 subspace_gen(build_seed + s);
+            std::vector<uint8_t> assignment(n_train);
+            for (int iteration = 0; iteration < n_iterations; ++iteration) {
+                assign_pq_codes(train, s, assignment.data(), 1);
+                MatrixXf sums = MatrixXf::Zero(length, n_centroids);
+                VectorXi counts = VectorXi::Zero(n_centroids);
+                for (int i = 0; i < n_train; ++i) {
+                    sums.col(assignment[i]) += train.block(first, i, length, 1);
+                    counts(assignment[i])++;
+                }
+                // an empty cluster restarts from a random training point
+                for (int c = 0; c < n_centroids; ++c) {
+                    if (counts(c))
+                        pq_centroids.block(first, c, length, 1) = sums.col(c) / counts(c);
+                    else
+                        pq_centroids.block(first, c, length, 1) = train.block(first, subspace_gen() % n_train, length, 1);
+                }
+            }
+        });
+    }
+
+    /**
+    * Finds the mean and the pq_subspaces principal components of the data, the
+    * eigenvectors of the largest eigenvalues of its covariance matrix, on a
+    * sample drawn by the original ids, so reordering the data does not change
+    * them.
+    */
+    void train_pca() {
+        const int n_train = std::min(n_samples, 16384);
+        std::mt19937 gen(build_seed);
+        std::vector<int> sample(n_samples);
+        std::iota(sample.begin(), sample.end(), 0);
+        for (int i = 0; i < n_train; ++i)
+            std::swap(sample[i], sample[std::uniform_int_distribution<int>(i, n_samples - 1)(gen)]);
+        MatrixXf train(dim, n_train);
+        for (int i = 0; i < n_train; ++i)
+            train.col(i) = Map<const VectorXf>(column(to_internal(sample[i])), dim);
+
+        pca_mean = n_train ? VectorXf(train.rowwise().mean()) : VectorXf::Zero(dim);
+        train.colwise() -= pca_mean;
+        MatrixXf covariance = MatrixXf::Zero(dim, dim);
+        covariance.selfadjointView<Lower>().rankUpdate(train, 1.0f / std::max(n_train, 1));
+        // the eigenvalues are in increasing order
+        const SelfAdjointEigenSolver<MatrixXf> solver(covariance);
+        pca_components = solver.eigenvectors().rightCols(pq_subspaces).rowwise().reverse();
+    }
+
+    /**
+    * Writes the code of subspace s of each column of points, the nearest centroid
+    * of the subspace, to out with the given stride between the columns.
+    */
+    void assign_pq_codes(const Ref<const MatrixXf> &points, int s, uint8_t *out, int stride) const {
+        const int first = pq_first(s), length = pq_first(s + 1) - first;
+        const auto centroids = pq_centroids.middleRows(first, length);
+        const VectorXf half_norms = centroids.colwise().squaredNorm().transpose() / 2;
+        const MatrixXf products = centroids.transpose() * points.middleRows(first, length);
+        for (int i = 0; i < points.cols(); ++i) {
+            Index c;
+            (half_norms - products.col(i)).minCoeff(&c);
+            out[(size_t) i * stride] = c;
+        }
+    }
+
+    /**
+    * Quantizes the search data of the points with internal ids first, ..., last - 1
+    * into codes, sized for all n_samples points, with the INT8 ranges of the
+    * earlier points; inserted values out of the range get the nearest code.
+    */
+    void quantize_points(int first, int last) {
+        const size_t code_bytes = code_size();
+        codes.resize(code_bytes * n_samples);
+        advise_huge_pages(codes.data(), codes.size());
+
+        if (quantization == PQ || quantization == BINARY || quantization == PCA) {
+            const int block_size = 1024;
+            parallel_for((last - first + block_size - 1) / block_size, [&](int b) {
+                const int block = first + b * block_size, n = std::min(block_size, last - block);
+                const Map<const MatrixXf> points(column(block), dim, n);
+                if (quantization == BINARY) {
+                    const MatrixXf projected = project_points(points);
+                    for (int i = 0; i < n; ++i)
+                        binary_code(projected.col(i).data(),
+                                    reinterpret_cast<uint64_t *>(codes.data() + code_bytes * (block + i)));
+                    return;
+                }
+                if (quantization == PCA) {
+                    Map<MatrixXf>(reinterpret_cast<float *>(codes.data() + code_bytes * block), pq_subspaces, n) =
+                        pca_components.transpose() * (points.colwise() - pca_mean);
+                    return;
+                }
+                for (int s = 0; s < pq_subspaces; ++s)
+                    assign_pq_codes(points, s, codes.data() + code_bytes * block + s, pq_subspaces);
+            });
+            return;
+        }
+
+        parallel_for(last - first, [&](int j) {
+            const int i = first + j;
+            const float *x = column(i);
+            if (quantization == INT8) {
+                uint8_t *code = codes.data() + code_bytes * i;
+                for (int j = 0; j < dim; ++j) {
+                    const float c = std::round((x[j] - code_offset(j)) / code_scale(j));
+                    code[j] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, c)));
+                }
+            } else {
+                uint16_t *code = reinterpret_cast<uint16_t *>(codes.data() + code_bytes * i);
+                for (int j = 0; j < dim; ++j)
+                    code[j] = mrpt_kernels::float_to_half(x[j]);
+            }
+        }, 1024);
+    }
+
+    /**
+    * Scores the n_elected candidates in indices with the quantized data and keeps
+    * the n_shortlist nearest of them in the heap scratch.shortlist.
+    */
+    void shortlist_candidates(const Ref<const VectorXf> &q, int n_shortlist, const int *indices, int n_elected,
+                              QueryScratch &scratch) const {
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const size_t code_bytes = code_size();
+        const int distance = prefetch_distance < 0 ? std::max(4, std::min(32, 8192 / (int) code_bytes))
+                                                   : prefetch_distance;
+        const float *query = q.data();
+        if (quantization == INT8) {
+            scratch.quantized_query = q - code_offset;
+            query = scratch.quantized_query.data();
+        } else if (quantization == PQ) {
+            VectorXf &tables = scratch.quantized_query;
+            tables.resize(256 * pq_subspaces);
+            for (int s = 0; s < pq_subspaces; ++s) {
+                const int first = pq_first(s), length = pq_first(s + 1) - first;
+                tables.segment(256 * s, 256) = (pq_centroids.middleRows(first, length).colwise()
+                                                - q.segment(first, length)).colwise().squaredNorm().transpose();
+            }
+            query = tables.data();
+        } else if (quantization == PCA) {
+            scratch.quantized_query.noalias() = pca_components.transpose() * (q - pca_mean);
+            query = scratch.quantized_query.data();
+        } else if (quantization == BINARY) {
+            std::vector<uint64_t> &code = scratch.binary_query;
+            code.resize(binary_words());
+            if (scratch.projected_query) {
+                binary_code(scratch.projected_query, code.data());
+            } else {
+                const VectorXf projected_query = project_query(q);
+                binary_code(projected_query.data(), code.data());
+            }
+        }
+
+        TopK &shortlist = scratch.shortlist;
+        shortlist.reset(n_shortlist);
+        if (quantization == BINARY) {
+            const uint64_t *query_code = scratch.binary_query.data();
+            const int words = binary_words();
+            for (int i = 0; i < n_elected; ++i) {
+                if (distance && i + distance < n_elected)
+                    mrpt_kernels::prefetch(codes.data() + code_bytes * indices[i + distance], code_bytes);
+                const uint64_t *code = reinterpret_cast<const uint64_t *>(codes.data() + code_bytes * indices[i]);
+                shortlist.push(kernels.hamming(query_code, code, words), indices[i]);
+            }
+            return;
+        }
+        for (int i = 0; i < n_elected; ++i) {
+            if (distance && i + distance < n_elected)
+                mrpt_kernels::prefetch(codes.data() + code_bytes * indices[i + distance], code_bytes);
+            const uint8_t *code = codes.data() + code_bytes * indices[i];
+            float d;
+            if (quantization == INT8)
+                d = kernels.l2_int8(query, code_scale.data(), code, dim);
+            else if (quantization == FLOAT16)
+                d = kernels.l2_float16(query, reinterpret_cast<const uint16_t *>(code), dim);
+            else if (quantization == PCA)
+                d = kernels.l2(query, reinterpret_cast<const float *>(code), pq_subspaces);
+            else
+                d = mrpt_kernels::pq_distance(query, code, pq_subspaces);
+            shortlist.push(d, indices[i]);
+        }
+    }
+
+    /**
+    * Returns the data read by the linear search, whose columns are indexed by
+    * internal ids.
+    */
+    Map<const MatrixXf> search_matrix() const {
+        return Map<const MatrixXf>(search_data, dim, n_samples);
+    }
+
+    /**
+    * Returns the vector of a point given its internal id.
+    */
+    const float *column(int id) const {
+        return search_data + static_cast<std::ptrdiff_t>(id) * dim;
+    }
+
+    /**
+    * Returns the columns first, ..., first + n - 1 of the data matrix X, or of
+    * 8-bit data widened to floats into buffer.
+    */
+    Map<const MatrixXf> data_columns(int first, int n, MatrixXf &buffer) const {
+        if (!byte_data)
+            return Map<const MatrixXf>(X->data() + static_cast<std::ptrdiff_t>(first) * dim, dim, n);
+        const Map<const Matrix<uint8_t, Dynamic, Dynamic>> bytes(codes.data() + (size_t) dim * first, dim, n);
+        buffer = (bytes.cast<float>().array().colwise() * code_scale.array()).colwise() + code_offset.array();
+        return Map<const MatrixXf>(buffer.data(), dim, n);
+    }
+
+    /**
+    * Conversions between the ids of the original data, used by the public
+    * methods, and the internal ids used in the leaves. The two are the same
+    * unless the data has been reordered. Negative ids are kept as they are.
+    */
+    int to_internal(int id) const {
+        return data_position.size() ? data_position(id) : id;
+    }
+
+    int to_external(int id) const {
+        return data_order.size() && id >= 0 ? data_order(id) : id;
+    }
+
+    /**
+    * Returns the internal ids of the n original ids in ids, using buffer for
+    * the converted ids if a conversion is needed.
+    */
+    const int *to_internal(const int *ids, int n, std::vector<int> &buffer) const {
+        if (!data_position.size()) return ids;
+        buffer.resize(n);
+        for (int i = 0; i < n; ++i)
+            buffer[i] = data_position(ids[i]);
+        return buffer.data();
+    }
+
+    /**
+    * Returns a pointer to the points of leaf of tree n_tree.
+    */
+    const int *leaf_begin(int n_tree, int leaf) const {
+        return leaf_ids_data + (size_t) n_tree * tree_points + leaf_first_data[n_tree * ((1 << depth) + 1) + leaf];
+    }
+
+    /**
+    * Returns the number of points in leaf of tree n_tree.
+    */
+    int leaf_size(int n_tree, int leaf) const {
+        const int *first = leaf_first_data + n_tree * ((1 << depth) + 1) + leaf;
+        return first[1] - first[0];
+    }
+
+    /**
+    * Calls f(ids, n) with the points of the leaves first, ..., last - 1 of tree
+    * n_tree, which follow each other in the tree, without the inserted points:
+    * once with all of them, or if the leaves are compressed, with each block
+    * unpacked into a buffer on the stack.
+    */
+    template<typename F>
+    void visit_leaves(int n_tree, int first, int last, F f) const {
+        if (packed_first.empty()) {
+            const int *begin = leaf_begin(n_tree, first);
+            f(begin, (int) (leaf_begin(n_tree, last) - begin));
+            return;
+        }
+        const mrpt_kernels::UnpackFunction unpack = dim_kernels->unpack_ids;
+        int block[mrpt_kernels::pack_block];
+        for (int leaf = first; leaf < last; ++leaf) {
+            const uint32_t *words = packed_ids.data() + packed_first[(size_t) n_tree * (1 << depth) + leaf];
+            for (int left = leaf_size(n_tree, leaf); left > 0; left -= mrpt_kernels::pack_block) {
+                const int n = std::min(left, mrpt_kernels::pack_block);
+                words = unpack(words, n, block);
+                f(block, n);
+            }
+        }
+    }
+
+    /**
+    * Offers the distance between each pair of points in leaf of tree n_tree to
+    * the neighbors of both points of the pair, skipping the points already
+    * among them through an earlier tree. The squared distances of EUCLIDEAN are
+    * computed as ||x||^2 - 2 x^T y + ||y||^2 from the inner products of the leaf.
+    */
+    void join_leaf(int n_tree, int leaf, const VectorXf &norms, std::vector<TopK> &heaps) const {
+        std::vector<int> ids;
+        visit_leaves(n_tree, leaf, leaf + 1, [&](const int *points, int n) { ids.insert(ids.end(), points, points + n); });
+        if (!inserted_leaves.empty()) {
+            const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + leaf];
+            ids.insert(ids.end(), inserted.begin(), inserted.end());
+        }
+        if (n_stale)
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [this](int id) { return is_deleted(id); }), ids.end());
+
+        const int m = ids.size();
+        MatrixXf points(dim, m);
+        for (int i = 0; i < m; ++i)
+            points.col(i) = Map<const VectorXf>(column(ids[i]), dim);
+        MatrixXf dots(m, m);
+        dots.triangularView<Lower>() = points.transpose() * points;
+
+        for (int b = 0; b < m; ++b) {
+            const int id_b = ids[b];
+            const float scale = inverse_norm(norms(id_b));
+            for (int a = b + 1; a < m; ++a) {
+                const int id_a = ids[a];
+                const float d = metric == EUCLIDEAN ? std::max(0.0f, norms(id_a) + norms(id_b) - 2 * dots(a, b))
+                                                    : score(dots(a, b), id_a, norms.data(), scale);
+                if (d < heaps[id_a].threshold() && !heaps[id_a].contains(id_b))
+                    heaps[id_a].push(d, id_b);
+                if (d < heaps[id_b].threshold() && !heaps[id_b].contains(id_a))
+                    heaps[id_b].push(d, id_a);
+            }
+        }
+    }
+
+    /**
+    * Writes the original ids of the candidates with at least votes_required votes
+    * among the num_leaves candidates to out, and returns how many there are.
+    */
+    int filter_votes(const int *leaves, int num_leaves, int votes_required, int *out, QueryScratch &scratch) const {
+        scratch.reserve(std::min(num_leaves, n_samples));
+        scratch.select_counters(n_samples, num_leaves, votes_required == 1);
+
+        std::vector<int> internal_leaves;
+        leaves = to_internal(leaves, num_leaves, internal_leaves);
+
+        int n_elected = 0, n_touched = 0;
+        count_votes(leaves, num_leaves, votes_required, scratch, n_elected, n_touched);
+        for (int i = 0; i < n_elected; ++i)
+            out[i] = to_external(scratch.elected(i));
+        clear_votes(scratch, n_touched);
+        return n_elected;
+    }
+
+    /**
+    * Calls f with the internal id of every point that is not deleted in the given
+    * leaves of the trees, a leaf per tree, including the points inserted into them.
+    * A negative leaf, of a tree not loaded yet, is skipped.
+    */
+    template<typename F>
+    void for_each_leaf_point(const int *found_leaves, F f) const {
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            const int leaf = found_leaves[n_tree];
+            if (leaf < 0)
+                continue;
+            visit_leaves(n_tree, leaf, leaf + 1, [&](const int *ids, int n) {
+                for (const int *p = ids; p < ids + n; ++p)
+                    if (!n_stale || !is_deleted(*p)) f(*p);
+            });
+            if (!inserted_leaves.empty()) {
+                for (int id : inserted_leaves[n_tree * (1 << depth) + leaf])
+                    if (!n_stale || !is_deleted(id)) f(id);
+            }
+        }
+    }
+
+    /**
+    * Starts loading the offset of leaf of tree n_tree into the cache, as
+    * count_leaf_votes reads it, for prefetch_leaf a few trees later.
+    */
+    void prefetch_leaf_offset(int n_tree, int leaf, int pruned_levels) const {
+        const size_t first = (size_t) n_tree * (1 << depth) + (leaf << pruned_levels);
+        if (packed_first.empty())
+            mrpt_kernels::prefetch(leaf_first_data + first + n_tree, 2 * sizeof(int));
+        else
+            mrpt_kernels::prefetch(packed_first.data() + first, sizeof(packed_first[0]));
+    }
+
+    /**
+    * Starts loading the first cache lines of the ids of leaf of tree n_tree,
+    * counted by count_leaf_votes, into the cache. The hardware prefetcher
+    * follows the rest of a long leaf once it is read.
+    */
+    void prefetch_leaf(int n_tree, int leaf, int pruned_levels) const {
+        const int first = leaf << pruned_levels;
+        if (packed_first.empty()) {
+            const int *begin = leaf_begin(n_tree, first), *end = leaf_begin(n_tree, (leaf + 1) << pruned_levels);
+            mrpt_kernels::prefetch(begin, std::min<int>(leaf_prefetch_bytes, sizeof(int) * (end - begin)));
+        } else {
+            mrpt_kernels::prefetch(packed_ids.data() + packed_first[(size_t) n_tree * (1 << depth) + first],
+                                   leaf_prefetch_bytes);
+        }
+    }
+
+    /**
+    * Counts the votes of the points of leaf of tree n_tree, including the points
+    * inserted into it after the trees were built, and returns their number. With
+    * pruned_levels set in scratch, the leaf is one of the tree cut that many
+    * levels shorter, which holds the consecutive leaves of its subtree.
+    * @param weight - The votes the tree gives each point, see set_margin_votes
+    */
+    int count_leaf_votes(int n_tree, int leaf, int votes_required, QueryScratch &scratch,
+                         int &n_elected, int &n_touched, int weight = 1) const {
+        const int first = leaf << scratch.pruned_levels, last = (leaf + 1) << scratch.pruned_levels;
+        int n = 0;
+        visit_leaves(n_tree, first, last, [&](const int *ids, int m) {
+            count_votes(ids, m, votes_required, scratch, n_elected, n_touched, weight);
+            n += m;
+        });
+        for (int j = first; j < last && !inserted_leaves.empty(); ++j) {
+            const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + j];
+            count_votes(inserted.data(), inserted.size(), votes_required, scratch, n_elected, n_touched, weight);
+            n += inserted.size();
+        }
+        return n;
+    }
+
+    /**
+    * Sets the points of leaf of tree n_tree, as count_leaf_votes counts them,
+    * in the bitmap of the tree for the bit-sliced counters of scratch.
+    */
+    void set_leaf_bits(int n_tree, int leaf, QueryScratch &scratch) const {
+        uint64_t *bits = scratch.tree_bits.data() + QueryScratch::sliced_words(n_samples) * n_tree;
+        const Filter *filter = scratch.filter;
+        const uint64_t *excluded = scratch.excluded;
+        auto set_bits = [&](const int *ids, int m) {
+            // the bits of a run of ids in the same word are gathered before the word is
+            // written, rather than each write waiting for the one before it
+            int word = 0;
+            uint64_t word_bits = 0;
+            for (int i = 0; i < m; ++i) {
+                const int id = ids[i];
+                if ((n_stale && is_deleted(id)) || (filter && !filter->test(id)) || excluded_sample(excluded, id))
+                    continue;
+                if (id >> 6 != word) {
+                    bits[word] |= word_bits;
+                    word = id >> 6;
+                    word_bits = 0;
+                }
+                word_bits |= (uint64_t) 1 << (id & 63);
+            }
+            bits[word] |= word_bits;
+        };
+        const int first = leaf << scratch.pruned_levels, last = (leaf + 1) << scratch.pruned_levels;
+        visit_leaves(n_tree, first, last, set_bits);
+        for (int j = first; j < last && !inserted_leaves.empty(); ++j) {
+            const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + j];
+            set_bits(inserted.data(), inserted.size());
+        }
+    }
+
+    /**
+    * Computes the centroids and radii of the leaves of all trees for
+    * set_leaf_bounds, and the squared norms of the data.
+    */
+    void compute_leaf_bounds() {
+        const int n_leaves = 1 << depth;
+        leaf_centroids.resize(dim, n_trees * n_leaves);
+        leaf_radii.resize(n_trees * n_leaves);
+        parallel_for(n_trees, [&](int n_tree) {
+            bound_tree(n_tree);
+        });
+        data_norms();
+    }
+
+    /**
+    * Computes the centroids and radii of the leaves of tree n_tree from their
+    * points that are not deleted, including the inserted ones. The radii are
+    * rounded up, so that the bounds hold despite the rounding errors of the
+    * distances.
+    */
+    void bound_tree(int n_tree) {
+        const int n_leaves = 1 << depth;
+        std::vector<int> ids;
+        for (int leaf = 0; leaf < n_leaves; ++leaf) {
+            const int i = n_tree * n_leaves + leaf;
+            ids.clear();
+            visit_leaves(n_tree, leaf, leaf + 1, [&](const int *points, int n) { ids.insert(ids.end(), points, points + n); });
+            if (!inserted_leaves.empty())
+                ids.insert(ids.end(), inserted_leaves[i].begin(), inserted_leaves[i].end());
+            if (n_stale)
+                ids.erase(std::remove_if(ids.begin(), ids.end(), [this](int id) { return is_deleted(id); }), ids.end());
+
+            leaf_centroids.col(i).setZero();
+            for (int id : ids)
+                leaf_centroids.col(i) += Map<const VectorXf>(column(id), dim);
+            if (!ids.empty())
+                leaf_centroids.col(i) /= ids.size();
+            float radius = 0;
+            for (int id : ids)
+                radius = std::max(radius, (Map<const VectorXf>(column(id), dim) - leaf_centroids.col(i)).squaredNorm());
+            leaf_radii(i) = ids.empty() ? -1 : std::sqrt(radius) * (1 + 1e-4f);
+        }
+    }
+
+    /**
+    * Grows the ball of leaf i, at n_tree * 2^depth + leaf, to hold the point x
+    * inserted into the leaf.
+    */
+    void extend_leaf_bound(int i, const float *x) {
+        const Map<const VectorXf> point(x, dim);
+        if (leaf_radii(i) < 0) {
+            leaf_centroids.col(i) = point;
+            leaf_radii(i) = 0;
+        } else {
+            leaf_radii(i) = std::max(leaf_radii(i), (point - leaf_centroids.col(i)).norm() * (1 + 1e-4f));
+        }
+    }
+
+    /**
+    * Orders the n_elected candidates elected by probe_leaves into scratch.ranked
+    * by the lower bounds of their distances to the query given by the balls of
+    * the leaves that elected them, which go to scratch.lower_bounds. A candidate
+    * is in the ball of every leaf it is in, so the bound is that of the first.
+    */
+    void order_by_leaf_bounds(const float *query, QueryScratch &scratch, int n_elected) const {
+        const mrpt_kernels::DistanceFunction l2 = dim_kernels->l2;
+        const std::vector<std::pair<int, int>> &visited = scratch.visited_leaves;
+        std::vector<std::pair<float, int>> &order = scratch.leaf_order;
+        order.clear();
+        for (int j = 0, begin = 0; j < (int) visited.size(); begin = visited[j++].second) {
+            if (visited[j].second == begin)
+                continue;
+            const int leaf = visited[j].first;
+            const float gap = std::sqrt(l2(query, leaf_centroids.col(leaf).data(), dim)) - leaf_radii(leaf);
+            order.emplace_back(gap > 0 ? gap * gap : 0, j);
+        }
+        std::sort(order.begin(), order.end());
+
+        if (scratch.ranked.size() < n_elected)
+            scratch.ranked.resize(n_elected);
+        scratch.lower_bounds.resize(n_elected);
+        int n = 0;
+        for (const std::pair<float, int> &leaf : order) {
+            const int j = leaf.second, begin = j ? visited[j - 1].second : 0;
+            for (int i = begin; i < visited[j].second; ++i, ++n) {
+                scratch.ranked(n) = scratch.elected(i);
+                scratch.lower_bounds[n] = leaf.first;
+            }
+        }
+    }
+
+    /**
+    * Forgets the inserted points that are not merged into the trees and the
+    * deleted points, for trees that are grown or loaded.
+    */
+    void clear_updates() {
+        inserted_leaves.clear();
+        n_unmerged = 0;
+        tree_points = n_samples;
+        deleted_bits.clear();
+        n_deleted = 0;
+        n_stale = 0;
+        duplicate_first.clear();
+        duplicate_ids.clear();
+    }
+
+    /**
+    * Rebuilds the hash table of find_label from the labels, with twice as many
+    * slots as labels rounded up to a power of two, so that probes stay short.
+    * @return false if two points have the same label
+    */
+    bool index_labels() {
+        n_labeled = 0;
+        for (int64_t value : labels)
+            n_labeled += value != -1;
+        size_t n_slots = 2;
+        while (n_slots < 2 * (size_t) n_labeled)
+            n_slots *= 2;
+        label_slots.assign(labels.empty() ? 0 : n_slots, -1);
+        const size_t mask = n_slots - 1;
+        for (int id = 0; id < (int) labels.size(); ++id) {
+            if (labels[id] == -1)
+                continue;
+            size_t slot = mix_bits(labels[id]) & mask;
+            for (; label_slots[slot] >= 0; slot = (slot + 1) & mask)
+                if (labels[label_slots[slot]] == labels[id])
+                    return false;
+            label_slots[slot] = id;
+        }
+        return true;
+    }
+
+    /**
+    * Adds the label of a point, which no other point has, to the hash table.
+    */
+    void index_label(int id) {
+        if (labels[id] == -1)
+            return;
+        if (2 * (size_t) (n_labeled + 1) > label_slots.size()) {
+            index_labels();
+            return;
+        }
+        const size_t mask = label_slots.size() - 1;
+        size_t slot = mix_bits(labels[id]) & mask;
+        while (label_slots[slot] >= 0)
+            slot = (slot + 1) & mask;
+        label_slots[slot] = id;
+        ++n_labeled;
+    }
+
+    /**
+    * Removes the label of a point, moving the later entries of its run of the
+    * hash table back so that no probe stops early.
+    */
+    void unlabel(int id) {
+        if (id < 0 || id >= (int) labels.size() || labels[id] == -1)
+            return;
+        const size_t mask = label_slots.size() - 1;
+        size_t hole = mix_bits(labels[id]) & mask;
+        while (label_slots[hole] != id)
+            hole = (hole + 1) & mask;
+        for (size_t next = (hole + 1) & mask; label_slots[next] >= 0; next = (next + 1) & mask) {
+            const size_t home = mix_bits(labels[label_slots[next]]) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                label_slots[hole] = label_slots[next];
+                hole = next;
+            }
+        }
+        label_slots[hole] = -1;
+        labels[id] = -1;
+        --n_labeled;
+    }
+
+    /**
+    * Returns true if the n labels of new points are not repeated among
+    * themselves, and unless replacing, not used by the points of the index.
+    */
+    bool new_labels_valid(const int64_t *values, int n, bool replacing) const {
+        std::vector<int64_t> sorted;
+        for (int i = 0; i < n; ++i) {
+            if (values[i] == -1)
+                continue;
+            if (!replacing && find_label(values[i]) >= 0)
+                return false;
+            sorted.push_back(values[i]);
+        }
+        std::sort(sorted.begin(), sorted.end());
+        return std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end();
+    }
+
+    /**
+    * Returns true if the point with internal id has been deleted.
+    */
+    bool is_deleted(int id) const {
+        return (deleted_bits[id >> 6] >> (id & 63)) & 1;
+    }
+
+    /**
+    * Returns true if the bits excluded of query_excluding are set and exclude
+    * the point with internal id.
+    */
+    static bool excluded_sample(const uint64_t *excluded, int id) {
+        return excluded && ((excluded[id >> 6] >> (id & 63)) & 1);
+    }
+
+    /**
+    * Builds again the trees in which a leaf has drifted beyond twice the size of
+    * a balanced leaf, or beyond the limit of the leaf sizes if it is less but
+    * still leaves room for the balanced leaves, after insert or update, and
+    * merges the inserted points into the trees once they are more than an eighth
+    * of all points.
+    */
+    void regrow_drifted_trees() {
+        const int n_leaves = 1 << depth;
+        const int balanced_leaf_size = (n_samples - n_deleted + n_leaves - 1) >> depth;
+        int max_leaf_size = 2 * std::max(1, (n_samples - n_deleted) >> depth);
+        if (leaf_size_limit)
+            max_leaf_size = std::min(max_leaf_size, std::max(leaf_size_limit, balanced_leaf_size));
+        std::vector<int> drifted;
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            for (int j = 0; j < n_leaves; ++j) {
+                const int n_inserted = inserted_leaves.empty() ? 0 : inserted_leaves[n_tree * n_leaves + j].size();
+                if (leaf_size(n_tree, j) + n_inserted > max_leaf_size) {
+                    drifted.push_back(n_tree);
+                    break;
+                }
+            }
+        }
+
+        if (!drifted.empty() || 8 * (int64_t) n_unmerged > n_samples)
+            compact_leaves();
+        for (int n_tree : drifted) {
+            regrow_tree(n_tree);
+            if (leaf_radii.size())
+                bound_tree(n_tree);
+        }
+    }
+
+    /**
+    * Returns the data of the index once points are inserted or set_data_file is
+    * called, in data_file or data_storage.
+    */
+    float *stored_points() {
+        return data_file.is_open() ? reinterpret_cast<float *>(data_file.data() + sizeof(mrpt_data::DataFileHeader))
+                                   : data_storage.data();
+    }
+
+    /**
+    * Writes the points X_new after the points in data_file and updates the number
+    * of points in its header.
+    * @return false if the file cannot grow to hold them.
+    */
+    bool append_to_data_file(const Ref<const MatrixXf> &X_new) {
+        const size_t offset = sizeof(mrpt_data::DataFileHeader);
+        if (!data_file.resize(offset + sizeof(float) * dim * ((size_t) n_samples + X_new.cols())))
+            return false;
+        float *rows = stored_points() + (size_t) n_samples * dim;
+        for (int i = 0; i < X_new.cols(); ++i)
+            std::copy(X_new.col(i).data(), X_new.col(i).data() + dim, rows + (size_t) i * dim);
+        reinterpret_cast<mrpt_data::DataFileHeader *>(data_file.data())->n = n_samples + X_new.cols();
+        return true;
+    }
+
+    /**
+    * Appends the points X_new to the data of the index as by insert, with the ids
+    * n_samples, n_samples + 1, ..., and counts them as unmerged, leaving it to
+    * the caller to put them into inserted_leaves.
+    */
+    void append_points(const Ref<const MatrixXf> &X_new) {
+        const int n_old = n_samples, n_new = X_new.cols();
+        expand_duplicates();
+        copy_mapped_index();
+        if (data_order.size())
+            compact_leaves();
+
+        // the data is kept in its original order, after which the inserted points are appended
+        if (X != &stored_data) {
+            std::vector<float> storage;
+            storage.reserve((size_t) (n_old + n_new) * dim);
+            advise_huge_pages(storage.data(), sizeof(float) * storage.capacity());
+            for (int i = 0; i < n_old; ++i)
+                storage.insert(storage.end(), column(to_internal(i)), column(to_internal(i)) + dim);
+            data_storage.swap(storage);
+            // the points were copied, so owned data is no longer needed
+            given_data.release();
+            new (&given_matrix) Map<const MatrixXf>(nullptr, dim, 0);
+        }
+        if (data_file.is_open() && !append_to_data_file(X_new)) {
+            // the file cannot grow, so the data moves into memory
+            std::vector<float> storage(stored_points(), stored_points() + (size_t) n_old * dim);
+            data_storage.swap(storage);
+            data_file.close();
+        }
+        if (!data_file.is_open())
+            for (int i = 0; i < n_new; ++i)
+                data_storage.insert(data_storage.end(), X_new.col(i).data(), X_new.col(i).data() + dim);
+        n_samples += n_new;
+        new (&stored_data) Map<const MatrixXf>(stored_points(), dim, n_samples);
+        X = &stored_data;
+        if (labels.size())
+            labels.resize(n_samples, -1);
+
+        const bool reordered = data_order.size();
+        if (reordered) {
+            parallel_for(n_trees, [&](int n_tree) {
+                int *ids = leaf_ids.col(n_tree).data();
+                for (int i = 0; i < tree_points; ++i)
+                    ids[i] = data_order(ids[i]);
+            });
+            if (n_deleted) {
+                std::vector<uint64_t> bits(deleted_bits.size(), 0);
+                for (int i = 0; i < n_old; ++i)
+                    if (is_deleted(i)) bits[data_order(i) >> 6] |= uint64_t(1) << (data_order(i) & 63);
+                deleted_bits.swap(bits);
+            }
+            data_order.resize(0);
+            data_position.resize(0);
+            reordered_data.resize(0, 0);
+        }
+        search_data = stored_points();
+        if (reordered)
+            quantize_data(false);
+        else if (codes.size())
+            quantize_points(n_old, n_samples);
+        if (leading_dimensions.size())
+            copy_leading_dimensions(reordered ? 0 : n_old, false);
+        if (data_squared_norms.size() && reordered) {
+            data_squared_norms = search_matrix().colwise().squaredNorm().transpose();
+        } else if (data_squared_norms.size()) {
+            data_squared_norms.conservativeResize(n_samples);
+            data_squared_norms.tail(n_new) = X_new.colwise().squaredNorm().transpose();
+        }
+
+        if (n_deleted)
+            deleted_bits.resize((n_samples + 63) / 64, 0);
+        if (inserted_leaves.empty())
+            inserted_leaves.resize((size_t) n_trees * (1 << depth));
+        n_unmerged += n_new;
+    }
+
+    /**
+    * Writes the leaves of all trees with the inserted points merged into them and
+    * the deleted points left out to first and ids, laid out as leaf_first and leaf_ids.
+    * @param with_duplicates - If true, the points left out by collapse_duplicates
+    * follow the points they are copies of
+    */
+    void merged_leaves(MatrixXi &first, MatrixXi &ids, bool with_duplicates = false) const {
+        first.resize((1 << depth) + 1, n_trees);
+        ids.resize(tree_points + n_unmerged - n_stale + (with_duplicates ? (int) duplicate_ids.size() : 0), n_trees);
+        parallel_for(n_trees, [&](int n_tree) {
+            merge_tree(n_tree, first.col(n_tree).data(), ids.col(n_tree).data(), with_duplicates);
+        });
+    }
+
+    /**
+    * Writes the leaves of tree n_tree as merged_leaves, the 2^depth + 1 leaf
+    * offsets to first and the tree_points + n_unmerged - n_stale points to ids,
+    * and the duplicates after them if with_duplicates is true.
+    */
+    void merge_tree(int n_tree, int *first, int *ids, bool with_duplicates = false) const {
+        const int n_leaves = 1 << depth;
+        const std::vector<int> none;
+        int *out = ids;
+        auto deleted = [this](int id) { return n_stale && is_deleted(id); };
+        auto copy = [&](const int *points, int n) {
+            if (!with_duplicates || duplicate_ids.empty()) {
+                out = std::remove_copy_if(points, points + n, out, deleted);
+                return;
+            }
+            for (int i = 0; i < n; ++i) {
+                if (deleted(points[i])) continue;
+                *out++ = points[i];
+                out = std::copy(duplicate_ids.data() + duplicate_first[points[i]],
+                                duplicate_ids.data() + duplicate_first[points[i] + 1], out);
+            }
+        };
+        for (int j = 0; j < n_leaves; ++j) {
+            first[j] = out - ids;
+            visit_leaves(n_tree, j, j + 1, copy);
+            const std::vector<int> &inserted = inserted_leaves.empty() ? none : inserted_leaves[n_tree * n_leaves + j];
+            copy(inserted.data(), inserted.size());
+        }
+        first[n_leaves] = out - ids;
+    }
+
+    /**
+    * Returns a CRC-32C of the state of the index a delta of save_delta is made
+    * against: the numbers of points and deleted points, the split points, the
+    * random matrix and the number of points in each leaf once the inserted points
+    * are merged and the deleted ones left out. Indexes loaded from the same file
+    * and changed in the same way have the same fingerprint, however their trees
+    * are laid out in memory.
+    */
+    uint32_t delta_fingerprint() const {
+        const int n_leaves = 1 << depth;
+        std::vector<int32_t> sizes((size_t) n_trees * n_leaves);
+        parallel_for(n_trees, [&](int n_tree) {
+            auto live = [this](const int *ids, int n) {
+                int count = 0;
+                for (int i = 0; i < n; ++i)
+                    count += !(n_stale && is_deleted(ids[i]));
+                return count;
+            };
+            for (int j = 0; j < n_leaves; ++j) {
+                int size = n_stale ? 0 : leaf_size(n_tree, j);
+                if (n_stale)
+                    visit_leaves(n_tree, j, j + 1, [&](const int *ids, int n) { size += live(ids, n); });
+                if (!inserted_leaves.empty()) {
+                    const std::vector<int> &inserted = inserted_leaves[n_tree * n_leaves + j];
+                    size += live(inserted.data(), inserted.size());
+                }
+                sizes[(size_t) n_tree * n_leaves + j] = size;
+            }
+        });
+
+        const int32_t counts[] = {n_samples, n_deleted, projection, (int32_t) build_seed};
+        uint32_t crc = mrpt_kernels::crc32c(0, counts, sizeof(counts));
+        crc = mrpt_kernels::crc32c(crc, split_data, sizeof(float) * n_array * n_trees);
+        crc = mrpt_kernels::crc32c(crc, sizes.data(), sizeof(int32_t) * sizes.size());
+        write_random_matrix([&crc](const void *data, size_t bytes) {
+            crc = mrpt_kernels::crc32c(crc, data, bytes);
+            return true;
+        });
+        return crc;
+    }
+
+    /**
+    * Returns true if tree n_tree projects the points onto the same random vectors
+    * in this index and in other.
+    */
+    bool same_random_rows(const Mrpt &other, int n_tree) const {
+        if (projection != GAUSSIAN || other.projection != GAUSSIAN)
+            return projection == other.projection && build_seed == other.build_seed;
+        const int first = n_tree * depth, last = first + depth;
+        if (density == 1)
+            return std::equal(dense_matrix.data() + (size_t) first * dim, dense_matrix.data() + (size_t) last * dim,
+                              other.dense_matrix.data() + (size_t) first * dim);
+        const int *outer = sparse_matrix.outerIndexPtr(), *other_outer = other.sparse_matrix.outerIndexPtr();
+        for (int r = first; r < last; ++r)
+            if (outer[r + 1] - outer[r] != other_outer[r + 1] - other_outer[r])
+                return false;
+        return std::equal(sparse_matrix.innerIndexPtr() + outer[first], sparse_matrix.innerIndexPtr() + outer[last],
+                          other.sparse_matrix.innerIndexPtr() + other_outer[first]) &&
+               std::equal(sparse_matrix.valuePtr() + outer[first], sparse_matrix.valuePtr() + outer[last],
+                          other.sparse_matrix.valuePtr() + other_outer[first]);
+    }
+
+    /**
+    * Moves the inserted points from inserted_leaves into leaf_first and leaf_ids,
+    * and removes the deleted points from the trees.
+    * @param with_duplicates - If true, the points left out by collapse_duplicates are
+    * put back next to the points they are copies of, see expand_duplicates
+    */
+    void compact_leaves(bool with_duplicates = false) {
+        if (!n_unmerged && !n_stale && !with_duplicates)
+            return;
+        copy_mapped_index();
+        MatrixXi first, ids;
+        merged_leaves(first, ids, with_duplicates);
+        leaf_first.swap(first);
+        leaf_ids.swap(ids);
+        inserted_leaves.clear();
+        tree_points = leaf_ids.rows();
+        n_unmerged = 0;
+        n_stale = 0;
+        use_owned_trees();
+    }
+
+    /**
+    * Puts the points left out of the trees by collapse_duplicates back into the
+    * leaves of the points they are copies of, and forgets the duplicates, before
+    * the points of the index change.
+    */
+    void expand_duplicates() {
+        if (duplicate_ids.empty())
+            return;
+        compact_leaves(true);
+        for (int id : duplicate_ids)
+            deleted_bits[id >> 6] &= ~(uint64_t(1) << (id & 63));
+        n_deleted -= duplicate_ids.size();
+        duplicate_first.clear();
+        duplicate_ids.clear();
+    }
+
+    /**
+    * Builds tree n_tree again from all the points that are not deleted with its
+    * random vectors, which moves its split points back to the medians. The trees
+    * have to be compacted. If the data is reordered, the points of each leaf are
+    * sorted by their internal ids like those of the other trees.
+    */
+    void regrow_tree(int n_tree) {
+        MatrixXf projections;
+        project_data(n_tree * depth, depth, projections);
+        int *indices = leaf_ids.col(n_tree).data();
+        for (int i = 0, j = 0; i < n_samples; ++i)
+            if (!n_deleted || !is_deleted(to_internal(i))) indices[j++] = i;
+
+        grow_tasks(1, [&](int) { grow_subtree(indices, indices + tree_points, 0, 0, n_tree, projections.data(), depth); });
+        leaf_first(1 << depth, n_tree) = tree_points;
+
+        if (data_order.size()) {
+            for (int i = 0; i < tree_points; ++i)
+                indices[i] = data_position(indices[i]);
+            for (int j = 0; j < (1 << depth); ++j)
+                std::sort(indices + leaf_first(j, n_tree), indices + leaf_first(j + 1, n_tree));
+        }
+    }
+
+    /**
+    * Points the queries to the trees in split_points, leaf_first and leaf_ids.
+    */
+    void use_owned_trees() {
+        split_data = split_points.data();
+        leaf_first_data = leaf_first.data();
+        leaf_ids_data = leaf_ids.data();
+        packed_ids = std::vector<uint32_t>();
+        packed_first = std::vector<uint64_t>();
+    }
+
+    /**
+    * Drops the trees, the data order and the updates of the index before loading
+    * an index file, which stores the original ids.
+    */
+    void clear_for_load() {
+        release_mapped_index();
+        n_ready_trees = 0;
+        blocked_ready = false;
+        packed_ids = std::vector<uint32_t>();
+        packed_first = std::vector<uint64_t>();
+        data_order.resize(0);
+        data_position.resize(0);
+        reordered_data.resize(0, 0);
+        set_search_data(X->data());
+        clear_updates();
+        leaf_centroids.resize(0, 0);
+        leaf_radii.resize(0);
+        labels = std::vector<int64_t>();
+        label_slots = std::vector<int>();
+        n_labeled = 0;
+    }
+
+    /**
+    * Returns a block of bytes from allocator, or mapped anonymously if it has no allocate.
+    */
+    static void *allocate_block(const Allocator &allocator, size_t bytes) {
+        return allocator.allocate ? allocator.allocate(bytes) : mrpt_mmap::allocate_pages(bytes);
+    }
+
+    /**
+    * Frees a block of allocate_block, if block is not null.
+    */
+    static void free_block(const Allocator &allocator, void *block, size_t bytes) {
+        if (!block)
+            return;
+        if (!allocator.allocate)
+            mrpt_mmap::free_pages(block, bytes);
+        else if (allocator.deallocate)
+            allocator.deallocate(block, bytes);
+    }
+
+    /**
+    * Unmaps the index file mapped by load, if any, frees the block of compact,
+    * or stops using the buffer of load_from_memory.
+    */
+    void release_mapped_index() {
+        if (index_allocated) {
+            free_block(index_allocator, mapped_index, mapped_index_bytes);
+            index_allocator = Allocator();
+            index_allocated = false;
+        } else if (mapped_index_bytes) {
+            mrpt_mmap::unmap_file(mapped_index, mapped_index_bytes);
+        }
+        free_block(far_allocator, far_leaves_block, far_leaves_bytes);
+        far_allocator = Allocator();
+        far_leaves_block = nullptr;
+        far_leaves_bytes = 0;
+        mapped_index = nullptr;
+        mapped_index_bytes = 0;
+        if (random_matrix_mapped) {
+            random_matrix_mapped = false;
+            use_owned_random_matrix();
+        }
+    }
+
+    /**
+    * The header of an index file. The sections are at the given offsets from the
+    * start of the file, all multiples of 64. Files of version 6 and later end with
+    * the IndexFileChecksums of the sections.
+    */
+    struct IndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t n_samples;
+        int32_t dim;
+        int32_t n_trees;
+        int32_t depth;
+        float density;
+        uint32_t seed;
+        int32_t projection;
+        uint64_t split_points_offset;
+        uint64_t leaf_first_offset;
+        uint64_t leaf_ids_offset;
+        uint64_t random_matrix_offset;
+        uint64_t file_size;
+        int32_t n_tree_points; // since version 4, the points in each tree; the others are deleted
+        int32_t metric; // since version 5, the metric of the index; 0 (EUCLIDEAN) in earlier versions
+        uint64_t deleted_offset; // since version 4, the deleted points as a bitmap, 0 if there are none
+        float max_norm; // since version 5, the largest norm of the data of INNER_PRODUCT trees
+        uint32_t header_checksum; // since version 6, the CRC-32C of the header with this field zero
+        uint64_t checksums_offset; // since version 6, the offset of the IndexFileChecksums
+        uint64_t leaf_bounds_offset; // since version 7, the leaf bounds of set_leaf_bounds, 0 if there are none
+        int32_t first_tree; // since version 8, the number of the first tree in its forest, see grow_part
+        uint64_t labels_offset; // since version 9, the labels of set_labels, 0 if there are none
+    };
+
+    /**
+    * The CRC-32C checksums of the sections of an index file, without the padding
+    * between them.
+    */
+    struct IndexFileChecksums {
+        uint32_t split_points;
+        uint32_t leaf_first;
+        uint32_t leaf_ids;
+        uint32_t random_matrix;
+        uint32_t deleted; // 0 if there are no deleted points
+        uint32_t leaf_bounds; // since version 7, 0 if there are no leaf bounds
+        uint32_t labels; // since version 9, 0 if there are no labels
+    };
+
+    /**
+    * The header of a delta file of save_delta. It is followed by the sections
+    * of the delta, one after another: the new points as dim floats each, the
+    * leaf of each new point in each tree that was not grown again as int32, one
+    * tree after another, the ids of the points deleted since the base, the
+    * numbers of the trees grown again, and for each of them its split points,
+    * its leaf offsets and its points as in an index file, then the random
+    * matrix of write_random_matrix if it changed. The file ends with the
+    * CRC-32C of everything before it.
+    */
+    struct DeltaFileHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t dim;
+        int32_t n_trees;
+        int32_t depth;
+        float density;
+        int32_t metric;
+        int32_t base_n_samples; // the points of the index the delta applies to
+        uint32_t base_fingerprint; // the delta_fingerprint of that index
+        int32_t n_samples; // the points of the index after the delta
+        int32_t n_tombstones; // the points deleted since the base
+        int32_t n_regrown; // the trees grown again since the base
+        int32_t projection; // the projection, seed and largest data norm after the delta
+        uint32_t seed;
+        float max_norm;
+        uint64_t random_matrix_bytes; // 0 if the random matrix did not change
+        uint64_t file_size;
+    };
+
+    static const char *delta_file_magic() {
+        return "MRPTDLTA";
+    }
+
+    static const char *index_file_magic() {
+        return "MRPTINDX";
+    }
+
+    static uint32_t index_file_version() {
+        return 9;
+    }
+
+    static uint32_t header_checksum(const IndexFileHeader &header) {
+        // copied byte by byte, so the padding of the struct is checksummed as written; the headers
+        // of version 6 end before leaf_bounds_offset, of version 7 before first_tree and of version 8
+        // before labels_offset
+        IndexFileHeader copy;
+        memcpy(&copy, &header, sizeof(header));
+        copy.header_checksum = 0;
+        const size_t bytes = header.version >= 9 ? sizeof(copy) :
+                             header.version == 8 ? offsetof(IndexFileHeader, labels_offset) :
+                             header.version == 7 ? offsetof(IndexFileHeader, first_tree) :
+                                                   offsetof(IndexFileHeader, leaf_bounds_offset);
+        return mrpt_kernels::crc32c(0, &copy, bytes);
+    }
+
+    /**
+    * Returns the bytes of the checksums of an index file, which files of version
+    * 6 end before leaf_bounds and files of versions 7 and 8 before labels.
+    */
+    static size_t checksums_bytes(const IndexFileHeader &header) {
+        return header.version >= 9 ? sizeof(IndexFileChecksums) :
+               header.version >= 7 ? offsetof(IndexFileChecksums, labels) :
+                                     offsetof(IndexFileChecksums, leaf_bounds);
+    }
+
+    static uint64_t align_section(uint64_t offset) {
+        return (offset + 63) / 64 * 64;
+    }
+
+    static uint64_t file_size(FILE *fd) {
+#ifdef _WIN32
+        return _fseeki64(fd, 0, SEEK_END) == 0 ? _ftelli64(fd) : 0;
+#else
+        return fseeko(fd, 0, SEEK_END) == 0 ? ftello(fd) : 0;
+#endif
+    }
+
+    static bool seek(FILE *fd, uint64_t offset) {
+#ifdef _WIN32
+        return _fseeki64(fd, offset, SEEK_SET) == 0;
+#else
+        return fseeko(fd, offset, SEEK_SET) == 0;
+#endif
+    }
+
+    /**
+    * Returns true if an index file with the header can be loaded into this index.
+    */
+    bool valid_header(const IndexFileHeader &header) const {
+        return header.version >= 2 && header.version <= index_file_version() && header.n_samples == n_samples &&
+               header.dim == dim && header.n_trees == n_trees && header.depth == depth &&
+               header.density == density && header.projection == projection &&
+               (header.version >= 5 ? header.metric : EUCLIDEAN) == metric;
+    }
+
+    /**
+    * Fills info with the parameters in the header of an index file.
+    * @return False if the header is not of an index file of a known version.
+    */
+    static bool file_info(const IndexFileHeader &header, IndexFileInfo &info) {
+        if (memcmp(header.magic, index_file_magic(), sizeof(header.magic)) || header.version < 2 ||
+            header.version > index_file_version())
+            return false;
+        info.n_samples = header.n_samples;
+        info.dim = header.dim;
+        info.n_trees = header.n_trees;
+        info.depth = header.depth;
+        info.density = header.density;
+        info.seed = header.seed;
+        info.projection = static_cast<Projection>(header.projection);
+        info.metric = static_cast<Metric>(header.version >= 5 ? header.metric : EUCLIDEAN);
+        info.first_tree = header.version >= 8 ? header.first_tree : 0;
+        return true;
+    }
+
+    /**
+    * Returns true if an index file with the header can be loaded into this index,
+    * and takes the seed of the random matrix and the largest data norm from it.
+    */
+    bool read_header(const IndexFileHeader &header) {
+        if (header.version >= 6 && header.version <= index_file_version() &&
+            header.header_checksum != header_checksum(header))
+            return load_failed("the header of the index file is corrupted");
+        if (!valid_header(header))
+            return load_failed("the index file was saved with other parameters or by a newer version");
+        build_seed = header.seed;
+        max_norm = header.version >= 5 ? header.max_norm : 0;
+        first_tree = header.version >= 8 ? header.first_tree : 0;
+        forest_trees = first_tree + n_trees;
+        return true;
+    }
+
+    /**
+    * Reads the deleted points of a file of version 4 or later, and sets the
+    * number of points in the trees to the number of the other points. Every
+    * point that is not deleted is in the trees of a file.
+    */
+    bool read_deleted(FILE *fd, const IndexFileHeader &header) {
+        if (header.version < 4 || !header.deleted_offset)
+            return header.version < 4 || header.n_tree_points == n_samples;
+
+        deleted_bits.resize((n_samples + 63) / 64);
+        if (!seek(fd, header.deleted_offset) ||
+            fread(deleted_bits.data(), sizeof(uint64_t), deleted_bits.size(), fd) != deleted_bits.size())
+            return false;
+        return count_deleted(header);
+    }
+
+    /**
+    * Reads the deleted points like read_deleted from an index file in memory.
+    */
+    bool copy_deleted(const char *base, const IndexFileHeader &header) {
+        if (header.version < 4 || !header.deleted_offset)
+            return header.version < 4 || header.n_tree_points == n_samples;
+
+        deleted_bits.resize((n_samples + 63) / 64);
+        const uint64_t bytes = sizeof(uint64_t) * deleted_bits.size();
+        if (header.deleted_offset > header.file_size || header.file_size - header.deleted_offset < bytes)
+            return false;
+        memcpy(deleted_bits.data(), base + header.deleted_offset, bytes);
+        return count_deleted(header);
+    }
+
+    /**
+    * Counts the points in deleted_bits, and sets the number of points in the trees
+    * to the number of the other points.
+    */
+    bool count_deleted(const IndexFileHeader &header) {
+        for (uint64_t word : deleted_bits)
+            n_deleted += std::bitset<64>(word).count();
+        tree_points = header.n_tree_points;
+        return n_deleted == n_samples - tree_points;
+    }
+
+    /**
+    * Returns the length of the leaf bounds section of an index file: the
+    * centroids and the radii of the leaves of all trees, and the squared norms
+    * of the data in the original order.
+    */
+    uint64_t leaf_bounds_bytes() const {
+        return sizeof(float) * ((uint64_t) (dim + 1) * (n_trees << depth) + n_samples);
+    }
+
+    /**
+    * Writes the leaf bounds section of an index file with write.
+    */
+    bool write_leaf_bounds(const IndexWriter &write) const {
+        const VectorXf &norms = data_norms();
+        VectorXf original_order;
+        if (data_order.size()) {
+            original_order.resize(n_samples);
+            for (int i = 0; i < n_samples; ++i)
+                original_order(data_order(i)) = norms(i);
+        }
+        const VectorXf &saved = data_order.size() ? original_order : norms;
+        return write(leaf_centroids.data(), sizeof(float) * leaf_centroids.size()) &&
+               write(leaf_radii.data(), sizeof(float) * leaf_radii.size()) &&
+               write(saved.data(), sizeof(float) * saved.size());
+    }
+
+    uint32_t leaf_bounds_checksum() const {
+        uint32_t crc = 0;
+        write_leaf_bounds([&crc](const void *data, size_t bytes) {
+            crc = mrpt_kernels::crc32c(crc, data, bytes);
+            return true;
+        });
+        return crc;
+    }
+
+    /**
+    * Reads the leaf bounds of an index file of version 7 or later, if it has any,
+    * together with the data norms stored with them.
+    */
+    bool read_leaf_bounds(FILE *fd, const IndexFileHeader &header) {
+        if (header.version < 7 || !header.leaf_bounds_offset)
+            return true;
+        leaf_centroids.resize(dim, n_trees << depth);
+        leaf_radii.resize(n_trees << depth);
+        VectorXf norms(n_samples);
+        const bool ok = seek(fd, header.leaf_bounds_offset) &&
+            fread(leaf_centroids.data(), sizeof(float), leaf_centroids.size(), fd) == (size_t) leaf_centroids.size() &&
+            fread(leaf_radii.data(), sizeof(float), leaf_radii.size(), fd) == (size_t) leaf_radii.size() &&
+            fread(norms.data(), sizeof(float), n_samples, fd) == (size_t) n_samples;
+        if (ok) {
+            use_data_norms(norms);
+        } else {
+            leaf_centroids.resize(0, 0);
+            leaf_radii.resize(0);
+        }
+        return ok;
+    }
+
+    /**
+    * Reads the leaf bounds like read_leaf_bounds from an index file in memory,
+    * whose sections fit in it.
+    */
+    void copy_leaf_bounds(const char *base, const IndexFileHeader &header) {
+        if (header.version < 7 || !header.leaf_bounds_offset)
+            return;
+        const float *section = reinterpret_cast<const float *>(base + header.leaf_bounds_offset);
+        const int n_bounds = n_trees << depth;
+        leaf_centroids = Map<const MatrixXf>(section, dim, n_bounds);
+        leaf_radii = Map<const VectorXf>(section + (size_t) dim * n_bounds, n_bounds);
+        VectorXf norms = Map<const VectorXf>(section + (size_t) (dim + 1) * n_bounds, n_samples);
+        use_data_norms(norms);
+    }
+
+    /**
+    * Reads the labels of an index file of version 9 or later, if it has any.
+    * @return false if they cannot be read or two points have the same label
+    */
+    bool read_labels(FILE *fd, const IndexFileHeader &header) {
+        if (header.version < 9 || !header.labels_offset)
+            return true;
+        labels.resize(n_samples);
+        if (seek(fd, header.labels_offset) && fread(labels.data(), sizeof(int64_t), n_samples, fd) == (size_t) n_samples &&
+            index_labels())
+            return true;
+        labels = std::vector<int64_t>();
+        index_labels();
+        return false;
+    }
+
+    /**
+    * Reads the labels like read_labels from an index file in memory, whose
+    * sections fit in it.
+    */
+    bool copy_labels(const char *base, const IndexFileHeader &header) {
+        if (header.version < 9 || !header.labels_offset)
+            return true;
+        const int64_t *section = reinterpret_cast<const int64_t *>(base + header.labels_offset);
+        labels.assign(section, section + n_samples);
+        if (index_labels())
+            return true;
+        labels = std::vector<int64_t>();
+        index_labels();
+        return false;
+    }
+
+    /**
+    * Makes norms the squared norms of the data returned by data_norms, unless
+    * they are computed already.
+    */
+    void use_data_norms(VectorXf &norms) {
+        std::call_once(data_norms_computed, [this, &norms] { data_squared_norms.swap(norms); });
+    }
+
+    /**
+    * Checks the header of an index file and that the file is as long as the header
+    * says, and reads the deleted points.
+    */
+    bool check_file(FILE *fd, const IndexFileHeader &header) {
+        if (!read_header(header))
+            return false;
+        if (file_size(fd) < header.file_size)
+            return load_failed("the index file is truncated");
+        if (!read_deleted(fd, header) || !sections_fit(header) || !read_leaf_bounds(fd, header) ||
+            !read_labels(fd, header))
+            return load_failed("the sections of the index file are invalid");
+        return true;
+    }
+
+    /**
+    * Reads the checksums of an index file of version 6 or later, and sets them to
+    * zero for older files.
+    */
+    static bool read_checksums(FILE *fd, const IndexFileHeader &header, IndexFileChecksums &checksums) {
+        memset(&checksums, 0, sizeof(checksums));
+        return header.version < 6 ||
+               (seek(fd, header.checksums_offset) && fread(&checksums, checksums_bytes(header), 1, fd) == 1);
+    }
+
+    /**
+    * Returns true if the checksums of an index file of version 6 or later match the
+    * trees, the random matrix and the deleted points loaded from it, or if they are
+    * not checked.
+    */
+    bool checksums_match(const IndexFileHeader &header, const IndexFileChecksums &checksums) {
+        if (header.version < 6 || !verify_checksums)
+            return true;
+
+        const int n_leaves = 1 << depth;
+        uint32_t random_matrix = 0;
+        write_random_matrix([&random_matrix](const void *data, size_t bytes) {
+            random_matrix = mrpt_kernels::crc32c(random_matrix, data, bytes);
+            return true;
+        });
+        const bool ok =
+            mrpt_kernels::crc32c(0, split_data, sizeof(float) * n_array * n_trees) == checksums.split_points &&
+            mrpt_kernels::crc32c(0, leaf_first_data, sizeof(int) * (n_leaves + 1) * n_trees) == checksums.leaf_first &&
+            mrpt_kernels::crc32c(0, leaf_ids_data, sizeof(int) * tree_points * n_trees) == checksums.leaf_ids &&
+            random_matrix == checksums.random_matrix &&
+            (!header.deleted_offset ||
+             mrpt_kernels::crc32c(0, deleted_bits.data(), sizeof(uint64_t) * deleted_bits.size()) == checksums.deleted) &&
+            (header.version < 7 || !header.leaf_bounds_offset || leaf_bounds_checksum() == checksums.leaf_bounds) &&
+            (header.version < 9 || !header.labels_offset ||
+             mrpt_kernels::crc32c(0, labels.data(), sizeof(int64_t) * labels.size()) == checksums.labels);
+        return ok || load_failed("a checksum of the index file does not match, the file is corrupted");
+    }
+
+    /**
+    * Records why a load failed, unless the reason is already known, and returns false.
+    */
+    bool load_failed(const char *reason) {
+        if (!load_failure)
+            load_failure = reason;
+        return false;
+    }
+
+    /**
+    * Returns true if the leaf offsets of a tree are valid: the leaves are one after
+    * another and together hold every point.
+    */
+    bool valid_leaf_offsets(const int *first) const {
+        const int n_leaves = 1 << depth;
+        bool ok = first[0] == 0 && first[n_leaves] == tree_points;
+        for (int j = 0; j < n_leaves && ok; ++j)
+            ok = first[j] <= first[j + 1];
+        return ok;
+    }
+
+    /**
+    * Requests transparent huge pages for the whole 2 MB pages of the bytes at p,
+    * if huge pages are enabled with set_huge_pages. Failures are ignored, and the
+    * memory then stays on normal pages.
+    */
+    void advise_huge_pages(const void *p, size_t bytes) const {
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+        const uintptr_t huge_page = 2 << 20;
+        const uintptr_t begin = (reinterpret_cast<uintptr_t>(p) + huge_page - 1) & ~(huge_page - 1);
+        const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + bytes) & ~(huge_page - 1);
+        if (huge_pages && end > begin)
+            madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#endif
+    }
+
+    /**
+    * Allocates the tree arrays of the index and points the queries to them.
+    */
+    void allocate_trees() {
+        split_points = MatrixXf(n_array, n_trees);
+        leaf_first = MatrixXi((1 << depth) + 1, n_trees);
+        leaf_ids = MatrixXi(tree_points, n_trees);
+        advise_huge_pages(leaf_ids.data(), sizeof(int) * leaf_ids.size());
+        use_owned_trees();
+        tree_ready.assign(n_trees, 0);
+    }
+
+    /**
+    * Reads the sections of an index file after its header.
+    * @param path - Filepath to the index file
+    * @param fd - The file, positioned after the header
+    * @param header - The header of the file
+    * @param map_file - See load
+    * @return True if the file matches the index and loading succeeded, false otherwise.
+    */
+    bool load_sections(const char *path, FILE *fd, const IndexFileHeader &header, bool map_file) {
+        IndexFileChecksums checksums;
+        if (!check_file(fd, header) || !read_checksums(fd, header, checksums))
+            return false;
+
+        // version 2 stored a sparse random matrix as triplets
+        if (!map_file) {
+            if (!seek(fd, header.random_matrix_offset) || !read_random_matrix(fd, header.version >= 3))
+                return false;
+            allocate_trees();
+            return load_trees(path, header) && checksums_match(header, checksums);
+        }
+
+        const bool ok = map_index_file(fd, header, true) && checksums_match(header, checksums);
+        if (!ok)
+            release_mapped_index();
+        return ok;
+    }
+
+    /**
+    * Maps an index file into memory and points the trees and the random matrix
+    * to it, regenerating a random matrix that is not Gaussian. The caller
+    * releases the mapping if this fails.
+    * @param fd - The file, whose header is checked
+    * @param header - The header of the file
+    * @param check_trees - Whether the leaf offsets of the trees are checked,
+    * which reads them; see check_mapped_trees
+    * @return True if the file was mapped and its sections are valid.
+    */
+    bool map_index_file(FILE *fd, const IndexFileHeader &header, bool check_trees) {
+        void *p = mrpt_mmap::map_file(fd, header.file_size);
+        if (!p)
+            return false;
+        mapped_index = p;
+        mapped_index_bytes = header.file_size;
+        advise_huge_pages(p, header.file_size);
+
+        // a Gaussian matrix is used from the mapping too, the others are regenerated
+        bool ok = map_sections(static_cast<const char *>(mapped_index), header, check_trees);
+        if (ok && !random_matrix_mapped)
+            ok = seek(fd, header.random_matrix_offset) && read_random_matrix(fd, header.version >= 3);
+        return ok;
+    }
+
+    /**
+    * Checks the leaf offsets of the trees first, ..., last - 1 of an index file
+    * mapped without checking them, one tree at a time, and makes each tree
+    * available to the queries once it and the trees before it are checked.
+    * @return False at the first tree whose offsets are invalid.
+    */
+    bool check_mapped_trees(int first, int last) {
+        const int n_leaves = 1 << depth;
+        for (int n_tree = first; n_tree < last; ++n_tree) {
+            if (!valid_leaf_offsets(leaf_first_data + (size_t) n_tree * (n_leaves + 1)))
+                return load_failed("the sections of the index file are invalid");
+            mark_tree_loaded(n_tree);
+        }
+        return true;
+    }
+
+    /**
+    * Returns true if the sections of an index file with the header end within the
+    * file, once read_deleted has set the number of points in the trees.
+    */
+    bool sections_fit(const IndexFileHeader &header) const {
+        const int n_leaves = 1 << depth;
+        const uint64_t deleted_bytes = sizeof(uint64_t) * ((n_samples + 63) / 64);
+        return header.split_points_offset + sizeof(float) * n_array * n_trees <= header.file_size &&
+               header.leaf_first_offset + sizeof(int) * (n_leaves + 1) * n_trees <= header.file_size &&
+               header.leaf_ids_offset + sizeof(int) * (uint64_t) tree_points * n_trees <= header.file_size &&
+               header.random_matrix_offset <= header.file_size &&
+               (header.version < 4 || !header.deleted_offset ||
+                header.deleted_offset + deleted_bytes <= header.file_size) &&
+               (header.version < 7 || !header.leaf_bounds_offset ||
+                header.leaf_bounds_offset + leaf_bounds_bytes() <= header.file_size) &&
+               (header.version < 9 || !header.labels_offset ||
+                header.labels_offset + sizeof(int64_t) * (uint64_t) n_samples <= header.file_size) &&
+               (header.version < 6 || header.checksums_offset + checksums_bytes(header) <= header.file_size);
+    }
+
+    /**
+    * Takes the deleted points, the leaf bounds, the labels and the checksums of
+    * an index file in memory, and points the trees and the random matrix to its
+    * sections, regenerating a random matrix that is not Gaussian. The caller
+    * sets mapped_index to the file, and releases it if this fails.
+    * @param base - The start of the file, aligned to 4 bytes
+    * @param header - The header of the file, checked by read_header, that fits in it
+    * @param checksums - Set to the checksums of the file
+    * @param check_trees - Whether the leaf offsets of the trees are checked
+    * @return True if the sections are valid, false otherwise.
+    */
+    bool use_file_sections(const char *base, const IndexFileHeader &header, IndexFileChecksums &checksums,
+                           bool check_trees = true) {
+        if (!copy_deleted(base, header) || !sections_fit(header))
+            return load_failed("the sections of the index file are invalid");
+        copy_leaf_bounds(base, header);
+        if (!copy_labels(base, header))
+            return load_failed("the labels of the index file are repeated");
+
+        memset(&checksums, 0, sizeof(checksums));
+        if (header.version >= 6)
+            memcpy(&checksums, base + header.checksums_offset, checksums_bytes(header));
+
+        if (!map_sections(base, header, check_trees))
+            return false;
+        if (random_matrix_mapped)
+            return true;
+        // only Gaussian random matrices are stored, the others are regenerated from the seed
+        if (projection == GAUSSIAN || header.file_size - header.random_matrix_offset < sizeof(unsigned))
+            return false;
+        memcpy(&build_seed, base + header.random_matrix_offset, sizeof(unsigned));
+        density < 1 ? build_sparse_random_matrix() : build_dense_random_matrix();
+        use_owned_random_matrix();
+        return true;
+    }
+
+    /**
+    * Decompresses a compressed index file of save_compressed, its blocks in
+    * parallel, into a block of pages, and loads the index from the block in
+    * place, keeping the block as that of compact.
+    * @return True if loading succeeded, false otherwise, and then load_error tells why.
+    */
+    bool load_compressed(const char *data, size_t bytes) {
+        wait_load();
+        ++n_changes;
+        const int64_t start = metrics_clock();
+        load_failure = nullptr;
+        if (!mrpt_compress::available())
+            return record_load(start, load_failed("the index file is compressed, and zstd support is not compiled in"));
+
+        mrpt_compress::CompressedFileHeader header;
+        memcpy(&header, data, sizeof(header));
+        const uint64_t table = sizeof(header) + sizeof(uint64_t) * header.n_blocks;
+        bool ok = header.version >= 1 && header.version <= mrpt_compress::compressed_file_version() &&
+                  header.block_size > 0 && header.raw_size > 0 && header.n_blocks < bytes &&
+                  header.n_blocks == (header.raw_size + header.block_size - 1) / header.block_size && table <= bytes;
+        // the blocks follow the table of their sizes
+        std::vector<uint64_t> offsets(ok ? header.n_blocks + 1 : 0, table);
+        for (uint64_t b = 0; b < header.n_blocks && ok; ++b) {
+            uint64_t size;
+            memcpy(&size, data + sizeof(header) + sizeof(uint64_t) * b, sizeof(size));
+            offsets[b + 1] = offsets[b] + size;
+            ok = size <= bytes && offsets[b + 1] <= bytes;
+        }
+        if (!ok)
+            return record_load(start, load_failed("the compressed index file is truncated or invalid"));
+
+        char *block = static_cast<char *>(mrpt_mmap::allocate_pages(header.raw_size));
+        if (!block)
+            return record_load(start, load_failed("cannot allocate memory for the decompressed index"));
+        std::atomic<bool> decompressed(true);
+        parallel_for((int) header.n_blocks, [&](int b) {
+            const uint64_t first = b * header.block_size;
+            const size_t raw_bytes = std::min<uint64_t>(header.block_size, header.raw_size - first);
+            if (!mrpt_compress::decompress_block(data + offsets[b], offsets[b + 1] - offsets[b], block + first, raw_bytes))
+                decompressed = false;
+        });
+        if (!decompressed) {
+            mrpt_mmap::free_pages(block, header.raw_size);
+            return record_load(start, load_failed("the compressed index file is corrupted"));
+        }
+        if (!load_from_memory(block, header.raw_size, true)) {
+            mrpt_mmap::free_pages(block, header.raw_size);
+            return false;
+        }
+        index_allocator = Allocator();
+        index_allocated = true;
+        mapped_index_bytes = header.raw_size;
+        return true;
+    }
+
+    /**
+    * Points the trees, and a Gaussian random matrix of version 3 or later, to the
+    * sections of an index file in memory. The other random matrices are left to
+    * the caller.
+    * @param base - The start of the file, aligned to 4 bytes
+    * @param header - The header of the file, whose sections fit in it
+    * @param check_trees - Whether the leaf offsets of the trees are checked
+    * @return True if the sections are valid, false otherwise.
+    */
+    bool map_sections(const char *base, const IndexFileHeader &header, bool check_trees = true) {
+        const int n_leaves = 1 << depth;
+        split_data = reinterpret_cast<const float *>(base + header.split_points_offset);
+        leaf_first_data = reinterpret_cast<const int *>(base + header.leaf_first_offset);
+        leaf_ids_data = reinterpret_cast<const int *>(base + header.leaf_ids_offset);
+
+        bool ok = true;
+        for (int n_tree = 0; n_tree < n_trees && ok && check_trees; ++n_tree)
+            ok = valid_leaf_offsets(leaf_first_data + n_tree * (n_leaves + 1));
+        if (!ok || projection != GAUSSIAN || header.version < 3)
+            return ok;
+
+        random_matrix_mapped =
+            map_random_matrix(base + header.random_matrix_offset, header.file_size - header.random_matrix_offset);
+        return random_matrix_mapped;
+    }
+
+    /**
+    * Reads the trees of an index file into the arrays allocated by allocate_trees.
+    * The trees are read in parallel, each with a file handle of its own, and the
+    * queries start using them as soon as they and all trees before them are read.
+    * @param path - Filepath to the index file
+    * @param header - The header of the file
+    * @return True if reading succeeded, false otherwise.
+    */
+    bool load_trees(const char *path, const IndexFileHeader &header) {
+        const int n_leaves = 1 << depth;
+        std::atomic<bool> ok(true);
+
+        parallel_for(n_trees, [&](int n_tree) {
+            if (!ok)
+                return;
+            FILE *fd = fopen(path, "rb");
+            const bool tree_ok = fd &&
+                seek(fd, header.split_points_offset + sizeof(float) * n_tree * n_array) &&
+                fread(split_points.col(n_tree).data(), sizeof(float), n_array, fd) == (size_t) n_array &&
+                seek(fd, header.leaf_first_offset + sizeof(int) * n_tree * (n_leaves + 1)) &&
+                fread(leaf_first.col(n_tree).data(), sizeof(int), n_leaves + 1, fd) == (size_t) n_leaves + 1 &&
+                seek(fd, header.leaf_ids_offset + sizeof(int) * n_tree * (size_t) tree_points) &&
+                fread(leaf_ids.col(n_tree).data(), sizeof(int), tree_points, fd) == (size_t) tree_points &&
+                valid_leaf_offsets(leaf_first.col(n_tree).data());
+            if (fd)
+                fclose(fd);
+
+            if (tree_ok)
+                mark_tree_loaded(n_tree);
+            else
+                ok = false;
+        });
+        return ok;
+    }
+
+    /**
+    * Reads the bytes [first, last) of an index file with read into the same
+    * bytes of block, in ranges of range_bytes of which n_streams are read at once.
+    * @return True if all the ranges were read.
+    */
+    bool read_ranges(const RangeReader &read, char *block, uint64_t first, uint64_t last, int n_streams,
+                     uint64_t range_bytes) const {
+        range_bytes = std::max<uint64_t>(1, range_bytes);
+        const int n_ranges = last > first ? (last - first + range_bytes - 1) / range_bytes : 0;
+        std::atomic<bool> ok(true);
+        parallel_for(n_ranges, [&](int r) {
+            const uint64_t offset = first + r * range_bytes;
+            if (ok && !read(offset, block + offset, std::min(range_bytes, last - offset)))
+                ok = false;
+        }, 1, std::max(1, n_streams));
+        return ok;
+    }
+
+    /**
+    * Reads the leaves of the trees of an index file with read into the block
+    * of load_ranges, in ranges of range_bytes of which n_streams are read at
+    * once, in the order of the trees. A tree is checked and made available to
+    * the queries once all of its ranges are read, and the trees before it.
+    * @param tree_bytes - The bytes of the leaves of a tree
+    * @return True if reading succeeded, false otherwise.
+    */
+    bool read_trees(const RangeReader &read, const IndexFileHeader &header, uint64_t tree_bytes, int n_streams,
+                    uint64_t range_bytes) {
+        const int n_leaves = 1 << depth;
+        range_bytes = std::max<uint64_t>(1, range_bytes);
+        const int tree_ranges = std::max<uint64_t>(1, (tree_bytes + range_bytes - 1) / range_bytes);
+        char *block = static_cast<char *>(mapped_index);
+        std::vector<std::atomic<int>> unread(n_trees);
+        for (std::atomic<int> &ranges : unread)
+            ranges = tree_ranges;
+        std::atomic<bool> read_ok(true), valid(true);
+
+        parallel_for(n_trees * tree_ranges, [&](int r) {
+            const int n_tree = r / tree_ranges;
+            const uint64_t first = (uint64_t) (r % tree_ranges) * range_bytes;
+            const uint64_t offset = header.leaf_ids_offset + n_tree * tree_bytes + first;
+            if (!read_ok || !valid)
+                return;
+            if (first < tree_bytes && !read(offset, block + offset, std::min(range_bytes, tree_bytes - first))) {
+                read_ok = false;
+                return;
+            }
+            if (--unread[n_tree] > 0)
+                return;
+            if (valid_leaf_offsets(leaf_first_data + (size_t) n_tree * (n_leaves + 1)))
+                mark_tree_loaded(n_tree);
+            else
+                valid = false;
+        }, 1, std::max(1, n_streams));
+        return (read_ok || load_failed("cannot read the index file")) &&
+               (valid || load_failed("the sections of the index file are invalid"));
+    }
+
+    /**
+    * Marks a tree loaded, and makes it and the loaded trees after it available to
+    * the queries if all trees before it are loaded.
+    */
+    void mark_tree_loaded(int n_tree) {
+        std::lock_guard<std::mutex> lock(tree_ready_mutex);
+        tree_ready[n_tree] = 1;
+        int n_ready = n_ready_trees.load(std::memory_order_relaxed);
+        while (n_ready < n_trees && tree_ready[n_ready])
+            ++n_ready;
+        n_ready_trees.store(n_ready, std::memory_order_release);
+    }
+
+    /**
+    * Reads an index file in the format of older versions, which has no header.
+    * @param fd - The file, positioned at its start
+    * @return True if loading succeeded, false otherwise.
+    */
+    bool load_headerless(FILE *fd) {
+        split_points = MatrixXf(n_array, n_trees);
+        if (fread(split_points.data(), sizeof(float), (size_t) n_array * n_trees, fd) != (size_t) n_array * n_trees)
+            return false;
+
+        // load tree leaves, which hold every point once
+        const int n_leaves = 1 << depth;
+        leaf_ids = MatrixXi(n_samples, n_trees);
+        leaf_first = MatrixXi(n_leaves + 1, n_trees);
+        for (int i = 0; i < n_trees; ++i) {
+            int sz;
+            if (fread(&sz, sizeof(int), 1, fd) != 1 || sz != n_leaves) {
+                return false;
+            }
+            int position = 0;
+            for (int j = 0; j < sz; ++j) {
+                int leaf_size;
+                if (fread(&leaf_size, sizeof(int), 1, fd) != 1 || leaf_size < 0 || leaf_size > n_samples - position) {
+                    return false;
+                }
+                leaf_first(j, i) = position;
+                if (fread(leaf_ids.col(i).data() + position, sizeof(int), leaf_size, fd) != (size_t) leaf_size) {
+                    return false;
+                }
+                position += leaf_size;
+            }
+            leaf_first(n_leaves, i) = position;
+            if (position != n_samples || (leaf_ids.col(i).array() < 0).any() ||
+                (leaf_ids.col(i).array() >= n_samples).any())
+                return false;
+        }
+
+        use_owned_trees();
+        return read_random_matrix(fd, false);
+    }
+
+    /**
+    * Writes the random matrix, or only its seed if it can be regenerated from it. A
+    * sparse matrix is written as its compressed arrays: the number of nonzeros, the
+    * n_pool + 1 row offsets, the column indices and the values.
+    */
+    bool write_random_matrix(const IndexWriter &write) const {
+        if (projection != GAUSSIAN)
+            return write(&build_seed, sizeof(unsigned));
+        if (density < 1) {
+            int non_zeros = sparse_matrix.nonZeros();
+            return write(&non_zeros, sizeof(int)) && write(sparse_matrix.outerIndexPtr(), sizeof(int) * (n_pool + 1)) &&
+                   write(sparse_matrix.innerIndexPtr(), sizeof(int) * non_zeros) &&
+                   write(sparse_matrix.valuePtr(), sizeof(float) * non_zeros);
+        }
+        return write(dense_matrix.data(), sizeof(float) * n_pool * dim);
+    }
+
+    /**
+    * Returns the number of bytes write_random_matrix writes.
+    */
+    uint64_t random_matrix_bytes() const {
+        if (projection != GAUSSIAN)
+            return sizeof(unsigned);
+        if (density < 1)
+            return sizeof(int) * (n_pool + 2) + (sizeof(int) + sizeof(float)) * (uint64_t) sparse_matrix.nonZeros();
+        return sizeof(float) * (uint64_t) n_pool * dim;
+    }
+
+    /**
+    * Reads the random matrix written by write_random_matrix and points the
+    * projections to it.
+    * @param compressed - If false, a sparse matrix is stored in the format of older
+    * versions as (row, column, value) triplets
+    * @return True if reading succeeded, false otherwise.
+    */
+    bool read_random_matrix(FILE *fd, bool compressed) {
+        if (!read_owned_random_matrix(fd, compressed))
+            return false;
+        use_owned_random_matrix();
+        return true;
+    }
+
+    /**
+    * Reads the random matrix like read_random_matrix into a new random_matrix of
+    * the index.
+    */
+    bool read_owned_random_matrix(FILE *fd, bool compressed) {
+        if (projection != GAUSSIAN) {
+            if (fread(&build_seed, sizeof(unsigned), 1, fd) != 1)
+                return false;
+            density < 1 ? build_sparse_random_matrix() : build_dense_random_matrix();
+            return true;
+        }
+
+        random_matrix = std::make_shared<RandomMatrix>();
+        if (density == 1) {
+            random_matrix->dense = Matrix<float, Dynamic, Dynamic, RowMajor>(n_pool, dim);
+            return fread(random_matrix->dense.data(), sizeof(float), (size_t) n_pool * dim, fd) == (size_t) n_pool * dim;
+        }
+
+        int non_zeros;
+        if (fread(&non_zeros, sizeof(int), 1, fd) != 1 || non_zeros < 0 || non_zeros > (int64_t) n_pool * dim)
+            return false;
+
+        if (!compressed) {
+            struct Entry {
+                int row, col;
+                float val;
+            };
+            std::vector<Entry> entries(non_zeros);
+            if (fread(entries.data(), sizeof(Entry), non_zeros, fd) != (size_t) non_zeros)
+                return false;
+
+            std::vector<Triplet<float>> triplets;
+            triplets.reserve(non_zeros);
+            for (const Entry &e : entries) {
+                if (e.row < 0 || e.row >= n_pool || e.col < 0 || e.col >= dim)
+                    return false;
+                triplets.push_back(Triplet<float>(e.row, e.col, e.val));
+            }
+
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool, dim);
+            random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+            random_matrix->sparse.makeCompressed();
+            return true;
+        }
+
+        random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool, dim);
+        random_matrix->sparse.resizeNonZeros(non_zeros);
+        int *outer = random_matrix->sparse.outerIndexPtr(), *inner = random_matrix->sparse.innerIndexPtr();
+        if (fread(outer, sizeof(int), n_pool + 1, fd) != (size_t) n_pool + 1 ||
+            fread(inner, sizeof(int), non_zeros, fd) != (size_t) non_zeros ||
+            fread(random_matrix->sparse.valuePtr(), sizeof(float), non_zeros, fd) != (size_t) non_zeros)
+            return false;
+
+        const bool ok = valid_compressed(outer, inner, non_zeros);
+        if (!ok)
+            random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool, dim);
+        return ok;
+    }
+
+    /**
+    * Returns true if the arrays are a valid compressed n_pool x dim sparse matrix:
+    * the rows are consecutive and have increasing columns, as Eigen expects.
+    */
+    bool valid_compressed(const int *outer, const int *inner, int non_zeros) const {
+        bool ok = outer[0] == 0 && outer[n_pool] == non_zeros;
+        for (int j = 0; j < n_pool && ok; ++j) {
+            ok = outer[j] <= outer[j + 1];
+            for (int k = outer[j]; k < outer[j + 1] && ok; ++k)
+                ok = inner[k] >= 0 && inner[k] < dim && (k == outer[j] || inner[k - 1] < inner[k]);
+        }
+        return ok;
+    }
+
+    /**
+    * Points the projections to the random matrix in a mapped index file written by
+    * write_random_matrix, instead of reading it into memory.
+    * @param section - The start of the random matrix in the mapping
+    * @param bytes - The number of bytes from section to the end of the mapping
+    * @return True if the matrix is valid, false otherwise.
+    */
+    bool map_random_matrix(const char *section, uint64_t bytes) {
+        if (density == 1) {
+            if (bytes < sizeof(float) * n_pool * (size_t) dim)
+                return false;
+            new (&dense_matrix) Map<const Matrix<float, Dynamic, Dynamic, RowMajor>>(
+                reinterpret_cast<const float *>(section), n_pool, dim);
+            prepare_projection();
+            return true;
+        }
+
+        int non_zeros;
+        if (bytes < sizeof(int) * (n_pool + 2))
+            return false;
+        memcpy(&non_zeros, section, sizeof(int));
+        if (non_zeros < 0 || non_zeros > (int64_t) n_pool * dim ||
+            bytes < sizeof(int) * (n_pool + 2) + (sizeof(int) + sizeof(float)) * (uint64_t) non_zeros)
+            return false;
+
+        const int *outer = reinterpret_cast<const int *>(section) + 1;
+        const int *inner = outer + n_pool + 1;
+        const float *values = reinterpret_cast<const float *>(inner + non_zeros);
+        if (!valid_compressed(outer, inner, non_zeros))
+            return false;
+        new (&sparse_matrix) Map<const SparseMatrix<float, RowMajor>>(n_pool, dim, non_zeros, outer, inner, values);
+        prepare_projection();
+        return true;
+    }
+
+    /**
+    * Points the projections to random_matrix.
+    */
+    void use_owned_random_matrix() {
+        random_matrix_shared = false;
+        new (&dense_matrix) Map<const Matrix<float, Dynamic, Dynamic, RowMajor>>(
+            random_matrix->dense.data(), random_matrix->dense.rows(), random_matrix->dense.cols());
+        new (&sparse_matrix) Map<const SparseMatrix<float, RowMajor>>(
+            random_matrix->sparse.rows(), random_matrix->sparse.cols(), random_matrix->sparse.nonZeros(),
+            random_matrix->sparse.outerIndexPtr(), random_matrix->sparse.innerIndexPtr(),
+            random_matrix->sparse.valuePtr());
+        prepare_projection();
+    }
+
+    /**
+    * Makes the copies of the random matrix the projections read instead of it,
+    * after the matrix has changed.
+    */
+    void prepare_projection() {
+        quantize_projection();
+        index_signs();
+    }
+
+    /**
+    * Lists the columns of the +1 and the -1 components of each row of sparse
+    * RADEMACHER projections apart, so that a projection onto a row is the sum
+    * of the gathered components of the point at the first columns minus that
+    * at the others, without multiplications and without reading the values of
+    * the sparse matrix. Releases the lists for other projections.
+    */
+    void index_signs() {
+        sign_first = std::vector<int>();
+        sign_columns = std::vector<int>();
+        if (density == 1 || projection != RADEMACHER || !sparse_matrix.nonZeros())
+            return;
+        sign_first.resize(2 * sparse_matrix.rows() + 1);
+        sign_columns.resize(sparse_matrix.nonZeros());
+        const int *outer = sparse_matrix.outerIndexPtr(), *inner = sparse_matrix.innerIndexPtr();
+        const float *values = sparse_matrix.valuePtr();
+        int n = 0;
+        for (int r = 0; r < sparse_matrix.rows(); ++r) {
+            for (int sign = 0; sign < 2; ++sign) {
+                sign_first[2 * r + sign] = n;
+                for (int i = outer[r]; i < outer[r + 1]; ++i) {
+                    if ((values[i] < 0) == (sign == 1))
+                        sign_columns[n++] = inner[i];
+                }
+            }
+        }
+        sign_first[2 * sparse_matrix.rows()] = n;
+    }
+
+    /**
+    * Multiplies the n_rows rows of the sparse random matrix from first_row on by
+    * the points stored as the columns of P into projections, which has n_rows
+    * rows and a column for each point. The product is blocked for the caches:
+    * the points are taken a tile of at most 256 KB at a time, and the rows a
+    * group whose nonzeros fit in 16 KB at a time, so that both stay cached
+    * while every point of the tile is projected onto every row of the group,
+    * each by a vector gather of its components at the columns of the row. The
+    * rows of sparse RADEMACHER projections are projected onto with gathered
+    * sums of the columns of index_signs, without multiplications.
+    */
+    template<typename Projections>
+    void multiply_sparse(int first_row, int n_rows, const Ref<const MatrixXf> &P, Projections &&projections) const {
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const bool signs = !sign_first.empty();
+        const int *outer = sparse_matrix.outerIndexPtr() + first_row, *inner = sparse_matrix.innerIndexPtr();
+        const float *values = sparse_matrix.valuePtr();
+        const int *first = signs ? sign_first.data() + 2 * first_row : nullptr, *columns = sign_columns.data();
+        const int n_points = P.cols(), tile = std::max<int>(1, (256 << 10) / (sizeof(float) * dim));
+        const int group_nonzeros = (16 << 10) / (sizeof(int) + sizeof(float));
+
+        for (int j0 = 0; j0 < n_points; j0 += tile) {
+            const int j1 = std::min(n_points, j0 + tile);
+            for (int r0 = 0, r1; r0 < n_rows; r0 = r1) {
+                for (r1 = r0 + 1; r1 < n_rows && outer[r1 + 1] - outer[r0] <= group_nonzeros; ++r1) { }
+                for (int j = j0; j < j1; ++j) {
+                    const float *p = P.col(j).data();
+                    for (int r = r0; r < r1; ++r) {
+                        if (signs)
+                            projections(r, j) =
+                                kernels.gather_sum(p, columns + first[2 * r], first[2 * r + 1] - first[2 * r]) -
+                                kernels.gather_sum(p, columns + first[2 * r + 1], first[2 * r + 2] - first[2 * r + 1]);
+                        else
+                            projections(r, j) = kernels.gather_dot(p, inner + outer[r], values + outer[r],
+                                                                   outer[r + 1] - outer[r]);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+    * Makes the rounded copy of the dense random matrix set with
+    * set_projection_precision, or releases it.
+    */
+    void quantize_projection() {
+        projection_half = std::vector<uint16_t>();
+        projection_int8 = std::vector<int8_t>();
+        projection_step.resize(0);
+        if (projection_precision == FLOAT32 || density < 1 || projection == HADAMARD || !dense_matrix.size())
+            return;
+        const float *matrix = dense_matrix.data();
+        if (projection_precision == FLOAT16) {
+            projection_half.resize(dense_matrix.size());
+            for (size_t i = 0; i < projection_half.size(); ++i)
+                projection_half[i] = mrpt_kernels::float_to_half(matrix[i]);
+            return;
+        }
+        projection_int8.resize(dense_matrix.size());
+        projection_step.resize(dense_matrix.rows());
+        for (int r = 0; r < dense_matrix.rows(); ++r) {
+            projection_step(r) = int8_step(matrix + (size_t) r * dim);
+            for (int i = 0; i < dim; ++i)
+                projection_int8[(size_t) r * dim + i] = int8_code(matrix[(size_t) r * dim + i], projection_step(r));
+        }
+    }
+
+    /**
+    * Returns the step of the 8-bit codes of a row of the random matrix, which
+    * spread its largest magnitude over the codes -127, ..., 127.
+    */
+    float int8_step(const float *row) const {
+        float largest = 0;
+        for (int i = 0; i < dim; ++i)
+            largest = std::max(largest, std::fabs(row[i]));
+        return largest / 127;
+    }
+
+    static int8_t int8_code(float value, float step) {
+        return step > 0 ? static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, std::nearbyint(value / step)))) : 0;
+    }
+
+    /**
+    * Rounds the dense random matrix of the index to the values of the copy of
+    * set_projection_precision, so that the trees built with it are split by
+    * the projections the queries get.
+    */
+    void round_random_matrix() {
+        if (projection_precision == FLOAT32)
+            return;
+        float *matrix = random_matrix->dense.data();
+        for (int r = 0; r < random_matrix->dense.rows(); ++r) {
+            float *row = matrix + (size_t) r * dim;
+            const float step = projection_precision == INT8 ? int8_step(row) : 0;
+            for (int i = 0; i < dim; ++i)
+                row[i] = projection_precision == FLOAT16 ? mrpt_kernels::half_to_float(mrpt_kernels::float_to_half(row[i]))
+                                                         : step * int8_code(row[i], step);
+        }
+    }
+
+    /**
+    * Projects q onto the first n_rows rows of the rounded copy of the dense
+    * random matrix.
+    */
+    void project_rounded(const Ref<const VectorXf> &q, int n_rows, float *projected_query) const {
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        for (int r = 0; r < n_rows; ++r) {
+            projected_query[r] = projection_half.size() ?
+                kernels.dot_float16(q.data(), projection_half.data() + (size_t) r * dim, dim) :
+                projection_step(r) * kernels.dot_int8(q.data(), projection_int8.data() + (size_t) r * dim, dim);
+        }
+    }
+
+    /**
+    * Copies the trees and the random matrix of an index mapped from a file into
+    * memory and unmaps the file, and unpacks compressed leaves, so that the trees
+    * can be changed. Does nothing else if the index is not mapped.
+    */
+    void copy_mapped_index() {
+        expand_leaves();
+        if (!mapped_index)
+            return;
+        const int n_leaves = 1 << depth;
+        split_points = Map<const MatrixXf>(split_data, n_array, n_trees);
+        leaf_first = Map<const MatrixXi>(leaf_first_data, n_leaves + 1, n_trees);
+        leaf_ids = Map<const MatrixXi>(leaf_ids_data, tree_points, n_trees);
+        if (random_matrix_mapped)
+            own_random_matrix();
+        release_mapped_index();
+        use_owned_trees();
+    }
+
+    /**
+    * Unpacks the leaves compressed by compress_leaves back into leaf_ids, each
+    * leaf sorted by id.
+    */
+    void expand_leaves() {
+        if (packed_first.empty())
+            return;
+        leaf_ids = MatrixXi(tree_points, n_trees);
+        parallel_for(n_trees, [&](int n_tree) {
+            int *out = leaf_ids.col(n_tree).data();
+            visit_leaves(n_tree, 0, 1 << depth, [&](const int *ids, int n) {
+                out = std::copy(ids, ids + n, out);
+            });
+        });
+        use_owned_trees();
+    }
+
+    /**
+    * Copies the random matrix the projections use into a matrix of the index's
+    * own, if it is the matrix of a mapped file or of another index, or if other
+    * indexes use it too.
+    */
+    void own_random_matrix() {
+        if (!random_matrix_mapped && !random_matrix_shared && random_matrix.use_count() == 1)
+            return;
+        std::shared_ptr<RandomMatrix> copy = std::make_shared<RandomMatrix>();
+        if (density < 1)
+            copy->sparse = sparse_matrix;
+        else
+            copy->dense = dense_matrix;
+        random_matrix = copy;
+        random_matrix_mapped = false;
+        use_owned_random_matrix();
+    }
+
+    /**
+    * Measures the time the steps of the queries take per unit of work on the
+    * test queries Q for autotune: projecting and routing per random vector,
+    * counting votes per vote, and the linear search per candidate.
+    */
+    void measure_query_costs(const Ref<const MatrixXf> &Q, double &projection_cost, double &vote_cost,
+                             double &distance_cost) const {
+        typedef std::chrono::steady_clock clock;
+        const int n_test = Q.cols(), k = 1;
+        QueryScratch scratch;
+        VectorXi found_leaves(n_trees);
+        int64_t n_votes = 0, n_candidates = 0;
+        double projection_time = 0, vote_time = 0, distance_time = 0;
+        int out;
+
+        for (int i = 0; i < n_test; ++i) {
+            clock::time_point start = clock::now();
+            const VectorXf projected_query = project_query(Q.col(i));
+            route(projected_query.data(), found_leaves.data());
+            clock::time_point voted = clock::now();
+            projection_time += std::chrono::duration<double>(voted - start).count();
+
+            int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+            scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+            scratch.select_counters(n_samples, n_trees, false);
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                if (found_leaves(n_tree) < 0) continue;
+                n_votes += count_leaf_votes(n_tree, found_leaves(n_tree), 1, scratch, n_elected, n_touched);
+            }
+            clear_votes(scratch, n_touched);
+            start = clock::now();
+            vote_time += std::chrono::duration<double>(start - voted).count();
+
+            exact_knn(Q.col(i), k, scratch.elected.data(), n_elected, scratch, &out, nullptr);
+            distance_time += std::chrono::duration<double>(clock::now() - start).count();
+            n_candidates += n_elected;
+        }
+
+        projection_cost = projection_time / ((double) n_test * n_pool);
+        vote_cost = vote_time / std::max<int64_t>(n_votes, 1);
+        distance_cost = distance_time / std::max<int64_t>(n_candidates, 1);
+    }
+
+    /**
+    * Returns the maximum number of threads a parallel region may use.
+    */
+    /**
+    * Returns the bytes of a random matrix of n_pool rows, or of a sparse one if
+    * non_zeros is not negative.
+    */
+    static uint64_t random_matrix_size(uint64_t n_pool, int dim, int64_t non_zeros) {
+        if (non_zeros < 0)
+            return sizeof(float) * n_pool * dim;
+        return (sizeof(float) + sizeof(int)) * (uint64_t) non_zeros + sizeof(int) * (n_pool + 1);
+    }
+
+    /**
+    * Returns the bytes of the QueryScratch of a query over n_samples points
+    * with the vote counters of votes_required > 1 and the candidate buffers
+    * grown to the points of n_trees balanced leaves.
+    */
+    /**
+    * Predicts the memory of this index pruned to the configuration p, with the
+    * data stored as type and the leaves compressed if compressed, for
+    * fit_memory_budget.
+    */
+    MemoryUsage predict_storage(const Parameters &p, Quantization type, bool compressed) const {
+        MemoryUsage memory = estimate_memory(n_samples, dim, p.n_trees, p.depth, density);
+        const uint64_t components = (uint64_t) n_samples * dim;
+        memory.build_peak = 0;
+        memory.data = byte_data || type != FLOAT32 ? 0 : sizeof(float) * components;
+        if (byte_data)
+            memory.quantized_data = components;
+        else if (type == FLOAT16)
+            memory.quantized_data = sizeof(uint16_t) * components;
+        else if (type == INT8)
+            memory.quantized_data = components + 2 * sizeof(float) * dim;
+        if (compressed)
+            memory.leaves = sizeof(int) * (((uint64_t) 1 << p.depth) + 1) * p.n_trees +
+                            packed_leaves_size(n_samples, p.n_trees, p.depth);
+        memory.owned_data = sizeof(float) * (uint64_t) data_squared_norms.size();
+        memory.graph = sizeof(int64_t) * graph_indptr.capacity() + sizeof(int) * graph_neighbors.capacity();
+        return memory;
+    }
+
+    /**
+    * Returns the recall of the queries Q made with query_pruned in the
+    * configuration p, given the true k nearest neighbors of each query.
+    */
+    double pruned_recall(const Ref<const MatrixXf> &Q, int k, const Parameters &p, const int *true_knn) const {
+        std::vector<int64_t> hits(Q.cols(), 0);
+        parallel_for(Q.cols(), [&](int i) {
+            std::vector<int> found(k, -1);
+            query_pruned(Q.col(i), k, p.votes, p.n_trees, p.depth, found.data());
+            const int *neighbors = true_knn + (size_t) i * k;
+            for (int j = 0; j < k; ++j)
+                hits[i] += found[j] >= 0 && std::find(neighbors, neighbors + k, found[j]) != neighbors + k;
+        });
+        return std::accumulate(hits.begin(), hits.end(), (int64_t) 0) / ((double) Q.cols() * k);
+    }
+
+    /**
+    * Predicts the bytes of the leaves of n_trees trees of depth depth over
+    * n_samples points compressed by compress_leaves, besides leaf_first.
+    */
+    static uint64_t packed_leaves_size(int n_samples, int n_trees, int depth) {
+        // the largest of pack_block gaps of mean 2^depth between the sorted ids of a leaf is
+        // about ln(pack_block) = 4.85 times the mean
+        const uint64_t n_leaves = (uint64_t) 1 << depth, leaf_size = n_samples >> depth;
+        const uint64_t remainder = leaf_size % mrpt_kernels::pack_block;
+        int width = 0;
+        for (; width < 32 && (uint64_t) (4.85 * n_leaves) >> width; ++width) { }
+        const uint64_t words = leaf_size / mrpt_kernels::pack_block * mrpt_kernels::packed_words(mrpt_kernels::pack_block, width)
+                               + (remainder ? mrpt_kernels::packed_words(remainder, width) : 0);
+        return (sizeof(uint32_t) * words + sizeof(uint64_t)) * n_leaves * n_trees;
+    }
+
+    static uint64_t scratch_size(int n_samples, int n_trees, int depth) {
+        const int counter_bytes = n_trees < 256 ? 1 : n_trees < 65536 ? 2 : 4;
+        const uint64_t candidates = std::min<uint64_t>(n_samples, (uint64_t) n_trees * (((n_samples - 1) >> depth) + 1));
+        return sizeof(QueryScratch) + (uint64_t) counter_bytes * n_samples + 2 * sizeof(int) * candidates;
+    }
+
+    static int max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    /**
+    * Returns the number of threads the batch queries are divided between, as
+    * set by set_query_threads.
+    */
+    int query_threads() const {
+        return n_query_threads > 0 ? n_query_threads : available_threads();
+    }
+
+    /**
+    * Runs the parallel loops on the pool of set_build_priority, if there is
+    * one, while in scope, and on the executor of set_executor again after.
+    */
+    struct BuildScope {
+        explicit BuildScope(Mrpt &index_) : index(index_), saved(index_.executor) {
+            if (index.build_executor)
+                index.executor = index.build_executor;
+        }
+        ~BuildScope() { index.executor = std::move(saved); }
+
+        Mrpt &index;
+        std::shared_ptr<mrpt_executor::Executor> saved;
+    };
+
+    /**
+    * Returns the number of threads the parallel loops run on, those of the
+    * executor if there is one.
+    */
+    int available_threads() const {
+        return executor ? executor->concurrency() : max_threads();
+    }
+
+    /**
+    * Calls task(i) for each i in [0, n) in parallel, on the executor of
+    * set_executor if there is one and with OpenMP otherwise. OpenMP hands the
+    * iterations to the threads in chunks of grain, and the executor runs each
+    * chunk as one task.
+    * @param n_threads - The most threads used, 0 for all
+    */
+    template<typename Task>
+    void parallel_for(int n, const Task &task, int grain = 1, int n_threads = 0) const {
+        if (n <= 0)
+            return;
+        if (n_threads == 1 || n == 1) {
+            for (int i = 0; i < n; ++i)
+                task(i);
+            return;
+        }
+        if (executor) {
+            const int n_chunks = (n + grain - 1) / grain;
+            executor->parallel_for(n_chunks, [&](int c) {
+                const bool nested = in_parallel_for();
+                in_parallel_for() = true;
+                for (int i = c * grain; i < std::min(n, (c + 1) * grain); ++i)
+                    task(i);
+                in_parallel_for() = nested;
+            });
+            return;
+        }
+        #pragma omp parallel for schedule(dynamic, grain) num_threads(n_threads > 0 ? n_threads : max_threads())
+        for (int i = 0; i < n; ++i) {
+            // the calling thread runs tasks too, and is no longer in the loop afterwards
+            const bool nested = in_parallel_for();
+            in_parallel_for() = true;
+            task(i);
+            in_parallel_for() = nested;
+        }
+    }
+
+    /**
+    * Returns whether the calling thread runs a task of parallel_for: the flag
+    * is set on the threads of OpenMP or of the executor while they run one.
+    */
+    static bool &in_parallel_for() {
+        static thread_local bool in_task = false;
+        return in_task;
+    }
+
+    /**
+    * Returns the number of threads that score the n_elected candidates of a
+    * query, 1 to score them serially: with fewer candidates than
+    * parallel_scoring_min, with a deadline or lower bounds, whose order the
+    * search follows, or when the query itself runs in a parallel loop, of the
+    * index or of the caller.
+    */
+    int parallel_scoring_threads(int n_elected, bool ordered) const {
+        if (!parallel_scoring_min || n_elected < parallel_scoring_min || ordered || in_parallel_for())
+            return 1;
+#ifdef _OPENMP
+        if (!executor && omp_in_parallel())
+            return 1;
+#endif
+        return std::min(query_threads(), std::max(1, n_elected / 1024));
+    }
+
+    /**
+    * Calls grow(t) for each of n trees. With OpenMP each tree is a task that can
+    * divide itself further into tasks with grow_subtree; an executor runs each
+    * tree as one task.
+    */
+    template<typename Grow>
+    void grow_tasks(int n, const Grow &grow) const {
+        if (executor) {
+            parallel_for(n, grow);
+            return;
+        }
+        #pragma omp parallel
+        #pragma omp single
+        for (int t = 0; t < n; ++t) {
+            #pragma omp task
+            grow(t);
+        }
+    }
+
+    /**
+    * Returns the smallest distance between a projection of a query and the
+    * split point it is compared with on the way down tree n_tree.
+    * @param projected_query - The projections of the query onto all n_pool random vectors
+    */
+    float tree_margin(int n_tree, const float *projected_query) const {
+        const float *split = split_data + (size_t) n_tree * n_array;
+        const float *projections = projected_query + n_tree * depth;
+        float margin = std::numeric_limits<float>::infinity();
+        int idx_tree = 0;
+        for (int d = 0; d < depth; ++d) {
+            margin = std::min(margin, std::abs(projections[d] - split[idx_tree]));
+            idx_tree = 2 * idx_tree + 2 - (projections[d] <= split[idx_tree]);
+        }
+        return margin;
+    }
+
+    /**
+    * Returns the votes tree n_tree gives the points of the leaf of a query
+    * with set_margin_votes, by the share of the margins its margin falls in.
+    */
+    int margin_weight(int n_tree, const float *projected_query) const {
+        const float margin = tree_margin(n_tree, projected_query);
+        return 1 + (int) (std::upper_bound(margin_thresholds.begin(), margin_thresholds.end(), margin) -
+                          margin_thresholds.begin());
+    }
+
+    /**
+    * Returns the most votes a tree gives with set_margin_votes, 1 without.
+    */
+    int margin_levels() const {
+        return margin_thresholds.size() + 1;
+    }
+
+    /**
+    * Routes a query to exactly one leaf in each tree. While load_async is loading
+    * the index, the trees that are not loaded yet get leaf -1. With AVX2 or AVX-512
+    * the trees are descended 8 or 16 at a time by the routing kernel, otherwise
+    * one by one.
+    * @param projected_query - The projections of the query onto all n_pool random vectors
+    * @param found_leaves - Output buffer for the leaf index in each of the n_trees trees
+    */
+    void route(const float *projected_query, int *found_leaves) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.route");
+        if (blocked_ready.load(std::memory_order_acquire)) {
+            route_blocked(projected_query, found_leaves);
+            return;
+        }
+        const int n_ready = trees_loaded();
+        std::fill(found_leaves + n_ready, found_leaves + n_trees, -1);
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        if (kernels.route && n_ready >= 8) {
+            kernels.route(projected_query, split_data, n_ready, depth, n_array, found_leaves);
+            return;
+        }
+        switch (depth) {
+            case 4: return route_trees<4>(projected_query, found_leaves, n_ready);
+            case 5: return route_trees<5>(projected_query, found_leaves, n_ready);
+            case 6: return route_trees<6>(projected_query, found_leaves, n_ready);
+            case 7: return route_trees<7>(projected_query, found_leaves, n_ready);
+            case 8: return route_trees<8>(projected_query, found_leaves, n_ready);
+            case 9: return route_trees<9>(projected_query, found_leaves, n_ready);
+            case 10: return route_trees<10>(projected_query, found_leaves, n_ready);
+            case 11: return route_trees<11>(projected_query, found_leaves, n_ready);
+            case 12: return route_trees<12>(projected_query, found_leaves, n_ready);
+            case 13: return route_trees<13>(projected_query, found_leaves, n_ready);
+            case 14: return route_trees<14>(projected_query, found_leaves, n_ready);
+            case 15: return route_trees<15>(projected_query, found_leaves, n_ready);
+            case 16: return route_trees<16>(projected_query, found_leaves, n_ready);
+            default: break;
+        }
+        for (int n_tree = 0; n_tree < n_ready; ++n_tree) {
+            const float *split = split_data + (size_t) n_tree * n_array;
+            const float *projections = projected_query + n_tree * depth;
+            int idx_tree = 0;
+            for (int d = 0; d < depth; ++d)
+                idx_tree = 2 * idx_tree + 2 - (projections[d] <= split[idx_tree]);
+            found_leaves[n_tree] = idx_tree - (1 << depth) + 1;
+        }
+    }
+
+    /**
+    * Routes a query in all trees through the blocked copy of the split points of
+    * layout_splits, four trees at a time so that their cache misses overlap. The
+    * leaf is the concatenation of the child taken out of each block.
+    */
+    void route_blocked(const float *projected_query, int *found_leaves) const {
+        const int top = depth % 4 ? depth % 4 : 4, top_nodes = (1 << top) - 1;
+        for (int t0 = 0; t0 < n_trees; t0 += 4) {
+            const int n = std::min(4, n_trees - t0);
+            int leaf[4];
+            for (int j = 0; j < n; ++j) {
+                const float *block = blocked_data + (size_t) (t0 + j) * blocked_stride;
+                const float *projections = projected_query + (t0 + j) * depth;
+                int i = 0;
+                for (int d = 0; d < top; ++d)
+                    i = 2 * i + 2 - (projections[d] <= block[i]);
+                leaf[j] = i - top_nodes;
+            }
+            int64_t first = 1, count = 1 << top; // the first block of the level of blocks, and their number
+            for (int level = top; level < depth; level += 4) {
+                for (int j = 0; j < n; ++j) {
+                    const float *block = blocked_data + (size_t) (t0 + j) * blocked_stride + (first + leaf[j]) * 16;
+                    const float *projections = projected_query + (t0 + j) * depth + level;
+                    int i = 0;
+                    i = 2 * i + 2 - (projections[0] <= block[i]);
+                    i = 2 * i + 2 - (projections[1] <= block[i]);
+                    i = 2 * i + 2 - (projections[2] <= block[i]);
+                    i = 2 * i + 2 - (projections[3] <= block[i]);
+                    leaf[j] = 16 * leaf[j] + i - 15;
+                }
+                first += count;
+                count *= 16;
+            }
+            std::copy(leaf, leaf + n, found_leaves + t0);
+        }
+    }
+
+    /**
+    * Copies the split points of all trees into the blocked layout of
+    * set_blocked_splits, if it is enabled, or releases the copy. Within a block
+    * the split points of its subtree are in heap order, and the blocks of a
+    * level of blocks in the order of the leaves of the levels above them, so
+    * the block under the path p taken so far is the block p of its level.
+    */
+    void layout_splits() {
+        blocked_ready = false;
+        blocked_splits = std::vector<float>();
+        blocked_data = nullptr;
+        if (!blocked_layout || !depth || !n_trees || !split_data)
+            return;
+        const int top = depth % 4 ? depth % 4 : 4;
+        int64_t n_blocks = 1;
+        for (int64_t level = top, count = 1 << top; level < depth; level += 4, count *= 16)
+            n_blocks += count;
+        blocked_stride = n_blocks * 16;
+        blocked_splits.assign((size_t) n_trees * blocked_stride + 16, 0);
+        const size_t misalignment = reinterpret_cast<uintptr_t>(blocked_splits.data()) % 64 / sizeof(float);
+        float *blocked = blocked_splits.data() + (misalignment ? 16 - misalignment : 0);
+
+        parallel_for(n_trees, [&](int n_tree) {
+            const float *split = split_data + (size_t) n_tree * n_array;
+            float *blocks = blocked + (size_t) n_tree * blocked_stride;
+            int64_t first = 0, count = 1;
+            for (int level = 0; level < depth; level += level ? 4 : top) {
+                const int height = level ? 4 : top;
+                for (int64_t path = 0; path < count; ++path) {
+                    float *block = blocks + (first + path) * 16;
+                    // node o of level a of the block is node path * 2^a + o of level + a of the tree
+                    for (int a = 0; a < height; ++a)
+                        for (int o = 0; o < (1 << a); ++o)
+                            block[(1 << a) - 1 + o] = split[((int64_t) 1 << (level + a)) - 1 + (path << a) + o];
+                }
+                first += count;
+                count <<= height;
+            }
+        });
+        blocked_data = blocked;
+        blocked_ready.store(true, std::memory_order_release);
+    }
+
+    /**
+    * Routes a query in the first n_ready trees, whose depth is the compile time
+    * constant Depth, so that the descent is unrolled. Each level picks the child
+    * by arithmetic on the comparison instead of a branch, as the branch would be
+    * taken at random.
+    */
+    template<int Depth>
+    void route_trees(const float *projected_query, int *found_leaves, int n_ready) const {
+        for (int n_tree = 0; n_tree < n_ready; ++n_tree) {
+            const float *split = split_data + (size_t) n_tree * n_array;
+            const float *projections = projected_query + n_tree * Depth;
+            int idx_tree = 0;
+            for (int d = 0; d < Depth; ++d)
+                idx_tree = 2 * idx_tree + 2 - (projections[d] <= split[idx_tree]);
+            found_leaves[n_tree] = idx_tree - (1 << Depth) + 1;
+        }
+    }
+
+    /**
+    * Returns whether the votes of a query with the working memory scratch are
+    * counted bit-sliced. Summing the bitmaps of the trees takes the same time
+    * whatever the size of the leaves, while the counters take a random access
+    * per sample in a leaf, so the bitmaps are faster once the leaves have about
+    * one sample per word of 64 samples or more, with trees of at most 6 levels.
+    * With fewer than 3 levels, each word of a bitmap is written many times per
+    * leaf, each write waiting for the one before. The bitmaps of all trees take
+    * n_trees * n_samples bits, at most 16 MB.
+    */
+    bool use_sliced_votes(const QueryScratch &scratch) const {
+        const int levels = depth - scratch.pruned_levels;
+        const size_t bitmap_bytes = sizeof(uint64_t) * QueryScratch::sliced_words(n_samples) * n_trees;
+        return levels >= 3 && levels <= 6 && bitmap_bytes <= (16 << 20);
+    }
+
+    /**
+    * Returns whether the votes of a query with the working memory scratch are
+    * counted by merging the sorted leaves. A counter takes a cache miss per
+    * sample in a leaf once the counters of all samples do not fit in the
+    * cache, while the merge reads and writes the ids of the leaves in order,
+    * about log2(n_trees) times. The leaves are merged when the counters take
+    * more than merge_counter_bytes and the leaves hold fewer than one sample
+    * in merge_sparsity, so that most counters would be cold.
+    */
+    bool use_merged_votes(const QueryScratch &scratch) const {
+        if (!leaves_sorted())
+            return false;
+        const uint64_t counter_bytes = n_trees < 256 ? 1 : n_trees < 65536 ? 2 : 4;
+        const uint64_t candidates = (uint64_t) n_trees * ((tree_points >> (depth - scratch.pruned_levels)) + 1) +
+                                    n_unmerged;
+        return counter_bytes * n_samples > merge_counter_bytes && candidates * merge_sparsity < (uint64_t) n_samples;
+    }
+
+    /**
+    * Sets the settings of the batches from the file of calibrate_batch, a line
+    * of "key value" for each, if it was written for an index of the same dim,
+    * n_trees and depth, about as many points and as many query threads.
+    * @return False, with nothing set, if the file is missing or does not match
+    */
+    bool read_batch_tuning(const char *path) {
+        std::FILE *f = std::fopen(path, "r");
+        if (!f)
+            return false;
+        char key[64];
+        long long value;
+        std::map<std::string, long long> values;
+        while (std::fscanf(f, "%63s %lld", key, &value) == 2)
+            values[key] = value;
+        std::fclose(f);
+        auto get = [&](const char *name) {
+            const auto it = values.find(name);
+            return it == values.end() ? -1 : it->second;
+        };
+        const long long samples = get("samples");
+        if (get("version") != 1 || get("dim") != dim || get("trees") != n_trees || get("depth") != depth ||
+            get("threads") != query_threads() || samples < n_samples / 2 || samples > 2LL * n_samples ||
+            get("block_size") < 1 || get("interleave") < 1)
+            return false;
+        BatchTuning tuning;
+        tuning.block_size = get("block_size");
+        tuning.interleave = get("interleave");
+        tuning.leaf_major = get("leaf_major") > 0;
+        tuning.rerank = get("rerank") > 0;
+        set_batch_tuning(tuning);
+        return true;
+    }
+
+    /**
+    * Writes the settings of the batches and the shape of the index to the file
+    * of calibrate_batch, through a temporary file renamed over it.
+    * @return False if the file could not be written
+    */
+    bool write_batch_tuning(const char *path) const {
+        const std::string tmp = std::string(path) + ".tmp";
+        std::FILE *f = std::fopen(tmp.c_str(), "w");
+        if (!f)
+            return false;
+        const bool ok = std::fprintf(f, "version 1\ndim %d\ntrees %d\ndepth %d\nsamples %d\nthreads %d\n"
+                                        "block_size %d\ninterleave %d\nleaf_major %d\nrerank %d\n",
+                                     dim, n_trees, depth, n_samples, query_threads(), batch_block_size,
+                                     interleave_size, (int) leaf_major_votes, (int) batch_rerank) > 0;
+        if (std::fclose(f) || !ok || std::rename(tmp.c_str(), path)) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+    * Returns true if the queries can read the data of all the points, to score
+    * them by brute force.
+    */
+    bool scannable() const {
+        return byte_data || X->cols() == n_samples || reordered_data.size();
+    }
+
+    /**
+    * Answers a query by brute force for set_query_planner and query_filtered:
+    * scores the points that pass scratch.filter, gathered from its bitmap,
+    * and are not excluded, or all the points with exact_knn_batch.
+    */
+    void brute_force_query(const Ref<const VectorXf> &q, int k, int *out, float *out_distances,
+                           QueryScratch &scratch) const {
+        const int64_t start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        int n_scored = 0;
+        if (scratch.filter || scratch.excluded) {
+            const Filter *filter = scratch.filter;
+            scratch.reserve(filter ? filter->count() : n_samples);
+            for (int id = 0; id < (filter ? std::min(filter->n_bits, n_samples) : n_samples); ++id) {
+                if (filter && !filter->bits[id >> 6]) {
+                    id |= 63; // no point of this word passes
+                    continue;
+                }
+                if ((!filter || filter->test(id)) && (!n_deleted || !is_deleted(id)) &&
+                    !excluded_sample(scratch.excluded, id))
+                    scratch.elected(n_scored++) = id;
+            }
+            // the graph walk keeps to the filter too
+            exact_knn(q, k, scratch.elected.data(), n_scored, scratch, out, out_distances);
+        } else {
+            exact_knn_batch(Map<const MatrixXf>(q.data(), dim, 1), k, out, out_distances, 1);
+            n_scored = n_samples - n_deleted;
+        }
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, 0, n_scored, false);
+#ifndef MRPT_NO_QUERY_STATS
+        if (scratch.stats)
+            scratch.stats->n_brute_force++;
+#endif
+        record_query(start);
+    }
+
+    /**
+    * Counts the votes of the leaves of q found by the tree traversals, and
+    * performs the linear search among the elected candidates.
+    * @param found_leaves - The leaf index of q in each of the n_trees trees
+    * @param max_distances - If positive, the most candidates scored, those with the most votes
+    * @param deadline_ns - If nonzero, the time of mrpt_metrics::now_ns at which the linear
+    * search stops; the candidates are then scored in decreasing order of their votes
+    * @param out_votes - If given, output buffer of size k for the votes of the neighbors
+    * @param confidence - If given, its n_voted and n_elected are set
+    * @return True if the linear search was cut short by max_distances or deadline_ns
+    */
+    bool query_from_found_leaves(const Ref<const VectorXf> &q, const int *found_leaves, int k, int votes_required,
+                                 int *out, float *out_distances, QueryScratch &scratch, int max_distances = 0,
+                                 int64_t deadline_ns = 0, int *out_votes = nullptr,
+                                 QueryConfidence *confidence = nullptr) const {
+        int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+        const bool budget = max_distances > 0 || deadline_ns;
+        int64_t time = stats_clock(scratch);
+        scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+        // the trees vote by the margins of the query only where its projections are known
+        const bool weighted = margin_thresholds.size() && scratch.projected_query && !scratch.pruned_levels;
+        scratch.select_counters(n_samples, weighted ? n_trees * margin_levels() : n_trees,
+                                votes_required == 1 && !budget && !out_votes, !weighted && use_sliced_votes(scratch),
+                                !weighted && use_merged_votes(scratch));
+        MRPT_TRACE_SCOPE(vote_trace, "mrpt.vote");
+
+        // count votes, loading the offsets of the leaves two distances ahead and then their ids
+        // one distance ahead, so the misses on the leaves of the next trees overlap with the votes
+        const bool sliced = scratch.counter_bytes == -1, merged = scratch.counter_bytes == -2;
+        const int ahead = leaf_prefetch_trees;
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            if (n_tree + 2 * ahead < n_trees && found_leaves[n_tree + 2 * ahead] >= 0)
+                prefetch_leaf_offset(n_tree + 2 * ahead, found_leaves[n_tree + 2 * ahead], scratch.pruned_levels);
+            if (n_tree + ahead < n_trees && found_leaves[n_tree + ahead] >= 0)
+                prefetch_leaf(n_tree + ahead, found_leaves[n_tree + ahead], scratch.pruned_levels);
+            const int leaf = found_leaves[n_tree];
+            if (leaf < 0)
+                continue;
+            if (sliced)
+                set_leaf_bits(n_tree, leaf, scratch);
+            else if (merged)
+                gather_leaf(n_tree, leaf, scratch);
+            else
+                count_leaf_votes(n_tree, leaf, votes_required, scratch, n_elected, n_touched,
+                                 weighted ? margin_weight(n_tree, scratch.projected_query) : 1);
+        }
+        const int n_voted = sliced ? elect_sliced(votes_required, scratch, n_elected, n_touched) :
+                            merged ? elect_merged(votes_required, scratch, n_elected, n_touched) : n_touched;
+
+        const bool fallback = n_elected < k && votes_required > 1;
+        if (fallback)
+            elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+        if (budget)
+            rank_by_votes(scratch, n_elected);
+        const bool cut = max_distances > 0 && n_elected > std::max(k, max_distances);
+        if (cut)
+            n_elected = std::max(k, max_distances);
+        // the counters are read for the votes of the neighbors after the search, and the
+        // touched samples are then still needed to clear them, not as a buffer for sort_ids
+        if (!out_votes)
+            clear_votes(scratch, n_touched);
+        add_time(scratch, &QueryStats::voting_ns, time);
+        MRPT_TRACE_END(vote_trace);
+        if (sort_candidates && !deadline_ns && !out_votes)
+            sort_ids(scratch.elected.data(), n_elected, scratch.touched.data());
+
+        const bool complete = exact_knn(q, k, scratch.elected.data(), n_elected, scratch, out, out_distances,
+                                        deadline_ns);
+        if (out_votes) {
+            for (int i = 0; i < k; ++i)
+                out_votes[i] = out[i] >= 0 ? vote_count(scratch, to_internal(out[i])) : 0;
+            clear_votes(scratch, n_touched);
+        }
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_voted, n_elected, fallback, cut || !complete);
+        if (confidence) {
+            confidence->n_voted = n_voted;
+            confidence->n_elected = n_elected;
+        }
+        return cut || !complete;
+    }
+
+    /**
+    * Answers the queries of query_batch and query_batch_projected in blocks.
+    * @param projected_queries - The projections of the queries, or nullptr if
+    * each block is projected by query_block
+    */
+    void query_batch_blocks(const Ref<const MatrixXf> &Q, const float *projected_queries, int k, int votes_required,
+                            int *out, float *out_distances, int max_candidates, QueryStats *stats) const {
+        const int n_queries = Q.cols();
+        const int block_size = std::max(1, std::min(batch_block_size, n_queries / query_threads()));
+        const int n_blocks = (n_queries + block_size - 1) / block_size;
+        if (query_planner && !max_candidates && plan_query(k, votes_required) == PLAN_BRUTE_FORCE) {
+            exact_knn_batch(Q, k, out, out_distances);
+            if (stats) {
+                stats->n_queries += n_queries;
+                stats->n_brute_force += n_queries;
+                stats->n_elected += (int64_t) n_queries * (n_samples - n_deleted);
+            }
+            return;
+        }
+
+        std::mutex stats_mutex;
+        parallel_for(n_blocks, [&](int b) {
+            QueryScratch &scratch = thread_scratch();
+            QueryStats block_stats;
+            scratch.stats = stats ? &block_stats : nullptr;
+            const int first = b * block_size;
+            query_block(Q, first, std::min(block_size, n_queries - first), k, votes_required, max_candidates, out,
+                        out_distances, scratch,
+                        projected_queries ? projected_queries + (size_t) first * n_pool : nullptr);
+            scratch.stats = nullptr;
+            if (stats) {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats->add(block_stats);
+            }
+        }, 1, query_threads());
+    }
+
+    /**
+    * Answers the n queries first, ..., first + n - 1 of Q for query_batch: the
+    * block is projected with one matrix-matrix product, and each query is
+    * recorded with its share of the projection.
+    * @param projected - The projections of the block computed earlier, n_pool
+    * floats for each query, or nullptr to project the block here
+    */
+    void query_block(const Ref<const MatrixXf> &Q, int first, int n, int k, int votes_required, int max_candidates,
+                     int *out, float *out_distances, QueryScratch &scratch, const float *projected = nullptr) const {
+        const int64_t block_start = metrics_clock();
+        int64_t time = stats_clock(scratch);
+        MatrixXf block_projections;
+        if (!projected) {
+            block_projections = project_queries(Q.middleCols(first, n));
+            projected = block_projections.data();
+        }
+        const Map<const MatrixXf> projected_queries(projected, n_pool, n);
+        add_time(scratch, &QueryStats::projection_ns, time);
+
+        if (max_candidates > 0) {
+            // each query is recorded with its share of the projection of the block
+            int64_t start = metrics_clock();
+            const int64_t setup_share = (start - block_start) / n;
+            for (int i = first; i < first + n; ++i) {
+                query_from_probes(Q.col(i), projected_queries.col(i - first).data(), k, votes_required, max_candidates,
+                                  out + (size_t) i * k, out_distances ? out_distances + (size_t) i * k : nullptr, scratch);
+                start = record_query(start, setup_share);
+                monitor_recall(Q.col(i), k, out + (size_t) i * k);
+            }
+            return;
+        }
+
+        MatrixXi found_leaves(n_trees, n);
+        for (int i = 0; i < n; ++i)
+            route(projected_queries.col(i).data(), found_leaves.col(i).data());
+        add_time(scratch, &QueryStats::routing_ns, time);
+        int64_t start = metrics_clock();
+        const int64_t setup_share = (start - block_start) / n;
+        const int group_size = interleave_size > 1 || !batch_rerank ? interleave_size : (int) max_interleave;
+        if (group_size > 1) {
+            std::vector<QueryScratch> &group = thread_group_scratch();
+            group.resize(group_size);
+            for (QueryScratch &s : group)
+                s.stats = scratch.stats;
+            for (int i = first; i < first + n; i += group_size) {
+                const int m = std::min(group_size, first + n - i);
+                query_group(Q, i, m, found_leaves.col(i - first).data(), projected_queries.col(i - first).data(),
+                            k, votes_required, out, out_distances, group.data());
+                const int64_t end = metrics_clock(), share = (end - start) / m;
+                for (int j = i; j < i + m; ++j) {
+                    record_query(end, share + setup_share);
+                    monitor_recall(Q.col(j), k, out + (size_t) j * k);
+                }
+                start = end;
+            }
+            return;
+        }
+        for (int i = first; i < first + n; ++i) {
+            scratch.projected_query = projected_queries.col(i - first).data();
+            query_from_found_leaves(Q.col(i), found_leaves.col(i - first).data(), k, votes_required,
+                                    out + (size_t) i * k, out_distances ? out_distances + (size_t) i * k : nullptr, scratch);
+            scratch.projected_query = nullptr;
+            start = record_query(start, setup_share);
+            monitor_recall(Q.col(i), k, out + (size_t) i * k);
+        }
+    }
+
+    /**
+    * Answers the n queries first, ..., first + n - 1 of Q like
+    * query_from_found_leaves, counting their votes in turns with
+    * vote_interleaved, or leaf by leaf with vote_leaf_major, each query with its
+    * own working memory in scratches.
+    * @param found_leaves - The leaves of the queries, n_trees for each one after another
+    * @param projected - The projections of the queries, n_pool for each one after another
+    */
+    void query_group(const Ref<const MatrixXf> &Q, int first, int n, const int *found_leaves, const float *projected,
+                     int k, int votes_required, int *out, float *out_distances, QueryScratch *scratches) const {
+        const int max_leaf_size = n_samples / (1 << depth) + 1;
+        int64_t time = stats_clock(scratches[0]);
+        int n_elected[max_interleave], n_touched[max_interleave];
+        for (int i = 0; i < n; ++i) {
+            scratches[i].reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+            scratches[i].select_counters(n_samples, n_trees, votes_required == 1);
+        }
+        if (leaf_major_votes)
+            vote_leaf_major(found_leaves, n, votes_required, scratches, n_elected, n_touched);
+        else
+            vote_interleaved(found_leaves, n, votes_required, scratches, n_elected, n_touched);
+        add_time(scratches[0], &QueryStats::voting_ns, time);
+
+        bool fallback[max_interleave];
+        for (int i = 0; i < n; ++i) {
+            QueryScratch &scratch = scratches[i];
+            fallback[i] = n_elected[i] < k && votes_required > 1;
+            if (fallback[i])
+                elect_by_max_votes(k, votes_required, scratch, n_elected[i], n_touched[i]);
+            clear_votes(scratch, n_touched[i]);
+            if (sort_candidates)
+                sort_ids(scratch.elected.data(), n_elected[i], scratch.touched.data());
+            add_time(scratch, &QueryStats::voting_ns, time);
+        }
+
+        const bool batched = batch_rerank && rerank_group(Q, first, n, k, scratches, n_elected, out, out_distances);
+        if (batched)
+            add_time(scratches[0], &QueryStats::search_ns, time);
+        for (int i = 0; i < n; ++i) {
+            QueryScratch &scratch = scratches[i];
+            if (!batched) {
+                const size_t j = first + i;
+                scratch.projected_query = projected + (size_t) i * n_pool;
+                exact_knn(Q.col(j), k, scratch.elected.data(), n_elected[i], scratch, out + j * k,
+                          out_distances ? out_distances + j * k : nullptr);
+                scratch.projected_query = nullptr;
+                add_time(scratch, &QueryStats::search_ns, time);
+            }
+            add_counts(scratch, n_touched[i], n_elected[i], fallback[i]);
+        }
+    }
+
+    /**
+    * Scores the candidates of the n queries first, ..., first + n - 1 of Q,
+    * elected in scratches, by one matrix product instead of a linear search per
+    * query: the union of the candidates is gathered into a block of columns,
+    * multiplied by the block of the queries, and each query then ranks its own
+    * candidates by their inner products, from which the squared distances are
+    * ||x||^2 - 2 x^T q + ||q||^2, like exact_knn. Used when the candidates of
+    * the queries overlap so much that the product computes at most four times
+    * as many pairs as the candidates, and only with the data in float32
+    * without a quantized copy, leading dimensions or graph walk. The distances
+    * may differ from those of exact_knn in the last bits.
+    * @return False, with nothing written, if the candidates are not scored this way
+    */
+    bool rerank_group(const Ref<const MatrixXf> &Q, int first, int n, int k, QueryScratch *scratches,
+                      const int *n_elected, int *out, float *out_distances) const {
+        if (codes.size() || leading_dimensions.size() || graph_hops || !search_data)
+            return false;
+        // the column of each candidate in the block, -1 for the samples not in the union
+        std::vector<int> &candidates = scratches[0].union_ids, &columns = scratches[0].union_columns;
+        if (columns.size() < (size_t) n_samples)
+            columns.resize(n_samples, -1);
+        candidates.clear();
+        size_t n_pairs = 0;
+        for (int i = 0; i < n; ++i) {
+            const int *elected = scratches[i].elected.data();
+            for (int e = 0; e < n_elected[i]; ++e) {
+                if (columns[elected[e]] < 0) {
+                    columns[elected[e]] = 0;
+                    candidates.push_back(elected[e]);
+                }
+            }
+            n_pairs += n_elected[i];
+        }
+        const int n_union = candidates.size();
+        if (!n_union || (size_t) n_union * n > 4 * n_pairs) {
+            for (int id : candidates)
+                columns[id] = -1;
+            return false;
+        }
+        // the columns are gathered in the order of the data
+        std::sort(candidates.begin(), candidates.end());
+        for (int c = 0; c < n_union; ++c)
+            columns[candidates[c]] = c;
+
+        MRPT_TRACE_SCOPE(trace, "mrpt.exact_knn");
+        MatrixXf block(dim, n_union);
+        for (int c = 0; c < n_union; ++c)
+            block.col(c) = Map<const VectorXf>(column(candidates[c]), dim);
+        MatrixXf products(n_union, n);
+        products.noalias() = block.transpose() * Q.middleCols(first, n);
+        const VectorXf norms = metric == INNER_PRODUCT ? VectorXf() : VectorXf(block.colwise().squaredNorm());
+
+        for (int i = 0; i < n; ++i) {
+            TopK &heap = scratches[i].heap;
+            const Ref<const VectorXf> q = Q.col(first + i);
+            const float query_norm = metric == EUCLIDEAN ? q.squaredNorm() : inverse_norm(q.squaredNorm());
+            const int *elected = scratches[i].elected.data();
+            heap.reset(k);
+            for (int e = 0; e < n_elected[i]; ++e) {
+                const int c = columns[elected[e]];
+                const float product = products(c, i);
+                const float value = metric == EUCLIDEAN ? std::max(0.0f, norms(c) - 2 * product + query_norm)
+                                  : metric == INNER_PRODUCT ? -product
+                                  : -product * query_norm * inverse_norm(norms(c));
+                heap.push(value, elected[e]);
+            }
+            const size_t j = first + i;
+            extract_knn(heap, out + j * k, out_distances ? out_distances + j * k : nullptr);
+        }
+        for (int id : candidates)
+            columns[id] = -1;
+        return true;
+    }
+
+    /**
+    * Counts the votes of the leaves of n queries like query_from_found_leaves,
+    * as interleaved state machines: in its turn, a query counts the votes of a
+    * chunk of the ids of its leaves whose counters it prefetched in its last
+    * turn, and prefetches the counters of its next chunk.
+    * @param found_leaves - The leaves of the queries, n_trees for each one after another
+    * @param n - The number of queries, at most max_interleave
+    * @param n_elected - Output, the number of candidates elected for each query
+    * @param n_touched - Output, the number of candidates with a vote for each query
+    */
+    void vote_interleaved(const int *found_leaves, int n, int votes_required, QueryScratch *scratches,
+                          int *n_elected, int *n_touched) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.vote");
+        const int chunk = 16;
+        const mrpt_kernels::UnpackFunction unpack = dim_kernels->unpack_ids;
+        struct Cursor {
+            int n_tree; // the tree whose leaf is being counted
+            const int *next, *end; // the ids of the leaf not counted yet
+            int n_next; // the number of ids at next prefetched for the turn
+            const uint32_t *words; // the blocks of a compressed leaf not unpacked yet
+            int n_packed; // the number of ids in them
+            int block[mrpt_kernels::pack_block]; // the unpacked block of a compressed leaf
+        } cursors[max_interleave];
+
+        // moves a query to its next chunk and prefetches its counters, false when it has none
+        auto advance = [&](int g) {
+            Cursor &c = cursors[g];
+            const int *leaves = found_leaves + (size_t) g * n_trees;
+            while (c.next == c.end) {
+                if (c.n_packed) {
+                    const int n = std::min(c.n_packed, mrpt_kernels::pack_block);
+                    c.words = unpack(c.words, n, c.block);
+                    c.next = c.block;
+                    c.end = c.block + n;
+                    c.n_packed -= n;
+                    continue;
+                }
+                if (c.n_tree >= 0 && leaves[c.n_tree] >= 0 && !inserted_leaves.empty()) {
+                    const std::vector<int> &inserted = inserted_leaves[c.n_tree * (1 << depth) + leaves[c.n_tree]];
+                    count_votes(inserted.data(), inserted.size(), votes_required, scratches[g], n_elected[g],
+                                n_touched[g]);
+                }
+                if (++c.n_tree == n_trees)
+                    return false;
+                const int leaf = leaves[c.n_tree];
+                c.next = c.end = nullptr;
+                if (leaf >= 0 && !packed_first.empty()) {
+                    c.words = packed_ids.data() + packed_first[(size_t) c.n_tree * (1 << depth) + leaf];
+                    c.n_packed = leaf_size(c.n_tree, leaf);
+                } else if (leaf >= 0) {
+                    c.next = leaf_begin(c.n_tree, leaf);
+                    c.end = c.next + leaf_size(c.n_tree, leaf);
+                }
+            }
+            c.n_next = std::min<int>(chunk, c.end - c.next);
+            prefetch_votes(scratches[g], c.next, c.n_next);
+            return true;
+        };
+
+        bool active[max_interleave];
+        int n_active = 0;
+        for (int g = 0; g < n; ++g) {
+            n_elected[g] = n_touched[g] = 0;
+            cursors[g].n_tree = -1;
+            cursors[g].next = cursors[g].end = nullptr;
+            cursors[g].n_packed = 0;
+            n_active += active[g] = advance(g);
+        }
+        while (n_active) {
+            for (int g = 0; g < n; ++g) {
+                if (!active[g])
+                    continue;
+                Cursor &c = cursors[g];
+                count_votes(c.next, c.n_next, votes_required, scratches[g], n_elected[g], n_touched[g]);
+                c.next += c.n_next;
+                if (!advance(g)) {
+                    active[g] = false;
+                    --n_active;
+                }
+            }
+        }
+    }
+
+    /**
+    * Counts the votes of the leaves of n queries like query_from_found_leaves,
+    * leaf by leaf: in each tree the queries are sorted by their leaf, and the
+    * ids of a leaf are read, and unpacked if the leaves are compressed, once for
+    * all the queries that reach it, a chunk at a time that stays in the L1 cache
+    * while the votes of each of the queries are counted.
+    * @param found_leaves - The leaves of the queries, n_trees for each one after another
+    * @param n - The number of queries, at most max_interleave
+    * @param n_elected - Output, the number of candidates elected for each query
+    * @param n_touched - Output, the number of candidates with a vote for each query
+    */
+    void vote_leaf_major(const int *found_leaves, int n, int votes_required, QueryScratch *scratches,
+                         int *n_elected, int *n_touched) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.vote");
+        const int chunk = 1024;
+        for (int g = 0; g < n; ++g)
+            n_elected[g] = n_touched[g] = 0;
+        int order[max_interleave];
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            auto leaf_of = [&](int g) { return found_leaves[(size_t) g * n_trees + n_tree]; };
+            int m = 0;
+            for (int g = 0; g < n; ++g)
+                if (leaf_of(g) >= 0)
+                    order[m++] = g;
+            std::sort(order, order + m, [&](int a, int b) { return leaf_of(a) < leaf_of(b); });
+
+            for (int i = 0, end; i < m; i = end) {
+                const int leaf = leaf_of(order[i]);
+                for (end = i + 1; end < m && leaf_of(order[end]) == leaf; ++end) {}
+                visit_leaves(n_tree, leaf, leaf + 1, [&](const int *ids, int size) {
+                    for (int first = 0; first < size; first += chunk) {
+                        const int n_ids = std::min(chunk, size - first);
+                        for (int j = i; j < end; ++j) {
+                            const int g = order[j];
+                            count_votes(ids + first, n_ids, votes_required, scratches[g], n_elected[g], n_touched[g]);
+                        }
+                    }
+                });
+                if (inserted_leaves.empty())
+                    continue;
+                const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + leaf];
+                for (int j = i; j < end; ++j) {
+                    const int g = order[j];
+                    count_votes(inserted.data(), inserted.size(), votes_required, scratches[g], n_elected[g],
+                                n_touched[g]);
+                }
+            }
+        }
+    }
+
+    /**
+    * Prefetches the vote counters of the n samples in ids.
+    */
+    static void prefetch_votes(const QueryScratch &scratch, const int *ids, int n) {
+        for (int i = 0; i < n; ++i) {
+            const int id = ids[i];
+            switch (scratch.counter_bytes) {
+                case 0: mrpt_kernels::prefetch(scratch.voted.data() + (id >> 6), 1); break;
+                case 1: mrpt_kernels::prefetch(scratch.votes8.data() + id, 1); break;
+                case 2: mrpt_kernels::prefetch(scratch.votes16.data() + id, 1); break;
+                default: mrpt_kernels::prefetch(scratch.votes.data() + id, 1);
+            }
+        }
+    }
+
+    /**
+    * Counts the votes of the leaves in found_leaves like query_from_found_leaves,
+    * and appends the elected candidates within radius of q to out, converted
+    * into the original ids, and their distances to out_distances.
+    * @return The number of candidates appended
+    */
+    int radius_from_found_leaves(const Ref<const VectorXf> &q, const int *found_leaves, float radius,
+                                 int votes_required, std::vector<int> *out, std::vector<float> *out_distances,
+                                 QueryScratch &scratch) const {
+        int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+        int64_t time = stats_clock(scratch);
+        scratch.reserve(std::min<int64_t>((int64_t) n_trees * max_leaf_size, n_samples));
+        scratch.select_counters(n_samples, n_trees, votes_required == 1);
+
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            const int leaf = found_leaves[n_tree];
+            if (leaf < 0)
+                continue;
+            count_leaf_votes(n_tree, leaf, votes_required, scratch, n_elected, n_touched);
+        }
+        clear_votes(scratch, n_touched);
+        add_time(scratch, &QueryStats::voting_ns, time);
+        if (sort_candidates)
+            sort_ids(scratch.elected.data(), n_elected, scratch.touched.data());
+
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const float *query = q.data(), *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const float query_scale = metric == COSINE ? inverse_norm(q.squaredNorm()) : 1;
+        const float squared_radius = radius * radius;
+        const int *elected = scratch.elected.data(), block = 64;
+        int n_found = 0;
+
+        for (int i = 0; i < n_elected; ++i) {
+            const int id = elected[i];
+            const float *x = column(id);
+            float d;
+            if (metric == EUCLIDEAN) {
+                d = 0;
+                for (int j = 0; j < dim && d <= squared_radius; j += block)
+                    d += kernels.l2(query + j, x + j, std::min(block, dim - j));
+                if (d > squared_radius)
+                    continue;
+                d = std::sqrt(d);
+            } else {
+                d = -score(kernels.dot(query, x, dim), id, norms, query_scale);
+                if (d < radius)
+                    continue;
+            }
+            // the point and its duplicates of collapse_duplicates
+            const int n_copies = duplicate_ids.empty() ? 0 : duplicate_first[id + 1] - duplicate_first[id];
+            for (int j = -1; j < n_copies; ++j) {
+                out->push_back(to_external(j < 0 ? id : duplicate_ids[duplicate_first[id] + j]));
+                if (out_distances)
+                    out_distances->push_back(d);
+                ++n_found;
+            }
+        }
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_touched, n_elected, false, false);
+        return n_found;
+    }
+
+    /**
+    * Orders the n_elected candidates of scratch by decreasing votes with a
+    * counting sort of the vote counts, which are still in the counters.
+    */
+    void rank_by_votes(QueryScratch &scratch, int n_elected) const {
+        std::vector<int> first(n_trees + 2, 0);
+        int *elected = scratch.elected.data();
+        for (int i = 0; i < n_elected; ++i)
+            ++first[n_trees - std::min(n_trees, vote_count(scratch, elected[i])) + 1];
+        for (int v = 0; v <= n_trees; ++v)
+            first[v + 1] += first[v];
+        if (scratch.ranked.size() < n_elected)
+            scratch.ranked.resize(n_elected);
+        for (int i = 0; i < n_elected; ++i)
+            scratch.ranked(first[n_trees - std::min(n_trees, vote_count(scratch, elected[i]))]++) = elected[i];
+        std::copy(scratch.ranked.data(), scratch.ranked.data() + n_elected, elected);
+    }
+
+    /**
+    * Returns the votes sample id has got in the current query of scratch.
+    */
+    static int vote_count(const QueryScratch &scratch, int id) {
+        switch (scratch.counter_bytes) {
+            case -2: return merged_vote_count(scratch, id);
+            case -1: return sliced_vote_count(scratch, id);
+            case 0: return (scratch.voted[id >> 6] >> (id & 63)) & 1;
+            case 1: return scratch.votes8[id];
+            case 2: return scratch.votes16[id];
+            default: return scratch.votes(id);
+        }
+    }
+
+    /**
+    * Counts the votes of the leaves visited by the multi-probe traversal of
+    * query_multiprobe, and performs the linear search among the elected candidates.
+    * With the leaf bounds of set_leaf_bounds and votes_required 1, the candidates
+    * are searched leaf by leaf in ascending order of the bounds of the leaves.
+    * @param projected_query - The projections of q onto all n_pool random vectors
+    */
+    void query_from_probes(const Ref<const VectorXf> &q, const float *projected_query, int k, int votes_required,
+                           int max_candidates, int *out, float *out_distances, QueryScratch &scratch) const {
+        int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+        const int64_t max_visited = std::max<int64_t>((int64_t) n_trees * max_leaf_size,
+                                                      (int64_t) max_candidates + max_leaf_size);
+        int64_t time = stats_clock(scratch);
+        scratch.reserve(std::min<int64_t>(max_visited, n_samples));
+        scratch.select_counters(n_samples, n_trees, votes_required == 1);
+        const bool bounded = leaf_radii.size() && votes_required == 1 && !codes.size() && !scratch.pruned_levels;
+
+        probe_leaves(projected_query, max_candidates, votes_required, scratch, n_elected, n_touched, bounded);
+
+        const bool fallback = n_elected < k && votes_required > 1;
+        if (fallback)
+            elect_by_max_votes(k, votes_required, scratch, n_elected, n_touched);
+        clear_votes(scratch, n_touched);
+        if (bounded)
+            order_by_leaf_bounds(q.data(), scratch, n_elected);
+        add_time(scratch, &QueryStats::voting_ns, time);
+        if (sort_candidates && !bounded)
+            sort_ids(scratch.elected.data(), n_elected, scratch.touched.data());
+
+        if (bounded)
+            exact_knn(q, k, scratch.ranked.data(), n_elected, scratch, out, out_distances, 0, scratch.lower_bounds.data());
+        else
+            exact_knn(q, k, scratch.elected.data(), n_elected, scratch, out, out_distances);
+        add_time(scratch, &QueryStats::search_ns, time);
+        add_counts(scratch, n_touched, n_elected, fallback);
+    }
+
+    /**
+    * Visits the leaf of the query in each loaded tree, and then more leaves in
+    * best-first order until the visited leaves hold at least max_candidates
+    * samples, counting the votes of every visited leaf. A branch not taken is
+    * queued with the largest margin between the query and a split point on the
+    * path to it, which is the distance the query would have to move for the
+    * trees to route it there.
+    * @param projected_query - The projections of the query onto all n_pool random vectors
+    * @param record - Whether the visited leaves are recorded in scratch.visited_leaves
+    */
+    void probe_leaves(const float *projected_query, int max_candidates, int votes_required, QueryScratch &scratch,
+                      int &n_elected, int &n_touched, bool record = false) const {
+        std::vector<std::pair<float, int>> &queue = scratch.probes;
+        const std::greater<std::pair<float, int>> closer;
+        int n_candidates = 0;
+        queue.clear();
+        scratch.visited_leaves.clear();
+
+        // descends from node idx_tree on level d of tree n_tree to a leaf, queueing the other branches
+        auto descend = [&](int n_tree, int idx_tree, int d, float priority) {
+            for (; d < depth; ++d) {
+                const float margin = projected_query[n_tree * depth + d] - split_data[n_tree * n_array + idx_tree];
+                const int idx_left = 2 * idx_tree + 1;
+                const int idx_other = margin <= 0 ? idx_left + 1 : idx_left;
+                queue.emplace_back(std::max(priority, std::abs(margin)), n_tree * n_array + idx_other);
+                std::push_heap(queue.begin(), queue.end(), closer);
+                idx_tree = margin <= 0 ? idx_left : idx_left + 1;
+            }
+            const int leaf = idx_tree - (1 << depth) + 1;
+            n_candidates += count_leaf_votes(n_tree, leaf, votes_required, scratch, n_elected, n_touched);
+            if (record)
+                scratch.visited_leaves.emplace_back(n_tree * (1 << depth) + leaf, n_elected);
+        };
+
+        const int n_ready = trees_loaded();
+        for (int n_tree = 0; n_tree < n_ready; ++n_tree)
+            descend(n_tree, 0, 0, 0);
+
+        while (n_candidates < max_candidates && !queue.empty()) {
+            std::pop_heap(queue.begin(), queue.end(), closer);
+            const float priority = queue.back().first;
+            const int n_tree = queue.back().second / n_array, idx_tree = queue.back().second % n_array;
+            queue.pop_back();
+
+            int d = 0;
+            while ((2 << d) - 1 <= idx_tree)
+                ++d;
+            descend(n_tree, idx_tree, d, priority);
+        }
+    }
+
+    /**
+    * Visits the leaves for the query of session with the candidate budget of
+    * the session, doubled first if grow is set, and adds the scores
+    * of the elected candidates not scored before to the heap of the session.
+    * If fewer candidates than the session has scored plus n_wanted are
+    * elected, those with the most votes are added as by query.
+    * @param n_wanted - The number of neighbors the next page still needs
+    */
+    void score_session(QuerySession &session, int n_wanted, bool grow, QueryScratch &scratch) const {
+        if (grow)
+            session.max_candidates = (int) std::min<int64_t>(
+                std::max<int64_t>(2 * (int64_t) session.max_candidates, session.scored.size() + n_wanted),
+                std::min<int64_t>((int64_t) n_trees * n_samples, std::numeric_limits<int>::max()));
+
+        int n_elected = 0, n_touched = 0, max_leaf_size = n_samples / (1 << depth) + 1;
+        const int64_t max_visited = std::max<int64_t>((int64_t) n_trees * max_leaf_size,
+                                                      (int64_t) session.max_candidates + max_leaf_size);
+        scratch.reserve(std::min<int64_t>(max_visited, n_samples));
+        scratch.select_counters(n_samples, n_trees, session.votes_required == 1);
+        probe_leaves(session.projected_query.data(), session.max_candidates, session.votes_required, scratch,
+                     n_elected, n_touched);
+        session.exhausted = scratch.probes.empty();
+        const int n_target = (int) std::min<size_t>(session.scored.size() + n_wanted, n_samples);
+        if (n_elected < n_target && session.votes_required > 1)
+            elect_by_max_votes(n_target, session.votes_required, scratch, n_elected, n_touched);
+        clear_votes(scratch, n_touched);
+
+        // only the candidates not scored by an earlier visit are scored
+        int *elected = scratch.elected.data();
+        std::sort(elected, elected + n_elected);
+        const int n_scored = session.scored.size();
+        const int n_new = std::set_difference(elected, elected + n_elected, session.scored.begin(),
+                                              session.scored.end(), scratch.touched.data()) - scratch.touched.data();
+        const int *ids = scratch.touched.data();
+        session.scored.insert(session.scored.end(), ids, ids + n_new);
+        std::inplace_merge(session.scored.begin(), session.scored.begin() + n_scored, session.scored.end());
+
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const mrpt_kernels::DistanceFunction distance = metric == EUCLIDEAN ? kernels.l2 : kernels.dot;
+        const float *query = session.q.data();
+        const float *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const float query_scale = inverse_norm(session.q.squaredNorm());
+        const VectorXf shifted = byte_data ? VectorXf(session.q - code_offset) : VectorXf();
+        const std::greater<std::pair<float, int>> nearest_first;
+        for (int i = 0; i < n_new; ++i) {
+            const int id = ids[i];
+            if (n_deleted && is_deleted(id))
+                continue;
+            const float value = byte_data
+                ? kernels.l2_int8(shifted.data(), code_scale.data(), codes.data() + (size_t) dim * id, dim)
+                : score(distance(query, column(id), dim), id, norms, query_scale);
+            // the duplicates left out of the trees by collapse_duplicates are at the same distance
+            const int n_copies = duplicate_ids.empty() ? 0 : duplicate_first[id + 1] - duplicate_first[id];
+            for (int j = -1; j < n_copies; ++j) {
+                session.heap.emplace_back(value, j < 0 ? id : duplicate_ids[duplicate_first[id] + j]);
+                std::push_heap(session.heap.begin(), session.heap.end(), nearest_first);
+            }
+        }
+    }
+
+    /**
+    * Returns the query working memory of the calling thread. The buffers grow
+    * to fit the largest index queried from the thread and are kept for the
+    * lifetime of the thread.
+    */
+    static QueryScratch &thread_scratch() {
+        static thread_local QueryScratch scratch;
+        return scratch;
+    }
+
+    static const int max_interleave = 32; // the most queries of set_query_interleave
+    static const int leaf_prefetch_trees = 4; // how many trees ahead query prefetches the ids of the leaves
+    static const int leaf_prefetch_bytes = 256; // the bytes of the ids of a leaf prefetched
+    static const uint64_t merge_counter_bytes = 64 << 20; // the counters above which sorted leaves may be merged
+    static const int merge_sparsity = 32; // the samples per candidate above which sorted leaves are merged
+
+    /**
+    * Returns the working memory of the calling thread for the groups of
+    * queries of set_query_interleave.
+    */
+    static std::vector<QueryScratch> &thread_group_scratch() {
+        static thread_local std::vector<QueryScratch> scratch;
+        return scratch;
+    }
+
+    /**
+    * Counts a tree built by grow, and reports the progress if a progress
+    * callback is set, min_interval has passed since the last report, and no
+    * other thread is reporting. With a duty cycle of set_build_priority, the
+    * thread then pauses for as long as the tree took, scaled so that it works
+    * that share of the time.
+    * @param start - The time the thread started building the tree, from mrpt_metrics::now_ns
+    */
+    void tree_built(int64_t start) {
+        if (build_duty_cycle < 1) {
+            const double busy = mrpt_metrics::now_ns() - start;
+            std::this_thread::sleep_for(std::chrono::nanoseconds((int64_t) (busy * (1 / build_duty_cycle - 1))));
+        }
+        const int n_built = ++n_built_trees;
+        if (!progress_callback)
+            return;
+        const int64_t now = mrpt_metrics::now_ns();
+        if (now - last_progress_ns.load(std::memory_order_relaxed) < progress_interval_ns ||
+            reporting_progress.exchange(true, std::memory_order_acquire))
+            return;
+        if (now - last_progress_ns.load(std::memory_order_relaxed) >= progress_interval_ns) {
+            progress_callback(n_built, n_trees);
+            last_progress_ns.store(mrpt_metrics::now_ns(), std::memory_order_relaxed);
+        }
+        reporting_progress.store(false, std::memory_order_release);
+    }
+
+    /**
+    * Returns the time in nanoseconds if the metrics of the index are enabled,
+    * and 0 otherwise.
+    */
+    int64_t metrics_clock() const {
+        return metrics ? mrpt_metrics::now_ns() : 0;
+    }
+
+    /**
+    * Records the latency of a query that started at start, plus extra, into the
+    * metrics if they are enabled, and returns the time the query ended.
+    */
+    int64_t record_query(int64_t start, int64_t extra = 0) const {
+        if (!metrics)
+            return 0;
+        const int64_t now = mrpt_metrics::now_ns();
+        metrics->queries.record(now - start + extra);
+        return now;
+    }
+
+    /**
+    * Hands a query answered with out to the recall monitor, if there is one.
+    */
+    void monitor_recall(const Ref<const VectorXf> &q, int k, const int *out) const {
+        if (metrics && metrics->recall)
+            metrics->recall->observe(q.data(), k, out);
+    }
+
+    /**
+    * Records a load that started at start into the metrics if they are enabled,
+    * and returns ok. A failed load without a known reason gets a general one.
+    */
+    bool record_load(int64_t start, bool ok) {
+        if (!ok)
+            load_failed("the index file cannot be read or is invalid");
+        if (metrics) {
+            if (ok)
+                metrics->loads.record(mrpt_metrics::now_ns() - start);
+            else
+                metrics->failed_loads.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ok;
+    }
+
+    /**
+    * Returns the time in nanoseconds if the queries made with scratch gather
+    * statistics, and 0 otherwise.
+    */
+    static int64_t stats_clock(const QueryScratch &scratch) {
+#ifndef MRPT_NO_QUERY_STATS
+        if (scratch.stats)
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+        return 0;
+    }
+
+    /**
+    * Adds the time since time to the phase of the statistics of scratch, if
+    * any, and moves time to the present.
+    */
+    static void add_time(QueryScratch &scratch, int64_t QueryStats::*phase, int64_t &time) {
+#ifndef MRPT_NO_QUERY_STATS
+        if (scratch.stats) {
+            const int64_t now = stats_clock(scratch);
+            scratch.stats->*phase += now - time;
+            time = now;
+        }
+#endif
+    }
+
+    /**
+    * Counts a query that touched n_touched samples and elected n_elected
+    * candidates in the statistics of scratch, if any.
+    */
+    static void add_counts(QueryScratch &scratch, int n_touched, int n_elected, bool fallback,
+                           bool truncated = false) {
+#ifndef MRPT_NO_QUERY_STATS
+        if (scratch.stats) {
+            scratch.stats->n_queries++;
+            scratch.stats->n_touched += n_touched;
+            scratch.stats->n_elected += n_elected;
+            scratch.stats->n_fallbacks += fallback;
+            scratch.stats->n_truncated += truncated;
+        }
+#endif
+    }
+
+    /**
+    * Adds a vote for each of the n samples in ids, appends the samples getting
+    * their first vote to the touched samples, and appends the samples reaching
+    * votes_required votes to the elected candidates.
+    * @param weight - The votes added to each sample, see set_margin_votes
+    */
+    void count_votes(const int *ids, int n, int votes_required, QueryScratch &scratch,
+                     int &n_elected, int &n_touched, int weight = 1) const {
+        // leaves with inserted points may hold more than the buffers were reserved for
+        if (n_touched + n > scratch.touched.size())
+            scratch.reserve(std::min<int64_t>(n_samples, std::max<int64_t>(2 * scratch.touched.size(), n_touched + n)));
+
+        if (weight != 1 && scratch.counter_bytes) {
+            switch (scratch.counter_bytes) {
+                case 1: count_weighted_votes(scratch.votes8.data(), ids, n, votes_required, weight, scratch,
+                                             n_elected, n_touched); break;
+                case 2: count_weighted_votes(scratch.votes16.data(), ids, n, votes_required, weight, scratch,
+                                             n_elected, n_touched); break;
+                default: count_weighted_votes(scratch.votes.data(), ids, n, votes_required, weight, scratch,
+                                              n_elected, n_touched);
+            }
+            return;
+        }
+        switch (scratch.counter_bytes) {
+            case 0: mark_votes(ids, n, scratch, n_elected, n_touched); break;
+            case 1: count_votes(scratch.votes8.data(), ids, n, votes_required, scratch, n_elected, n_touched); break;
+            case 2: count_votes(scratch.votes16.data(), ids, n, votes_required, scratch, n_elected, n_touched); break;
+            default: count_votes(scratch.votes.data(), ids, n, votes_required, scratch, n_elected, n_touched);
+        }
+    }
+
+    /**
+    * Same as count_votes with the counters votes, but adds weight votes to
+    * each sample, which is elected when its votes pass votes_required.
+    */
+    template<typename Counter>
+    void count_weighted_votes(Counter *votes, const int *ids, int n, int votes_required, int weight,
+                              QueryScratch &scratch, int &n_elected, int &n_touched) const {
+        int *elected = scratch.elected.data(), *touched = scratch.touched.data();
+        const Filter *filter = scratch.filter;
+        const uint64_t *excluded = scratch.excluded;
+        for (int i = 0; i < n; ++i, ++ids) {
+            if ((n_stale && is_deleted(*ids)) || (filter && !filter->test(*ids)) || excluded_sample(excluded, *ids))
+                continue;
+            const int before = votes[*ids], v = before + weight;
+            votes[*ids] = v;
+            if (!before) touched[n_touched++] = *ids;
+            if (before < votes_required && v >= votes_required) elected[n_elected++] = *ids;
+        }
+    }
+
+    /**
+    * Counts the votes of the n samples in ids with the vote counters votes.
+    */
+    template<typename Counter>
+    void count_votes(Counter *votes, const int *ids, int n, int votes_required, QueryScratch &scratch,
+                     int &n_elected, int &n_touched) const {
+        int *elected = scratch.elected.data(), *touched = scratch.touched.data();
+        const Filter *filter = scratch.filter;
+        const uint64_t *excluded = scratch.excluded;
+        if (n_stale || filter || excluded) {
+            for (int i = 0; i < n; ++i, ++ids) {
+                if ((n_stale && is_deleted(*ids)) || (filter && !filter->test(*ids)) ||
+                    excluded_sample(excluded, *ids))
+                    continue;
+                const int v = ++votes[*ids];
+                if (v == 1) touched[n_touched++] = *ids;
+                if (v == votes_required) elected[n_elected++] = *ids;
+            }
+            return;
+        }
+        for (int i = 0; i < n; ++i, ++ids) {
+            const int v = ++votes[*ids];
+            if (v == 1) touched[n_touched++] = *ids;
+            if (v == votes_required) elected[n_elected++] = *ids;
+        }
+    }
+
+    /**
+    * Sums the bitmaps of the trees set by set_leaf_bits into bit-sliced vote
+    * counts, sliced_block words of 64 samples at a time: bit p of the counts of
+    * the samples of a word is one word, and a bitmap is added to the counts with
+    * a carry from each bit to the next, in loops over the words of a block that
+    * the compiler turns into SIMD instructions. The counts are compared with
+    * votes_required from the most significant bit down, and the samples having
+    * at least as many votes are elected. The bitmaps are cleared on the way,
+    * and the counts of the words having votes are kept in the vote planes of
+    * scratch, which are then the touched samples.
+    * @return The number of samples that have votes
+    */
+    int elect_sliced(int votes_required, QueryScratch &scratch, int &n_elected, int &n_touched) const {
+        const int block = QueryScratch::sliced_block, n_planes = scratch.n_planes;
+        const size_t n_words = QueryScratch::sliced_words(n_samples);
+        const bool reachable = !(votes_required >> n_planes);
+        int n_voted = 0;
+        uint64_t counts[32][QueryScratch::sliced_block];
+        for (size_t first = 0; first < n_words; first += block) {
+            std::fill(counts[0], counts[0] + n_planes * block, 0);
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                uint64_t *bits = scratch.tree_bits.data() + n_words * n_tree + first, carry[block];
+                for (int j = 0; j < block; ++j) {
+                    carry[j] = bits[j];
+                    bits[j] = 0;
+                }
+                for (int p = 0; p < n_planes; ++p) {
+                    uint64_t more = 0;
+                    for (int j = 0; j < block; ++j) {
+                        const uint64_t next = counts[p][j] & carry[j];
+                        counts[p][j] ^= carry[j];
+                        carry[j] = next;
+                        more |= next;
+                    }
+                    if (!more)
+                        break;
+                }
+            }
+
+            for (int j = 0; j < block; ++j) {
+                uint64_t greater = 0, equal = ~(uint64_t) 0, any = 0;
+                for (int p = n_planes - 1; p >= 0; --p) {
+                    any |= counts[p][j];
+                    if ((votes_required >> p) & 1) {
+                        equal &= counts[p][j];
+                    } else {
+                        greater |= equal & counts[p][j];
+                        equal &= ~counts[p][j];
+                    }
+                }
+                if (!any)
+                    continue;
+                uint64_t elect = reachable ? greater | equal : 0;
+                const int n_new = mrpt_kernels::popcount(elect);
+                if (n_elected + n_new > scratch.elected.size() || n_touched >= scratch.touched.size())
+                    scratch.reserve(std::min<int64_t>(n_samples, std::max<int64_t>(2 * scratch.elected.size(),
+                                                                                   n_elected + 64)));
+                const size_t word = first + j;
+                uint64_t *planes = scratch.vote_planes.data() + word * n_planes;
+                for (int p = 0; p < n_planes; ++p)
+                    planes[p] = counts[p][j];
+                scratch.touched(n_touched++) = word;
+                n_voted += mrpt_kernels::popcount(any);
+                for (int *elected = scratch.elected.data(); elect; elect &= elect - 1)
+                    elected[n_elected++] = 64 * word + mrpt_kernels::count_trailing_zeros(elect);
+            }
+        }
+        return n_voted;
+    }
+
+    /**
+    * Appends the ids of leaf of tree n_tree to the runs of scratch that
+    * elect_merged merges: the sorted ids of the leaf, or with pruned levels of
+    * each leaf of its subtree, and the points inserted into each, sorted.
+    */
+    void gather_leaf(int n_tree, int leaf, QueryScratch &scratch) const {
+        std::vector<int> &ids = scratch.merge_ids;
+        std::vector<int> &first = scratch.merge_first;
+        const int begin = leaf << scratch.pruned_levels, end = (leaf + 1) << scratch.pruned_levels;
+        if (packed_first.empty()) {
+            // the leaves of a subtree follow each other, each one a run
+            for (int j = begin; j < end; ++j) {
+                ids.insert(ids.end(), leaf_begin(n_tree, j), leaf_begin(n_tree, j + 1));
+                first.push_back(ids.size());
+            }
+        } else {
+            for (int j = begin; j < end; ++j) {
+                visit_leaves(n_tree, j, j + 1, [&](const int *block, int n) { ids.insert(ids.end(), block, block + n); });
+                first.push_back(ids.size());
+            }
+        }
+        for (int j = begin; j < end && !inserted_leaves.empty(); ++j) {
+            const std::vector<int> &inserted = inserted_leaves[n_tree * (1 << depth) + j];
+            if (inserted.empty())
+                continue;
+            ids.insert(ids.end(), inserted.begin(), inserted.end());
+            std::sort(ids.end() - inserted.size(), ids.end());
+            first.push_back(ids.size());
+        }
+    }
+
+    /**
+    * Merges the runs of ids gathered by gather_leaf, pairs of runs at a time
+    * until one is left, and counts the votes of each sample as the length of
+    * its run in the merged ids. The samples are touched in the order of their
+    * ids, with their votes in merged_votes, and elected in that order.
+    * @return The number of samples that have votes
+    */
+    int elect_merged(int votes_required, QueryScratch &scratch, int &n_elected, int &n_touched) const {
+        std::vector<int> &ids = scratch.merge_ids, &buffer = scratch.merge_buffer, &first = scratch.merge_first;
+        buffer.resize(ids.size());
+        while (first.size() > 2) {
+            const int n_runs = first.size() - 1;
+            const int *runs = ids.data();
+            int r = 0;
+            for (; r + 4 <= n_runs; r += 4)
+                merge_ids_2(runs + first[r], runs + first[r + 1], runs + first[r + 2], buffer.data() + first[r],
+                            runs + first[r + 2], runs + first[r + 3], runs + first[r + 4], buffer.data() + first[r + 2]);
+            for (; r < n_runs; r += 2) {
+                const int *a = runs + first[r], *b = runs + first[std::min(r + 1, n_runs)];
+                merge_ids(a, b, b, runs + first[std::min(r + 2, n_runs)], buffer.data() + first[r]);
+            }
+            // the runs merged in this pass start at every other start
+            int n_merged_runs = 0;
+            for (int r = 0; r <= n_runs; r += 2)
+                first[n_merged_runs++] = first[r];
+            if (n_runs % 2)
+                first[n_merged_runs++] = first[n_runs];
+            first.resize(n_merged_runs);
+            ids.swap(buffer);
+        }
+
+        const int n = ids.size();
+        scratch.reserve(std::min(n, n_samples));
+        if (scratch.merged_votes.size() < (size_t) std::min(n, n_samples))
+            scratch.merged_votes.resize(std::min(n, n_samples));
+        int *elected = scratch.elected.data(), *touched = scratch.touched.data();
+        const Filter *filter = scratch.filter;
+        const uint64_t *excluded = scratch.excluded;
+        for (int i = 0; i < n;) {
+            const int id = ids[i];
+            int end = i + 1;
+            while (end < n && ids[end] == id)
+                ++end;
+            const int v = end - i;
+            i = end;
+            if ((n_stale && is_deleted(id)) || (filter && !filter->test(id)) || excluded_sample(excluded, id))
+                continue;
+            scratch.merged_votes[n_touched] = v;
+            touched[n_touched++] = id;
+            if (v >= votes_required)
+                elected[n_elected++] = id;
+        }
+        scratch.n_merged = n_touched;
+        return n_touched;
+    }
+
+    /**
+    * Merges the sorted ids a, ..., a_end - 1 and b, ..., b_end - 1 into out
+    * without branching on their order, which the branch predictor could not
+    * guess for the ids of two leaves.
+    */
+    static void merge_ids(const int *a, const int *a_end, const int *b, const int *b_end, int *out) {
+        while (a < a_end && b < b_end) {
+            const int x = *a, y = *b, from_b = y < x;
+            *out++ = from_b ? y : x;
+            a += 1 - from_b;
+            b += from_b;
+        }
+        out = std::copy(a, a_end, out);
+        std::copy(b, b_end, out);
+    }
+
+    /**
+    * Merges the adjacent sorted runs a, ..., b - 1 and b, ..., end - 1 into
+    * out, and the runs of c, d and end_d into out_c, at the same time. Each
+    * step of a merge waits for the load of the step before it, so the steps of
+    * two merges interleaved take about the time of one.
+    */
+    static void merge_ids_2(const int *a, const int *b, const int *end, int *out,
+                            const int *c, const int *d, const int *end_d, int *out_c) {
+        const int *b_begin = b, *d_begin = d;
+        while (a < b_begin && b < end && c < d_begin && d < end_d) {
+            const int x = *a, y = *b, from_b = y < x;
+            const int z = *c, w = *d, from_d = w < z;
+            *out++ = from_b ? y : x;
+            *out_c++ = from_d ? w : z;
+            a += 1 - from_b;
+            b += from_b;
+            c += 1 - from_d;
+            d += from_d;
+        }
+        merge_ids(a, b_begin, b, end, out);
+        merge_ids(c, d_begin, d, end_d, out_c);
+    }
+
+    /**
+    * Returns the votes of sample id in the merged leaves of scratch.
+    */
+    static int merged_vote_count(const QueryScratch &scratch, int id) {
+        const int *touched = scratch.touched.data();
+        const int *it = std::lower_bound(touched, touched + scratch.n_merged, id);
+        return it < touched + scratch.n_merged && *it == id ? scratch.merged_votes[it - touched] : 0;
+    }
+
+    /**
+    * Same as elect_by_max_votes for the votes of the merged leaves.
+    */
+    void elect_merged_by_max_votes(int k, int votes_required, QueryScratch &scratch,
+                                   int &n_elected, int n_touched) const {
+        const int *votes = scratch.merged_votes.data(), *touched = scratch.touched.data();
+        int *elected = scratch.elected.data();
+        std::vector<int> vote_count(votes_required, 0);
+        for (int i = 0; i < n_touched; ++i)
+            if (votes[i] < votes_required)
+                ++vote_count[votes[i]];
+        int max_votes = votes_required - 1;
+        for (int would_elect = n_elected; max_votes > 1; --max_votes) {
+            would_elect += vote_count[max_votes];
+            if (would_elect >= k) break;
+        }
+        for (int i = 0; i < n_touched; ++i)
+            if (votes[i] >= max_votes && votes[i] < votes_required)
+                elected[n_elected++] = touched[i];
+    }
+
+    /**
+    * Returns the votes of sample id in the bit-sliced counters of scratch.
+    */
+    static int sliced_vote_count(const QueryScratch &scratch, int id) {
+        const uint64_t *planes = scratch.vote_planes.data() + (size_t) (id >> 6) * scratch.n_planes;
+        int v = 0;
+        for (int p = 0; p < scratch.n_planes; ++p)
+            v |= (int) ((planes[p] >> (id & 63)) & 1) << p;
+        return v;
+    }
+
+    /**
+    * Counts the votes of the n samples in ids when a single vote elects a
+    * sample: the samples without a vote bit are marked, touched and elected.
+    */
+    void mark_votes(const int *ids, int n, QueryScratch &scratch, int &n_elected, int &n_touched) const {
+        uint64_t *voted = scratch.voted.data();
+        int *elected = scratch.elected.data(), *touched = scratch.touched.data();
+        const Filter *filter = scratch.filter;
+        const uint64_t *excluded = scratch.excluded;
+        for (int i = 0; i < n; ++i, ++ids) {
+            uint64_t &word = voted[*ids >> 6];
+            const uint64_t bit = (uint64_t) 1 << (*ids & 63);
+            if ((word & bit) || (n_stale && is_deleted(*ids)) || (filter && !filter->test(*ids)) ||
+                excluded_sample(excluded, *ids))
+                continue;
+            word |= bit;
+            touched[n_touched++] = *ids;
+            elected[n_elected++] = *ids;
+        }
+    }
+
+    /**
+    * Resets the vote counts of the n_touched touched samples back to zero.
+    */
+    void clear_votes(QueryScratch &scratch, int n_touched) const {
+        const int *touched = scratch.touched.data();
+        switch (scratch.counter_bytes) {
+            case -2:
+                // the merged runs are overwritten by the next query
+                break;
+            case -1:
+                // the touched samples are the words of the bit-sliced counters
+                for (int i = 0; i < n_touched; ++i)
+                    std::fill_n(scratch.vote_planes.data() + (size_t) touched[i] * scratch.n_planes,
+                                scratch.n_planes, 0);
+                break;
+            case 0:
+                // every bit set in a word belongs to a touched sample
+                for (int i = 0; i < n_touched; ++i)
+                    scratch.voted[touched[i] >> 6] = 0;
+                break;
+            case 1: clear_votes(scratch.votes8.data(), touched, n_touched); break;
+            case 2: clear_votes(scratch.votes16.data(), touched, n_touched); break;
+            default: clear_votes(scratch.votes.data(), touched, n_touched);
+        }
+    }
+
+    template<typename Counter>
+    static void clear_votes(Counter *votes, const int *touched, int n_touched) {
+        for (int i = 0; i < n_touched; ++i)
+            votes[touched[i]] = 0;
+    }
+
+    /**
+    * Sorts the n ids in increasing order with a least significant digit radix
+    * sort of 11 bits per pass, which takes as many passes as the ids of the
+    * samples have digits; a few hundred ids are sorted by comparisons instead.
+    * @param buffer - Working memory for n ids
+    */
+    void sort_ids(int *ids, int n, int *buffer) const {
+        if (n < 256) {
+            std::sort(ids, ids + n);
+            return;
+        }
+        const int bits = 11, n_buckets = 1 << bits;
+        int *from = ids, *to = buffer;
+        for (int shift = 0; shift < 32 && (n_samples - 1) >> shift; shift += bits) {
+            int first[n_buckets + 1] = {0};
+            for (int i = 0; i < n; ++i)
+                ++first[((from[i] >> shift) & (n_buckets - 1)) + 1];
+            for (int b = 0; b < n_buckets; ++b)
+                first[b + 1] += first[b];
+            for (int i = 0; i < n; ++i)
+                to[first[(from[i] >> shift) & (n_buckets - 1)]++] = from[i];
+            std::swap(from, to);
+        }
+        if (from != ids)
+            std::copy(from, from + n, ids);
+    }
+
+    /**
+    * If not enough samples had at least votes_required votes, find the maximum
+    * amount of votes needed such that the final search set size has at least k
+    * samples, and elect also the samples having that many votes. Only the
+    * n_touched samples that received votes are examined, so the cost does not
+    * depend on the size of the data.
+    */
+    void elect_by_max_votes(int k, int votes_required, QueryScratch &scratch,
+                            int &n_elected, int n_touched) const {
+        // with a single vote required, every touched sample is already elected
+        if (votes_required <= 1) return;
+        switch (scratch.counter_bytes) {
+            case -2: elect_merged_by_max_votes(k, votes_required, scratch, n_elected, n_touched); break;
+            case -1: elect_sliced_by_max_votes(k, votes_required, scratch, n_elected, n_touched); break;
+            case 1: elect_by_max_votes(scratch.votes8.data(), k, votes_required, scratch, n_elected, n_touched); break;
+            case 2: elect_by_max_votes(scratch.votes16.data(), k, votes_required, scratch, n_elected, n_touched); break;
+            default: elect_by_max_votes(scratch.votes.data(), k, votes_required, scratch, n_elected, n_touched);
+        }
+    }
+
+    template<typename Counter>
+    void elect_by_max_votes(const Counter *votes, int k, int votes_required, QueryScratch &scratch,
+                            int &n_elected, int n_touched) const {
+        const int *touched = scratch.touched.data();
+        int *elected = scratch.elected.data();
+
+        int max_votes = 0;
+        for (int i = 0; i < n_touched; ++i)
+            max_votes = std::max<int>(max_votes, votes[touched[i]]);
+        max_votes = std::min(max_votes, votes_required - 1);
+        if (max_votes < 1) return;
+
+        VectorXi vote_count = VectorXi::Zero(max_votes + 1);
+        for (int i = 0; i < n_touched; ++i) {
+            const int v = votes[touched[i]];
+            if (v <= max_votes) vote_count(v)++;
+        }
+
+        for (int would_elect = n_elected; max_votes > 1; --max_votes) {
+            would_elect += vote_count(max_votes);
+            if (would_elect >= k) break;
+        }
+
+        for (int i = 0; i < n_touched; ++i) {
+            const int v = votes[touched[i]];
+            if (v >= max_votes && v < votes_required)
+                elected[n_elected++] = touched[i];
+        }
+    }
+
+    /**
+    * Same as above for the bit-sliced counters, whose n_touched touched words
+    * are examined 64 samples at a time.
+    */
+    void elect_sliced_by_max_votes(int k, int votes_required, QueryScratch &scratch,
+                                   int &n_elected, int n_touched) const {
+        std::vector<int> vote_count(votes_required, 0);
+        int votes[64];
+        for (int i = 0; i < n_touched; ++i) {
+            const uint64_t any = decode_sliced_votes(scratch, scratch.touched(i), votes);
+            for (uint64_t bits = any; bits; bits &= bits - 1) {
+                const int v = votes[mrpt_kernels::count_trailing_zeros(bits)];
+                if (v < votes_required) vote_count[v]++;
+            }
+        }
+
+        int max_votes = votes_required - 1;
+        while (max_votes > 0 && !vote_count[max_votes])
+            --max_votes;
+        if (max_votes < 1) return;
+        for (int would_elect = n_elected; max_votes > 1; --max_votes) {
+            would_elect += vote_count[max_votes];
+            if (would_elect >= k) break;
+        }
+
+        for (int i = 0; i < n_touched; ++i) {
+            const int word = scratch.touched(i);
+            const uint64_t any = decode_sliced_votes(scratch, word, votes);
+            for (uint64_t bits = any; bits; bits &= bits - 1) {
+                const int j = mrpt_kernels::count_trailing_zeros(bits);
+                if (votes[j] >= max_votes && votes[j] < votes_required)
+                    scratch.elected(n_elected++) = 64 * word + j;
+            }
+        }
+    }
+
+    /**
+    * Writes the votes of the 64 samples of word in the bit-sliced counters of
+    * scratch into votes.
+    * @return The bits of the samples of the word that have votes
+    */
+    static uint64_t decode_sliced_votes(const QueryScratch &scratch, int word, int *votes) {
+        const uint64_t *planes = scratch.vote_planes.data() + (size_t) word * scratch.n_planes;
+        uint64_t any = 0;
+        std::fill_n(votes, 64, 0);
+        for (int p = 0; p < scratch.n_planes; ++p) {
+            any |= planes[p];
+            for (uint64_t bits = planes[p]; bits; bits &= bits - 1)
+                votes[mrpt_kernels::count_trailing_zeros(bits)] += 1 << p;
+        }
+        return any;
+    }
+
+    /**
+    * Serial linear search for the k nearest neighbors of q among the n_elected
+    * samples in indices. The distances are computed and the nearest samples
+    * are selected in a single pass using the heap of scratch. The distances are
+    * computed four candidates at a time by the SIMD kernels chosen for the running
+    * CPU, while the candidates a few steps ahead are prefetched into the cache.
+    * With a quantized copy of the data, only the shortlist nearest candidates by
+    * the copy are scored with the data, or none if shortlist_size is negative.
+    * The INNER_PRODUCT and COSINE metrics score the candidates by inner products.
+    * A query with as many candidates as set_parallel_scoring asks for scores
+    * them on several threads instead, each keeping the k nearest of its share
+    * in a heap of its own, and the heaps are merged at the end.
+    * With the EUCLIDEAN metric and at least 256 dimensions, the distances are
+    * summed by blocks of dimensions in the order of abandon_blocks once the heap
+    * is full, and the candidates are abandoned when they cannot enter it. With
+    * the leading dimensions of set_leading_dimensions, a candidate is scored
+    * on them first once the heap is full, and with the data only if their
+    * partial sum can enter it.
+    * @param deadline_ns - If nonzero, the time of mrpt_metrics::now_ns after which
+    * the search stops, checked after every 256 candidates scored with the data
+    * @param lower_bounds - If given, lower bounds of the squared distances of the
+    * candidates in ascending order, such as those of order_by_leaf_bounds; the
+    * search stops at the first candidate whose bound is past the k-th nearest
+    * so far, as the rest cannot enter the heap. Not used with quantized data.
+    * @return False if the search stopped at deadline_ns before scoring all candidates
+    */
+    bool exact_knn(const Ref<const VectorXf> &q, int k, const int *indices, int n_elected, QueryScratch &scratch,
+                   int *out, float *out_distances, int64_t deadline_ns = 0,
+                   const float *lower_bounds = nullptr) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.exact_knn");
+        if (codes.size() && shortlist_size < 0) {
+            shortlist_candidates(q, k, indices, n_elected, scratch);
+            extract_knn(scratch.shortlist, out, out_distances);
+            return true;
+        }
+        const int n_shortlist = std::max(k, shortlist_size ? shortlist_size : 4 * k);
+        if (codes.size() && n_elected > n_shortlist) {
+            shortlist_candidates(q, n_shortlist, indices, n_elected, scratch);
+            if (scratch.shortlisted.size() < n_shortlist)
+                scratch.shortlisted.resize(n_shortlist);
+            n_elected = scratch.shortlist.extract(scratch.shortlisted.data(), nullptr);
+            indices = scratch.shortlisted.data();
+        }
+
+        const mrpt_kernels::DistanceKernels &kernels = *dim_kernels;
+        const mrpt_kernels::DistanceFunction4 distance_4 = metric == EUCLIDEAN ? kernels.l2_4 : kernels.dot_4;
+        const mrpt_kernels::DistanceFunction distance_1 = metric == EUCLIDEAN ? kernels.l2 : kernels.dot;
+        const float *norms = metric == COSINE ? data_norms().data() : nullptr;
+        const float query_scale = metric == COSINE ? inverse_norm(q.squaredNorm()) : 1;
+        TopK &heap = scratch.heap;
+        const float *query = q.data();
+        const int vector_bytes = dim * sizeof(float);
+        const int distance = prefetch_distance < 0 ? std::max(4, std::min(32, 8192 / vector_bytes))
+                                                   : prefetch_distance;
+        heap.reset(k);
+
+#ifndef _WIN32
+        if (advise_pages)
+            advise_candidates(indices, n_elected);
+#endif
+        // once the heap is full, a candidate of high-dimensional data is dropped as soon as the partial
+        // sum of its squared distance reaches the distance of the k-th nearest so far, so only the
+        // block summed first is prefetched, as the rest of a far candidate is never read
+        const bool abandon = metric == EUCLIDEAN && dim >= 256;
+        const std::vector<std::pair<int, int>> &blocks = abandon ? abandon_blocks() : abandon_order;
+        const int prefetch_offset = abandon ? blocks[0].first : 0;
+        const int prefetch_bytes = abandon ? blocks[0].second * (int) sizeof(float) : vector_bytes;
+        // the leading dimensions are read first, so only they are prefetched
+        const int n_leading = metric == EUCLIDEAN ? leading_dimensions.size() : 0;
+        if (n_leading) {
+            scratch.leading_query.resize(n_leading);
+            for (int d = 0; d < n_leading; ++d)
+                scratch.leading_query[d] = query[leading_dimensions(d)];
+        }
+        auto prefetch_candidate = [&](int j) {
+            if (n_leading)
+                mrpt_kernels::prefetch(leading_data.data() + (size_t) n_leading * indices[j], n_leading * sizeof(float));
+            else
+                mrpt_kernels::prefetch(column(indices[j]) + prefetch_offset, prefetch_bytes);
+        };
+        auto bounded_out = [&](const TopK &h, int i) { return lower_bounds && lower_bounds[i] > h.threshold(); };
+        // scores the candidates i, ..., end - 1 into h, prefetching those before prefetch_end, and
+        // returns where it stopped, at end or at the first candidate bounded out of h
+        auto score_candidates = [&](TopK &h, int i, int end, int prefetch_end) {
+            for (; i + 4 <= end && !bounded_out(h, i); i += 4) {
+                if (distance) {
+                    for (int j = i + distance; j < std::min(i + distance + 4, prefetch_end); ++j)
+                        prefetch_candidate(j);
+                }
+                const float *candidates[4] = {column(indices[i]), column(indices[i + 1]),
+                                              column(indices[i + 2]), column(indices[i + 3])};
+                float distances[4];
+                if (n_leading && h.threshold() < std::numeric_limits<float>::infinity())
+                    leading_distance_4(query, scratch.leading_query.data(), indices + i, h.threshold(), kernels,
+                                       distances);
+                else if (abandon && h.threshold() < std::numeric_limits<float>::infinity())
+                    abandoning_distance_4(query, candidates, h.threshold(), blocks, kernels.l2_4, distances);
+                else
+                    distance_4(query, candidates, dim, distances);
+                for (int j = 0; j < 4; ++j)
+                    h.push(score(distances[j], indices[i + j], norms, query_scale), indices[i + j]);
+            }
+            for (; i < end && !bounded_out(h, i); ++i)
+                h.push(score(distance_1(query, column(indices[i]), dim), indices[i], norms, query_scale), indices[i]);
+            return i;
+        };
+
+        bool complete = true;
+        const int n_threads = parallel_scoring_threads(n_elected, deadline_ns || lower_bounds);
+        if (n_threads > 1) {
+            // each thread keeps the k nearest of its share of the candidates, and the heaps are merged
+            std::vector<TopK> &partial = scratch.partial_heaps;
+            partial.resize(n_threads);
+            parallel_for(n_threads, [&](int t) {
+                const int first = (int64_t) n_elected * t / n_threads, last = (int64_t) n_elected * (t + 1) / n_threads;
+                partial[t].reset(k);
+                for (int j = first; j < std::min(first + distance, last); ++j)
+                    prefetch_candidate(j);
+                score_candidates(partial[t], first, last, last);
+            }, 1, n_threads);
+            for (const TopK &h : partial)
+                for (const std::pair<float, int> &p : h.items())
+                    heap.push(p.first, p.second);
+        } else {
+            for (int j = 0; j < std::min(distance, n_elected); ++j)
+                prefetch_candidate(j);
+            // with a deadline the candidates are scored in blocks, between which the clock is read
+            const int block_size = deadline_ns ? 256 : n_elected;
+            int i = 0;
+            for (int end = std::min(block_size, n_elected); ; end = std::min(end + block_size, n_elected)) {
+                i = score_candidates(heap, i, end, n_elected);
+                if (end == n_elected || bounded_out(heap, i))
+                    break;
+                if (mrpt_metrics::now_ns() > deadline_ns) {
+                    complete = false;
+                    break;
+                }
+            }
+        }
+
+        if (graph_hops && !graph_indptr.empty() && !deadline_ns)
+            walk_graph(query, k, scratch, distance_1, norms, query_scale);
+        extract_knn(heap, out, out_distances);
+        return complete;
+    }
+
+    /**
+    * Refines the neighbors found by the linear search, in the heap of scratch,
+    * by the graph walk of set_graph_walk. The points of the heap seed the beam
+    * and the frontier, and the heap then receives the k nearest of the beam.
+    * Skips the deleted points and, with a filter in scratch, those that do not
+    * pass it.
+    */
+    void walk_graph(const float *query, int k, QueryScratch &scratch, mrpt_kernels::DistanceFunction distance,
+                    const float *norms, float query_scale) const {
+        TopK &heap = scratch.heap, &beam = scratch.beam;
+        std::vector<std::pair<float, int>> &frontier = scratch.frontier;
+        const std::greater<std::pair<float, int>> nearest_first;
+        if (scratch.walked.size() < (size_t) (n_samples + 63) / 64)
+            scratch.walked.resize((n_samples + 63) / 64);
+        auto walked = [&](int id) {
+            uint64_t &word = scratch.walked[id >> 6];
+            const uint64_t bit = (uint64_t) 1 << (id & 63);
+            if (word & bit)
+                return true;
+            word |= bit;
+            scratch.walked_ids.push_back(id);
+            return false;
+        };
+
+        beam.reset(std::max(k, graph_beam));
+        frontier.clear();
+        for (const std::pair<float, int> &p : heap.items()) {
+            beam.push(p.first, p.second);
+            frontier.push_back(p);
+            walked(p.second);
+        }
+        std::make_heap(frontier.begin(), frontier.end(), nearest_first);
+
+        const int n_rows = graph_indptr.size() - 1;
+        for (int hop = 0; hop < graph_hops && !frontier.empty(); ++hop) {
+            std::pop_heap(frontier.begin(), frontier.end(), nearest_first);
+            const std::pair<float, int> expanded = frontier.back();
+            frontier.pop_back();
+            if (expanded.first > beam.threshold())
+                break;
+            const int row = to_external(expanded.second);
+            if (row >= n_rows)
+                continue;
+            const int64_t end = graph_indptr[row + 1];
+            for (int64_t e = graph_indptr[row]; e < end; ++e) {
+                const int id = to_internal(graph_neighbors[e]);
+                if (walked(id) || (n_deleted && is_deleted(id)) || (scratch.filter && !scratch.filter->test(id)) ||
+                    excluded_sample(scratch.excluded, id))
+                    continue;
+                const float d = score(distance(query, column(id), dim), id, norms, query_scale);
+                if (d < beam.threshold()) {
+                    beam.push(d, id);
+                    frontier.emplace_back(d, id);
+                    std::push_heap(frontier.begin(), frontier.end(), nearest_first);
+                }
+            }
+        }
+
+        for (int id : scratch.walked_ids)
+            scratch.walked[id >> 6] = 0;
+        scratch.walked_ids.clear();
+        heap.reset(k);
+        for (const std::pair<float, int> &p : beam.items())
+            heap.push(p.first, p.second);
+    }
+
+    /**
+    * Returns the blocks of memory the queries read, as their first byte and
+    * their size: the index block of a mapped file or of compact, and the data
+    * if the queries read it.
+    * @param owned - Whether the copies the index owns are included too: the
+    * reordered copy of the data, the quantized copy and the leading dimensions
+    * of set_leading_dimensions
+    */
+    std::vector<std::pair<const unsigned char *, size_t>> query_memory(bool owned) const {
+        std::vector<std::pair<const unsigned char *, size_t>> ranges;
+        auto add = [&ranges](const void *first, size_t bytes) {
+            if (first && bytes)
+                ranges.emplace_back(static_cast<const unsigned char *>(first), bytes);
+        };
+        add(mapped_index, mapped_index_bytes);
+        if (uses_data() || (owned && reordered_data.size()))
+            add(search_data, sizeof(float) * dim * (size_t) n_samples);
+        if (owned) {
+            add(codes.data(), codes.size());
+            add(leading_data.data(), sizeof(float) * leading_data.size());
+        }
+        return ranges;
+    }
+
+#ifndef _WIN32
+    /**
+    * Gives the operating system the advice on the pages of bytes bytes from
+    * first, rounded out to whole pages.
+    */
+    static void advise_range(const void *first, size_t bytes, int advice) {
+        static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(first) & ~(page_size - 1);
+        const std::uintptr_t end = reinterpret_cast<std::uintptr_t>(first) + bytes;
+        madvise(reinterpret_cast<void *>(begin), end - begin, advice);
+    }
+
+    /**
+    * Asks the operating system to start reading in the memory pages of the
+    * n_elected candidates in indices. Runs of candidates on the same or
+    * consecutive pages are requested with one call.
+    */
+    void advise_candidates(const int *indices, int n_elected) const {
+        static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+        std::uintptr_t begin = 0, end = 0;
+        for (int i = 0; i < n_elected; ++i) {
+            const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(column(indices[i]));
+            const std::uintptr_t first = address & ~(page_size - 1);
+            const std::uintptr_t last = (address + dim * sizeof(float) + page_size - 1) & ~(page_size - 1);
+            if (first <= end && last >= begin) {
+                begin = std::min(begin, first);
+                end = std::max(end, last);
+                continue;
+            }
+            if (end > begin)
+                madvise(reinterpret_cast<void *>(begin), end - begin, MADV_WILLNEED);
+            begin = first;
+            end = last;
+        }
+        if (end > begin)
+            madvise(reinterpret_cast<void *>(begin), end - begin, MADV_WILLNEED);
+    }
+#endif
+
+    /**
+    * Writes the samples in heap in ascending order of distance to the output
+    * buffers, converting the internal ids into the original ids and the
+    * squared distances into distances.
+    */
+    void extract_knn(TopK &heap, int *out, float *out_distances) const {
+        const int k = heap.capacity();
+        const int n_found = add_duplicates(heap.extract(out, out_distances), k, out, out_distances);
+        for (int i = 0; i < n_found; ++i)
+            out[i] = to_external(out[i]);
+        if (out_distances) {
+            for (int i = 0; i < n_found; ++i)
+                out_distances[i] = metric == EUCLIDEAN ? std::sqrt(out_distances[i]) : -out_distances[i];
+        }
+    }
+
+    /**
+    * Follows each of the first n_found internal ids in out with its duplicates left
+    * out of the trees by collapse_duplicates, at the same distance, up to k ids.
+    * @return The number of ids in out
+    */
+    int add_duplicates(int n_found, int k, int *out, float *out_distances) const {
+        if (duplicate_ids.empty() || !n_found)
+            return n_found;
+        std::vector<std::pair<int, float>> found(n_found);
+        for (int i = 0; i < n_found; ++i)
+            found[i] = std::make_pair(out[i], out_distances ? out_distances[i] : 0);
+        int n = 0;
+        for (int i = 0; i < n_found && n < k; ++i) {
+            const int id = found[i].first, n_copies = duplicate_first[id + 1] - duplicate_first[id];
+            for (int j = -1; j < n_copies && n < k; ++j, ++n) {
+                out[n] = j < 0 ? id : duplicate_ids[duplicate_first[id] + j];
+                if (out_distances) out_distances[n] = found[i].second;
+            }
+        }
+        return n;
+    }
+
+    /**
+    * Returns the score the linear search ranks a candidate by, the smallest first,
+    * from the value of the distance kernel: the squared distance for EUCLIDEAN and
+    * the negated inner product for INNER_PRODUCT, which COSINE scales by the
+    * inverse norms of the candidate and the query.
+    * @param norms - The squared norms of the search data, used by COSINE only
+    * @param query_scale - The inverse norm of the query, used by COSINE only
+    */
+    float score(float value, int index, const float *norms, float query_scale) const {
+        if (metric == EUCLIDEAN)
+            return value;
+        if (metric == INNER_PRODUCT)
+            return -value;
+        return -value * query_scale * inverse_norm(norms[index]);
+    }
+
+    /**
+    * Returns the inverse of the norm with the square squared_norm, or 0 for a zero vector.
+    */
+    static float inverse_norm(float squared_norm) {
+        return squared_norm > 0 ? 1 / std::sqrt(squared_norm) : 0;
+    }
+
+    /**
+    * Projects the points stored as the columns of P onto all n_pool random vectors.
+    */
+    MatrixXf project_points(const Ref<const MatrixXf> &P) const {
+        MatrixXf projected_points(n_pool, P.cols());
+        if (density < 1)
+            multiply_sparse(0, n_pool, P, projected_points);
+        else
+            projected_points.noalias() = dense_matrix * P;
+        return projected_points;
+    }
+
+    /**
+    * Turns the projections of data points onto the rows of the random matrix from
+    * first_row on into the projections the trees of the metric are split by.
+    * COSINE trees split the normalized points. INNER_PRODUCT trees split the points
+    * divided by max_norm and extended with the component sqrt(1 - |x|^2 / max_norm^2),
+    * whose random vector components are given by extra_component.
+    * @param projections - The projections, one point per column
+    * @param squared_norms - The squared norms of the points
+    */
+    void transform_projections(int first_row, Ref<MatrixXf> projections, const Ref<const VectorXf> &squared_norms) const {
+        if (metric == COSINE) {
+            for (int j = 0; j < projections.cols(); ++j)
+                projections.col(j) *= inverse_norm(squared_norms(j));
+        } else if (metric == INNER_PRODUCT) {
+            VectorXf extra(projections.rows());
+            for (int i = 0; i < extra.size(); ++i)
+                extra(i) = extra_component((first_row + i) / depth, (first_row + i) % depth);
+            const float scale = max_norm > 0 ? 1 / max_norm : 0;
+            for (int j = 0; j < projections.cols(); ++j) {
+                const float height = std::sqrt(std::max(0.0f, max_norm * max_norm - squared_norms(j)));
+                projections.col(j) = scale * (projections.col(j) + height * extra);
+            }
+        }
+    }
+
+    /**
+    * Builds the trees in groups of as many trees as there are threads, or as fit in
+    * memory_limit. If not even one tree fits, the trees are projected one level at a
+    * time with grow_tree_by_level, and if needed fewer threads are used.
+    * @param memory_limit - See grow
+    */
+    void grow_trees(size_t memory_limit) {
+        const size_t level_bytes = sizeof(float) * n_samples;
+        const size_t tree_bytes = depth * level_bytes;
+        int n_threads = available_threads();
+
+        if (memory_limit == 0 || memory_limit >= tree_bytes) {
+            const size_t fit = memory_limit ? memory_limit / tree_bytes : n_threads;
+            grow_in_groups(std::min<size_t>(fit, n_threads));
+            return;
+        }
+
+        n_threads = std::max<size_t>(1, std::min<size_t>(n_threads, memory_limit / level_bytes));
+        last_build.n_groups = (n_trees + n_threads - 1) / n_threads;
+        last_build.projection_bytes = n_threads * level_bytes;
+
+        parallel_for(n_trees, [&](int n_tree) {
+            const int64_t start = mrpt_metrics::now_ns();
+            grow_tree_by_level(n_tree);
+            tree_built(start);
+        }, 1, n_threads);
+    }
+
+    /**
+    * Builds the trees in groups that fit in memory_limit, all of them in one group if there
+    * is no limit, with grow_in_groups.
+    * @param memory_limit - The maximum number of bytes for the projections of a group, which
+    * has at least one tree
+    */
+    void grow_streaming(size_t memory_limit) {
+        const size_t tree_bytes = sizeof(float) * depth * n_samples;
+        int group_size = n_trees;
+        if (memory_limit)
+            group_size = std::max<size_t>(1, std::min<size_t>(n_trees, memory_limit / tree_bytes));
+        grow_in_groups(group_size);
+    }
+
+    /**
+    * Builds the trees group by group. The projections of a group are computed in one
+    * sequential pass over the data, after which the trees of the group are built in
+    * parallel from the projections, one task per tree and more tasks within the trees.
+    * @param group_size - The number of trees in a group
+    */
+    void grow_in_groups(int group_size) {
+        const int n_leaves = 1 << depth;
+        group_size = std::max(1, std::min(group_size, n_trees));
+
+        MatrixXf projections;
+        for (int first = 0; first < n_trees; first += group_size) {
+            const int n_group = std::min(group_size, n_trees - first);
+            const int64_t start = mrpt_metrics::now_ns();
+            project_data(first * depth, n_group * depth, projections);
+            last_build.projection_ns += mrpt_metrics::now_ns() - start;
+            last_build.projection_bytes = std::max<int64_t>(last_build.projection_bytes,
+                                                            sizeof(float) * projections.size());
+            ++last_build.n_groups;
+
+            grow_tasks(n_group, [&](int t) {
+                MRPT_TRACE_SCOPE(trace, "mrpt.grow_tree");
+                const int64_t start = mrpt_metrics::now_ns();
+                const int n_tree = first + t;
+                int *indices = leaf_ids.col(n_tree).data();
+                std::iota(indices, indices + n_samples, 0);
+                grow_subtree(indices, indices + n_samples, 0, 0, n_tree, projections.data() + t * depth,
+                             n_group * depth);
+                leaf_first(n_leaves, n_tree) = n_samples;
+                tree_built(start);
+            });
+        }
+    }
+
+    /**
+    * Returns n_sample distinct points of the data drawn uniformly at random, in the
+    * order of the data, as the columns of a matrix. The points are drawn with Floyd's
+    * algorithm in n_sample steps.
+    * @param stream - The number of the random stream of the sample, which is seeded
+    * from the seed of the build and stream
+    */
+    MatrixXf sample_data(int n_sample, int stream) const {
+        std::seed_seq seq{build_seed, static_cast<unsigned>(stream)};
+        std::mt19937 gen(seq);
+        std::vector<bool> in_sample(n_samples, false);
+        std::vector<int> sample;
+        sample.reserve(n_sample);
+        for (int j = n_samples - n_sample; j < n_samples; ++j) {
+            const int t = std::uniform_int_distribution<int>(0, j)(gen);
+            const int id = in_sample[t] ? j : t;
+            in_sample[id] = true;
+            sample.push_back(id);
+        }
+        std::sort(sample.begin(), sample.end());
+
+        MatrixXf sample_points(dim, n_sample);
+        parallel_for(n_sample, [&](int i) {
+            MatrixXf widened;
+            sample_points.col(i) = data_columns(sample[i], 1, widened);
+        }, 1024);
+        return sample_points;
+    }
+
+    /**
+    * Replaces the random vector of every level of every tree by the best of
+    * n_split_candidates random vectors: the one along which the points of a
+    * sample of the data vary the most within the nodes of the level, relative
+    * to the squared length of the vector. The first candidate is the vector
+    * already in the random matrix. The nodes of the sample are split by their
+    * medians along the chosen vectors level by level, as the trees will be.
+    */
+    void choose_split_directions() {
+        const int n_sample = std::min(n_samples, direction_sample_size);
+        if (n_sample < 2)
+            return;
+        const MatrixXf sample_points = sample_data(n_sample, forest_trees + 1);
+        const VectorXf sample_norms = metric == COSINE ? VectorXf(sample_points.colwise().squaredNorm().transpose())
+                                                       : VectorXf();
+        Matrix<float, Dynamic, Dynamic, RowMajor> directions;
+        if (density < 1)
+            directions = random_matrix->sparse.toDense();
+        else
+            directions.swap(random_matrix->dense);
+
+        parallel_for(n_trees, [&](int n_tree) {
+            // a stream apart from those of the rows and of the nodes of the tree
+            std::seed_seq seq{build_seed, static_cast<unsigned>(first_tree + n_tree), static_cast<unsigned>(n_array)};
+            std::mt19937 gen(seq);
+            std::normal_distribution<float> normal_dist(0, 1);
+            std::bernoulli_distribution nonzero(density);
+
+            MatrixXf candidates(n_split_candidates, dim), projections;
+            std::vector<int> node(n_sample, 0), order(n_sample), first, next;
+            std::vector<double> sum, sum_squares;
+
+            for (int level = 0; level < depth; ++level) {
+                const int row = n_tree * depth + level, n_nodes = 1 << level;
+
+                // the points of the sample ordered by node
+                first.assign(n_nodes + 1, 0);
+                for (int j = 0; j < n_sample; ++j)
+                    ++first[node[j] + 1];
+                for (int v = 0; v < n_nodes; ++v)
+                    first[v + 1] += first[v];
+                next.assign(first.begin(), first.end() - 1);
+                for (int j = 0; j < n_sample; ++j)
+                    order[next[node[j]]++] = j;
+
+                candidates.row(0) = directions.row(row);
+                for (int c = 1; c < n_split_candidates; ++c)
+                    for (int i = 0; i < dim; ++i)
+                        candidates(c, i) = density < 1 && !nonzero(gen) ? 0 : normal_dist(gen);
+                projections.noalias() = candidates * sample_points;
+
+                int best = 0;
+                double best_score = -1;
+                for (int c = 0; c < n_split_candidates; ++c) {
+                    if (metric == COSINE)
+                        transform_projections(row, projections.middleRows(c, 1), sample_norms);
+                    sum.assign(n_nodes, 0);
+                    sum_squares.assign(n_nodes, 0);
+                    for (int j = 0; j < n_sample; ++j) {
+                        const double p = projections(c, j);
+                        sum[node[j]] += p;
+                        sum_squares[node[j]] += p * p;
+                    }
+                    double within = 0;
+                    for (int v = 0; v < n_nodes; ++v) {
+                        if (first[v + 1] > first[v])
+                            within += sum_squares[v] - sum[v] * sum[v] / (first[v + 1] - first[v]);
+                    }
+                    const double length = candidates.row(c).squaredNorm();
+                    const double score = length > 0 ? within / length : 0;
+                    if (score > best_score) {
+                        best_score = score;
+                        best = c;
+                    }
+                }
+                directions.row(row) = candidates.row(best);
+
+                for (int v = 0; v < n_nodes; ++v) {
+                    int *begin = order.data() + first[v], *end = order.data() + first[v + 1];
+                    int *middle;
+                    split_node(begin, end, projections.data() + best, n_split_candidates, middle);
+                    for (const int *p = begin; p < end; ++p)
+                        node[*p] = 2 * v + (p >= middle);
+                }
+            }
+        });
+
+        if (density < 1) {
+            random_matrix->sparse = directions.sparseView();
+            random_matrix->sparse.makeCompressed();
+        } else {
+            random_matrix->dense.swap(directions);
+        }
+        use_owned_random_matrix();
+    }
+
+    /**
+    * Builds the trees like grow_in_groups, but from a uniform sample of
+    * build_sample_size points, in as many groups as needed to fit memory_limit.
+    * Then fills the leaves of all the trees by routing all the points through
+    * them: the leaf of each point is first written in place of its index in
+    * leaf_ids, after which the indices of every tree are sorted by leaf with a
+    * counting sort. With a limit of the leaf sizes, the trees with a larger leaf
+    * are grown again from all the points with regrow_tree.
+    * @param memory_limit - See grow
+    */
+    void grow_from_sample(size_t memory_limit) {
+        const int n_leaves = 1 << depth, n_sample = build_sample_size;
+        MatrixXf sample_points = sample_data(n_sample, forest_trees);
+        const VectorXf sample_norms = metric != EUCLIDEAN ? VectorXf(sample_points.colwise().squaredNorm().transpose())
+                                                          : VectorXf();
+
+        const size_t tree_bytes = sizeof(float) * depth * n_sample;
+        int group_size = n_trees;
+        if (memory_limit)
+            group_size = std::max<size_t>(1, std::min<size_t>(n_trees, memory_limit / tree_bytes));
+
+        // the split points, with the indices of the sample as scratch in leaf_ids
+        MatrixXf projections;
+        for (int first = 0; first < n_trees; first += group_size) {
+            const int n_group = std::min(group_size, n_trees - first);
+            if (density < 1) {
+                projections.resize(n_group * depth, sample_points.cols());
+                multiply_sparse(first * depth, n_group * depth, sample_points, projections);
+            } else {
+                projections.noalias() = dense_matrix.middleRows(first * depth, n_group * depth) * sample_points;
+            }
+            if (metric != EUCLIDEAN)
+                transform_projections(first * depth, projections, sample_norms);
+            last_build.projection_bytes = std::max<int64_t>(last_build.projection_bytes,
+                                                            sizeof(float) * projections.size());
+            ++last_build.n_groups;
+
+            grow_tasks(n_group, [&](int t) {
+                MRPT_TRACE_SCOPE(trace, "mrpt.grow_tree");
+                int *indices = leaf_ids.col(first + t).data();
+                std::iota(indices, indices + n_sample, 0);
+                grow_subtree(indices, indices + n_sample, 0, 0, first + t, projections.data() + t * depth,
+                             n_group * depth);
+            });
+        }
+        sample_points.resize(0, 0);
+        projections.resize(0, 0);
+
+        // route reads the split points of the ready trees
+        split_data = split_points.data();
+        n_ready_trees = n_trees;
+        const int block_size = 256, n_blocks = (n_samples + block_size - 1) / block_size;
+
+        parallel_for(n_blocks, [&](int b) {
+            const int first = b * block_size, n = std::min(block_size, n_samples - first);
+            MatrixXf widened;
+            const Map<const MatrixXf> points = data_columns(first, n, widened);
+            MatrixXf projected = project_points(points);
+            VectorXi found_leaves(n_trees);
+            if (metric != EUCLIDEAN)
+                transform_projections(0, projected, points.colwise().squaredNorm().transpose());
+            for (int i = 0; i < n; ++i) {
+                route(projected.col(i).data(), found_leaves.data());
+                for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+                    leaf_ids(first + i, n_tree) = found_leaves(n_tree);
+            }
+        });
+        n_ready_trees = 0;
+
+        parallel_for(n_trees, [&](int n_tree) {
+            const int64_t start = mrpt_metrics::now_ns();
+            int *ids = leaf_ids.col(n_tree).data();
+            std::vector<int> first(n_leaves + 1, 0), sorted(n_samples);
+            for (int i = 0; i < n_samples; ++i)
+                ++first[ids[i] + 1];
+            for (int j = 0; j < n_leaves; ++j)
+                first[j + 1] += first[j];
+            for (int j = 0; j <= n_leaves; ++j)
+                leaf_first(j, n_tree) = first[j];
+            for (int i = 0; i < n_samples; ++i)
+                sorted[first[ids[i]]++] = i;
+            std::copy(sorted.begin(), sorted.end(), ids);
+            tree_built(start);
+        });
+
+        if (leaf_size_limit) {
+            for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+                for (int j = 0; j < n_leaves; ++j) {
+                    if (leaf_first(j + 1, n_tree) - leaf_first(j, n_tree) > leaf_size_limit) {
+                        regrow_tree(n_tree);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+    * Projects the data onto a range of rows of the random matrix. The data is read
+    * in chunks of consecutive columns, at most 64 MB each and split evenly between
+    * the threads, so that it is accessed sequentially. The chunks of 8-bit data
+    * are widened to floats first, at most 4 MB each as all threads hold one.
+    * @param first_row - The first row of the random matrix
+    * @param n_rows - The number of rows
+    * @param projections - Output, n_rows x n_samples
+    */
+    void project_data(int first_row, int n_rows, MatrixXf &projections) const {
+        MRPT_TRACE_SCOPE(trace, "mrpt.project_data");
+        const size_t chunk_bytes = byte_data ? 4 << 20 : 64 << 20;
+        const int per_thread = (n_samples + available_threads() - 1) / available_threads();
+        const int chunk = std::max<size_t>(1, std::min<size_t>(per_thread, chunk_bytes / (sizeof(float) * dim)));
+        const int n_chunks = (n_samples + chunk - 1) / chunk;
+        projections.resize(n_rows, n_samples);
+
+        parallel_for(n_chunks, [&](int c) {
+            const int j = c * chunk, m = std::min(chunk, n_samples - j);
+            if (data_fill)
+                (*data_fill)(j + m);
+            MatrixXf widened;
+            const Map<const MatrixXf> points = data_columns(j, m, widened);
+            if (density < 1)
+                multiply_sparse(first_row, n_rows, points, projections.middleCols(j, m));
+            else
+                projections.middleCols(j, m).noalias() = dense_matrix.middleRows(first_row, n_rows) * points;
+            if (metric != EUCLIDEAN)
+                transform_projections(first_row, projections.middleCols(j, m),
+                                      points.colwise().squaredNorm().transpose());
+        });
+    }
+
+    /**
+    * Splits a tree node into two by the median of the projections of its points.
+    * The indices are partitioned in place, so that the first (n + 1) / 2 of them
+    * have the smaller projections. When other points have the same projection
+    * as the median, all of them go to the same child, the left one as the queries
+    * route them or the right one if that splits the node more evenly, so that
+    * duplicates are not spread over two leaves.
+    * @param begin - The start of the indices in the node
+    * @param end - The end of the indices in the node
+    * @param projections - The projections of the data, the one of point j at projections[j * stride]
+    * @param stride - The distance between the projections of consecutive points
+    * @param middle - Set to the first index of the right child
+    * @return The split point of the node
+    */
+    static float split_node(int *begin, int *end, const float *projections, int stride, int *&middle) {
+        const int n = end - begin;
+        middle = begin + (n + 1) / 2;
+        if (n == 0)
+            return 0;
+        if (n >= radix_split_min_points)
+            return radix_split_node(begin, end, projections, stride, middle);
+
+        auto projection = [projections, stride](int i) { return projections[(ptrdiff_t) i * stride]; };
+        auto by_projection = [projections, stride](int i1, int i2) {
+            return projections[(ptrdiff_t) i1 * stride] < projections[(ptrdiff_t) i2 * stride];
+        };
+
+        // move the median to its place, smaller projections before and larger after it
+        const int split_point = (n % 2) ? n / 2 : n / 2 - 1; // median split
+        int *median = begin + split_point;
+        std::nth_element(begin, median, end, by_projection);
+
+        const float split = projection(*median);
+        const int *next = median + 1 < end ? std::min_element(median + 1, end, by_projection) : nullptr;
+        const bool tied_left = median > begin && projection(*std::max_element(begin, median, by_projection)) == split;
+        if (!tied_left && (!next || projection(*next) > split))
+            return n % 2 ? split : (split + projection(*next)) / 2;
+
+        // [equal, greater) holds the points with the projection of the median
+        int *equal = std::partition(begin, median, [&](int i) { return projection(i) < split; });
+        int *greater = std::partition(median + 1, end, [&](int i) { return projection(i) == split; });
+        const int64_t half = (n + 1) / 2;
+        if (equal > begin && half - (equal - begin) < (greater - begin) - half) {
+            middle = equal;
+            return projection(*std::max_element(begin, equal, by_projection));
+        }
+        middle = greater;
+        return split;
+    }
+
+    static const int radix_split_min_points = 64; // the smallest nodes split_node splits by radix select
+
+    /**
+    * The working memory of radix_split_node: the keys of the projections of a
+    * node, the keys left in the running for the median, and the partitioned
+    * indices.
+    */
+    struct SplitScratch {
+        std::vector<uint32_t> keys;
+        std::vector<uint32_t> candidates;
+        std::vector<int> ids;
+    };
+
+    /**
+    * Returns the split working memory of the calling thread, grown to fit the
+    * largest node it has split.
+    */
+    static SplitScratch &thread_split_scratch() {
+        static thread_local SplitScratch scratch;
+        return scratch;
+    }
+
+    /**
+    * Maps a float to an unsigned integer in the same order, with -0 and 0 both
+    * mapped to the key of 0.
+    */
+    static uint32_t float_order_key(float x) {
+        x += 0.0f;
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof bits);
+        return bits ^ (-(bits >> 31) | 0x80000000u);
+    }
+
+    /**
+    * Returns the float of a key of float_order_key.
+    */
+    static float order_key_float(uint32_t key) {
+        const uint32_t bits = key ^ ((key >> 31) - 1 | 0x80000000u);
+        float x;
+        std::memcpy(&x, &bits, sizeof x);
+        return x;
+    }
+
+    /**
+    * Splits a tree node like split_node, but finds the median by a radix select
+    * on the projections mapped to integer keys instead of by nth_element. The
+    * keys are gathered once, the median is found a byte at a time from
+    * histograms of the keys that still share its leading bytes, and a single
+    * pass then partitions the indices into those with smaller, equal and
+    * larger projections, at offsets known from the histograms. Neither pass
+    * branches on the data, where nth_element mispredicts about every other
+    * comparison of its partitions. The children hold the same points as with
+    * nth_element, in a different order within each.
+    * @param begin - The start of the indices in the node
+    * @param end - The end of the indices in the node
+    * @param projections - The projections of the data, the one of point j at projections[j * stride]
+    * @param stride - The distance between the projections of consecutive points
+    * @param middle - Set to the first index of the right child
+    * @return The split point of the node
+    */
+    static float radix_split_node(int *begin, int *end, const float *projections, int stride, int *&middle) {
+        const int n = end - begin;
+        SplitScratch &scratch = thread_split_scratch();
+        if ((int) scratch.keys.size() < n) {
+            scratch.keys.resize(n);
+            scratch.candidates.resize(n);
+            scratch.ids.resize(n);
+        }
+        uint32_t *keys = scratch.keys.data();
+        for (int j = 0; j < n; ++j)
+            keys[j] = float_order_key(projections[(ptrdiff_t) begin[j] * stride]);
+
+        // the key of rank split_point, narrowed down from the highest byte
+        const int split_point = (n % 2) ? n / 2 : n / 2 - 1;
+        const uint32_t *candidates = keys;
+        int n_candidates = n, rank = split_point, n_less = 0, n_equal = 0;
+        uint32_t median = 0;
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            int count[256] = {0};
+            for (int j = 0; j < n_candidates; ++j)
+                ++count[(candidates[j] >> shift) & 255];
+            uint32_t digit = 0;
+            while (rank >= count[digit]) {
+                rank -= count[digit];
+                n_less += count[digit];
+                ++digit;
+            }
+            median |= digit << shift;
+            if (count[digit] == n_candidates || shift == 0) {
+                // the rest of the keys share the leading bytes, nothing to compact
+                if (shift == 0)
+                    n_equal = count[digit];
+                continue;
+            }
+
+            uint32_t *next = scratch.candidates.data();
+            int m = 0;
+            for (int j = 0; j < n_candidates; ++j) {
+                next[m] = candidates[j];
+                m += (candidates[j] >> shift) == (median >> shift);
+            }
+            candidates = next;
+            n_candidates = m;
+        }
+
+        // [n_less, n_less + n_equal) for the points with the projection of the median
+        int *ids = scratch.ids.data();
+        int position[3] = {0, n_less, n_less + n_equal};
+        uint32_t max_less = 0, min_greater = ~0u;
+        for (int j = 0; j < n; ++j) {
+            const uint32_t key = keys[j];
+            ids[position[(key > median) + (key >= median)]++] = begin[j];
+            max_less = std::max(max_less, key < median ? key : 0u);
+            min_greater = std::min(min_greater, key > median ? key : ~0u);
+        }
+        std::copy(ids, ids + n, begin);
+
+        const float split = order_key_float(median);
+        const bool tied_left = n_less < split_point, tied_right = n_less + n_equal > split_point + 1;
+        if (!tied_left && !tied_right)
+            return n % 2 ? split : (split + order_key_float(min_greater)) / 2;
+
+        const int64_t half = (n + 1) / 2;
+        if (n_less > 0 && half - n_less < n_less + n_equal - half) {
+            middle = begin + n_less;
+            return order_key_float(max_less);
+        }
+        middle = begin + n_less + n_equal;
+        return split;
+    }
+
+    /**
+    * Splits a tree node into two by the median of the projections of a uniform
+    * sample of split_sample_size of its points, drawn with replacement. The
+    * indices are partitioned in place, those with projections at most the split
+    * point first.
+    * @param begin - The start of the indices in the node
+    * @param end - The end of the indices in the node
+    * @param projections - The projections of the data, the one of point j at projections[j * stride]
+    * @param stride - The distance between the projections of consecutive points
+    * @param gen - The random number generator of the sample
+    * @param middle - Set to the first index of the right child
+    * @return The split point of the node
+    */
+    float split_node_sampled(int *begin, int *end, const float *projections, int stride, std::mt19937 &gen,
+                             int *&middle) const {
+        const int n = end - begin;
+        std::uniform_int_distribution<int> uniform(0, n - 1);
+        std::vector<float> sample(split_sample_size);
+        for (float &value : sample)
+            value = projections[(ptrdiff_t) begin[uniform(gen)] * stride];
+
+        std::vector<float>::iterator median = sample.begin() + (split_sample_size - 1) / 2;
+        std::nth_element(sample.begin(), median, sample.end());
+        float split = *median;
+
+        middle = std::partition(begin, end, [projections, stride, split](int i) {
+            return projections[(ptrdiff_t) i * stride] <= split;
+        });
+
+        // many points at the split point: they go to the right child instead if that is more even
+        const int64_t half = (n + 1) / 2;
+        if (middle - begin > half) {
+            int *less = std::partition(begin, middle, [projections, stride, split](int i) {
+                return projections[(ptrdiff_t) i * stride] < split;
+            });
+            if (less > begin && half - (less - begin) < (middle - begin) - half) {
+                middle = less;
+                split = projections[(ptrdiff_t) *std::max_element(begin, less, [projections, stride](int i1, int i2) {
+                    return projections[(ptrdiff_t) i1 * stride] < projections[(ptrdiff_t) i2 * stride];
+                }) * stride];
+            }
+        }
+        return split;
+    }
+
+    /**
+    * Splits a node with split_node, or with split_node_sampled if it has more
+    * than split_sample_size points and the larger child of the sampled split
+    * can still be split into leaves of at most leaf_size_limit points.
+    * @param i - The index of the node within its tree
+    * @param n_tree - The index of the tree within the index
+    * @param middle - Set to the first index of the right child
+    * @return The split point of the node
+    */
+    float split_tree_node(int *begin, int *end, const float *projections, int stride, int i, int n_tree,
+                          int *&middle) const {
+        if (split_sample_size > 0 && end - begin > split_sample_size) {
+            // a stream of its own for every node, so that the tree does not depend on the build order
+            std::seed_seq seq{build_seed, static_cast<unsigned>(first_tree + n_tree), static_cast<unsigned>(i)};
+            std::mt19937 gen(seq);
+            const float split = split_node_sampled(begin, end, projections, stride, gen, middle);
+            if (!leaf_size_limit)
+                return split;
+
+            int level = 0;
+            while ((2 << level) <= i + 1)
+                ++level;
+            const int below = depth - level - 1; // the levels below the children
+            const int64_t larger = std::max(middle - begin, end - middle);
+            if ((larger + (1 << below) - 1) >> below <= leaf_size_limit)
+                return split;
+        }
+        return split_node(begin, end, projections, stride, middle);
+    }
+
+    /**
+    * Builds a single random projection tree. The tree is constructed by recursively
+    * projecting the data on a random vector and splitting into two by the median.
+    * The indices are partitioned in place, so that when the recursion is done
+    * [begin, end) of the root holds the leaves of the tree one after another.
+    * Within a parallel region the left child of a large node is built as an
+    * OpenMP task of its own, so the idle threads of the team share the work
+    * of a tree even when there are fewer trees than threads.
+    * @param begin - The start of the indices left in this branch
+    * @param end - The end of the indices left in this branch
+    * @param tree_level - The level in tree where the recursion is at
+    * @param i - The index within the tree where we are at
+    * @param n_tree - The index of the tree within the index
+    * @param tree_projections - Precalculated projection values for the current tree, the one
+    * of point j on level l at tree_projections[j * stride + l]
+    * @param stride - The distance between the projections of consecutive points
+    */
+    void grow_subtree(int *begin, int *end, int tree_level, int i, int n_tree, const float *tree_projections, int stride) {
+        const int idx_left = 2 * i + 1;
+        const int idx_right = idx_left + 1;
+
+        if (tree_level == depth) {
+            leaf_first(i - (1 << depth) + 1, n_tree) = begin - leaf_ids.col(n_tree).data();
+            return;
+        }
+
+        int *middle;
+        split_points(i, n_tree) = split_tree_node(begin, end, tree_projections + tree_level, stride, i, n_tree,
+                                                  middle);
+
+        // smaller nodes are not worth the overhead of a task
+        const int min_task_points = 1 << 14;
+        if (end - begin < min_task_points) {
+            grow_subtree(begin, middle, tree_level + 1, idx_left, n_tree, tree_projections, stride);
+            grow_subtree(middle, end, tree_level + 1, idx_right, n_tree, tree_projections, stride);
+            return;
+        }
+
+        #pragma omp task
+        grow_subtree(begin, middle, tree_level + 1, idx_left, n_tree, tree_projections, stride);
+        grow_subtree(middle, end, tree_level + 1, idx_right, n_tree, tree_projections, stride);
+        #pragma omp taskwait
+    }
+
+    /**
+    * Builds a single random projection tree like grow_subtree, but one level at a
+    * time, so that only the projections of one level are kept in memory.
+    * @param n_tree - The index of the tree within the index
+    */
+    void grow_tree_by_level(int n_tree) {
+        MRPT_TRACE_SCOPE(trace, "mrpt.grow_tree");
+        int *indices = leaf_ids.col(n_tree).data();
+        std::iota(indices, indices + n_samples, 0);
+
+        // the nodes of a level, node j has the indices [first[j], first[j + 1])
+        std::vector<int> first = {0, n_samples}, next_first;
+        MatrixXf level_projections;
+        const VectorXf squared_norms = metric != EUCLIDEAN ? VectorXf(X->colwise().squaredNorm().transpose()) : VectorXf();
+
+        for (int level = 0; level < depth; ++level) {
+            const int row = n_tree * depth + level;
+            if (byte_data) {
+                project_data(row, 1, level_projections);
+            } else if (density < 1) {
+                level_projections.resize(1, n_samples);
+                multiply_sparse(row, 1, *X, level_projections);
+            } else {
+                level_projections.noalias() = dense_matrix.middleRows(row, 1) * *X;
+            }
+            transform_projections(row, level_projections, squared_norms);
+
+            const int n_nodes = first.size() - 1, first_node = (1 << level) - 1;
+            next_first.resize(2 * n_nodes + 1);
+            for (int j = 0; j < n_nodes; ++j) {
+                int *begin = indices + first[j], *end = indices + first[j + 1], *middle;
+                split_points(first_node + j, n_tree) = split_tree_node(begin, end, level_projections.data(), 1,
+                                                                       first_node + j, n_tree, middle);
+                next_first[2 * j] = first[j];
+                next_first[2 * j + 1] = middle - indices;
+            }
+            next_first[2 * n_nodes] = n_samples;
+            first.swap(next_first);
+        }
+
+        for (int j = 0; j <= (1 << depth); ++j)
+            leaf_first(j, n_tree) = first[j];
+    }
+
+    /**
+    * Builds a random sparse matrix for use in random projection. The components of
+    * the matrix are drawn from the distribution
+    *
+    *       0 w.p. 1 - a
+    * N(0, 1) w.p. a
+    *
+    * where a = density, or with RADEMACHER projections +-1 instead of N(0, 1).
+    */
+    void build_sparse_random_matrix() {
+        random_matrix = std::make_shared<RandomMatrix>();
+        random_matrix->sparse = SparseMatrix<float, RowMajor>(n_pool, dim);
+
+        // the rows of each tree come from a random stream of their own
+        std::vector<std::vector<Triplet<float>>> tree_triplets(n_trees);
+
+        parallel_for(n_trees, [&](int n_tree) {
+            draw_sparse_rows(n_tree, tree_triplets[n_tree]);
+        });
+
+        std::vector<Triplet<float>> triplets;
+        for (const std::vector<Triplet<float>> &t : tree_triplets)
+            triplets.insert(triplets.end(), t.begin(), t.end());
+
+        random_matrix->sparse.setFromTriplets(triplets.begin(), triplets.end());
+        random_matrix->sparse.makeCompressed();
+    }
+
+    /*
+    * Builds a random dense matrix for use in random projection. The components of
+    * the matrix are drawn from the standard normal distribution, or with RADEMACHER
+    * projections they are +-1.
+    */
+    void build_dense_random_matrix() {
+        random_matrix = std::make_shared<RandomMatrix>();
+        random_matrix->dense = Matrix<float, Dynamic, Dynamic, RowMajor>(n_pool, dim);
+        if (projection == HADAMARD) {
+            build_hadamard_projection();
+            return;
+        }
+
+        parallel_for(n_trees, [&](int n_tree) {
+            draw_dense_rows(n_tree, random_matrix->dense.data() + (size_t) n_tree * depth * dim);
+        });
+        round_random_matrix();
+    }
+
+    /**
+    * Draws the nonzero components of the sparse rows of tree n_tree, from the
+    * random stream of the tree.
+    * @param triplets - Output, the components are appended to it
+    */
+    void draw_sparse_rows(int n_tree, std::vector<Triplet<float>> &triplets) const {
+        std::mt19937 gen = tree_generator(n_tree);
+        std::uniform_real_distribution<float> uni_dist(0, 1);
+        std::normal_distribution<float> norm_dist(0, 1);
+
+        for (int j = n_tree * depth; j < (n_tree + 1) * depth; ++j) {
+            for (int i = 0; i < dim; ++i) {
+                if (projection == RADEMACHER) {
+                    const float value = rademacher_component(j, i);
+                    if (value != 0)
+                        triplets.push_back(Triplet<float>(j, i, value));
+                    continue;
+                }
+                if (uni_dist(gen) > density) continue;
+                triplets.push_back(Triplet<float>(j, i, norm_dist(gen)));
+            }
+        }
+    }
+
+    /**
+    * Draws the dense rows of tree n_tree from the random stream of the tree, or
+    * with RADEMACHER projections from the seed of the build. Other projections
+    * than RADEMACHER get standard normal components.
+    * @param rows - Output, the depth rows of the tree one after another
+    */
+    void draw_dense_rows(int n_tree, float *rows) const {
+        std::mt19937 gen = tree_generator(n_tree);
+        std::normal_distribution<float> normal_dist(0, 1);
+        if (projection == RADEMACHER) {
+            for (int j = 0; j < depth; ++j)
+                for (int i = 0; i < dim; ++i)
+                    rows[(size_t) j * dim + i] = rademacher_component(n_tree * depth + j, i);
+        } else {
+            std::generate(rows, rows + (size_t) depth * dim, [&normal_dist, &gen] { return normal_dist(gen); });
+        }
+    }
+
+    /**
+    * Draws the sign flips and the output rows of the HADAMARD projection, and
+    * stores the transform also as the dense random matrix it is equivalent to, so
+    * that the data and batches of queries can be projected with matrix products.
+    * The rows are in blocks of hadamard_size, one block per transform; row j of
+    * block b is row hadamard_rows(j) of the Hadamard matrix times the signs of b.
+    */
+    void build_hadamard_projection() {
+        hadamard_size = 1;
+        while (hadamard_size < dim)
+            hadamard_size *= 2;
+        const int n_blocks = (n_pool + hadamard_size - 1) / hadamard_size;
+        hadamard_signs = VectorXf(n_blocks * hadamard_size);
+        hadamard_rows = VectorXi(n_pool);
+
+        parallel_for(n_blocks, [&](int b) {
+            std::mt19937 gen = tree_generator(b); // one stream per block
+            std::bernoulli_distribution coin(0.5);
+            for (int i = 0; i < hadamard_size; ++i)
+                hadamard_signs(b * hadamard_size + i) = coin(gen) ? 1 : -1;
+
+            // distinct rows of the Hadamard matrix for the projections of the block
+            std::vector<int> rows(hadamard_size);
+            std::iota(rows.begin(), rows.end(), 0);
+            std::shuffle(rows.begin(), rows.end(), gen);
+            const int first = b * hadamard_size, n = std::min(hadamard_size, n_pool - first);
+            for (int j = 0; j < n; ++j) {
+                const int row = rows[j];
+                hadamard_rows(first + j) = row;
+                for (int i = 0; i < dim; ++i) {
+                    const bool odd = std::bitset<32>(row & i).count() & 1;
+                    random_matrix->dense(first + j, i) = (odd ? -1 : 1) * hadamard_signs(first + i);
+                }
+            }
+        });
+    }
+
+    /**
+    * Projects a vector with the HADAMARD projection: for each block, flips the
+    * signs of the components, applies the fast Walsh-Hadamard transform and picks
+    * the rows of the block.
+    * @param x - The vector of length dim
+    * @param projected - Output buffer for the n_pool projections
+    */
+    void hadamard_project(const float *x, float *projected) const {
+        VectorXf buffer(hadamard_size);
+        for (int first = 0; first < n_pool; first += hadamard_size) {
+            const float *signs = hadamard_signs.data() + first;
+            for (int i = 0; i < dim; ++i)
+                buffer(i) = x[i] * signs[i];
+            buffer.tail(hadamard_size - dim).setZero();
+
+            // in-place butterflies of the unnormalized transform
+            for (int h = 1; h < hadamard_size; h *= 2) {
+                for (int i = 0; i < hadamard_size; i += 2 * h) {
+                    for (int j = i; j < i + h; ++j) {
+                        const float a = buffer(j), b = buffer(j + h);
+                        buffer(j) = a + b;
+                        buffer(j + h) = a - b;
+                    }
+                }
+            }
+
+            const int n = std::min(hadamard_size, n_pool - first);
+            for (int j = 0; j < n; ++j)
+                projected[first + j] = buffer(hadamard_rows(first + j));
+        }
+    }
+
+    /**
+    * Returns a component of a RADEMACHER projection matrix. The component is a hash
+    * of the seed and its position, nonzero with probability density, and then +1 or
+    * -1 with equal probability.
+    * @param row - The row of the component, n_tree * depth + level
+    * @param col - The column of the component
+    */
+    float rademacher_component(int row, int col) const {
+        row += first_tree * depth;
+        const uint64_t h = mix_bits(mix_bits(((uint64_t) build_seed << 32) | (uint32_t) row) + col);
+        // the top 24 bits decide if the component is nonzero and the lowest one its sign
+        if (density < 1 && (h >> 40) >= density * (1 << 24))
+            return 0;
+        return (h & 1) ? 1 : -1;
+    }
+
+    /**
+    * Returns the component of the random vector of level level of tree n_tree in
+    * the extra dimension of INNER_PRODUCT trees, +1 or -1. Like the components of
+    * RADEMACHER projections it is a hash of the seed, so it is not stored, and it
+    * stays the same for a tree and level when the index is pruned.
+    */
+    float extra_component(int n_tree, int level) const {
+        n_tree += first_tree;
+        const uint64_t h = mix_bits(mix_bits(~(((uint64_t) build_seed << 32) | (uint32_t) n_tree)) + level);
+        return (h & 1) ? 1 : -1;
+    }
+
+    /**
+    * The finalizer of splitmix64, which maps similar inputs to unrelated outputs.
+    */
+    static uint64_t mix_bits(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /**
+    * Returns the blocks of 64 dimensions, as the first dimension and the size,
+    * that the linear search sums distances by, in decreasing order of the
+    * variance of the data in the block, computing them from a sample of the
+    * data on the first call. The dimensions of large variance tend to add most
+    * to the distance, so summing them first rejects the far candidates sooner.
+    */
+    const std::vector<std::pair<int, int>> &abandon_blocks() const {
+        std::call_once(abandon_blocks_computed, [this] {
+            const int block_size = 64, n_blocks = (dim + block_size - 1) / block_size;
+            const int step = std::max(1, n_samples / 4096);
+            const Map<const MatrixXf> data = search_matrix();
+            const VectorXf mean = data.rowwise().mean();
+            VectorXf variance = VectorXf::Zero(dim);
+            for (int i = 0; i < n_samples; i += step)
+                variance += (data.col(i) - mean).cwiseAbs2();
+
+            std::vector<std::pair<float, int>> ranked(n_blocks);
+            for (int b = 0; b < n_blocks; ++b) {
+                const int first = b * block_size, size = std::min(block_size, dim - first);
+                ranked[b] = std::make_pair(-variance.segment(first, size).sum(), first);
+            }
+            std::sort(ranked.begin(), ranked.end());
+            for (const std::pair<float, int> &block : ranked)
+                abandon_order.emplace_back(block.second, std::min(block_size, dim - block.second));
+        });
+        return abandon_order;
+    }
+
+    /**
+    * Computes the squared Euclidean distances between q and the four vectors
+    * in x by the blocks of dimensions of abandon_blocks, and stops as soon as
+    * the partial sums of all four are at least threshold.
+    */
+    void abandoning_distance_4(const float *q, const float *const *x, float threshold,
+                               const std::vector<std::pair<int, int>> &blocks,
+                               mrpt_kernels::DistanceFunction4 l2_4, float *distances) const {
+        std::fill(distances, distances + 4, 0.0f);
+        for (const std::pair<int, int> &block : blocks) {
+            const float *x_block[4] = {x[0] + block.first, x[1] + block.first, x[2] + block.first, x[3] + block.first};
+            float partial[4];
+            l2_4(q + block.first, x_block, block.second, partial);
+            for (int j = 0; j < 4; ++j)
+                distances[j] += partial[j];
+            if (std::min(std::min(distances[0], distances[1]), std::min(distances[2], distances[3])) >= threshold)
+                break;
+        }
+    }
+
+    /**
+    * Computes the squared Euclidean distances between q and the four points of
+    * internal ids ids on the leading dimensions of set_leading_dimensions, in
+    * leading_q, and over all dimensions for those whose partial sum is below
+    * threshold.
+    */
+    void leading_distance_4(const float *q, const float *leading_q, const int *ids, float threshold,
+                            const mrpt_kernels::DistanceKernels &kernels, float *distances) const {
+        const int n_leading = leading_dimensions.size();
+        const float *leading[4];
+        for (int j = 0; j < 4; ++j)
+            leading[j] = leading_data.data() + (size_t) n_leading * ids[j];
+        kernels.l2_4(leading_q, leading, n_leading, distances);
+        for (int j = 0; j < 4; ++j)
+            if (distances[j] < threshold)
+                distances[j] = kernels.l2(q, column(ids[j]), dim);
+    }
+
+    /**
+    * Returns the random number generator of the rows of one tree. The generators of
+    * different trees are seeded independently from the seed of the build and the
+    * index of the tree, so the rows do not depend on the order they are generated in.
+    * @param n_tree - The index of the tree
+    */
+    std::mt19937 tree_generator(int n_tree) const {
+        std::seed_seq seq{build_seed, static_cast<unsigned>(first_tree + n_tree)};
+        return std::mt19937(seq);
+    }
+
+    Data given_data; // the data the index was constructed with, until it is released
+    Map<const MatrixXf> given_matrix; // the matrix of given_data
+    Map<const MatrixXf> *X; // the data matrix, given_matrix or stored_data
+    std::vector<float> data_storage; // the data followed by the inserted points, once points are inserted
+    mrpt_mmap::GrowableFile data_file; // the data followed by the inserted points, after set_data_file
+    Map<const MatrixXf> stored_data; // the matrix of data_storage or data_file, which X points to once points are inserted
+    mutable VectorXf data_squared_norms; // squared norms of the data points, used by exact_knn_batch
+    mutable std::once_flag data_norms_computed;
+    MatrixXf leaf_centroids; // the centroid of leaf j of tree n_tree in column n_tree * 2^depth + j, if set_leaf_bounds
+    VectorXf leaf_radii; // the radius of the ball around each centroid holding the leaf, -1 for an empty leaf
+    mutable std::vector<std::pair<int, int>> abandon_order; // the blocks of dimensions of abandon_blocks
+    mutable std::once_flag abandon_blocks_computed;
+    VectorXi leading_dimensions; // the dimensions of set_leading_dimensions, in decreasing order of variance
+    std::vector<float> leading_data; // the leading dimensions of each point, in internal id order
+    std::map<std::string, std::vector<int>> attributes; // the attributes of set_attribute, by original id
+    std::vector<int64_t> labels; // the label of each point of set_labels by original id, -1 for none; empty if unset
+    std::vector<int> label_slots; // the hash table of find_label: the ids of the labeled points, -1 in empty slots
+    int n_labeled; // the number of labels in label_slots
+    const float *search_data; // the data read by the linear search, in internal id order
+    MatrixXf reordered_data; // copy of the data in the leaf order of the first tree, if made
+    VectorXi data_order; // original id of each internal id, empty if the data is not reordered
+    VectorXi data_position; // internal id of each original id, empty if the data is not reordered
+    MatrixXf split_points; // all split points in all trees
+    MatrixXi leaf_ids; // the points of all trees, column n_tree holds the leaves of tree n_tree one after another
+    MatrixXi leaf_first; // leaf_first(j, n_tree) is the start of leaf j of tree n_tree in its column of leaf_ids,
+                         // and the last row holds the end of the last leaf
+    const float *split_data; // the split points the queries use, of split_points or of a mapped index file
+    const int *leaf_first_data; // the leaf offsets the queries use, of leaf_first or of a mapped index file
+    const int *leaf_ids_data; // the leaves the queries use, of leaf_ids or of a mapped index file,
+                              // nullptr if they are compressed
+    std::vector<uint32_t> packed_ids; // the leaves compressed by compress_leaves, blocks of mrpt_kernels::pack_ids
+    std::vector<uint64_t> packed_first; // packed_first[n_tree * 2^depth + leaf] is the first word of the leaf in
+                                        // packed_ids; empty if the leaves are not compressed
+    std::vector<std::vector<int>> inserted_leaves; // points inserted into leaf j of tree n_tree, at n_tree * 2^depth + j,
+                                                   // and not yet merged into leaf_ids; empty if there are none
+    int n_unmerged; // the number of points in inserted_leaves
+    int tree_points; // the number of points in each tree in leaf_ids
+    std::vector<uint64_t> deleted_bits; // bit i is set if the point with internal id i is deleted; empty if none is
+    int n_deleted; // the number of deleted points
+    int n_stale; // the number of deleted points still in the trees, which the vote counting skips
+    std::vector<int> duplicate_first; // the duplicates of the point with internal id i are duplicate_ids[duplicate_first[i]],
+                                      // ..., duplicate_ids[duplicate_first[i + 1] - 1]; empty if none are collapsed
+    std::vector<int> duplicate_ids; // the points left out of the trees by collapse_duplicates, which count as deleted
+    void *mapped_index; // the index file mapped by load, the buffer of load_from_memory, the block of compact, or null
+    size_t mapped_index_bytes; // the length of the mapping or the block, 0 for the buffer of load_from_memory
+    bool index_allocated; // whether mapped_index is the block of compact
+    Allocator index_allocator; // the allocator of the block of compact
+    void *far_leaves_block; // the leaves compact placed in far memory, or null
+    size_t far_leaves_bytes; // the length of far_leaves_block
+    Allocator far_allocator; // the allocator of far_leaves_block
+    size_t far_data_bytes; // the bytes of the data compact copied into far memory, while given_data holds them
+    MemoryTiers memory_tiers; // the tiers load places the index in, if tiered_load
+    bool tiered_load; // whether set_memory_tiers was called
+    bool random_matrix_mapped; // whether the projections use the random matrix of the mapping
+    bool random_matrix_shared; // whether the projections use the random matrix of another index
+    std::atomic<int> n_ready_trees; // the queries use the trees 0, ..., n_ready_trees - 1
+    bool blocked_layout; // whether the queries route through blocked_splits, see set_blocked_splits
+    std::vector<float> blocked_splits; // the split points of all trees in blocks of 16 floats, see layout_splits
+    const float *blocked_data; // the first block of blocked_splits, aligned to 64 bytes
+    int blocked_stride; // the floats of the blocks of a tree
+    std::atomic<bool> blocked_ready; // whether blocked_splits holds the split points of all trees
+    std::vector<char> tree_ready; // which trees load_trees has read
+    std::mutex tree_ready_mutex; // guards tree_ready
+    std::thread loader; // the thread loading the trees for load_async
+    std::shared_ptr<mrpt_executor::Executor> executor; // runs the parallel loops instead of OpenMP, or null
+    std::unique_ptr<mrpt_metrics::IndexMetrics> metrics; // the metrics of the index, null if they are not kept
+    bool loading_ok; // whether the loading of load_async succeeded
+    const char *load_failure; // why the last load failed, or null
+    uint64_t n_changes; // the number of changes of the index, see change_count
+    uint64_t sorted_leaves_change; // n_changes when sort_leaves sorted the leaves, which stay sorted until it changes
+
+    /**
+    * The random vectors needed for all the RP-trees, dense or sparse by the
+    * density, held by the indexes using them.
+    */
+    struct RandomMatrix {
+        Matrix<float, Dynamic, Dynamic, RowMajor> dense;
+        SparseMatrix<float, RowMajor> sparse;
+    };
+    std::shared_ptr<RandomMatrix> random_matrix = std::make_shared<RandomMatrix>(); // the random matrix of the index,
+                                                                                     // shared by share_random_matrix
+    Map<const Matrix<float, Dynamic, Dynamic, RowMajor>> dense_matrix; // the dense random matrix the projections use,
+                                                                       // of random_matrix or of a mapped index file
+    Map<const SparseMatrix<float, RowMajor>> sparse_matrix; // the sparse random matrix the projections use,
+                                                            // of random_matrix or of a mapped index file
+
+    int n_samples; // sample size of data
+    const int dim; // dimension of data
+    const mrpt_kernels::DistanceKernels *dim_kernels; // the distance kernels, compiled for dim if it is common
+    int n_trees; // number of RP-trees
+    int depth; // depth of an RP-tree with median split
+    const float density; // expected ratio of non-zero components in a projection matrix
+    int n_pool; // amount of random vectors needed for all the RP-trees
+    int n_array; // length of the one RP-tree as array
+    const unsigned seed; // seed of the random projections, 0 if every build is random
+    Projection projection; // distribution of the components of the random projections
+    const Metric metric; // the similarity the nearest neighbors are searched by
+    float max_norm; // the largest norm of the data the INNER_PRODUCT trees were built from
+    unsigned build_seed; // seed the random projections of the index were generated from
+    int first_tree; // the number of tree 0 in the forest the trees are a part of, see grow_part
+    int forest_trees; // the trees of that forest, which number the random streams of the samples of grow
+    int split_sample_size; // the number of points the splits of larger nodes are estimated from, or 0 for exact medians
+    int build_sample_size; // the number of points the trees are grown from before all are routed, or 0 for all
+    int leaf_size_limit; // the largest leaf the trees are built with, or 0 for no limit
+    int n_split_candidates; // the number of random vectors the vector of each level is chosen from
+    int direction_sample_size; // the number of points the random vectors of the levels are compared on
+    int hadamard_size; // length of the Walsh-Hadamard transforms of HADAMARD projections, dim rounded up to a power of 2
+    VectorXf hadamard_signs; // sign flips of the blocks of HADAMARD projections
+    VectorXi hadamard_rows; // the row of the Hadamard matrix of each HADAMARD projection
+    int prefetch_distance; // how many candidates ahead the linear search prefetches, -1 for automatic
+    bool advise_pages; // whether the pages of the candidates are requested with madvise before the linear search
+    bool sort_candidates; // whether the candidates are sorted by id before the linear search
+    int interleave_size; // the number of queries of query_batch whose votes are counted in turns, 1 for none
+    bool leaf_major_votes; // whether the votes of the groups of interleave_size are counted leaf by leaf
+    bool batch_rerank; // whether query_batch scores the candidates of a group by one matrix product
+    int batch_block_size; // the most queries of a block of query_batch
+    int parallel_scoring_min; // the fewest candidates a query scores on several threads, 0 for never
+    std::vector<float> margin_thresholds; // the margins past which a tree gives one more vote, empty for one vote
+    int n_query_threads; // the threads of the batch queries, 0 for the OpenMP default
+    bool huge_pages; // whether large arrays are backed by transparent huge pages
+    bool verify_checksums; // whether the loads check the checksums of index files
+    Quantization quantization; // the quantized copy of the data the linear search scores the candidates against
+    int shortlist_size; // the number of candidates re-ranked with the data, 0 for 4 * k and negative for none
+    std::vector<uint8_t> codes; // the quantized search data, in internal id order; empty without quantization
+    VectorXf code_offset; // the value of code 0 in each dimension, for INT8 codes
+    VectorXf code_scale; // the step between consecutive codes in each dimension, for INT8 codes
+    bool byte_data; // whether the INT8 codes are the 8-bit data the index was constructed with, which has no floats
+    int pq_subspaces; // the number of subspaces of PQ codes, or of principal components of PCA codes
+    VectorXi pq_first; // the first dimension of each subspace of PQ codes, followed by dim
+    MatrixXf pq_centroids; // column c holds centroid c of all subspaces of PQ codes, one subspace after another
+    VectorXf binary_thresholds; // the median projection of the data onto each random vector, for BINARY codes
+    VectorXf pca_mean; // the mean of the data, subtracted before projecting onto the principal components
+    MatrixXf pca_components; // column c holds principal component c of the data, for PCA codes
+    Quantization projection_precision; // the precision of the dense random matrix the single queries are projected with
+    std::vector<uint16_t> projection_half; // the dense random matrix as half precision floats, for FLOAT16
+    std::vector<int8_t> projection_int8; // the dense random matrix as 8-bit codes, row by row, for INT8
+    VectorXf projection_step; // the step between consecutive codes in each row of projection_int8
+    std::vector<int64_t> graph_indptr; // the neighbors of original id i in the graph of set_graph are
+    std::vector<int> graph_neighbors;  // graph_neighbors[graph_indptr[i], graph_indptr[i + 1]), by original id
+    int graph_hops; // the most samples the graph walk of a query expands, 0 for no walk
+    int graph_beam; // the nearest samples the graph walk keeps, 0 for k
+    bool query_planner; // whether the queries choose between the trees and brute force, see set_query_planner
+    PlannerCosts plan_costs; // the costs the planner estimates the plans with
+    std::vector<int> sign_first; // for sparse RADEMACHER projections, where the +1 and then the -1 columns of each
+                                 // row start in sign_columns, followed by their end; empty otherwise
+    std::vector<int> sign_columns; // the columns of the nonzero components of the sparse random matrix by sign
+    ProgressCallback progress_callback; // reports the progress of grow, empty if it is silent
+    int64_t progress_interval_ns; // the least time between two progress reports
+    std::atomic<int> n_built_trees; // the number of trees grow has built so far
+    std::atomic<int64_t> last_progress_ns; // the time of the last progress report, or of the start of grow
+    std::atomic<bool> reporting_progress; // whether a thread is calling progress_callback
+    std::shared_ptr<mrpt_executor::Executor> build_executor; // the pool of set_build_priority, or null
+    double build_duty_cycle; // the share of the time the threads of grow work, 1 unless set_build_priority
+    const std::function<bool(int)> *data_fill; // waits for the data being written during grow_pipelined, or null
+    BuildStats last_build; // the phases of the last grow
+};
+
+#endif // CPP_MRPT_H_
+
@@ -0,0 +1,386 @@
+#ifndef CPP_ROLLING_MRPT_H_
+#define CPP_ROLLING_MRPT_H_
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+#include "Mrpt.h"
+
+/*
+ * A rolling index over a stream of points of which only the most recent
+ * matter, such as the items of the last days of a feed. The points are
+ * inserted into a small mutable head, which the queries search exactly, and
+ * seal builds the head into an Mrpt partition of its own, for example once a
+ * day. A query searches the partitions in parallel and merges their k nearest
+ * neighbors with those of the head. The oldest partitions are expired by
+ * dropping them whole, instead of deleting their points one by one, and the
+ * index keeps at most max_partitions of them.
+ *
+ * The points are numbered in the order of insertion with 64-bit ids, which
+ * stay the same when older partitions expire. All partitions are built with
+ * the same seed, so those of the same depth share one random matrix and a
+ * query is projected once for them.
+ *
+ * The queries take a reference to the current partitions and head, as the
+ * SnapshotHandle of mrpt_snapshot.h does, so they never take a lock and can
+ * run concurrently with insert, seal and expire. Those are serialized with
+ * each other: an insert waits while seal builds a partition, and the queries
+ * are answered from the head meanwhile. An expired partition is freed when
+ * the last query using it is done.
+ */
+class RollingMrpt {
+ public:
+    /**
+    * Creates an empty rolling index.
+    * @param dim_ - The dimension of the points
+    * @param n_trees_ - The number of trees of each partition
+    * @param depth_ - The depth of the trees, lowered for partitions of fewer than 2^depth_ points
+    * @param density_ - Expected ratio of non-zero components in a projection matrix
+    * @param seed_ - The seed of the random projections of all partitions. If 0, a random
+    * seed is drawn for the index.
+    * @param projection_ - The distribution of the components of the projection matrix
+    * @param metric_ - The similarity the nearest neighbors are searched by
+    * @param max_partitions_ - The most partitions kept; seal expires the oldest beyond them, 0 for no limit
+    * @param head_capacity_ - The most points of the head, which insert seals when it is full.
+    * The queries score all points of the head, so it bounds the cost of that.
+    */
+    RollingMrpt(int dim_, int n_trees_, int depth_, float density_, unsigned seed_ = 0,
+                Mrpt::Projection projection_ = Mrpt::GAUSSIAN, Mrpt::Metric metric_ = Mrpt::EUCLIDEAN,
+                int max_partitions_ = 0, int head_capacity_ = 65536) :
+        dim(dim_), n_trees(n_trees_), depth(depth_), density(density_),
+        seed(seed_ ? seed_ : std::random_device()() | 1), projection(projection_), metric(metric_),
+        max_partitions(std::max(0, max_partitions_)), head_capacity(std::max(chunk_points, head_capacity_)),
+        next_id(0), current(std::make_shared<State>()) {
+        current->head = std::make_shared<Head>(dim, head_capacity, 0);
+    }
+
+    RollingMrpt(const RollingMrpt &) = delete;
+    RollingMrpt &operator=(const RollingMrpt &) = delete;
+
+    /**
+    * Appends n points stored one after another in points to the head. They
+    * get the ids following those of the points inserted before, and each is
+    * visible to the queries that start after it is written. A full head is
+    * sealed first.
+    * @return The id of the first point
+    */
+    int64_t insert(const float *points, int n) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        const int64_t first = next_id;
+        std::shared_ptr<Head> head = std::atomic_load(&current)->head;
+        for (int i = 0; i < n; ++i) {
+            if (head->n_written == head_capacity) {
+                seal_locked();
+                head = std::atomic_load(&current)->head;
+            }
+            head->append(points + (size_t) i * dim, metric);
+            ++next_id;
+        }
+        return first;
+    }
+
+    /**
+    * Builds the points of the head into a partition and starts an empty head.
+    * The queries keep searching the old head until the partition is published.
+    * If there are more than max_partitions partitions, the oldest are expired.
+    * @return false if the head has fewer than two points, which it then keeps
+    */
+    bool seal() {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        return seal_locked();
+    }
+
+    /**
+    * Drops the n_oldest oldest partitions. The queries that start afterwards no
+    * longer find their points, and their memory is freed once the queries that
+    * are searching them are done.
+    * @return The number of partitions dropped
+    */
+    int expire(int n_oldest) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        return expire_locked(n_oldest);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q among the points of the
+    * partitions and of the head, with the ids given by insert. The partitions
+    * are searched in parallel, each as Mrpt::query does, and the head exactly.
+    * Lock-free, and can be called from any number of threads concurrently with
+    * everything else.
+    * @param q - The query, dim floats
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the ids of the k approximate nearest neighbors, -1 where fewer were found
+    * @param out_distances - Output buffer for the distances of the k approximate nearest neighbors (optional parameter)
+    */
+    void query(const float *q, int k, int votes_required, int64_t *out, float *out_distances = nullptr) const {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        query_state(*state, q, k, votes_required, out, out_distances, true);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the queries stored as
+    * the columns of Q, which are divided between the threads; each query
+    * searches the partitions and the head in turn.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_batch(const Map<const MatrixXf> &Q, int k, int votes_required, int64_t *out,
+                     float *out_distances = nullptr) const {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        const int n_queries = Q.cols();
+
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (int i = 0; i < n_queries; ++i)
+            query_state(*state, Q.col(i).data(), k, votes_required, out + (size_t) i * k,
+                        out_distances ? out_distances + (size_t) i * k : nullptr, false);
+    }
+
+    /**
+    * Returns the number of partitions.
+    */
+    int n_partitions() const {
+        return std::atomic_load(&current)->partitions.size();
+    }
+
+    /**
+    * Returns the id of the oldest point the queries can find; those before it
+    * have expired.
+    */
+    int64_t first_id() const {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        return state->partitions.empty() ? state->head->first_id : state->partitions[0]->first_id;
+    }
+
+    /**
+    * Returns the number of points the queries can find, in the partitions and
+    * in the head.
+    */
+    int64_t size() const {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        int64_t n = state->head->n_visible.load(std::memory_order_acquire);
+        for (const std::shared_ptr<Partition> &partition : state->partitions)
+            n += partition->n;
+        return n;
+    }
+
+    /**
+    * Returns the number of points in the head, those inserted since the last seal.
+    */
+    int head_size() const {
+        return std::atomic_load(&current)->head->n_visible.load(std::memory_order_acquire);
+    }
+
+ private:
+    static const int chunk_points = 1024; // the points of a chunk of the head
+
+    // the points inserted since the last seal, in chunks that never move, each followed
+    // by the squared norms of its points
+    struct Head {
+        Head(int dim_, int capacity, int64_t first_id_) :
+            dim(dim_), first_id(first_id_), n_written(0), n_visible(0),
+            chunks((capacity + chunk_points - 1) / chunk_points),
+            directory(new std::atomic<const float *>[chunks.size()]) {
+            for (size_t c = 0; c < chunks.size(); ++c)
+                directory[c].store(nullptr);
+        }
+
+        // called by the writer only
+        void append(const float *x, Mrpt::Metric metric) {
+            const int c = n_written / chunk_points, i = n_written % chunk_points;
+            if (!chunks[c]) {
+                chunks[c].reset(new float[(size_t) chunk_points * (dim + 1)]);
+                directory[c].store(chunks[c].get(), std::memory_order_release);
+            }
+            float *chunk = chunks[c].get();
+            std::copy(x, x + dim, chunk + (size_t) i * dim);
+            chunk[(size_t) chunk_points * dim + i] = metric == Mrpt::EUCLIDEAN ? 0 : Map<const VectorXf>(x, dim).squaredNorm();
+            n_visible.store(++n_written, std::memory_order_release);
+        }
+
+        const float *point(int i) const {
+            return directory[i / chunk_points].load(std::memory_order_acquire) + (size_t) (i % chunk_points) * dim;
+        }
+
+        float squared_norm(int i) const {
+            return directory[i / chunk_points].load(std::memory_order_acquire)[(size_t) chunk_points * dim + i % chunk_points];
+        }
+
+        int dim;
+        int64_t first_id; // the id of the first point
+        int n_written; // the points written, known to the writer only
+        std::atomic<int> n_visible; // the points the queries see
+        std::vector<std::unique_ptr<float[]>> chunks; // owned by the writer, read through directory
+        std::unique_ptr<std::atomic<const float *>[]> directory;
+    };
+
+    // a sealed head, indexed by an Mrpt over its own copy of the points
+    struct Partition {
+        std::vector<float> data;
+        std::unique_ptr<Mrpt> index;
+        int64_t first_id; // the id of the first point
+        int n;
+        bool shares_previous; // whether it shares the random matrix of the partition before it
+    };
+
+    // what the queries search, replaced as a whole by the writer
+    struct State {
+        std::vector<std::shared_ptr<Partition>> partitions; // the oldest first
+        std::shared_ptr<Head> head;
+    };
+
+    int dim, n_trees, depth;
+    float density;
+    unsigned seed;
+    Mrpt::Projection projection;
+    Mrpt::Metric metric;
+    int max_partitions, head_capacity;
+    int64_t next_id; // the id of the next point inserted, known to the writer only
+    std::shared_ptr<State> current; // accessed with the atomic functions of shared_ptr only
+    std::mutex writer_mutex; // serializes insert, seal and expire, never taken by the queries
+
+    bool seal_locked() {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        const Head &head = *state->head;
+        const int n = head.n_written;
+        if (n < 2)
+            return false;
+
+        std::shared_ptr<Partition> partition = std::make_shared<Partition>();
+        partition->data.resize((size_t) n * dim);
+        for (int i = 0; i < n; ++i)
+            std::copy(head.point(i), head.point(i) + dim, partition->data.data() + (size_t) i * dim);
+        partition->first_id = head.first_id;
+        partition->n = n;
+
+        // the trees of a partition of fewer than 2^depth points are as deep as its points allow
+        int partition_depth = 1;
+        while (partition_depth < depth && (2 << partition_depth) <= n)
+            ++partition_depth;
+        partition->index.reset(new Mrpt(Mrpt::Data::borrow(partition->data.data(), dim, n), n_trees,
+                                        partition_depth, density, seed, projection, metric));
+        partition->index->grow(1);
+        partition->shares_previous = !state->partitions.empty() &&
+                                     partition->index->share_random_matrix(*state->partitions.back()->index);
+
+        std::shared_ptr<State> next = std::make_shared<State>();
+        next->partitions = state->partitions;
+        next->partitions.push_back(std::move(partition));
+        next->head = std::make_shared<Head>(dim, head_capacity, head.first_id + n);
+        std::atomic_store(&current, next);
+        if (max_partitions)
+            expire_locked((int) next->partitions.size() - max_partitions);
+        return true;
+    }
+
+    int expire_locked(int n_oldest) {
+        const std::shared_ptr<State> state = std::atomic_load(&current);
+        n_oldest = std::max(0, std::min<int>(n_oldest, state->partitions.size()));
+        if (!n_oldest)
+            return 0;
+        std::shared_ptr<State> next = std::make_shared<State>();
+        next->partitions.assign(state->partitions.begin() + n_oldest, state->partitions.end());
+        next->head = state->head;
+        std::atomic_store(&current, next);
+        return n_oldest;
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q in state, searching the
+    * partitions with OpenMP threads if parallel is set.
+    */
+    void query_state(const State &state, const float *q, int k, int votes_required, int64_t *out,
+                     float *out_distances, bool parallel) const {
+        const int n_partitions = state.partitions.size();
+        const Map<const VectorXf> query_vector(q, dim);
+
+        // a query is projected once for each run of partitions sharing a random matrix
+        std::vector<VectorXf> projected(n_partitions);
+        for (int p = 0; p < n_partitions; ++p)
+            if (!p || !state.partitions[p]->shares_previous)
+                projected[p] = state.partitions[p]->index->project_query(query_vector);
+        std::vector<const float *> projected_query(n_partitions);
+        for (int p = 0; p < n_partitions; ++p)
+            projected_query[p] = projected[p].size() ? projected[p].data() : projected_query[p - 1];
+
+        // the neighbors of the partitions, followed by those of the head
+        std::vector<int> ids((size_t) (n_partitions + 1) * k, -1);
+        std::vector<float> distances((size_t) (n_partitions + 1) * k);
+        #pragma omp parallel for schedule(dynamic) if (parallel && n_partitions > 0)
+        for (int p = 0; p <= n_partitions; ++p) {
+            if (p < n_partitions)
+                state.partitions[p]->index->query_projected(query_vector, projected_query[p], k, votes_required,
+                                                            ids.data() + (size_t) p * k, distances.data() + (size_t) p * k);
+            else
+                query_head(*state.head, q, k, ids.data() + (size_t) p * k, distances.data() + (size_t) p * k);
+        }
+
+        std::vector<std::pair<float, int64_t>> candidates;
+        for (int p = 0; p <= n_partitions; ++p) {
+            const int64_t first_id = p < n_partitions ? state.partitions[p]->first_id : state.head->first_id;
+            for (int j = 0; j < k; ++j) {
+                const int id = ids[(size_t) p * k + j];
+                if (id >= 0)
+                    candidates.emplace_back(distances[(size_t) p * k + j], first_id + id);
+            }
+        }
+        merge(candidates, k, out, out_distances);
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of q among the points of the head
+    * visible when the query starts, with the distances of Mrpt::query.
+    */
+    void query_head(const Head &head, const float *q, int k, int *out, float *out_distances) const {
+        const int n_visible = head.n_visible.load(std::memory_order_acquire);
+        const mrpt_kernels::DistanceKernels &kernels = mrpt_kernels::distance_kernels(dim);
+        const float query_scale = metric == Mrpt::COSINE ?
+            1 / std::sqrt(std::max(Map<const VectorXf>(q, dim).squaredNorm(), 1e-30f)) : 1;
+        Mrpt::TopK heap(k);
+        for (int i = 0; i < n_visible; ++i) {
+            const float *x = head.point(i);
+            float score;
+            if (metric == Mrpt::EUCLIDEAN) {
+                score = kernels.l2(q, x, dim);
+            } else {
+                score = -kernels.dot(q, x, dim);
+                const float squared_norm = head.squared_norm(i);
+                if (metric == Mrpt::COSINE)
+                    score *= squared_norm > 0 ? query_scale / std::sqrt(squared_norm) : 0;
+            }
+            heap.push(score, i);
+        }
+        const int n_found = heap.extract(out, out_distances);
+        for (int i = 0; i < n_found; ++i)
+            out_distances[i] = metric == Mrpt::EUCLIDEAN ? std::sqrt(out_distances[i]) : -out_distances[i];
+    }
+
+    /**
+    * Writes the k nearest of the (distance, id) candidates to out, the largest
+    * similarities first for the INNER_PRODUCT and COSINE metrics. If fewer than
+    * k were found, the remaining output slots are set to -1.
+    */
+    void merge(std::vector<std::pair<float, int64_t>> &candidates, int k, int64_t *out, float *out_distances) const {
+        const int n_found = std::min<int>(k, candidates.size());
+        if (metric == Mrpt::EUCLIDEAN)
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end());
+        else
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end(),
+                              std::greater<std::pair<float, int64_t>>());
+        for (int j = 0; j < k; ++j) {
+            out[j] = j < n_found ? candidates[j].second : -1;
+            if (out_distances)
+                out_distances[j] = j < n_found ? candidates[j].first : -1;
+        }
+    }
+};
+
+#endif // CPP_ROLLING_MRPT_H_
@@ -0,0 +1,286 @@
+#ifndef CPP_SHARDED_MRPT_H_
+#define CPP_SHARDED_MRPT_H_
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+#include "Mrpt.h"
+
+/*
+ * One logical index over several Mrpt indexes, the shards, that each hold a
+ * disjoint part of the data. The points of the shards are numbered one shard
+ * after another with 64-bit ids, so the sharded index is not limited to 2^31
+ * points. All shards are built with the same seed, so they have the same
+ * random matrix, and they keep only one copy of it: a query is then projected
+ * once and the projections are routed in every shard. The k nearest neighbors found in each shard are merged into the k
+ * nearest neighbors of the whole data.
+ */
+class ShardedMrpt {
+ public:
+    /**
+    * Creates a sharded index whose shards are the matrices in shard_data, for
+    * example separate files that are memory mapped. The points of shard i get the
+    * ids following those of shard i - 1. The index is built with grow or loaded
+    * with load.
+    * @param shard_data - The data of the shards. The data the matrices map must outlive
+    * the index, the matrix objects need not.
+    * @param n_trees_ - The number of trees in each shard
+    * @param depth_ - The depth of the trees
+    * @param density_ - Expected ratio of non-zero components in a projection matrix
+    * @param seed_ - The seed of the random projections of all shards. If 0, a random
+    * seed is drawn for the index.
+    * @param projection_ - The distribution of the components of the projection matrix
+    * @param metric_ - The similarity the nearest neighbors are searched by
+    */
+    ShardedMrpt(const std::vector<Map<const MatrixXf> *> &shard_data, int n_trees_, int depth_, float density_,
+                unsigned seed_ = 0, Mrpt::Projection projection_ = Mrpt::GAUSSIAN,
+                Mrpt::Metric metric_ = Mrpt::EUCLIDEAN) :
+        metric(metric_), shared_projection(false) {
+        add_shards(shard_data, n_trees_, depth_, density_, seed_, projection_);
+    }
+
+    /**
+    * Creates a sharded index over the columns of a single data matrix, split into
+    * n_shards ranges of consecutive columns. The ids are the columns of X.
+    */
+    ShardedMrpt(const Map<const MatrixXf> &X, int n_shards, int n_trees_, int depth_, float density_,
+                unsigned seed_ = 0, Mrpt::Projection projection_ = Mrpt::GAUSSIAN,
+                Mrpt::Metric metric_ = Mrpt::EUCLIDEAN) :
+        metric(metric_), shared_projection(false) {
+        std::vector<Map<const MatrixXf>> column_ranges;
+        std::vector<Map<const MatrixXf> *> shard_data;
+        const int64_t n = X.cols();
+        column_ranges.reserve(n_shards);
+        for (int i = 0; i < n_shards; ++i) {
+            const int64_t first = n * i / n_shards, last = n * (i + 1) / n_shards;
+            column_ranges.emplace_back(X.data() + first * X.rows(), X.rows(), last - first);
+            shard_data.push_back(&column_ranges.back());
+        }
+        add_shards(shard_data, n_trees_, depth_, density_, seed_, projection_);
+    }
+
+    ShardedMrpt(const ShardedMrpt &) = delete;
+
+    /**
+    * Builds the trees of every shard, one shard after another, and lets all
+    * shards use the random matrix of the first one.
+    * @param keep_data - See Mrpt::grow
+    * @param memory_limit - See Mrpt::grow; the limit applies to each shard
+    * @param stream_data - See Mrpt::grow
+    */
+    void grow(int keep_data, size_t memory_limit = 0, bool stream_data = false) {
+        for (std::unique_ptr<Mrpt> &shard : shards)
+            shard->grow(keep_data, memory_limit, stream_data);
+        share_random_matrix();
+    }
+
+    /**
+    * Copies the data of each shard into the leaf order of its first tree, see
+    * Mrpt::reorder_data.
+    */
+    void reorder_data() {
+        for (std::unique_ptr<Mrpt> &shard : shards)
+            shard->reorder_data();
+    }
+
+    /**
+    * Saves each shard to a file of its own, whose path is path followed by a dot
+    * and the number of the shard.
+    * @return false if saving any of the shards fails
+    */
+    bool save(const char *path) const {
+        bool ok = true;
+        for (size_t i = 0; i < shards.size(); ++i)
+            ok = shards[i]->save(shard_path(path, i).c_str()) && ok;
+        return ok;
+    }
+
+    /**
+    * Loads the shards saved by save with the same path. The shards share the random
+    * matrix of the first shard if they were built with the same seed.
+    * @param map_file - See Mrpt::load
+    * @return false if loading any of the shards fails
+    */
+    bool load(const char *path, bool map_file = false) {
+        bool ok = true;
+        for (size_t i = 0; i < shards.size() && ok; ++i)
+            ok = shards[i]->load(shard_path(path, i).c_str(), map_file);
+        if (ok)
+            share_random_matrix();
+        return ok;
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q in the whole data. The shards
+    * are queried in parallel.
+    * @param q - The query object whose neighbors the function finds
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the ids of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    */
+    void query(const Ref<const VectorXf> &q, int k, int votes_required, int64_t *out,
+               float *out_distances = nullptr) const {
+        const int n_shards = shards.size();
+        std::vector<int> ids((size_t) n_shards * k);
+        std::vector<float> distances((size_t) n_shards * k);
+        const VectorXf projected_query = shared_projection ? shards[0]->project_query(q) : VectorXf();
+
+        #pragma omp parallel for
+        for (int i = 0; i < n_shards; ++i)
+            query_shard(i, q, projected_query, k, votes_required, ids.data() + (size_t) i * k,
+                        distances.data() + (size_t) i * k);
+
+        merge(ids.data(), distances.data(), k, out, out_distances);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the queries stored as
+    * the columns of Q. The queries are split into blocks that are divided between
+    * the threads, and each query is answered by all shards in turn.
+    * @param Q - The query objects as a dim x n_queries matrix
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_batch(const Map<const MatrixXf> &Q, int k, int votes_required, int64_t *out,
+                     float *out_distances = nullptr) const {
+        const int n_queries = Q.cols(), n_shards = shards.size(), max_block_size = 64;
+        const int block_size = std::max(1, std::min(max_block_size, n_queries / max_threads()));
+        const int n_blocks = (n_queries + block_size - 1) / block_size;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < n_blocks; ++b) {
+            const int first = b * block_size, n = std::min(block_size, n_queries - first);
+            const MatrixXf projected_queries = shared_projection ? shards[0]->project_queries(Q.middleCols(first, n))
+                                                                 : MatrixXf();
+            std::vector<int> ids((size_t) n_shards * k);
+            std::vector<float> distances((size_t) n_shards * k);
+
+            for (int i = first; i < first + n; ++i) {
+                const VectorXf projected_query = shared_projection ? projected_queries.col(i - first) : VectorXf();
+                for (int s = 0; s < n_shards; ++s)
+                    query_shard(s, Q.col(i), projected_query, k, votes_required, ids.data() + (size_t) s * k,
+                                distances.data() + (size_t) s * k);
+                merge(ids.data(), distances.data(), k, out + (size_t) i * k,
+                      out_distances ? out_distances + (size_t) i * k : nullptr);
+            }
+        }
+    }
+
+    /**
+    * Returns the number of shards.
+    */
+    int n_shards() const {
+        return shards.size();
+    }
+
+    /**
+    * Returns the shard i, for example to change its settings with set_prefetch.
+    */
+    Mrpt &shard(int i) {
+        return *shards[i];
+    }
+
+    /**
+    * Returns the id of the first point of shard i; shard n_shards() gives the
+    * number of points in all shards.
+    */
+    int64_t shard_offset(int i) const {
+        return offsets[i];
+    }
+
+ private:
+    /**
+    * Creates a shard for each matrix in shard_data. Without a seed, one seed is
+    * drawn for all shards, so that they can share their random matrix.
+    */
+    void add_shards(const std::vector<Map<const MatrixXf> *> &shard_data, int n_trees_, int depth_, float density_,
+                    unsigned seed_, Mrpt::Projection projection_) {
+        const unsigned seed = seed_ ? seed_ : std::random_device()() | 1;
+        int64_t offset = 0;
+        for (Map<const MatrixXf> *X : shard_data) {
+            shards.emplace_back(new Mrpt(X, n_trees_, depth_, density_, seed, projection_, metric));
+            offsets.push_back(offset);
+            offset += X->cols();
+        }
+        offsets.push_back(offset);
+    }
+
+    static std::string shard_path(const char *path, size_t i) {
+        return std::string(path) + "." + std::to_string(i);
+    }
+
+    static int max_threads() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    /**
+    * Lets the shards use the random matrix of the first shard. Shards whose matrix
+    * differs, for example because they were loaded from files built with other
+    * seeds, keep their own, and the queries are then projected by every shard.
+    */
+    void share_random_matrix() {
+        shared_projection = true;
+        for (size_t i = 1; i < shards.size(); ++i)
+            shared_projection = shards[i]->share_random_matrix(*shards[0]) && shared_projection;
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q in shard i, routing the shared
+    * projections of q if there are any.
+    */
+    void query_shard(int i, const Ref<const VectorXf> &q, const VectorXf &projected_query, int k, int votes_required,
+                     int *ids, float *distances) const {
+        if (shared_projection)
+            shards[i]->query_projected(q, projected_query.data(), k, votes_required, ids, distances);
+        else
+            shards[i]->query(q, k, votes_required, ids, distances);
+    }
+
+    /**
+    * Merges the k nearest neighbors found in each shard, laid out one shard after
+    * another in ids and distances, into the k nearest neighbors of all shards with
+    * global ids. If fewer than k neighbors were found, the remaining output slots
+    * are set to -1. The similarities of the INNER_PRODUCT and COSINE metrics are
+    * merged the largest first.
+    */
+    void merge(const int *ids, const float *distances, int k, int64_t *out, float *out_distances) const {
+        std::vector<std::pair<float, int64_t>> candidates;
+        for (size_t s = 0; s < shards.size(); ++s) {
+            for (int j = 0; j < k; ++j) {
+                const int id = ids[s * k + j];
+                if (id >= 0)
+                    candidates.emplace_back(distances[s * k + j], offsets[s] + id);
+            }
+        }
+
+        const int n_found = std::min<int>(k, candidates.size());
+        if (metric == Mrpt::EUCLIDEAN)
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end());
+        else
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end(),
+                              std::greater<std::pair<float, int64_t>>());
+        for (int j = 0; j < k; ++j) {
+            out[j] = j < n_found ? candidates[j].second : -1;
+            if (out_distances)
+                out_distances[j] = j < n_found ? candidates[j].first : -1;
+        }
+    }
+
+    std::vector<std::unique_ptr<Mrpt>> shards;
+    std::vector<int64_t> offsets; // the id of the first point of each shard, followed by the number of all points
+    const Mrpt::Metric metric; // the similarity the nearest neighbors are searched by
+    bool shared_projection; // whether all shards use the random matrix of the first one
+};
+
+#endif // CPP_SHARDED_MRPT_H_
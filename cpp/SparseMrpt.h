@@ -0,0 +1,267 @@
+#ifndef CPP_SPARSE_MRPT_H_
+#define CPP_SPARSE_MRPT_H_
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <cmath>
+
+#include "Mrpt.h"
+
+/*
+ * An index of sparse data, such as TF-IDF or hashed feature vectors with
+ * millions of dimensions and a few nonzeros each, stored as the columns of a
+ * compressed sparse column matrix; a CSR matrix with a point on each row has
+ * the same arrays. The trees are the RP-trees of Mrpt with sparse Gaussian
+ * random vectors. The data is projected with a sparse-sparse product per tree,
+ * and the linear search scores the candidates with sparse-sparse dot
+ * products, so neither the data nor the queries are ever made dense.
+ */
+class SparseMrpt {
+ public:
+    /**
+    * Creates an index of the points stored as the columns of X_. The trees are
+    * built with grow.
+    * @param X_ - The data, dim x n_samples, with the nonzeros of each column in
+    * increasing order of rows. The matrix must outlive the index.
+    * @param n_trees_ - The number of trees to be used in the index
+    * @param depth_ - The depth of the trees
+    * @param density_ - Expected ratio of non-zero components in a random vector.
+    * The vectors should share a few dimensions with most of the points, so with
+    * very sparse data it has to be larger than for dense data.
+    * @param seed_ - The seed of the random projections. If 0, every build draws a
+    * new random seed.
+    */
+    SparseMrpt(const Map<const SparseMatrix<float>> *X_, int n_trees_, int depth_, float density_,
+               unsigned seed_ = 0) :
+        X(X_),
+        n_samples(X_->cols()),
+        dim(X_->rows()),
+        n_trees(n_trees_),
+        depth(depth_),
+        density(density_),
+        seed(seed_) { }
+
+    SparseMrpt(const SparseMrpt &) = delete;
+
+    /**
+    * Generates the random vectors and builds the trees, in parallel over the
+    * trees. The projections of one tree take depth * n_samples floats.
+    */
+    void grow() {
+        const unsigned build_seed = seed ? seed : std::random_device()();
+        const int n_leaves = 1 << depth;
+        random_matrices.assign(n_trees, SparseMatrix<float>());
+        split_points = MatrixXf((n_leaves << 1), n_trees);
+        leaf_first = MatrixXi(n_leaves + 1, n_trees);
+        leaf_ids = MatrixXi(n_samples, n_trees);
+        norms = VectorXf(n_samples);
+        for (int j = 0; j < n_samples; ++j)
+            norms(j) = X->col(j).squaredNorm();
+
+        #pragma omp parallel for
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            std::seed_seq seq{build_seed, static_cast<unsigned>(n_tree)};
+            std::mt19937 gen(seq);
+            random_matrices[n_tree] = random_matrix(gen);
+
+            const MatrixXf projections = random_matrices[n_tree] * *X;
+            int *indices = leaf_ids.col(n_tree).data();
+            std::iota(indices, indices + n_samples, 0);
+            grow_subtree(indices, indices + n_samples, 0, 0, n_tree, projections);
+            leaf_first(n_leaves, n_tree) = n_samples;
+        }
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of q: the points in the leaves of
+    * q that get at least votes_required votes are searched for the nearest ones.
+    * @param q - The query object as a sparse vector of dim components
+    * @param k - The number of neighbors the user wants the function to return
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for distances of the k approximate nearest neighbors (optional parameter)
+    */
+    void query(const SparseVector<float> &q, int k, int votes_required, int *out,
+               float *out_distances = nullptr) const {
+        std::vector<int> votes(n_samples);
+        query(q, k, votes_required, out, out_distances, votes);
+    }
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the queries stored as
+    * the columns of Q, in parallel over the queries.
+    * @param Q - The query objects as a dim x n_queries sparse matrix
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void query_batch(const Map<const SparseMatrix<float>> &Q, int k, int votes_required, int *out,
+                     float *out_distances = nullptr) const {
+        const int n_queries = Q.cols();
+
+        #pragma omp parallel
+        {
+            std::vector<int> votes(n_samples);
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n_queries; ++i) {
+                const SparseVector<float> q = Q.col(i);
+                query(q, k, votes_required, out + (size_t) i * k,
+                      out_distances ? out_distances + (size_t) i * k : nullptr, votes);
+            }
+        }
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of q among all the points.
+    * @param q - The query object as a sparse vector of dim components
+    * @param k - The number of neighbors searched for
+    * @param out - Output buffer for the indices of the k nearest neighbors
+    * @param out_distances - Output buffer for the distances of the k nearest neighbors (optional parameter)
+    */
+    void exact_knn(const SparseVector<float> &q, int k, int *out, float *out_distances = nullptr) const {
+        std::vector<int> indices(n_samples);
+        std::iota(indices.begin(), indices.end(), 0);
+        exact_knn(q, k, indices.data(), n_samples, out, out_distances);
+    }
+
+    /**
+    * Finds the exact k nearest neighbors of each of the queries stored as the
+    * columns of Q, in parallel over the queries.
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to out[i * k, (i + 1) * k)
+    * @param out_distances - Output buffer for the distances, laid out as out (optional parameter)
+    */
+    void exact_knn_batch(const Map<const SparseMatrix<float>> &Q, int k, int *out,
+                         float *out_distances = nullptr) const {
+        std::vector<int> indices(n_samples);
+        std::iota(indices.begin(), indices.end(), 0);
+        const int n_queries = Q.cols();
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < n_queries; ++i) {
+            const SparseVector<float> q = Q.col(i);
+            exact_knn(q, k, indices.data(), n_samples, out + (size_t) i * k,
+                      out_distances ? out_distances + (size_t) i * k : nullptr);
+        }
+    }
+
+ private:
+    /**
+    * Returns the depth x dim random matrix of a tree, whose nonzero components
+    * are drawn with probability density. The gaps between consecutive nonzeros
+    * are drawn instead of testing every component, so that generating the
+    * matrix takes time in proportion to its nonzeros, not to dim.
+    */
+    SparseMatrix<float> random_matrix(std::mt19937 &gen) const {
+        std::geometric_distribution<long long> gap_dist(std::min(1.0f, std::max(density, 1e-9f)));
+        std::normal_distribution<float> norm_dist(0, 1);
+        std::vector<Triplet<float>> triplets;
+        for (int row = 0; row < depth; ++row) {
+            for (long long i = gap_dist(gen); i < dim; i += 1 + gap_dist(gen))
+                triplets.push_back(Triplet<float>(row, i, norm_dist(gen)));
+        }
+        SparseMatrix<float> matrix(depth, dim);
+        matrix.setFromTriplets(triplets.begin(), triplets.end());
+        return matrix;
+    }
+
+    /**
+    * Splits the points in [begin, end) by the median of their projections on
+    * level tree_level and recurses into both halves down to the leaves.
+    * @param i - The index of the node in the array of the tree
+    */
+    void grow_subtree(int *begin, int *end, int tree_level, int i, int n_tree, const MatrixXf &projections) {
+        const int n_leaves = 1 << depth;
+        if (tree_level == depth) {
+            leaf_first(i - n_leaves + 1, n_tree) = begin - leaf_ids.col(n_tree).data();
+            return;
+        }
+
+        const int n = end - begin;
+        int *median = begin + (n + 1) / 2;
+        auto by_projection = [&projections, tree_level](int i1, int i2) {
+            return projections(tree_level, i1) < projections(tree_level, i2);
+        };
+        float split = 0;
+        if (n > 0) {
+            std::nth_element(begin, median - 1, end, by_projection);
+            split = projections(tree_level, *(median - 1));
+            if (median < end) {
+                std::nth_element(median, median, end, by_projection);
+                split = (split + projections(tree_level, *median)) / 2;
+            }
+        }
+        split_points(i, n_tree) = split;
+
+        grow_subtree(begin, median, tree_level + 1, 2 * i + 1, n_tree, projections);
+        grow_subtree(median, end, tree_level + 1, 2 * i + 2, n_tree, projections);
+    }
+
+    /**
+    * Queries with the vote counters in votes, which are zero before and after
+    * the query.
+    */
+    void query(const SparseVector<float> &q, int k, int votes_required, int *out, float *out_distances,
+               std::vector<int> &votes) const {
+        const int n_leaves = 1 << depth;
+        std::vector<int> leaves(n_trees), elected;
+
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            const VectorXf projected = random_matrices[n_tree] * q;
+            int idx_tree = 0;
+            for (int d = 0; d < depth; ++d)
+                idx_tree = 2 * idx_tree + (projected(d) <= split_points(idx_tree, n_tree) ? 1 : 2);
+            leaves[n_tree] = idx_tree - n_leaves + 1;
+
+            const int *ids = leaf_ids.col(n_tree).data();
+            for (int j = leaf_first(leaves[n_tree], n_tree); j < leaf_first(leaves[n_tree] + 1, n_tree); ++j) {
+                if (++votes[ids[j]] == votes_required)
+                    elected.push_back(ids[j]);
+            }
+        }
+
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            const int *ids = leaf_ids.col(n_tree).data();
+            for (int j = leaf_first(leaves[n_tree], n_tree); j < leaf_first(leaves[n_tree] + 1, n_tree); ++j)
+                votes[ids[j]] = 0;
+        }
+
+        exact_knn(q, k, elected.data(), elected.size(), out, out_distances);
+    }
+
+    /**
+    * Finds the k nearest neighbors of q among the n_elected points in indices by
+    * the squared distances |x|^2 - 2 x^T q + |q|^2, with sparse dot products.
+    */
+    void exact_knn(const SparseVector<float> &q, int k, const int *indices, int n_elected, int *out,
+                   float *out_distances) const {
+        const float q_norm = q.squaredNorm();
+        Mrpt::TopK heap(k);
+        for (int i = 0; i < n_elected; ++i) {
+            const int j = indices[i];
+            heap.push(norms(j) - 2 * X->col(j).dot(q), j);
+        }
+
+        const int n_found = heap.extract(out, out_distances);
+        if (out_distances) {
+            for (int i = 0; i < n_found; ++i)
+                out_distances[i] = std::sqrt(std::max(0.0f, out_distances[i] + q_norm));
+        }
+    }
+
+    const Map<const SparseMatrix<float>> *X; // the data, one point per column
+    const int n_samples; // sample size of data
+    const int dim; // dimension of data
+    const int n_trees; // number of RP-trees
+    const int depth; // depth of an RP-tree with median split
+    const float density; // expected ratio of non-zero components in a random vector
+    const unsigned seed; // seed of the random projections, 0 if every build is random
+    std::vector<SparseMatrix<float>> random_matrices; // the depth x dim random vectors of each tree
+    MatrixXf split_points; // the split points of the nodes of each tree, one tree per column
+    MatrixXi leaf_first; // the first position of each leaf in leaf_ids, followed by n_samples
+    MatrixXi leaf_ids; // the points of each tree in the order of its leaves
+    VectorXf norms; // the squared norms of the points
+};
+
+#endif // CPP_SPARSE_MRPT_H_
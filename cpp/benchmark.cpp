@@ -0,0 +1,517 @@
+/*
+ * Benchmark of MRPT indexes on standard ANN data sets. Builds an index for
+ * every combination of the given numbers of trees and depths, queries it with
+ * every given vote threshold, and reports the build time, peak memory, index
+ * size, throughput, latency percentiles and recall as CSV or JSON.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -march=native -fopenmp -Icpp -Icpp/lib cpp/benchmark.cpp -o mrpt_benchmark
+ *
+ * The data and the queries are read from .fvecs or .bvecs files, such as those
+ * of SIFT1M, GIST1M and the Deep1B subsets, or from raw float32 files with one
+ * point per row, such as those written by utils/binary_converter.py from HDF5
+ * (GloVe) and other formats, whose dimension is given with --dim unless the
+ * file starts with the header written by mrpt_convert. The true neighbors are read from an .ivecs file or computed by exact search.
+ *
+ * With --build, only the builds are measured, for every combination of the
+ * numbers of threads, numbers of points (the first n of the data), numbers of
+ * trees, depths and densities, to plan the capacity of the builds. Each build
+ * is reported with the wall time of its phases from Mrpt::build_stats, the
+ * peak memory and the allocations made with malloc of glibc during it, and its
+ * speedup over the build of the fewest threads of the same configuration. The
+ * phase with the smallest speedup, the limiting phase, is where the scaling
+ * breaks down, and the bytes of the projections held at once show the memory
+ * that grows with the threads.
+ *
+ * Usage: mrpt_benchmark [options] data queries
+ *        mrpt_benchmark --build [options] data
+ *   --groundtruth path   true neighbors as .ivecs, computed if not given
+ *   --dim d              dimension of raw float32 files without a header
+ *   --trees list         numbers of trees, e.g. 10,50,100 (default 10,50,100)
+ *   --depth list         depths of the trees (default 8,10)
+ *   --votes list         vote thresholds (default 1,2,4,8)
+ *   --density list       expected ratios of non-zero components, default 1 / sqrt(dim)
+ *   --build              measure the builds only
+ *   --threads list       numbers of threads of --build (default 1, 2, 4, ... up to all)
+ *   --n list             numbers of points of --build (default all)
+ *   --k k                number of neighbors searched for (default 10)
+ *   --n-queries n        use only the first n queries
+ *   --seed s             seed of the random projections (default 1)
+ *   --name name          name of the data set in the report
+ *   --json               report as JSON instead of CSV
+ *   --output path        the file the report is written to, stdout by default
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "Mrpt.h"
+#include "mrpt_data.h"
+
+#ifdef __GLIBC__
+/*
+ * The allocations of the build are counted by replacing malloc, which new
+ * and Eigen allocate with, by one that counts the calls and the bytes.
+ */
+static std::atomic<int64_t> n_allocations(0), allocated_bytes(0);
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(n * size, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    n_allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+}
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string data_path, query_path, groundtruth_path, name, output_path;
+    std::vector<int> trees{10, 50, 100}, depths{8, 10}, votes{1, 2, 4, 8}, threads, sizes;
+    std::vector<float> densities;
+    int dim = 0, k = 10, n_queries = 0;
+    unsigned seed = 1;
+    bool json = false, build = false;
+};
+
+struct PointSet {
+    std::vector<float> values;
+    int dim = 0, n = 0;
+};
+
+bool ends_with(const std::string &s, const char *suffix) {
+    const size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+std::vector<int> parse_list(const char *s) {
+    std::vector<int> list;
+    for (const char *p = s; *p; ) {
+        char *end;
+        const long value = std::strtol(p, &end, 10);
+        if (end == p) break;
+        list.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return list;
+}
+
+std::vector<float> parse_float_list(const char *s) {
+    std::vector<float> list;
+    for (const char *p = s; *p; ) {
+        char *end;
+        const float value = std::strtof(p, &end);
+        if (end == p) break;
+        list.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return list;
+}
+
+/**
+* Reads a file of vectors, each stored as its dimension followed by its
+* components, which are float32 in .fvecs, int32 in .ivecs and uint8 in .bvecs
+* files. At most max_n vectors are read if max_n is positive.
+*/
+template<typename T>
+bool read_vecs(const std::string &path, int max_n, std::vector<T> &values, int &dim, int &n) {
+    FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    int32_t d;
+    std::vector<T> row;
+    for (n = 0; (max_n <= 0 || n < max_n) && std::fread(&d, sizeof d, 1, f) == 1; ++n) {
+        if (n == 0) dim = d;
+        row.resize(d);
+        if (d != dim || std::fread(row.data(), sizeof(T), d, f) != (size_t) d) {
+            std::fclose(f);
+            return false;
+        }
+        values.insert(values.end(), row.begin(), row.end());
+    }
+    std::fclose(f);
+    return n > 0;
+}
+
+/**
+* Reads the points of path into a dim x n matrix, from an .fvecs or .bvecs file
+* or from a raw float32 file of the given dimension.
+*/
+bool read_points(const std::string &path, int dim, int max_n, PointSet &m) {
+    if (ends_with(path, ".fvecs"))
+        return read_vecs(path, max_n, m.values, m.dim, m.n);
+    if (ends_with(path, ".bvecs")) {
+        std::vector<uint8_t> bytes;
+        if (!read_vecs(path, max_n, bytes, m.dim, m.n)) return false;
+        m.values.assign(bytes.begin(), bytes.end());
+        return true;
+    }
+
+    FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(f, header);
+    if (has_header < 0 || (has_header && dim > 0 && header.dim != dim) || (!has_header && dim <= 0)) {
+        std::fclose(f);
+        return false;
+    }
+    if (has_header) {
+        m.dim = header.dim;
+        m.n = header.n;
+    } else {
+        std::fseek(f, 0, SEEK_END);
+        const long bytes = std::ftell(f);
+        std::fseek(f, 0, SEEK_SET);
+        m.dim = dim;
+        m.n = bytes / ((long) sizeof(float) * dim);
+    }
+    if (max_n > 0) m.n = std::min(m.n, max_n);
+    m.values.resize((size_t) m.dim * m.n);
+    const bool ok = std::fread(m.values.data(), sizeof(float), m.values.size(), f) == m.values.size();
+    std::fclose(f);
+    return ok && m.n > 0;
+}
+
+/**
+* Returns the largest resident set size of the process so far in kilobytes,
+* or since the last reset_peak_rss on Linux.
+*/
+long peak_rss_kb() {
+#ifdef __linux__
+    FILE *f = std::fopen("/proc/self/status", "r");
+    char line[256];
+    long peak = -1;
+    while (f && std::fgets(line, sizeof(line), f)) {
+        if (std::strncmp(line, "VmHWM:", 6) == 0)
+            peak = std::atol(line + 6);
+    }
+    if (f) std::fclose(f);
+    if (peak >= 0) return peak;
+#endif
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/**
+* Lowers the peak resident set size of peak_rss_kb to the current one, on Linux.
+*/
+void reset_peak_rss() {
+#ifdef __linux__
+    FILE *f = std::fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    std::fputs("5", f);
+    std::fclose(f);
+#endif
+}
+
+long file_size(const char *path) {
+    FILE *f = std::fopen(path, "rb");
+    if (!f) return -1;
+    std::fseek(f, 0, SEEK_END);
+    const long size = std::ftell(f);
+    std::fclose(f);
+    return size;
+}
+
+double percentile(std::vector<double> values, double p) {
+    const size_t i = std::min(values.size() - 1, (size_t) (p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--json") o.json = true;
+        else if (arg == "--build") o.build = true;
+        else if (arg == "--threads" && has_value) o.threads = parse_list(argv[++i]);
+        else if (arg == "--n" && has_value) o.sizes = parse_list(argv[++i]);
+        else if (arg == "--groundtruth" && has_value) o.groundtruth_path = argv[++i];
+        else if (arg == "--dim" && has_value) o.dim = std::atoi(argv[++i]);
+        else if (arg == "--trees" && has_value) o.trees = parse_list(argv[++i]);
+        else if (arg == "--depth" && has_value) o.depths = parse_list(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = parse_list(argv[++i]);
+        else if (arg == "--density" && has_value) o.densities = parse_float_list(argv[++i]);
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--n-queries" && has_value) o.n_queries = std::atoi(argv[++i]);
+        else if (arg == "--seed" && has_value) o.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--name" && has_value) o.name = argv[++i];
+        else if (arg == "--output" && has_value) o.output_path = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (paths.size() != (o.build ? 1 : 2) || o.k < 1) return false;
+    o.data_path = paths[0];
+    if (!o.build) o.query_path = paths[1];
+    if (o.name.empty()) o.name = o.data_path;
+    return true;
+}
+
+/**
+* Measures the builds of --build and reports them to out.
+*/
+void benchmark_builds(const Options &o, const PointSet &data, FILE *out) {
+    const int dim = data.dim;
+    std::vector<int> threads = o.threads, sizes = o.sizes;
+    if (threads.empty()) {
+        int max_threads = 1;
+#ifdef _OPENMP
+        max_threads = omp_get_max_threads();
+#endif
+        for (int t = 1; t < max_threads; t *= 2)
+            threads.push_back(t);
+        threads.push_back(max_threads);
+    }
+    if (sizes.empty())
+        sizes.push_back(data.n);
+
+    if (o.json)
+        std::fprintf(out, "[");
+    else
+        std::fprintf(out, "dataset,n,dim,n_trees,depth,density,threads,build_s,matrix_s,projection_s,tree_s,"
+                     "assembly_s,groups,projection_bytes,peak_rss_kb,allocations,allocated_bytes,speedup,"
+                     "efficiency,limiting_phase\n");
+    const char *phases[] = {"matrix", "projection", "tree", "assembly"};
+    bool first_row = true;
+
+    for (int n : sizes) {
+        n = std::min(n, data.n);
+        Map<const MatrixXf> X(data.values.data(), dim, n);
+        for (float density : o.densities) {
+            for (int depth : o.depths) {
+                if (n < 2 || depth > std::ceil(std::log2((double) n))) continue;
+                for (int n_trees : o.trees) {
+                    double base_s = 0, base_phases[4] = {0, 0, 0, 0};
+                    for (int t = 0; t < (int) threads.size(); ++t) {
+#ifdef _OPENMP
+                        omp_set_num_threads(threads[t]);
+#endif
+                        Mrpt index(&X, n_trees, depth, density, o.seed);
+                        reset_peak_rss();
+#ifdef __GLIBC__
+                        const int64_t allocations_before = n_allocations, bytes_before = allocated_bytes;
+#endif
+                        const Clock::time_point start = Clock::now();
+                        index.grow(1);
+                        const double build_s = std::chrono::duration<double>(Clock::now() - start).count();
+                        int64_t allocations = -1, bytes = -1;
+#ifdef __GLIBC__
+                        allocations = n_allocations - allocations_before;
+                        bytes = allocated_bytes - bytes_before;
+#endif
+                        const long rss = peak_rss_kb();
+                        const Mrpt::BuildStats &stats = index.build_stats();
+                        const double phase_s[4] = {1e-9 * stats.matrix_ns, 1e-9 * stats.projection_ns,
+                                                   1e-9 * stats.tree_ns, 1e-9 * stats.assembly_ns};
+
+                        // the phase that sped up the least over the fewest threads limits the scaling
+                        if (t == 0) {
+                            base_s = build_s;
+                            std::copy(phase_s, phase_s + 4, base_phases);
+                        }
+                        int limiting = -1;
+                        double least_speedup = 0;
+                        for (int p = 0; p < 4 && t > 0; ++p) {
+                            if (base_phases[p] < 0.05 * base_s) continue;
+                            const double speedup = base_phases[p] / std::max(phase_s[p], 1e-9);
+                            if (limiting < 0 || speedup < least_speedup) {
+                                limiting = p;
+                                least_speedup = speedup;
+                            }
+                        }
+                        const double speedup = base_s / build_s;
+                        const double efficiency = speedup * threads[0] / threads[t];
+                        const char *limiting_phase = limiting < 0 ? "" : phases[limiting];
+
+                        if (o.json)
+                            std::fprintf(out, "%s\n  {\"dataset\": \"%s\", \"n\": %d, \"dim\": %d, \"n_trees\": %d, "
+                                         "\"depth\": %d, \"density\": %g, \"threads\": %d, \"build_s\": %.3f, "
+                                         "\"matrix_s\": %.3f, \"projection_s\": %.3f, \"tree_s\": %.3f, "
+                                         "\"assembly_s\": %.3f, \"groups\": %d, \"projection_bytes\": %lld, "
+                                         "\"peak_rss_kb\": %ld, \"allocations\": %lld, \"allocated_bytes\": %lld, "
+                                         "\"speedup\": %.2f, \"efficiency\": %.2f, \"limiting_phase\": \"%s\"}",
+                                         first_row ? "" : ",", o.name.c_str(), n, dim, n_trees, depth, density,
+                                         threads[t], build_s, phase_s[0], phase_s[1], phase_s[2], phase_s[3],
+                                         stats.n_groups, (long long) stats.projection_bytes, rss,
+                                         (long long) allocations, (long long) bytes, speedup, efficiency,
+                                         limiting_phase);
+                        else
+                            std::fprintf(out, "%s,%d,%d,%d,%d,%g,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%lld,%ld,%lld,%lld,"
+                                         "%.2f,%.2f,%s\n", o.name.c_str(), n, dim, n_trees, depth, density, threads[t],
+                                         build_s, phase_s[0], phase_s[1], phase_s[2], phase_s[3], stats.n_groups,
+                                         (long long) stats.projection_bytes, rss, (long long) allocations,
+                                         (long long) bytes, speedup, efficiency, limiting_phase);
+                        std::fflush(out);
+                        first_row = false;
+                    }
+                }
+            }
+        }
+    }
+    if (o.json)
+        std::fprintf(out, "\n]\n");
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        std::fprintf(stderr, "usage: %s [--groundtruth path] [--dim d] [--trees list] [--depth list] "
+                     "[--votes list] [--density list] [--k k] [--n-queries n] [--seed s] [--name name] "
+                     "[--json] [--output path] data queries\n"
+                     "       %s --build [--threads list] [--n list] [--dim d] [--trees list] [--depth list] "
+                     "[--density list] [--seed s] [--name name] [--json] [--output path] data\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    PointSet data, queries;
+    if (!read_points(o.data_path, o.dim, 0, data) ||
+        (!o.build && (!read_points(o.query_path, o.dim, o.n_queries, queries) || queries.dim != data.dim))) {
+        std::fprintf(stderr, "cannot read the data or the queries\n");
+        return 1;
+    }
+    if (o.densities.empty())
+        o.densities.push_back(1 / std::sqrt((float) data.dim));
+
+    if (o.build) {
+        FILE *out = o.output_path.empty() ? stdout : std::fopen(o.output_path.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+            return 1;
+        }
+        benchmark_builds(o, data, out);
+        if (out != stdout)
+            std::fclose(out);
+        return 0;
+    }
+
+    const int dim = data.dim, n = data.n, n_queries = queries.n, k = o.k;
+    Map<const MatrixXf> X(data.values.data(), dim, n), Q(queries.values.data(), dim, n_queries);
+
+    std::vector<int> truth;
+    int truth_k = k;
+    if (!o.groundtruth_path.empty()) {
+        int n_truth;
+        if (!read_vecs(o.groundtruth_path, n_queries, truth, truth_k, n_truth) || n_truth < n_queries
+            || truth_k < k) {
+            std::fprintf(stderr, "cannot read %d true neighbors of each query\n", k);
+            return 1;
+        }
+    } else {
+        Mrpt exact(&X, 1, 1, 1);
+        truth.resize((size_t) n_queries * k);
+        exact.exact_knn_batch(Q, k, truth.data());
+    }
+
+    FILE *out = o.output_path.empty() ? stdout : std::fopen(o.output_path.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        return 1;
+    }
+    if (o.json)
+        std::fprintf(out, "[");
+    else
+        std::fprintf(out, "dataset,n,dim,k,n_trees,depth,density,votes_required,build_s,peak_rss_kb,"
+                     "index_bytes,qps,p50_us,p99_us,recall\n");
+
+    const std::string index_path = (o.output_path.empty() ? std::string("mrpt_benchmark") : o.output_path) + ".idx";
+    bool first_row = true;
+    std::vector<double> latencies(n_queries);
+    std::vector<int> result(k);
+
+    for (float density : o.densities) {
+        for (int depth : o.depths) {
+            for (int n_trees : o.trees) {
+                Mrpt index(&X, n_trees, depth, density, o.seed);
+                const Clock::time_point build_start = Clock::now();
+                index.grow(1);
+                const double build_s = std::chrono::duration<double>(Clock::now() - build_start).count();
+                const long rss = peak_rss_kb();
+                const long index_bytes = index.save(index_path.c_str()) ? file_size(index_path.c_str()) : -1;
+                std::remove(index_path.c_str());
+
+                for (int votes : o.votes) {
+                    if (votes > n_trees) continue;
+                    int64_t found = 0;
+                    const Clock::time_point start = Clock::now();
+                    for (int i = 0; i < n_queries; ++i) {
+                        const Clock::time_point query_start = Clock::now();
+                        index.query(Q.col(i), k, votes, result.data());
+                        latencies[i] = std::chrono::duration<double, std::micro>(Clock::now() - query_start).count();
+
+                        const int *t = truth.data() + (size_t) i * truth_k;
+                        for (int j = 0; j < k; ++j)
+                            found += std::find(t, t + k, result[j]) != t + k;
+                    }
+                    const double total_s = std::chrono::duration<double>(Clock::now() - start).count();
+                    const double qps = n_queries / total_s, recall = (double) found / ((double) n_queries * k);
+                    const double p50 = percentile(latencies, 0.5), p99 = percentile(latencies, 0.99);
+
+                    if (o.json)
+                        std::fprintf(out, "%s\n  {\"dataset\": \"%s\", \"n\": %d, \"dim\": %d, \"k\": %d, "
+                                     "\"n_trees\": %d, \"depth\": %d, \"density\": %g, \"votes_required\": %d, \"build_s\": %.3f, "
+                                     "\"peak_rss_kb\": %ld, \"index_bytes\": %ld, \"qps\": %.1f, \"p50_us\": %.1f, "
+                                     "\"p99_us\": %.1f, \"recall\": %.4f}", first_row ? "" : ",", o.name.c_str(), n,
+                                     dim, k, n_trees, depth, density, votes, build_s, rss, index_bytes, qps, p50, p99,
+                                     recall);
+                    else
+                        std::fprintf(out, "%s,%d,%d,%d,%d,%d,%g,%d,%.3f,%ld,%ld,%.1f,%.1f,%.1f,%.4f\n",
+                                     o.name.c_str(), n, dim, k, n_trees, depth, density, votes, build_s, rss,
+                                     index_bytes, qps, p50, p99, recall);
+                    std::fflush(out);
+                    first_row = false;
+                }
+            }
+        }
+    }
+
+    if (o.json)
+        std::fprintf(out, "\n]\n");
+    if (out != stdout)
+        std::fclose(out);
+    return 0;
+}
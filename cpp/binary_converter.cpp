@@ -0,0 +1,471 @@
+/*
+ * Converts data sets into the float32 files that MRPTIndex and mrpt_benchmark
+ * read, with one point per row after a header that gives their shape (see
+ * mrpt_data.h), like utils/binary_converter.py but fast enough for data sets
+ * of hundreds of gigabytes. The input is read and written in chunks, so it
+ * does not need to fit in memory, and the chunks of text files are parsed by
+ * all OpenMP threads.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -fopenmp cpp/binary_converter.cpp -o mrpt_convert
+ * or, to read HDF5 files (including MAT-files of version 7.3), with
+ *   g++ -std=c++11 -O3 -fopenmp -DMRPT_HDF5 -I/usr/include/hdf5/serial cpp/binary_converter.cpp \
+ *       -o mrpt_convert -L/usr/lib/x86_64-linux-gnu/hdf5/serial -lhdf5
+ *
+ * The format of the input is given by its extension: .fvecs, .bvecs and .ivecs
+ * files store each vector as its dimension followed by its float32, uint8 or
+ * int32 components, .h5, .hdf5 and .mat files hold the points as the rows of a
+ * two-dimensional dataset, and other files, or - for the standard input, are
+ * text with one point per line. The number of points and the dimension are
+ * printed when the conversion is done; they are also written into the header,
+ * which is filled in last, so MRPTIndex reads the shape from the file.
+ *
+ * Usage: mrpt_convert [options] input output
+ *   --format f         fvecs, bvecs, ivecs, hdf5 or text, instead of the extension
+ *   --n n              convert only the first n points
+ *   --delimiter c      the delimiter of text files, by default ',' or any whitespace
+ *   --skip-cols k      skip the first k columns of each line of text
+ *   --skip-rows k      skip the first k lines of text, such as a header
+ *   --dataset name     the dataset of an HDF5 file
+ *   --chunk-mb m       the size of the chunks read at a time (default 64)
+ *   --raw              write only the rows, without the header, whose shape must then be given to MRPTIndex
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "mrpt_data.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef MRPT_HDF5
+#include <hdf5.h>
+#endif
+
+namespace {
+
+struct Options {
+    std::string input_path, output_path, format, dataset;
+    int64_t max_n = -1;
+    int skip_cols = 0, skip_rows = 0;
+    char delimiter = 0; // 0 for any whitespace or a comma
+    size_t chunk_bytes = 64 << 20;
+    bool raw = false; // no header
+};
+
+bool ends_with(const std::string &s, const char *suffix) {
+    const size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+std::string input_format(const Options &o) {
+    if (!o.format.empty()) return o.format;
+    for (const char *format : {"fvecs", "bvecs", "ivecs"})
+        if (ends_with(o.input_path, (std::string(".") + format).c_str())) return format;
+    if (ends_with(o.input_path, ".h5") || ends_with(o.input_path, ".hdf5") || ends_with(o.input_path, ".mat"))
+        return "hdf5";
+    return "text";
+}
+
+/**
+* Writes the floats to the output, and reports a failure once.
+*/
+bool write_floats(FILE *out, const float *values, size_t n) {
+    if (std::fwrite(values, sizeof(float), n, out) == n) return true;
+    std::fprintf(stderr, "cannot write the output\n");
+    return false;
+}
+
+/**
+* Converts a file of vectors stored as their dimension followed by their
+* components, reading a chunk of whole vectors at a time.
+*/
+template<typename T>
+bool convert_vecs(FILE *in, FILE *out, const Options &o, int64_t &n, int &dim) {
+    int32_t d;
+    if (std::fread(&d, sizeof d, 1, in) != 1 || d <= 0) {
+        std::fprintf(stderr, "cannot read the dimension of the vectors\n");
+        return false;
+    }
+    dim = d;
+    std::fseek(in, 0, SEEK_SET);
+
+    const size_t row_bytes = sizeof(int32_t) + sizeof(T) * dim;
+    const size_t rows_per_chunk = std::max<size_t>(1, o.chunk_bytes / row_bytes);
+    std::vector<char> chunk(rows_per_chunk * row_bytes);
+    std::vector<float> values(rows_per_chunk * dim);
+
+    for (n = 0; o.max_n < 0 || n < o.max_n; ) {
+        size_t rows = std::fread(chunk.data(), row_bytes, rows_per_chunk, in);
+        if (o.max_n >= 0) rows = std::min<size_t>(rows, o.max_n - n);
+        if (!rows) break;
+
+        for (size_t i = 0; i < rows; ++i) {
+            std::memcpy(&d, chunk.data() + i * row_bytes, sizeof d);
+            if (d != dim) {
+                std::fprintf(stderr, "vector %lld has dimension %d instead of %d\n", (long long) (n + i), d, dim);
+                return false;
+            }
+        }
+
+        #pragma omp parallel for
+        for (int64_t i = 0; i < (int64_t) rows; ++i) {
+            const char *row = chunk.data() + i * row_bytes + sizeof(int32_t);
+            float *v = values.data() + i * dim;
+            for (int j = 0; j < dim; ++j) {
+                T component;
+                std::memcpy(&component, row + j * sizeof(T), sizeof(T));
+                v[j] = component;
+            }
+        }
+        if (!write_floats(out, values.data(), rows * dim)) return false;
+        n += rows;
+    }
+    return true;
+}
+
+// the powers of ten that are exact in a double
+const double exact_powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                               1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/**
+* Parses a number at p like strtod, which is only called for the numbers that
+* a double cannot be computed exactly from: those with over 19 significant
+* digits or a large exponent, infinities and NaNs. The others are the integer of
+* their digits times or divided by an exact power of ten, which rounds once and
+* so correctly.
+* @return The end of the number, or p if there is no number at p.
+*/
+const char *parse_double(const char *p, double &value) {
+    const char *start = p;
+    const bool negative = *p == '-';
+    if (*p == '-' || *p == '+') ++p;
+
+    uint64_t mantissa = 0;
+    int significant = 0, exponent = 0;
+    bool any_digits = false, exact = true;
+    for (; *p >= '0' && *p <= '9'; ++p) {
+        any_digits = true;
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant += mantissa > 0;
+        } else {
+            exact = exact && *p == '0';
+            ++exponent;
+        }
+    }
+    if (*p == '.') {
+        for (++p; *p >= '0' && *p <= '9'; ++p) {
+            any_digits = true;
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa > 0;
+                --exponent;
+            } else {
+                exact = exact && *p == '0';
+            }
+        }
+    }
+    if (any_digits && (*p == 'e' || *p == 'E')) {
+        const char *e = p + 1;
+        const bool negative_exponent = *e == '-';
+        if (*e == '-' || *e == '+') ++e;
+        if (*e < '0' || *e > '9') {
+            exact = false;
+        } else {
+            int exponent_value = 0;
+            for (; *e >= '0' && *e <= '9'; ++e)
+                exponent_value = std::min(exponent_value * 10 + (*e - '0'), 100000);
+            exponent += negative_exponent ? -exponent_value : exponent_value;
+            p = e;
+        }
+    }
+
+    if (!any_digits || !exact || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+        char *end;
+        value = std::strtod(start, &end);
+        return end;
+    }
+    const double magnitude = exponent < 0 ? mantissa / exact_powers[-exponent] : mantissa * exact_powers[exponent];
+    value = negative ? -magnitude : magnitude;
+    return p;
+}
+
+struct TextChunk {
+    const char *begin, *end; // whole lines, the last one ending before end
+    std::vector<float> values;
+    int64_t rows = 0;
+    int dim = 0; // the number of values of the rows, or -1 if they differ
+    int64_t bad_line = -1; // the first line of the chunk that cannot be parsed
+};
+
+bool is_delimiter(char c, char delimiter) {
+    return delimiter ? c == delimiter : c == ' ' || c == '\t' || c == ',' || c == ';';
+}
+
+// the characters around the fields of a line, or at its end
+bool is_padding(char c) {
+    return c == ' ' || c == '\t' || c == '"' || c == '\r';
+}
+
+/**
+* Parses the lines of a piece of text, skipping the empty ones. The text ends
+* with a newline or the terminating zero of the chunk.
+*/
+void parse_lines(TextChunk &c, const Options &o) {
+    const char *p = c.begin;
+    for (int64_t line = 0; p < c.end; ++line) {
+        const char *line_end = static_cast<const char *>(std::memchr(p, '\n', c.end - p));
+        if (!line_end) line_end = c.end;
+
+        int fields = 0, values = 0;
+        bool ok = true;
+        while (p < line_end && ok) {
+            while (p < line_end && is_padding(*p)) ++p;
+            if (p == line_end) break;
+            if (fields++ < o.skip_cols) {
+                while (p < line_end && !is_delimiter(*p, o.delimiter)) ++p;
+            } else {
+                double value;
+                const char *end = parse_double(p, value);
+                ok = end != p && (end == line_end || is_delimiter(*end, o.delimiter) || is_padding(*end));
+                c.values.push_back((float) value);
+                ++values;
+                p = end;
+                while (p < line_end && is_padding(*p)) ++p;
+            }
+            if (p < line_end && is_delimiter(*p, o.delimiter)) ++p;
+        }
+        p = line_end + 1;
+
+        if (!ok) {
+            c.bad_line = line;
+            return;
+        }
+        if (!values) continue;
+        if (!c.rows) c.dim = values;
+        else if (values != c.dim) c.dim = -1;
+        ++c.rows;
+    }
+}
+
+/**
+* Converts text with one point per line. Chunks of whole lines are read in
+* turn, each split into one piece per thread at line breaks, and the pieces
+* are parsed in parallel and written in order.
+*/
+bool convert_text(FILE *in, FILE *out, const Options &o, int64_t &n, int &dim) {
+#ifdef _OPENMP
+    const int n_pieces = omp_get_max_threads();
+#else
+    const int n_pieces = 1;
+#endif
+    std::vector<char> chunk(o.chunk_bytes + 1);
+    size_t carried = 0; // the start of a line left over from the previous chunk
+    int64_t line = 0, skipped = 0;
+    n = 0;
+    dim = 0;
+
+    for (bool eof = false; !eof && (o.max_n < 0 || n < o.max_n); ) {
+        const size_t read = std::fread(chunk.data() + carried, 1, o.chunk_bytes - carried, in);
+        eof = carried + read < o.chunk_bytes;
+        size_t length = carried + read;
+        chunk[length] = 0;
+
+        // the last line is carried over unless the input ends
+        size_t parsed = length;
+        if (!eof) {
+            while (parsed > 0 && chunk[parsed - 1] != '\n') --parsed;
+            if (!parsed) {
+                std::fprintf(stderr, "line %lld is longer than a chunk, use a larger --chunk-mb\n", (long long) line);
+                return false;
+            }
+        }
+
+        const char *begin = chunk.data(), *end = chunk.data() + parsed;
+        for (; skipped < o.skip_rows && begin < end; ++skipped, ++line) {
+            const char *next = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+            begin = next ? next + 1 : end;
+        }
+
+        std::vector<TextChunk> pieces(n_pieces);
+        const char *piece_begin = begin;
+        for (int i = 0; i < n_pieces; ++i) {
+            const char *piece_end = i == n_pieces - 1 ? end :
+                std::max(piece_begin, begin + (end - begin) * (i + 1) / n_pieces);
+            if (piece_end < end) {
+                const char *next = static_cast<const char *>(std::memchr(piece_end, '\n', end - piece_end));
+                piece_end = next ? next + 1 : end;
+            }
+            pieces[i].begin = piece_begin;
+            pieces[i].end = piece_end;
+            piece_begin = piece_end;
+        }
+
+        #pragma omp parallel for schedule(static, 1)
+        for (int i = 0; i < n_pieces; ++i)
+            parse_lines(pieces[i], o);
+
+        for (int i = 0; i < n_pieces; ++i) {
+            const TextChunk &c = pieces[i];
+            const int64_t first_line = line;
+            line += std::count(c.begin, c.end, '\n');
+            if (c.bad_line >= 0) {
+                std::fprintf(stderr, "cannot parse line %lld\n", (long long) (first_line + c.bad_line + 1));
+                return false;
+            }
+            if (!c.rows) continue;
+            if (c.dim < 0 || (dim && c.dim != dim)) {
+                std::fprintf(stderr, "the lines from line %lld on do not all have the same number of values\n",
+                             (long long) first_line + 1);
+                return false;
+            }
+            dim = c.dim;
+            const int64_t rows = o.max_n < 0 ? c.rows : std::min(c.rows, o.max_n - n);
+            if (!write_floats(out, c.values.data(), rows * dim)) return false;
+            n += rows;
+            if (o.max_n >= 0 && n == o.max_n) break;
+        }
+
+        carried = length - parsed;
+        std::memmove(chunk.data(), chunk.data() + parsed, carried);
+    }
+    return true;
+}
+
+#ifdef MRPT_HDF5
+/**
+* Converts the rows of a two-dimensional HDF5 dataset of any numeric type,
+* which the library converts to float32, reading a block of rows at a time.
+*/
+bool convert_hdf5(const Options &o, FILE *out, int64_t &n, int &dim) {
+    if (o.dataset.empty()) {
+        std::fprintf(stderr, "the dataset of an HDF5 file must be given with --dataset\n");
+        return false;
+    }
+    const hid_t file = H5Fopen(o.input_path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file < 0) return false;
+    const hid_t dataset = H5Dopen2(file, o.dataset.c_str(), H5P_DEFAULT);
+    const hid_t space = dataset < 0 ? -1 : H5Dget_space(dataset);
+    hsize_t dims[2];
+    bool ok = space >= 0 && H5Sget_simple_extent_ndims(space) == 2 && H5Sget_simple_extent_dims(space, dims, NULL) == 2;
+    if (!ok) std::fprintf(stderr, "%s is not a two-dimensional dataset\n", o.dataset.c_str());
+
+    n = 0;
+    dim = ok ? (int) dims[1] : 0;
+    const int64_t total = ok ? (o.max_n < 0 ? (int64_t) dims[0] : std::min<int64_t>(o.max_n, dims[0])) : 0;
+    const hsize_t rows_per_chunk = std::max<size_t>(1, o.chunk_bytes / (sizeof(float) * std::max(dim, 1)));
+    std::vector<float> values(rows_per_chunk * dim);
+    while (ok && n < total) {
+        hsize_t offset[2] = {(hsize_t) n, 0}, count[2] = {std::min<hsize_t>(rows_per_chunk, total - n), dims[1]};
+        const hid_t memory = H5Screate_simple(2, count, NULL);
+        ok = H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL) >= 0 &&
+             H5Dread(dataset, H5T_NATIVE_FLOAT, memory, space, H5P_DEFAULT, values.data()) >= 0 &&
+             write_floats(out, values.data(), count[0] * dim);
+        H5Sclose(memory);
+        n += count[0];
+    }
+
+    if (space >= 0) H5Sclose(space);
+    if (dataset >= 0) H5Dclose(dataset);
+    H5Fclose(file);
+    return ok;
+}
+#endif
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--format" && has_value) o.format = argv[++i];
+        else if (arg == "--n" && has_value) o.max_n = std::atoll(argv[++i]);
+        else if (arg == "--delimiter" && has_value) o.delimiter = argv[++i][0];
+        else if (arg == "--skip-cols" && has_value) o.skip_cols = std::atoi(argv[++i]);
+        else if (arg == "--skip-rows" && has_value) o.skip_rows = std::atoi(argv[++i]);
+        else if (arg == "--dataset" && has_value) o.dataset = argv[++i];
+        else if (arg == "--chunk-mb" && has_value) o.chunk_bytes = (size_t) std::max(1, std::atoi(argv[++i])) << 20;
+        else if (arg == "--raw") o.raw = true;
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (paths.size() != 2) return false;
+    o.input_path = paths[0];
+    o.output_path = paths[1];
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        std::fprintf(stderr, "usage: %s [--format f] [--n n] [--delimiter c] [--skip-cols k] [--skip-rows k] "
+                     "[--dataset name] [--chunk-mb m] [--raw] input output\n", argv[0]);
+        return 2;
+    }
+
+    const std::string format = input_format(o);
+    FILE *out = std::fopen(o.output_path.c_str(), "wb");
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        return 1;
+    }
+
+    // the shape is known only at the end, so the header is written over a placeholder
+    mrpt_data::DataFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    if (!o.raw && std::fwrite(&header, sizeof(header), 1, out) != 1) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        std::fclose(out);
+        return 1;
+    }
+
+    int64_t n = 0;
+    int dim = 0;
+    bool ok;
+    if (format == "hdf5") {
+#ifdef MRPT_HDF5
+        ok = convert_hdf5(o, out, n, dim);
+#else
+        std::fprintf(stderr, "HDF5 files need a build with -DMRPT_HDF5\n");
+        ok = false;
+#endif
+    } else {
+        FILE *in = o.input_path == "-" ? stdin : std::fopen(o.input_path.c_str(), "rb");
+        if (!in) {
+            std::fprintf(stderr, "cannot read %s\n", o.input_path.c_str());
+            std::fclose(out);
+            return 1;
+        }
+        if (format == "fvecs") ok = convert_vecs<float>(in, out, o, n, dim);
+        else if (format == "bvecs") ok = convert_vecs<uint8_t>(in, out, o, n, dim);
+        else if (format == "ivecs") ok = convert_vecs<int32_t>(in, out, o, n, dim);
+        else if (format == "text") ok = convert_text(in, out, o, n, dim);
+        else {
+            std::fprintf(stderr, "unknown format %s\n", format.c_str());
+            ok = false;
+        }
+        if (in != stdin) std::fclose(in);
+    }
+
+    if (ok && !o.raw) {
+        header = mrpt_data::make_header(n, dim);
+        ok = std::fseek(out, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok) {
+        std::fprintf(stderr, "the conversion of %s failed\n", o.input_path.c_str());
+        return 1;
+    }
+    std::printf("%lld %d\n", (long long) n, dim);
+    return 0;
+}
@@ -0,0 +1,521 @@
+/*
+ * A coordinator of k-NN searches over a data set split into shards, each
+ * served by one or more replicas of mrpt_server (server.cpp) on other
+ * machines. A search is forwarded as it came, in the wire format of the
+ * server, to one replica of every shard, whose server batches its queries
+ * with those of its other clients. The k nearest neighbors found in each
+ * shard are merged into the k nearest neighbors of the whole data, as
+ * ShardedMrpt merges its shards in one process, so the answer is that of a
+ * ShardedMrpt over the same shards and the same indexes.
+ *
+ * The replicas of a shard are asked first in turns. A replica that fails is
+ * replaced by the next one at once. With --hedge-ms, a shard that has not
+ * answered in that time is asked again from its next replica, and the first
+ * answer is used, so a replica slowed by a busy machine or by page faults
+ * does not hold up the search. A shard that has not answered by the deadline
+ * fails the search with 504, unless partial answers are allowed: the answer
+ * is then merged from the other shards and lists the missing ones.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -pthread -Icpp cpp/coordinator.cpp -o mrpt_coordinator
+ *
+ * The coordinator speaks HTTP/1.1 with keep-alive and keeps the connections
+ * to the replicas alive too:
+ *
+ *   POST /search?k=10&votes=1&distances=1&deadline_ms=100&partial=1
+ *       As the /search of the server. The ids are global: the id of a point
+ *       in its shard plus the id of the first point of the shard. deadline_ms
+ *       and partial default to --deadline-ms and --partial. If shards are
+ *       missing from a partial answer, their numbers, counted from 0 in the
+ *       order of the command line, are listed in "missing_shards".
+ *   GET /metrics
+ *       The counters of the coordinator in the text format of Prometheus.
+ *   GET /health
+ *       Answers ok.
+ *
+ * The coordinator uses POSIX sockets and does not build on Windows.
+ *
+ * Usage: mrpt_coordinator [options] shard...
+ *   shard                [first_id@]host:port[,host:port...], the IPv4 addresses of the
+ *                        replicas of a shard and the id of its first point, which must be
+ *                        given if there are several shards (default 0)
+ *   --host address       the IPv4 address listened on (default 0.0.0.0)
+ *   --port p             the port listened on (default 8090)
+ *   --k k                number of neighbors searched for by default (default 10)
+ *   --votes v            votes required by default (default 1)
+ *   --metric m           euclidean, inner_product or cosine, the metric of the indexes of the
+ *                        shards: the similarities of the last two are merged the largest first
+ *                        (default euclidean)
+ *   --hedge-ms t         ask the next replica of a shard that has not answered in t ms
+ *                        (default 0, do not hedge)
+ *   --deadline-ms t      how long the shards may take to answer (default 1000)
+ *   --partial            answer from the shards that answered by the deadline
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mrpt_http.h"
+
+namespace {
+
+using mrpt_http::Clock;
+using mrpt_http::HttpRequest;
+using mrpt_http::HttpResponse;
+using mrpt_http::json_error;
+using mrpt_http::parameter;
+using mrpt_http::read_request;
+using mrpt_http::respond;
+
+struct Options {
+    std::string host = "0.0.0.0";
+    int port = 8090, k = 10, votes = 1, hedge_ms = 0, deadline_ms = 1000;
+    bool similarity = false, partial = false;
+};
+
+struct Replica {
+    std::string host, address; // the IPv4 address, and it with the port
+    int port = 0;
+    std::mutex mutex; // guards idle
+    std::vector<int> idle; // the kept-alive connections to the replica not in use
+};
+
+struct Shard {
+    int64_t first_id = 0;
+    std::vector<std::unique_ptr<Replica>> replicas;
+    std::atomic<unsigned> next{0}; // the replica asked first by the next search
+};
+
+/*
+* A search fanned out to the shards. It is shared with the threads that ask
+* the replicas, which outlive the search when they lose to a hedge or miss
+* the deadline.
+*/
+struct Fanout {
+    struct Call {
+        unsigned first = 0; // the replica asked first
+        int n_asked = 0; // the replicas asked, the first + i for i < n_asked
+        int n_pending = 0; // the replicas asked that have not returned
+        int winner = -1; // the replica whose answer is used, counted from first, or -1
+        std::vector<bool> hedges; // whether the replica i was asked as a hedge
+        Clock::time_point hedge_at; // when to ask the next replica if none has answered
+        HttpResponse response;
+    };
+
+    std::mutex mutex; // guards calls
+    std::condition_variable changed;
+    std::vector<Call> calls; // one for each shard
+};
+
+const size_t max_idle = 64; // the most idle connections kept to a replica
+
+Options options;
+std::vector<std::unique_ptr<Shard>> shards;
+std::atomic<long long> n_requests{0}, n_failed_requests{0}, n_partial_answers{0}, n_shard_requests{0},
+    n_hedges{0}, n_hedges_won{0}, n_shard_failures{0}, n_shard_timeouts{0};
+
+/**
+* Posts a request to a replica over an idle connection if it has one, and over
+* a new connection if not or if the server has closed the idle one meanwhile.
+*/
+bool exchange(Replica &replica, const std::string &target, const std::string &body, HttpResponse &response,
+              Clock::time_point deadline) {
+    for (;;) {
+        int s = -1;
+        {
+            std::lock_guard<std::mutex> lock(replica.mutex);
+            if (!replica.idle.empty()) {
+                s = replica.idle.back();
+                replica.idle.pop_back();
+            }
+        }
+        const bool reused = s >= 0;
+        if (!reused && (s = mrpt_http::connect_to(replica.host, replica.port, deadline)) < 0)
+            return false;
+
+        std::string buffer;
+        const bool answered = mrpt_http::post(s, replica.address, target, body, buffer, response, deadline);
+        if (answered && response.keep_alive && buffer.empty()) {
+            std::lock_guard<std::mutex> lock(replica.mutex);
+            if (replica.idle.size() < max_idle) {
+                replica.idle.push_back(s);
+                s = -1;
+            }
+        }
+        if (s >= 0)
+            close(s);
+        if (answered || !reused || Clock::now() >= deadline)
+            return answered;
+    }
+}
+
+/**
+* Asks the next replica of shard i in a thread of its own. Called with the
+* mutex of the fan-out held.
+*/
+void ask(const std::shared_ptr<Fanout> &fanout, int i, bool hedge, const std::string &target,
+         const std::shared_ptr<const std::string> &body, Clock::time_point deadline) {
+    Fanout::Call &call = fanout->calls[i];
+    const int attempt = call.n_asked++;
+    ++call.n_pending;
+    call.hedges.push_back(hedge);
+    call.hedge_at = Clock::now() + std::chrono::milliseconds(options.hedge_ms);
+    ++n_shard_requests;
+    if (hedge)
+        ++n_hedges;
+
+    Shard &shard = *shards[i];
+    Replica &replica = *shard.replicas[(call.first + attempt) % shard.replicas.size()];
+    std::thread([fanout, i, attempt, target, body, deadline, &replica] {
+        HttpResponse response;
+        const bool answered = exchange(replica, target, *body, response, deadline);
+        // an error of the server is a failure of the replica, an error of the request is an answer
+        const bool failed = !answered || response.status >= 500;
+        if (failed && Clock::now() < deadline)
+            ++n_shard_failures;
+
+        std::lock_guard<std::mutex> lock(fanout->mutex);
+        Fanout::Call &call = fanout->calls[i];
+        --call.n_pending;
+        if (!failed && call.winner < 0) {
+            call.winner = attempt;
+            call.response = std::move(response);
+        }
+        fanout->changed.notify_all();
+    }).detach();
+}
+
+/**
+* Merges the k nearest neighbors of the queries found in each shard, with the
+* ids local to the shard, into the k nearest neighbors of the whole data.
+* @param first_ids - The id of the first point of each shard
+* @param ids - The neighbors found in each shard, one list for each query
+* @param distances - Their distances, laid out as ids
+* @return The JSON answer of the search.
+*/
+std::string merge(const std::vector<int64_t> &first_ids, const std::vector<std::vector<std::vector<int64_t>>> &ids,
+                  const std::vector<std::vector<std::vector<float>>> &distances, int n, int k, bool with_distances) {
+    std::string indices = "{\"indices\": [", dists = "\"distances\": [";
+    char value[32];
+    std::vector<std::pair<float, int64_t>> candidates;
+    for (int q = 0; q < n; ++q) {
+        candidates.clear();
+        for (size_t s = 0; s < ids.size(); ++s) {
+            for (int j = 0; j < k; ++j) {
+                const int64_t id = ids[s][q][j];
+                if (id >= 0)
+                    candidates.emplace_back(distances[s][q][j], first_ids[s] + id);
+            }
+        }
+
+        const int n_found = std::min<int>(k, candidates.size());
+        if (options.similarity)
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end(),
+                              std::greater<std::pair<float, int64_t>>());
+        else
+            std::partial_sort(candidates.begin(), candidates.begin() + n_found, candidates.end());
+        indices += q ? ", [" : "[";
+        dists += q ? ", [" : "[";
+        for (int j = 0; j < k; ++j) {
+            indices += (j ? ", " : "") + std::to_string(j < n_found ? candidates[j].second : -1);
+            if (with_distances) {
+                std::snprintf(value, sizeof(value), "%s%.9g", j ? ", " : "", j < n_found ? candidates[j].first : -1.0f);
+                dists += value;
+            }
+        }
+        indices += "]";
+        dists += "]";
+    }
+    return indices + "]" + (with_distances ? ", " + dists + "]" : "");
+}
+
+/**
+* Answers the queries in the body of a search request from the shards.
+*/
+int search(const HttpRequest &r, std::string &out) {
+    const int k = std::atoi(parameter(r.query, "k", std::to_string(options.k)).c_str());
+    const int votes = std::atoi(parameter(r.query, "votes", std::to_string(options.votes)).c_str());
+    const bool with_distances = parameter(r.query, "distances", "0") != "0";
+    const int deadline_ms = std::atoi(parameter(r.query, "deadline_ms", std::to_string(options.deadline_ms)).c_str());
+    const bool partial = parameter(r.query, "partial", options.partial ? "1" : "0") != "0";
+    if (r.body.empty() || r.body.size() % sizeof(float)) {
+        out = json_error("the body should hold float32 queries");
+        return 400;
+    }
+    if (k < 1 || votes < 1 || deadline_ms < 1) {
+        out = json_error("k, votes and deadline_ms should be positive");
+        return 400;
+    }
+
+    // the shards are asked for the distances, which the merge needs
+    const std::string target = "/search?k=" + std::to_string(k) + "&votes=" + std::to_string(votes) + "&distances=1";
+    const std::shared_ptr<const std::string> body = std::make_shared<const std::string>(r.body);
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(deadline_ms);
+    const int n_shards = shards.size();
+    std::shared_ptr<Fanout> fanout = std::make_shared<Fanout>();
+    fanout->calls.resize(n_shards);
+
+    std::unique_lock<std::mutex> lock(fanout->mutex);
+    for (int i = 0; i < n_shards; ++i) {
+        fanout->calls[i].first = shards[i]->next++;
+        ask(fanout, i, false, target, body, deadline);
+    }
+    for (;;) {
+        const Clock::time_point now = Clock::now();
+        Clock::time_point wake = deadline;
+        bool waiting = false;
+        for (int i = 0; i < n_shards; ++i) {
+            Fanout::Call &call = fanout->calls[i];
+            if (call.winner >= 0)
+                continue;
+            const int n_replicas = shards[i]->replicas.size();
+            // a replica that failed is replaced at once, one that is slow is hedged
+            const bool hedge = call.n_pending > 0 && options.hedge_ms > 0 && now >= call.hedge_at;
+            if (call.n_asked < n_replicas && (call.n_pending == 0 || hedge))
+                ask(fanout, i, hedge, target, body, deadline);
+            if (call.n_pending == 0)
+                continue; // all the replicas failed
+            waiting = true;
+            if (options.hedge_ms > 0 && call.n_asked < n_replicas)
+                wake = std::min(wake, call.hedge_at);
+        }
+        if (!waiting || now >= deadline)
+            break;
+        fanout->changed.wait_until(lock, wake);
+    }
+
+    std::vector<int> missing;
+    std::vector<HttpResponse> answers;
+    std::vector<int64_t> first_ids;
+    bool timed_out = false;
+    for (int i = 0; i < n_shards; ++i) {
+        Fanout::Call &call = fanout->calls[i];
+        if (call.winner < 0) {
+            missing.push_back(i);
+            if (call.n_pending) {
+                timed_out = true;
+                ++n_shard_timeouts;
+            }
+            continue;
+        }
+        if (call.hedges[call.winner])
+            ++n_hedges_won;
+        answers.push_back(std::move(call.response));
+        first_ids.push_back(shards[i]->first_id);
+    }
+    lock.unlock();
+
+    // an error in the request, such as queries of the wrong dimension, is passed on
+    for (const HttpResponse &answer : answers) {
+        if (answer.status != 200) {
+            out = answer.body;
+            return answer.status;
+        }
+    }
+    if (answers.empty() || (!missing.empty() && !partial)) {
+        out = json_error(timed_out ? "shards did not answer by the deadline" : "shards failed");
+        return timed_out ? 504 : 502;
+    }
+
+    std::vector<std::vector<std::vector<int64_t>>> ids(answers.size());
+    std::vector<std::vector<std::vector<float>>> distances(answers.size());
+    for (size_t s = 0; s < answers.size(); ++s) {
+        bool valid = mrpt_http::parse_lists(answers[s].body, "indices", ids[s]) &&
+                     mrpt_http::parse_lists(answers[s].body, "distances", distances[s]) &&
+                     ids[s].size() == ids[0].size() && distances[s].size() == ids[0].size();
+        for (size_t q = 0; valid && q < ids[s].size(); ++q)
+            valid = ids[s][q].size() == (size_t) k && distances[s][q].size() == (size_t) k;
+        if (!valid) {
+            out = json_error("a shard answered with a malformed body");
+            return 502;
+        }
+    }
+
+    out = merge(first_ids, ids, distances, ids[0].size(), k, with_distances);
+    if (!missing.empty()) {
+        ++n_partial_answers;
+        out += ", \"missing_shards\": [";
+        for (size_t j = 0; j < missing.size(); ++j)
+            out += (j ? ", " : "") + std::to_string(missing[j]);
+        out += "]";
+    }
+    out += "}\n";
+    return 200;
+}
+
+std::string metrics() {
+    std::string text;
+    const struct { const char *name, *help; long long value; } samples[] = {
+        {"mrpt_coordinator_requests_total", "Number of requests served.", n_requests.load()},
+        {"mrpt_coordinator_failed_requests_total", "Number of requests answered with an error.",
+         n_failed_requests.load()},
+        {"mrpt_coordinator_partial_answers_total", "Number of searches answered without some shards.",
+         n_partial_answers.load()},
+        {"mrpt_coordinator_shard_requests_total", "Number of requests sent to the replicas of the shards.",
+         n_shard_requests.load()},
+        {"mrpt_coordinator_hedges_total", "Number of requests sent to a replica as a hedge.", n_hedges.load()},
+        {"mrpt_coordinator_hedges_won_total", "Number of hedges whose answer was used.", n_hedges_won.load()},
+        {"mrpt_coordinator_shard_failures_total", "Number of requests to a replica that failed.",
+         n_shard_failures.load()},
+        {"mrpt_coordinator_shard_timeouts_total", "Number of shards that did not answer a search by the deadline.",
+         n_shard_timeouts.load()},
+    };
+    for (const auto &sample : samples) {
+        text += std::string("# HELP ") + sample.name + " " + sample.help + "\n";
+        text += std::string("# TYPE ") + sample.name + " counter\n";
+        text += std::string(sample.name) + " " + std::to_string(sample.value) + "\n";
+    }
+    return text;
+}
+
+void serve_connection(int socket) {
+    const int one = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::string buffer, out;
+    HttpRequest r;
+    for (;;) {
+        const int read = read_request(socket, buffer, r);
+        if (read <= 0) {
+            if (read < 0)
+                respond(socket, read == -2 ? 413 : 400, json_error("malformed request"), false);
+            break;
+        }
+
+        int status = 404;
+        const char *content_type = "application/json";
+        out = json_error("not found");
+        if (r.method == "POST" && r.path == "/search") {
+            status = search(r, out);
+        } else if (r.method == "GET" && r.path == "/metrics") {
+            status = 200;
+            content_type = "text/plain; version=0.0.4";
+            out = metrics();
+        } else if (r.method == "GET" && r.path == "/health") {
+            status = 200;
+            content_type = "text/plain";
+            out = "ok\n";
+        }
+        ++n_requests;
+        if (status != 200)
+            ++n_failed_requests;
+        if (!respond(socket, status, out, r.keep_alive, content_type) || !r.keep_alive)
+            break;
+    }
+    close(socket);
+}
+
+/**
+* Parses a shard given as [first_id@]host:port[,host:port...].
+*/
+bool parse_shard(const std::string &spec, Shard &shard) {
+    size_t begin = 0;
+    const size_t at = spec.find('@');
+    if (at != std::string::npos) {
+        char *end;
+        shard.first_id = std::strtoll(spec.c_str(), &end, 10);
+        if (end != spec.c_str() + at || shard.first_id < 0)
+            return false;
+        begin = at + 1;
+    }
+    while (begin < spec.size()) {
+        size_t end = spec.find(',', begin);
+        if (end == std::string::npos) end = spec.size();
+        const std::string address = spec.substr(begin, end - begin);
+        const size_t colon = address.rfind(':');
+        std::unique_ptr<Replica> replica(new Replica);
+        replica->address = address;
+        replica->host = address.substr(0, colon);
+        replica->port = colon == std::string::npos ? 0 : std::atoi(address.c_str() + colon + 1);
+        in_addr parsed;
+        if (replica->port <= 0 || replica->port > 65535 || inet_pton(AF_INET, replica->host.c_str(), &parsed) != 1)
+            return false;
+        shard.replicas.push_back(std::move(replica));
+        begin = end + 1;
+    }
+    return !shard.replicas.empty();
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    bool has_first_ids = true;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--partial") o.partial = true;
+        else if (arg == "--host" && has_value) o.host = argv[++i];
+        else if (arg == "--port" && has_value) o.port = std::atoi(argv[++i]);
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = std::atoi(argv[++i]);
+        else if (arg == "--hedge-ms" && has_value) o.hedge_ms = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--deadline-ms" && has_value) o.deadline_ms = std::atoi(argv[++i]);
+        else if (arg == "--metric" && has_value) {
+            const std::string metric = argv[++i];
+            if (metric != "euclidean" && metric != "inner_product" && metric != "cosine") return false;
+            o.similarity = metric != "euclidean";
+        } else if (arg.compare(0, 2, "--") == 0) {
+            return false;
+        } else {
+            shards.emplace_back(new Shard);
+            if (!parse_shard(arg, *shards.back())) return false;
+            has_first_ids = has_first_ids && arg.find('@') != std::string::npos;
+        }
+    }
+    return !shards.empty() && (shards.size() == 1 || has_first_ids) && o.k >= 1 && o.votes >= 1 &&
+           o.deadline_ms >= 1 && o.port > 0 && o.port <= 65535;
+}
+
+}
+
+int main(int argc, char **argv) {
+    if (!parse_options(argc, argv, options)) {
+        std::fprintf(stderr, "usage: %s [--host address] [--port p] [--k k] [--votes v] [--metric m] "
+                     "[--hedge-ms t] [--deadline-ms t] [--partial] [first_id@]host:port[,host:port...]...\n",
+                     argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (listener < 0 || inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        std::fprintf(stderr, "cannot listen on %s:%d: %s\n", options.host.c_str(), options.port, std::strerror(errno));
+        return 1;
+    }
+    std::fprintf(stderr, "coordinating %zu shards on %s:%d\n", shards.size(), options.host.c_str(), options.port);
+
+    for (;;) {
+        const int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            std::fprintf(stderr, "accept failed: %s\n", std::strerror(errno));
+            return 1;
+        }
+        std::thread(serve_connection, connection).detach();
+    }
+}
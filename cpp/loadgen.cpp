@@ -0,0 +1,449 @@
+/*
+ * A load generator that issues k-NN queries at fixed arrival rates, to an
+ * index in the process or to mrpt_server over HTTP, and measures the latency
+ * of each query from the time it was meant to be sent. The arrivals follow a
+ * schedule fixed in advance, Poisson by default, whatever the answers take,
+ * so a slow answer delays none of the later queries and the latency counts
+ * the time a query waits behind others (there is no coordinated omission).
+ * The offered load is swept over --rates to find where the index saturates,
+ * answering fewer queries per second than it is offered, and the knee of the
+ * 99th percentile latency, where it rises above --knee times its value at the
+ * lowest rate.
+ *
+ * The queries are answered by one of the targets:
+ *   query    Mrpt::query on --threads worker threads
+ *   async    an mrpt_async::AsyncQueries, which answers the queries pending
+ *            together in batches with query_batch
+ *   server   POST /search of mrpt_server at --server, over --connections
+ *            kept-alive connections
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -fopenmp -pthread -Icpp -Icpp/lib cpp/loadgen.cpp -o mrpt_loadgen
+ *
+ * The queries are read from a float32 file, with the header of mrpt_data.h or
+ * of dimension --dim, and sent in turns. The data and the index of the query
+ * and async targets are those of mrpt_server. Each rate is reported with the
+ * queries sent and failed, the achieved throughput and the distribution of
+ * the latencies, as CSV or JSON, and the saturation point and the knee are
+ * printed at the end.
+ *
+ * Usage: mrpt_loadgen [options] data index queries
+ *        mrpt_loadgen --target server --server host:port [options] queries
+ *   --target t           query, async or server (default query)
+ *   --rates list         offered loads in queries per second (default 100,200,500,1000,2000,5000)
+ *   --duration s         seconds each load is offered (default 10)
+ *   --arrivals a         poisson or uniform arrivals (default poisson)
+ *   --k k                number of neighbors searched for (default 10)
+ *   --votes v            votes required (default 1)
+ *   --threads t          worker threads of the query target (default the number of cores)
+ *   --max-batch b        largest batch of the async target (default 256)
+ *   --server host:port   the IPv4 address of the server of the server target
+ *   --connections c      connections of the server target (default 64)
+ *   --timeout-ms t       time after which a query to the server fails (default 10000)
+ *   --knee x             the rise of the 99th percentile that makes the knee (default 2)
+ *   --dim d              dimension of raw float32 files without a header
+ *   --mmap               map the index file instead of reading it into memory
+ *   --seed s             seed of the arrival times (default 1)
+ *   --json               report as JSON instead of CSV
+ *   --output path        the file the report is written to, stdout by default
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <unistd.h>
+
+#include "Mrpt.h"
+#include "mrpt_async.h"
+#include "mrpt_data.h"
+#include "mrpt_http.h"
+#include "mrpt_mmap.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string target = "query", data_path, index_path, query_path, server_host, output_path;
+    std::vector<double> rates{100, 200, 500, 1000, 2000, 5000};
+    double duration = 10, knee = 2;
+    bool poisson = true, map_index = false, json = false;
+    int k = 10, votes = 1, threads = 0, max_batch = 256, server_port = 0, connections = 64, timeout_ms = 10000;
+    int dim = 0;
+    unsigned seed = 1;
+};
+
+/*
+* The outcome of one offered load.
+*/
+struct Step {
+    std::vector<double> latency_us; // of the queries answered
+    int64_t n_sent = 0, n_failed = 0;
+    double elapsed_s = 0; // from the first arrival until the last answer
+};
+
+std::vector<double> parse_rates(const char *s) {
+    std::vector<double> list;
+    for (const char *p = s; *p; ) {
+        char *end;
+        const double value = std::strtod(p, &end);
+        if (end == p) break;
+        list.push_back(value);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return list;
+}
+
+/**
+* Maps a float32 file into memory, with or without the header of mrpt_data.h.
+* @return The points, or nullptr if the file cannot be mapped or its dimension is unknown.
+*/
+std::unique_ptr<Map<const MatrixXf>> map_points(const std::string &path, int dim) {
+    FILE *fd = std::fopen(path.c_str(), "rb");
+    if (!fd)
+        return nullptr;
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(fd, header);
+    std::fseek(fd, 0, SEEK_END);
+    const long long bytes = std::ftell(fd);
+    int64_t n = 0;
+    size_t offset = 0;
+    if (has_header > 0) {
+        n = header.n;
+        dim = header.dim;
+        offset = header.data_offset;
+    } else if (has_header == 0 && dim > 0) {
+        n = bytes / ((long long) sizeof(float) * dim);
+    }
+
+    const float *points = nullptr;
+    if (n > 0 && (long long) (offset + sizeof(float) * n * dim) <= bytes) {
+        const char *p = static_cast<const char *>(mrpt_mmap::map_file(fd, bytes));
+        points = p ? reinterpret_cast<const float *>(p + offset) : nullptr;
+    }
+    std::fclose(fd);
+    return points ? std::unique_ptr<Map<const MatrixXf>>(new Map<const MatrixXf>(points, dim, n)) : nullptr;
+}
+
+/**
+* Returns the times since the start of a step at which its queries are sent.
+*/
+std::vector<Clock::duration> arrival_times(double rate, double duration, bool poisson, std::mt19937 &gen) {
+    std::vector<Clock::duration> times;
+    std::exponential_distribution<double> gap(rate);
+    for (double t = 0; t < duration; t += poisson ? gap(gen) : 1 / rate)
+        times.push_back(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(t)));
+    return times;
+}
+
+/**
+* Offers the queries at the times of schedule to n_workers threads, which
+* answer query i with answer(worker, i), false if it failed, and records the
+* latency of each from its time in the schedule.
+*/
+Step run_workers(const std::vector<Clock::duration> &schedule, int n_workers,
+                 const std::function<bool(int, int)> &answer) {
+    const int n = schedule.size();
+    Step step;
+    std::vector<double> latency_us(n, -1);
+    std::deque<int> pending;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool done = false;
+    const Clock::time_point start = Clock::now() + std::chrono::milliseconds(10);
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_workers; ++w) {
+        workers.emplace_back([&, w] {
+            for (;;) {
+                int i;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&] { return done || !pending.empty(); });
+                    if (pending.empty()) return;
+                    i = pending.front();
+                    pending.pop_front();
+                }
+                if (answer(w, i))
+                    latency_us[i] = std::chrono::duration<double, std::micro>(Clock::now() - (start + schedule[i]))
+                                    .count();
+            }
+        });
+    }
+
+    for (int i = 0; i < n; ++i) {
+        std::this_thread::sleep_until(start + schedule[i]);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(i);
+        }
+        ready.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    ready.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+    step.elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+    step.n_sent = n;
+    for (double latency : latency_us) {
+        if (latency < 0)
+            ++step.n_failed;
+        else
+            step.latency_us.push_back(latency);
+    }
+    return step;
+}
+
+/**
+* Offers the queries at the times of schedule to an AsyncQueries, which
+* answers them on its dispatcher thread.
+*/
+Step run_async(const std::vector<Clock::duration> &schedule, mrpt_async::AsyncQueries &queries,
+               const Map<const MatrixXf> &Q, int k, int votes) {
+    const int n = schedule.size();
+    Step step;
+    std::vector<double> latency_us(n);
+    const Clock::time_point start = Clock::now() + std::chrono::milliseconds(10);
+    for (int i = 0; i < n; ++i) {
+        const Clock::time_point intended = start + schedule[i];
+        std::this_thread::sleep_until(intended);
+        double *latency = &latency_us[i];
+        queries.submit(Q.col(i % Q.cols()).data(), k, votes, false, [latency, intended](mrpt_async::QueryResult &) {
+            *latency = std::chrono::duration<double, std::micro>(Clock::now() - intended).count();
+        });
+    }
+    queries.wait();
+    step.elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+    step.n_sent = n;
+    step.latency_us = latency_us;
+    return step;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    const size_t i = std::min(values.size() - 1, (size_t) (p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    std::string server;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--mmap") o.map_index = true;
+        else if (arg == "--json") o.json = true;
+        else if (arg == "--target" && has_value) o.target = argv[++i];
+        else if (arg == "--rates" && has_value) o.rates = parse_rates(argv[++i]);
+        else if (arg == "--duration" && has_value) o.duration = std::atof(argv[++i]);
+        else if (arg == "--arrivals" && has_value) {
+            const std::string arrivals = argv[++i];
+            if (arrivals != "poisson" && arrivals != "uniform") return false;
+            o.poisson = arrivals == "poisson";
+        }
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = std::atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) o.threads = std::atoi(argv[++i]);
+        else if (arg == "--max-batch" && has_value) o.max_batch = std::atoi(argv[++i]);
+        else if (arg == "--server" && has_value) server = argv[++i];
+        else if (arg == "--connections" && has_value) o.connections = std::atoi(argv[++i]);
+        else if (arg == "--timeout-ms" && has_value) o.timeout_ms = std::atoi(argv[++i]);
+        else if (arg == "--knee" && has_value) o.knee = std::atof(argv[++i]);
+        else if (arg == "--dim" && has_value) o.dim = std::atoi(argv[++i]);
+        else if (arg == "--seed" && has_value) o.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--output" && has_value) o.output_path = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (o.threads == 0) o.threads = std::max(1u, std::thread::hardware_concurrency());
+    if (o.rates.empty() || o.duration <= 0 || o.k < 1 || o.votes < 1 || o.threads < 1 || o.max_batch < 1 ||
+        o.connections < 1 || o.timeout_ms < 1)
+        return false;
+    for (double rate : o.rates)
+        if (rate <= 0) return false;
+
+    if (o.target == "server") {
+        const size_t colon = server.rfind(':');
+        if (paths.size() != 1 || colon == std::string::npos) return false;
+        o.server_host = server.substr(0, colon);
+        o.server_port = std::atoi(server.c_str() + colon + 1);
+        o.query_path = paths[0];
+        return o.server_port > 0 && o.server_port < 65536;
+    }
+    if ((o.target != "query" && o.target != "async") || paths.size() != 3) return false;
+    o.data_path = paths[0];
+    o.index_path = paths[1];
+    o.query_path = paths[2];
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        std::fprintf(stderr, "usage: %s [--target query|async] [--rates list] [--duration s] [--arrivals a] [--k k] "
+                     "[--votes v] [--threads t] [--max-batch b] [--knee x] [--dim d] [--mmap] [--seed s] [--json] "
+                     "[--output path] data index queries\n"
+                     "       %s --target server --server host:port [--connections c] [--timeout-ms t] [--rates list] "
+                     "[--duration s] [--arrivals a] [--k k] [--votes v] [--knee x] [--dim d] [--seed s] [--json] "
+                     "[--output path] queries\n", argv[0], argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::unique_ptr<Map<const MatrixXf>> data, queries;
+    std::unique_ptr<Mrpt> index;
+    if (o.target != "server") {
+        data = map_points(o.data_path, o.dim);
+        Mrpt::IndexFileInfo info;
+        if (!data || !Mrpt::read_file_info(o.index_path.c_str(), info) || info.n_samples != data->cols() ||
+            info.dim != data->rows()) {
+            std::fprintf(stderr, "cannot map the data, or %s is not an index of it\n", o.index_path.c_str());
+            return 1;
+        }
+        index.reset(new Mrpt(data.get(), info.n_trees, info.depth, info.density, info.seed, info.projection,
+                             info.metric));
+        if (!index->load(o.index_path.c_str(), o.map_index)) {
+            std::fprintf(stderr, "%s: cannot load the index: %s\n", o.index_path.c_str(), index->load_error());
+            return 1;
+        }
+        index->prefault();
+        o.k = std::min<int>(o.k, data->cols());
+    }
+    queries = map_points(o.query_path, data ? data->rows() : o.dim);
+    if (!queries || (data && queries->rows() != data->rows())) {
+        std::fprintf(stderr, "cannot read the queries of %s\n", o.query_path.c_str());
+        return 1;
+    }
+    const Map<const MatrixXf> &Q = *queries;
+    const int dim = Q.rows();
+
+    // the state of the workers of the targets
+    std::vector<std::vector<int>> outs(o.threads, std::vector<int>(o.k));
+    std::unique_ptr<mrpt_async::AsyncQueries> async;
+    if (o.target == "async")
+        async.reset(new mrpt_async::AsyncQueries(*index, dim, o.max_batch, 0));
+    std::vector<int> sockets(o.connections, -1);
+    std::vector<std::string> buffers(o.connections);
+    const std::string search_target = "/search?k=" + std::to_string(o.k) + "&votes=" + std::to_string(o.votes);
+
+    std::function<bool(int, int)> answer;
+    int n_workers = o.threads;
+    if (o.target == "query") {
+        answer = [&](int w, int i) {
+            index->query(Q.col(i % Q.cols()), o.k, o.votes, outs[w].data());
+            return true;
+        };
+    } else if (o.target == "server") {
+        n_workers = o.connections;
+        answer = [&](int w, int i) {
+            const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(o.timeout_ms);
+            const std::string body(reinterpret_cast<const char *>(Q.col(i % Q.cols()).data()), sizeof(float) * dim);
+            mrpt_http::HttpResponse response;
+            // a connection closed by the server is opened again once
+            for (int attempt = 0; attempt < 2; ++attempt) {
+                if (sockets[w] < 0) {
+                    sockets[w] = mrpt_http::connect_to(o.server_host, o.server_port, deadline);
+                    buffers[w].clear();
+                    if (sockets[w] < 0) return false;
+                }
+                if (mrpt_http::post(sockets[w], o.server_host, search_target, body, buffers[w], response, deadline)) {
+                    if (!response.keep_alive) {
+                        close(sockets[w]);
+                        sockets[w] = -1;
+                    }
+                    return response.status == 200;
+                }
+                close(sockets[w]);
+                sockets[w] = -1;
+            }
+            return false;
+        };
+    }
+
+    FILE *out = o.output_path.empty() ? stdout : std::fopen(o.output_path.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        return 1;
+    }
+    if (o.json)
+        std::fprintf(out, "[");
+    else
+        std::fprintf(out, "target,offered_qps,sent,failed,achieved_qps,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,"
+                     "saturated\n");
+
+    std::mt19937 gen(o.seed);
+    std::sort(o.rates.begin(), o.rates.end());
+    double saturation = 0, knee = 0, base_p99 = 0;
+    bool saturated_before = false, knee_passed = false;
+    for (size_t r = 0; r < o.rates.size(); ++r) {
+        const double rate = o.rates[r];
+        const std::vector<Clock::duration> schedule = arrival_times(rate, o.duration, o.poisson, gen);
+        const Step step = async ? run_async(schedule, *async, Q, o.k, o.votes) :
+                          run_workers(schedule, n_workers, answer);
+
+        const double achieved = step.latency_us.size() / step.elapsed_s;
+        double mean = 0;
+        for (double latency : step.latency_us)
+            mean += latency / step.latency_us.size();
+        const double p50 = percentile(step.latency_us, 0.5), p90 = percentile(step.latency_us, 0.9);
+        const double p99 = percentile(step.latency_us, 0.99), p999 = percentile(step.latency_us, 0.999);
+        const double max = step.latency_us.empty() ? 0 :
+                           *std::max_element(step.latency_us.begin(), step.latency_us.end());
+        // the index keeps up with a load it answers at 95% of its rate, with a few failures at most
+        const bool saturated = achieved < 0.95 * step.n_sent / o.duration || step.n_failed > step.n_sent / 100;
+        if (r == 0) base_p99 = p99;
+        if (!saturated && !saturated_before) saturation = rate;
+        const bool within_knee = !step.latency_us.empty() && p99 <= o.knee * base_p99;
+        if (within_knee && !knee_passed) knee = rate;
+        saturated_before = saturated_before || saturated;
+        knee_passed = knee_passed || !within_knee;
+
+        if (o.json)
+            std::fprintf(out, "%s\n  {\"target\": \"%s\", \"offered_qps\": %.1f, \"sent\": %lld, \"failed\": %lld, "
+                         "\"achieved_qps\": %.1f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                         "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, \"saturated\": %s}", r ? "," : "",
+                         o.target.c_str(), rate, (long long) step.n_sent, (long long) step.n_failed, achieved, mean,
+                         p50, p90, p99, p999, max, saturated ? "true" : "false");
+        else
+            std::fprintf(out, "%s,%.1f,%lld,%lld,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%d\n", o.target.c_str(), rate,
+                         (long long) step.n_sent, (long long) step.n_failed, achieved, mean, p50, p90, p99, p999,
+                         max, saturated);
+        std::fflush(out);
+    }
+    if (o.json)
+        std::fprintf(out, "\n]\n");
+    if (out == stdout)
+        std::fflush(out);
+    else
+        std::fclose(out);
+
+    for (int s : sockets)
+        if (s >= 0) close(s);
+    if (saturation > 0)
+        std::fprintf(stderr, "saturation point: %g qps", saturation);
+    else
+        std::fprintf(stderr, "saturation point: below the lowest load");
+    std::fprintf(stderr, "; p99 knee (p99 within %gx of that of the lowest load): %g qps\n", o.knee, knee);
+    return 0;
+}
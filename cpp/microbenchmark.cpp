@@ -0,0 +1,446 @@
+/*
+ * Microbenchmarks of the hot routines of MRPT, each run alone on inputs
+ * computed beforehand by Mrpt::prepare_kernels: the projection of the queries
+ * (dense and sparse random vectors), their routing down the trees, the vote
+ * counting, the fallback to the most voted points when fewer than k are
+ * elected, the scoring of the candidates, the selection of the k nearest of
+ * their scores, and the split of the nodes of each level of a tree in the
+ * build. An optimization of one routine can so be measured apart from the
+ * rest of the query or the build, whose whole is measured by benchmark.cpp.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -march=native -fopenmp -Icpp -Icpp/lib cpp/microbenchmark.cpp -o mrpt_microbenchmark
+ *
+ * Every kernel is repeated until it has run for --min-time seconds, and that
+ * --repetitions times; the report gives the median time per unit of work of
+ * the repetitions, such as per random vector projected on or per candidate
+ * scored. On Linux, the cycles, instructions, last-level cache misses and
+ * dTLB misses per unit are read from the hardware counters of the thread, and
+ * left empty where perf_event_open is not allowed
+ * (/proc/sys/kernel/perf_event_paranoid) or the CPU lacks the counter.
+ *
+ * The data is synthetic, a mixture of Gaussian clusters of the size given with
+ * --synthetic, unless a file is given, which is read as by benchmark.cpp: an
+ * .fvecs or .bvecs file or a float32 file. The queries are read from the
+ * second file, or are points of the data with noise added.
+ *
+ * Usage: mrpt_microbenchmark [options] [data [queries]]
+ *   --synthetic n,dim    size of the synthetic data (default 100000,128)
+ *   --dim d              dimension of raw float32 files without a header
+ *   --trees t            number of trees (default 50)
+ *   --depth d            depth of the trees (default 10)
+ *   --votes v            vote threshold (default 4)
+ *   --density list       densities of the random vectors, default 1 and 1 / sqrt(dim)
+ *   --k k                number of neighbors searched for (default 10)
+ *   --n-queries n        number of queries (default 1000)
+ *   --kernels list       kernels run, of projection, routing, voting, fallback, scoring,
+ *                        selection and splitting (default all)
+ *   --repetitions r      repetitions of every kernel (default 5)
+ *   --min-time s         the least time of a repetition in seconds (default 0.2)
+ *   --seed s             seed of the random projections and the synthetic data (default 1)
+ *   --name name          name of the data set in the report
+ *   --json               report as JSON instead of CSV
+ *   --output path        the file the report is written to, stdout by default
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Mrpt.h"
+#include "mrpt_data.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char *const kernel_names[] = {"projection", "routing", "voting", "fallback", "scoring", "selection",
+                                    "splitting"};
+const int n_kernels = sizeof(kernel_names) / sizeof(kernel_names[0]);
+
+struct Options {
+    std::string data_path, query_path, name, output_path;
+    std::vector<float> densities;
+    std::vector<bool> kernels = std::vector<bool>(n_kernels, true);
+    int synthetic_n = 100000, synthetic_dim = 128, dim = 0, n_trees = 50, depth = 10, votes = 4, k = 10;
+    int n_queries = 1000, repetitions = 5;
+    double min_time = 0.2;
+    unsigned seed = 1;
+    bool json = false;
+};
+
+struct PointSet {
+    std::vector<float> values;
+    int dim = 0, n = 0;
+};
+
+bool ends_with(const std::string &s, const char *suffix) {
+    const size_t n = std::strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+std::vector<std::string> split_list(const char *s) {
+    std::vector<std::string> list;
+    for (const char *p = s; *p; ) {
+        const char *end = std::strchr(p, ',');
+        list.push_back(end ? std::string(p, end) : std::string(p));
+        if (!end) break;
+        p = end + 1;
+    }
+    return list;
+}
+
+/**
+* Reads a file of vectors, each stored as its dimension followed by its
+* components, which are float32 in .fvecs and uint8 in .bvecs files. At most
+* max_n vectors are read if max_n is positive.
+*/
+template<typename T>
+bool read_vecs(const std::string &path, int max_n, std::vector<T> &values, int &dim, int &n) {
+    FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    int32_t d;
+    std::vector<T> row;
+    for (n = 0; (max_n <= 0 || n < max_n) && std::fread(&d, sizeof d, 1, f) == 1; ++n) {
+        if (n == 0) dim = d;
+        row.resize(d);
+        if (d != dim || std::fread(row.data(), sizeof(T), d, f) != (size_t) d) {
+            std::fclose(f);
+            return false;
+        }
+        values.insert(values.end(), row.begin(), row.end());
+    }
+    std::fclose(f);
+    return n > 0;
+}
+
+/**
+* Reads the points of path into a dim x n matrix, from an .fvecs or .bvecs file
+* or from a float32 file, with the header of mrpt_data.h or of the given dimension.
+*/
+bool read_points(const std::string &path, int dim, int max_n, PointSet &m) {
+    if (ends_with(path, ".fvecs"))
+        return read_vecs(path, max_n, m.values, m.dim, m.n);
+    if (ends_with(path, ".bvecs")) {
+        std::vector<uint8_t> bytes;
+        if (!read_vecs(path, max_n, bytes, m.dim, m.n)) return false;
+        m.values.assign(bytes.begin(), bytes.end());
+        return true;
+    }
+
+    FILE *f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(f, header);
+    if (has_header < 0 || (has_header && dim > 0 && header.dim != dim) || (!has_header && dim <= 0)) {
+        std::fclose(f);
+        return false;
+    }
+    if (has_header) {
+        m.dim = header.dim;
+        m.n = header.n;
+    } else {
+        std::fseek(f, 0, SEEK_END);
+        const long bytes = std::ftell(f);
+        std::fseek(f, 0, SEEK_SET);
+        m.dim = dim;
+        m.n = bytes / ((long) sizeof(float) * dim);
+    }
+    if (max_n > 0) m.n = std::min(m.n, max_n);
+    m.values.resize((size_t) m.dim * m.n);
+    const bool ok = std::fread(m.values.data(), sizeof(float), m.values.size(), f) == m.values.size();
+    std::fclose(f);
+    return ok && m.n > 0;
+}
+
+/**
+* Fills m with n points of dimension dim drawn from a mixture of 100 Gaussian
+* clusters, as the data sets of embeddings are clustered.
+*/
+void synthetic_points(int n, int dim, std::mt19937 &gen, PointSet &m) {
+    const int n_clusters = 100;
+    std::normal_distribution<float> normal;
+    std::uniform_int_distribution<int> cluster(0, n_clusters - 1);
+    std::vector<float> centers((size_t) n_clusters * dim);
+    for (float &x : centers)
+        x = 3 * normal(gen);
+    m.dim = dim;
+    m.n = n;
+    m.values.resize((size_t) dim * n);
+    for (int i = 0; i < n; ++i) {
+        const float *center = centers.data() + (size_t) cluster(gen) * dim;
+        for (int d = 0; d < dim; ++d)
+            m.values[(size_t) i * dim + d] = center[d] + normal(gen);
+    }
+}
+
+/**
+* Returns n_queries points of the data with Gaussian noise of a tenth of the
+* spread of the data added.
+*/
+void noisy_queries(const PointSet &data, int n_queries, std::mt19937 &gen, PointSet &queries) {
+    double variance = 0;
+    for (float x : data.values)
+        variance += (double) x * x;
+    const float noise = 0.1f * std::sqrt(variance / data.values.size());
+    std::normal_distribution<float> normal(0, noise);
+    std::uniform_int_distribution<int> point(0, data.n - 1);
+    queries.dim = data.dim;
+    queries.n = n_queries;
+    queries.values.resize((size_t) data.dim * n_queries);
+    for (int i = 0; i < n_queries; ++i) {
+        const float *p = data.values.data() + (size_t) point(gen) * data.dim;
+        for (int d = 0; d < data.dim; ++d)
+            queries.values[(size_t) i * data.dim + d] = p[d] + normal(gen);
+    }
+}
+
+/**
+* The hardware counters of the calling thread: cycles, instructions, last-level
+* cache misses and dTLB misses, each -1 if it cannot be read.
+*/
+class Counters {
+ public:
+    static const int n_counters = 4;
+
+    Counters() {
+        std::fill(fds, fds + n_counters, -1);
+#ifdef __linux__
+        const uint32_t types[n_counters] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                            PERF_TYPE_HW_CACHE};
+        const uint64_t configs[n_counters] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+            PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16};
+        for (int c = 0; c < n_counters; ++c) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[c];
+            attr.config = configs[c];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~Counters() {
+#ifdef __linux__
+        for (int fd : fds)
+            if (fd >= 0) close(fd);
+#endif
+    }
+
+    Counters(const Counters &) = delete;
+    Counters &operator=(const Counters &) = delete;
+
+    void start() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd < 0) continue;
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /**
+    * Stops the counters and adds their counts since start to totals.
+    */
+    void stop(int64_t *totals) {
+        for (int c = 0; c < n_counters; ++c) {
+            long long count = -1;
+#ifdef __linux__
+            if (fds[c] >= 0) {
+                ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+                if (read(fds[c], &count, sizeof(count)) != sizeof(count))
+                    count = -1;
+            }
+#endif
+            totals[c] = count < 0 || totals[c] < 0 ? -1 : totals[c] + count;
+        }
+    }
+
+ private:
+    int fds[n_counters];
+};
+
+double median(std::vector<double> values) {
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--json") o.json = true;
+        else if (arg == "--synthetic" && has_value) {
+            const std::vector<std::string> size = split_list(argv[++i]);
+            if (size.size() != 2) return false;
+            o.synthetic_n = std::atoi(size[0].c_str());
+            o.synthetic_dim = std::atoi(size[1].c_str());
+        }
+        else if (arg == "--dim" && has_value) o.dim = std::atoi(argv[++i]);
+        else if (arg == "--trees" && has_value) o.n_trees = std::atoi(argv[++i]);
+        else if (arg == "--depth" && has_value) o.depth = std::atoi(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = std::atoi(argv[++i]);
+        else if (arg == "--density" && has_value) {
+            for (const std::string &density : split_list(argv[++i]))
+                o.densities.push_back(std::atof(density.c_str()));
+        }
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--n-queries" && has_value) o.n_queries = std::atoi(argv[++i]);
+        else if (arg == "--kernels" && has_value) {
+            o.kernels.assign(n_kernels, false);
+            for (const std::string &name : split_list(argv[++i])) {
+                const int kernel = std::find(kernel_names, kernel_names + n_kernels, name) - kernel_names;
+                if (kernel == n_kernels) return false;
+                o.kernels[kernel] = true;
+            }
+        }
+        else if (arg == "--repetitions" && has_value) o.repetitions = std::atoi(argv[++i]);
+        else if (arg == "--min-time" && has_value) o.min_time = std::atof(argv[++i]);
+        else if (arg == "--seed" && has_value) o.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--name" && has_value) o.name = argv[++i];
+        else if (arg == "--output" && has_value) o.output_path = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (paths.size() > 2 || o.k < 1 || o.n_trees < 1 || o.depth < 1 || o.votes < 1 || o.n_queries < 1 ||
+        o.repetitions < 1 || o.synthetic_n < 2 || o.synthetic_dim < 1)
+        return false;
+    for (float density : o.densities)
+        if (!(density > 0 && density <= 1)) return false;
+    if (paths.size() > 0) o.data_path = paths[0];
+    if (paths.size() > 1) o.query_path = paths[1];
+    if (o.name.empty()) o.name = o.data_path.empty() ? "synthetic" : o.data_path;
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        std::fprintf(stderr, "usage: %s [--synthetic n,dim] [--dim d] [--trees t] [--depth d] [--votes v] "
+                     "[--density list] [--k k] [--n-queries n] [--kernels list] [--repetitions r] [--min-time s] "
+                     "[--seed s] [--name name] [--json] [--output path] [data [queries]]\n", argv[0]);
+        return 2;
+    }
+
+    std::mt19937 gen(o.seed);
+    PointSet data, queries;
+    if (o.data_path.empty()) {
+        synthetic_points(o.synthetic_n, o.synthetic_dim, gen, data);
+    } else if (!read_points(o.data_path, o.dim, 0, data)) {
+        std::fprintf(stderr, "cannot read the data\n");
+        return 1;
+    }
+    if (o.query_path.empty()) {
+        noisy_queries(data, o.n_queries, gen, queries);
+    } else if (!read_points(o.query_path, o.dim, o.n_queries, queries) || queries.dim != data.dim) {
+        std::fprintf(stderr, "cannot read the queries\n");
+        return 1;
+    }
+    const int dim = data.dim, n = data.n, k = std::min(o.k, n);
+    const int depth = std::min<int>(o.depth, std::ceil(std::log2((double) n)));
+    Map<const MatrixXf> X(data.values.data(), dim, n), Q(queries.values.data(), dim, queries.n);
+    if (o.densities.empty())
+        o.densities = {1, 1 / std::sqrt((float) dim)};
+
+    FILE *out = o.output_path.empty() ? stdout : std::fopen(o.output_path.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        return 1;
+    }
+    if (o.json)
+        std::fprintf(out, "[");
+    else
+        std::fprintf(out, "dataset,n,dim,k,n_trees,depth,density,votes_required,kernel,level,units,ns_per_unit,"
+                     "cycles_per_unit,instructions_per_unit,llc_misses_per_unit,dtlb_misses_per_unit\n");
+
+    Counters counters;
+    bool first_row = true;
+    for (float density : o.densities) {
+        Mrpt index(&X, o.n_trees, depth, density, o.seed);
+        index.grow(1);
+
+        for (int kernel = 0; kernel < n_kernels; ++kernel) {
+            if (!o.kernels[kernel]) continue;
+            const bool splitting = kernel == Mrpt::KERNEL_SPLITTING;
+            // the projection is the one kernel that depends on the density, besides the trees it builds
+            for (int level = 0; level < (splitting ? depth : 1); ++level) {
+                Mrpt::KernelInputs inputs;
+                index.prepare_kernels(Q, k, o.votes, level, inputs);
+                const Mrpt::Kernel which = static_cast<Mrpt::Kernel>(kernel);
+
+                std::vector<double> ns_per_unit;
+                int64_t units = 0, totals[Counters::n_counters] = {0, 0, 0, 0};
+                index.run_kernel(which, inputs); // warm up the caches and the working memory
+                for (int r = 0; r < o.repetitions; ++r) {
+                    int64_t repetition_units = 0;
+                    double elapsed = 0;
+                    do {
+                        const Clock::time_point start = Clock::now();
+                        counters.start();
+                        repetition_units += index.run_kernel(which, inputs);
+                        counters.stop(totals);
+                        elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+                    } while (elapsed < o.min_time && repetition_units > 0);
+                    units += repetition_units;
+                    ns_per_unit.push_back(repetition_units ? 1e9 * elapsed / repetition_units : 0);
+                }
+
+                char per_unit[Counters::n_counters][32];
+                for (int c = 0; c < Counters::n_counters; ++c) {
+                    if (totals[c] < 0 || units == 0)
+                        per_unit[c][0] = '\0';
+                    else
+                        std::snprintf(per_unit[c], sizeof(per_unit[c]), "%.3f", (double) totals[c] / units);
+                }
+                if (o.json) {
+                    std::fprintf(out, "%s\n  {\"dataset\": \"%s\", \"n\": %d, \"dim\": %d, \"k\": %d, \"n_trees\": %d, "
+                                 "\"depth\": %d, \"density\": %g, \"votes_required\": %d, \"kernel\": \"%s\", "
+                                 "\"level\": %d, \"units\": %lld, \"ns_per_unit\": %.3f", first_row ? "" : ",",
+                                 o.name.c_str(), n, dim, k, o.n_trees, depth, density, o.votes, kernel_names[kernel],
+                                 splitting ? level : -1, (long long) units, median(ns_per_unit));
+                    const char *keys[Counters::n_counters] = {"cycles_per_unit", "instructions_per_unit",
+                                                             "llc_misses_per_unit", "dtlb_misses_per_unit"};
+                    for (int c = 0; c < Counters::n_counters; ++c)
+                        std::fprintf(out, ", \"%s\": %s", keys[c], per_unit[c][0] ? per_unit[c] : "null");
+                    std::fprintf(out, "}");
+                } else {
+                    std::fprintf(out, "%s,%d,%d,%d,%d,%d,%g,%d,%s,%d,%lld,%.3f,%s,%s,%s,%s\n", o.name.c_str(), n, dim,
+                                 k, o.n_trees, depth, density, o.votes, kernel_names[kernel], splitting ? level : -1,
+                                 (long long) units, median(ns_per_unit), per_unit[0], per_unit[1], per_unit[2],
+                                 per_unit[3]);
+                }
+                std::fflush(out);
+                first_row = false;
+            }
+        }
+    }
+
+    if (o.json)
+        std::fprintf(out, "\n]\n");
+    if (out != stdout)
+        std::fclose(out);
+    return 0;
+}
@@ -0,0 +1,283 @@
+#ifndef CPP_MRPT_ASYNC_H_
+#define CPP_MRPT_ASYNC_H_
+
+/*
+ * Asynchronous queries of an Mrpt index, for servers built around an event
+ * loop that must not block on a query. A query is submitted with a callback
+ * or for a future and answered by a dispatcher thread, which takes all the
+ * queries waiting, up to a batch, and answers the queries of the batch that
+ * have the same parameters together with query_batch: they are projected with
+ * one matrix product and divided between the OpenMP threads. The queries that
+ * arrive while a batch is answered form the next batch, so under load the
+ * concurrent queries are batched without any added latency; a wait can be set
+ * to collect larger batches when the load is light.
+ *
+ * The same object serves the blocking queries of many client threads with
+ * query, which submits a query and waits for it: the threads then share the
+ * batched projections instead of each paying for a single query.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Mrpt.h"
+
+namespace mrpt_async {
+
+/*
+* The answer to one query.
+*/
+struct QueryResult {
+    std::vector<int> indices; // the k neighbors, in ascending order of distance, -1 where fewer were found
+    std::vector<float> distances; // their distances to the query, empty if they were not requested
+};
+
+/*
+* How the queries were batched, for tuning max_batch and max_wait_us.
+*/
+struct BatchStats {
+    long long n_batches = 0; // the batches answered
+    long long n_queries = 0; // the queries answered in them
+    long long n_full = 0; // the batches of max_batch queries
+};
+
+class AsyncQueries {
+ public:
+    typedef std::function<void(QueryResult &)> Callback;
+
+    /**
+    * Starts the dispatcher thread.
+    * @param index - The index queried, which must outlive this object and must
+    * not be modified while queries are pending
+    * @param dim - The dimension of the data and of the queries
+    * @param max_batch - The largest number of queries answered together
+    * @param max_wait_us - How long in microseconds after the oldest query
+    * waiting was submitted the dispatcher waits for a batch to fill, which
+    * bounds the latency added by batching; 0 (the default) answers the queries
+    * waiting at once
+    */
+    AsyncQueries(const Mrpt &index, int dim, int max_batch = 256, int max_wait_us = 0) :
+        state(std::make_shared<State>()) {
+        state->index = &index;
+        state->dim = dim;
+        state->max_batch = std::max(1, max_batch);
+        state->max_wait_us = std::max(0, max_wait_us);
+        dispatcher = std::thread(run, state);
+    }
+
+    AsyncQueries(const AsyncQueries &) = delete;
+    AsyncQueries &operator=(const AsyncQueries &) = delete;
+
+    /**
+    * Answers the queries still pending, and stops the dispatcher thread. When
+    * called from a callback, that is on the dispatcher thread, no other query
+    * may be pending, and the thread stops once the callback returns.
+    */
+    ~AsyncQueries() {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stopping = true;
+        }
+        state->query_waiting.notify_one();
+        if (std::this_thread::get_id() == dispatcher.get_id())
+            dispatcher.detach();
+        else
+            dispatcher.join();
+    }
+
+    /**
+    * Submits a query, which is copied, and returns at once.
+    * @param q - The query, a vector of dim floats
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param return_distances - Whether the distances of the neighbors are also computed
+    * @param done - Called on the dispatcher thread with the result once the
+    * query is answered. It delays the queries answered after it, so it should
+    * only hand the result over, and it must not throw.
+    */
+    void submit(const float *q, int k, int votes_required, bool return_distances, Callback done) {
+        Request request;
+        request.q.assign(q, q + state->dim);
+        request.k = k;
+        request.votes_required = votes_required;
+        request.return_distances = return_distances;
+        request.done = std::move(done);
+        request.submitted = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->queue.push_back(std::move(request));
+            ++state->n_pending;
+        }
+        state->query_waiting.notify_one();
+    }
+
+    /**
+    * Submits a query as above, and returns a future of its result.
+    */
+    std::future<QueryResult> submit(const float *q, int k, int votes_required, bool return_distances = false) {
+        std::shared_ptr<std::promise<QueryResult>> promise = std::make_shared<std::promise<QueryResult>>();
+        std::future<QueryResult> result = promise->get_future();
+        submit(q, k, votes_required, return_distances, [promise](QueryResult &r) {
+            promise->set_value(std::move(r));
+        });
+        return result;
+    }
+
+    /**
+    * Submits a query and waits for its answer, like Mrpt::query but batched
+    * with the queries of the other threads. Must not be called from a callback.
+    * @param q - The query, a vector of dim floats
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - Output buffer for the indices of the k approximate nearest neighbors
+    * @param out_distances - Output buffer for their distances (optional parameter)
+    */
+    void query(const float *q, int k, int votes_required, int *out, float *out_distances = nullptr) {
+        std::promise<void> answered;
+        submit(q, k, votes_required, out_distances != nullptr, [&](QueryResult &r) {
+            std::copy(r.indices.begin(), r.indices.end(), out);
+            if (out_distances)
+                std::copy(r.distances.begin(), r.distances.end(), out_distances);
+            answered.set_value();
+        });
+        answered.get_future().wait();
+    }
+
+    /**
+    * Returns how the queries answered so far were batched.
+    */
+    BatchStats stats() const {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->stats;
+    }
+
+    /**
+    * Returns the number of queries submitted whose callbacks have not returned yet.
+    */
+    int pending() const {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->n_pending;
+    }
+
+    /**
+    * Waits until every query submitted so far has been answered and its
+    * callback has returned. Must not be called from a callback.
+    */
+    void wait() const {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->all_answered.wait(lock, [this] { return state->n_pending == 0; });
+    }
+
+ private:
+    struct Request {
+        std::vector<float> q;
+        int k, votes_required;
+        bool return_distances;
+        Callback done;
+        std::chrono::steady_clock::time_point submitted;
+    };
+
+    // shared with the dispatcher thread, which outlives this object when it is destroyed from a callback
+    struct State {
+        const Mrpt *index = nullptr;
+        int dim = 0, max_batch = 0, max_wait_us = 0;
+        mutable std::mutex mutex; // guards the members below
+        std::condition_variable query_waiting, all_answered;
+        std::deque<Request> queue;
+        int n_pending = 0; // queued or being answered
+        bool stopping = false;
+        BatchStats stats;
+    };
+
+    static void run(std::shared_ptr<State> state) {
+        std::vector<Request> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->query_waiting.wait(lock, [&] { return state->stopping || !state->queue.empty(); });
+                if (state->queue.empty())
+                    return;
+                if (state->max_wait_us > 0 && !state->stopping && (int) state->queue.size() < state->max_batch) {
+                    const std::chrono::steady_clock::time_point deadline =
+                        state->queue.front().submitted + std::chrono::microseconds(state->max_wait_us);
+                    state->query_waiting.wait_until(lock, deadline, [&] {
+                        return state->stopping || (int) state->queue.size() >= state->max_batch;
+                    });
+                }
+                const int n = std::min<int>(state->max_batch, state->queue.size());
+                batch.clear();
+                for (int i = 0; i < n; ++i) {
+                    batch.push_back(std::move(state->queue.front()));
+                    state->queue.pop_front();
+                }
+            }
+
+            answer(*state, batch);
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->n_pending -= batch.size();
+            ++state->stats.n_batches;
+            state->stats.n_queries += batch.size();
+            state->stats.n_full += (int) batch.size() == state->max_batch;
+            if (!state->n_pending)
+                state->all_answered.notify_all();
+        }
+    }
+
+    /**
+    * Answers a batch, each run of queries with the same k and votes_required
+    * with one call to query_batch.
+    */
+    static void answer(const State &state, std::vector<Request> &batch) {
+        std::stable_sort(batch.begin(), batch.end(), [](const Request &a, const Request &b) {
+            return a.k != b.k ? a.k < b.k : a.votes_required < b.votes_required;
+        });
+
+        std::vector<int> out;
+        std::vector<float> out_distances;
+        QueryResult result;
+        for (size_t first = 0, last; first < batch.size(); first = last) {
+            const int k = batch[first].k, votes_required = batch[first].votes_required;
+            bool distances = false;
+            for (last = first; last < batch.size() && batch[last].k == k &&
+                 batch[last].votes_required == votes_required; ++last)
+                distances = distances || batch[last].return_distances;
+
+            const int n = last - first;
+            MatrixXf Q(state.dim, n);
+            for (int i = 0; i < n; ++i)
+                std::copy(batch[first + i].q.begin(), batch[first + i].q.end(), Q.col(i).data());
+            out.resize((size_t) n * k);
+            out_distances.resize(distances ? (size_t) n * k : 0);
+            state.index->query_batch(Map<const MatrixXf>(Q.data(), state.dim, n), k, votes_required, out.data(),
+                                     distances ? out_distances.data() : nullptr);
+
+            for (int i = 0; i < n; ++i) {
+                Request &request = batch[first + i];
+                result.indices.assign(out.begin() + (size_t) i * k, out.begin() + (size_t) (i + 1) * k);
+                if (request.return_distances)
+                    result.distances.assign(out_distances.begin() + (size_t) i * k,
+                                            out_distances.begin() + (size_t) (i + 1) * k);
+                else
+                    result.distances.clear();
+                request.done(result);
+                request.done = nullptr;
+            }
+        }
+    }
+
+    std::shared_ptr<State> state;
+    std::thread dispatcher;
+};
+
+} // namespace mrpt_async
+
+#endif // CPP_MRPT_ASYNC_H_
@@ -0,0 +1,196 @@
+/*
+ * The implementation of the C interface of mrpt_c.h, which is compiled into
+ * libmrpt. See mrpt_c.h for how to build it.
+ */
+
+#define MRPT_C_BUILD
+#include "mrpt_c.h"
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "Mrpt.h"
+#include "mrpt_data.h"
+#include "mrpt_mmap.h"
+
+struct mrpt_index {
+    std::unique_ptr<Mrpt> index;
+    int dim = 0;
+    bool built = false; // whether the trees are grown or loaded
+    std::string error;
+};
+
+namespace {
+
+/**
+* Returns true if the parameters of an index over n points of dimension dim
+* are in range, as MRPTIndex checks them.
+*/
+bool valid_parameters(int n, int dim, int n_trees, int depth, float density, int projection, int metric) {
+    return n > 0 && dim > 0 && n_trees > 0 && depth >= 1 && depth <= std::ceil(std::log2((double) n)) &&
+           density > 0 && density <= 1 && projection >= Mrpt::GAUSSIAN && projection <= Mrpt::HADAMARD &&
+           metric >= Mrpt::EUCLIDEAN && metric <= Mrpt::COSINE;
+}
+
+mrpt_index *create(Mrpt::Data data, int n_trees, int depth, float density, uint32_t seed, int projection,
+                   int metric) {
+    std::unique_ptr<mrpt_index> handle(new (std::nothrow) mrpt_index);
+    if (!handle)
+        return nullptr;
+    handle->dim = data.dim();
+    handle->index.reset(new Mrpt(std::move(data), n_trees, depth, density, seed,
+                                 static_cast<Mrpt::Projection>(projection), static_cast<Mrpt::Metric>(metric)));
+    return handle.release();
+}
+
+/**
+* Returns -1 after recording why a call on the index failed.
+*/
+int fail(const mrpt_index *index, const char *reason) {
+    const_cast<mrpt_index *>(index)->error = reason;
+    return -1;
+}
+
+bool valid_query(const mrpt_index *index, const float *queries, int n_queries, int k, const int32_t *out_ids) {
+    return index && queries && n_queries >= 0 && k > 0 && k <= index->index->size() && out_ids;
+}
+
+} // namespace
+
+extern "C" {
+
+uint32_t mrpt_api_version(void) {
+    return MRPT_C_API_VERSION;
+}
+
+mrpt_index *mrpt_create(const float *data, int n, int dim, int n_trees, int depth, float density,
+                        uint32_t seed, int projection, int metric) {
+    if (!data || !valid_parameters(n, dim, n_trees, depth, density, projection, metric))
+        return nullptr;
+    try {
+        return create(Mrpt::Data::borrow(data, dim, n), n_trees, depth, density, seed, projection, metric);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+mrpt_index *mrpt_create_from_file(const char *path, int dim, int n_trees, int depth, float density,
+                                  uint32_t seed, int projection, int metric) {
+    FILE *fd = std::fopen(path, "rb");
+    if (!fd)
+        return nullptr;
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(fd, header);
+    std::fseek(fd, 0, SEEK_END);
+    const long long bytes = std::ftell(fd);
+    int64_t n = 0;
+    size_t offset = 0;
+    if (has_header > 0) {
+        n = header.n;
+        dim = header.dim;
+        offset = header.data_offset;
+    } else if (has_header == 0 && dim > 0) {
+        n = bytes / ((long long) sizeof(float) * dim);
+    }
+
+    char *mapping = nullptr;
+    if (n > 0 && n <= std::numeric_limits<int>::max() && (long long) (offset + sizeof(float) * n * dim) <= bytes &&
+        valid_parameters(n, dim, n_trees, depth, density, projection, metric))
+        mapping = static_cast<char *>(mrpt_mmap::map_file(fd, bytes));
+    std::fclose(fd);
+    if (!mapping)
+        return nullptr;
+
+    const float *points = reinterpret_cast<const float *>(mapping + offset);
+    Mrpt::Data data = Mrpt::Data::adopt(points, dim, n, [mapping, bytes] { mrpt_mmap::unmap_file(mapping, bytes); },
+                                        true);
+    try {
+        return create(std::move(data), n_trees, depth, density, seed, projection, metric);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void mrpt_free(mrpt_index *index) {
+    delete index;
+}
+
+const char *mrpt_error(const mrpt_index *index) {
+    return index ? index->error.c_str() : "";
+}
+
+int mrpt_size(const mrpt_index *index) {
+    return index->index->size();
+}
+
+int mrpt_dim(const mrpt_index *index) {
+    return index->dim;
+}
+
+int mrpt_build(mrpt_index *index) {
+    index->error.clear();
+    try {
+        index->index->grow(1);
+        index->built = true;
+        return 0;
+    } catch (const std::bad_alloc &) {
+        return fail(index, "out of memory");
+    } catch (...) {
+        return fail(index, "the trees could not be grown");
+    }
+}
+
+int mrpt_query_batch(const mrpt_index *index, const float *queries, int n_queries, int k, int votes_required,
+                     int32_t *out_ids, float *out_distances) {
+    if (!valid_query(index, queries, n_queries, k, out_ids) || votes_required < 1 || !index->built)
+        return -1;
+    try {
+        const Map<const MatrixXf> Q(queries, index->dim, n_queries);
+        index->index->query_batch(Q, k, votes_required, out_ids, out_distances);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int mrpt_exact_search_batch(const mrpt_index *index, const float *queries, int n_queries, int k,
+                            int32_t *out_ids, float *out_distances) {
+    if (!valid_query(index, queries, n_queries, k, out_ids) || !index->index->uses_data())
+        return -1;
+    try {
+        const Map<const MatrixXf> Q(queries, index->dim, n_queries);
+        index->index->exact_knn_batch(Q, k, out_ids, out_distances);
+        return 0;
+    } catch (...) {
+        return -1;
+    }
+}
+
+int mrpt_save(const mrpt_index *index, const char *path) {
+    const_cast<mrpt_index *>(index)->error.clear();
+    if (!index->built)
+        return fail(index, "the index is not built");
+    try {
+        return index->index->save(path) ? 0 : fail(index, "cannot write the index file");
+    } catch (...) {
+        return fail(index, "out of memory");
+    }
+}
+
+int mrpt_load(mrpt_index *index, const char *path, int map_file) {
+    index->error.clear();
+    try {
+        if (!index->index->load(path, map_file))
+            return fail(index, index->index->load_error());
+        index->built = true;
+        return 0;
+    } catch (...) {
+        return fail(index, "out of memory");
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,143 @@
+#ifndef CPP_MRPT_C_H_
+#define CPP_MRPT_C_H_
+
+/*
+ * A C interface to Mrpt, for the bindings of other languages such as Go or
+ * Rust, which link it as libmrpt instead of compiling Mrpt.h. An index is an
+ * opaque mrpt_index handle, and all the buffers are the caller's: the data
+ * is borrowed, the queries are read in place, and the neighbors are written
+ * into the arrays given. The points and the queries are rows of dim float32
+ * components, one after another.
+ *
+ * Build the shared library with
+ *   g++ -std=c++11 -O3 -fopenmp -fPIC -shared -fvisibility=hidden -Icpp -Icpp/lib cpp/mrpt_c.cpp -o libmrpt.so
+ * or the static one with
+ *   g++ -std=c++11 -O3 -fopenmp -fPIC -c -Icpp -Icpp/lib cpp/mrpt_c.cpp -o mrpt_c.o && ar rcs libmrpt.a mrpt_c.o
+ * and link a static libmrpt with the C++ library and OpenMP (-lstdc++ -lgomp).
+ *
+ * The functions returning int return 0 on success and -1 on failure; then
+ * mrpt_error tells why, except after the queries, which fail only for
+ * arguments out of range and leave the error as it was. The queries and the
+ * other functions taking a const index may run concurrently with each other
+ * on one index; the others must not overlap with any call on the same index.
+ * No C++ exception crosses the interface.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(MRPT_C_BUILD)
+#define MRPT_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define MRPT_API
+#else
+#define MRPT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The version of this interface; functions are only ever added under the same version. */
+#define MRPT_C_API_VERSION 1
+
+typedef struct mrpt_index mrpt_index;
+
+enum mrpt_projection {
+    MRPT_GAUSSIAN = 0,
+    MRPT_RADEMACHER = 1,
+    MRPT_HADAMARD = 2
+};
+
+enum mrpt_metric {
+    MRPT_EUCLIDEAN = 0,
+    MRPT_INNER_PRODUCT = 1,
+    MRPT_COSINE = 2
+};
+
+/*
+ * Returns the MRPT_C_API_VERSION the library was built with, to check at run
+ * time that it matches the header a binding was written against.
+ */
+MRPT_API uint32_t mrpt_api_version(void);
+
+/*
+ * Creates an index over n points of dimension dim, which it borrows: data must
+ * stay alive and unchanged until the index is freed. The trees are grown by
+ * mrpt_build.
+ * @param density - The expected ratio of non-zero components of the random
+ * vectors, in (0, 1]; 1 for dense vectors
+ * @param seed - The seed of the random vectors, or 0 for a random one
+ * @param projection - An mrpt_projection
+ * @param metric - An mrpt_metric
+ * @return The index, or NULL if a parameter is out of range or there is no memory.
+ */
+MRPT_API mrpt_index *mrpt_create(const float *data, int n, int dim, int n_trees, int depth, float density,
+                                 uint32_t seed, int projection, int metric);
+
+/*
+ * Creates an index like mrpt_create over the points of a data file of
+ * mrpt_data.h, or of a raw float32 file when dim is given, which is mapped
+ * into memory and unmapped when the index is freed.
+ * @param dim - The dimension of a file without a header, or 0 for a file with one
+ * @return The index, or NULL if the file cannot be mapped or a parameter is out of range.
+ */
+MRPT_API mrpt_index *mrpt_create_from_file(const char *path, int dim, int n_trees, int depth, float density,
+                                           uint32_t seed, int projection, int metric);
+
+/*
+ * Frees the index, and unmaps the data file of mrpt_create_from_file. NULL is ignored.
+ */
+MRPT_API void mrpt_free(mrpt_index *index);
+
+/*
+ * Returns why the last failed call on the index failed, or an empty string.
+ * The string is valid until the next call on the index.
+ */
+MRPT_API const char *mrpt_error(const mrpt_index *index);
+
+/* The number of points of the index and their dimension. */
+MRPT_API int mrpt_size(const mrpt_index *index);
+MRPT_API int mrpt_dim(const mrpt_index *index);
+
+/*
+ * Grows the trees of the index with all threads.
+ */
+MRPT_API int mrpt_build(mrpt_index *index);
+
+/*
+ * Finds the k approximate nearest neighbors of each of n_queries queries, in
+ * parallel. The neighbors of query i go to out_ids[i * k, (i + 1) * k), with
+ * -1 where fewer than k were found, and their distances likewise to
+ * out_distances unless it is NULL.
+ * @param votes_required - The votes a point needs to be a candidate, at least 1
+ */
+MRPT_API int mrpt_query_batch(const mrpt_index *index, const float *queries, int n_queries, int k,
+                              int votes_required, int32_t *out_ids, float *out_distances);
+
+/*
+ * Finds the exact k nearest neighbors of each query as mrpt_query_batch lays
+ * them out. Needs the data.
+ */
+MRPT_API int mrpt_exact_search_batch(const mrpt_index *index, const float *queries, int n_queries, int k,
+                                     int32_t *out_ids, float *out_distances);
+
+/*
+ * Saves the trees to an index file, which mrpt_load and MRPTIndex.load read.
+ */
+MRPT_API int mrpt_save(const mrpt_index *index, const char *path);
+
+/*
+ * Loads an index file saved from an index over the same points with the same
+ * parameters.
+ * @param map_file - If nonzero, the file is mapped into memory and the trees
+ * are used from the mapping, so that processes mapping one file share it in
+ * the page cache and the load takes no time
+ */
+MRPT_API int mrpt_load(mrpt_index *index, const char *path, int map_file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CPP_MRPT_C_H_
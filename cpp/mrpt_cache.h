@@ -0,0 +1,440 @@
+#ifndef CPP_MRPT_CACHE_H_
+#define CPP_MRPT_CACHE_H_
+
+/*
+ * A cache of the answers of an Mrpt index, for traffic in which the same
+ * queries come again, such as the vectors of popular items. An answer is
+ * found by a hash of the bytes of the query and its k and votes_required, and
+ * the query itself is compared too, so only a query repeated exactly hits.
+ * A hit skips the projection, the voting and the linear search altogether.
+ *
+ * The cache holds at most a given number of answers, evicting the least
+ * recently used one. It is divided into shards by the hash, each with a lock
+ * of its own, so concurrent queries rarely wait for each other. The answers
+ * are dropped when Mrpt::change_count tells that the index has changed, by
+ * insert or remove for example. A hot swap replaces the index, so the cache
+ * should be replaced with it, for example by keeping both in the snapshot of
+ * mrpt_snapshot.h, or cleared.
+ *
+ * A SessionCache keeps the Mrpt::QuerySessions of queries answered a page at
+ * a time, such as the results of a search shown 20 at a time, found by a
+ * token for as long as pages of them are asked for within a time to live.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Mrpt.h"
+
+namespace mrpt_cache {
+
+/*
+* The counters of a QueryCache, for its hit rate.
+*/
+struct CacheStats {
+    long long n_hits = 0; // the lookups that found an answer
+    long long n_misses = 0; // the lookups that did not
+    long long n_evictions = 0; // the answers evicted to make room for others
+    long long n_invalidations = 0; // the answers dropped because the index changed
+    long long n_entries = 0; // the answers held now
+
+    double hit_rate() const {
+        return n_hits + n_misses ? (double) n_hits / (n_hits + n_misses) : 0;
+    }
+};
+
+class QueryCache {
+ public:
+    /**
+    * @param index - The index queried, which must outlive this object
+    * @param dim - The dimension of the data and of the queries
+    * @param capacity - The largest number of answers held, 0 for a cache that holds none
+    * @param n_shards - The number of parts with a lock of their own the cache is divided into
+    */
+    QueryCache(const Mrpt &index_, int dim_, size_t capacity, int n_shards = 16) :
+        index(index_),
+        dim(dim_),
+        shards(std::max(1, n_shards)),
+        shard_capacity((capacity + shards.size() - 1) / shards.size()) {
+        for (Shard &shard : shards)
+            shard.changes = index.change_count();
+    }
+
+    QueryCache(const QueryCache &) = delete;
+    QueryCache &operator=(const QueryCache &) = delete;
+
+    /**
+    * Answers a query like Mrpt::query, from the cache if it holds the answer,
+    * and otherwise with the index, keeping the answer. Can be called
+    * concurrently with the other methods, but not with the methods that modify
+    * the index.
+    * @param q - The query, a vector of dim floats
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer for the indices of the k neighbors
+    * @param out_distances - The output buffer for their distances, or nullptr
+    */
+    void query(const float *q, int k, int votes_required, int *out, float *out_distances = nullptr) {
+        if (lookup(q, k, votes_required, out, out_distances))
+            return;
+        index.query(Map<const VectorXf>(q, dim), k, votes_required, out, out_distances);
+        store(q, k, votes_required, out, out_distances);
+    }
+
+    /**
+    * Copies the answer to a query into out and out_distances if the cache holds it.
+    * @return True on a hit. An answer kept without distances misses when
+    * out_distances is not nullptr.
+    */
+    bool lookup(const float *q, int k, int votes_required, int *out, float *out_distances = nullptr) {
+        const uint64_t key = hash(q, k, votes_required);
+        Shard &shard = shard_of(key);
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            check_changes(shard);
+            const auto found = shard.entries.find(key);
+            if (found != shard.entries.end()) {
+                const Entry &entry = *found->second;
+                if (entry.k == k && entry.votes_required == votes_required &&
+                    (!out_distances || !entry.distances.empty()) &&
+                    !std::memcmp(entry.q.data(), q, sizeof(float) * dim)) {
+                    std::copy(entry.indices.begin(), entry.indices.end(), out);
+                    if (out_distances)
+                        std::copy(entry.distances.begin(), entry.distances.end(), out_distances);
+                    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+                    n_hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        n_misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /**
+    * Keeps the answer to a query, found for example with the AsyncQueries of
+    * mrpt_async.h after a lookup missed, evicting the least recently used
+    * answer of its shard if it is full. An answer with the same hash is replaced.
+    * @param out_distances - The distances of the neighbors, or nullptr
+    */
+    void store(const float *q, int k, int votes_required, const int *out, const float *out_distances = nullptr) {
+        if (!shard_capacity)
+            return;
+        const uint64_t key = hash(q, k, votes_required);
+        Shard &shard = shard_of(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        check_changes(shard);
+        const auto found = shard.entries.find(key);
+        if (found != shard.entries.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+        } else {
+            if (shard.entries.size() >= shard_capacity) {
+                // the least recently used entry is reused for the new answer
+                shard.entries.erase(shard.lru.back().key);
+                shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+                n_evictions.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                shard.lru.emplace_front();
+            }
+            shard.entries.emplace(key, shard.lru.begin());
+        }
+
+        Entry &entry = shard.lru.front();
+        entry.key = key;
+        entry.k = k;
+        entry.votes_required = votes_required;
+        entry.q.assign(q, q + dim);
+        entry.indices.assign(out, out + k);
+        if (out_distances)
+            entry.distances.assign(out_distances, out_distances + k);
+        else
+            entry.distances.clear();
+    }
+
+    /**
+    * Drops all the answers, for example after the index was swapped for another.
+    */
+    void clear() {
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.lru.clear();
+            shard.changes = index.change_count();
+        }
+    }
+
+    /**
+    * Returns the counters of the cache. Can be called concurrently with the queries.
+    */
+    CacheStats stats() const {
+        CacheStats stats;
+        stats.n_hits = n_hits.load(std::memory_order_relaxed);
+        stats.n_misses = n_misses.load(std::memory_order_relaxed);
+        stats.n_evictions = n_evictions.load(std::memory_order_relaxed);
+        stats.n_invalidations = n_invalidations.load(std::memory_order_relaxed);
+        for (const Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            stats.n_entries += shard.entries.size();
+        }
+        return stats;
+    }
+
+    /**
+    * Returns the counters in the text exposition format of Prometheus.
+    * @param prefix - The beginning of the names of the metrics
+    * @param labels - Labels added to every sample, such as index="main"
+    */
+    std::string prometheus_text(const std::string &prefix = "mrpt", const std::string &labels = "") const {
+        const CacheStats s = stats();
+        const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        const struct { const char *name, *type, *help; long long value; } samples[] = {
+            {"_cache_hits_total", "counter", "Number of queries answered from the cache.", s.n_hits},
+            {"_cache_misses_total", "counter", "Number of queries not found in the cache.", s.n_misses},
+            {"_cache_evictions_total", "counter", "Number of answers evicted from the cache.", s.n_evictions},
+            {"_cache_invalidations_total", "counter", "Number of answers dropped because the index changed.",
+             s.n_invalidations},
+            {"_cache_entries", "gauge", "Number of answers in the cache.", s.n_entries},
+        };
+        std::string text;
+        for (const auto &sample : samples) {
+            const std::string name = prefix + sample.name;
+            text += "# HELP " + name + " " + sample.help + "\n";
+            text += "# TYPE " + name + " " + sample.type + "\n";
+            text += name + braces + " " + std::to_string(sample.value) + "\n";
+        }
+        return text;
+    }
+
+ private:
+    struct Entry {
+        uint64_t key;
+        int k, votes_required;
+        std::vector<float> q;
+        std::vector<int> indices;
+        std::vector<float> distances; // empty if the answer was kept without them
+    };
+
+    struct Shard {
+        mutable std::mutex mutex; // guards the members below
+        std::list<Entry> lru; // the entries, the most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries; // the entries by key
+        uint64_t changes; // the change_count of the index the entries were found with
+    };
+
+    /**
+    * Hashes the bytes of a query 8 at a time, followed by k and votes_required.
+    */
+    uint64_t hash(const float *q, int k, int votes_required) const {
+        const size_t bytes = sizeof(float) * dim;
+        const char *p = reinterpret_cast<const char *>(q);
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ bytes;
+        size_t i = 0;
+        for (; i + 8 <= bytes; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, p + i, 8);
+            h = mix(h ^ word);
+        }
+        if (i < bytes) {
+            uint64_t word = 0;
+            std::memcpy(&word, p + i, bytes - i);
+            h = mix(h ^ word);
+        }
+        return mix(h ^ ((uint64_t) (uint32_t) k << 32 | (uint32_t) votes_required));
+    }
+
+    static uint64_t mix(uint64_t h) {
+        h *= 0xBF58476D1CE4E5B9ULL;
+        return h ^ (h >> 31);
+    }
+
+    Shard &shard_of(uint64_t key) {
+        return shards[(key >> 40) % shards.size()];
+    }
+
+    /**
+    * Drops the entries of a shard, whose lock is held, if the index has changed since they were found.
+    */
+    void check_changes(Shard &shard) {
+        const uint64_t changes = index.change_count();
+        if (shard.changes == changes)
+            return;
+        n_invalidations.fetch_add(shard.entries.size(), std::memory_order_relaxed);
+        shard.entries.clear();
+        shard.lru.clear();
+        shard.changes = changes;
+    }
+
+    const Mrpt &index;
+    const int dim;
+    std::vector<Shard> shards;
+    const size_t shard_capacity; // the largest number of entries of each shard
+    std::atomic<long long> n_hits{0}, n_misses{0}, n_evictions{0}, n_invalidations{0};
+};
+
+/*
+* Holds the sessions of queries answered a page at a time with
+* Mrpt::start_session and Mrpt::next_page, found by the token start returns,
+* so that the pages asked for by separate requests, of an HTTP server say, do
+* not repeat the search. A session is dropped when no page of it has been
+* asked for in the time to live, when room is needed for a new session and it
+* is the one used least recently, or when the index has changed.
+*/
+class SessionCache {
+ public:
+    /**
+    * @param index - The index queried, which must outlive this object
+    * @param dim - The dimension of the data and of the queries
+    * @param capacity - The largest number of sessions held
+    * @param ttl_ms - The milliseconds a session is kept after its last page
+    */
+    SessionCache(const Mrpt &index_, int dim_, size_t capacity_, int64_t ttl_ms = 60000) :
+        index(index_),
+        dim(dim_),
+        capacity(std::max<size_t>(1, capacity_)),
+        ttl_ns(ttl_ms * 1000000),
+        tokens(std::random_device()()) { }
+
+    SessionCache(const SessionCache &) = delete;
+    SessionCache &operator=(const SessionCache &) = delete;
+
+    /**
+    * Starts a session for the query q, and writes its first page of k
+    * neighbors. Can be called concurrently with the other methods, but not
+    * with the methods that modify the index.
+    * @param q - The query, a vector of dim floats
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param k - The number of neighbors in the first page
+    * @param out - The output buffer for the indices of the neighbors
+    * @param out_distances - The output buffer for their distances, or nullptr
+    * @param n_found - If not nullptr, set to the number of neighbors written
+    * @return The token of the session, never 0
+    */
+    uint64_t start(const float *q, int votes_required, int k, int *out, float *out_distances = nullptr,
+                   int *n_found = nullptr) {
+        std::shared_ptr<Session> session = std::make_shared<Session>();
+        index.start_session(Map<const VectorXf>(q, dim), votes_required, session->query);
+        const int n = index.next_page(session->query, k, out, out_distances);
+        if (n_found)
+            *n_found = n;
+        session->last_used = mrpt_metrics::now_ns();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (sessions.size() >= capacity)
+            evict(session->last_used);
+        uint64_t token;
+        do
+            token = tokens();
+        while (!token || sessions.count(token));
+        sessions.emplace(token, session);
+        return token;
+    }
+
+    /**
+    * Writes the next page of k neighbors of the session of token, see
+    * Mrpt::next_page.
+    * @return The number of neighbors written, fewer than k at the end of the
+    * results, or -1 if there is no such session: it has expired, been
+    * dropped, or was started before the index changed
+    */
+    int next_page(uint64_t token, int k, int *out, float *out_distances = nullptr) {
+        const int64_t now = mrpt_metrics::now_ns();
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto found = sessions.find(token);
+            if (found == sessions.end())
+                return -1;
+            session = found->second;
+        }
+        int n = -1;
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            if (now - session->last_used <= ttl_ns) {
+                n = index.next_page(session->query, k, out, out_distances);
+                session->last_used = now;
+            }
+        }
+        if (n < 0)
+            close(token);
+        return n;
+    }
+
+    /**
+    * Drops the session of token, for example when the user leaves the results.
+    */
+    void close(uint64_t token) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.erase(token);
+    }
+
+    /**
+    * Drops all the sessions, for example after the index was swapped for another.
+    */
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.clear();
+    }
+
+    /**
+    * Returns the number of sessions held, the expired ones not yet dropped included.
+    */
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sessions.size();
+    }
+
+ private:
+    struct Session {
+        std::mutex mutex; // guards the members below
+        Mrpt::QuerySession query;
+        int64_t last_used = 0; // when the last page was taken, from mrpt_metrics::now_ns
+    };
+
+    /**
+    * Drops the expired sessions, or if none has expired, the one used least
+    * recently. The lock of the cache is held.
+    */
+    void evict(int64_t now) {
+        auto oldest = sessions.end();
+        int64_t oldest_used = now;
+        for (auto it = sessions.begin(); it != sessions.end();) {
+            // a session whose page is being taken is left alone
+            std::unique_lock<std::mutex> lock(it->second->mutex, std::try_to_lock);
+            const int64_t used = lock ? it->second->last_used : now;
+            if (now - used > ttl_ns) {
+                lock.unlock();
+                it = sessions.erase(it);
+                continue;
+            }
+            if (used <= oldest_used) {
+                oldest = it;
+                oldest_used = used;
+            }
+            ++it;
+        }
+        if (sessions.size() >= capacity && oldest != sessions.end())
+            sessions.erase(oldest);
+    }
+
+    const Mrpt &index;
+    const int dim;
+    const size_t capacity;
+    const int64_t ttl_ns;
+    mutable std::mutex mutex; // guards the members below
+    std::mt19937_64 tokens; // makes the tokens, from a random seed
+    std::unordered_map<uint64_t, std::shared_ptr<Session>> sessions;
+};
+
+} // namespace mrpt_cache
+
+#endif // CPP_MRPT_CACHE_H_
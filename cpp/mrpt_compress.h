@@ -0,0 +1,109 @@
+#ifndef CPP_MRPT_COMPRESS_H_
+#define CPP_MRPT_COMPRESS_H_
+
+/*
+ * The compressed index files of Mrpt::save_compressed: the bytes of an index
+ * file written by save, cut into blocks of a few megabytes that are compressed
+ * with zstd independently of each other, so that they are compressed and
+ * decompressed in parallel. The file starts with a header of 64 bytes,
+ * followed by the compressed size of each block as a uint64_t and then by the
+ * blocks themselves. Mrpt::load and Mrpt::load_from_memory recognize the
+ * files by their magic and decompress them into memory; the uncompressed
+ * files that can be mapped are still written by save.
+ *
+ * zstd is optional: compile with -DMRPT_ZSTD and link with -lzstd to read and
+ * write the compressed files. Without it, available() is false and the files
+ * can be neither written nor read.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef MRPT_ZSTD
+#include <zstd.h>
+#endif
+
+namespace mrpt_compress {
+
+struct CompressedFileHeader {
+    char magic[8]; // MRPTZSTD
+    uint32_t version;
+    uint32_t reserved_flags;
+    uint64_t raw_size; // the size of the index file before compression
+    uint64_t block_size; // the size of each block before compression, except the last one
+    uint64_t n_blocks;
+    uint8_t reserved[24];
+};
+
+inline const char *compressed_file_magic() {
+    return "MRPTZSTD";
+}
+
+inline uint32_t compressed_file_version() {
+    return 1;
+}
+
+/*
+* Returns true if the module was compiled with zstd, so that compressed files
+* can be written and read.
+*/
+inline bool available() {
+#ifdef MRPT_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+* Returns whether bytes bytes at p start with the header of a compressed file.
+*/
+inline bool is_compressed(const void *p, size_t bytes) {
+    return bytes >= sizeof(CompressedFileHeader) && !std::memcmp(p, compressed_file_magic(), 8);
+}
+
+/*
+* Returns the most bytes a block of bytes bytes can take compressed.
+*/
+inline size_t compress_bound(size_t bytes) {
+#ifdef MRPT_ZSTD
+    return ZSTD_compressBound(bytes);
+#else
+    return bytes;
+#endif
+}
+
+/*
+* Compresses a block with zstd at the given level into out, which holds at
+* least compress_bound(bytes) bytes.
+* @return The size of the compressed block, or 0 if it could not be compressed.
+*/
+inline size_t compress_block(const void *data, size_t bytes, void *out, size_t capacity, int level) {
+#ifdef MRPT_ZSTD
+    const size_t size = ZSTD_compress(out, capacity, data, bytes, level);
+    return ZSTD_isError(size) ? 0 : size;
+#else
+    (void) data; (void) bytes; (void) out; (void) capacity; (void) level;
+    return 0;
+#endif
+}
+
+/*
+* Decompresses a block into out, which holds exactly the raw_bytes bytes the
+* block had before compression.
+* @return True if the block was decompressed into raw_bytes bytes.
+*/
+inline bool decompress_block(const void *data, size_t bytes, void *out, size_t raw_bytes) {
+#ifdef MRPT_ZSTD
+    const size_t size = ZSTD_decompress(out, raw_bytes, data, bytes);
+    return !ZSTD_isError(size) && size == raw_bytes;
+#else
+    (void) data; (void) bytes; (void) out; (void) raw_bytes;
+    return false;
+#endif
+}
+
+} // namespace mrpt_compress
+
+#endif // CPP_MRPT_COMPRESS_H_
@@ -0,0 +1,613 @@
+/*
+ * The CUDA backend of mrpt_cuda.h. See there for how it is built.
+ *
+ * A batch of B queries is answered in these steps, each a kernel or a call
+ * to cuBLAS or CUB on the default stream:
+ *   1. the queries are projected onto all random vectors with one SGEMM,
+ *   2. a thread per query and tree routes the query to a leaf,
+ *   3. the leaves of each query are gathered into one segment of candidates,
+ *   4. the segments are sorted, so the votes of a candidate are the length of its run,
+ *   5. the votes are counted per query, and the threshold of the votes a candidate
+ *      needs is lowered as Mrpt::elect_by_max_votes does if fewer than k are elected,
+ *   6. a warp per candidate scores the elected candidates with the data,
+ *   7. the segments are sorted by score, and the first k of each are the neighbors.
+ * The sorts are stable, so the candidates at the same distance come in the
+ * order of their ids, as with the heap of the CPU.
+ */
+
+#include "mrpt_cuda.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <cublas_v2.h>
+#include <cub/cub.cuh>
+#include <cuda_runtime.h>
+
+namespace mrpt_cuda {
+
+namespace {
+
+/**
+* An array in the memory of the GPU, which keeps its allocation when it is
+* resized to a smaller size.
+*/
+template<typename T>
+class DeviceArray {
+ public:
+    DeviceArray() : ptr(nullptr), capacity(0) { }
+
+    DeviceArray(const DeviceArray &) = delete;
+    DeviceArray &operator=(const DeviceArray &) = delete;
+
+    ~DeviceArray() {
+        if (ptr) cudaFree(ptr);
+    }
+
+    bool resize(size_t n) {
+        if (n <= capacity)
+            return true;
+        if (ptr) cudaFree(ptr);
+        ptr = nullptr;
+        capacity = 0;
+        if (cudaMalloc(&ptr, sizeof(T) * n) != cudaSuccess) {
+            ptr = nullptr;
+            return false;
+        }
+        capacity = n;
+        return true;
+    }
+
+    bool upload(const T *host, size_t n) {
+        return resize(n) && (!n || cudaMemcpy(ptr, host, sizeof(T) * n, cudaMemcpyHostToDevice) == cudaSuccess);
+    }
+
+    bool download(T *host, size_t n) const {
+        return !n || cudaMemcpy(host, ptr, sizeof(T) * n, cudaMemcpyDeviceToHost) == cudaSuccess;
+    }
+
+    T *data() const {
+        return ptr;
+    }
+
+ private:
+    T *ptr;
+    size_t capacity;
+};
+
+const int block_threads = 256;
+
+int n_blocks(size_t n_threads) {
+    return (int) ((n_threads + block_threads - 1) / block_threads);
+}
+
+__device__ float inverse_norm(float squared_norm) {
+    return squared_norm > 0 ? 1 / sqrtf(squared_norm) : 0;
+}
+
+__device__ bool is_deleted(const unsigned long long *deleted, int i) {
+    return deleted && (deleted[i >> 6] >> (i & 63) & 1);
+}
+
+/**
+* Computes the squared norms of the n columns of the dim x n matrix x, a warp per column.
+*/
+__global__ void squared_norms(const float *x, int dim, int n, float *norms) {
+    const int lane = threadIdx.x % 32;
+    const size_t col = ((size_t) blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    if (col >= (size_t) n) return;
+    const float *v = x + col * dim;
+    float sum = 0;
+    for (int i = lane; i < dim; i += 32)
+        sum += v[i] * v[i];
+    for (int offset = 16; offset; offset /= 2)
+        sum += __shfl_down_sync(0xffffffff, sum, offset);
+    if (!lane) norms[col] = sum;
+}
+
+/**
+* Routes each query down each tree, a thread per pair, writing the leaf and
+* its size to leaves and counts, which are laid out query after query.
+*/
+__global__ void route(const float *projected, const float *query_norms, int n_queries, int n_trees, int depth,
+                      int n_pool, bool normalize, const float *split_points, const int *leaf_first, int *leaves,
+                      int *counts) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n_queries * n_trees) return;
+    const int b = i / n_trees, t = i % n_trees;
+    const float scale = normalize ? inverse_norm(query_norms[b]) : 1;
+    const float *p = projected + (size_t) b * n_pool + t * depth;
+    const float *split = split_points + (size_t) t * (2 << depth);
+    int idx = 0;
+    for (int d = 0; d < depth; ++d)
+        idx = 2 * idx + 2 - (p[d] * scale <= split[idx]);
+    const int leaf = idx - (1 << depth) + 1;
+    const int *first = leaf_first + (size_t) t * ((1 << depth) + 1);
+    leaves[i] = leaf;
+    counts[i] = first[leaf + 1] - first[leaf];
+}
+
+/**
+* Sets the offset of the first candidate of each query from the offsets of
+* its leaves, and the end of the last one.
+*/
+__global__ void segment_offsets(const int *offsets, const int *counts, int n_queries, int n_trees, int *segments) {
+    const int b = blockIdx.x * blockDim.x + threadIdx.x;
+    if (b > n_queries) return;
+    const int last = n_queries * n_trees - 1;
+    segments[b] = b < n_queries ? offsets[b * n_trees] : offsets[last] + counts[last];
+}
+
+/**
+* Copies the points of the leaf of each query and tree to the candidates, a block per pair.
+*/
+__global__ void gather(const int *leaves, const int *offsets, int n_trees, int depth, int tree_points,
+                       const int *leaf_first, const int *leaf_ids, int *candidates) {
+    const int i = blockIdx.x, t = i % n_trees;
+    const int *first = leaf_first + (size_t) t * ((1 << depth) + 1);
+    const int begin = first[leaves[i]], n = first[leaves[i] + 1] - begin;
+    const int *ids = leaf_ids + (size_t) t * tree_points + begin;
+    int *out = candidates + offsets[i];
+    for (int j = threadIdx.x; j < n; j += blockDim.x)
+        out[j] = ids[j];
+}
+
+/**
+* Returns the query whose segment holds the candidate i, the last b with segments[b] <= i.
+*/
+__device__ int segment_of(const int *segments, int n_queries, int i) {
+    int lo = 0, hi = n_queries;
+    while (hi - lo > 1) {
+        const int mid = (lo + hi) / 2;
+        if (segments[mid] <= i) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+* Counts the votes of the sorted candidates: the first candidate of each run
+* gets the length of the run and the others 0. The runs are also counted in
+* the histogram of the votes of each query, and the elected ones in n_elected.
+*/
+__global__ void count_votes(const int *sorted, const int *segments, int n_queries, int n_trees, int votes_required,
+                            int *votes, int *histogram, int *n_elected) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= segments[n_queries]) return;
+    const int b = segment_of(segments, n_queries, i);
+    if (i > segments[b] && sorted[i] == sorted[i - 1]) {
+        votes[i] = 0;
+        return;
+    }
+    int v = 1;
+    while (i + v < segments[b + 1] && sorted[i + v] == sorted[i])
+        ++v;
+    votes[i] = v;
+    atomicAdd(histogram + (size_t) b * (n_trees + 1) + v, 1);
+    if (v >= votes_required)
+        atomicAdd(n_elected + b, 1);
+}
+
+/**
+* Sets the votes each candidate of a query needs to be elected: votes_required,
+* or fewer if fewer than k candidates have that many, lowered as
+* Mrpt::elect_by_max_votes does.
+*/
+__global__ void vote_thresholds(const int *histogram, const int *n_elected, int n_queries, int n_trees, int k,
+                                int votes_required, int *thresholds) {
+    const int b = blockIdx.x * blockDim.x + threadIdx.x;
+    if (b >= n_queries) return;
+    const int *count = histogram + (size_t) b * (n_trees + 1);
+    int threshold = votes_required;
+    if (votes_required > 1 && n_elected[b] < k) {
+        int max_votes = 0;
+        for (int v = 1; v <= n_trees; ++v)
+            if (count[v]) max_votes = v;
+        max_votes = min(max_votes, votes_required - 1);
+        if (max_votes >= 1) {
+            for (int would_elect = n_elected[b]; max_votes > 1; --max_votes) {
+                would_elect += count[max_votes];
+                if (would_elect >= k) break;
+            }
+            threshold = max_votes;
+        }
+    }
+    thresholds[b] = threshold;
+}
+
+/**
+* Scores the candidates that are elected, a warp per candidate, with the
+* score of Mrpt::score; the others get an infinite score.
+*/
+__global__ void score_candidates(const float *data, const float *norms, const float *queries,
+                                 const float *query_norms, const int *sorted, const int *votes,
+                                 const int *segments, const int *thresholds, int n_queries, int dim, int metric,
+                                 float *keys) {
+    const int lane = threadIdx.x % 32;
+    const size_t w = ((size_t) blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    if (w >= (size_t) segments[n_queries]) return;
+    const int i = w, b = segment_of(segments, n_queries, i);
+    if (!votes[i] || votes[i] < thresholds[b]) {
+        if (!lane) keys[i] = INFINITY;
+        return;
+    }
+    const float *q = queries + (size_t) b * dim, *x = data + (size_t) sorted[i] * dim;
+    float sum = 0;
+    if (metric == Mrpt::EUCLIDEAN) {
+        for (int d = lane; d < dim; d += 32) {
+            const float diff = q[d] - x[d];
+            sum += diff * diff;
+        }
+    } else {
+        for (int d = lane; d < dim; d += 32)
+            sum += q[d] * x[d];
+    }
+    for (int offset = 16; offset; offset /= 2)
+        sum += __shfl_down_sync(0xffffffff, sum, offset);
+    if (lane) return;
+    if (metric == Mrpt::EUCLIDEAN)
+        keys[i] = sum;
+    else if (metric == Mrpt::INNER_PRODUCT)
+        keys[i] = -sum;
+    else
+        keys[i] = -sum * inverse_norm(query_norms[b]) * inverse_norm(norms[sorted[i]]);
+}
+
+/**
+* Writes the first k candidates of each segment sorted by score, converting
+* the ids into the original ids and the scores into distances; -1 where a
+* segment has fewer than k finite scores. With exact set, the scores are those
+* of exact_scores, which leave out the squared norm of the query.
+*/
+__global__ void extract(const float *keys, const int *ids, const int *segments, int stride, const float *query_norms,
+                        const int *original_ids, int n_queries, int k, int metric, bool exact, int *out,
+                        float *out_distances) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n_queries * k) return;
+    const int b = i / k, j = i % k;
+    const int begin = segments ? segments[b] : b * stride, end = segments ? segments[b + 1] : b * stride + k;
+    const int pos = begin + j;
+    if (pos >= end || !(keys[pos] < INFINITY)) {
+        out[i] = -1;
+        if (out_distances) out_distances[i] = -1;
+        return;
+    }
+    out[i] = original_ids ? original_ids[ids[pos]] : ids[pos];
+    if (!out_distances) return;
+    if (metric != Mrpt::EUCLIDEAN)
+        out_distances[i] = -keys[pos];
+    else
+        out_distances[i] = exact ? sqrtf(fmaxf(0.0f, keys[pos] + query_norms[b])) : sqrtf(keys[pos]);
+}
+
+/**
+* Turns the inner products of a block of m points with each query, the first
+* m rows of the stride x n_queries matrix dots, into the scores of
+* Mrpt::exact_knn_batch, and writes the ids of the points beside them. The
+* rows from m to block_size are left out with an infinite score.
+*/
+__global__ void exact_scores(float *dots, int *ids, int stride, int block_size, int first, int m, int n_queries,
+                             const float *norms, const float *query_norms, const unsigned long long *deleted,
+                             int metric) {
+    const size_t i = (size_t) blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= (size_t) block_size * n_queries) return;
+    const int l = i % block_size, b = i / block_size;
+    float &key = dots[(size_t) b * stride + l];
+    ids[(size_t) b * stride + l] = first + l;
+    const int point = first + l;
+    if (l >= m || is_deleted(deleted, point)) {
+        key = INFINITY;
+        return;
+    }
+    if (metric == Mrpt::EUCLIDEAN)
+        key = norms[point] - 2 * key;
+    else if (metric == Mrpt::INNER_PRODUCT)
+        key = -key;
+    else
+        key = -key * inverse_norm(query_norms[b]) * inverse_norm(norms[point]);
+}
+
+/**
+* Copies the k best of each sorted segment behind the next block of scores,
+* so they compete with it.
+*/
+__global__ void keep_best(const float *sorted_keys, const int *sorted_ids, int stride, int block_size, int k,
+                          int n_queries, float *keys, int *ids) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n_queries * k) return;
+    const int b = i / k, j = i % k;
+    keys[(size_t) b * stride + block_size + j] = sorted_keys[(size_t) b * stride + j];
+    ids[(size_t) b * stride + block_size + j] = sorted_ids[(size_t) b * stride + j];
+}
+
+__global__ void fill_best(int stride, int block_size, int k, int n_queries, float *keys, int *ids) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= n_queries * k) return;
+    const int b = i / k, j = i % k;
+    keys[(size_t) b * stride + block_size + j] = INFINITY;
+    ids[(size_t) b * stride + block_size + j] = -1;
+}
+
+__global__ void strided_offsets(int stride, int n_queries, int *offsets) {
+    const int b = blockIdx.x * blockDim.x + threadIdx.x;
+    if (b <= n_queries) offsets[b] = b * stride;
+}
+
+} // namespace
+
+struct DeviceIndex::State {
+    int device = 0;
+    int n_samples = 0, dim = 0, n_trees = 0, depth = 0, tree_points = 0, n_pool = 0;
+    int metric = Mrpt::EUCLIDEAN;
+    bool reordered = false, has_deleted = false;
+    cublasHandle_t cublas = nullptr;
+
+    // the index
+    DeviceArray<float> data, norms, random_matrix, split_points;
+    DeviceArray<int> leaf_first, leaf_ids, original_ids;
+    DeviceArray<unsigned long long> deleted;
+
+    // the working memory of a batch
+    DeviceArray<float> queries, query_norms, projected, keys, sorted_keys;
+    DeviceArray<int> leaves, counts, offsets, segments, candidates, sorted, votes, histogram, n_elected, thresholds;
+    DeviceArray<int> sorted_ids, out;
+    DeviceArray<float> out_distances;
+    DeviceArray<char> sort_memory;
+
+    ~State() {
+        if (cublas) cublasDestroy(cublas);
+    }
+};
+
+DeviceIndex::DeviceIndex() : failure(nullptr) { }
+
+DeviceIndex::~DeviceIndex() { }
+
+int DeviceIndex::device_count() {
+    int n = 0;
+    return cudaGetDeviceCount(&n) == cudaSuccess ? n : 0;
+}
+
+bool DeviceIndex::upload(const Mrpt::FlatIndex &flat, int device) {
+    static_assert(sizeof(unsigned long long) == sizeof(uint64_t), "the deleted bits are copied as they are");
+    failure = nullptr;
+    state.reset();
+    if (cudaSetDevice(device) != cudaSuccess) {
+        failure = "cannot use the CUDA device";
+        return false;
+    }
+
+    std::unique_ptr<State> s(new State);
+    s->device = device;
+    s->n_samples = flat.n_samples;
+    s->dim = flat.dim;
+    s->n_trees = flat.n_trees;
+    s->depth = flat.depth;
+    s->tree_points = flat.tree_points;
+    s->n_pool = flat.n_trees * flat.depth;
+    s->metric = flat.metric;
+    s->reordered = !flat.original_ids.empty();
+    s->has_deleted = !flat.deleted.empty();
+
+    if (cublasCreate(&s->cublas) != CUBLAS_STATUS_SUCCESS) {
+        s->cublas = nullptr;
+        failure = "cannot initialize cuBLAS";
+        return false;
+    }
+    if (!s->data.upload(flat.data, (size_t) flat.dim * flat.n_samples) ||
+        !s->norms.resize(flat.n_samples) ||
+        !s->random_matrix.upload(flat.random_matrix.data(), flat.random_matrix.size()) ||
+        !s->split_points.upload(flat.split_points.data(), flat.split_points.size()) ||
+        !s->leaf_first.upload(flat.leaf_first.data(), flat.leaf_first.size()) ||
+        !s->leaf_ids.upload(flat.leaf_ids.data(), flat.leaf_ids.size()) ||
+        !s->original_ids.upload(flat.original_ids.data(), flat.original_ids.size()) ||
+        !s->deleted.upload(reinterpret_cast<const unsigned long long *>(flat.deleted.data()), flat.deleted.size())) {
+        failure = "cannot copy the index to the GPU";
+        return false;
+    }
+    squared_norms<<<n_blocks((size_t) flat.n_samples * 32), block_threads>>>(s->data.data(), flat.dim,
+                                                                             flat.n_samples, s->norms.data());
+    if (cudaDeviceSynchronize() != cudaSuccess) {
+        failure = "cannot compute the norms of the data on the GPU";
+        return false;
+    }
+    state = std::move(s);
+    return true;
+}
+
+bool DeviceIndex::query_batch(const float *Q, int n_queries, int k, int votes_required, int *out,
+                              float *out_distances, int batch_size) {
+    failure = nullptr;
+    if (!state) {
+        failure = "no index has been uploaded";
+        return false;
+    }
+    State &s = *state;
+    if (cudaSetDevice(s.device) != cudaSuccess) {
+        failure = "cannot use the CUDA device";
+        return false;
+    }
+    const int B = std::max(1, std::min(batch_size, n_queries));
+    const int n_pairs = B * s.n_trees;
+    if (!s.queries.resize((size_t) B * s.dim) || !s.query_norms.resize(B) ||
+        !s.projected.resize((size_t) B * s.n_pool) || !s.leaves.resize(n_pairs) || !s.counts.resize(n_pairs) ||
+        !s.offsets.resize(n_pairs) || !s.segments.resize(B + 1) ||
+        !s.histogram.resize((size_t) B * (s.n_trees + 1)) || !s.n_elected.resize(B) ||
+        !s.thresholds.resize(B) || !s.out.resize((size_t) B * k) || !s.out_distances.resize((size_t) B * k)) {
+        failure = "out of GPU memory";
+        return false;
+    }
+
+    for (int first = 0; first < n_queries; first += B) {
+        const int n = std::min(B, n_queries - first);
+        const int n_routes = n * s.n_trees;
+        if (!s.queries.upload(Q + (size_t) first * s.dim, (size_t) n * s.dim)) {
+            failure = "cannot copy the queries to the GPU";
+            return false;
+        }
+        squared_norms<<<n_blocks((size_t) n * 32), block_threads>>>(s.queries.data(), s.dim, n, s.query_norms.data());
+
+        // the projections of query b are the column b of the n_pool x n matrix projected
+        const float one = 1, zero = 0;
+        if (cublasSgemm(s.cublas, CUBLAS_OP_T, CUBLAS_OP_N, s.n_pool, n, s.dim, &one, s.random_matrix.data(), s.dim,
+                        s.queries.data(), s.dim, &zero, s.projected.data(), s.n_pool) != CUBLAS_STATUS_SUCCESS) {
+            failure = "cannot project the queries on the GPU";
+            return false;
+        }
+        route<<<n_blocks(n_routes), block_threads>>>(s.projected.data(), s.query_norms.data(), n, s.n_trees, s.depth,
+                                                     s.n_pool, s.metric != Mrpt::EUCLIDEAN, s.split_points.data(),
+                                                     s.leaf_first.data(), s.leaves.data(), s.counts.data());
+
+        size_t scan_bytes = 0;
+        cub::DeviceScan::ExclusiveSum(nullptr, scan_bytes, s.counts.data(), s.offsets.data(), n_routes);
+        if (!s.sort_memory.resize(scan_bytes)) {
+            failure = "out of GPU memory";
+            return false;
+        }
+        cub::DeviceScan::ExclusiveSum(s.sort_memory.data(), scan_bytes, s.counts.data(), s.offsets.data(), n_routes);
+        segment_offsets<<<n_blocks(n + 1), block_threads>>>(s.offsets.data(), s.counts.data(), n, s.n_trees,
+                                                            s.segments.data());
+        int n_candidates = 0;
+        if (cudaMemcpy(&n_candidates, s.segments.data() + n, sizeof(int), cudaMemcpyDeviceToHost) != cudaSuccess) {
+            failure = "cannot route the queries on the GPU";
+            return false;
+        }
+        if (!n_candidates) {
+            // only with empty leaves, as after removing most of the points
+            std::fill(out + (size_t) first * k, out + (size_t) (first + n) * k, -1);
+            if (out_distances)
+                std::fill(out_distances + (size_t) first * k, out_distances + (size_t) (first + n) * k, -1);
+            continue;
+        }
+
+        const size_t m = n_candidates;
+        if (!s.candidates.resize(m) || !s.sorted.resize(m) || !s.votes.resize(m) || !s.keys.resize(m) ||
+            !s.sorted_keys.resize(m) || !s.sorted_ids.resize(m)) {
+            failure = "out of GPU memory, the batch size should be smaller";
+            return false;
+        }
+        gather<<<n_routes, block_threads>>>(s.leaves.data(), s.offsets.data(), s.n_trees, s.depth, s.tree_points,
+                                            s.leaf_first.data(), s.leaf_ids.data(), s.candidates.data());
+
+        size_t id_sort_bytes = 0, key_sort_bytes = 0;
+        cub::DeviceSegmentedRadixSort::SortKeys(nullptr, id_sort_bytes, s.candidates.data(), s.sorted.data(),
+                                                n_candidates, n, s.segments.data(), s.segments.data() + 1);
+        cub::DeviceSegmentedRadixSort::SortPairs(nullptr, key_sort_bytes, s.keys.data(), s.sorted_keys.data(),
+                                                 s.sorted.data(), s.sorted_ids.data(), n_candidates, n,
+                                                 s.segments.data(), s.segments.data() + 1);
+        size_t sort_bytes = std::max(id_sort_bytes, key_sort_bytes);
+        if (!s.sort_memory.resize(sort_bytes)) {
+            failure = "out of GPU memory, the batch size should be smaller";
+            return false;
+        }
+        cub::DeviceSegmentedRadixSort::SortKeys(s.sort_memory.data(), sort_bytes, s.candidates.data(),
+                                                s.sorted.data(), n_candidates, n, s.segments.data(),
+                                                s.segments.data() + 1);
+
+        cudaMemset(s.histogram.data(), 0, sizeof(int) * (size_t) n * (s.n_trees + 1));
+        cudaMemset(s.n_elected.data(), 0, sizeof(int) * n);
+        count_votes<<<n_blocks(n_candidates), block_threads>>>(s.sorted.data(), s.segments.data(), n, s.n_trees,
+                                                               votes_required, s.votes.data(), s.histogram.data(),
+                                                               s.n_elected.data());
+        vote_thresholds<<<n_blocks(n), block_threads>>>(s.histogram.data(), s.n_elected.data(), n, s.n_trees, k,
+                                                        votes_required, s.thresholds.data());
+        score_candidates<<<n_blocks((size_t) n_candidates * 32), block_threads>>>(
+            s.data.data(), s.norms.data(), s.queries.data(), s.query_norms.data(), s.sorted.data(), s.votes.data(),
+            s.segments.data(), s.thresholds.data(), n, s.dim, s.metric, s.keys.data());
+
+        sort_bytes = key_sort_bytes;
+        cub::DeviceSegmentedRadixSort::SortPairs(s.sort_memory.data(), sort_bytes, s.keys.data(),
+                                                 s.sorted_keys.data(), s.sorted.data(), s.sorted_ids.data(),
+                                                 n_candidates, n, s.segments.data(), s.segments.data() + 1);
+        extract<<<n_blocks((size_t) n * k), block_threads>>>(
+            s.sorted_keys.data(), s.sorted_ids.data(), s.segments.data(), 0, s.query_norms.data(),
+            s.reordered ? s.original_ids.data() : nullptr, n, k, s.metric, false, s.out.data(),
+            out_distances ? s.out_distances.data() : nullptr);
+
+        if (!s.out.download(out + (size_t) first * k, (size_t) n * k) ||
+            (out_distances && !s.out_distances.download(out_distances + (size_t) first * k, (size_t) n * k))) {
+            failure = "the queries failed on the GPU";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeviceIndex::exact_knn_batch(const float *Q, int n_queries, int k, int *out, float *out_distances,
+                                  int batch_size) {
+    failure = nullptr;
+    if (!state) {
+        failure = "no index has been uploaded";
+        return false;
+    }
+    State &s = *state;
+    if (cudaSetDevice(s.device) != cudaSuccess) {
+        failure = "cannot use the CUDA device";
+        return false;
+    }
+    const int B = std::max(1, std::min(batch_size, n_queries));
+    const int block_size = std::min(8192, std::max(1, s.n_samples));
+    // each column holds the scores of a block of points followed by the k best so far
+    const int stride = block_size + k;
+    const size_t n_keys = (size_t) stride * B;
+    if (!s.queries.resize((size_t) B * s.dim) || !s.query_norms.resize(B) || !s.keys.resize(n_keys) ||
+        !s.sorted_keys.resize(n_keys) || !s.candidates.resize(n_keys) || !s.sorted_ids.resize(n_keys) ||
+        !s.segments.resize(B + 1) || !s.out.resize((size_t) B * k) || !s.out_distances.resize((size_t) B * k)) {
+        failure = "out of GPU memory, the batch size should be smaller";
+        return false;
+    }
+
+    for (int first = 0; first < n_queries; first += B) {
+        const int n = std::min(B, n_queries - first);
+        if (!s.queries.upload(Q + (size_t) first * s.dim, (size_t) n * s.dim)) {
+            failure = "cannot copy the queries to the GPU";
+            return false;
+        }
+        squared_norms<<<n_blocks((size_t) n * 32), block_threads>>>(s.queries.data(), s.dim, n, s.query_norms.data());
+        strided_offsets<<<n_blocks(n + 1), block_threads>>>(stride, n, s.segments.data());
+        fill_best<<<n_blocks((size_t) n * k), block_threads>>>(stride, block_size, k, n, s.keys.data(),
+                                                               s.candidates.data());
+
+        size_t sort_bytes = 0;
+        cub::DeviceSegmentedRadixSort::SortPairs(nullptr, sort_bytes, s.keys.data(), s.sorted_keys.data(),
+                                                 s.candidates.data(), s.sorted_ids.data(), (int) (stride * n), n,
+                                                 s.segments.data(), s.segments.data() + 1);
+        if (!s.sort_memory.resize(sort_bytes)) {
+            failure = "out of GPU memory, the batch size should be smaller";
+            return false;
+        }
+
+        for (int j = 0; j < s.n_samples; j += block_size) {
+            const int m = std::min(block_size, s.n_samples - j);
+            const float one = 1, zero = 0;
+            if (cublasSgemm(s.cublas, CUBLAS_OP_T, CUBLAS_OP_N, m, n, s.dim, &one, s.data.data() + (size_t) j * s.dim,
+                            s.dim, s.queries.data(), s.dim, &zero, s.keys.data(), stride) != CUBLAS_STATUS_SUCCESS) {
+                failure = "cannot score the data on the GPU";
+                return false;
+            }
+            exact_scores<<<n_blocks((size_t) block_size * n), block_threads>>>(
+                s.keys.data(), s.candidates.data(), stride, block_size, j, m, n, s.norms.data(),
+                s.query_norms.data(), s.has_deleted ? s.deleted.data() : nullptr, s.metric);
+            cub::DeviceSegmentedRadixSort::SortPairs(s.sort_memory.data(), sort_bytes, s.keys.data(),
+                                                     s.sorted_keys.data(), s.candidates.data(), s.sorted_ids.data(),
+                                                     (int) (stride * n), n, s.segments.data(), s.segments.data() + 1);
+            keep_best<<<n_blocks((size_t) n * k), block_threads>>>(s.sorted_keys.data(), s.sorted_ids.data(), stride,
+                                                                   block_size, k, n, s.keys.data(),
+                                                                   s.candidates.data());
+        }
+
+        extract<<<n_blocks((size_t) n * k), block_threads>>>(
+            s.sorted_keys.data(), s.sorted_ids.data(), nullptr, stride, s.query_norms.data(),
+            s.reordered ? s.original_ids.data() : nullptr, n, k, s.metric, true, s.out.data(),
+            out_distances ? s.out_distances.data() : nullptr);
+        if (!s.out.download(out + (size_t) first * k, (size_t) n * k) ||
+            (out_distances && !s.out_distances.download(out_distances + (size_t) first * k, (size_t) n * k))) {
+            failure = "the search failed on the GPU";
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace mrpt_cuda
@@ -0,0 +1,114 @@
+#ifndef CPP_MRPT_CUDA_H_
+#define CPP_MRPT_CUDA_H_
+
+/*
+ * An optional CUDA backend for offline batch work on an Mrpt index, such as
+ * k-NN graphs, ground truth and the re-scoring of millions of queries. A
+ * DeviceIndex holds a copy of the index in the memory of a GPU: the data, the
+ * random vectors, the split points and the leaves, flattened by
+ * Mrpt::flatten. The queries are answered in batches like Mrpt::query: the
+ * batch is projected with one cuBLAS product, each query is routed down the
+ * trees by a thread per tree, the candidates of each query are gathered from
+ * its leaves and sorted, the votes of a candidate are the length of its run,
+ * and the elected candidates are scored and the k nearest selected with a
+ * segmented sort of CUB. The candidates elected are the same as those of
+ * Mrpt::query, including the fallback when fewer than k get votes_required
+ * votes; the results may differ where a rounding difference of the GPU
+ * arithmetic routes a query to another leaf or swaps two neighbors at the
+ * same distance. exact_knn_batch searches the whole data like
+ * Mrpt::exact_knn_batch.
+ *
+ * The backend is compiled from mrpt_cuda.cu with nvcc and linked with
+ * cuBLAS, for example
+ *   nvcc -std=c++11 -O3 -Xcompiler -fopenmp -Icpp -Icpp/lib -c cpp/mrpt_cuda.cu
+ *   g++ -std=c++11 -O3 -fopenmp -Icpp -Icpp/lib app.cpp mrpt_cuda.o -lcudart -lcublas
+ * and this header includes no CUDA header, so the rest of a program is
+ * compiled as usual. The index stays on the host too, and is not changed by
+ * the backend; a DeviceIndex does not follow later changes of the index, and
+ * is uploaded again for them.
+ */
+
+#include <memory>
+
+#include "Mrpt.h"
+
+namespace mrpt_cuda {
+
+class DeviceIndex {
+ public:
+    DeviceIndex();
+    ~DeviceIndex();
+
+    DeviceIndex(const DeviceIndex &) = delete;
+    DeviceIndex &operator=(const DeviceIndex &) = delete;
+
+    /**
+    * Returns the number of CUDA devices, 0 if there is none or no driver.
+    */
+    static int device_count();
+
+    /**
+    * Copies an index to a GPU, replacing the index uploaded before, if any.
+    * The index must keep its data.
+    * @param index - The index, which is not needed by the DeviceIndex afterwards
+    * @param device - The CUDA device the index is copied to
+    * @return false if the index has no data or trees or the copy fails, and
+    * then error tells why
+    */
+    bool upload(const Mrpt &index, int device = 0) {
+        Mrpt::FlatIndex flat;
+        if (!index.flatten(flat)) {
+            failure = "the index has no data or no trees";
+            return false;
+        }
+        return upload(flat, device);
+    }
+
+    /**
+    * Same as above, from an index flattened by Mrpt::flatten.
+    */
+    bool upload(const Mrpt::FlatIndex &flat, int device = 0);
+
+    /**
+    * Finds the k approximate nearest neighbors of each of the queries, as
+    * Mrpt::query_batch does with the data itself scoring the candidates.
+    * @param Q - The queries, n_queries vectors of dim floats one after another
+    * @param n_queries - The number of queries
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param out - The output buffer of size k * n_queries; the neighbors of query i are written to
+    * out[i * k, (i + 1) * k), -1 where fewer than k were found
+    * @param out_distances - Output buffer for the distances, laid out as out, or nullptr
+    * @param batch_size - The most queries sent to the GPU at once, which bounds
+    * its working memory to about n_trees * (leaf size) * 24 bytes per query
+    * @return false if the GPU fails or no index is uploaded, and then error tells why
+    */
+    bool query_batch(const float *Q, int n_queries, int k, int votes_required, int *out,
+                     float *out_distances = nullptr, int batch_size = 1024);
+
+    /**
+    * Finds the k nearest neighbors of each of the queries among all points
+    * that are not deleted, as Mrpt::exact_knn_batch does. The data is scored
+    * in blocks of points against batches of queries with cuBLAS.
+    * @param batch_size - The most queries sent to the GPU at once
+    * @return false if the GPU fails or no index is uploaded, and then error tells why
+    */
+    bool exact_knn_batch(const float *Q, int n_queries, int k, int *out, float *out_distances = nullptr,
+                         int batch_size = 256);
+
+    /**
+    * Returns why the last call failed, or nullptr if it succeeded.
+    */
+    const char *error() const {
+        return failure;
+    }
+
+ private:
+    struct State;
+    std::unique_ptr<State> state;
+    const char *failure;
+};
+
+} // namespace mrpt_cuda
+
+#endif // CPP_MRPT_CUDA_H_
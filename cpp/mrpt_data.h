@@ -0,0 +1,198 @@
+#ifndef CPP_MRPT_DATA_H_
+#define CPP_MRPT_DATA_H_
+
+/*
+ * The data files that MRPTIndex reads and binary_converter writes: the points
+ * as rows of float32 components, after a header of 64 bytes that gives their
+ * number, their dimension and the type of their components. The rows start at
+ * a multiple of 64 bytes, so the rows of a mapped file are aligned to cache
+ * lines. Files without the header, which hold only the rows, can still be read
+ * when their shape is given.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace mrpt_data {
+
+enum DataType {
+    FLOAT32 = 0
+};
+
+struct DataFileHeader {
+    char magic[8]; // MRPTDATA
+    uint32_t version;
+    uint32_t dtype; // a DataType
+    int64_t n; // the number of points
+    int64_t dim; // the dimension of the points
+    uint64_t data_offset; // the offset of the first row from the start of the file, a multiple of 64
+    uint8_t reserved[24];
+};
+
+inline const char *data_file_magic() {
+    return "MRPTDATA";
+}
+
+inline uint32_t data_file_version() {
+    return 1;
+}
+
+/*
+* Returns the header of a file of n float32 points of dimension dim.
+*/
+inline DataFileHeader make_header(int64_t n, int64_t dim) {
+    DataFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, data_file_magic(), sizeof(header.magic));
+    header.version = data_file_version();
+    header.dtype = FLOAT32;
+    header.n = n;
+    header.dim = dim;
+    header.data_offset = sizeof(header);
+    return header;
+}
+
+/*
+* Reads the header at the start of a data file, and leaves the file positioned
+* at the first row.
+* @return 1 if the file has a valid header, 0 if it has no header and holds only
+* the rows, and -1 if its header is invalid or of a newer version.
+*/
+inline int read_header(FILE *fd, DataFileHeader &header) {
+    if (std::fseek(fd, 0, SEEK_SET) != 0)
+        return -1;
+    if (std::fread(&header, sizeof(header), 1, fd) != 1 || std::memcmp(header.magic, data_file_magic(), 8)) {
+        std::fseek(fd, 0, SEEK_SET);
+        return 0;
+    }
+    const bool valid = header.version >= 1 && header.version <= data_file_version() && header.dtype == FLOAT32 &&
+                       header.n > 0 && header.dim > 0 && header.data_offset >= sizeof(header) &&
+                       header.data_offset % 64 == 0;
+    return valid && std::fseek(fd, header.data_offset, SEEK_SET) == 0 ? 1 : -1;
+}
+
+/*
+* Reads the rows of a data file into a buffer on threads of its own, while its
+* caller works on the rows read so far, so that the reading overlaps with the
+* computation, as in Mrpt::grow_pipelined. The threads take chunks of the file
+* in order and read each with large positioned reads, and wait_rows waits
+* until a prefix of the rows is in the buffer. On Windows one thread reads the
+* file sequentially.
+*/
+class PipelinedReader {
+ public:
+    /*
+    * Starts reading bytes bytes of the file at path, from offset on, into buffer.
+    * @param row_bytes - The bytes of a row, which wait_rows counts in
+    * @param n_threads - The number of reading threads
+    * @param chunk_bytes - The bytes a thread reads at a time
+    */
+    PipelinedReader(const char *path, uint64_t offset_, void *buffer_, uint64_t bytes_, uint64_t row_bytes_,
+                    int n_threads = 4, uint64_t chunk_bytes_ = 16 << 20) :
+        fd(std::fopen(path, "rb")), offset(offset_), buffer(static_cast<char *>(buffer_)), bytes(bytes_),
+        row_bytes(row_bytes_), chunk_bytes(std::max<uint64_t>(1, chunk_bytes_)),
+        n_chunks((bytes_ + chunk_bytes - 1) / chunk_bytes), next_chunk(0), n_read(0), failed(!fd),
+        read(n_chunks, 0) {
+#ifdef _WIN32
+        n_threads = 1;
+#endif
+        if (!fd)
+            return;
+        for (int t = 0; t < std::max(1, n_threads); ++t)
+            threads.emplace_back([this] { run(); });
+    }
+
+    PipelinedReader(const PipelinedReader &) = delete;
+    PipelinedReader &operator=(const PipelinedReader &) = delete;
+
+    ~PipelinedReader() {
+        join();
+    }
+
+    /*
+    * Waits until the first n_rows rows are in the buffer.
+    * @return false if they cannot be read
+    */
+    bool wait_rows(int64_t n_rows) {
+        const uint64_t needed = std::min<uint64_t>(n_chunks, (n_rows * row_bytes + chunk_bytes - 1) / chunk_bytes);
+        std::unique_lock<std::mutex> lock(mutex);
+        progress.wait(lock, [&] { return n_read >= needed || failed; });
+        return n_read >= needed;
+    }
+
+    /*
+    * Waits for the reading threads and closes the file.
+    * @return false if the file could not be read whole
+    */
+    bool join() {
+        for (std::thread &thread : threads)
+            thread.join();
+        threads.clear();
+        if (fd)
+            std::fclose(fd);
+        fd = nullptr;
+        return n_read == n_chunks;
+    }
+
+ private:
+    void run() {
+        for (;;) {
+            uint64_t c;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failed || next_chunk == n_chunks)
+                    return;
+                c = next_chunk++;
+            }
+            const uint64_t first = c * chunk_bytes, n = std::min(chunk_bytes, bytes - first);
+            uint64_t done = 0;
+#ifdef _WIN32
+            // the only thread reads the chunks in order
+            if (c > 0 || _fseeki64(fd, offset, SEEK_SET) == 0)
+                done = std::fread(buffer + first, 1, n, fd);
+#else
+            while (done < n) {
+                const ssize_t got = pread(fileno(fd), buffer + first + done, n - done, offset + first + done);
+                if (got <= 0)
+                    break;
+                done += got;
+            }
+#endif
+            std::lock_guard<std::mutex> lock(mutex);
+            if (done != n) {
+                failed = true;
+            } else {
+                read[c] = 1;
+                while (n_read < n_chunks && read[n_read])
+                    ++n_read;
+            }
+            progress.notify_all();
+        }
+    }
+
+    FILE *fd;
+    uint64_t offset;
+    char *buffer;
+    uint64_t bytes, row_bytes, chunk_bytes, n_chunks;
+    std::mutex mutex; // guards the members below
+    std::condition_variable progress; // notified when a chunk is read or fails
+    uint64_t next_chunk; // the next chunk a thread takes
+    uint64_t n_read; // the chunks read from the start of the file without a gap
+    bool failed;
+    std::vector<char> read; // whether each chunk is read
+    std::vector<std::thread> threads;
+};
+
+} // namespace mrpt_data
+
+#endif // CPP_MRPT_DATA_H_
@@ -0,0 +1,1060 @@
+#ifndef CPP_MRPT_DISK_H_
+#define CPP_MRPT_DISK_H_
+
+/*
+ * Vectors kept on disk, typically an NVMe drive, for an index whose trees,
+ * leaves and quantized copy of the data stay in memory. The index is queried
+ * for a shortlist of candidates with the quantized copy alone (see
+ * Mrpt::set_quantization with a negative shortlist, after which the data can
+ * be released), and the vectors of the candidates are then read from a
+ * VectorFile in one batch and re-ranked exactly by DiskSearch. This makes the
+ * data larger than memory searchable without the page faults of a memory
+ * mapped data file, which stall a query once for each candidate.
+ *
+ * A vector file is written by write_vector_file. Its vectors are laid out so
+ * that none of them crosses a page: several small vectors are packed in each
+ * page, and a vector larger than a page starts a page of its own. A vector is
+ * then fetched with one aligned read of a page, or of the pages of the
+ * vector, which can bypass the page cache (O_DIRECT). On Linux the reads of a
+ * batch are submitted together to an io_uring, with the system calls
+ * themselves, so liburing is not needed; elsewhere, or if the kernel has no
+ * io_uring, they are read one by one with pread. The reads of vectors in the
+ * same page are merged, and so are the reads of pages next to each other. An
+ * optional VectorCache keeps the vectors asked for most often in memory, for
+ * the candidates that many queries share.
+ *
+ * write_leaf_clustered_vector_file lays the vectors out by the leaves of a
+ * tree instead, each leaf from the start of a page, with a table of the slot
+ * of each vector. The candidates of a query come mostly from few leaves, so
+ * their vectors then take fewer and longer reads, and VectorFile::fetch_leaf
+ * reads a whole leaf at once.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(MRPT_NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MRPT_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include "Mrpt.h"
+#include "mrpt_mmap.h"
+
+namespace mrpt_disk {
+
+/*
+* The first bytes of a vector file, which are followed by zeros up to the end of
+* the first page. The vectors start at the second page, in slots of which
+* per_page fill a page. In a file of version 1 vector i is in slot i. A file of
+* version 2 is clustered by the leaves of a tree: the vectors of each leaf are
+* in consecutive slots starting at a page, and the slot of each vector is in the
+* table at table_offset, n slots as int64_t, -1 for a vector not in the file,
+* followed by the first slot and the size of each of the n_leaves leaves.
+*/
+struct VectorFileHeader {
+    char magic[8]; // "MRPTVECS"
+    uint32_t version; // 1, or 2 if the file is clustered by leaves
+    uint32_t page_size; // the unit of the reads, a multiple of the block size of the drive
+    int64_t n; // the number of vectors
+    int32_t dim; // the number of floats of a vector
+    uint32_t per_page; // the vectors packed in each page, or 0 if each vector starts a page of its own
+    uint64_t span; // the bytes read for a vector: a page, or the pages of one vector
+    int64_t n_slots; // the number of slots, with those left empty to start the leaves at pages
+    uint64_t table_offset; // the offset of the slots of the vectors, 0 in version 1
+    int32_t n_leaves; // the number of leaves in the table, 0 in version 1
+    uint32_t reserved;
+};
+
+const char vector_file_magic[8] = {'M', 'R', 'P', 'T', 'V', 'E', 'C', 'S'};
+
+/*
+* Returns the layout of n vectors of dim floats in pages of page_size bytes.
+*/
+inline VectorFileHeader vector_file_layout(int64_t n, int dim, uint32_t page_size) {
+    VectorFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, vector_file_magic, sizeof(header.magic));
+    header.version = 1;
+    header.page_size = page_size;
+    header.n = n;
+    header.dim = dim;
+    header.n_slots = n;
+    const uint64_t vector_bytes = sizeof(float) * (uint64_t) dim;
+    header.per_page = vector_bytes <= page_size ? page_size / vector_bytes : 0;
+    header.span = header.per_page ? page_size : (vector_bytes + page_size - 1) / page_size * page_size;
+    return header;
+}
+
+/*
+* Writes the header and the slots of a vector file; slot i holds the vector
+* slot_ids[i], or zeros if it is -1.
+*/
+inline bool write_vector_slots(FILE *fd, const VectorFileHeader &header, const float *data, const int64_t *slot_ids) {
+    const size_t vector_bytes = sizeof(float) * (size_t) header.dim;
+    std::vector<char> page(header.span);
+    std::memcpy(page.data(), &header, sizeof(header));
+    bool ok = std::fwrite(page.data(), 1, header.page_size, fd) == header.page_size;
+
+    const int64_t per_read = header.per_page ? header.per_page : 1;
+    for (int64_t first = 0; ok && first < header.n_slots; first += per_read) {
+        std::fill(page.begin(), page.end(), 0);
+        const int64_t m = std::min(per_read, header.n_slots - first);
+        for (int64_t i = 0; i < m; ++i) {
+            const int64_t id = slot_ids ? slot_ids[first + i] : first + i;
+            if (id >= 0)
+                std::memcpy(page.data() + i * vector_bytes, data + id * header.dim, vector_bytes);
+        }
+        ok = std::fwrite(page.data(), 1, page.size(), fd) == page.size();
+    }
+    return ok;
+}
+
+/*
+* Writes the columns of a dim x n matrix to a vector file.
+* @param path - The file, which is replaced
+* @param data - The vectors, n columns of dim floats one after another
+* @param page_size - The unit of the reads, a power of two of at least the block
+* size of the drive, 4096 for most
+* @return false if the file cannot be written
+*/
+inline bool write_vector_file(const char *path, const float *data, int dim, int64_t n, uint32_t page_size = 4096) {
+    if (dim < 1 || n < 0 || page_size < sizeof(VectorFileHeader))
+        return false;
+    FILE *fd = std::fopen(path, "wb");
+    if (!fd)
+        return false;
+    const bool ok = write_vector_slots(fd, vector_file_layout(n, dim, page_size), data, nullptr);
+    return std::fclose(fd) == 0 && ok;
+}
+
+/*
+* Writes the columns of a dim x n matrix to a vector file clustered by the
+* leaves of a tree of an index: the vectors of each leaf are next to each other
+* from the start of a page, so that a leaf, or candidates from the same leaf,
+* are read with one sequential read instead of one read for each page. The
+* first tree is the order Mrpt::reorder_data keeps the data in. Points
+* deleted from the index are left out of the file.
+* @param index - The index, whose ids are the columns of data
+* @param n_tree - The tree whose leaves the vectors are clustered by
+* @return false if the file cannot be written or the tree is not loaded
+*/
+inline bool write_leaf_clustered_vector_file(const char *path, const Mrpt &index, const float *data, int dim,
+                                             int64_t n, int n_tree = 0, uint32_t page_size = 4096) {
+    if (dim < 1 || n < 0 || page_size < sizeof(VectorFileHeader) || n_tree < 0 || n_tree >= index.trees_loaded())
+        return false;
+    std::vector<int64_t> indptr;
+    std::vector<int> ids;
+    index.leaf_points(n_tree, indptr, ids);
+    const int n_leaves = indptr.size() - 1;
+
+    VectorFileHeader header = vector_file_layout(n, dim, page_size);
+    header.version = 2;
+    header.n_leaves = n_leaves;
+    const int64_t per_page = header.per_page ? header.per_page : 1;
+    std::vector<int64_t> slot_ids, slots(n, -1), leaves(2 * n_leaves);
+    for (int leaf = 0; leaf < n_leaves; ++leaf) {
+        // each leaf starts at a page of its own
+        const int64_t first = (slot_ids.size() + per_page - 1) / per_page * per_page;
+        slot_ids.resize(first, -1);
+        leaves[leaf] = first;
+        leaves[n_leaves + leaf] = indptr[leaf + 1] - indptr[leaf];
+        for (int64_t i = indptr[leaf]; i < indptr[leaf + 1]; ++i) {
+            if (ids[i] < 0 || ids[i] >= n)
+                return false;
+            slots[ids[i]] = slot_ids.size();
+            slot_ids.push_back(ids[i]);
+        }
+    }
+    header.n_slots = slot_ids.size();
+    header.table_offset = header.page_size + (header.n_slots + per_page - 1) / per_page * header.span;
+
+    FILE *fd = std::fopen(path, "wb");
+    if (!fd)
+        return false;
+    bool ok = write_vector_slots(fd, header, data, slot_ids.data());
+    ok = ok && std::fwrite(slots.data(), sizeof(int64_t), n, fd) == (size_t) n;
+    ok = ok && std::fwrite(leaves.data(), sizeof(int64_t), leaves.size(), fd) == leaves.size();
+    return std::fclose(fd) == 0 && ok;
+}
+
+/*
+* The counters of the cache of a VectorFile.
+*/
+struct FetchStats {
+    long long n_reads = 0; // the reads issued, one per page or per large vector
+    long long n_hits = 0; // the vectors found in the cache
+    long long n_misses = 0; // the vectors read from the file
+    long long n_evicted = 0; // the vectors of the cache replaced by vectors read from the file
+    long long n_rejected = 0; // the vectors read from the file not admitted to a full cache
+
+    double hit_rate() const {
+        return n_hits + n_misses ? (double) n_hits / (n_hits + n_misses) : 0;
+    }
+};
+
+/*
+* A cache of the vectors of a VectorFile with a bounded memory. The candidates
+* of the queries are skewed towards few vectors, so a vector read from the file
+* takes the place of a cached one only if it has been asked for more often
+* lately (TinyLFU): the lookups of every vector are counted in a count-min
+* sketch of counters that saturate at 15 and are halved once the lookups reach
+* ten times the size of the cache, and the vector that would be replaced is
+* chosen by the CLOCK algorithm, the first one the hand reaches that has not
+* been hit since the hand last passed it. The cache is split into shards by the
+* hash of the id, each with a lock, its slots, a hash table of its ids and a
+* sketch of its own, so concurrent fetches mostly lock different shards.
+*/
+class VectorCache {
+ public:
+    VectorCache() : dim(0), n_shards(0), n_evicted(0), n_rejected(0) { }
+
+    VectorCache(const VectorCache &) = delete;
+    VectorCache &operator=(const VectorCache &) = delete;
+
+    /**
+    * Empties the cache and sizes it for vectors of dim floats.
+    * @param bytes - The memory of the cache with its tables, 0 for no cache
+    */
+    void reset(size_t bytes, int dim_) {
+        dim = dim_;
+        // a slot takes its vector, its id and reference bit, and at most four entries of the hash table and
+        // two counters of each row of the sketch
+        const size_t slot_bytes = sizeof(float) * dim + sizeof(int64_t) + 1 + 4 * sizeof(int32_t) + 2 * sketch_rows;
+        const size_t n_slots = std::min<size_t>(bytes / slot_bytes, std::numeric_limits<int32_t>::max() / 2);
+        n_shards = 1;
+        while (n_shards < max_shards && n_slots / (2 * n_shards) >= min_shard_slots)
+            n_shards *= 2;
+        shards.reset(n_slots ? new Shard[n_shards] : nullptr);
+        if (!n_slots)
+            n_shards = 0;
+        for (size_t i = 0; i < n_shards; ++i)
+            shards[i].reset(n_slots / n_shards + (i < n_slots % n_shards), dim);
+        n_evicted = n_rejected = 0;
+    }
+
+    /**
+    * Frees the cache.
+    */
+    void clear() {
+        shards.reset();
+        n_shards = 0;
+    }
+
+    /**
+    * Counts a lookup of the vector id, and copies it into out if it is cached.
+    * @return true if the vector is cached
+    */
+    bool lookup(int64_t id, float *out) {
+        if (!n_shards)
+            return false;
+        const uint64_t h = hash(id);
+        Shard &shard = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.count(h);
+        const int32_t slot = shard.find(id, h);
+        if (slot < 0)
+            return false;
+        shard.referenced[slot] = 1;
+        std::copy_n(shard.vectors.data() + (size_t) slot * dim, dim, out);
+        return true;
+    }
+
+    /**
+    * Offers the vector id read from the file to the cache, which takes it into a
+    * free slot, or in place of the vector the CLOCK hand stops at if id has been
+    * looked up more often than it.
+    */
+    void store(int64_t id, const float *x) {
+        if (!n_shards)
+            return;
+        const uint64_t h = hash(id);
+        Shard &shard = shards[shard_of(h)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.ids.empty() || shard.find(id, h) >= 0)
+            return;
+        int32_t slot;
+        if (shard.n_used < shard.ids.size()) {
+            slot = shard.n_used++;
+        } else {
+            const int32_t n_slots = shard.ids.size();
+            while (shard.referenced[shard.hand]) {
+                shard.referenced[shard.hand] = 0;
+                shard.hand = (shard.hand + 1) % n_slots;
+            }
+            slot = shard.hand;
+            const int64_t victim = shard.ids[slot];
+            if (shard.frequency(h) <= shard.frequency(hash(victim))) {
+                n_rejected.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            shard.erase(victim);
+            shard.hand = (shard.hand + 1) % n_slots;
+            n_evicted.fetch_add(1, std::memory_order_relaxed);
+        }
+        shard.ids[slot] = id;
+        shard.referenced[slot] = 0;
+        shard.insert(slot, h);
+        std::copy_n(x, dim, shard.vectors.data() + (size_t) slot * dim);
+    }
+
+    long long evicted() const {
+        return n_evicted.load(std::memory_order_relaxed);
+    }
+
+    long long rejected() const {
+        return n_rejected.load(std::memory_order_relaxed);
+    }
+
+ private:
+    static const size_t max_shards = 64; // the most shards, each with a lock
+    static const size_t min_shard_slots = 64; // the fewest slots of a shard when there are several
+    static const int sketch_rows = 4; // the counters of a vector in the sketch, one in each row
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<float> vectors; // the vectors of the slots
+        std::vector<int64_t> ids; // the id of the vector in each slot, or -1
+        std::vector<uint8_t> referenced; // whether each slot was hit since the CLOCK hand passed it
+        std::vector<int32_t> table; // the slots by the hash of their ids, with linear probing, or -1
+        std::vector<uint8_t> sketch; // sketch_rows rows of counters of the lookups
+        size_t n_used = 0; // the slots filled, which fill in order
+        int32_t hand = 0; // the slot the CLOCK hand is at
+        uint64_t n_counted = 0; // the lookups counted since the counters were last halved
+
+        void reset(size_t n_slots, int dim) {
+            vectors.assign(n_slots * dim, 0);
+            ids.assign(n_slots, -1);
+            referenced.assign(n_slots, 0);
+            size_t width = 16;
+            while (width < 2 * n_slots)
+                width *= 2;
+            table.assign(width, -1);
+            sketch.assign(sketch_rows * (width / 2), 0);
+            n_used = 0;
+            hand = 0;
+            n_counted = 0;
+        }
+
+        size_t counter(uint64_t h, int row) const {
+            // the rows are indexed by double hashing of the two halves of the hash
+            const size_t width = sketch.size() / sketch_rows;
+            return row * width + ((h + row * ((h >> 32) | 1)) & (width - 1));
+        }
+
+        int frequency(uint64_t h) const {
+            int f = 15;
+            for (int row = 0; row < sketch_rows; ++row)
+                f = std::min<int>(f, sketch[counter(h, row)]);
+            return f;
+        }
+
+        void count(uint64_t h) {
+            // only the smallest counters are incremented (conservative update), which overcounts less
+            const int f = frequency(h);
+            if (f < 15)
+                for (int row = 0; row < sketch_rows; ++row)
+                    if (sketch[counter(h, row)] == f)
+                        ++sketch[counter(h, row)];
+            // the counters are halved at times, so that they follow the vectors asked for lately
+            if (++n_counted >= 10 * ids.size()) {
+                for (uint8_t &c : sketch)
+                    c >>= 1;
+                n_counted /= 2;
+            }
+        }
+
+        int32_t find(int64_t id, uint64_t h) const {
+            const size_t mask = table.size() - 1;
+            for (size_t i = h & mask; table[i] >= 0; i = (i + 1) & mask)
+                if (ids[table[i]] == id)
+                    return table[i];
+            return -1;
+        }
+
+        void insert(int32_t slot, uint64_t h) {
+            const size_t mask = table.size() - 1;
+            size_t i = h & mask;
+            while (table[i] >= 0)
+                i = (i + 1) & mask;
+            table[i] = slot;
+        }
+
+        void erase(int64_t id) {
+            const size_t mask = table.size() - 1;
+            size_t i = hash(id) & mask;
+            while (ids[table[i]] != id)
+                i = (i + 1) & mask;
+            // the entries after it that would not be found past the hole are shifted back into it
+            for (size_t j = (i + 1) & mask; table[j] >= 0; j = (j + 1) & mask) {
+                const size_t home = hash(ids[table[j]]) & mask;
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                    table[i] = table[j];
+                    i = j;
+                }
+            }
+            table[i] = -1;
+        }
+    };
+
+    static uint64_t hash(int64_t id) {
+        // the finalizer of splitmix64
+        uint64_t z = (uint64_t) id + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    size_t shard_of(uint64_t h) const {
+        return (h >> 48) & (n_shards - 1);
+    }
+
+    int dim;
+    size_t n_shards; // a power of two
+    std::unique_ptr<Shard[]> shards;
+    std::atomic<long long> n_evicted, n_rejected;
+};
+
+/*
+* A read of a batch: span bytes at offset into buffer.
+*/
+struct PageRead {
+    char *buffer;
+    uint64_t offset;
+    uint64_t bytes;
+    bool done;
+};
+
+/*
+* Reads bytes at an offset of a file, repeating short reads.
+* @return true if all the bytes were read
+*/
+inline bool read_at(int file, char *buffer, uint64_t bytes, uint64_t offset) {
+    while (bytes) {
+#ifdef _WIN32
+        if (_lseeki64(file, offset, SEEK_SET) < 0)
+            return false;
+        const int n = _read(file, buffer, (unsigned) std::min<uint64_t>(bytes, 1 << 30));
+#else
+        const ssize_t n = pread(file, buffer, bytes, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        if (n <= 0)
+            return false;
+        buffer += n;
+        offset += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+#ifdef MRPT_IO_URING
+
+/*
+* An io_uring set up with the system calls, whose submission queue takes the
+* reads of a batch and whose completion queue returns them.
+*/
+class Ring {
+ public:
+    explicit Ring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            return;
+        n_entries = params.sq_entries;
+        sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+
+        sq = map(sq_bytes, IORING_OFF_SQ_RING);
+        cq = single ? sq : map(cq_bytes, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe *>(map(sqes_bytes, IORING_OFF_SQES));
+        if (!sq || !cq || !sqes) {
+            release();
+            return;
+        }
+        char *s = static_cast<char *>(sq), *c = static_cast<char *>(cq);
+        sq_tail = reinterpret_cast<unsigned *>(s + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(s + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(s + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(c + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(c + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(c + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(c + params.cq_off.cqes);
+    }
+
+    ~Ring() {
+        release();
+    }
+
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    bool ok() const {
+        return fd >= 0;
+    }
+
+    /**
+    * Submits the reads, as many at a time as the ring holds, and waits for them.
+    * A read that fails or comes back short is left with done false.
+    * @return false if the ring itself fails
+    */
+    bool read(int file, PageRead *reads, int n) {
+        for (int first = 0; first < n; first += n_entries) {
+            const unsigned m = std::min<unsigned>(n_entries, n - first);
+            unsigned tail = *sq_tail;
+            for (unsigned i = 0; i < m; ++i, ++tail) {
+                const PageRead &r = reads[first + i];
+                const unsigned slot = tail & sq_mask;
+                io_uring_sqe &sqe = sqes[slot];
+                std::memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_READ;
+                sqe.fd = file;
+                sqe.addr = reinterpret_cast<uint64_t>(r.buffer);
+                sqe.len = r.bytes;
+                sqe.off = r.offset;
+                sqe.user_data = first + i;
+                sq_array[slot] = slot;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+            unsigned submitted = 0, completed = 0;
+            while (completed < m) {
+                const int entered = syscall(__NR_io_uring_enter, fd, m - submitted, 1, IORING_ENTER_GETEVENTS,
+                                            nullptr, 0);
+                if (entered < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                submitted += entered;
+                unsigned head = *cq_head;
+                const unsigned available = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != available; ++head, ++completed) {
+                    const io_uring_cqe &cqe = cqes[head & cq_mask];
+                    PageRead &r = reads[cqe.user_data];
+                    r.done = cqe.res >= 0 && (uint64_t) cqe.res == r.bytes;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+        }
+        return true;
+    }
+
+ private:
+    void *map(size_t bytes, off_t offset) {
+        void *p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void release() {
+        if (sqes) munmap(sqes, sqes_bytes);
+        if (cq && cq != sq) munmap(cq, cq_bytes);
+        if (sq) munmap(sq, sq_bytes);
+        if (fd >= 0) ::close(fd);
+        sq = cq = nullptr;
+        sqes = nullptr;
+        fd = -1;
+    }
+
+    int fd = -1;
+    unsigned n_entries = 0;
+    size_t sq_bytes = 0, cq_bytes = 0, sqes_bytes = 0;
+    void *sq = nullptr, *cq = nullptr;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_tail = nullptr, *sq_array = nullptr, *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+
+#endif // MRPT_IO_URING
+
+class VectorFile {
+ public:
+    VectorFile() : file(-1), direct(false), n_reads(0), n_hits(0), n_misses(0) {
+        std::memset(&header, 0, sizeof(header));
+    }
+
+    ~VectorFile() {
+        close();
+    }
+
+    VectorFile(const VectorFile &) = delete;
+    VectorFile &operator=(const VectorFile &) = delete;
+
+    /**
+    * Opens a vector file written by write_vector_file or
+    * write_leaf_clustered_vector_file, closing the file opened before, if any.
+    * The slots of a clustered file are kept in memory, 16 bytes per vector.
+    * @param path - The file
+    * @param cache_bytes - The memory of the cache of vectors with its tables, 0 for no cache (see VectorCache)
+    * @param direct_io - If true, the reads bypass the page cache where the
+    * system and the file system allow it, so that only the cache of this object
+    * keeps vectors in memory
+    * @return false if the file cannot be opened or is not a vector file
+    */
+    bool open(const char *path, size_t cache_bytes = 0, bool direct_io = true) {
+        close();
+#ifdef _WIN32
+        (void) direct_io;
+        file = ::_open(path, _O_RDONLY | _O_BINARY);
+#else
+        file = ::open(path, O_RDONLY);
+#endif
+        if (file < 0)
+            return false;
+        if (!read_at(file, reinterpret_cast<char *>(&header), sizeof(header), 0) ||
+            std::memcmp(header.magic, vector_file_magic, sizeof(header.magic)) ||
+            (header.version != 1 && header.version != 2) || header.dim < 1 || header.n < 0 ||
+            header.page_size < sizeof(VectorFileHeader) ||
+            header.span != vector_file_layout(header.n, header.dim, header.page_size).span || !read_table()) {
+            close();
+            return false;
+        }
+
+#ifdef O_DIRECT
+        // the file is opened again for the reads of the pages, which are aligned
+        if (direct_io) {
+            const int unbuffered = ::open(path, O_RDONLY | O_DIRECT);
+            if (unbuffered >= 0) {
+                ::close(file);
+                file = unbuffered;
+                direct = true;
+            }
+        }
+#else
+        (void) direct_io;
+#endif
+
+        cache.reset(cache_bytes, header.dim);
+        return true;
+    }
+
+    /**
+    * Closes the file and drops the cache. Must not be called concurrently with fetch.
+    */
+    void close() {
+        if (file >= 0) {
+#ifdef _WIN32
+            ::_close(file);
+#else
+            ::close(file);
+#endif
+        }
+        file = -1;
+        direct = false;
+        std::memset(&header, 0, sizeof(header));
+        readers.clear();
+        slots.clear();
+        slot_ids.clear();
+        leaves.clear();
+        cache.clear();
+    }
+
+    /**
+    * Copies vectors into out, those not in the cache with one batch of reads.
+    * The vectors in the same page are read once, and the pages next to each
+    * other in one read. Can be called concurrently; each concurrent call uses a
+    * ring of its own.
+    * @param ids - The vectors, in [0, size())
+    * @param n - The number of vectors
+    * @param out - The output buffer of n * dim() floats; vector i is written to
+    * out[i * dim(), (i + 1) * dim())
+    * @return false if an id is out of range or not in the file, or a read fails
+    */
+    bool fetch(const int64_t *ids, int n, float *out) {
+        if (file < 0)
+            return false;
+        const int dim = header.dim;
+        std::unique_ptr<Reader> reader = acquire();
+        std::vector<std::pair<int64_t, int>> &missing = reader->missing;
+        missing.clear();
+        for (int i = 0; i < n; ++i) {
+            const int64_t slot = ids[i] >= 0 && ids[i] < header.n ? slot_of(ids[i]) : -1;
+            if (slot < 0) {
+                release(std::move(reader));
+                return false;
+            }
+            if (!cache.lookup(ids[i], out + (int64_t) i * dim))
+                missing.emplace_back(slot, i);
+        }
+        n_hits.fetch_add(n - missing.size(), std::memory_order_relaxed);
+        n_misses.fetch_add(missing.size(), std::memory_order_relaxed);
+        if (missing.empty()) {
+            release(std::move(reader));
+            return true;
+        }
+
+        // the pages are read into the buffer one after another, so the pages
+        // next to each other in the file are also next to each other in the buffer
+        std::sort(missing.begin(), missing.end());
+        size_t n_pages = 0;
+        for (size_t j = 0; j < missing.size(); ++j)
+            n_pages += !j || read_of(missing[j].first) != read_of(missing[j - 1].first);
+        reader->reserve(n_pages * header.span);
+        std::vector<PageRead> &reads = reader->reads;
+        reads.clear();
+        char *buffer = reader->buffer;
+        for (size_t j = 0; j < missing.size(); ++j) {
+            if (j && read_of(missing[j].first) == read_of(missing[j - 1].first))
+                continue;
+            const uint64_t offset = header.page_size + read_of(missing[j].first) * header.span;
+            PageRead *last = reads.empty() ? nullptr : &reads.back();
+            if (last && last->offset + last->bytes == offset && last->bytes + header.span <= max_read_bytes)
+                last->bytes += header.span;
+            else
+                reads.push_back(PageRead{buffer, offset, header.span, false});
+            buffer += header.span;
+        }
+        n_reads.fetch_add(reads.size(), std::memory_order_relaxed);
+
+        bool ok = true;
+#ifdef MRPT_IO_URING
+        if (reader->ring && reader->ring->ok())
+            reader->ring->read(file, reads.data(), reads.size());
+#endif
+        for (PageRead &r : reads)
+            if (!r.done)
+                ok = ok && read_at(file, r.buffer, r.bytes, r.offset);
+
+        const size_t vector_bytes = sizeof(float) * dim;
+        size_t page = 0;
+        for (size_t j = 0; ok && j < missing.size(); ++j) {
+            const int64_t slot = missing[j].first;
+            if (j && read_of(slot) != read_of(missing[j - 1].first))
+                ++page;
+            const char *src = reader->buffer + page * header.span + in_page(slot);
+            float *dst = out + (int64_t) missing[j].second * dim;
+            std::memcpy(dst, src, vector_bytes);
+            cache.store(ids[missing[j].second], dst);
+        }
+        release(std::move(reader));
+        return ok;
+    }
+
+    /**
+    * Copies the vectors of a leaf of a file clustered by leaves into out with
+    * one sequential read, bypassing the cache. Can be called concurrently.
+    * @param leaf - The leaf, in [0, n_leaves())
+    * @param ids - The output buffer for the ids of the leaf_size(leaf) vectors
+    * @param out - The output buffer of leaf_size(leaf) * dim() floats, laid out as those of fetch
+    * @return false if the file is not clustered, the leaf is out of range or the read fails
+    */
+    bool fetch_leaf(int leaf, int64_t *ids, float *out) {
+        if (file < 0 || leaf < 0 || leaf >= header.n_leaves)
+            return false;
+        const int64_t first = leaves[leaf], size = leaves[header.n_leaves + leaf];
+        if (!size)
+            return true;
+        std::unique_ptr<Reader> reader = acquire();
+        const uint64_t first_page = read_of(first), bytes = (read_of(first + size - 1) - first_page + 1) * header.span;
+        reader->reserve(bytes);
+        PageRead read = {reader->buffer, header.page_size + first_page * header.span, bytes, false};
+#ifdef MRPT_IO_URING
+        if (reader->ring && reader->ring->ok())
+            reader->ring->read(file, &read, 1);
+#endif
+        const bool ok = read.done || read_at(file, read.buffer, read.bytes, read.offset);
+        n_reads.fetch_add(1, std::memory_order_relaxed);
+        for (int64_t i = 0; ok && i < size; ++i) {
+            const int64_t slot = first + i;
+            ids[i] = slot_ids[slot];
+            std::memcpy(out + i * header.dim, reader->buffer + (read_of(slot) - first_page) * header.span + in_page(slot),
+                        sizeof(float) * header.dim);
+        }
+        release(std::move(reader));
+        return ok;
+    }
+
+    /**
+    * Returns the number of leaves a clustered file is clustered by, 0 if it is not clustered.
+    */
+    int n_leaves() const {
+        return header.n_leaves;
+    }
+
+    /**
+    * Returns the number of vectors of a leaf of a clustered file.
+    */
+    int64_t leaf_size(int leaf) const {
+        return leaves[header.n_leaves + leaf];
+    }
+
+    /**
+    * Returns the number of vectors in the file.
+    */
+    int64_t size() const {
+        return header.n;
+    }
+
+    /**
+    * Returns the number of floats of a vector.
+    */
+    int dimension() const {
+        return header.dim;
+    }
+
+    /**
+    * Returns whether the reads bypass the page cache.
+    */
+    bool direct_io() const {
+        return direct;
+    }
+
+    /**
+    * Returns whether the reads are submitted to an io_uring rather than read one by one.
+    */
+    static bool uses_io_uring() {
+#ifdef MRPT_IO_URING
+        static const bool available = Ring(1).ok();
+        return available;
+#else
+        return false;
+#endif
+    }
+
+    /**
+    * Returns the counters of the reads and the cache. Can be called concurrently with fetch.
+    */
+    FetchStats stats() const {
+        FetchStats stats;
+        stats.n_reads = n_reads.load(std::memory_order_relaxed);
+        stats.n_hits = n_hits.load(std::memory_order_relaxed);
+        stats.n_misses = n_misses.load(std::memory_order_relaxed);
+        stats.n_evicted = cache.evicted();
+        stats.n_rejected = cache.rejected();
+        return stats;
+    }
+
+ private:
+    static const unsigned ring_entries = 256; // the reads submitted to a ring at once
+    static const uint64_t max_read_bytes = 1 << 20; // the most bytes of pages next to each other read at once
+
+    /**
+    * The state of one fetch: a ring, an aligned buffer for the pages and the
+    * lists of the batch. Readers are kept for the next fetches.
+    */
+    struct Reader {
+        char *buffer = nullptr;
+        size_t capacity = 0;
+        std::vector<std::pair<int64_t, int>> missing;
+        std::vector<PageRead> reads;
+#ifdef MRPT_IO_URING
+        std::unique_ptr<Ring> ring;
+#endif
+
+        ~Reader() {
+            mrpt_mmap::free_pages(buffer, capacity);
+        }
+
+        void reserve(size_t bytes) {
+            if (bytes <= capacity)
+                return;
+            mrpt_mmap::free_pages(buffer, capacity);
+            capacity = std::max(bytes, 2 * capacity);
+            buffer = static_cast<char *>(mrpt_mmap::allocate_pages(capacity));
+            if (!buffer)
+                throw std::bad_alloc();
+        }
+    };
+
+    std::unique_ptr<Reader> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(readers_mutex);
+            if (!readers.empty()) {
+                std::unique_ptr<Reader> reader = std::move(readers.back());
+                readers.pop_back();
+                return reader;
+            }
+        }
+        std::unique_ptr<Reader> reader(new Reader);
+#ifdef MRPT_IO_URING
+        if (uses_io_uring())
+            reader->ring.reset(new Ring(ring_entries));
+#endif
+        return reader;
+    }
+
+    void release(std::unique_ptr<Reader> reader) {
+        std::lock_guard<std::mutex> lock(readers_mutex);
+        readers.push_back(std::move(reader));
+    }
+
+    /**
+    * Reads the slots of the vectors and the leaves of a clustered file.
+    * @return false if the table is not valid
+    */
+    bool read_table() {
+        if (header.version == 1) {
+            header.n_slots = header.n;
+            return !header.n_leaves;
+        }
+        const int64_t per_page = header.per_page ? header.per_page : 1;
+        if (header.n_leaves < 0 || header.n_slots < 0 ||
+            header.table_offset != header.page_size + (header.n_slots + per_page - 1) / per_page * header.span)
+            return false;
+        slots.resize(header.n);
+        leaves.resize(2 * (size_t) header.n_leaves);
+        if (!read_at(file, reinterpret_cast<char *>(slots.data()), sizeof(int64_t) * slots.size(), header.table_offset) ||
+            !read_at(file, reinterpret_cast<char *>(leaves.data()), sizeof(int64_t) * leaves.size(),
+                     header.table_offset + sizeof(int64_t) * slots.size()))
+            return false;
+
+        slot_ids.assign(header.n_slots, -1);
+        for (int64_t id = 0; id < header.n; ++id) {
+            if (slots[id] < -1 || slots[id] >= header.n_slots)
+                return false;
+            if (slots[id] >= 0)
+                slot_ids[slots[id]] = id;
+        }
+        for (int leaf = 0; leaf < header.n_leaves; ++leaf) {
+            const int64_t first = leaves[leaf], size = leaves[header.n_leaves + leaf];
+            if (first < 0 || size < 0 || first + size > header.n_slots)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+    * Returns the slot of the vector id, or -1 if it is not in the file.
+    */
+    int64_t slot_of(int64_t id) const {
+        return slots.empty() ? id : slots[id];
+    }
+
+    /**
+    * Returns the number of the read that fetches the vector in slot.
+    */
+    uint64_t read_of(int64_t slot) const {
+        return header.per_page ? slot / header.per_page : slot;
+    }
+
+    /**
+    * Returns the offset of the vector in slot from the start of its read.
+    */
+    uint64_t in_page(int64_t slot) const {
+        return header.per_page ? slot % header.per_page * sizeof(float) * header.dim : 0;
+    }
+
+    int file;
+    bool direct;
+    VectorFileHeader header;
+
+    std::mutex readers_mutex;
+    std::vector<std::unique_ptr<Reader>> readers; // the readers not in use
+
+    std::vector<int64_t> slots; // the slot of each vector of a clustered file, empty if vector i is in slot i
+    std::vector<int64_t> slot_ids; // the vector in each slot of a clustered file, or -1
+    std::vector<int64_t> leaves; // the first slot of each leaf of a clustered file, then the sizes of the leaves
+
+    VectorCache cache;
+
+    std::atomic<long long> n_reads, n_hits, n_misses;
+};
+
+/*
+* Queries an index whose vectors are in a VectorFile: the index finds a
+* shortlist of candidates, the vectors of which are fetched in one batch and
+* scored exactly.
+*/
+class DiskSearch {
+ public:
+    /**
+    * @param index - The index, which must outlive this object; best quantized
+    * with a negative shortlist, so that its queries do not read the data
+    * @param vectors - The vectors of the index by its ids, which must outlive
+    * this object
+    * @param metric - The metric of the index
+    */
+    DiskSearch(const Mrpt &index_, VectorFile &vectors_, Mrpt::Metric metric_ = Mrpt::EUCLIDEAN) :
+        index(index_), vectors(vectors_), metric(metric_) {}
+
+    /**
+    * Finds the k approximate nearest neighbors of a query like Mrpt::query,
+    * re-ranking the shortlist nearest candidates of the index with the vectors
+    * of the file. Can be called concurrently with the other queries, but not
+    * with the methods that modify the index.
+    * @param q - The query, a vector of vectors.dimension() floats
+    * @param k - The number of neighbors searched for
+    * @param votes_required - The number of votes required for an object to be included in the linear search step
+    * @param shortlist - The number of candidates re-ranked, at least k; 0 re-ranks 4 * k of them
+    * @param out - The output buffer for the indices of the k neighbors, -1 where fewer were found
+    * @param out_distances - The output buffer for their distances, or nullptr
+    * @return false if the vectors of the candidates cannot be read
+    */
+    bool query(const float *q, int k, int votes_required, int shortlist, int *out,
+               float *out_distances = nullptr) const {
+        const int dim = vectors.dimension();
+        const int n_candidates = shortlist ? std::max(shortlist, k) : 4 * k;
+        std::vector<int> candidates(n_candidates);
+        index.query(Map<const VectorXf>(q, dim), n_candidates, votes_required, candidates.data());
+        const int n_found = std::find(candidates.begin(), candidates.end(), -1) - candidates.begin();
+
+        std::vector<int64_t> ids(candidates.begin(), candidates.begin() + n_found);
+        std::vector<float> x((size_t) n_found * dim);
+        if (!vectors.fetch(ids.data(), n_found, x.data()))
+            return false;
+
+        const mrpt_kernels::DistanceKernels &kernels = mrpt_kernels::distance_kernels(dim);
+        const mrpt_kernels::DistanceFunction distance = metric == Mrpt::EUCLIDEAN ? kernels.l2 : kernels.dot;
+        const float query_scale = metric == Mrpt::COSINE ? inverse_norm(kernels.dot(q, q, dim)) : 0;
+        Mrpt::TopK heap(k);
+        for (int i = 0; i < n_found; ++i) {
+            const float *xi = x.data() + (size_t) i * dim;
+            const float value = distance(q, xi, dim);
+            float score = value;
+            if (metric == Mrpt::INNER_PRODUCT)
+                score = -value;
+            else if (metric == Mrpt::COSINE)
+                score = -value * query_scale * inverse_norm(kernels.dot(xi, xi, dim));
+            heap.push(score, candidates[i]);
+        }
+
+        const int n = heap.extract(out, out_distances);
+        if (out_distances) {
+            for (int i = 0; i < n; ++i)
+                out_distances[i] = metric == Mrpt::EUCLIDEAN ? std::sqrt(out_distances[i]) : -out_distances[i];
+        }
+        return true;
+    }
+
+ private:
+    static float inverse_norm(float squared_norm) {
+        return squared_norm > 0 ? 1 / std::sqrt(squared_norm) : 0;
+    }
+
+    const Mrpt &index;
+    VectorFile &vectors;
+    const Mrpt::Metric metric;
+};
+
+} // namespace mrpt_disk
+
+#endif // CPP_MRPT_DISK_H_
@@ -0,0 +1,301 @@
+#ifndef CPP_MRPT_EXECUTOR_H_
+#define CPP_MRPT_EXECUTOR_H_
+
+/*
+ * The executors that run the parallel loops of an Mrpt index given one with
+ * Mrpt::set_executor: the builds, the batch queries, knn_graph and the loads.
+ * Without an executor the loops use OpenMP directly. An executor runs a loop
+ * as tasks numbered from 0, each of which covers a range of its iterations,
+ * and returns when all of them are done.
+ *
+ * OpenMPExecutor runs the tasks with OpenMP, like an index without an
+ * executor. ThreadPool runs them on threads of its own, which steal tasks
+ * from each other, and needs no OpenMP, so a process using it can fork as
+ * long as the pool is created after the fork. An application with a thread
+ * pool of its own implements Executor to run the tasks on it instead.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace mrpt_executor {
+
+class Executor {
+ public:
+    virtual ~Executor() { }
+
+    /*
+    * Calls task(i) for each i in [0, n_tasks), in any order and on any of the
+    * threads of the executor, and returns when all the calls have returned.
+    * The calling thread may run some of the tasks itself. A task can call
+    * parallel_for again, and the executor must not deadlock then, for
+    * example by running the inner tasks on the calling thread.
+    */
+    virtual void parallel_for(int n_tasks, const std::function<void(int)> &task) = 0;
+
+    /*
+    * Returns the number of tasks the executor runs at the same time, which
+    * the index divides its batches by.
+    */
+    virtual int concurrency() const = 0;
+};
+
+/*
+* Runs the tasks with an OpenMP parallel loop of dynamic schedule.
+*/
+class OpenMPExecutor : public Executor {
+ public:
+    /*
+    * @param n_threads - The number of threads, or 0 for omp_get_max_threads()
+    * of the calling thread
+    */
+    explicit OpenMPExecutor(int n_threads_ = 0) : n_threads(std::max(0, n_threads_)) { }
+
+    void parallel_for(int n_tasks, const std::function<void(int)> &task) override {
+        #pragma omp parallel for schedule(dynamic) num_threads(concurrency())
+        for (int i = 0; i < n_tasks; ++i)
+            task(i);
+    }
+
+    int concurrency() const override {
+        if (n_threads)
+            return n_threads;
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+ private:
+    int n_threads;
+};
+
+/*
+* A pool of threads that divide the tasks of a loop between them in equal
+* ranges at first. A thread takes the tasks of its own range from the front,
+* and one that runs out steals the back half of the largest range left. The
+* calling thread is one of the workers, so a pool of n threads starts n - 1.
+* The loops of different callers run one at a time, and a loop called from a
+* task of the pool runs serially on the calling thread. The threads of the
+* pool do not survive a fork, so a process that forks creates its pool after
+* forking. Under OpenMP the threads of the pool are limited to one OpenMP
+* thread each, so that the matrix products of the tasks do not start teams of
+* their own.
+*
+* A pool with a niceness runs work in the background, such as the build of
+* an index on a host that keeps serving queries: its threads run at a lower
+* priority, on Linux where the priority is per thread, and the calling thread
+* only waits for them, so that it does not work at its own priority.
+*/
+class ThreadPool : public Executor {
+ public:
+    /*
+    * @param n_threads - The number of threads, including the calling thread
+    * unless niceness is given, or 0 for std::thread::hardware_concurrency()
+    * @param niceness - How much the nice value of the threads is raised, from
+    * 0 to 19, or 0 for threads of the priority of the process
+    */
+    explicit ThreadPool(int n_threads = 0, int niceness_ = 0) :
+        niceness(std::max(0, std::min(19, niceness_))),
+        n_workers(std::max(1, n_threads > 0 ? n_threads : (int) std::thread::hardware_concurrency()) + (niceness > 0)),
+        ranges(new Range[n_workers]) {
+        for (int w = 1; w < n_workers; ++w)
+            threads.emplace_back([this, w] { work(w); });
+    }
+
+    ~ThreadPool() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        started.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void parallel_for(int n_tasks, const std::function<void(int)> &task) override {
+        if (n_tasks <= 0)
+            return;
+        if (in_pool() || (!niceness && (n_workers == 1 || n_tasks == 1))) {
+            for (int i = 0; i < n_tasks; ++i)
+                task(i);
+            return;
+        }
+
+        std::lock_guard<std::mutex> loop_lock(loop_mutex);
+        // with a niceness the calling thread, worker 0, gets no range and does not steal
+        const int first = niceness > 0, n_working = n_workers - first;
+        ranges[0].begin = ranges[0].end = 0;
+        for (int w = first; w < n_workers; ++w) {
+            ranges[w].begin = (int64_t) n_tasks * (w - first) / n_working;
+            ranges[w].end = (int64_t) n_tasks * (w - first + 1) / n_working;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &task;
+            error = nullptr;
+            n_running = n_workers - 1;
+            ++generation;
+        }
+        started.notify_all();
+
+        current_pool() = this;
+        if (!niceness)
+            run(0);
+        current_pool() = nullptr;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return n_running == 0; });
+        current = nullptr;
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    int concurrency() const override {
+        return n_workers - (niceness > 0);
+    }
+
+ private:
+    // the tasks [begin, end) a worker has left, padded to a cache line of its own
+    struct Range {
+        std::mutex lock;
+        int begin = 0, end = 0;
+        char padding[64];
+    };
+
+    int niceness;
+    int n_workers;
+    std::unique_ptr<Range[]> ranges;
+    std::vector<std::thread> threads;
+    std::mutex loop_mutex; // held by the caller of a loop until it finishes
+    std::mutex mutex; // guards the fields below
+    std::condition_variable started, finished;
+    const std::function<void(int)> *current = nullptr; // the task of the loop running
+    std::exception_ptr error; // the first exception of a task of the loop
+    int n_running = 0; // the workers other than the caller still in the loop
+    uint64_t generation = 0; // the number of loops started
+    bool stopping = false;
+
+    static ThreadPool *&current_pool() {
+        static thread_local ThreadPool *pool = nullptr;
+        return pool;
+    }
+
+    bool in_pool() const {
+        return current_pool() == this;
+    }
+
+    void work(int w) {
+        current_pool() = this;
+#ifdef _OPENMP
+        omp_set_num_threads(1);
+#endif
+#ifdef __linux__
+        // the nice value of a thread on Linux, whose threads are processes of their own to setpriority
+        if (niceness) {
+            const id_t tid = syscall(SYS_gettid);
+            setpriority(PRIO_PROCESS, tid, std::min(19, getpriority(PRIO_PROCESS, tid) + niceness));
+        }
+#endif
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                started.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            run(w);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--n_running == 0)
+                finished.notify_one();
+        }
+    }
+
+    /*
+    * Runs the tasks of worker w, and then those it steals, until none are left.
+    */
+    void run(int w) {
+        int i;
+        while (take(w, i) || steal(w, i)) {
+            try {
+                (*current)(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
+    }
+
+    bool take(int w, int &i) {
+        Range &r = ranges[w];
+        std::lock_guard<std::mutex> lock(r.lock);
+        if (r.begin == r.end)
+            return false;
+        i = r.begin++;
+        return true;
+    }
+
+    /*
+    * Moves the back half of the largest range of another worker to the range
+    * of worker w, and takes the first task of it.
+    */
+    bool steal(int w, int &i) {
+        for (;;) {
+            int victim = -1, most = 0;
+            for (int v = 0; v < n_workers; ++v) {
+                if (v == w)
+                    continue;
+                std::lock_guard<std::mutex> lock(ranges[v].lock);
+                if (ranges[v].end - ranges[v].begin > most) {
+                    most = ranges[v].end - ranges[v].begin;
+                    victim = v;
+                }
+            }
+            if (victim < 0)
+                return false;
+
+            int begin, end;
+            {
+                std::lock_guard<std::mutex> lock(ranges[victim].lock);
+                Range &r = ranges[victim];
+                if (r.begin == r.end)
+                    continue; // emptied meanwhile, look again
+                end = r.end;
+                begin = r.end - (r.end - r.begin + 1) / 2;
+                r.end = begin;
+            }
+            std::lock_guard<std::mutex> lock(ranges[w].lock);
+            ranges[w].begin = begin + 1;
+            ranges[w].end = end;
+            i = begin;
+            return true;
+        }
+    }
+};
+
+} // namespace mrpt_executor
+
+#endif // CPP_MRPT_EXECUTOR_H_
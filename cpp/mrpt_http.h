@@ -0,0 +1,432 @@
+#ifndef CPP_MRPT_HTTP_H_
+#define CPP_MRPT_HTTP_H_
+
+/*
+ * The HTTP/1.1 of the search server and of the coordinator that fans its
+ * queries out to the servers of the shards: reading and answering requests
+ * on one side, posting requests over kept-alive connections with a deadline
+ * on the other, and parsing the JSON answer of a search. RangeClient reads
+ * an index file from object storage by range GETs, for Mrpt::load_ranges.
+ * Only what these need is supported: bodies of a Content-Length, without
+ * chunked transfer encoding, IPv4 addresses and plain HTTP.
+ *
+ * Uses POSIX sockets and does not build on Windows.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace mrpt_http {
+
+typedef std::chrono::steady_clock Clock;
+
+struct HttpRequest {
+    std::string method, path, query, body;
+    bool keep_alive = true;
+};
+
+struct HttpResponse {
+    int status = 0;
+    std::string body;
+    bool keep_alive = true;
+};
+
+/*
+* Returns the value of a parameter of the query string of a URL, or def if it is missing.
+*/
+inline std::string parameter(const std::string &query, const std::string &name, const std::string &def = "") {
+    for (size_t begin = 0; begin <= query.size(); ) {
+        size_t end = query.find('&', begin);
+        if (end == std::string::npos) end = query.size();
+        const size_t eq = query.find('=', begin);
+        if (eq < end && query.compare(begin, eq - begin, name) == 0)
+            return query.substr(eq + 1, end - eq - 1);
+        begin = end + 1;
+    }
+    return def;
+}
+
+inline bool send_all(int socket, const std::string &bytes) {
+    for (size_t sent = 0; sent < bytes.size(); ) {
+        const ssize_t n = send(socket, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+inline bool respond(int socket, int status, const std::string &body, bool keep_alive,
+                    const char *content_type = "application/json") {
+    const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" :
+                         status == 413 ? "Payload Too Large" : status == 502 ? "Bad Gateway" :
+                         status == 504 ? "Gateway Timeout" : "Internal Server Error";
+    char head[256];
+    std::snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+                  status, reason, content_type, body.size(), keep_alive ? "" : "Connection: close\r\n");
+    return send_all(socket, head + body);
+}
+
+inline std::string json_error(const std::string &message) {
+    return "{\"error\": \"" + message + "\"}\n";
+}
+
+/*
+* Receives at most n bytes, waiting for them until the deadline if one is given.
+* @return The number of bytes received, 0 if the connection was closed and -1 on
+* an error or when the deadline passes.
+*/
+inline ssize_t receive(int socket, char *chunk, size_t n, const Clock::time_point *deadline) {
+    for (;;) {
+        if (deadline) {
+            const long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                *deadline - Clock::now()).count();
+            if (ms < 0) return -1;
+            pollfd p = {socket, POLLIN, 0};
+            const int ready = poll(&p, 1, (int) std::min(ms + 1, 1LL << 30));
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return -1;
+        }
+        const ssize_t received = recv(socket, chunk, n, 0);
+        if (received < 0 && errno == EINTR) continue;
+        return received;
+    }
+}
+
+/*
+* Reads the next message of a connection, a request or a response, keeping the
+* bytes read past it in buffer.
+* @param head - Set to the start line and the headers
+* @param body - Set to the body
+* @param keep_alive - Set to whether the connection stays open after the message
+* @param deadline - The time the message must be read by, or nullptr to wait for it
+* as long as the connection is open
+* @return 1 if a message was read, 0 if the connection was closed or the deadline
+* passed, -1 if the message is malformed and -2 if its body is too large.
+*/
+inline int read_message(int socket, std::string &buffer, std::string &head, std::string &body, bool &keep_alive,
+                        const Clock::time_point *deadline = nullptr) {
+    const size_t max_head = 1 << 16, max_body = (size_t) 1 << 28;
+    size_t head_end;
+    char chunk[1 << 16];
+    while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        if (buffer.size() > max_head) return -1;
+        const ssize_t n = receive(socket, chunk, sizeof(chunk), deadline);
+        if (n <= 0) return 0;
+        buffer.append(chunk, n);
+    }
+
+    head = buffer.substr(0, head_end);
+    const size_t line_end = std::min(head.find("\r\n"), head.size());
+    // HTTP/1.0 closes by default, named last in a request line and first in a status line
+    keep_alive = head.compare(0, 8, "HTTP/1.0") != 0 &&
+                 (line_end < 8 || head.compare(line_end - 8, 8, "HTTP/1.0") != 0);
+    size_t content_length = 0;
+    for (size_t begin = line_end; begin < head.size(); ) {
+        size_t end = head.find("\r\n", begin + 2);
+        if (end == std::string::npos) end = head.size();
+        std::string header = head.substr(begin + 2, end - begin - 2);
+        std::transform(header.begin(), header.end(), header.begin(), ::tolower);
+        if (header.compare(0, 15, "content-length:") == 0)
+            content_length = std::strtoull(header.c_str() + 15, nullptr, 10);
+        else if (header.compare(0, 11, "connection:") == 0)
+            keep_alive = header.find("close") == std::string::npos;
+        begin = end;
+    }
+    if (content_length > max_body) return -2;
+
+    buffer.erase(0, head_end + 4);
+    while (buffer.size() < content_length) {
+        const ssize_t n = receive(socket, chunk, std::min(sizeof(chunk), content_length - buffer.size()), deadline);
+        if (n <= 0) return 0;
+        buffer.append(chunk, n);
+    }
+    body = buffer.substr(0, content_length);
+    buffer.erase(0, content_length);
+    return 1;
+}
+
+/*
+* Reads the next request of a connection into r, keeping the bytes read past it in buffer.
+* @return 1 if a request was read, 0 if the connection was closed, -1 if the request
+* is malformed and -2 if its body is too large.
+*/
+inline int read_request(int socket, std::string &buffer, HttpRequest &r) {
+    std::string head;
+    const int read = read_message(socket, buffer, head, r.body, r.keep_alive);
+    if (read <= 0) return read;
+
+    const std::string line = head.substr(0, head.find("\r\n"));
+    const size_t s1 = line.find(' '), s2 = line.find(' ', s1 + 1);
+    if (s1 == std::string::npos || s2 == std::string::npos) return -1;
+    r.method = line.substr(0, s1);
+    const std::string target = line.substr(s1 + 1, s2 - s1 - 1);
+    const size_t question = target.find('?');
+    r.path = target.substr(0, question);
+    r.query = question == std::string::npos ? "" : target.substr(question + 1);
+    return 1;
+}
+
+/*
+* Opens a connection to a server before a deadline, with Nagle's algorithm off.
+* @param host - The IPv4 address of the server
+* @return The socket, or -1 if the server cannot be reached in time.
+*/
+inline int connect_to(const std::string &host, int port, Clock::time_point deadline) {
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+        return -1;
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        return -1;
+
+    // connect without blocking, to give up at the deadline
+    const int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    bool connected = connect(s, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    if (!connected && errno == EINPROGRESS) {
+        const Clock::time_point now = Clock::now();
+        const long long ms = deadline > now ?
+            std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1 : 0;
+        pollfd p = {s, POLLOUT, 0};
+        int error = 0;
+        socklen_t length = sizeof(error);
+        connected = poll(&p, 1, (int) std::min(ms, 1LL << 30)) == 1 &&
+                    getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+    }
+    if (!connected) {
+        close(s);
+        return -1;
+    }
+    fcntl(s, F_SETFL, flags);
+    const int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+/*
+* Posts a request on an open connection and reads the response before a deadline.
+* @param host - The host named in the request
+* @param target - The path and the query string of the request
+* @param buffer - The bytes read past the previous response of the connection,
+* empty for a new connection
+* @return True if a response was read, in which case the connection can be used
+* again if response.keep_alive is set, and false if it must be closed.
+*/
+inline bool post(int socket, const std::string &host, const std::string &target, const std::string &body,
+                 std::string &buffer, HttpResponse &response, Clock::time_point deadline) {
+    // a send blocked by a full window gives up at the deadline too
+    const long long us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+    if (us <= 0)
+        return false;
+    timeval timeout;
+    timeout.tv_sec = us / 1000000;
+    timeout.tv_usec = us % 1000000;
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char head[512];
+    std::snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\n"
+                  "Content-Length: %zu\r\n\r\n", target.c_str(), host.c_str(), body.size());
+    if (!send_all(socket, head) || !send_all(socket, body))
+        return false;
+
+    std::string response_head;
+    if (read_message(socket, buffer, response_head, response.body, response.keep_alive, &deadline) != 1)
+        return false;
+    const size_t space = response_head.find(' ');
+    response.status = space == std::string::npos ? 0 : std::atoi(response_head.c_str() + space + 1);
+    return response.status > 0;
+}
+
+/*
+* Reads the bytes [first, first + length) of the resource at target with a
+* range GET on an open connection, and the response before a deadline.
+* @param host - The host named in the request
+* @param out - Set to the bytes
+* @param buffer - The bytes read past the previous response of the connection,
+* empty for a new connection
+* @param keep_alive - Set to whether the connection can be used again
+* @return True if the server sent exactly those bytes.
+*/
+inline bool get_range(int socket, const std::string &host, const std::string &target, uint64_t first,
+                      uint64_t length, char *out, std::string &buffer, bool &keep_alive,
+                      Clock::time_point deadline) {
+    if (!length)
+        return true;
+    const long long us = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+    if (us <= 0)
+        return false;
+    timeval timeout;
+    timeout.tv_sec = us / 1000000;
+    timeout.tv_usec = us % 1000000;
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    const std::string head = "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\nRange: bytes=" +
+                             std::to_string(first) + "-" + std::to_string(first + length - 1) + "\r\n\r\n";
+    std::string response_head, body;
+    keep_alive = false;
+    if (!send_all(socket, head) || read_message(socket, buffer, response_head, body, keep_alive, &deadline) != 1)
+        return false;
+    // 206 Partial Content, or 200 with the whole resource if it is exactly the range
+    const size_t space = response_head.find(' ');
+    const int status = space == std::string::npos ? 0 : std::atoi(response_head.c_str() + space + 1);
+    if ((status != 206 && (status != 200 || first)) || body.size() != length)
+        return false;
+    std::memcpy(out, body.data(), length);
+    return true;
+}
+
+/*
+* Reads the ranges of a resource of an HTTP server, such as an index file in
+* an S3-compatible object store at a URL presigned for GET, for
+* Mrpt::load_ranges. Any number of threads can read at once, each on a
+* kept-alive connection of a pool, and a range that fails is read again on a
+* new connection up to retries times.
+*/
+class RangeClient {
+ public:
+    /*
+    * @param url - The URL of the resource, http://address:port/path?query with an IPv4 address
+    * @param timeout_ms - How long a range may take to read
+    * @param retries_ - How many times a range that failed is read again
+    */
+    explicit RangeClient(const std::string &url, int timeout_ms = 30000, int retries_ = 2) :
+        port(80), timeout(std::chrono::milliseconds(timeout_ms)), retries(retries_) {
+        const std::string scheme = "http://";
+        if (url.compare(0, scheme.size(), scheme) != 0)
+            return;
+        const size_t slash = url.find('/', scheme.size());
+        host = url.substr(scheme.size(), slash == std::string::npos ? std::string::npos : slash - scheme.size());
+        target = slash == std::string::npos ? "/" : url.substr(slash);
+        const size_t colon = host.find(':');
+        address = host.substr(0, colon);
+        if (colon != std::string::npos)
+            port = std::atoi(host.c_str() + colon + 1);
+    }
+
+    RangeClient(const RangeClient &) = delete;
+    RangeClient &operator=(const RangeClient &) = delete;
+
+    ~RangeClient() {
+        for (const Connection &c : idle)
+            close(c.socket);
+    }
+
+    /*
+    * Returns whether the URL is one the client can read.
+    */
+    bool valid() const {
+        in_addr a;
+        return !address.empty() && port > 0 && port < 65536 && inet_pton(AF_INET, address.c_str(), &a) == 1;
+    }
+
+    /*
+    * Reads the bytes [offset, offset + length) of the resource into out.
+    * @return False if they cannot be read.
+    */
+    bool read(uint64_t offset, void *out, uint64_t length) {
+        if (!valid())
+            return false;
+        for (int attempt = 0; attempt <= retries; ++attempt) {
+            const Clock::time_point deadline = Clock::now() + timeout;
+            Connection c;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!idle.empty() && attempt == 0) {
+                    c = std::move(idle.back());
+                    idle.pop_back();
+                }
+            }
+            if (c.socket < 0 && (c.socket = connect_to(address, port, deadline)) < 0)
+                continue;
+            bool keep_alive;
+            const bool ok = get_range(c.socket, host, target, offset, length, static_cast<char *>(out), c.buffer,
+                                      keep_alive, deadline);
+            if (ok && keep_alive) {
+                std::lock_guard<std::mutex> lock(mutex);
+                idle.push_back(std::move(c));
+            } else {
+                close(c.socket);
+            }
+            if (ok)
+                return true;
+        }
+        return false;
+    }
+
+ private:
+    struct Connection {
+        int socket = -1;
+        std::string buffer; // the bytes read past the last response
+    };
+
+    std::string host, address, target;
+    int port;
+    Clock::duration timeout;
+    int retries;
+    std::mutex mutex; // guards idle
+    std::vector<Connection> idle; // the open connections no read is using
+};
+
+/*
+* Parses the list of lists of numbers following "key": in a JSON object, such as
+* the indices of the answer of a search.
+* @return True if the key was found and its value is a list of lists of numbers.
+*/
+template <typename T>
+bool parse_lists(const std::string &json, const char *key, std::vector<std::vector<T>> &lists) {
+    lists.clear();
+    const size_t at = json.find(std::string("\"") + key + "\"");
+    if (at == std::string::npos)
+        return false;
+    const char *p = json.c_str() + at + std::strlen(key) + 2;
+    auto skip = [&p] { while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t') ++p; };
+    skip();
+    if (*p++ != ':') return false;
+    skip();
+    if (*p++ != '[') return false;
+    for (skip(); *p != ']'; skip()) {
+        if (!lists.empty() && *p++ != ',') return false;
+        skip();
+        if (*p++ != '[') return false;
+        lists.emplace_back();
+        for (skip(); *p != ']'; skip()) {
+            if (!lists.back().empty() && *p++ != ',') return false;
+            char *end;
+            const double value = std::strtod(p, &end);
+            if (end == p) return false;
+            lists.back().push_back((T) value);
+            p = end;
+        }
+        ++p;
+    }
+    return true;
+}
+
+} // namespace mrpt_http
+
+#endif // CPP_MRPT_HTTP_H_
@@ -0,0 +1,1270 @@
+#ifndef CPP_MRPT_KERNELS_H_
+#define CPP_MRPT_KERNELS_H_
+
+/*
+ * Distance kernels for the candidate re-ranking loop of Mrpt. Every kernel
+ * is compiled for several instruction sets in the same binary (SSE, AVX2+FMA
+ * and AVX-512 on x86, NEON on ARM64), and the fastest one supported by the
+ * CPU is selected at runtime, so a generic build that is not compiled with
+ * -march=native still runs vectorized distance computations. The selection
+ * can be overridden by setting the environment variable MRPT_SIMD to one of
+ * scalar, sse, avx2 or avx512.
+ *
+ * Besides single distances, each instruction set has a kernel that computes
+ * the distances from one query to four candidates in one pass over the
+ * query, which keeps four independent streams of loads in flight. For the
+ * common dimensions of embeddings in fixed_dimensions, distance_kernels(dim)
+ * returns the same kernels compiled for that dimension, whose loops have no
+ * tail and are unrolled completely, with two accumulators per candidate.
+ *
+ * The quantized kernels compute the squared distance from a float query to a
+ * vector stored with 8-bit codes or as half precision floats. With 8-bit codes,
+ * component i of the stored vector is offset_i + scale_i * code_i, and the
+ * kernel is given the query minus the offsets and the scales. The inner
+ * products of a float query with half precision floats and with signed 8-bit
+ * codes project the queries onto a rounded random matrix, and the sums of
+ * gathered components onto the sparse +-1 vectors of RADEMACHER projections. Vectors coded
+ * with product quantization are scored by summing up entries of a distance
+ * table of the query. Binary codes are compared by the number of differing
+ * bits, counted with the popcnt instruction where the CPU has it, eight words
+ * at a time with the vpopcntq of AVX-512 VPOPCNTDQ, or with the byte counts of
+ * NEON.
+ *
+ * The compressed leaves of Mrpt::compress_leaves hold their sorted ids as
+ * differences bit-packed in eight interleaved lanes, which the AVX2 kernel
+ * unpacks a row of eight ids at a time, adding up the differences with a
+ * prefix sum in the register.
+ *
+ * The sections of index files are checksummed with CRC-32C, which is computed
+ * with the crc32 instruction of SSE 4.2 where the CPU has it.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MRPT_KERNELS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define MRPT_TARGET(isa)
+#else
+#define MRPT_TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif defined(__aarch64__)
+#define MRPT_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(__clang__)
+#define MRPT_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define MRPT_UNROLL _Pragma("GCC unroll 64")
+#else
+#define MRPT_UNROLL
+#endif
+
+namespace mrpt_kernels {
+
+/*
+* Squared Euclidean distance, or inner product, between two vectors of dim
+* floats, and the same for one query and four candidates at a time.
+*/
+typedef float (*DistanceFunction)(const float *a, const float *b, int dim);
+typedef void (*DistanceFunction4)(const float *q, const float *const *x, int dim, float *out);
+typedef float (*Int8Function)(const float *q, const float *scale, const uint8_t *code, int dim);
+typedef float (*Float16Function)(const float *q, const uint16_t *x, int dim);
+typedef float (*Int8DotFunction)(const float *q, const int8_t *code, int dim);
+typedef float (*GatherFunction)(const float *q, const int *columns, int n);
+typedef float (*GatherDotFunction)(const float *q, const int *columns, const float *values, int n);
+typedef int (*HammingFunction)(const uint64_t *a, const uint64_t *b, int words);
+
+/*
+* Unpacks the n ids of a block written by pack_ids to out, which has room for n
+* rounded up to a multiple of 8, and returns the words after the block.
+*/
+typedef const uint32_t *(*UnpackFunction)(const uint32_t *words, int n, int *out);
+
+/*
+* Routes a query down n_trees trees of the given depth, several trees at a time
+* in the lanes of a vector. The split points of tree t start at split + t * stride
+* and its projections at projected + t * depth, and the leaf reached in tree t is
+* written to leaves[t].
+*/
+typedef void (*RouteFunction)(const float *projected, const float *split, int n_trees, int depth, int stride,
+                              int *leaves);
+
+struct DistanceKernels {
+    const char *name; // name of the instruction set
+    DistanceFunction l2;
+    DistanceFunction4 l2_4;
+    DistanceFunction dot;
+    DistanceFunction4 dot_4;
+    Int8Function l2_int8;
+    Float16Function l2_float16;
+    Float16Function dot_float16;
+    Int8DotFunction dot_int8; // inner product with signed 8-bit codes, to be scaled by the caller
+    GatherFunction gather_sum; // the sum of the components of q at n columns
+    GatherDotFunction gather_dot; // the inner product of n values with the components of q at n columns
+    RouteFunction route; // nullptr without vector gathers, then the trees are descended one by one
+    HammingFunction hamming; // the number of differing bits of two binary codes of words 64-bit words
+    UnpackFunction unpack_ids; // the ids of a block of compressed leaves
+};
+
+/*
+* Portable kernels, also used for the tails of the vectorized ones. The four
+* independent accumulators let the compiler vectorize the loops when it is
+* allowed to reorder floating point additions.
+*/
+template <bool L2>
+inline float scalar_distance(const float *a, const float *b, int dim) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        if (L2) {
+            const float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1];
+            const float d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+            s0 += d0 * d0; s1 += d1 * d1; s2 += d2 * d2; s3 += d3 * d3;
+        } else {
+            s0 += a[i] * b[i]; s1 += a[i + 1] * b[i + 1];
+            s2 += a[i + 2] * b[i + 2]; s3 += a[i + 3] * b[i + 3];
+        }
+    }
+    for (; i < dim; ++i) {
+        if (L2) {
+            const float d = a[i] - b[i];
+            s0 += d * d;
+        } else {
+            s0 += a[i] * b[i];
+        }
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+template <bool L2>
+inline void scalar_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    for (int j = 0; j < 4; ++j)
+        out[j] = scalar_distance<L2>(q, x[j], dim);
+}
+
+/*
+* Distance from the first `from` components onwards, for the tails of the
+* vectorized kernels.
+*/
+template <bool L2>
+inline float scalar_tail(const float *a, const float *b, int from, int dim) {
+    return from < dim ? scalar_distance<L2>(a + from, b + from, dim - from) : 0;
+}
+
+/*
+* Conversions between floats and IEEE half precision floats, rounding to the
+* nearest half. Values beyond the half range become infinities.
+*/
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16, exponent = (h >> 10) & 0x1f;
+    const uint32_t mantissa = h & 0x3ff;
+    if (!exponent) {
+        const float f = mantissa * (1.0f / (1 << 24));
+        return sign ? -f : f;
+    }
+    const uint32_t bits = sign | (exponent == 31 ? 0x7f800000 : (exponent + 112) << 23) | mantissa << 13;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    const uint16_t sign = (bits >> 16) & 0x8000;
+    const uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude > 0x7f800000)
+        return sign | 0x7e00;
+    if (magnitude >= 0x477ff000) // rounds to more than the largest half
+        return sign | 0x7c00;
+    if (magnitude < 0x38800000) // subnormal halves are multiples of 2^-24
+        return sign | static_cast<uint16_t>(std::nearbyint(std::fabs(f) * (1 << 24)));
+    uint32_t h = (magnitude - 0x38000000) >> 13;
+    const uint32_t rest = magnitude & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+inline float scalar_distance_int8(const float *q, const float *scale, const uint8_t *code, int dim) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= dim; i += 2) {
+        const float d0 = q[i] - scale[i] * code[i], d1 = q[i + 1] - scale[i + 1] * code[i + 1];
+        s0 += d0 * d0; s1 += d1 * d1;
+    }
+    for (; i < dim; ++i) {
+        const float d = q[i] - scale[i] * code[i];
+        s0 += d * d;
+    }
+    return s0 + s1;
+}
+
+template <bool L2>
+inline float scalar_distance_float16(const float *q, const uint16_t *x, int dim) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= dim; i += 2) {
+        if (L2) {
+            const float d0 = q[i] - half_to_float(x[i]), d1 = q[i + 1] - half_to_float(x[i + 1]);
+            s0 += d0 * d0; s1 += d1 * d1;
+        } else {
+            s0 += q[i] * half_to_float(x[i]); s1 += q[i + 1] * half_to_float(x[i + 1]);
+        }
+    }
+    for (; i < dim; ++i) {
+        if (L2) {
+            const float d = q[i] - half_to_float(x[i]);
+            s0 += d * d;
+        } else {
+            s0 += q[i] * half_to_float(x[i]);
+        }
+    }
+    return s0 + s1;
+}
+
+/*
+* Inner product of a float query with a vector of signed 8-bit codes, which
+* the caller multiplies by the scale of the codes.
+*/
+inline float scalar_dot_int8(const float *q, const int8_t *code, int dim) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= dim; i += 2) {
+        s0 += q[i] * code[i]; s1 += q[i + 1] * code[i + 1];
+    }
+    for (; i < dim; ++i)
+        s0 += q[i] * code[i];
+    return s0 + s1;
+}
+
+/*
+* Sum of the components of q at the n given columns, the projection of q onto
+* a vector whose components there are 1, and 0 elsewhere.
+*/
+inline float scalar_gather_sum(const float *q, const int *columns, int n) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s0 += q[columns[i]]; s1 += q[columns[i + 1]];
+    }
+    for (; i < n; ++i)
+        s0 += q[columns[i]];
+    return s0 + s1;
+}
+
+/*
+* Inner product of q with a sparse vector whose n nonzero values are at the
+* given columns, the projection of q onto a row of a sparse random matrix.
+*/
+inline float scalar_gather_dot(const float *q, const int *columns, const float *values, int n) {
+    float s0 = 0, s1 = 0;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        s0 += values[i] * q[columns[i]]; s1 += values[i + 1] * q[columns[i + 1]];
+    }
+    for (; i < n; ++i)
+        s0 += values[i] * q[columns[i]];
+    return s0 + s1;
+}
+
+/*
+* Asymmetric distance of product quantization: the sum over the m subspaces of
+* the entries that the codes of a vector select from the 256-entry distance
+* tables of the query for the subspaces. The lookups do not vectorize well, so
+* there is one portable kernel whose four sums keep several lookups in flight.
+*/
+inline float pq_distance(const float *table, const uint8_t *code, int m) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0;
+    for (; i + 4 <= m; i += 4) {
+        s0 += table[(i << 8) + code[i]];
+        s1 += table[((i + 1) << 8) + code[i + 1]];
+        s2 += table[((i + 2) << 8) + code[i + 2]];
+        s3 += table[((i + 3) << 8) + code[i + 3]];
+    }
+    for (; i < m; ++i)
+        s0 += table[(i << 8) + code[i]];
+    return (s0 + s1) + (s2 + s3);
+}
+
+/*
+ * Returns the number of bits set in x.
+ */
+inline int popcount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x -= (x >> 1) & 0x5555555555555555ULL;
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+ * Returns the position of the lowest bit set in x, which must not be 0.
+ */
+inline int count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    return popcount((x & (0 - x)) - 1);
+#endif
+}
+
+inline int scalar_hamming(const uint64_t *a, const uint64_t *b, int words) {
+    int count = 0;
+    for (int i = 0; i < words; ++i)
+        count += popcount(a[i] ^ b[i]);
+    return count;
+}
+
+/*
+* Sorted ids are packed in blocks of at most pack_block ids. A block is the
+* first id, the bit width b of the largest difference between consecutive ids,
+* and the differences, the first of which is 0, in eight lanes of 32-bit words:
+* difference j goes to lane j % 8 at bit (j / 8) * b of the lane, and word k of
+* a lane is word 2 + 8 * k + lane of the block, so eight consecutive words hold
+* the same bits of every lane.
+*/
+const int pack_block = 128;
+
+/*
+* Returns the number of words of a block of n ids whose differences take width bits.
+*/
+inline int packed_words(int n, int width) {
+    return 2 + 8 * (((n + 7) / 8 * width + 31) / 32);
+}
+
+/*
+* Returns the bits of the largest difference between consecutive ids of the n sorted ids.
+*/
+inline int difference_width(const int *ids, int n) {
+    uint32_t bits = 0;
+    for (int j = 1; j < n; ++j)
+        bits |= (uint32_t) (ids[j] - ids[j - 1]);
+    int width = 0;
+    for (; width < 32 && bits >> width; ++width) { }
+    return width;
+}
+
+/*
+* Packs the n sorted ids, at most pack_block, to words and returns the words
+* after the block.
+*/
+inline uint32_t *pack_ids(const int *ids, int n, uint32_t *words) {
+    const int width = difference_width(ids, n), size = packed_words(n, width);
+    std::memset(words, 0, sizeof(uint32_t) * size);
+    words[0] = ids[0];
+    words[1] = width;
+    uint32_t *lanes = words + 2;
+    for (int j = 1; j < n && width; ++j) {
+        const uint32_t difference = ids[j] - ids[j - 1];
+        const int bit = (j / 8) * width, lane = j % 8, w = bit / 32, shift = bit % 32;
+        lanes[8 * w + lane] |= difference << shift;
+        if (shift + width > 32)
+            lanes[8 * (w + 1) + lane] |= difference >> (32 - shift);
+    }
+    return words + size;
+}
+
+inline const uint32_t *scalar_unpack_ids(const uint32_t *words, int n, int *out) {
+    const int width = words[1];
+    const uint32_t mask = width < 32 ? (1u << width) - 1 : ~0u, *lanes = words + 2;
+    uint32_t id = words[0];
+    out[0] = id;
+    for (int j = 1; j < n && width; ++j) {
+        const int bit = (j / 8) * width, lane = j % 8, w = bit / 32, shift = bit % 32;
+        uint32_t difference = lanes[8 * w + lane] >> shift;
+        if (shift + width > 32)
+            difference |= lanes[8 * (w + 1) + lane] << (32 - shift);
+        id += difference & mask;
+        out[j] = id;
+    }
+    return words + packed_words(n, width);
+}
+
+#ifdef MRPT_KERNELS_X86
+
+MRPT_TARGET("popcnt")
+inline int popcnt_hamming(const uint64_t *a, const uint64_t *b, int words) {
+    long long c0 = 0, c1 = 0;
+    int i = 0;
+    for (; i + 2 <= words; i += 2) {
+        c0 += _mm_popcnt_u64(a[i] ^ b[i]);
+        c1 += _mm_popcnt_u64(a[i + 1] ^ b[i + 1]);
+    }
+    if (i < words)
+        c0 += _mm_popcnt_u64(a[i] ^ b[i]);
+    return (int) (c0 + c1);
+}
+
+inline float hsum_sse(__m128 v) {
+    __m128 shuf = _mm_movehl_ps(v, v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+template <bool L2>
+inline __m128 sse_term(__m128 acc, __m128 a, __m128 b) {
+    if (L2) {
+        const __m128 d = _mm_sub_ps(a, b);
+        return _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    return _mm_add_ps(acc, _mm_mul_ps(a, b));
+}
+
+template <bool L2>
+inline float sse_distance(const float *a, const float *b, int dim) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = sse_term<L2>(acc0, _mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc1 = sse_term<L2>(acc1, _mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    }
+    for (; i + 4 <= dim; i += 4)
+        acc0 = sse_term<L2>(acc0, _mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    return hsum_sse(_mm_add_ps(acc0, acc1)) + scalar_tail<L2>(a, b, i, dim);
+}
+
+template <bool L2>
+inline void sse_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    __m128 acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128 qv = _mm_loadu_ps(q + i);
+        acc0 = sse_term<L2>(acc0, qv, _mm_loadu_ps(x[0] + i));
+        acc1 = sse_term<L2>(acc1, qv, _mm_loadu_ps(x[1] + i));
+        acc2 = sse_term<L2>(acc2, qv, _mm_loadu_ps(x[2] + i));
+        acc3 = sse_term<L2>(acc3, qv, _mm_loadu_ps(x[3] + i));
+    }
+    out[0] = hsum_sse(acc0) + scalar_tail<L2>(q, x[0], i, dim);
+    out[1] = hsum_sse(acc1) + scalar_tail<L2>(q, x[1], i, dim);
+    out[2] = hsum_sse(acc2) + scalar_tail<L2>(q, x[2], i, dim);
+    out[3] = hsum_sse(acc3) + scalar_tail<L2>(q, x[3], i, dim);
+}
+
+inline float sse_distance_int8(const float *q, const float *scale, const uint8_t *code, int dim) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i)), zero);
+        const __m128 c0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(c, zero));
+        const __m128 c1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(c, zero));
+        const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(q + i), _mm_mul_ps(_mm_loadu_ps(scale + i), c0));
+        const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(q + i + 4), _mm_mul_ps(_mm_loadu_ps(scale + i + 4), c1));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    return hsum_sse(_mm_add_ps(acc0, acc1)) + scalar_distance_int8(q + i, scale + i, code + i, dim - i);
+}
+
+MRPT_TARGET("avx2,fma")
+inline float hsum_avx2(__m256 v) {
+    const __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehl_ps(sum, sum);
+    __m128 sums = _mm_add_ps(sum, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+template <bool L2>
+MRPT_TARGET("avx2,fma")
+inline __m256 avx2_term(__m256 acc, __m256 a, __m256 b) {
+    if (L2) {
+        const __m256 d = _mm256_sub_ps(a, b);
+        return _mm256_fmadd_ps(d, d, acc);
+    }
+    return _mm256_fmadd_ps(a, b, acc);
+}
+
+template <bool L2>
+MRPT_TARGET("avx2,fma")
+float avx2_distance(const float *a, const float *b, int dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = avx2_term<L2>(acc0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc1 = avx2_term<L2>(acc1, _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    }
+    for (; i + 8 <= dim; i += 8)
+        acc0 = avx2_term<L2>(acc0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + scalar_tail<L2>(a, b, i, dim);
+}
+
+template <bool L2>
+MRPT_TARGET("avx2,fma")
+void avx2_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256 qv = _mm256_loadu_ps(q + i);
+        acc0 = avx2_term<L2>(acc0, qv, _mm256_loadu_ps(x[0] + i));
+        acc1 = avx2_term<L2>(acc1, qv, _mm256_loadu_ps(x[1] + i));
+        acc2 = avx2_term<L2>(acc2, qv, _mm256_loadu_ps(x[2] + i));
+        acc3 = avx2_term<L2>(acc3, qv, _mm256_loadu_ps(x[3] + i));
+    }
+    out[0] = hsum_avx2(acc0) + scalar_tail<L2>(q, x[0], i, dim);
+    out[1] = hsum_avx2(acc1) + scalar_tail<L2>(q, x[1], i, dim);
+    out[2] = hsum_avx2(acc2) + scalar_tail<L2>(q, x[2], i, dim);
+    out[3] = hsum_avx2(acc3) + scalar_tail<L2>(q, x[3], i, dim);
+}
+
+MRPT_TARGET("avx2,fma")
+float avx2_distance_int8(const float *q, const float *scale, const uint8_t *code, int dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+        const __m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c));
+        const __m256 c1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)));
+        const __m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), c0, _mm256_loadu_ps(q + i));
+        const __m256 d1 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i + 8), c1, _mm256_loadu_ps(q + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        const __m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i));
+        const __m256 d = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c)),
+                                          _mm256_loadu_ps(q + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + scalar_distance_int8(q + i, scale + i, code + i, dim - i);
+}
+
+template <bool L2>
+MRPT_TARGET("avx2,fma,f16c")
+float avx2_distance_float16(const float *q, const uint16_t *x, int dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i)));
+        const __m256 x1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i + 8)));
+        acc0 = avx2_term<L2>(acc0, _mm256_loadu_ps(q + i), x0);
+        acc1 = avx2_term<L2>(acc1, _mm256_loadu_ps(q + i + 8), x1);
+    }
+    for (; i + 8 <= dim; i += 8)
+        acc0 = avx2_term<L2>(acc0, _mm256_loadu_ps(q + i),
+                               _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i))));
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + scalar_distance_float16<L2>(q + i, x + i, dim - i);
+}
+
+MRPT_TARGET("avx2,fma")
+float avx2_dot_int8(const float *q, const int8_t *code, int dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(c)), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8),
+                               _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(c, 8))), acc1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        const __m128i c = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(code + i));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(c)), acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + scalar_dot_int8(q + i, code + i, dim - i);
+}
+
+MRPT_TARGET("avx2,fma")
+float avx2_gather_sum(const float *q, const int *columns, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(columns + i));
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(q, c, 4));
+    }
+    return hsum_avx2(acc) + scalar_gather_sum(q, columns + i, n - i);
+}
+
+MRPT_TARGET("avx2,fma")
+float avx2_gather_dot(const float *q, const int *columns, const float *values, int n) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(columns + i));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(values + i), _mm256_i32gather_ps(q, c, 4), acc);
+    }
+    return hsum_avx2(acc) + scalar_gather_dot(q, columns + i, values + i, n - i);
+}
+
+MRPT_TARGET("avx512f")
+inline float hsum_avx512(__m512 v) {
+    const __m256 lo = _mm512_castps512_ps256(v);
+    const __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+    const __m256 sum8 = _mm256_add_ps(lo, hi);
+    const __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+    __m128 shuf = _mm_movehl_ps(sum, sum);
+    __m128 sums = _mm_add_ps(sum, shuf);
+    shuf = _mm_shuffle_ps(sums, sums, 1);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+template <bool L2>
+MRPT_TARGET("avx512f")
+inline __m512 avx512_term(__m512 acc, __m512 a, __m512 b) {
+    if (L2) {
+        const __m512 d = _mm512_sub_ps(a, b);
+        return _mm512_fmadd_ps(d, d, acc);
+    }
+    return _mm512_fmadd_ps(a, b, acc);
+}
+
+/*
+* The AVX-512 kernels handle the tail with a masked load instead of a scalar
+* loop.
+*/
+template <bool L2>
+MRPT_TARGET("avx512f")
+float avx512_distance(const float *a, const float *b, int dim) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        acc0 = avx512_term<L2>(acc0, _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc1 = avx512_term<L2>(acc1, _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+    }
+    for (; i + 16 <= dim; i += 16)
+        acc0 = avx512_term<L2>(acc0, _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    if (i < dim) {
+        const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        acc1 = avx512_term<L2>(acc1, _mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+    }
+    return hsum_avx512(_mm512_add_ps(acc0, acc1));
+}
+
+template <bool L2>
+MRPT_TARGET("avx512f")
+void avx512_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m512 qv = _mm512_loadu_ps(q + i);
+        acc0 = avx512_term<L2>(acc0, qv, _mm512_loadu_ps(x[0] + i));
+        acc1 = avx512_term<L2>(acc1, qv, _mm512_loadu_ps(x[1] + i));
+        acc2 = avx512_term<L2>(acc2, qv, _mm512_loadu_ps(x[2] + i));
+        acc3 = avx512_term<L2>(acc3, qv, _mm512_loadu_ps(x[3] + i));
+    }
+    if (i < dim) {
+        const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+        const __m512 qv = _mm512_maskz_loadu_ps(mask, q + i);
+        acc0 = avx512_term<L2>(acc0, qv, _mm512_maskz_loadu_ps(mask, x[0] + i));
+        acc1 = avx512_term<L2>(acc1, qv, _mm512_maskz_loadu_ps(mask, x[1] + i));
+        acc2 = avx512_term<L2>(acc2, qv, _mm512_maskz_loadu_ps(mask, x[2] + i));
+        acc3 = avx512_term<L2>(acc3, qv, _mm512_maskz_loadu_ps(mask, x[3] + i));
+    }
+    out[0] = hsum_avx512(acc0);
+    out[1] = hsum_avx512(acc1);
+    out[2] = hsum_avx512(acc2);
+    out[3] = hsum_avx512(acc3);
+}
+
+MRPT_TARGET("avx512f")
+float avx512_distance_int8(const float *q, const float *scale, const uint8_t *code, int dim) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        const __m512 c0 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i))));
+        const __m512 c1 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i + 16))));
+        const __m512 d0 = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i), c0, _mm512_loadu_ps(q + i));
+        const __m512 d1 = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i + 16), c1, _mm512_loadu_ps(q + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+        const __m512 d = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i), _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(c)),
+                                          _mm512_loadu_ps(q + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    return hsum_avx512(_mm512_add_ps(acc0, acc1)) + scalar_distance_int8(q + i, scale + i, code + i, dim - i);
+}
+
+template <bool L2>
+MRPT_TARGET("avx512f")
+float avx512_distance_float16(const float *q, const uint16_t *x, int dim) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16)
+        acc = avx512_term<L2>(acc, _mm512_loadu_ps(q + i),
+                                _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i))));
+    return hsum_avx512(acc) + scalar_distance_float16<L2>(q + i, x + i, dim - i);
+}
+
+MRPT_TARGET("avx512f")
+float avx512_dot_int8(const float *q, const int8_t *code, int dim) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(c)), acc);
+    }
+    return hsum_avx512(acc) + scalar_dot_int8(q + i, code + i, dim - i);
+}
+
+MRPT_TARGET("avx512f")
+float avx512_gather_sum(const float *q, const int *columns, int n) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        acc = _mm512_add_ps(acc, _mm512_i32gather_ps(_mm512_loadu_si512(columns + i), q, 4));
+    return hsum_avx512(acc) + scalar_gather_sum(q, columns + i, n - i);
+}
+
+MRPT_TARGET("avx512f")
+float avx512_gather_dot(const float *q, const int *columns, const float *values, int n) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(values + i), _mm512_i32gather_ps(_mm512_loadu_si512(columns + i), q, 4),
+                              acc);
+    return hsum_avx512(acc) + scalar_gather_dot(q, columns + i, values + i, n - i);
+}
+
+MRPT_TARGET("avx512f,avx512vpopcntdq")
+inline int avx512_hamming(const uint64_t *a, const uint64_t *b, int words) {
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 8 <= words; i += 8)
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                                                          _mm512_loadu_si512(b + i))));
+    if (i < words) {
+        const __mmask8 mask = (__mmask8) ((1u << (words - i)) - 1);
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, a + i),
+                                                                          _mm512_maskz_loadu_epi64(mask, b + i))));
+    }
+    return (int) _mm512_reduce_add_epi64(acc);
+}
+
+/*
+* The routing kernels descend 8 (AVX2) or 16 (AVX-512) trees in lockstep: each
+* level gathers the split point of the current node and the projection of the
+* level in every lane, and moves the lanes where the projection is not below
+* the split to the right child. The remaining trees are descended one by one.
+*/
+inline void scalar_route(const float *projected, const float *split, int first, int n_trees, int depth, int stride,
+                         int *leaves) {
+    for (int t = first; t < n_trees; ++t) {
+        const float *s = split + (size_t) t * stride, *p = projected + (size_t) t * depth;
+        int idx = 0;
+        for (int d = 0; d < depth; ++d)
+            idx = 2 * idx + 2 - (p[d] <= s[idx]);
+        leaves[t] = idx - (1 << depth) + 1;
+    }
+}
+
+MRPT_TARGET("avx2")
+inline void avx2_route(const float *projected, const float *split, int n_trees, int depth, int stride, int *leaves) {
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i split_lanes = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(stride));
+    const __m256i one = _mm256_set1_epi32(1), first_leaf = _mm256_set1_epi32((1 << depth) - 1);
+    int t = 0;
+    for (; t + 8 <= n_trees; t += 8) {
+        const float *s = split + (size_t) t * stride, *p = projected + (size_t) t * depth;
+        __m256i level = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(depth)), idx = _mm256_setzero_si256();
+        for (int d = 0; d < depth; ++d) {
+            const __m256 split_point = _mm256_i32gather_ps(s, _mm256_add_epi32(split_lanes, idx), 4);
+            const __m256 projection = _mm256_i32gather_ps(p, level, 4);
+            // all ones, -1, in the lanes going right
+            const __m256i right = _mm256_castps_si256(_mm256_cmp_ps(projection, split_point, _CMP_NLE_UQ));
+            idx = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(idx, idx), one), right);
+            level = _mm256_add_epi32(level, one);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(leaves + t), _mm256_sub_epi32(idx, first_leaf));
+    }
+    scalar_route(projected, split, t, n_trees, depth, stride, leaves);
+}
+
+MRPT_TARGET("avx2")
+inline const uint32_t *avx2_unpack_ids(const uint32_t *words, int n, int *out) {
+    const int width = words[1];
+    if (!width)
+        return scalar_unpack_ids(words, n, out);
+    const __m256i mask = _mm256_set1_epi32(width < 32 ? (1u << width) - 1 : ~0u), last = _mm256_set1_epi32(7);
+    const uint32_t *lanes = words + 2;
+    __m256i id = _mm256_set1_epi32(words[0]);
+    for (int row = 0; row < (n + 7) / 8; ++row) {
+        const int bit = row * width, w = bit / 32, shift = bit % 32;
+        __m256i x = _mm256_srl_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(lanes + 8 * w)),
+                                     _mm_cvtsi32_si128(shift));
+        if (shift + width > 32)
+            x = _mm256_or_si256(x, _mm256_sll_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(lanes + 8 * w + 8)),
+                                                    _mm_cvtsi32_si128(32 - shift)));
+        x = _mm256_and_si256(x, mask);
+        // the prefix sums of the differences in each half, then the sum of the lower half added to the upper
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        const __m256i low = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(low, low, 0x08));
+        id = _mm256_add_epi32(x, id);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 8 * row), id);
+        id = _mm256_permutevar8x32_epi32(id, last);
+    }
+    return words + packed_words(n, width);
+}
+
+MRPT_TARGET("avx512f")
+inline void avx512_route(const float *projected, const float *split, int n_trees, int depth, int stride, int *leaves) {
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i split_lanes = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(stride));
+    const __m512i one = _mm512_set1_epi32(1), first_leaf = _mm512_set1_epi32((1 << depth) - 1);
+    int t = 0;
+    for (; t + 16 <= n_trees; t += 16) {
+        const float *s = split + (size_t) t * stride, *p = projected + (size_t) t * depth;
+        __m512i level = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(depth)), idx = _mm512_setzero_si512();
+        for (int d = 0; d < depth; ++d) {
+            const __m512 split_point = _mm512_i32gather_ps(_mm512_add_epi32(split_lanes, idx), s, 4);
+            const __m512 projection = _mm512_i32gather_ps(level, p, 4);
+            const __mmask16 right = _mm512_cmp_ps_mask(projection, split_point, _CMP_NLE_UQ);
+            idx = _mm512_add_epi32(_mm512_add_epi32(idx, idx), one);
+            idx = _mm512_mask_add_epi32(idx, right, idx, one);
+            level = _mm512_add_epi32(level, one);
+        }
+        _mm512_storeu_si512(leaves + t, _mm512_sub_epi32(idx, first_leaf));
+    }
+    scalar_route(projected, split, t, n_trees, depth, stride, leaves);
+}
+
+/*
+* Instruction sets supported by both the CPU and the operating system.
+*/
+inline bool cpu_has_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 1);
+    const bool fma = regs[2] & (1 << 12), osxsave = regs[2] & (1 << 27), f16c = regs[2] & (1 << 29);
+    if (!fma || !osxsave || !f16c || (_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(regs, 7, 0);
+    return regs[1] & (1 << 5);
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+#endif
+}
+
+inline bool cpu_has_avx512() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 1);
+    if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 0xe6) != 0xe6) return false;
+    __cpuidex(regs, 7, 0);
+    return regs[1] & (1 << 16);
+#else
+    return __builtin_cpu_supports("avx512f");
+#endif
+}
+
+inline bool cpu_has_avx512_vpopcntdq() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuidex(regs, 7, 0);
+    return cpu_has_avx512() && (regs[2] & (1 << 14));
+#else
+    return cpu_has_avx512() && __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+}
+
+inline bool cpu_has_sse42() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 1);
+    return regs[2] & (1 << 20);
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif // MRPT_KERNELS_X86
+
+#ifdef MRPT_KERNELS_NEON
+
+template <bool L2>
+inline float32x4_t neon_term(float32x4_t acc, float32x4_t a, float32x4_t b) {
+    if (L2) {
+        const float32x4_t d = vsubq_f32(a, b);
+        return vfmaq_f32(acc, d, d);
+    }
+    return vfmaq_f32(acc, a, b);
+}
+
+template <bool L2>
+inline float neon_distance(const float *a, const float *b, int dim) {
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = neon_term<L2>(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = neon_term<L2>(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= dim; i += 4)
+        acc0 = neon_term<L2>(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    return vaddvq_f32(vaddq_f32(acc0, acc1)) + scalar_tail<L2>(a, b, i, dim);
+}
+
+template <bool L2>
+inline void neon_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    float32x4_t acc2 = vdupq_n_f32(0), acc3 = vdupq_n_f32(0);
+    int i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const float32x4_t qv = vld1q_f32(q + i);
+        acc0 = neon_term<L2>(acc0, qv, vld1q_f32(x[0] + i));
+        acc1 = neon_term<L2>(acc1, qv, vld1q_f32(x[1] + i));
+        acc2 = neon_term<L2>(acc2, qv, vld1q_f32(x[2] + i));
+        acc3 = neon_term<L2>(acc3, qv, vld1q_f32(x[3] + i));
+    }
+    out[0] = vaddvq_f32(acc0) + scalar_tail<L2>(q, x[0], i, dim);
+    out[1] = vaddvq_f32(acc1) + scalar_tail<L2>(q, x[1], i, dim);
+    out[2] = vaddvq_f32(acc2) + scalar_tail<L2>(q, x[2], i, dim);
+    out[3] = vaddvq_f32(acc3) + scalar_tail<L2>(q, x[3], i, dim);
+}
+
+inline int neon_hamming(const uint64_t *a, const uint64_t *b, int words) {
+    // the byte counts of two words are at most 128 and fit in a byte when summed
+    uint32_t count = 0;
+    int i = 0;
+    for (; i + 2 <= words; i += 2)
+        count += vaddvq_u8(vcntq_u8(vreinterpretq_u8_u64(veorq_u64(vld1q_u64(a + i), vld1q_u64(b + i)))));
+    if (i < words)
+        count += scalar_hamming(a + i, b + i, 1);
+    return (int) count;
+}
+
+#endif // MRPT_KERNELS_NEON
+
+/*
+* Kernels for vectors of exactly Dim floats, a multiple of 32, whose loops the
+* compiler unrolls completely. Given any other dim, they fall back on the
+* kernels of the same instruction set for any dimension, so they are also
+* correct for the partial vectors of the leading and abandoned dimensions.
+*/
+#ifdef MRPT_KERNELS_X86
+
+template <bool L2, int Dim>
+MRPT_TARGET("avx2,fma")
+float avx2_fixed_distance(const float *a, const float *b, int dim) {
+    if (dim != Dim)
+        return avx2_distance<L2>(a, b, dim);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 16) {
+        acc0 = avx2_term<L2>(acc0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc1 = avx2_term<L2>(acc1, _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1));
+}
+
+template <bool L2, int Dim>
+MRPT_TARGET("avx2,fma")
+void avx2_fixed_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    if (dim != Dim)
+        return avx2_distance_4<L2>(q, x, dim, out);
+    // eight accumulators and two rows of the query take ten of the sixteen registers
+    const float *x0 = x[0], *x1 = x[1], *x2 = x[2], *x3 = x[3];
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    __m256 b0 = _mm256_setzero_ps(), b1 = _mm256_setzero_ps(), b2 = _mm256_setzero_ps(), b3 = _mm256_setzero_ps();
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 16) {
+        const __m256 q0 = _mm256_loadu_ps(q + i), q1 = _mm256_loadu_ps(q + i + 8);
+        a0 = avx2_term<L2>(a0, q0, _mm256_loadu_ps(x0 + i));
+        a1 = avx2_term<L2>(a1, q0, _mm256_loadu_ps(x1 + i));
+        a2 = avx2_term<L2>(a2, q0, _mm256_loadu_ps(x2 + i));
+        a3 = avx2_term<L2>(a3, q0, _mm256_loadu_ps(x3 + i));
+        b0 = avx2_term<L2>(b0, q1, _mm256_loadu_ps(x0 + i + 8));
+        b1 = avx2_term<L2>(b1, q1, _mm256_loadu_ps(x1 + i + 8));
+        b2 = avx2_term<L2>(b2, q1, _mm256_loadu_ps(x2 + i + 8));
+        b3 = avx2_term<L2>(b3, q1, _mm256_loadu_ps(x3 + i + 8));
+    }
+    out[0] = hsum_avx2(_mm256_add_ps(a0, b0));
+    out[1] = hsum_avx2(_mm256_add_ps(a1, b1));
+    out[2] = hsum_avx2(_mm256_add_ps(a2, b2));
+    out[3] = hsum_avx2(_mm256_add_ps(a3, b3));
+}
+
+template <bool L2, int Dim>
+MRPT_TARGET("avx512f")
+float avx512_fixed_distance(const float *a, const float *b, int dim) {
+    if (dim != Dim)
+        return avx512_distance<L2>(a, b, dim);
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 32) {
+        acc0 = avx512_term<L2>(acc0, _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc1 = avx512_term<L2>(acc1, _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+    }
+    return hsum_avx512(_mm512_add_ps(acc0, acc1));
+}
+
+template <bool L2, int Dim>
+MRPT_TARGET("avx512f")
+void avx512_fixed_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    if (dim != Dim)
+        return avx512_distance_4<L2>(q, x, dim, out);
+    const float *x0 = x[0], *x1 = x[1], *x2 = x[2], *x3 = x[3];
+    __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+    __m512 b0 = _mm512_setzero_ps(), b1 = _mm512_setzero_ps(), b2 = _mm512_setzero_ps(), b3 = _mm512_setzero_ps();
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 32) {
+        const __m512 q0 = _mm512_loadu_ps(q + i), q1 = _mm512_loadu_ps(q + i + 16);
+        a0 = avx512_term<L2>(a0, q0, _mm512_loadu_ps(x0 + i));
+        a1 = avx512_term<L2>(a1, q0, _mm512_loadu_ps(x1 + i));
+        a2 = avx512_term<L2>(a2, q0, _mm512_loadu_ps(x2 + i));
+        a3 = avx512_term<L2>(a3, q0, _mm512_loadu_ps(x3 + i));
+        b0 = avx512_term<L2>(b0, q1, _mm512_loadu_ps(x0 + i + 16));
+        b1 = avx512_term<L2>(b1, q1, _mm512_loadu_ps(x1 + i + 16));
+        b2 = avx512_term<L2>(b2, q1, _mm512_loadu_ps(x2 + i + 16));
+        b3 = avx512_term<L2>(b3, q1, _mm512_loadu_ps(x3 + i + 16));
+    }
+    out[0] = hsum_avx512(_mm512_add_ps(a0, b0));
+    out[1] = hsum_avx512(_mm512_add_ps(a1, b1));
+    out[2] = hsum_avx512(_mm512_add_ps(a2, b2));
+    out[3] = hsum_avx512(_mm512_add_ps(a3, b3));
+}
+
+#endif // MRPT_KERNELS_X86
+
+#ifdef MRPT_KERNELS_NEON
+
+template <bool L2, int Dim>
+float neon_fixed_distance(const float *a, const float *b, int dim) {
+    if (dim != Dim)
+        return neon_distance<L2>(a, b, dim);
+    float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 8) {
+        acc0 = neon_term<L2>(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = neon_term<L2>(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1));
+}
+
+template <bool L2, int Dim>
+void neon_fixed_distance_4(const float *q, const float *const *x, int dim, float *out) {
+    if (dim != Dim)
+        return neon_distance_4<L2>(q, x, dim, out);
+    const float *x0 = x[0], *x1 = x[1], *x2 = x[2], *x3 = x[3];
+    float32x4_t a0 = vdupq_n_f32(0), a1 = vdupq_n_f32(0), a2 = vdupq_n_f32(0), a3 = vdupq_n_f32(0);
+    float32x4_t b0 = vdupq_n_f32(0), b1 = vdupq_n_f32(0), b2 = vdupq_n_f32(0), b3 = vdupq_n_f32(0);
+    MRPT_UNROLL
+    for (int i = 0; i < Dim; i += 8) {
+        const float32x4_t q0 = vld1q_f32(q + i), q1 = vld1q_f32(q + i + 4);
+        a0 = neon_term<L2>(a0, q0, vld1q_f32(x0 + i));
+        a1 = neon_term<L2>(a1, q0, vld1q_f32(x1 + i));
+        a2 = neon_term<L2>(a2, q0, vld1q_f32(x2 + i));
+        a3 = neon_term<L2>(a3, q0, vld1q_f32(x3 + i));
+        b0 = neon_term<L2>(b0, q1, vld1q_f32(x0 + i + 4));
+        b1 = neon_term<L2>(b1, q1, vld1q_f32(x1 + i + 4));
+        b2 = neon_term<L2>(b2, q1, vld1q_f32(x2 + i + 4));
+        b3 = neon_term<L2>(b3, q1, vld1q_f32(x3 + i + 4));
+    }
+    out[0] = vaddvq_f32(vaddq_f32(a0, b0));
+    out[1] = vaddvq_f32(vaddq_f32(a1, b1));
+    out[2] = vaddvq_f32(vaddq_f32(a2, b2));
+    out[3] = vaddvq_f32(vaddq_f32(a3, b3));
+}
+
+#endif // MRPT_KERNELS_NEON
+
+/*
+* Returns kernels with the float distances of kernels replaced by those of
+* the same instruction set for Dim floats. The scalar and SSE kernels are
+* kept, as eight accumulators do not leave SSE enough registers to be faster.
+*/
+template <int Dim>
+inline DistanceKernels fixed_kernels(DistanceKernels kernels) {
+    static_assert(Dim % 32 == 0, "the fixed kernels read 32 floats per iteration");
+#if defined(MRPT_KERNELS_X86)
+    if (!std::strcmp(kernels.name, "avx2")) {
+        kernels.l2 = avx2_fixed_distance<true, Dim>;
+        kernels.l2_4 = avx2_fixed_distance_4<true, Dim>;
+        kernels.dot = avx2_fixed_distance<false, Dim>;
+        kernels.dot_4 = avx2_fixed_distance_4<false, Dim>;
+    } else if (!std::strcmp(kernels.name, "avx512")) {
+        kernels.l2 = avx512_fixed_distance<true, Dim>;
+        kernels.l2_4 = avx512_fixed_distance_4<true, Dim>;
+        kernels.dot = avx512_fixed_distance<false, Dim>;
+        kernels.dot_4 = avx512_fixed_distance_4<false, Dim>;
+    }
+#elif defined(MRPT_KERNELS_NEON)
+    if (!std::strcmp(kernels.name, "neon")) {
+        kernels.l2 = neon_fixed_distance<true, Dim>;
+        kernels.l2_4 = neon_fixed_distance_4<true, Dim>;
+        kernels.dot = neon_fixed_distance<false, Dim>;
+        kernels.dot_4 = neon_fixed_distance_4<false, Dim>;
+    }
+#endif
+    return kernels;
+}
+
+/*
+* Hints the CPU to start loading the given number of bytes starting at p
+* into the cache.
+*/
+inline void prefetch(const void *p, int bytes) {
+    const char *c = static_cast<const char *>(p);
+    for (int i = 0; i < bytes; i += 64) {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(c + i, 0, 3);
+#elif defined(MRPT_KERNELS_X86)
+        _mm_prefetch(c + i, _MM_HINT_T0);
+#endif
+    }
+}
+
+/*
+* The tables of CRC-32C (the reflected polynomial 0x82f63b78) for eight bytes
+* at a time: entry k of a byte is its CRC followed by k zero bytes.
+*/
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; ++k)
+            for (int i = 0; i < 256; ++i)
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+    }
+};
+
+inline uint32_t scalar_crc32c(uint32_t crc, const uint8_t *p, size_t bytes) {
+    static const Crc32cTables tables;
+    const uint32_t (*t)[256] = tables.table;
+    for (; bytes >= 8; p += 8, bytes -= 8) {
+        const uint32_t low = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; bytes; ++p, --bytes)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+    return crc;
+}
+
+#ifdef MRPT_KERNELS_X86
+MRPT_TARGET("sse4.2")
+inline uint32_t sse42_crc32c(uint32_t crc, const uint8_t *p, size_t bytes) {
+    uint64_t crc64 = crc;
+    for (; bytes >= 8; p += 8, bytes -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+    for (; bytes; ++p, --bytes)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+/*
+* Returns the CRC-32C of bytes at data, continuing from the CRC crc of the
+* bytes before them, so crc32c(crc32c(0, a, n), b, m) is the CRC of a followed
+* by b.
+*/
+inline uint32_t crc32c(uint32_t crc, const void *data, size_t bytes) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+#ifdef MRPT_KERNELS_X86
+    static const bool sse42 = cpu_has_sse42();
+    if (sse42)
+        return ~sse42_crc32c(~crc, p, bytes);
+#endif
+    return ~scalar_crc32c(~crc, p, bytes);
+}
+
+/*
+* Chooses the kernels once per process: the instruction set named by
+* MRPT_SIMD if the CPU supports it, otherwise the widest supported one.
+*/
+inline DistanceKernels select_distance_kernels() {
+    const int max_kernels = 4;
+    DistanceKernels supported[max_kernels] = {
+        {"scalar", scalar_distance<true>, scalar_distance_4<true>, scalar_distance<false>, scalar_distance_4<false>,
+         scalar_distance_int8, scalar_distance_float16<true>, scalar_distance_float16<false>, scalar_dot_int8,
+         scalar_gather_sum, scalar_gather_dot, nullptr, scalar_hamming, scalar_unpack_ids}
+    };
+    int n_supported = 1;
+
+#if defined(MRPT_KERNELS_X86)
+    const DistanceKernels sse = {"sse", sse_distance<true>, sse_distance_4<true>,
+                                 sse_distance<false>, sse_distance_4<false>,
+                                 sse_distance_int8, scalar_distance_float16<true>, scalar_distance_float16<false>,
+                                 scalar_dot_int8, scalar_gather_sum, scalar_gather_dot, nullptr, scalar_hamming,
+                                 scalar_unpack_ids};
+    const DistanceKernels avx2 = {"avx2", avx2_distance<true>, avx2_distance_4<true>,
+                                  avx2_distance<false>, avx2_distance_4<false>,
+                                  avx2_distance_int8, avx2_distance_float16<true>, avx2_distance_float16<false>,
+                                  avx2_dot_int8, avx2_gather_sum, avx2_gather_dot, avx2_route, popcnt_hamming,
+                                  avx2_unpack_ids};
+    const DistanceKernels avx512 = {"avx512", avx512_distance<true>, avx512_distance_4<true>,
+                                    avx512_distance<false>, avx512_distance_4<false>,
+                                    avx512_distance_int8, avx512_distance_float16<true>,
+                                    avx512_distance_float16<false>, avx512_dot_int8, avx512_gather_sum,
+                                    avx512_gather_dot, avx512_route,
+                                    cpu_has_avx512_vpopcntdq() ? avx512_hamming : popcnt_hamming,
+                                    avx2_unpack_ids};
+    supported[n_supported++] = sse;
+    if (cpu_has_avx2()) supported[n_supported++] = avx2;
+    if (cpu_has_avx512()) supported[n_supported++] = avx512;
+#elif defined(MRPT_KERNELS_NEON)
+    const DistanceKernels neon = {"neon", neon_distance<true>, neon_distance_4<true>,
+                                  neon_distance<false>, neon_distance_4<false>,
+                                  scalar_distance_int8, scalar_distance_float16<true>, scalar_distance_float16<false>,
+                                  scalar_dot_int8, scalar_gather_sum, scalar_gather_dot, nullptr, neon_hamming,
+                                  scalar_unpack_ids};
+    supported[n_supported++] = neon;
+#endif
+
+    const char *forced = std::getenv("MRPT_SIMD");
+    for (int i = 0; forced && i < n_supported; ++i) {
+        if (!std::strcmp(forced, supported[i].name)) return supported[i];
+    }
+    return supported[n_supported - 1];
+}
+
+inline const DistanceKernels &distance_kernels() {
+    static const DistanceKernels kernels = select_distance_kernels();
+    return kernels;
+}
+
+/*
+* The dimensions that have kernels of their own: those of common embeddings
+* and image descriptors, such as the 96 of Deep1B, the 128 of SIFT, the 384
+* and 768 of sentence embeddings and the 960 of GIST.
+*/
+const int fixed_dimensions[] = {96, 128, 384, 768, 960};
+
+/*
+* Returns the kernels for vectors of dim floats: those compiled for dim if it
+* is one of fixed_dimensions, otherwise the same as distance_kernels().
+*/
+inline const DistanceKernels &distance_kernels(int dim) {
+    switch (dim) {
+    case 96: { static const DistanceKernels kernels = fixed_kernels<96>(distance_kernels()); return kernels; }
+    case 128: { static const DistanceKernels kernels = fixed_kernels<128>(distance_kernels()); return kernels; }
+    case 384: { static const DistanceKernels kernels = fixed_kernels<384>(distance_kernels()); return kernels; }
+    case 768: { static const DistanceKernels kernels = fixed_kernels<768>(distance_kernels()); return kernels; }
+    case 960: { static const DistanceKernels kernels = fixed_kernels<960>(distance_kernels()); return kernels; }
+    default: return distance_kernels();
+    }
+}
+
+} // namespace mrpt_kernels
+
+#endif // CPP_MRPT_KERNELS_H_
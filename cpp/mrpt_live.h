@@ -0,0 +1,562 @@
+#ifndef CPP_MRPT_LIVE_H_
+#define CPP_MRPT_LIVE_H_
+
+/*
+ * An index that takes inserts while it is being queried, without locks on the
+ * read path. A LiveIndex is an Mrpt index built over the points it had at its
+ * last compaction, the base, and a delta of the points inserted since. The
+ * delta keeps the ids of its points in append-only lists, one for each leaf
+ * of each tree of the base, and their vectors in chunks that never move.
+ *
+ * A single writer appends to the lists and publishes them in the manner of
+ * RCU. A list that is full is copied into one twice its size, the copy
+ * replaces it, and the old list is freed only once no query can still be
+ * reading it. An EpochDomain tracks those queries. The writer makes an
+ * inserted point visible only after it is in the lists of all trees, so a
+ * query sees a consistent snapshot of the delta. Queries never take a mutex.
+ * They may run concurrently with each other, with insert and with compact.
+ *
+ * Once the delta grows to a fraction of the base, the writer builds a new
+ * base over all the points and publishes it with an empty delta. The old
+ * base serves the queries in flight until they finish. Inserts wait for a
+ * compaction, but queries do not. A query answers from the base index as
+ * Mrpt::query does. It also elects the delta points with votes_required
+ * votes in the leaves of the query, scores them exactly and merges them in.
+ *
+ * save_snapshot persists the index while it keeps serving and taking inserts.
+ * The base of a generation and the delta points written so far never change,
+ * so the snapshot records only the generation and the chunks of the delta at
+ * the time of the call, and a thread of its own writes them out. A compaction
+ * during the save keeps the old generation alive until the save is done, so a
+ * save holds on to at most one generation besides the current one.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Mrpt.h"
+#include "mrpt_data.h"
+
+namespace mrpt_live {
+
+/*
+* Epoch-based reclamation: readers mark themselves in the current epoch for as
+* long as they use shared objects, and a writer that has unpublished an object
+* waits with synchronize until every reader that could have seen it has left
+* before freeing it. The readers are counted in shards, padded to cache lines
+* of their own, so concurrent readers rarely write the same line. Entering and
+* leaving are a few atomic operations and never block.
+*/
+class EpochDomain {
+ public:
+    EpochDomain() : epoch(0), shards(new Shard[n_shards]) { }
+
+    EpochDomain(const EpochDomain &) = delete;
+    EpochDomain &operator=(const EpochDomain &) = delete;
+
+    /*
+    * Marks the calling thread as a reader from construction to destruction.
+    */
+    class Guard {
+     public:
+        explicit Guard(const EpochDomain &domain_) : domain(domain_), shard(thread_shard()) {
+            for (;;) {
+                parity = domain.epoch.load() & 1;
+                domain.shards[shard].readers[parity].fetch_add(1);
+                // a writer may have moved on between the two loads; then enter its epoch instead
+                if ((domain.epoch.load() & 1) == parity)
+                    break;
+                domain.shards[shard].readers[parity].fetch_sub(1);
+            }
+        }
+
+        ~Guard() {
+            domain.shards[shard].readers[parity].fetch_sub(1, std::memory_order_release);
+        }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+     private:
+        const EpochDomain &domain;
+        int shard, parity;
+    };
+
+    /*
+    * Waits until every reader that entered before the call has left, so that
+    * the objects unpublished before the call can be freed. Called by one
+    * writer at a time.
+    */
+    void synchronize() {
+        // two flips, as a reader entering during the first one may count in either parity
+        for (int flip = 0; flip < 2; ++flip) {
+            const int parity = epoch.fetch_add(1) & 1;
+            for (int s = 0; s < n_shards; ++s)
+                while (shards[s].readers[parity].load() > 0)
+                    std::this_thread::yield();
+        }
+    }
+
+ private:
+    static const int n_shards = 64;
+
+    struct Shard {
+        std::atomic<int64_t> readers[2] = {{0}, {0}}; // the readers in the even and odd epochs
+        char padding[64];
+    };
+
+    std::atomic<uint64_t> epoch;
+    std::unique_ptr<Shard[]> shards;
+
+    static int thread_shard() {
+        static std::atomic<int> next(0);
+        static thread_local int shard = next.fetch_add(1) % n_shards;
+        return shard;
+    }
+};
+
+class LiveIndex {
+ public:
+    /*
+    * Builds an index over a copy of n points of dimension dim stored one after
+    * another in data. The parameters are those of the Mrpt constructor, and
+    * every compaction builds the new base with them.
+    * @param compact_fraction - The size of the delta relative to the base at
+    * which insert compacts the index
+    */
+    LiveIndex(const float *data, int dim_, int n, int n_trees_, int depth_, float density_, unsigned seed_ = 0,
+              Mrpt::Metric metric_ = Mrpt::EUCLIDEAN, double compact_fraction_ = 0.125) :
+        dim(dim_), n_trees(n_trees_), depth(depth_), density(density_), seed(seed_), metric(metric_),
+        compact_fraction(compact_fraction_), current(nullptr) {
+        std::vector<float> points(data, data + (size_t) dim * n);
+        current.store(build(std::move(points)));
+    }
+
+    ~LiveIndex() {
+        wait_snapshot();
+        delete current.load();
+    }
+
+    /*
+    * Opens a snapshot written by save_snapshot: loads the base index from
+    * index_path over the first points of data_path, and inserts the points
+    * after them, the delta when the snapshot was taken, as insert does. The
+    * parameters of the index are read from index_path.
+    * @return The index, or nullptr if the files cannot be read or do not match
+    */
+    static std::unique_ptr<LiveIndex> load_snapshot(const char *data_path, const char *index_path,
+                                                    double compact_fraction = 0.125) {
+        Mrpt::IndexFileInfo info;
+        if (!Mrpt::read_file_info(index_path, info))
+            return nullptr;
+        FILE *fd = std::fopen(data_path, "rb");
+        if (!fd)
+            return nullptr;
+        mrpt_data::DataFileHeader header;
+        std::vector<float> points;
+        bool ok = mrpt_data::read_header(fd, header) == 1 && header.dim == info.dim && header.n >= info.n_samples;
+        if (ok) {
+            points.resize((size_t) header.n * header.dim);
+            ok = std::fread(points.data(), sizeof(float), points.size(), fd) == points.size();
+        }
+        std::fclose(fd);
+        if (!ok)
+            return nullptr;
+
+        std::unique_ptr<LiveIndex> live(new LiveIndex(info, compact_fraction));
+        const std::vector<float> delta(points.begin() + (size_t) info.n_samples * info.dim, points.end());
+        points.resize((size_t) info.n_samples * info.dim);
+        live->current.store(live->build(std::move(points), index_path));
+        if (!live->current.load())
+            return nullptr;
+        live->insert(delta.data(), delta.size() / info.dim);
+        return live;
+    }
+
+    LiveIndex(const LiveIndex &) = delete;
+    LiveIndex &operator=(const LiveIndex &) = delete;
+
+    /*
+    * Appends n points stored one after another in points, which get the ids
+    * size(), size() + 1, ... in order. Each point is routed to its leaves
+    * with the split points of the base, and is visible to the queries that
+    * start after it is in all of them. Compacts the index once the delta
+    * holds more than compact_fraction of the points of the base. Inserts are
+    * serialized with each other and with compact.
+    */
+    void insert(const float *points, int n) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        Generation &g = *current.load(std::memory_order_relaxed);
+        const int n_leaves = 1 << depth, block = 1024;
+        for (int first = 0; first < n; first += block) {
+            const int m = std::min(block, n - first);
+            const Map<const MatrixXf> P(points + (size_t) first * dim, dim, m);
+            const MatrixXi leaves = g.index->find_point_leaves(P);
+            for (int i = 0; i < m; ++i) {
+                const int id = g.n_delta;
+                store_point(g, id, P.col(i).data());
+                for (int n_tree = 0; n_tree < n_trees; ++n_tree)
+                    append(g.leaves[n_tree * n_leaves + leaves(n_tree, i)], id);
+                ++g.n_delta;
+                g.n_visible.store(g.n_delta, std::memory_order_release);
+            }
+        }
+        reclaim();
+        if (g.n_delta > compact_fraction * g.n_base)
+            compact_locked();
+    }
+
+    /*
+    * Builds a new base over all the points, and publishes it with an empty
+    * delta. The queries keep running on the old base meanwhile, and it is
+    * freed once the last of them has finished.
+    */
+    void compact() {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        compact_locked();
+    }
+
+    /*
+    * Starts saving the points visible now to the data file data_path, in the
+    * format of mrpt_data.h, and the base index to index_path, as Mrpt::save
+    * writes it, on a thread of its own, and returns at once. Queries, inserts
+    * and compactions continue meanwhile. The files are written through a
+    * buffer of 4 MB to temporary files next to them, which are renamed over
+    * data_path and index_path when both are complete, so a save that fails or
+    * is interrupted leaves the previous snapshot in place. A save that is
+    * still running is waited for first. Open the files with load_snapshot.
+    */
+    void save_snapshot(const std::string &data_path, const std::string &index_path) {
+        std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+        join_snapshot();
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        const Generation *g = current.load(std::memory_order_relaxed);
+        const int n_delta = g->n_delta;
+        std::vector<const float *> chunks;
+        for (int c = 0; c * chunk_points < n_delta; ++c)
+            chunks.push_back(g->chunks[c].get());
+        pinned = g;
+        snapshot_ok = false;
+        snapshot_thread = std::thread([this, g, n_delta, chunks, data_path, index_path] {
+            const bool ok = write_snapshot(*g, chunks, n_delta, data_path, index_path);
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            pinned = nullptr;
+            retired_generation.reset();
+            snapshot_ok = ok;
+        });
+    }
+
+    /*
+    * Waits for the save started by save_snapshot.
+    * @return True if the snapshot was written, false if it failed or none was started.
+    */
+    bool wait_snapshot() {
+        std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex);
+        join_snapshot();
+        return snapshot_ok;
+    }
+
+    /*
+    * Finds the k approximate nearest neighbors of q among the points visible
+    * when the query starts, as Mrpt::query does, with the same ids and
+    * distances. Lock-free, and can be called from any number of threads
+    * concurrently with everything but the destructor.
+    * @param q - The query, dim floats
+    * @param out - The output buffer of size k, -1 where fewer than k were found
+    * @param out_distances - Output buffer for the distances, or nullptr
+    */
+    void query(const float *q, int k, int votes_required, int *out, float *out_distances = nullptr) const {
+        EpochDomain::Guard guard(epochs);
+        const Generation &g = *current.load(std::memory_order_acquire);
+        const int n_visible = g.n_visible.load(std::memory_order_acquire);
+        const Map<const VectorXf> query_vector(q, dim);
+
+        const VectorXf projected = g.index->project_query(query_vector);
+        std::vector<int> base_ids(k);
+        std::vector<float> base_distances(k);
+        g.index->query_projected(query_vector, projected.data(), k, votes_required, base_ids.data(),
+                                 base_distances.data());
+
+        Mrpt::TopK heap(k);
+        for (int i = 0; i < k && base_ids[i] >= 0; ++i)
+            heap.push(metric == Mrpt::EUCLIDEAN ? base_distances[i] * base_distances[i] : -base_distances[i], base_ids[i]);
+        if (n_visible)
+            score_delta(g, n_visible, q, projected.data(), votes_required, heap);
+
+        const int n_found = heap.extract(out, out_distances);
+        if (out_distances) {
+            for (int i = 0; i < n_found; ++i)
+                out_distances[i] = metric == Mrpt::EUCLIDEAN ? std::sqrt(out_distances[i]) : -out_distances[i];
+        }
+    }
+
+    /*
+    * Returns the number of points visible to the queries.
+    */
+    int size() const {
+        EpochDomain::Guard guard(epochs);
+        const Generation &g = *current.load(std::memory_order_acquire);
+        return g.n_base + g.n_visible.load(std::memory_order_acquire);
+    }
+
+    /*
+    * Returns the number of points in the delta, those inserted since the last
+    * compaction.
+    */
+    int delta_size() const {
+        EpochDomain::Guard guard(epochs);
+        return current.load(std::memory_order_acquire)->n_visible.load(std::memory_order_acquire);
+    }
+
+ private:
+    static const int chunk_points = 1024; // the points of a chunk of delta vectors
+    static const size_t snapshot_buffer_bytes = 4 << 20;
+
+    // the ids of the delta points in a leaf, of which the first size are written
+    struct LeafList {
+        explicit LeafList(int capacity_) : capacity(capacity_), size(0), ids(new int[capacity_]) { }
+        int capacity;
+        std::atomic<int> size;
+        std::unique_ptr<int[]> ids;
+    };
+
+    // the chunks of delta vectors, followed in each chunk by the squared norms of its points
+    struct Directory {
+        explicit Directory(int capacity) : chunks(capacity, nullptr) { }
+        std::vector<const float *> chunks;
+    };
+
+    // a base index with the delta inserted after it was built
+    struct Generation {
+        std::vector<float> data; // the points of the base
+        std::unique_ptr<Mrpt> index;
+        int n_base;
+        int n_lists = 0;
+        std::unique_ptr<std::atomic<LeafList *>[]> leaves; // the delta of leaf j of tree t at t * 2^depth + j
+        std::atomic<Directory *> directory{nullptr};
+        std::atomic<int> n_visible{0}; // the delta points the queries see
+        int n_delta; // the delta points written, known to the writer only
+        std::vector<std::unique_ptr<float[]>> chunks; // owned by the writer, read through directory
+
+        ~Generation() {
+            for (int j = 0; j < n_lists; ++j)
+                delete leaves[j].load();
+            delete directory.load();
+        }
+    };
+
+    int dim, n_trees, depth;
+    float density;
+    unsigned seed;
+    Mrpt::Metric metric;
+    double compact_fraction;
+    std::atomic<Generation *> current;
+    mutable EpochDomain epochs;
+    std::mutex writer_mutex; // serializes the writers, never taken by the queries
+    std::vector<std::unique_ptr<LeafList>> retired_lists; // unpublished, to be freed after synchronize
+    std::vector<std::unique_ptr<Directory>> retired_directories;
+    std::mutex snapshot_mutex; // serializes save_snapshot and wait_snapshot
+    std::thread snapshot_thread;
+    bool snapshot_ok = false; // whether the last snapshot was written, guarded by writer_mutex
+    const Generation *pinned = nullptr; // the generation being saved, guarded by writer_mutex
+    std::unique_ptr<Generation> retired_generation; // compacted while pinned, freed when the save is done
+
+    LiveIndex(const Mrpt::IndexFileInfo &info, double compact_fraction_) :
+        dim(info.dim), n_trees(info.n_trees), depth(info.depth), density(info.density), seed(info.seed),
+        metric(info.metric), compact_fraction(compact_fraction_), current(nullptr) { }
+
+    /*
+    * Makes a generation with an empty delta over points, growing its base index,
+    * or loading it from index_path if given.
+    * @return The generation, or nullptr if the index cannot be loaded
+    */
+    Generation *build(std::vector<float> points, const char *index_path = nullptr) const {
+        std::unique_ptr<Generation> g(new Generation);
+        g->data.swap(points);
+        g->n_base = g->data.size() / dim;
+        g->index.reset(new Mrpt(Mrpt::Data::borrow(g->data.data(), dim, g->n_base), n_trees, depth, density, seed,
+                                Mrpt::GAUSSIAN, metric));
+        if (!index_path)
+            g->index->grow(1);
+        else if (!g->index->load(index_path))
+            return nullptr;
+        g->n_lists = n_trees << depth;
+        g->leaves.reset(new std::atomic<LeafList *>[g->n_lists]);
+        for (int j = 0; j < g->n_lists; ++j)
+            g->leaves[j].store(nullptr);
+        g->directory.store(new Directory(16));
+        g->n_visible.store(0);
+        g->n_delta = 0;
+        return g.release();
+    }
+
+    void compact_locked() {
+        Generation *old = current.load(std::memory_order_relaxed);
+        if (!old->n_delta)
+            return;
+        std::vector<float> points(old->data);
+        points.reserve((size_t) dim * (old->n_base + old->n_delta));
+        for (int id = 0; id < old->n_delta; ++id) {
+            const float *x = old->chunks[id / chunk_points].get() + (size_t) (id % chunk_points) * dim;
+            points.insert(points.end(), x, x + dim);
+        }
+        current.store(build(std::move(points)), std::memory_order_release);
+        epochs.synchronize();
+        if (old == pinned)
+            retired_generation.reset(old);
+        else
+            delete old;
+        retired_lists.clear();
+        retired_directories.clear();
+    }
+
+    void join_snapshot() {
+        if (snapshot_thread.joinable())
+            snapshot_thread.join();
+    }
+
+    /*
+    * Writes the base data of g and the first n_delta points of its delta, in
+    * chunks, to data_path, and the base index to index_path, as save_snapshot.
+    */
+    bool write_snapshot(const Generation &g, const std::vector<const float *> &chunks, int n_delta,
+                        const std::string &data_path, const std::string &index_path) const {
+        const std::string data_tmp = data_path + ".tmp", index_tmp = index_path + ".tmp";
+        FILE *fd = std::fopen(data_tmp.c_str(), "wb");
+        if (!fd)
+            return false;
+        std::vector<char> buffer(snapshot_buffer_bytes);
+        std::setvbuf(fd, buffer.data(), _IOFBF, buffer.size());
+        const mrpt_data::DataFileHeader header = mrpt_data::make_header((int64_t) g.n_base + n_delta, dim);
+        bool ok = std::fwrite(&header, sizeof(header), 1, fd) == 1 &&
+                  std::fwrite(g.data.data(), sizeof(float), g.data.size(), fd) == g.data.size();
+        for (size_t c = 0; ok && c < chunks.size(); ++c) {
+            const size_t n = (size_t) std::min(chunk_points, n_delta - (int) c * chunk_points) * dim;
+            ok = std::fwrite(chunks[c], sizeof(float), n, fd) == n;
+        }
+        ok = std::fclose(fd) == 0 && ok;
+        ok = ok && g.index->save(index_tmp.c_str());
+        ok = ok && std::rename(data_tmp.c_str(), data_path.c_str()) == 0 &&
+             std::rename(index_tmp.c_str(), index_path.c_str()) == 0;
+        if (!ok) {
+            std::remove(data_tmp.c_str());
+            std::remove(index_tmp.c_str());
+        }
+        return ok;
+    }
+
+    /*
+    * Frees the lists and directories replaced by the last inserts, once no
+    * query can be reading them.
+    */
+    void reclaim() {
+        if (retired_lists.empty() && retired_directories.empty())
+            return;
+        epochs.synchronize();
+        retired_lists.clear();
+        retired_directories.clear();
+    }
+
+    /*
+    * Appends id to a leaf list, replacing a full list with a copy twice its size.
+    */
+    void append(std::atomic<LeafList *> &slot, int id) {
+        LeafList *list = slot.load(std::memory_order_relaxed);
+        const int size = list ? list->size.load(std::memory_order_relaxed) : 0;
+        if (!list || size == list->capacity) {
+            LeafList *grown = new LeafList(list ? 2 * list->capacity : 16);
+            if (list)
+                std::copy(list->ids.get(), list->ids.get() + size, grown->ids.get());
+            grown->size.store(size, std::memory_order_relaxed);
+            slot.store(grown, std::memory_order_release);
+            if (list)
+                retired_lists.emplace_back(list);
+            list = grown;
+        }
+        list->ids[size] = id;
+        list->size.store(size + 1, std::memory_order_release);
+    }
+
+    /*
+    * Copies a delta point into its chunk, adding a chunk and growing the
+    * directory if needed.
+    */
+    void store_point(Generation &g, int id, const float *x) {
+        const int c = id / chunk_points, i = id % chunk_points;
+        if (i == 0) {
+            g.chunks.emplace_back(new float[(size_t) chunk_points * (dim + 1)]);
+            Directory *directory = g.directory.load(std::memory_order_relaxed);
+            if (c == (int) directory->chunks.size()) {
+                Directory *grown = new Directory(2 * c);
+                std::copy(directory->chunks.begin(), directory->chunks.end(), grown->chunks.begin());
+                g.directory.store(grown, std::memory_order_release);
+                retired_directories.emplace_back(directory);
+                directory = grown;
+            }
+            directory->chunks[c] = g.chunks.back().get();
+        }
+        float *chunk = g.chunks[c].get();
+        std::copy(x, x + dim, chunk + (size_t) i * dim);
+        chunk[(size_t) chunk_points * dim + i] = Map<const VectorXf>(x, dim).squaredNorm();
+    }
+
+    /*
+    * Elects the delta points with votes_required votes in the leaves of the
+    * query, and offers them to heap with the scores of Mrpt::query.
+    */
+    void score_delta(const Generation &g, int n_visible, const float *q, const float *projected, int votes_required,
+                     Mrpt::TopK &heap) const {
+        VectorXi found_leaves(n_trees);
+        g.index->find_leaves_projected(projected, found_leaves.data());
+        std::vector<int> candidates;
+        for (int n_tree = 0; n_tree < n_trees; ++n_tree) {
+            if (found_leaves(n_tree) < 0)
+                continue;
+            const LeafList *list = g.leaves[(n_tree << depth) + found_leaves(n_tree)].load(std::memory_order_acquire);
+            if (!list)
+                continue;
+            const int size = list->size.load(std::memory_order_acquire);
+            for (int j = 0; j < size && list->ids[j] < n_visible; ++j)
+                candidates.push_back(list->ids[j]);
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        const mrpt_kernels::DistanceKernels &kernels = mrpt_kernels::distance_kernels(dim);
+        const Directory *directory = g.directory.load(std::memory_order_acquire);
+        const float query_scale = metric == Mrpt::COSINE ?
+            1 / std::sqrt(std::max(Map<const VectorXf>(q, dim).squaredNorm(), 1e-30f)) : 1;
+        // the votes of a candidate are the length of its run
+        for (size_t j = 0; j < candidates.size();) {
+            size_t end = j;
+            while (end < candidates.size() && candidates[end] == candidates[j])
+                ++end;
+            if ((int) (end - j) >= votes_required) {
+                const int id = candidates[j];
+                const float *chunk = directory->chunks[id / chunk_points];
+                const float *x = chunk + (size_t) (id % chunk_points) * dim;
+                float score;
+                if (metric == Mrpt::EUCLIDEAN) {
+                    score = kernels.l2(q, x, dim);
+                } else {
+                    score = -kernels.dot(q, x, dim);
+                    const float squared_norm = chunk[(size_t) chunk_points * dim + id % chunk_points];
+                    if (metric == Mrpt::COSINE)
+                        score *= squared_norm > 0 ? query_scale / std::sqrt(squared_norm) : 0;
+                }
+                heap.push(score, g.n_base + id);
+            }
+            j = end;
+        }
+    }
+};
+
+} // namespace mrpt_live
+
+#endif // CPP_MRPT_LIVE_H_
@@ -0,0 +1,433 @@
+#ifndef CPP_MRPT_METRICS_H_
+#define CPP_MRPT_METRICS_H_
+
+/*
+ * Latency histograms and counters that an Mrpt index keeps of its queries,
+ * builds and loads when its metrics are enabled, for monitoring long-running
+ * processes. The histograms have logarithmic buckets, four per power of two
+ * from 1 microsecond to about 18 minutes, so any percentile is known within
+ * 19%. Recording is lock-free: each histogram has several shards of relaxed
+ * atomic counters, and every thread records into the shard assigned to it, so
+ * concurrent queries rarely write to the same cache lines. A snapshot sums
+ * the shards, and the whole set of metrics can be exported in the text format
+ * of Prometheus.
+ *
+ * A RecallMonitor estimates the recall of the queries online by searching a
+ * sample of them again exactly on a thread of its own.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mrpt_metrics {
+
+/*
+* Returns a steady time in nanoseconds, for measuring latencies.
+*/
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+* The counts of a histogram summed over its shards at one point in time.
+*/
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts; // the number of values in each bucket
+    uint64_t count = 0; // the number of values recorded
+    uint64_t sum_ns = 0; // the sum of the values recorded
+
+    /*
+    * Returns the upper bound in nanoseconds of the bucket holding the value
+    * of rank p * count, for p in [0, 1], or 0 if nothing was recorded.
+    */
+    double percentile(double p) const;
+};
+
+class LatencyHistogram {
+ public:
+    static const int min_exponent = 10; // values below 2^10 ns fall in the first bucket
+    static const int n_octaves = 30;
+    static const int sub_buckets = 4; // buckets in each power of two
+    static const int n_buckets = 1 + n_octaves * sub_buckets;
+
+    explicit LatencyHistogram(int n_shards_) :
+        n_shards(n_shards_), shards(new Shard[n_shards_]) { }
+
+    /*
+    * Records a value in nanoseconds into the shard of the calling thread.
+    */
+    void record(int64_t ns) {
+        Shard &shard = shards[thread_shard() % n_shards];
+        shard.counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum_ns.fetch_add(ns > 0 ? ns : 0, std::memory_order_relaxed);
+    }
+
+    HistogramSnapshot snapshot() const {
+        HistogramSnapshot s;
+        s.counts.assign(n_buckets, 0);
+        for (int i = 0; i < n_shards; ++i) {
+            for (int b = 0; b < n_buckets; ++b)
+                s.counts[b] += shards[i].counts[b].load(std::memory_order_relaxed);
+            s.sum_ns += shards[i].sum_ns.load(std::memory_order_relaxed);
+        }
+        for (uint64_t c : s.counts)
+            s.count += c;
+        return s;
+    }
+
+    /*
+    * Returns the bucket of a value in nanoseconds: the power of two below the
+    * value and the next two bits of it.
+    */
+    static int bucket(int64_t ns) {
+        if (ns < (int64_t) 1 << min_exponent)
+            return 0;
+        int exponent = 63;
+        while (!(ns >> exponent))
+            --exponent;
+        if (exponent >= min_exponent + n_octaves)
+            return n_buckets - 1;
+        const int sub = (ns >> (exponent - 2)) & (sub_buckets - 1);
+        return 1 + (exponent - min_exponent) * sub_buckets + sub;
+    }
+
+    /*
+    * Returns the smallest value in nanoseconds above the values of bucket b.
+    */
+    static double upper_bound(int b) {
+        if (b == 0)
+            return (double) ((int64_t) 1 << min_exponent);
+        const int exponent = min_exponent + (b - 1) / sub_buckets, sub = (b - 1) % sub_buckets;
+        return std::ldexp((double) (sub_buckets + sub + 1), exponent - 2);
+    }
+
+ private:
+    // about a kilobyte, so that the shards of different threads rarely share cache lines
+    struct Shard {
+        std::atomic<uint64_t> counts[n_buckets] = {};
+        std::atomic<uint64_t> sum_ns{0};
+    };
+
+    /*
+    * Returns a number of the calling thread, assigned when it first records
+    * into any histogram.
+    */
+    static unsigned thread_shard() {
+        static std::atomic<unsigned> next_shard{0};
+        static thread_local const unsigned shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+        return shard;
+    }
+
+    const int n_shards;
+    std::unique_ptr<Shard[]> shards;
+};
+
+inline double HistogramSnapshot::percentile(double p) const {
+    if (!count)
+        return 0;
+    const uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(p * count));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); ++b) {
+        seen += counts[b];
+        if (seen >= rank)
+            return LatencyHistogram::upper_bound(b);
+    }
+    return LatencyHistogram::upper_bound(counts.size() - 1);
+}
+
+/*
+* The recall of the queries estimated by a RecallMonitor.
+*/
+struct RecallSnapshot {
+    double recall = 0; // the mean recall at k of the last queries checked, 0 if none was
+    int n_recent = 0; // the number of queries the recall is the mean of, at most the window
+    uint64_t n_checked = 0; // the queries checked since the monitor started
+    uint64_t n_dropped = 0; // the queries sampled but dropped because the monitor was busy
+};
+
+/*
+* Estimates the recall of the approximate queries while they are served. A
+* fraction of the queries, drawn at random, are copied with their answers and
+* searched again exactly by the thread of the monitor, which compares the
+* answers with the true nearest neighbors. The estimate is the mean recall of
+* the last window queries checked, so it follows the drift of the data and of
+* the queries. A query sampled while too many others are waiting, or while
+* another thread is handing one over, is dropped, so the queries never wait
+* for the monitor.
+*/
+class RecallMonitor {
+ public:
+    /*
+    * Searches n queries, dim floats each one after another, exactly, and writes
+    * the ids of the k nearest neighbors of query i to out[i * k, (i + 1) * k).
+    */
+    typedef std::function<void(const float *queries, int n, int k, int *out)> ExactSearch;
+
+    /*
+    * Starts the thread of the monitor.
+    * @param sample_rate - The fraction of the queries checked
+    * @param window - The number of the last queries checked the recall is the mean of
+    * @param exact - The exact search the answers are compared with, called on the thread of the monitor
+    * @param max_waiting - The most queries waiting to be checked, beyond which the sampled queries are dropped
+    */
+    RecallMonitor(int dim_, double sample_rate_, int window, ExactSearch exact_, int max_waiting_ = 1024) :
+        dim(dim_), sample_rate(sample_rate_), max_waiting(max_waiting_), exact(std::move(exact_)),
+        recalls(std::max(1, window)), checker(&RecallMonitor::run, this) { }
+
+    RecallMonitor(const RecallMonitor &) = delete;
+    RecallMonitor &operator=(const RecallMonitor &) = delete;
+
+    /*
+    * Drops the queries waiting and stops the thread once it has checked the
+    * queries it is checking.
+    */
+    ~RecallMonitor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            waiting.clear();
+        }
+        query_waiting.notify_one();
+        checker.join();
+    }
+
+    /*
+    * Samples a query answered by the index: with probability sample_rate the
+    * query and its answer are copied for checking. Can be called concurrently
+    * from any number of threads, and never blocks.
+    * @param q - The query, dim floats
+    * @param k - The number of neighbors searched for
+    * @param answer - The ids of the neighbors the query returned
+    */
+    void observe(const float *q, int k, const int *answer) {
+        if (!sampled())
+            return;
+        Sample sample;
+        sample.q.assign(q, q + dim);
+        sample.answer.assign(answer, answer + k);
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || (int) waiting.size() >= max_waiting) {
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        waiting.push_back(std::move(sample));
+        lock.unlock();
+        query_waiting.notify_one();
+    }
+
+    /*
+    * Drops the queries waiting and waits until the queries being checked are
+    * done, so that the index can be modified without the exact searches of the
+    * monitor reading it meanwhile.
+    */
+    void drain() {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.clear();
+        idle.wait(lock, [this] { return !checking; });
+    }
+
+    RecallSnapshot snapshot() const {
+        RecallSnapshot s;
+        std::lock_guard<std::mutex> lock(mutex);
+        s.n_recent = n_recent;
+        double sum = 0;
+        for (int i = 0; i < n_recent; ++i)
+            sum += recalls[i];
+        s.recall = n_recent ? sum / n_recent : 0;
+        s.n_checked = n_checked;
+        s.n_dropped = n_dropped.load(std::memory_order_relaxed);
+        return s;
+    }
+
+ private:
+    struct Sample {
+        std::vector<float> q;
+        std::vector<int> answer;
+    };
+
+    /*
+    * Returns true with probability sample_rate, from a random stream of the
+    * calling thread.
+    */
+    bool sampled() const {
+        static thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (state >> 11) * (1.0 / 9007199254740992.0) < sample_rate;
+    }
+
+    void run() {
+        const int max_batch = 256;
+        std::vector<Sample> batch;
+        std::vector<float> queries;
+        std::vector<int> out;
+        std::vector<double> checked;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                query_waiting.wait(lock, [this] { return stopping || !waiting.empty(); });
+                if (stopping)
+                    return;
+                const int n = std::min<int>(max_batch, waiting.size());
+                batch.clear();
+                for (int i = 0; i < n; ++i) {
+                    batch.push_back(std::move(waiting.front()));
+                    waiting.pop_front();
+                }
+                checking = true;
+            }
+
+            // the queries with the same k are searched together
+            std::stable_sort(batch.begin(), batch.end(), [](const Sample &a, const Sample &b) {
+                return a.answer.size() < b.answer.size();
+            });
+            checked.clear();
+            for (size_t first = 0, last; first < batch.size(); first = last) {
+                const int k = batch[first].answer.size();
+                for (last = first; last < batch.size() && (int) batch[last].answer.size() == k; ++last) { }
+                const int n = last - first;
+                queries.resize((size_t) n * dim);
+                for (int i = 0; i < n; ++i)
+                    std::copy(batch[first + i].q.begin(), batch[first + i].q.end(), queries.begin() + (size_t) i * dim);
+                out.resize((size_t) n * k);
+                exact(queries.data(), n, k, out.data());
+                for (int i = 0; i < n; ++i)
+                    checked.push_back(recall(batch[first + i].answer, out.data() + (size_t) i * k));
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (double r : checked) {
+                recalls[next] = r;
+                next = (next + 1) % recalls.size();
+                n_recent = std::min<int>(n_recent + 1, recalls.size());
+            }
+            n_checked += checked.size();
+            checking = false;
+            idle.notify_all();
+        }
+    }
+
+    /*
+    * Returns the fraction of the true neighbors, the ids in exact other than -1,
+    * found in answer.
+    */
+    static double recall(const std::vector<int> &answer, const int *exact) {
+        const int k = answer.size();
+        int n_true = 0, n_found = 0;
+        for (int i = 0; i < k; ++i) {
+            if (exact[i] < 0)
+                continue;
+            ++n_true;
+            n_found += std::find(answer.begin(), answer.end(), exact[i]) != answer.end();
+        }
+        return n_true ? (double) n_found / n_true : 1;
+    }
+
+    const int dim;
+    const double sample_rate;
+    const int max_waiting;
+    const ExactSearch exact;
+    mutable std::mutex mutex; // guards the members below up to n_checked
+    std::condition_variable query_waiting, idle;
+    std::deque<Sample> waiting;
+    bool checking = false;
+    bool stopping = false;
+    std::vector<float> recalls; // the recalls of the last queries checked, a ring buffer
+    int next = 0; // where the next recall goes in recalls
+    int n_recent = 0; // the recalls in recalls
+    uint64_t n_checked = 0;
+    std::atomic<uint64_t> n_dropped{0};
+    std::thread checker; // started last, once the members it uses are initialized
+};
+
+/*
+* The metrics of one index: the latencies of single queries, of whole-index
+* builds and of loads, and the number of failed loads.
+*/
+struct IndexMetrics {
+    LatencyHistogram queries{16};
+    LatencyHistogram builds{1};
+    LatencyHistogram loads{1};
+    std::atomic<uint64_t> failed_loads{0};
+    std::unique_ptr<RecallMonitor> recall; // the recall monitor of the index, null if there is none
+
+    /*
+    * Returns the metrics in the Prometheus text exposition format, with names
+    * starting with prefix and the given labels, such as index="main", added to
+    * every sample. The histograms are exported with a bucket per power of two.
+    */
+    std::string prometheus_text(const std::string &prefix, const std::string &labels = "") const {
+        std::string text;
+        append_histogram(text, prefix + "_query_latency_seconds", "Latency of the queries.", queries, labels);
+        append_histogram(text, prefix + "_build_duration_seconds", "Duration of the builds of the index.", builds,
+                         labels);
+        append_histogram(text, prefix + "_load_duration_seconds", "Duration of the loads of the index.", loads,
+                         labels);
+        const std::string name = prefix + "_failed_loads_total";
+        text += "# HELP " + name + " Number of loads of the index that failed.\n";
+        text += "# TYPE " + name + " counter\n";
+        const std::string label_set = labels.empty() ? "" : "{" + labels + "}";
+        text += name + label_set + " " + std::to_string(failed_loads.load(std::memory_order_relaxed)) + "\n";
+        if (!recall)
+            return text;
+
+        const RecallSnapshot r = recall->snapshot();
+        char value[64];
+        std::snprintf(value, sizeof(value), "%.6g", r.recall);
+        const std::string recall_name = prefix + "_estimated_recall", checked = prefix + "_recall_checks_total",
+                          dropped = prefix + "_recall_dropped_total";
+        text += "# HELP " + recall_name + " Mean recall of the last queries checked by exact search.\n";
+        text += "# TYPE " + recall_name + " gauge\n";
+        text += recall_name + label_set + " " + value + "\n";
+        text += "# HELP " + checked + " Number of queries checked by exact search.\n";
+        text += "# TYPE " + checked + " counter\n";
+        text += checked + label_set + " " + std::to_string(r.n_checked) + "\n";
+        text += "# HELP " + dropped + " Number of queries sampled for checking but dropped.\n";
+        text += "# TYPE " + dropped + " counter\n";
+        text += dropped + label_set + " " + std::to_string(r.n_dropped) + "\n";
+        return text;
+    }
+
+ private:
+    static void append_histogram(std::string &text, const std::string &name, const char *help,
+                                 const LatencyHistogram &histogram, const std::string &labels) {
+        const HistogramSnapshot s = histogram.snapshot();
+        const std::string label_prefix = labels.empty() ? "" : labels + ",";
+        const std::string label_set = labels.empty() ? "" : "{" + labels + "}";
+        char value[64];
+
+        text += "# HELP " + name + " " + help + "\n";
+        text += "# TYPE " + name + " histogram\n";
+        uint64_t cumulative = s.counts[0];
+        for (int b = 1; b < LatencyHistogram::n_buckets; ++b) {
+            // report the counts at the end of each power of two
+            if (b % LatencyHistogram::sub_buckets == 1) {
+                std::snprintf(value, sizeof(value), "%g", LatencyHistogram::upper_bound(b - 1) * 1e-9);
+                text += name + "_bucket{" + label_prefix + "le=\"" + value + "\"} " + std::to_string(cumulative) + "\n";
+            }
+            cumulative += s.counts[b];
+        }
+        text += name + "_bucket{" + label_prefix + "le=\"+Inf\"} " + std::to_string(s.count) + "\n";
+        std::snprintf(value, sizeof(value), "%.9g", s.sum_ns * 1e-9);
+        text += name + "_sum" + label_set + " " + value + "\n";
+        text += name + "_count" + label_set + " " + std::to_string(s.count) + "\n";
+    }
+};
+
+} // namespace mrpt_metrics
+
+#endif // CPP_MRPT_METRICS_H_
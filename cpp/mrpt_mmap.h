@@ -0,0 +1,292 @@
+#ifndef CPP_MRPT_MMAP_H_
+#define CPP_MRPT_MMAP_H_
+
+/*
+ * Read-only mappings of files into memory, with mmap on POSIX systems and
+ * with CreateFileMapping and MapViewOfFile on Windows, used by Mrpt::load to
+ * map an index file and by MRPTIndex to map a data file. The mappings are
+ * shared, so the processes that map the same file use one copy of it in the
+ * page cache. Also anonymous mappings, the blocks Mrpt::compact moves an
+ * index into by default, optionally bound to a NUMA node, and the growable
+ * file mappings that Mrpt::set_data_file keeps the inserted points in.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace mrpt_mmap {
+
+const int max_nodes = 1024; // the NUMA nodes allocate_pages_on_node can bind to
+
+/*
+* Maps the first bytes of an open file read-only.
+* @param fd - The file, opened for reading
+* @param bytes - The length of the mapping, at most the size of the file
+* @param populate - If true, the pages are read in while mapping where the
+* system supports it (MAP_POPULATE), instead of when they are first accessed
+* @return The start of the mapping, or nullptr if the file cannot be mapped.
+*/
+inline void *map_file(FILE *fd, size_t bytes, bool populate = false) {
+    if (!bytes)
+        return nullptr;
+#ifdef _WIN32
+    (void) populate;
+    const HANDLE file = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(fd)));
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    const uint64_t size = bytes;
+    const HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, static_cast<DWORD>(size >> 32),
+                                              static_cast<DWORD>(size), NULL);
+    if (!mapping)
+        return nullptr;
+    void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, bytes);
+    // the view keeps the mapping object alive until it is unmapped
+    CloseHandle(mapping);
+    return p;
+#else
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (populate)
+        flags |= MAP_POPULATE;
+#else
+    (void) populate;
+#endif
+    void *p = mmap(0, bytes, PROT_READ, flags, fileno(fd), 0);
+    return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+/*
+* Unmaps a mapping returned by map_file.
+* @param p - The start of the mapping, or nullptr for none
+* @param bytes - The length given to map_file
+*/
+inline void unmap_file(void *p, size_t bytes) {
+    if (!p)
+        return;
+#ifdef _WIN32
+    (void) bytes;
+    UnmapViewOfFile(p);
+#else
+    munmap(p, bytes);
+#endif
+}
+
+/*
+* Maps zero-filled read-write memory that belongs to no file, for a large block
+* that is returned to the system at once.
+* @return The start of the block, aligned to a page, or nullptr if it cannot be
+* allocated.
+*/
+inline void *allocate_pages(size_t bytes) {
+    if (!bytes)
+        return nullptr;
+#ifdef _WIN32
+    return VirtualAlloc(NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+/*
+* Maps zero-filled read-write memory like allocate_pages, bound to the NUMA node
+* node, such as a CPU-less node of memory attached over CXL, where the system
+* supports it (Linux); elsewhere the memory comes from any node.
+* @return The start of the block, or nullptr if it cannot be allocated or bound
+* to the node.
+*/
+inline void *allocate_pages_on_node(size_t bytes, int node) {
+    void *p = allocate_pages(bytes);
+#if defined(__linux__) && defined(SYS_mbind)
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long mask[max_nodes / bits] = {0};
+    if (p && node >= 0 && node < max_nodes - 1) {
+        mask[node / bits] = 1UL << (node % bits);
+        // MPOL_BIND, before the pages are first touched and so placed
+        if (syscall(SYS_mbind, p, bytes, 2, mask, (unsigned long) max_nodes, 0) != 0) {
+            munmap(p, bytes);
+            return nullptr;
+        }
+    }
+#else
+    (void) node;
+#endif
+    return p;
+}
+
+/*
+* Frees a block returned by allocate_pages.
+* @param p - The start of the block, or nullptr for none
+* @param bytes - The length given to allocate_pages
+*/
+inline void free_pages(void *p, size_t bytes) {
+    if (!p)
+        return;
+#ifdef _WIN32
+    (void) bytes;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, bytes);
+#endif
+}
+
+/*
+* A file mapped read-write that grows at its end, for the data of an index that
+* points are inserted into. The address space of the largest size the file may
+* reach is reserved when it is opened, and the file is mapped into it an extent
+* at a time as it grows, so the mapping never moves: pointers into it stay valid
+* for the readers while the file grows, and nothing is copied. The file itself
+* always has the size given to resize. Not supported on Windows, where open fails.
+*/
+class GrowableFile {
+ public:
+    GrowableFile() : fd(-1), base(nullptr), reserved(0), mapped(0), extent(0), used(0) { }
+
+    GrowableFile(const GrowableFile &) = delete;
+    GrowableFile &operator=(const GrowableFile &) = delete;
+
+    ~GrowableFile() {
+        close();
+    }
+
+    /*
+    * Creates the file at path, or truncates it if it exists, and reserves the
+    * address space of its mapping.
+    * @param max_bytes - The largest size the file can grow to
+    * @param extent_bytes - The bytes the mapping grows by at least at a time,
+    * rounded up to whole pages
+    * @return False if the file cannot be created or the address space cannot be
+    * reserved.
+    */
+    bool open(const char *path, size_t max_bytes, size_t extent_bytes) {
+        close();
+#ifdef _WIN32
+        (void) path;
+        (void) max_bytes;
+        (void) extent_bytes;
+        return false;
+#else
+        const size_t page = sysconf(_SC_PAGESIZE);
+        extent = (std::max<size_t>(extent_bytes, 1) + page - 1) / page * page;
+        reserved = (max_bytes + page - 1) / page * page;
+        if (!reserved)
+            return false;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+        flags |= MAP_NORESERVE;
+#endif
+        void *p = mmap(0, reserved, PROT_NONE, flags, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        base = static_cast<char *>(p);
+        fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            close();
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    /*
+    * Sets the size of the file to bytes, mapping the extents it grows into.
+    * @return False if bytes is more than the size the file can grow to or the
+    * file cannot be extended, in which case the file is left as it was.
+    */
+    bool resize(size_t bytes) {
+#ifdef _WIN32
+        (void) bytes;
+        return false;
+#else
+        if (fd < 0 || bytes > reserved)
+            return false;
+        const size_t new_mapped = std::min(reserved, (bytes + extent - 1) / extent * extent);
+        if (new_mapped > mapped) {
+            // the extent replaces the reserved pages in place, so the mapping keeps its start; the
+            // pages past the end of the file are not touched until the file is extended over them
+            void *p = mmap(base + mapped, new_mapped - mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                           fd, mapped);
+            if (p == MAP_FAILED)
+                return false;
+            mapped = new_mapped;
+        }
+        if (ftruncate(fd, bytes) != 0)
+            return false;
+        used = bytes;
+        return true;
+#endif
+    }
+
+    /*
+    * Unmaps and closes the file, which keeps the size last given to resize.
+    */
+    void close() {
+#ifndef _WIN32
+        if (base)
+            munmap(base, reserved);
+        if (fd >= 0)
+            ::close(fd);
+#endif
+        fd = -1;
+        base = nullptr;
+        reserved = mapped = used = 0;
+    }
+
+    void swap(GrowableFile &other) {
+        std::swap(fd, other.fd);
+        std::swap(base, other.base);
+        std::swap(reserved, other.reserved);
+        std::swap(mapped, other.mapped);
+        std::swap(extent, other.extent);
+        std::swap(used, other.used);
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    char *data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+    /*
+    * Returns the bytes of the file that are mapped, a whole number of extents.
+    */
+    size_t mapped_size() const {
+        return mapped;
+    }
+
+ private:
+    int fd;
+    char *base; // the start of the reserved address space, where the file is mapped
+    size_t reserved, mapped, extent, used;
+};
+
+} // namespace mrpt_mmap
+
+#endif // CPP_MRPT_MMAP_H_
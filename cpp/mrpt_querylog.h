@@ -0,0 +1,168 @@
+#ifndef CPP_MRPT_QUERYLOG_H_
+#define CPP_MRPT_QUERYLOG_H_
+
+/*
+ * The query logs that mrpt_server writes with --query-log and replay.cpp
+ * replays: a sample of the queries served, each with its k, votes_required and
+ * arrival time, so that an index can be benchmarked with the mix and the
+ * arrival pattern of real traffic. The file starts with a header of 64 bytes,
+ * followed by one record per query: a QueryRecord and the query as dim
+ * float32 components. The times are in nanoseconds since the log was opened,
+ * on a steady clock, and the header holds the wall time of its opening.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace mrpt_querylog {
+
+struct QueryLogHeader {
+    char magic[8]; // MRPTQLOG
+    uint32_t version;
+    uint32_t dim; // the dimension of the queries
+    int64_t start_unix_ns; // the wall time at which the log was opened
+    double sample_rate; // the share of the queries logged
+    uint8_t reserved[32];
+};
+
+struct QueryRecord {
+    int64_t time_ns; // the arrival time of the query since the log was opened
+    int32_t k;
+    int32_t votes_required;
+};
+
+inline const char *query_log_magic() {
+    return "MRPTQLOG";
+}
+
+inline uint32_t query_log_version() {
+    return 1;
+}
+
+/*
+* Writes a query log. record may be called from any number of threads.
+*/
+class QueryLogWriter {
+ public:
+    QueryLogWriter() : fd(nullptr), dim(0), sample_rate(1), n_seen(0), start(), last_flush() { }
+
+    ~QueryLogWriter() {
+        close();
+    }
+
+    QueryLogWriter(const QueryLogWriter &) = delete;
+    QueryLogWriter &operator=(const QueryLogWriter &) = delete;
+
+    /*
+    * Creates the log at path for queries of dimension dim_.
+    * @param sample_rate_ - The share of the queries logged, in (0, 1]: every
+    * 1 / sample_rate_th query is, so the sample keeps the arrival pattern
+    * @return False if the file cannot be written.
+    */
+    bool open(const char *path, int dim_, double sample_rate_) {
+        close();
+        fd = std::fopen(path, "wb");
+        if (!fd)
+            return false;
+        dim = dim_;
+        sample_rate = sample_rate_;
+        n_seen = 0;
+        start = std::chrono::steady_clock::now();
+        last_flush = start;
+
+        QueryLogHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, query_log_magic(), sizeof(header.magic));
+        header.version = query_log_version();
+        header.dim = dim;
+        header.start_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        header.sample_rate = sample_rate;
+        if (std::fwrite(&header, sizeof(header), 1, fd) != 1) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    bool is_open() const {
+        return fd != nullptr;
+    }
+
+    /*
+    * Logs the query q if it falls in the sample. The records are buffered, and
+    * flushed by the first record a second or more after the last flush and by
+    * close, so a process killed loses at most the records of its last second.
+    */
+    void record(const float *q, int k, int votes_required) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!fd)
+            return;
+        // the query is kept when the count of the kept ones, n_seen * sample_rate, reaches a new integer
+        const int64_t n = n_seen++;
+        if ((int64_t) ((n + 1) * sample_rate) == (int64_t) (n * sample_rate))
+            return;
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        QueryRecord r;
+        r.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+        r.k = k;
+        r.votes_required = votes_required;
+        std::fwrite(&r, sizeof(r), 1, fd);
+        std::fwrite(q, sizeof(float), dim, fd);
+        if (now - last_flush >= std::chrono::seconds(1)) {
+            std::fflush(fd);
+            last_flush = now;
+        }
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd)
+            std::fclose(fd);
+        fd = nullptr;
+    }
+
+ private:
+    std::mutex mutex;
+    FILE *fd;
+    int dim;
+    double sample_rate;
+    int64_t n_seen; // the queries offered to record
+    std::chrono::steady_clock::time_point start, last_flush;
+};
+
+/*
+* Reads a whole query log: the records in order of arrival, and the queries
+* as the columns of a dim x records.size() matrix in queries. A log cut short
+* by a crash of its writer is read up to its last whole record.
+* @return False if the file cannot be read or is not a query log.
+*/
+inline bool read_query_log(const char *path, QueryLogHeader &header, std::vector<QueryRecord> &records,
+                           std::vector<float> &queries) {
+    FILE *fd = std::fopen(path, "rb");
+    if (!fd)
+        return false;
+    if (std::fread(&header, sizeof(header), 1, fd) != 1 || std::memcmp(header.magic, query_log_magic(), 8) ||
+        header.version < 1 || header.version > query_log_version() || header.dim == 0) {
+        std::fclose(fd);
+        return false;
+    }
+    records.clear();
+    queries.clear();
+    QueryRecord r;
+    std::vector<float> q(header.dim);
+    while (std::fread(&r, sizeof(r), 1, fd) == 1 && std::fread(q.data(), sizeof(float), q.size(), fd) == q.size()) {
+        records.push_back(r);
+        queries.insert(queries.end(), q.begin(), q.end());
+    }
+    std::fclose(fd);
+    return true;
+}
+
+} // namespace mrpt_querylog
+
+#endif // CPP_MRPT_QUERYLOG_H_
@@ -0,0 +1,112 @@
+#ifndef CPP_MRPT_SNAPSHOT_H_
+#define CPP_MRPT_SNAPSHOT_H_
+
+/*
+ * Hot swapping of a served index without restarting the process. A
+ * SnapshotHandle holds a reference-counted pointer to the current snapshot, an
+ * index that is no longer modified (or an index together with whatever serves
+ * it, such as the AsyncQueries of mrpt_async.h). A query takes a reference to
+ * the current snapshot with get and keeps it until it is done, so a swap sends
+ * the new queries to the new snapshot while the queries in flight finish on
+ * the old one, which is destroyed with the last reference to it.
+ *
+ * The next snapshot can be loaded in the background with preload, typically
+ * with Mrpt::load followed by Mrpt::prefault so that its pages are resident
+ * before it gets any queries, and then installed with swap_preloaded.
+ */
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace mrpt_snapshot {
+
+template<typename T>
+class SnapshotHandle {
+ public:
+    typedef std::function<std::shared_ptr<T>()> Loader;
+
+    explicit SnapshotHandle(std::shared_ptr<T> initial = nullptr) : current(std::move(initial)) { }
+
+    SnapshotHandle(const SnapshotHandle &) = delete;
+    SnapshotHandle &operator=(const SnapshotHandle &) = delete;
+
+    ~SnapshotHandle() {
+        wait_preload();
+    }
+
+    /**
+    * Returns the current snapshot, which stays alive as long as the returned
+    * pointer does. Can be called concurrently with everything else.
+    */
+    std::shared_ptr<T> get() const {
+        return std::atomic_load(&current);
+    }
+
+    /**
+    * Makes next the current snapshot, and returns the previous one.
+    */
+    std::shared_ptr<T> swap(std::shared_ptr<T> next) {
+        return std::atomic_exchange(&current, std::move(next));
+    }
+
+    /**
+    * Starts building the next snapshot with load on a thread of its own, while
+    * the current one keeps serving. load returns the snapshot, or nullptr if it
+    * fails; it should leave the snapshot ready to serve. A preload that has not
+    * been swapped in is waited for and discarded.
+    */
+    void preload(Loader load) {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        join_loader();
+        preloaded.reset();
+        loader = std::thread([this, load] { preloaded = load(); });
+    }
+
+    /**
+    * Waits for the snapshot started by preload.
+    * @return True if it was built, false if it failed or none was started.
+    */
+    bool wait_preload() {
+        std::lock_guard<std::mutex> lock(preload_mutex);
+        join_loader();
+        return preloaded != nullptr;
+    }
+
+    /**
+    * Waits for the snapshot started by preload and makes it the current one.
+    * @return False, leaving the current snapshot in place, if it failed or none
+    * was started.
+    */
+    bool swap_preloaded() {
+        std::shared_ptr<T> next;
+        {
+            std::lock_guard<std::mutex> lock(preload_mutex);
+            join_loader();
+            next = std::move(preloaded);
+            preloaded.reset();
+        }
+        if (!next)
+            return false;
+        // the previous snapshot is released here unless queries still use it
+        swap(std::move(next));
+        return true;
+    }
+
+ private:
+    void join_loader() {
+        if (loader.joinable())
+            loader.join();
+    }
+
+    std::shared_ptr<T> current; // accessed with the atomic functions of shared_ptr only
+    std::mutex preload_mutex; // guards the members below
+    std::thread loader;
+    std::shared_ptr<T> preloaded; // written by the loader thread, read once it is joined
+};
+
+} // namespace mrpt_snapshot
+
+#endif // CPP_MRPT_SNAPSHOT_H_
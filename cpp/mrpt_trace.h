@@ -0,0 +1,177 @@
+#ifndef CPP_MRPT_TRACE_H_
+#define CPP_MRPT_TRACE_H_
+
+/*
+ * Trace events of the phases of Mrpt, so that a profiler shows on the
+ * timeline of a service which phase of the index a slow request was in, and
+ * how the threads of a build are used. The phases are marked by scopes:
+ * MRPT_TRACE_SCOPE(var, name) begins the event name, a string literal, which
+ * ends at the end of the enclosing block, or earlier at MRPT_TRACE_END(var).
+ *
+ * The events are compiled out unless one of these selects their sink:
+ *   -DMRPT_TRACE_PERFETTO  track events of the Perfetto SDK, in the category
+ *                          "mrpt", which the program defines with
+ *                          PERFETTO_DEFINE_CATEGORIES before including Mrpt.h
+ *   -DMRPT_TRACE_ITT       tasks of the Intel ITT API of VTune, in the domain
+ *                          "mrpt"; link with -littnotify
+ *   -DMRPT_TRACE_TRACY     zones of Tracy, compiled with TRACY_ENABLE
+ *   -DMRPT_TRACE_CALLBACK  calls of the mrpt_trace::Sink given to
+ *                          mrpt_trace::set_sink, for any other tracer
+ *
+ * The events are named "mrpt.<phase>": grow, random_matrix, project_data and
+ * grow_tree (one per tree, on the thread building it) in the build, load, and
+ * project_query, route, vote and exact_knn in the queries.
+ */
+
+#if defined(MRPT_TRACE_PERFETTO)
+#include <perfetto.h>
+#elif defined(MRPT_TRACE_ITT)
+#include <ittnotify.h>
+#elif defined(MRPT_TRACE_TRACY)
+#include <tracy/TracyC.h>
+#elif defined(MRPT_TRACE_CALLBACK)
+#include <atomic>
+#endif
+
+#if defined(MRPT_TRACE_PERFETTO) || defined(MRPT_TRACE_ITT) || defined(MRPT_TRACE_TRACY) || \
+    defined(MRPT_TRACE_CALLBACK)
+#define MRPT_TRACING
+#endif
+
+#ifdef MRPT_TRACING
+
+namespace mrpt_trace {
+
+#if defined(MRPT_TRACE_PERFETTO)
+
+typedef const char *Site;
+
+inline void begin(Site name) {
+    TRACE_EVENT_BEGIN("mrpt", perfetto::StaticString{name});
+}
+
+inline void end(Site) {
+    TRACE_EVENT_END("mrpt");
+}
+
+#define MRPT_TRACE_SITE(var, name) const mrpt_trace::Site var = name
+
+#elif defined(MRPT_TRACE_ITT)
+
+typedef __itt_string_handle *Site;
+
+inline __itt_domain *domain() {
+    static __itt_domain *const d = __itt_domain_create("mrpt");
+    return d;
+}
+
+inline void begin(Site handle) {
+    __itt_task_begin(domain(), __itt_null, __itt_null, handle);
+}
+
+inline void end(Site) {
+    __itt_task_end(domain());
+}
+
+// the string handle of a scope is created once, at its first use
+#define MRPT_TRACE_SITE(var, name) static const mrpt_trace::Site var = __itt_string_handle_create(name)
+
+#elif defined(MRPT_TRACE_TRACY)
+
+typedef const ___tracy_source_location_data *Site;
+
+#define MRPT_TRACE_SITE(var, name) \
+    static const ___tracy_source_location_data var##_location = {name, __func__, __FILE__, (uint32_t) __LINE__, 0}; \
+    const mrpt_trace::Site var = &var##_location
+
+#elif defined(MRPT_TRACE_CALLBACK)
+
+typedef const char *Site;
+
+/*
+* The receiver of the events of MRPT_TRACE_CALLBACK. The calls come from the
+* threads of the phases, concurrently, and end(name) follows begin(name) on
+* the same thread.
+*/
+class Sink {
+ public:
+    virtual ~Sink() { }
+    virtual void begin(const char *name) = 0;
+    virtual void end(const char *name) = 0;
+};
+
+inline std::atomic<Sink *> &current_sink() {
+    static std::atomic<Sink *> sink(nullptr);
+    return sink;
+}
+
+/*
+* Sends the events to sink from now on, or drops them if it is null. The sink
+* must outlive the phases running with it.
+*/
+inline void set_sink(Sink *sink) {
+    current_sink().store(sink, std::memory_order_release);
+}
+
+#define MRPT_TRACE_SITE(var, name) const mrpt_trace::Site var = name
+
+#endif
+
+/*
+* An event from its construction until end or its destruction.
+*/
+class Scope {
+ public:
+    explicit Scope(Site site) : site(site), open(true) {
+#if defined(MRPT_TRACE_TRACY)
+        context = ___tracy_emit_zone_begin(site, 1);
+#elif defined(MRPT_TRACE_CALLBACK)
+        sink = current_sink().load(std::memory_order_acquire);
+        if (sink) sink->begin(site);
+#else
+        begin(site);
+#endif
+    }
+
+    ~Scope() {
+        end();
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    void end() {
+        if (!open) return;
+        open = false;
+#if defined(MRPT_TRACE_TRACY)
+        ___tracy_emit_zone_end(context);
+#elif defined(MRPT_TRACE_CALLBACK)
+        if (sink) sink->end(site);
+#else
+        mrpt_trace::end(site);
+#endif
+    }
+
+ private:
+    Site site;
+    bool open;
+#if defined(MRPT_TRACE_TRACY)
+    TracyCZoneCtx context;
+#elif defined(MRPT_TRACE_CALLBACK)
+    Sink *sink;
+#endif
+};
+
+} // namespace mrpt_trace
+
+#define MRPT_TRACE_SCOPE(var, name) MRPT_TRACE_SITE(var##_site, name); mrpt_trace::Scope var(var##_site)
+#define MRPT_TRACE_END(var) var.end()
+
+#else
+
+#define MRPT_TRACE_SCOPE(var, name)
+#define MRPT_TRACE_END(var)
+
+#endif // MRPT_TRACING
+
+#endif // CPP_MRPT_TRACE_H_
@@ -1,39 +1,175 @@
 /*
  * This file wraps the C++11 Mrpt code to an extension module compatible with
  * Python 2.7.
+ *
+ * The GIL is released for the duration of the C++ work in every method, so
+ * Python threads can run queries in parallel with each other and with other
+ * Python code. The query methods (ann, ann_pages, next_page, ann_excluding, ann_projected, ann_from_leaves, exact_search, query_set,
+ * get_leaves, get_nearest_leaves, filter_leaves_by_votes, project), save and save_delta
+ * only read the index and may run concurrently on the same object. build,
+ * load, load_url, apply_delta, prune, prune_trees, regrow_trees, set_data_file, insert, merge, remove, update, remove_labels, set_labels, set_quantization,
+ * set_projection_precision, set_leading_dimensions, set_leaf_bounds, set_graph, build_graph, set_graph_walk,
+ * set_query_planner, calibrate_planner, calibrate_batch, compact, set_memory_tiers, compress_leaves, sort_leaves, collapse_duplicates, autotune, fit_memory_budget and the setters modify the index or the object. Each object has an
+ * IndexLock that the readers hold shared and the others alone, so a build or a load waits for the queries
+ * running and the queries started meanwhile wait for it. This also holds in a free-threaded Python
+ * (PEP 703), where the module declares that it does not need the GIL. While load_async loads the trees in
+ * the background, the queries and trees_loaded may run and use the trees loaded so far; the other methods
+ * wait for it.
+ *
+ * ann_submit queues a query for the dispatcher thread of mrpt_async, which
+ * answers the queries waiting together and calls the callback of each with the
+ * GIL taken. The dispatcher does not hold the lock of the index, so pending
+ * queries count as running queries that the methods modifying the index must
+ * not overlap with. The progress callback of build must not call the methods
+ * of the index being built, which would wait for the build.
  */
 
 #include "Python.h"
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <numeric>
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <iostream>
 
 #ifndef _WIN32
 #include <sys/mman.h>
+#include <unistd.h>
 #endif
 
+#include "BinaryMrpt.h"
 #include "Mrpt.h"
+#include "SparseMrpt.h"
+#include "mrpt_async.h"
+#include "mrpt_cache.h"
+#include "mrpt_data.h"
+#include "mrpt_mmap.h"
 #include "numpy/arrayobject.h"
 
+#ifndef _WIN32
+#include "mrpt_http.h"
+#endif
+
 #include <Eigen/Dense>
 
 using Eigen::MatrixXf;
 using Eigen::VectorXf;
 using Eigen::VectorXi;
 
+/*
+ * A readers-writer lock of an index object. The methods that only read the
+ * index hold it shared and run in parallel, and those that modify the index or
+ * the fields of the object hold it alone, so that in a free-threaded Python a
+ * build or a load waits for the queries running and the queries wait for it.
+ * A writer waiting keeps new readers out, so that a steady stream of queries
+ * cannot starve a reload. The lock is waited for with the GIL released, so that
+ * a thread holding it can always take the GIL back to finish.
+ */
+class IndexLock {
+ public:
+    void lock_shared() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!writer && !writers_waiting) {
+                ++readers;
+                return;
+            }
+        }
+        Py_BEGIN_ALLOW_THREADS
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            released.wait(guard, [this] { return !writer && !writers_waiting; });
+            ++readers;
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    void unlock_shared() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (--readers == 0)
+            released.notify_all();
+    }
+
+    void lock() {
+        Py_BEGIN_ALLOW_THREADS
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            ++writers_waiting;
+            released.wait(guard, [this] { return !writer && !readers; });
+            --writers_waiting;
+            writer = true;
+        }
+        Py_END_ALLOW_THREADS
+    }
+
+    void unlock() {
+        std::lock_guard<std::mutex> guard(mutex);
+        writer = false;
+        released.notify_all();
+    }
+
+ private:
+    std::mutex mutex;
+    std::condition_variable released;
+    int readers = 0;
+    int writers_waiting = 0;
+    bool writer = false;
+};
+
+/*
+ * Hold the lock of an index shared or alone for the rest of the method. A
+ * ReadGuard of NULL holds nothing, for another index that may be the same one.
+ */
+class ReadGuard {
+ public:
+    explicit ReadGuard(IndexLock *lock) : lock(lock) { if (lock) lock->lock_shared(); }
+    ~ReadGuard() { if (lock) lock->unlock_shared(); }
+    ReadGuard(const ReadGuard &) = delete;
+    ReadGuard &operator=(const ReadGuard &) = delete;
+
+ private:
+    IndexLock *lock;
+};
+
+class WriteGuard {
+ public:
+    explicit WriteGuard(IndexLock *lock) : lock(lock) { lock->lock(); }
+    ~WriteGuard() { lock->unlock(); }
+    WriteGuard(const WriteGuard &) = delete;
+    WriteGuard &operator=(const WriteGuard &) = delete;
+
+ private:
+    IndexLock *lock;
+};
+
 typedef struct {
     PyObject_HEAD
     Mrpt *ptr;
-    float *data;
-    bool mmap;
+    IndexLock *lock; // held shared by the methods reading the index and alone by those modifying it
+    bool mmap; // whether the data is a mapped file, which the index then owns
     int n;
     int dim;
+    int n_inserted;
+    bool query_only; // whether the data was released with only a quantized copy of it left
+    bool byte_data; // whether the index holds 8-bit data, without floats
+    Py_buffer *index_buffer; // the buffer a zero-copy load_bytes uses the index from, or NULL
+    mrpt_async::AsyncQueries *async_queries; // started by the first ann_submit, or NULL
+    int async_max_batch, async_max_wait_us;
+    mrpt_cache::SessionCache *page_sessions; // made by the first ann_pages, or NULL
+    int page_capacity, page_ttl_ms; // the settings of page_sessions
+    char *pending_file; // the data file build reads while it builds the trees, or NULL
+    size_t pending_offset; // the offset of the data in pending_file
+    float *pending_data; // the buffer the data of pending_file is read into
+#ifndef _WIN32
+    mrpt_http::RangeClient *range_source; // reads the index of the last load_url, or NULL
+#endif
 } mrptIndex;
 
 static PyObject *Mrpt_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
@@ -41,59 +177,260 @@ static PyObject *Mrpt_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
     self = reinterpret_cast<mrptIndex *>(type->tp_alloc(type, 0));
     if (self != NULL) {
         self->ptr = NULL;
-        self->data = NULL;
+        self->lock = new (std::nothrow) IndexLock;
+        if (!self->lock) {
+            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+            return PyErr_NoMemory();
+        }
+        self->mmap = false;
+        self->n_inserted = 0;
+        self->query_only = false;
+        self->byte_data = false;
+        self->index_buffer = NULL;
+        self->async_queries = NULL;
+        self->async_max_batch = 256;
+        self->async_max_wait_us = 0;
+        self->page_sessions = NULL;
+        self->page_capacity = 1024;
+        self->page_ttl_ms = 60000;
+        self->pending_file = NULL;
+        self->pending_offset = 0;
+        self->pending_data = NULL;
+#ifndef _WIN32
+        self->range_source = NULL;
+#endif
     }
     return reinterpret_cast<PyObject *>(self);
 }
 
-float *read_memory(char *file, int n, int dim) {
-    float *data = new float[n * dim];
+/*
+ * Requests transparent huge pages for the whole 2 MB pages of the bytes at p.
+ * Where huge pages are unavailable the hint fails and normal pages are used.
+ */
+static void advise_huge_pages(void *p, size_t bytes) {
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    const uintptr_t huge_page = 2 << 20;
+    const uintptr_t begin = (reinterpret_cast<uintptr_t>(p) + huge_page - 1) & ~(huge_page - 1);
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(p) + bytes) & ~(huge_page - 1);
+    if (end > begin)
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Fills the size floats of data from src, or from the file fd starting at offset
+ * if src is NULL, in chunks of 4 MB that are dealt to the OpenMP threads in turn. A page is
+ * placed in the NUMA node of the thread that first writes it, so when the
+ * threads are bound to all nodes (OMP_PROC_BIND=spread) the data is
+ * interleaved across the nodes instead of filling the node of one thread.
+ */
+static bool fill_interleaved(float *data, const float *src, FILE *fd, size_t size, size_t offset = 0) {
+#ifdef _WIN32
+    if (!src)
+        return fread(data, sizeof(float), size, fd) == size;
+#endif
+    const size_t chunk = (4 << 20) / sizeof(float);
+    const long long n_chunks = (size + chunk - 1) / chunk;
+    int failed = 0;
+
+    #pragma omp parallel for schedule(static, 1) reduction(+:failed)
+    for (long long c = 0; c < n_chunks; ++c) {
+        const size_t first = c * chunk, n = std::min(chunk, size - first);
+        if (src) {
+            std::copy(src + first, src + first + n, data + first);
+            continue;
+        }
+#ifndef _WIN32
+        char *buf = reinterpret_cast<char *>(data + first);
+        size_t done = 0;
+        while (done < n * sizeof(float)) {
+            const ssize_t got = pread(fileno(fd), buf + done, n * sizeof(float) - done,
+                                      offset + first * sizeof(float) + done);
+            if (got <= 0)
+                break;
+            done += got;
+        }
+        failed += done != n * sizeof(float);
+#endif
+    }
+    return !failed;
+}
 
+/*
+ * Reads the header of a data file into header.
+ * @return 1 if the file has a header, 0 if it holds only the data, and -1 if it
+ * cannot be read or its header is invalid.
+ */
+static int read_data_header(const char *file, mrpt_data::DataFileHeader &header) {
     FILE *fd;
     if ((fd = fopen(file, "rb")) == NULL)
+        return -1;
+    const int has_header = mrpt_data::read_header(fd, header);
+    fclose(fd);
+    return has_header;
+}
+
+float *read_memory(char *file, int n, int dim, size_t offset, bool interleave = false, bool huge_pages = false) {
+    FILE *fd;
+    if ((fd = fopen(file, "rb")) == NULL || fseek(fd, offset, SEEK_SET) != 0) {
+        if (fd)
+            fclose(fd);
         return NULL;
+    }
 
-    int read = fread(data, sizeof(float), n * dim, fd);
-    if (read != n * dim)
+    const size_t size = static_cast<size_t>(n) * dim;
+    float *data = new (std::nothrow) float[size];
+    if (data != NULL && huge_pages)
+        advise_huge_pages(data, sizeof(float) * size);
+    if (data == NULL || !(interleave ? fill_interleaved(data, NULL, fd, size, offset)
+                                     : fread(data, sizeof(float), size, fd) == size)) {
+        delete[] data;
+        fclose(fd);
         return NULL;
+    }
 
     fclose(fd);
     return data;
 }
 
-#ifndef _WIN32
-float *read_mmap(char *file, int n, int dim) {
+/*
+ * Maps a data file whose data starts at offset, and returns the start of the data.
+ */
+float *read_mmap(char *file, int n, int dim, size_t offset, bool huge_pages = false) {
     FILE *fd;
     if ((fd = fopen(file, "rb")) == NULL)
         return NULL;
 
-    float *data;
-
-    if ((data = reinterpret_cast<float *> (
-#ifdef MAP_POPULATE
-            mmap(0, n * dim * sizeof(float), PROT_READ,
-            MAP_SHARED | MAP_POPULATE, fileno(fd), 0))) == MAP_FAILED) {
-#else
-            mmap(0, n * dim * sizeof(float), PROT_READ,
-            MAP_SHARED, fileno(fd), 0))) == MAP_FAILED) {
-#endif
-            return NULL;
+    const size_t bytes = offset + sizeof(float) * n * dim;
+    char *mapping = static_cast<char *>(mrpt_mmap::map_file(fd, bytes, true));
+    if (mapping == NULL) {
+        fclose(fd);
+        return NULL;
     }
 
+    // huge pages of a file mapping need support from the file system, and are otherwise refused
+    if (huge_pages)
+        advise_huge_pages(mapping, bytes);
+
     fclose(fd);
-    return data;
+    return reinterpret_cast<float *>(mapping + offset);
+}
+
+/*
+ * Returns true if the file is a .bvecs file, in which each point is its dimension
+ * as a 32-bit integer followed by its components as bytes.
+ */
+static bool is_bvecs(const char *file) {
+    const size_t length = file ? strlen(file) : 0;
+    return length >= 6 && strcmp(file + length - 6, ".bvecs") == 0;
+}
+
+/*
+ * Reads the shape of a .bvecs file from the dimension of its first point and its size.
+ * @return false if the file cannot be read or its size is not a whole number of points
+ */
+static bool read_bvecs_shape(const char *file, int &n, int &dim) {
+    FILE *fd;
+    struct stat sb;
+    int32_t first_dim = 0;
+    if (stat(file, &sb) != 0 || (fd = fopen(file, "rb")) == NULL)
+        return false;
+    const bool read = fread(&first_dim, sizeof(first_dim), 1, fd) == 1;
+    fclose(fd);
+    const size_t row_bytes = sizeof(int32_t) + (size_t) first_dim;
+    if (!read || first_dim <= 0 || sb.st_size % row_bytes != 0)
+        return false;
+    n = sb.st_size / row_bytes;
+    dim = first_dim;
+    return true;
+}
+
+/*
+ * Maps the .bvecs file of n points of dimension dim, and constructs an index that
+ * copies the bytes of its points out of the mapping.
+ */
+static Mrpt *read_bvecs(const char *file, int n, int dim, int n_trees, int depth, float density, unsigned seed,
+                        Mrpt::Projection projection) {
+    FILE *fd;
+    if ((fd = fopen(file, "rb")) == NULL)
+        return NULL;
+    const size_t row_bytes = sizeof(int32_t) + dim, bytes = row_bytes * n;
+    uint8_t *mapping = static_cast<uint8_t *>(mrpt_mmap::map_file(fd, bytes));
+    fclose(fd);
+    if (mapping == NULL)
+        return NULL;
+    Mrpt *index = new Mrpt(mapping + sizeof(int32_t), dim, n, false, row_bytes, n_trees, depth, density, seed,
+                           projection);
+    mrpt_mmap::unmap_file(mapping, bytes);
+    return index;
 }
-#endif
 
 static int Mrpt_init(mrptIndex *self, PyObject *args) {
     PyObject *py_data;
     int depth, n_trees, n, dim, mmap;
     float density;
+    unsigned int seed = 0;
+    int projection = Mrpt::GAUSSIAN, numa = 0, huge_pages = 0, metric = Mrpt::EUCLIDEAN, pipelined = 0;
+
+    if (!PyArg_ParseTuple(args, "Oiiiifi|Iiiiii", &py_data, &n, &dim, &depth, &n_trees, &density, &mmap, &seed,
+                          &projection, &numa, &huge_pages, &metric, &pipelined))
+        return -1;
+
+    if (projection < Mrpt::GAUSSIAN || projection > Mrpt::HADAMARD) {
+        PyErr_SetString(PyExc_ValueError, "Unknown projection type");
+        return -1;
+    }
+
+    if (metric < Mrpt::EUCLIDEAN || metric > Mrpt::COSINE) {
+        PyErr_SetString(PyExc_ValueError, "Unknown metric");
+        return -1;
+    }
+
+    self->n = n;
+    self->dim = dim;
 
-    if (!PyArg_ParseTuple(args, "Oiiiifi", &py_data, &n, &dim, &depth, &n_trees, &density, &mmap))
+    // 8-bit data is copied into the index a byte per component, and read from .bvecs files by mapping them
+    const bool byte_array = PyArray_Check(py_data) &&
+                            (PyArray_TYPE(reinterpret_cast<PyArrayObject *>(py_data)) == NPY_UINT8 ||
+                             PyArray_TYPE(reinterpret_cast<PyArrayObject *>(py_data)) == NPY_INT8);
+#if PY_MAJOR_VERSION >= 3
+    const bool bvecs = PyUnicode_Check(py_data) && is_bvecs(PyBytes_AsString(py_data));
+#else
+    const bool bvecs = PyString_Check(py_data) && is_bvecs(PyString_AsString(py_data));
+#endif
+    if ((byte_array || bvecs) && metric != Mrpt::EUCLIDEAN) {
+        PyErr_SetString(PyExc_ValueError, "8-bit data is only supported with the euclidean metric");
         return -1;
+    }
+    if (byte_array) {
+        PyArrayObject *array = reinterpret_cast<PyArrayObject *>(py_data);
+        const bool is_signed = PyArray_TYPE(array) == NPY_INT8;
+        self->byte_data = true;
+        self->ptr = new Mrpt(static_cast<const uint8_t *>(PyArray_DATA(array)), dim, n, is_signed,
+                             PyArray_STRIDE(array, 0), n_trees, depth, density, seed,
+                             static_cast<Mrpt::Projection>(projection));
+        self->ptr->set_huge_pages(huge_pages);
+        return 0;
+    }
+    if (bvecs) {
+        char *file = PyBytes_AsString(py_data);
+        int file_n, file_dim;
+        if (!read_bvecs_shape(file, file_n, file_dim) || file_n != n || file_dim != dim) {
+            PyErr_SetString(PyExc_ValueError, "The .bvecs file cannot be read or does not hold N x dim points");
+            return -1;
+        }
+        self->byte_data = true;
+        self->ptr = read_bvecs(file, n, dim, n_trees, depth, density, seed, static_cast<Mrpt::Projection>(projection));
+        if (self->ptr == NULL) {
+            PyErr_SetString(PyExc_IOError, "Unable to map the .bvecs file");
+            return -1;
+        }
+        self->ptr->set_huge_pages(huge_pages);
+        return 0;
+    }
 
     float *data;
+    Mrpt::Data given;
 #if PY_MAJOR_VERSION >= 3
     if (PyUnicode_Check(py_data)) {
         char *file = PyBytes_AsString(py_data);
@@ -108,63 +445,255 @@ static int Mrpt_init(mrptIndex *self, PyObject *args) {
             return -1;
         }
 
-        if (sb.st_size != static_cast<unsigned>(sizeof(float) * dim * n)) {
+        // a file with a header starts with its shape, and the data after it is aligned to 64 bytes
+        mrpt_data::DataFileHeader header;
+        const int has_header = read_data_header(file, header);
+        if (has_header < 0) {
+            PyErr_SetString(PyExc_ValueError, "The header of the data file is invalid");
+            return -1;
+        }
+        if (has_header && (header.n != n || header.dim != dim)) {
+            PyErr_SetString(PyExc_ValueError, "The shape does not match the header of the data file");
+            return -1;
+        }
+        const size_t offset = has_header ? header.data_offset : 0;
+
+        if (static_cast<size_t>(sb.st_size) != offset + sizeof(float) * dim * n) {
             PyErr_SetString(PyExc_ValueError, "Size of the input is not N x dim");
             return -1;
         }
 
-#ifndef _WIN32
-        data = mmap ? read_mmap(file, n, dim) : read_memory(file, n, dim);
-#else
-        data = read_memory(file, n, dim);
-#endif
+        if (pipelined && !mmap) {
+            // build reads the file into the buffer while it projects the points read so far
+            data = new (std::nothrow) float[static_cast<size_t>(n) * dim];
+            self->pending_file = data ? strdup(file) : NULL;
+            self->pending_offset = offset;
+            self->pending_data = data;
+            if (data && !self->pending_file) {
+                delete[] data;
+                data = NULL;
+            }
+            if (data && huge_pages)
+                advise_huge_pages(data, sizeof(float) * n * dim);
+        } else {
+            data = mmap ? read_mmap(file, n, dim, offset, huge_pages)
+                        : read_memory(file, n, dim, offset, numa, huge_pages);
+        }
 
         if (data == NULL) {
             PyErr_SetString(PyExc_IOError, "Unable to read data from file or allocate memory for it");
             return -1;
         }
 
+        // the data read from a file belongs to the index
         self->mmap = mmap;
-        self->data = data;
+        if (mmap) {
+            char *mapping = reinterpret_cast<char *>(data) - offset;
+            const size_t bytes = offset + sizeof(float) * n * dim;
+            given = Mrpt::Data::adopt(data, dim, n, [mapping, bytes] { mrpt_mmap::unmap_file(mapping, bytes); },
+                                      true);
+        } else {
+            given = Mrpt::Data::adopt(data, dim, n, [data] { delete[] data; });
+        }
+    } else if (numa) {
+        // the array was first touched by the thread that created it, so the index uses an interleaved copy
+        const size_t size = static_cast<size_t>(n) * dim;
+        data = new (std::nothrow) float[size];
+        if (data == NULL) {
+            PyErr_SetString(PyExc_MemoryError, "Unable to allocate memory for the data");
+            return -1;
+        }
+        if (huge_pages)
+            advise_huge_pages(data, sizeof(float) * size);
+        fill_interleaved(data, reinterpret_cast<float *>(PyArray_DATA(py_data)), NULL, size);
+        given = Mrpt::Data::adopt(data, dim, n, [data] { delete[] data; });
     } else {
-        data = reinterpret_cast<float *>(PyArray_DATA(py_data));
+        // MRPTIndex keeps a reference to the array
+        given = Mrpt::Data::borrow(reinterpret_cast<float *>(PyArray_DATA(py_data)), dim, n);
     }
 
-    self->n = n;
-    self->dim = dim;
-
-    Eigen::Map<const MatrixXf> *X = new Eigen::Map<const MatrixXf>(data, dim, n);
-    self->ptr = new Mrpt(X, n_trees, depth, density);
+    self->ptr = new Mrpt(std::move(given), n_trees, depth, density, seed, static_cast<Mrpt::Projection>(projection),
+                         static_cast<Mrpt::Metric>(metric));
+    self->ptr->set_huge_pages(huge_pages);
 
     return 0;
 }
 
+/*
+ * Returns false and raises an exception if the data was released after the
+ * build and only the approximate queries can be answered from its quantized copy.
+ */
+static bool check_data(mrptIndex *self) {
+    if (self->pending_file) {
+        PyErr_SetString(PyExc_RuntimeError, "The data is read from the file by build");
+        return false;
+    }
+    if (self->query_only)
+        PyErr_SetString(PyExc_RuntimeError, "The data was released, only approximate queries are possible");
+    return !self->query_only;
+}
+
+/*
+ * Returns false and raises an exception, as check_data, if the data was released
+ * or if the index holds 8-bit data, which the methods reading the data as floats
+ * cannot use.
+ */
+static bool check_float_data(mrptIndex *self) {
+    if (!check_data(self))
+        return false;
+    if (self->byte_data)
+        PyErr_SetString(PyExc_RuntimeError, "The index holds 8-bit data, which this method does not support");
+    return !self->byte_data;
+}
+
 static PyObject *build(mrptIndex *self, PyObject *args) {
-    int keep_data;
+    const WriteGuard guard(self->lock);
+    int keep_data, reorder_data = 0;
+    Py_ssize_t memory_limit = 0;
+    PyObject *progress = Py_None;
+    double progress_interval = 1;
+    int split_sample = 0, build_sample = 0, max_leaf_size = 0, split_candidates = 1, first_tree = 0, last_tree = -1;
+    const char *checkpoint_dir = NULL;
+    int checkpoint_trees = 10;
+
+    if (!PyArg_ParseTuple(args, "i|inOdiiiiiizi", &keep_data, &reorder_data, &memory_limit, &progress,
+                          &progress_interval, &split_sample, &build_sample, &max_leaf_size, &split_candidates,
+                          &first_tree, &last_tree, &checkpoint_dir, &checkpoint_trees) ||
+        (!self->pending_file && !(reorder_data ? check_float_data(self) : check_data(self))))
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "i", &keep_data))
+    if (memory_limit < 0) {
+        PyErr_SetString(PyExc_ValueError, "memory_limit must be non-negative");
+        return NULL;
+    }
+    if (split_sample < 0 || build_sample < 0 || max_leaf_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "split_sample, build_sample and max_leaf_size must be non-negative");
         return NULL;
+    }
+    if (progress != Py_None && !PyCallable_Check(progress)) {
+        PyErr_SetString(PyExc_TypeError, "progress must be callable");
+        return NULL;
+    }
+
+    // the callback runs on a building thread, which takes the GIL for it; the first
+    // exception it raises stops the reports and is raised when the build is done
+    PyObject *error_type = NULL, *error_value = NULL, *error_traceback = NULL;
+    if (progress != Py_None) {
+        self->ptr->set_progress_callback([&](int n_built, int n_trees) {
+            PyGILState_STATE state = PyGILState_Ensure();
+            if (!error_type) {
+                PyObject *result = PyObject_CallFunction(progress, "ii", n_built, n_trees);
+                if (result)
+                    Py_DECREF(result);
+                else
+                    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+            }
+            PyGILState_Release(state);
+        }, progress_interval);
+    }
+
+    self->ptr->set_split_sample(split_sample);
+    self->ptr->set_build_sample(build_sample);
+    self->ptr->set_leaf_size_limit(max_leaf_size);
+    self->ptr->set_split_candidates(split_candidates);
+    // the data of a pending file is read while the trees are built
+    std::unique_ptr<mrpt_data::PipelinedReader> reader;
+    if (self->pending_file) {
+        reader.reset(new mrpt_data::PipelinedReader(self->pending_file, self->pending_offset,
+                                                    self->pending_data,
+                                                    sizeof(float) * self->n * self->dim, sizeof(float) * self->dim));
+        free(self->pending_file);
+        self->pending_file = NULL;
+        self->pending_data = NULL;
+    }
 
-    self->ptr->grow(keep_data);
+    // the data is released after reorder_data, which copies it
+    bool released = false, grown = true, read = true;
+    Py_BEGIN_ALLOW_THREADS
+    if (reader && last_tree < 0 && !checkpoint_dir) {
+        read = self->ptr->grow_pipelined(true, memory_limit, [&](int n) { return reader->wait_rows(n); });
+        read = reader->join() && read;
+    } else {
+        if (reader)
+            read = reader->wait_rows(self->n) && reader->join();
+        if (read && checkpoint_dir)
+            grown = self->ptr->grow_checkpointed(checkpoint_dir, checkpoint_trees, true, memory_limit, self->mmap);
+        else if (read && last_tree < 0)
+            self->ptr->grow(true, memory_limit, self->mmap);
+        else if (read)
+            grown = self->ptr->grow_part(first_tree, last_tree, true, memory_limit, self->mmap);
+    }
+    grown = grown && read;
+    if (grown && reorder_data)
+        self->ptr->reorder_data();
+    if (grown && !keep_data)
+        released = self->ptr->release_data();
+    Py_END_ALLOW_THREADS
+    self->ptr->set_progress_callback(Mrpt::ProgressCallback());
+
+    if (!read) {
+        PyErr_SetString(PyExc_IOError, "Unable to read data from file");
+        return NULL;
+    }
+    if (!grown && checkpoint_dir) {
+        PyErr_SetString(PyExc_ValueError, "A checkpointed build needs a nonzero seed and a projection other than "
+                                          "hadamard, and checkpoint_dir an existing directory the parts can be "
+                                          "saved to and loaded from");
+        return NULL;
+    }
+    if (!grown) {
+        PyErr_SetString(PyExc_ValueError, "A part of the trees needs a nonzero seed and a projection other than hadamard");
+        return NULL;
+    }
 
-    if(!keep_data) {
-        delete[] self->data;
+    if (error_type) {
+        PyErr_Restore(error_type, error_value, error_traceback);
+        return NULL;
     }
 
+    // the index releases the data it owns unless the queries read it; without a reordered copy
+    // the queries are then answered from the quantized copy only
+    if (released)
+        self->query_only = !reorder_data;
+
     Py_RETURN_NONE;
 }
 
-static void mrpt_dealloc(mrptIndex *self) {
-    if (self->data) {
-#ifndef _WIN32
-        if (self->mmap)
-            munmap(self->data, self->n * self->dim * sizeof(float));
-        else
-#endif
-            delete[] self->data;
+/*
+ * Releases the buffer of a zero-copy load_bytes, once the index no longer uses it.
+ */
+static void release_index_buffer(mrptIndex *self) {
+    if (self->index_buffer) {
+        PyBuffer_Release(self->index_buffer);
+        delete self->index_buffer;
+        self->index_buffer = NULL;
+    }
+}
+
+/*
+ * Answers the pending ann_submit queries and stops their dispatcher thread. The
+ * GIL is released meanwhile, since the callbacks take it.
+ */
+static void stop_async_queries(mrptIndex *self) {
+    if (self->async_queries) {
+        Py_BEGIN_ALLOW_THREADS
+        delete self->async_queries;
+        Py_END_ALLOW_THREADS
+        self->async_queries = NULL;
     }
+}
+
+static void mrpt_dealloc(mrptIndex *self) {
+    stop_async_queries(self);
+    delete self->page_sessions;
+    free(self->pending_file);
     if (self->ptr)
         delete self->ptr;
+#ifndef _WIN32
+    delete self->range_source;
+#endif
+    release_index_buffer(self);
+    delete self->lock;
     Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
 }
 
@@ -186,29 +715,140 @@ static PyArrayObject* vector_to_nparray(const std::vector<T>& vec, int type_num
    // no data at all
    } else {
       npy_intp dims[1] = {0};
-      return (PyArrayObject*) PyArray_ZEROS(1, dims, PyArray_FLOAT, 0);
+      return (PyArrayObject*) PyArray_ZEROS(1, dims, type_num, 0);
    }
 
 }
 
+/*
+ * Float32 vectors given from Python, as a vector or as a matrix with one vector
+ * per row, from an ndarray or any object with the buffer protocol. The rows are
+ * used in place when their components are contiguous and aligned, whatever the
+ * stride between the rows, so slices of larger arrays are not copied; other
+ * layouts are copied into a C-contiguous array.
+ */
+struct FloatRows {
+    PyArrayObject *array; // a reference to the array the rows are read from
+    const float *data;
+    int n, dim;
+    npy_intp stride; // the distance between the starts of consecutive rows, in floats
+    bool single; // whether a vector was given rather than a matrix
+
+    FloatRows() : array(NULL), data(nullptr), n(0), dim(0), stride(0), single(false) { }
+    ~FloatRows() { Py_XDECREF(array); }
+
+    const float *row(int i) const {
+        return data + i * stride;
+    }
+
+    Eigen::Map<const VectorXf> vector(int i = 0) const {
+        return Eigen::Map<const VectorXf>(row(i), dim);
+    }
+
+    Eigen::Map<const MatrixXf, 0, Eigen::OuterStride<>> matrix() const {
+        return Eigen::Map<const MatrixXf, 0, Eigen::OuterStride<>>(data, dim, n, Eigen::OuterStride<>(stride));
+    }
+};
+
+/*
+ * Reads the float32 vectors of o into rows, and checks that they have dimension dim.
+ * @return False with an exception set if o is not a float32 vector or matrix of that dimension.
+ */
+static bool get_rows(PyObject *o, int dim, FloatRows &rows) {
+    PyArrayObject *a = reinterpret_cast<PyArrayObject *>(PyArray_FromAny(o, NULL, 1, 2, 0, NULL));
+    if (!a)
+        return false;
+    if (PyArray_TYPE(a) != NPY_FLOAT32) {
+        Py_DECREF(a);
+        PyErr_SetString(PyExc_ValueError, "The vectors should have type float32");
+        return false;
+    }
+
+    const bool single = PyArray_NDIM(a) == 1;
+    const npy_intp n = single ? 1 : PyArray_DIM(a, 0), row_dim = PyArray_DIM(a, single ? 0 : 1);
+    const npy_intp row_stride = single ? 0 : PyArray_STRIDE(a, 0), component_stride = PyArray_STRIDE(a, single ? 0 : 1);
+    if (row_dim != dim) {
+        Py_DECREF(a);
+        PyErr_Format(PyExc_ValueError, "The vectors should have dimension %d", dim);
+        return false;
+    }
+    if (n > std::numeric_limits<int>::max()) {
+        Py_DECREF(a);
+        PyErr_SetString(PyExc_ValueError, "Too many vectors");
+        return false;
+    }
+
+    const bool in_place = PyArray_ISALIGNED(a) && (component_stride == sizeof(float) || row_dim <= 1) &&
+                          (n <= 1 || (row_stride > 0 && row_stride % sizeof(float) == 0));
+    if (!in_place) {
+        PyArrayObject *copy = reinterpret_cast<PyArrayObject *>(PyArray_NewCopy(a, NPY_CORDER));
+        Py_DECREF(a);
+        if (!copy)
+            return false;
+        a = copy;
+    }
+
+    rows.array = a;
+    rows.data = reinterpret_cast<const float *>(PyArray_DATA(a));
+    rows.n = n;
+    rows.dim = dim;
+    rows.stride = in_place && n > 1 ? row_stride / (npy_intp) sizeof(float) : dim;
+    rows.single = single;
+    return true;
+}
+
 static PyArrayObject *get_leaves(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
     PyObject *v;
-    int n,dim;
+    FloatRows q;
 
-    if (!PyArg_ParseTuple(args, "O", &v))
+    if (!PyArg_ParseTuple(args, "O", &v) || !get_rows(v, self->dim, q))
         return NULL;
 
-    float *indata = reinterpret_cast<float *>(PyArray_DATA(v));
-
     std::vector<int> leaf_indices;
 
-    dim = PyArray_DIM(v, 0);
-    self->ptr->get_leaf_indices(Eigen::Map<VectorXf>(indata, dim), &leaf_indices);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->get_leaf_indices(q.vector(), &leaf_indices);
+    Py_END_ALLOW_THREADS
     PyArrayObject *leaves = vector_to_nparray(leaf_indices,PyArray_INT);
     return leaves;
 }
 
+static PyObject *get_leaves_batch(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "O", &v) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    // the arrays are sized by counting the points of the leaves before they are written
+    MatrixXi found_leaves;
+    npy_intp n_rows = q.n + 1;
+    PyObject *indptr = PyArray_SimpleNew(1, &n_rows, NPY_INT64);
+    if (!indptr)
+        return NULL;
+    int64_t *offsets = reinterpret_cast<int64_t *>(PyArray_DATA(indptr));
+    Py_BEGIN_ALLOW_THREADS
+    found_leaves = self->ptr->find_leaves_batch(q.matrix());
+    self->ptr->count_leaf_points(found_leaves, offsets);
+    Py_END_ALLOW_THREADS
+
+    npy_intp n_points = offsets[q.n];
+    PyObject *indices = PyArray_SimpleNew(1, &n_points, NPY_INT);
+    if (!indices) {
+        Py_DECREF(indptr);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->copy_leaf_points(found_leaves, offsets, reinterpret_cast<int *>(PyArray_DATA(indices)));
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("(NN)", indptr, indices);
+}
+
 static PyArrayObject *filter_leaves_by_votes(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
     PyObject *l;
 
     int num_leaves,votes_required, dim;
@@ -219,7 +859,9 @@ static PyArrayObject *filter_leaves_by_votes(mrptIndex *self, PyObject *args) {
     std::vector<int> voted_leaves;
     const int *leaves = reinterpret_cast<int *>(PyArray_DATA(l));
 
+    Py_BEGIN_ALLOW_THREADS
     self->ptr->filter_leaves_by_votes(leaves,num_leaves,&voted_leaves,votes_required);
+    Py_END_ALLOW_THREADS
 
     PyArrayObject *final_leaves = vector_to_nparray(voted_leaves,PyArray_INT);
     return final_leaves;
@@ -227,226 +869,2516 @@ static PyArrayObject *filter_leaves_by_votes(mrptIndex *self, PyObject *args) {
 }
 
 static PyObject *ann_from_leaves(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
     PyObject *v;
     PyObject *l;
-    int k, elect, dim, num_leaves, return_distances;
+    int k, elect, num_leaves, return_distances;
+    FloatRows q;
 
-    if (!PyArg_ParseTuple(args, "OOiiii", &v, &l, &num_leaves, &k, &elect, &return_distances))
+    if (!PyArg_ParseTuple(args, "OOiiii", &v, &l, &num_leaves, &k, &elect, &return_distances) ||
+        !get_rows(v, self->dim, q))
         return NULL;
 
-    float *indata = reinterpret_cast<float *>(PyArray_DATA(v));
     const int *leaves = reinterpret_cast<int *>(PyArray_DATA(l));
     PyObject *nearest;
-    dim = PyArray_DIM(v, 0);
     npy_intp dims[1] = {k};
     nearest = PyArray_SimpleNew(1, dims, NPY_INT);
     int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
     if (return_distances) {
         PyObject *distances = PyArray_SimpleNew(1, dims, NPY_FLOAT32);
         float *out_distances = reinterpret_cast<float *>(PyArray_DATA(distances));
-        self->ptr->query_from_leaves(Eigen::Map<VectorXf>(indata, dim), leaves, num_leaves, k, elect, outdata, out_distances);
+        Py_BEGIN_ALLOW_THREADS
+        self->ptr->query_from_leaves(q.vector(), leaves, num_leaves, k, elect, outdata, out_distances);
+        Py_END_ALLOW_THREADS
 
         PyObject *out_tuple = PyTuple_New(2);
         PyTuple_SetItem(out_tuple, 0, nearest);
         PyTuple_SetItem(out_tuple, 1, distances);
         return out_tuple;
     } else {
-        self->ptr->query_from_leaves(Eigen::Map<VectorXf>(indata, dim), leaves, num_leaves, k, elect, outdata);
+        Py_BEGIN_ALLOW_THREADS
+        self->ptr->query_from_leaves(q.vector(), leaves, num_leaves, k, elect, outdata);
+        Py_END_ALLOW_THREADS
         return nearest;
     }
 
 }
 
-static PyObject *ann(mrptIndex *self, PyObject *args) {
-    PyObject *v;
-    int k, elect, dim, n, return_distances;
+/*
+ * Checks that indptr and leaves are an int64 and an int32 array that hold the
+ * candidate sets of n_sets queries in the layout of a CSR matrix.
+ */
+static bool check_leaf_sets(PyObject *indptr, PyObject *leaves, npy_intp n_sets) {
+    PyArrayObject *p = reinterpret_cast<PyArrayObject *>(indptr), *l = reinterpret_cast<PyArrayObject *>(leaves);
+    if (!PyArray_Check(indptr) || PyArray_TYPE(p) != NPY_INT64 || PyArray_NDIM(p) != 1 ||
+        !PyArray_ISCARRAY_RO(p) || PyArray_DIM(p, 0) != n_sets + 1 ||
+        !PyArray_Check(leaves) || PyArray_TYPE(l) != NPY_INT || PyArray_NDIM(l) != 1 || !PyArray_ISCARRAY_RO(l)) {
+        PyErr_SetString(PyExc_ValueError, "The leaf sets should be a contiguous int64 indptr array with one "
+                                          "element more than there are queries and a contiguous int32 array");
+        return false;
+    }
+    const int64_t *offsets = reinterpret_cast<const int64_t *>(PyArray_DATA(p));
+    for (npy_intp i = 0; i < n_sets; ++i) {
+        if (offsets[i] > offsets[i + 1]) {
+            PyErr_SetString(PyExc_ValueError, "indptr should be non-decreasing");
+            return false;
+        }
+    }
+    if (offsets[0] != 0 || offsets[n_sets] != PyArray_DIM(l, 0)) {
+        PyErr_SetString(PyExc_ValueError, "indptr should start at 0 and end at the length of the leaves");
+        return false;
+    }
+    return true;
+}
 
-    if (!PyArg_ParseTuple(args, "Oiii", &v, &k, &elect, &return_distances))
+static PyObject *filter_leaves_by_votes_batch(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *indptr, *l;
+    int votes_required;
+
+    if (!PyArg_ParseTuple(args, "OOi", &indptr, &l, &votes_required))
+        return NULL;
+    PyArrayObject *p = reinterpret_cast<PyArrayObject *>(indptr);
+    const npy_intp n_sets = PyArray_Check(indptr) && PyArray_SIZE(p) > 0 ? PyArray_SIZE(p) - 1 : 0;
+    if (!check_leaf_sets(indptr, l, n_sets))
         return NULL;
 
-    float *indata = reinterpret_cast<float *>(PyArray_DATA(v));
-    PyObject *nearest;
+    const int64_t *offsets = reinterpret_cast<const int64_t *>(PyArray_DATA(indptr));
+    npy_intp n_rows = n_sets + 1, n_leaves = offsets[n_sets];
+    PyObject *out_indptr = PyArray_SimpleNew(1, &n_rows, NPY_INT64);
+    PyObject *out = out_indptr ? PyArray_SimpleNew(1, &n_leaves, NPY_INT) : NULL;
+    if (!out) {
+        Py_XDECREF(out_indptr);
+        return NULL;
+    }
 
-    if (PyArray_NDIM(v) == 1) {
+    int64_t n_kept;
+    Py_BEGIN_ALLOW_THREADS
+    n_kept = self->ptr->filter_leaves_by_votes_batch(n_sets, offsets,
+        reinterpret_cast<const int *>(PyArray_DATA(l)), votes_required,
+        reinterpret_cast<int64_t *>(PyArray_DATA(out_indptr)),
+        reinterpret_cast<int *>(PyArray_DATA(out)));
+    Py_END_ALLOW_THREADS
+
+    // the kept candidates are returned as a view of the first n_kept elements
+    PyObject *kept = PySequence_GetSlice(out, 0, n_kept);
+    Py_DECREF(out);
+    if (!kept) {
+        Py_DECREF(out_indptr);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", out_indptr, kept);
+}
 
-        dim = PyArray_DIM(v, 0);
+static PyObject *ann_from_leaves_batch(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *indptr, *l;
+    int k, elect, return_distances;
+    FloatRows q;
 
-        npy_intp dims[1] = {k};
-        nearest = PyArray_SimpleNew(1, dims, NPY_INT);
-        int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    if (!PyArg_ParseTuple(args, "OOOiii", &v, &indptr, &l, &k, &elect, &return_distances) ||
+        !get_rows(v, self->dim, q) || !check_leaf_sets(indptr, l, q.n))
+        return NULL;
 
-        if (return_distances) {
-            PyObject *distances = PyArray_SimpleNew(1, dims, NPY_FLOAT32);
-            float *out_distances = reinterpret_cast<float *>(PyArray_DATA(distances));
-            self->ptr->query(Eigen::Map<VectorXf>(indata, dim), k, elect, outdata, out_distances);
+    const int64_t *offsets = reinterpret_cast<const int64_t *>(PyArray_DATA(indptr));
+    const int *leaves = reinterpret_cast<const int *>(PyArray_DATA(l));
+    npy_intp dims[2] = {q.n, k};
+    PyObject *nearest = PyArray_SimpleNew(2, dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(2, dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
 
-            PyObject *out_tuple = PyTuple_New(2);
-            PyTuple_SetItem(out_tuple, 0, nearest);
-            PyTuple_SetItem(out_tuple, 1, distances);
-            return out_tuple;
-        } else {
-            self->ptr->query(Eigen::Map<VectorXf>(indata, dim), k, elect, outdata);
-            return nearest;
-        }
-    } else {
-        n = PyArray_DIM(v, 0);
-        dim = PyArray_DIM(v, 1);
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances))
+                                     : nullptr;
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->query_from_leaves_batch(q.matrix(), offsets, leaves, k, elect, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
 
-        npy_intp dims[2] = {n, k};
-        nearest = PyArray_SimpleNew(2, dims, NPY_INT);
-        int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+static PyObject *knn_graph(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    int k, votes_required, return_distances;
 
-        if (return_distances) {
-            npy_intp dims[2] = {n, k};
-            PyObject *distances = PyArray_SimpleNew(2, dims, NPY_FLOAT32);
-            float *distances_out = reinterpret_cast<float *>(PyArray_DATA(distances));
+    if (!PyArg_ParseTuple(args, "iii", &k, &votes_required, &return_distances) || !check_float_data(self))
+        return NULL;
 
-            for (int i = 0; i < n; ++i) {
-                self->ptr->query(Eigen::Map<VectorXf>(indata + i * dim, dim),
-                                 k, elect, outdata + i * k, distances_out + i * k);
-            }
-            PyObject *out_tuple = PyTuple_New(2);
-            PyTuple_SetItem(out_tuple, 0, nearest);
-            PyTuple_SetItem(out_tuple, 1, distances);
-            return out_tuple;
-        } else {
-            for (int i = 0; i < n; ++i) {
-                self->ptr->query(Eigen::Map<VectorXf>(indata + i * dim, dim),
-                                 k, elect, outdata + i * k);
-            }
-            return nearest;
-        }
+    npy_intp n_points = self->n + self->n_inserted, n_rows = n_points + 1, size = n_points * k;
+    PyObject *indptr = PyArray_SimpleNew(1, &n_rows, NPY_INT64);
+    PyObject *nearest = indptr ? PyArray_SimpleNew(1, &size, NPY_INT) : NULL;
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(1, &size, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(indptr);
+        Py_XDECREF(nearest);
+        return NULL;
     }
-}
 
-static PyObject *get_nearest_leaves(mrptIndex *self, PyObject *args) {
-    PyObject *v,*leaves;
-    int num_leaves,k,dim;
-    if (!PyArg_ParseTuple(args, "OOii", &v, &leaves, &num_leaves, &k))
+    int64_t n_found;
+    Py_BEGIN_ALLOW_THREADS
+    n_found = self->ptr->knn_graph(k, votes_required, reinterpret_cast<int64_t *>(PyArray_DATA(indptr)),
+        reinterpret_cast<int *>(PyArray_DATA(nearest)),
+        distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr);
+    Py_END_ALLOW_THREADS
+
+    // the neighbors are returned as views of the first n_found elements
+    PyObject *indices = PySequence_GetSlice(nearest, 0, n_found);
+    PyObject *kept_distances = distances ? PySequence_GetSlice(distances, 0, n_found) : NULL;
+    Py_DECREF(nearest);
+    Py_XDECREF(distances);
+    if (!indices || (distances && !kept_distances)) {
+        Py_DECREF(indptr);
+        Py_XDECREF(indices);
+        Py_XDECREF(kept_distances);
         return NULL;
-    float *indata = reinterpret_cast<float *>(PyArray_DATA(v));
-    int *leaf_index = reinterpret_cast<int *>(PyArray_DATA(leaves));
-    dim = PyArray_DIM(v, 0);
-    npy_intp dims[1] = {k};
-    PyObject *nearest = PyArray_SimpleNew(1, dims, NPY_INT);
-    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
-    VectorXi idx(num_leaves);
-    for(int i=0;i<num_leaves;i++) {
-        idx(i) = leaf_index[i];
     }
-    self->ptr->exact_knn(Eigen::Map<VectorXf>(indata, dim), k, idx, num_leaves, outdata);
-    return nearest;
+    if (!kept_distances)
+        return Py_BuildValue("(NN)", indptr, indices);
+    return Py_BuildValue("(NNN)", indptr, indices, kept_distances);
 }
 
-static PyObject *exact_search(mrptIndex *self, PyObject *args) {
+static PyObject *radius_search(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
     PyObject *v;
-    int k, n, dim, return_distances;
+    float radius;
+    int elect, return_distances;
+    FloatRows q;
 
-    if (!PyArg_ParseTuple(args, "Oii", &v, &k, &return_distances))
+    if (!PyArg_ParseTuple(args, "Ofii", &v, &radius, &elect, &return_distances) || !check_float_data(self) ||
+        !get_rows(v, self->dim, q))
         return NULL;
 
-    float *indata = reinterpret_cast<float *>(PyArray_DATA(v));
-    PyObject *nearest;
-
-    VectorXi idx(self->n);
-    std::iota(idx.data(), idx.data() + self->n, 0);
+    std::vector<int64_t> indptr;
+    std::vector<int> nearest;
+    std::vector<float> distances;
+    std::vector<float> *out_distances = return_distances ? &distances : nullptr;
+    Py_BEGIN_ALLOW_THREADS
+    if (q.single)
+        self->ptr->query_radius(q.vector(), radius, elect, &nearest, out_distances);
+    else
+        self->ptr->query_radius_batch(q.matrix(), radius, elect, &indptr, &nearest, out_distances);
+    Py_END_ALLOW_THREADS
+
+    // a single query gets its neighbors, several get them as CSR arrays
+    PyObject *result = reinterpret_cast<PyObject *>(vector_to_nparray(nearest, NPY_INT));
+    if (!q.single)
+        result = Py_BuildValue("(NN)", vector_to_nparray(indptr, NPY_INT64), result);
+    if (!return_distances)
+        return result;
+    PyObject *out = PyTuple_New(2);
+    PyTuple_SetItem(out, 0, result);
+    PyTuple_SetItem(out, 1, reinterpret_cast<PyObject *>(vector_to_nparray(distances, NPY_FLOAT32)));
+    return out;
+}
 
-    if (PyArray_NDIM(v) == 1) {
-        dim = PyArray_DIM(v, 0);
+static PyObject *set_attribute(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    const char *name;
+    PyObject *v;
 
-        npy_intp dims[1] = {k};
-        nearest = PyArray_SimpleNew(1, dims, NPY_INT);
-        int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    if (!PyArg_ParseTuple(args, "sO", &name, &v))
+        return NULL;
+    PyArrayObject *values = reinterpret_cast<PyArrayObject *>(v);
+    if (!PyArray_Check(v) || PyArray_TYPE(values) != NPY_INT || PyArray_NDIM(values) != 1 ||
+        !PyArray_ISCARRAY_RO(values) || PyArray_DIM(values, 0) != self->n + self->n_inserted) {
+        PyErr_SetString(PyExc_ValueError, "The values should be a contiguous int32 vector with a value per point");
+        return NULL;
+    }
+    self->ptr->set_attribute(name, reinterpret_cast<const int *>(PyArray_DATA(v)));
+    Py_RETURN_NONE;
+}
+
+static void delete_filter(PyObject *capsule) {
+    delete reinterpret_cast<Mrpt::Filter *>(PyCapsule_GetPointer(capsule, "mrpt.Filter"));
+}
+
+/*
+ * Makes a filter passed by the points that pass all of the given conditions:
+ * a uint8 mask with a byte per point, unless it is None, and the comparisons
+ * (name, op, value) of attributes, op being a Mrpt::Comparison. The filter is
+ * returned in a capsule for ann_filtered.
+ */
+static PyObject *make_filter(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *m, *where;
+    const int n_points = self->n + self->n_inserted;
+
+    if (!PyArg_ParseTuple(args, "OO", &m, &where))
+        return NULL;
+
+    std::unique_ptr<Mrpt::Filter> filter;
+    if (m != Py_None) {
+        PyArrayObject *mask = reinterpret_cast<PyArrayObject *>(m);
+        if (!PyArray_Check(m) || PyArray_ITEMSIZE(mask) != 1 || PyArray_NDIM(mask) != 1 ||
+            !PyArray_ISCARRAY_RO(mask) || PyArray_DIM(mask, 0) != n_points) {
+            PyErr_SetString(PyExc_ValueError, "The mask should be a contiguous bool or uint8 vector with a byte per point");
+            return NULL;
+        }
+        filter.reset(new Mrpt::Filter(self->ptr->make_filter(reinterpret_cast<const uint8_t *>(PyArray_DATA(m)))));
+    }
+
+    PyObject *conditions = PySequence_Fast(where, "where should be a sequence of (name, op, value) tuples");
+    if (!conditions)
+        return NULL;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(conditions); ++i) {
+        const char *name;
+        int op, value;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(conditions, i), "sii", &name, &op, &value)) {
+            Py_DECREF(conditions);
+            return NULL;
+        }
+        Mrpt::Filter passed;
+        if (op < Mrpt::EQUAL || op > Mrpt::GREATER_EQUAL ||
+            !self->ptr->filter_where(name, static_cast<Mrpt::Comparison>(op), value, passed)) {
+            PyErr_Format(PyExc_ValueError, "Invalid condition on attribute %s", name);
+            Py_DECREF(conditions);
+            return NULL;
+        }
+        if (filter)
+            *filter &= passed;
+        else
+            filter.reset(new Mrpt::Filter(std::move(passed)));
+    }
+    Py_DECREF(conditions);
+
+    if (!filter)
+        filter.reset(new Mrpt::Filter(self->ptr->make_filter(std::vector<uint8_t>(n_points, 1).data())));
+    PyObject *capsule = PyCapsule_New(filter.get(), "mrpt.Filter", delete_filter);
+    if (capsule)
+        filter.release();
+    return capsule;
+}
+
+/*
+ * Returns the neighbors in the int32 array nearest as the labels of set_labels,
+ * in a new int64 array of the same shape, if the index has labels, and nearest
+ * itself otherwise. Steals the reference to nearest.
+ */
+static PyObject *as_labels(mrptIndex *self, PyObject *nearest) {
+    if (!self->ptr->has_labels())
+        return nearest;
+    PyArrayObject *ids = reinterpret_cast<PyArrayObject *>(nearest);
+    PyObject *labels = PyArray_SimpleNew(PyArray_NDIM(ids), PyArray_DIMS(ids), NPY_INT64);
+    if (labels)
+        self->ptr->to_labels(reinterpret_cast<const int *>(PyArray_DATA(ids)), PyArray_SIZE(ids),
+                             reinterpret_cast<int64_t *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(labels))));
+    Py_DECREF(nearest);
+    return labels;
+}
+
+static PyObject *ann_filtered(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *capsule;
+    int k, elect, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "OOiii", &v, &capsule, &k, &elect, &return_distances) || !get_rows(v, self->dim, q))
+        return NULL;
+    const Mrpt::Filter *filter = reinterpret_cast<Mrpt::Filter *>(PyCapsule_GetPointer(capsule, "mrpt.Filter"));
+    if (!filter)
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    #pragma omp parallel for schedule(dynamic) if (!q.single)
+    for (int i = 0; i < q.n; ++i)
+        self->ptr->query_filtered(q.vector(i), k, elect, *filter, outdata + (size_t) i * k,
+                                  out_distances ? out_distances + (size_t) i * k : nullptr);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *ann_excluding(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *indptr, *excluded;
+    int k, elect, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "OOOiii", &v, &indptr, &excluded, &k, &elect, &return_distances) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+    if (PyArray_DIM(indptr, 0) != q.n + 1) {
+        PyErr_SetString(PyExc_ValueError, "There should be a list of excluded points for each query");
+        return NULL;
+    }
+    const int64_t *offsets = reinterpret_cast<int64_t *>(PyArray_DATA(indptr));
+    const int64_t *values = reinterpret_cast<int64_t *>(PyArray_DATA(excluded));
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    // the excluded points are given by their labels if they have them, as the queries return them
+    const int64_t n_excluded = offsets[q.n], n_points = self->n + self->n_inserted;
+    std::vector<int> ids(n_excluded);
+    for (int64_t i = 0; i < n_excluded; ++i)
+        ids[i] = self->ptr->has_labels() ? self->ptr->find_label(values[i])
+                                         : values[i] >= 0 && values[i] < n_points ? (int) values[i] : -1;
+    #pragma omp parallel for schedule(dynamic) if (!q.single)
+    for (int i = 0; i < q.n; ++i)
+        self->ptr->query_excluding(q.vector(i), k, elect, ids.data() + offsets[i], offsets[i + 1] - offsets[i],
+                                   outdata + (size_t) i * k, out_distances ? out_distances + (size_t) i * k : nullptr);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *ann_pruned(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    int k, elect, n_trees, depth, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiiiii", &v, &k, &elect, &n_trees, &depth, &return_distances) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    #pragma omp parallel for schedule(dynamic) if (!q.single)
+    for (int i = 0; i < q.n; ++i)
+        self->ptr->query_pruned(q.vector(i), k, elect, n_trees, depth, outdata + (size_t) i * k,
+                                out_distances ? out_distances + (size_t) i * k : nullptr);
+    Py_END_ALLOW_THREADS
+
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *ann_confident(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    int k, elect, n_trees, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiiii", &v, &k, &elect, &n_trees, &return_distances) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    #pragma omp parallel for schedule(dynamic) if (!q.single)
+    for (int i = 0; i < q.n; ++i)
+        self->ptr->query_confident(q.vector(i), k, elect, n_trees, outdata + (size_t) i * k,
+                                   out_distances ? out_distances + (size_t) i * k : nullptr);
+    Py_END_ALLOW_THREADS
+
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *ann_early_stop(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    int k, elect, patience, max_trees, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiiiii", &v, &k, &elect, &patience, &max_trees, &return_distances) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    #pragma omp parallel for schedule(dynamic) if (!q.single)
+    for (int i = 0; i < q.n; ++i)
+        self->ptr->query_early_stop(q.vector(i), k, elect, patience, outdata + (size_t) i * k,
+                                    out_distances ? out_distances + (size_t) i * k : nullptr, max_trees);
+    Py_END_ALLOW_THREADS
+
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *stats_dict(const Mrpt::QueryStats &stats) {
+    return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:L}",
+                         "queries", (long long) stats.n_queries,
+                         "touched", (long long) stats.n_touched,
+                         "elected", (long long) stats.n_elected,
+                         "fallbacks", (long long) stats.n_fallbacks,
+                         "truncated", (long long) stats.n_truncated,
+                         "brute_force", (long long) stats.n_brute_force,
+                         "projection_ns", (long long) stats.projection_ns,
+                         "routing_ns", (long long) stats.routing_ns,
+                         "voting_ns", (long long) stats.voting_ns,
+                         "search_ns", (long long) stats.search_ns);
+}
+
+/*
+ * Returns the QueryConfidence of the queries of ann as a dict of arrays with a
+ * value per query, or of scalars for a single query.
+ */
+static PyObject *confidence_dict(const std::vector<Mrpt::QueryConfidence> &confidences, bool single) {
+    if (single)
+        return Py_BuildValue("{s:i,s:i,s:f,s:f}",
+                             "voted", confidences[0].n_voted,
+                             "elected", confidences[0].n_elected,
+                             "vote_concentration", confidences[0].vote_concentration,
+                             "distance_gap", confidences[0].distance_gap);
+    npy_intp n = confidences.size();
+    PyObject *voted = PyArray_SimpleNew(1, &n, NPY_INT), *elected = PyArray_SimpleNew(1, &n, NPY_INT);
+    PyObject *concentration = PyArray_SimpleNew(1, &n, NPY_FLOAT32), *gap = PyArray_SimpleNew(1, &n, NPY_FLOAT32);
+    if (!voted || !elected || !concentration || !gap) {
+        Py_XDECREF(voted);
+        Py_XDECREF(elected);
+        Py_XDECREF(concentration);
+        Py_XDECREF(gap);
+        return NULL;
+    }
+    for (npy_intp i = 0; i < n; ++i) {
+        reinterpret_cast<int *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(voted)))[i] = confidences[i].n_voted;
+        reinterpret_cast<int *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(elected)))[i] = confidences[i].n_elected;
+        reinterpret_cast<float *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(concentration)))[i] =
+            confidences[i].vote_concentration;
+        reinterpret_cast<float *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(gap)))[i] = confidences[i].distance_gap;
+    }
+    return Py_BuildValue("{s:N,s:N,s:N,s:N}", "voted", voted, "elected", elected, "vote_concentration", concentration,
+                         "distance_gap", gap);
+}
+
+/*
+ * Returns a new reference to an output array of a query of the given type and
+ * shape: out itself unless it is None, after checking that it is a writable,
+ * C-contiguous and aligned array of that type and shape, so that the results
+ * are written into it without allocating; otherwise a new array.
+ */
+static PyObject *output_array(PyObject *out, int nd, const npy_intp *shape, int type, const char *name) {
+    if (out == NULL || out == Py_None)
+        return PyArray_SimpleNew(nd, const_cast<npy_intp *>(shape), type);
+
+    PyArrayObject *a = reinterpret_cast<PyArrayObject *>(out);
+    bool ok = PyArray_Check(out) && PyArray_TYPE(a) == type && PyArray_NDIM(a) == nd && PyArray_ISCARRAY(a);
+    for (int i = 0; ok && i < nd; ++i)
+        ok = PyArray_DIM(a, i) == shape[i];
+    if (!ok) {
+        const std::string dims = nd == 2 ? std::to_string(shape[0]) + ", " + std::to_string(shape[1])
+                                         : std::to_string(shape[0]) + ",";
+        PyErr_Format(PyExc_ValueError, "%s should be a writable C-contiguous %s array of shape (%s)", name,
+                     type == NPY_INT ? "int32" : "float32", dims.c_str());
+        return NULL;
+    }
+    Py_INCREF(out);
+    return out;
+}
+
+static PyObject *ann(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *out = NULL, *out_dist = NULL;
+    int k, elect, n, return_distances, max_candidates = 0, return_stats = 0, max_distances = 0, return_votes = 0;
+    int target_candidates = 0, return_confidence = 0;
+    double time_budget = 0;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiii|iiidOOiii", &v, &k, &elect, &return_distances, &max_candidates, &return_stats,
+                          &max_distances, &time_budget, &out, &out_dist, &return_votes, &target_candidates,
+                          &return_confidence) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+
+    const bool budget = max_distances > 0 || time_budget > 0;
+    if ((budget || return_votes) && max_candidates > 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "max_distances, time_budget and return_votes cannot be used with max_candidates");
+        return NULL;
+    }
+    if (target_candidates > 0 && (budget || return_votes || max_candidates > 0)) {
+        PyErr_SetString(PyExc_ValueError, "target_candidates cannot be used with max_candidates, max_distances, "
+                                          "time_budget or return_votes");
+        return NULL;
+    }
+    if (return_confidence && (budget || return_votes || max_candidates > 0 || target_candidates > 0)) {
+        PyErr_SetString(PyExc_ValueError, "return_confidence cannot be used with max_candidates, max_distances, "
+                                          "time_budget, return_votes or target_candidates");
+        return NULL;
+    }
+
+    const bool single = q.single;
+    n = q.n;
+
+    npy_intp dims[2] = {n, k};
+    const int nd = single ? 1 : 2;
+    npy_intp *shape = single ? dims + 1 : dims;
+    PyObject *nearest = output_array(out, nd, shape, NPY_INT, "out");
+    if (!nearest)
+        return NULL;
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    PyObject *distances = return_distances ? output_array(out_dist, nd, shape, NPY_FLOAT32, "out_distances") : NULL;
+    if (return_distances && !distances) {
+        Py_DECREF(nearest);
+        return NULL;
+    }
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+    PyObject *votes = return_votes ? PyArray_SimpleNew(nd, shape, NPY_INT) : NULL;
+    int *out_votes = votes ? reinterpret_cast<int *>(PyArray_DATA(votes)) : nullptr;
+    // whether each query was cut short by a budget, a bool for a single query
+    npy_bool single_truncated = 0;
+    PyObject *truncated = budget && !single ? PyArray_SimpleNew(1, dims, NPY_BOOL) : NULL;
+    npy_bool *out_truncated = truncated ? reinterpret_cast<npy_bool *>(PyArray_DATA(truncated)) : &single_truncated;
+    Mrpt::QueryStats stats;
+    std::vector<Mrpt::QueryConfidence> confidences(return_confidence ? n : 0);
+
+    Py_BEGIN_ALLOW_THREADS
+    if ((budget || return_votes) && single && !return_stats) {
+        single_truncated = self->ptr->query_budgeted(q.vector(), k, elect, max_distances,
+                                                     time_budget, outdata, out_distances, out_votes);
+    } else if (budget || return_votes) {
+        // every thread queries with a scratch of its own, counting into statistics of its own
+        #pragma omp parallel if (!single)
+        {
+            Mrpt::QueryScratch scratch;
+            Mrpt::QueryStats thread_stats;
+            scratch.stats = return_stats ? &thread_stats : nullptr;
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n; ++i) {
+                float *query_distances = out_distances ? out_distances + (size_t) i * k : nullptr;
+                out_truncated[i] = self->ptr->query_budgeted(q.vector(i), k,
+                                                             elect, max_distances, time_budget,
+                                                             outdata + (size_t) i * k, query_distances, scratch,
+                                                             out_votes ? out_votes + (size_t) i * k : nullptr);
+            }
+            #pragma omp critical
+            stats.add(thread_stats);
+        }
+    } else if (target_candidates > 0) {
+        #pragma omp parallel if (!single)
+        {
+            Mrpt::QueryScratch scratch;
+            Mrpt::QueryStats thread_stats;
+            scratch.stats = return_stats ? &thread_stats : nullptr;
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n; ++i)
+                self->ptr->query_target(q.vector(i), k, target_candidates, outdata + (size_t) i * k,
+                                        out_distances ? out_distances + (size_t) i * k : nullptr, scratch);
+            #pragma omp critical
+            stats.add(thread_stats);
+        }
+    } else if (return_confidence) {
+        #pragma omp parallel if (!single)
+        {
+            Mrpt::QueryScratch scratch;
+            Mrpt::QueryStats thread_stats;
+            scratch.stats = return_stats ? &thread_stats : nullptr;
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < n; ++i)
+                self->ptr->query_confidence(q.vector(i), k, elect, outdata + (size_t) i * k,
+                                            out_distances ? out_distances + (size_t) i * k : nullptr, confidences[i],
+                                            scratch);
+            #pragma omp critical
+            stats.add(thread_stats);
+        }
+    } else if (!single || return_stats)
+        self->ptr->query_batch(q.matrix(), k, elect, outdata, out_distances,
+                               max_candidates, return_stats ? &stats : nullptr);
+    else if (max_candidates > 0)
+        self->ptr->query_multiprobe(q.vector(), k, elect, max_candidates, outdata, out_distances);
+    else
+        self->ptr->query(q.vector(), k, elect, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        Py_XDECREF(votes);
+        Py_XDECREF(truncated);
+        return NULL;
+    }
+    if (!return_distances && !return_votes && !return_stats && !budget && !return_confidence)
+        return nearest;
+    if (budget && single)
+        truncated = PyBool_FromLong(single_truncated);
+    PyObject *confidence = return_confidence ? confidence_dict(confidences, single) : NULL;
+    if (return_confidence && !confidence) {
+        Py_DECREF(nearest);
+        Py_XDECREF(distances);
+        return NULL;
+    }
+
+    const int n_returned = 1 + return_distances + !!return_votes;
+    PyObject *out_tuple = PyTuple_New(n_returned + return_stats + budget + !!return_confidence);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    if (return_distances)
+        PyTuple_SetItem(out_tuple, 1, distances);
+    if (return_votes)
+        PyTuple_SetItem(out_tuple, 1 + return_distances, votes);
+    if (budget)
+        PyTuple_SetItem(out_tuple, n_returned, truncated);
+    if (return_stats)
+        PyTuple_SetItem(out_tuple, n_returned + budget, stats_dict(stats));
+    if (return_confidence)
+        PyTuple_SetItem(out_tuple, n_returned + budget + return_stats, confidence);
+    return out_tuple;
+}
+
+/*
+ * The fast path of ann for a single vector, ann_vector(q, k, votes_required,
+ * return_distances=0, out=None), taking its arguments as a C array so that no
+ * argument tuple is built or parsed. A C-contiguous float32 numpy vector is
+ * queried in place without converting it; other vectors go through get_rows.
+ */
+static PyObject *ann_vector_args(mrptIndex *self, PyObject *const *args, Py_ssize_t nargs) {
+    const ReadGuard guard(self->lock);
+    if (nargs < 3 || nargs > 5) {
+        PyErr_SetString(PyExc_TypeError, "ann_vector takes the query, k, votes_required, return_distances and out");
+        return NULL;
+    }
+    const long k = PyLong_AsLong(args[1]), elect = PyLong_AsLong(args[2]);
+    const int return_distances = nargs > 3 ? PyObject_IsTrue(args[3]) : 0;
+    if (PyErr_Occurred() || return_distances < 0)
+        return NULL;
+    if (k < 1 || k > std::numeric_limits<int>::max() || elect < 1 || elect > std::numeric_limits<int>::max()) {
+        PyErr_SetString(PyExc_ValueError, "k and votes_required should be positive");
+        return NULL;
+    }
+
+    const float *data;
+    FloatRows q;
+    PyArrayObject *a = reinterpret_cast<PyArrayObject *>(args[0]);
+    if (PyArray_CheckExact(args[0]) && PyArray_TYPE(a) == NPY_FLOAT32 && PyArray_NDIM(a) == 1 &&
+        PyArray_DIM(a, 0) == self->dim && PyArray_ISCARRAY_RO(a)) {
+        data = reinterpret_cast<const float *>(PyArray_DATA(a));
+    } else {
+        if (!get_rows(args[0], self->dim, q))
+            return NULL;
+        if (!q.single) {
+            PyErr_SetString(PyExc_ValueError, "The query should be a vector");
+            return NULL;
+        }
+        data = q.data;
+    }
+
+    const npy_intp shape[1] = {k};
+    PyObject *nearest = output_array(nargs > 4 ? args[4] : NULL, 1, shape, NPY_INT, "out");
+    if (!nearest)
+        return NULL;
+    PyObject *distances = return_distances ? PyArray_SimpleNew(1, const_cast<npy_intp *>(shape), NPY_FLOAT32) : NULL;
+    if (return_distances && !distances) {
+        Py_DECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->query(Eigen::Map<const VectorXf>(data, self->dim), k, elect, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (!distances)
+        return nearest;
+    PyObject *out_tuple = PyTuple_New(2);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    PyTuple_SetItem(out_tuple, 1, distances);
+    return out_tuple;
+}
+
+#if PY_VERSION_HEX >= 0x03070000
+static PyObject *ann_vector(mrptIndex *self, PyObject *const *args, Py_ssize_t nargs) {
+    return ann_vector_args(self, args, nargs);
+}
+#define ANN_VECTOR_FLAGS METH_FASTCALL
+#else
+static PyObject *ann_vector(mrptIndex *self, PyObject *args) {
+    return ann_vector_args(self, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args));
+}
+#define ANN_VECTOR_FLAGS METH_VARARGS
+#endif
+
+static PyObject *ann_submit(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *v, *callback;
+    int k, elect, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "OiiiO", &v, &k, &elect, &return_distances, &callback) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+    if (!q.single) {
+        PyErr_SetString(PyExc_ValueError, "The query should be a vector");
+        return NULL;
+    }
+    if (!PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+
+    if (!self->async_queries)
+        self->async_queries = new mrpt_async::AsyncQueries(*self->ptr, self->dim, self->async_max_batch,
+                                                           self->async_max_wait_us);
+
+    // the dispatcher thread calls the callback with the GIL taken, exactly once, and releases it;
+    // an exception it raises is printed, as nothing is waiting to catch it
+    Py_INCREF(callback);
+    self->async_queries->submit(q.data, k, elect, return_distances,
+                                [callback, return_distances](mrpt_async::QueryResult &result) {
+        PyGILState_STATE state = PyGILState_Ensure();
+        PyObject *nearest = reinterpret_cast<PyObject *>(vector_to_nparray(result.indices, NPY_INT));
+        PyObject *distances = return_distances ? reinterpret_cast<PyObject *>(vector_to_nparray(result.distances))
+                                               : (Py_INCREF(Py_None), Py_None);
+        PyObject *out = PyObject_CallFunctionObjArgs(callback, nearest, distances, NULL);
+        if (out)
+            Py_DECREF(out);
+        else
+            PyErr_WriteUnraisable(callback);
+        Py_DECREF(nearest);
+        Py_DECREF(distances);
+        Py_DECREF(callback);
+        PyGILState_Release(state);
+    });
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_async_batching(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int max_batch, max_wait_us;
+
+    if (!PyArg_ParseTuple(args, "ii", &max_batch, &max_wait_us))
+        return NULL;
+
+    // the next ann_submit starts a dispatcher with the new settings
+    stop_async_queries(self);
+    self->async_max_batch = max_batch;
+    self->async_max_wait_us = max_wait_us;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *async_stats(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    mrpt_async::BatchStats stats;
+    if (self->async_queries)
+        stats = self->async_queries->stats();
+    return Py_BuildValue("{s:L,s:L,s:L}", "batches", stats.n_batches, "queries", stats.n_queries,
+                         "full_batches", stats.n_full);
+}
+
+/*
+ * Returns a page of n_found neighbors as ann would, or NULL with an exception set.
+ */
+static PyObject *page_result(const std::vector<int> &nearest, const std::vector<float> &distances, int n_found,
+                             int return_distances) {
+    npy_intp dims[1] = {n_found};
+    PyObject *ids = PyArray_SimpleNew(1, dims, NPY_INT);
+    if (!ids)
+        return NULL;
+    std::copy(nearest.begin(), nearest.begin() + n_found, reinterpret_cast<int *>(PyArray_DATA(ids)));
+    if (!return_distances)
+        return ids;
+    PyObject *dist = PyArray_SimpleNew(1, dims, NPY_FLOAT32);
+    if (!dist) {
+        Py_DECREF(ids);
+        return NULL;
+    }
+    std::copy(distances.begin(), distances.begin() + n_found, reinterpret_cast<float *>(PyArray_DATA(dist)));
+    return Py_BuildValue("NN", ids, dist);
+}
+
+static PyObject *ann_pages(mrptIndex *self, PyObject *args) {
+    PyObject *v;
+    int k, elect, return_distances;
+
+    if (!PyArg_ParseTuple(args, "Oiii", &v, &k, &elect, &return_distances))
+        return NULL;
+
+    // the sessions are made once, under the lock alone, and replaced but never removed until dealloc
+    bool made;
+    {
+        const ReadGuard guard(self->lock);
+        made = self->page_sessions != NULL;
+    }
+    if (!made) {
+        const WriteGuard guard(self->lock);
+        if (!self->page_sessions)
+            self->page_sessions = new mrpt_cache::SessionCache(*self->ptr, self->dim, self->page_capacity,
+                                                               self->page_ttl_ms);
+    }
+
+    const ReadGuard guard(self->lock);
+    FloatRows q;
+    if (!get_rows(v, self->dim, q))
+        return NULL;
+    if (!q.single) {
+        PyErr_SetString(PyExc_ValueError, "The query should be a vector");
+        return NULL;
+    }
+
+    std::vector<int> nearest(k);
+    std::vector<float> distances(return_distances ? k : 0);
+    int n_found;
+    unsigned long long token;
+    Py_BEGIN_ALLOW_THREADS
+    token = self->page_sessions->start(q.data, elect, k, nearest.data(),
+                                       return_distances ? distances.data() : nullptr, &n_found);
+    Py_END_ALLOW_THREADS
+
+    PyObject *page = page_result(nearest, distances, n_found, return_distances);
+    return page ? Py_BuildValue("KN", token, page) : NULL;
+}
+
+static PyObject *next_page(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    unsigned long long token;
+    int k, return_distances;
+
+    if (!PyArg_ParseTuple(args, "Kii", &token, &k, &return_distances))
+        return NULL;
+
+    std::vector<int> nearest(k);
+    std::vector<float> distances(return_distances ? k : 0);
+    int n_found = -1;
+    Py_BEGIN_ALLOW_THREADS
+    if (self->page_sessions)
+        n_found = self->page_sessions->next_page(token, k, nearest.data(),
+                                                 return_distances ? distances.data() : nullptr);
+    Py_END_ALLOW_THREADS
+
+    if (n_found < 0) {
+        PyErr_SetString(PyExc_KeyError, "The query session has expired or the index has changed");
+        return NULL;
+    }
+    return page_result(nearest, distances, n_found, return_distances);
+}
+
+static PyObject *close_pages(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    unsigned long long token;
+
+    if (!PyArg_ParseTuple(args, "K", &token))
+        return NULL;
+    if (self->page_sessions)
+        self->page_sessions->close(token);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_page_sessions(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int capacity, ttl_ms;
+
+    if (!PyArg_ParseTuple(args, "ii", &capacity, &ttl_ms))
+        return NULL;
+
+    self->page_capacity = capacity;
+    self->page_ttl_ms = ttl_ms;
+    if (self->page_sessions) {
+        delete self->page_sessions;
+        self->page_sessions = new mrpt_cache::SessionCache(*self->ptr, self->dim, capacity, ttl_ms);
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *get_nearest_leaves(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v,*leaves;
+    int num_leaves,k;
+    FloatRows q;
+    if (!PyArg_ParseTuple(args, "OOii", &v, &leaves, &num_leaves, &k) || !get_rows(v, self->dim, q))
+        return NULL;
+    int *leaf_index = reinterpret_cast<int *>(PyArray_DATA(leaves));
+    npy_intp dims[1] = {k};
+    PyObject *nearest = PyArray_SimpleNew(1, dims, NPY_INT);
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    VectorXi idx(num_leaves);
+    for(int i=0;i<num_leaves;i++) {
+        idx(i) = leaf_index[i];
+    }
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->exact_knn(q.vector(), k, idx, num_leaves, outdata);
+    Py_END_ALLOW_THREADS
+    return nearest;
+}
+
+static PyObject *exact_search(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *out = NULL, *out_dist = NULL;
+    int k, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oii|OO", &v, &k, &return_distances, &out, &out_dist) || !check_data(self) ||
+        !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    const npy_intp *shape = q.single ? dims + 1 : dims;
+    PyObject *nearest = output_array(out, nd, shape, NPY_INT, "out");
+    if (!nearest)
+        return NULL;
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    PyObject *distances = return_distances ? output_array(out_dist, nd, shape, NPY_FLOAT32, "out_distances") : NULL;
+    if (return_distances && !distances) {
+        Py_DECREF(nearest);
+        return NULL;
+    }
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (q.single) {
+        const int n_points = self->n + self->n_inserted;
+        VectorXi idx(n_points);
+        std::iota(idx.data(), idx.data() + n_points, 0);
+        self->ptr->exact_knn(q.vector(), k, idx, n_points, outdata, out_distances);
+    } else {
+        self->ptr->exact_knn_batch(q.matrix(), k, outdata, out_distances);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (!return_distances)
+        return nearest;
+    PyObject *out_tuple = PyTuple_New(2);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    PyTuple_SetItem(out_tuple, 1, distances);
+    return out_tuple;
+}
+
+static PyObject *query_set(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    int k, votes_required, aggregation, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiiii", &v, &k, &votes_required, &aggregation, &return_distances) ||
+        !check_data(self) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[1] = {k};
+    PyObject *nearest = PyArray_SimpleNew(1, dims, NPY_INT);
+    PyObject *distances = return_distances ? PyArray_SimpleNew(1, dims, NPY_FLOAT32) : NULL;
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->query_set(q.matrix(), k, votes_required, static_cast<Mrpt::SetAggregation>(aggregation), outdata,
+                         out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (!return_distances)
+        return nearest;
+    return Py_BuildValue("(NN)", nearest, distances);
+}
+
+static PyObject *set_metrics(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int enable;
+
+    if (!PyArg_ParseTuple(args, "i", &enable))
+        return NULL;
+
+    self->ptr->set_metrics(enable);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_recall_monitor(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    double sample_rate;
+    int window, n_threads;
+
+    if (!PyArg_ParseTuple(args, "dii", &sample_rate, &window, &n_threads))
+        return NULL;
+    if (sample_rate > 0 && !check_data(self))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->set_recall_monitor(sample_rate, window, n_threads);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *recall_estimate(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    const mrpt_metrics::RecallSnapshot r = self->ptr->recall_estimate();
+    return Py_BuildValue("{s:d,s:i,s:K,s:K}", "recall", r.recall, "recent", r.n_recent,
+                         "checked", (unsigned long long) r.n_checked, "dropped", (unsigned long long) r.n_dropped);
+}
+
+static PyObject *metrics_text(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    const char *prefix = "mrpt", *labels = "";
+
+    if (!PyArg_ParseTuple(args, "|ss", &prefix, &labels))
+        return NULL;
+
+    std::string text;
+    Py_BEGIN_ALLOW_THREADS
+    text = self->ptr->metrics_text(prefix, labels);
+    Py_END_ALLOW_THREADS
+
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromStringAndSize(text.data(), text.size());
+#else
+    return PyString_FromStringAndSize(text.data(), text.size());
+#endif
+}
+
+static PyObject *set_prefetch(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int distance, advise_pages, sort_candidates = 0;
+
+    if (!PyArg_ParseTuple(args, "ii|i", &distance, &advise_pages, &sort_candidates))
+        return NULL;
+
+    self->ptr->set_prefetch(distance, advise_pages, sort_candidates);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_query_interleave(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int group_size, leaf_major = 0;
+
+    if (!PyArg_ParseTuple(args, "i|i", &group_size, &leaf_major))
+        return NULL;
+
+    self->ptr->set_query_interleave(group_size, leaf_major);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_batch_rerank(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int enable;
+
+    if (!PyArg_ParseTuple(args, "i", &enable))
+        return NULL;
+
+    self->ptr->set_batch_rerank(enable);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_blocked_splits(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int enable;
+
+    if (!PyArg_ParseTuple(args, "i", &enable))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->set_blocked_splits(enable);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_margin_votes(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int levels;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "i", &levels))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_margin_votes(levels);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "Margin votes need levels in [1, 16] and the data and trees of the index");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_query_threads(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int n_threads;
+
+    if (!PyArg_ParseTuple(args, "i", &n_threads))
+        return NULL;
+
+    self->ptr->set_query_threads(n_threads);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_parallel_scoring(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int min_candidates;
+
+    if (!PyArg_ParseTuple(args, "i", &min_candidates))
+        return NULL;
+
+    self->ptr->set_parallel_scoring(min_candidates);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *calibrate_parallel_scoring(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    int threshold;
+
+    Py_BEGIN_ALLOW_THREADS
+    threshold = self->ptr->calibrate_parallel_scoring();
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromLong(threshold);
+}
+
+static PyObject *set_executor(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int thread_pool, n_threads;
+
+    if (!PyArg_ParseTuple(args, "ii", &thread_pool, &n_threads))
+        return NULL;
+
+    if (thread_pool)
+        self->ptr->set_executor(std::make_shared<mrpt_executor::ThreadPool>(n_threads));
+    else
+        self->ptr->set_executor(nullptr);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_build_priority(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int n_threads, niceness;
+    double duty_cycle;
+
+    if (!PyArg_ParseTuple(args, "iid", &n_threads, &niceness, &duty_cycle))
+        return NULL;
+
+    self->ptr->set_build_priority(n_threads, niceness, duty_cycle);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_quantization(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int quantization, shortlist, subspaces = 0;
+
+    if (!PyArg_ParseTuple(args, "ii|i", &quantization, &shortlist, &subspaces) || !check_float_data(self))
+        return NULL;
+
+    if (quantization < Mrpt::FLOAT32 || quantization > Mrpt::PCA) {
+        PyErr_SetString(PyExc_ValueError, "Unknown quantization type");
+        return NULL;
+    }
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_quantization(static_cast<Mrpt::Quantization>(quantization), shortlist, subspaces);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, quantization == Mrpt::BINARY && shortlist < 0
+                        ? "Binary codes need a non-negative shortlist"
+                        : "Quantization is only supported with the euclidean metric");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_projection_precision(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int precision;
+
+    if (!PyArg_ParseTuple(args, "i", &precision))
+        return NULL;
+
+    if (precision != Mrpt::FLOAT32 && precision != Mrpt::INT8 && precision != Mrpt::FLOAT16) {
+        PyErr_SetString(PyExc_ValueError, "Unknown projection precision");
+        return NULL;
+    }
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_projection_precision(static_cast<Mrpt::Quantization>(precision));
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "Only dense gaussian and rademacher projections can be rounded");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_leading_dimensions(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int n_dimensions;
+
+    if (!PyArg_ParseTuple(args, "i", &n_dimensions) || !check_float_data(self))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->set_leading_dimensions(n_dimensions);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_leaf_bounds(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int enable;
+
+    if (!PyArg_ParseTuple(args, "i", &enable) || (enable && !check_float_data(self)))
+        return NULL;
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_leaf_bounds(enable);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "Leaf bounds are only supported with the euclidean metric");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_graph(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *indptr, *neighbors;
+
+    if (!PyArg_ParseTuple(args, "OO", &indptr, &neighbors))
+        return NULL;
+    PyArrayObject *p = reinterpret_cast<PyArrayObject *>(indptr), *e = reinterpret_cast<PyArrayObject *>(neighbors);
+    if (!PyArray_Check(indptr) || PyArray_TYPE(p) != NPY_INT64 || PyArray_NDIM(p) != 1 ||
+        !PyArray_ISCARRAY_RO(p) || PyArray_DIM(p, 0) < 1 ||
+        !PyArray_Check(neighbors) || PyArray_TYPE(e) != NPY_INT || PyArray_NDIM(e) != 1 || !PyArray_ISCARRAY_RO(e)) {
+        PyErr_SetString(PyExc_ValueError, "The graph should be a contiguous int64 indptr array and a contiguous "
+                                          "int32 array of neighbors");
+        return NULL;
+    }
+    const int64_t *offsets = reinterpret_cast<const int64_t *>(PyArray_DATA(p));
+    const npy_intp n = PyArray_DIM(p, 0) - 1;
+    if (offsets[0] != 0 || offsets[n] != PyArray_DIM(e, 0)) {
+        PyErr_SetString(PyExc_ValueError, "indptr should start at 0 and end at the length of the neighbors");
+        return NULL;
+    }
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_graph(n, offsets, reinterpret_cast<const int *>(PyArray_DATA(e)));
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The graph should have at most one row per point, non-decreasing "
+                                          "indptr and the ids of indexed points as neighbors");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *build_graph(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int degree, votes_required;
+
+    if (!PyArg_ParseTuple(args, "ii", &degree, &votes_required) || !check_float_data(self))
+        return NULL;
+
+    int64_t n_edges;
+    Py_BEGIN_ALLOW_THREADS
+    n_edges = self->ptr->build_graph(degree, votes_required);
+    Py_END_ALLOW_THREADS
+    return PyLong_FromLongLong(n_edges);
+}
+
+static PyObject *set_graph_walk(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int n_hops, beam;
+
+    if (!PyArg_ParseTuple(args, "ii", &n_hops, &beam))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->set_graph_walk(n_hops, beam);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_query_planner(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int enabled;
+
+    if (!PyArg_ParseTuple(args, "i", &enabled))
+        return NULL;
+
+    self->ptr->set_query_planner(enabled);
+    Py_RETURN_NONE;
+}
+
+static PyObject *calibrate_planner(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    Mrpt::PlannerCosts costs;
+
+    Py_BEGIN_ALLOW_THREADS
+    costs = self->ptr->calibrate_planner();
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("{s:d,s:d,s:d,s:d}", "projection_ns", costs.projection_ns, "vote_ns", costs.vote_ns,
+                         "gather_ns", costs.gather_ns, "scan_ns", costs.scan_ns);
+}
+
+static PyObject *calibrate_batch(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int k, votes_required;
+    const char *cache_path;
+    Mrpt::BatchTuning tuning;
+
+    if (!PyArg_ParseTuple(args, "iiz", &k, &votes_required, &cache_path))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    tuning = self->ptr->calibrate_batch(k, votes_required, cache_path);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("{s:i,s:i,s:O,s:O}", "block_size", tuning.block_size, "interleave", tuning.interleave,
+                         "leaf_major", tuning.leaf_major ? Py_True : Py_False,
+                         "rerank", tuning.rerank ? Py_True : Py_False);
+}
+
+static PyObject *compact(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->compact();
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError, "Unable to allocate memory for the compacted index");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * Returns the tiers of memory of the NUMA nodes near_node and far_node, where
+ * a negative node is the memory of any node.
+ */
+static Mrpt::MemoryTiers memory_tiers(int near_node, int far_node, int leaves_far, int data_far) {
+    Mrpt::MemoryTiers tiers;
+    if (near_node >= 0)
+        tiers.near = Mrpt::node_allocator(near_node);
+    if (far_node >= 0)
+        tiers.far = Mrpt::node_allocator(far_node);
+    tiers.leaves = leaves_far ? Mrpt::FAR_MEMORY : Mrpt::NEAR_MEMORY;
+    tiers.data = data_far ? Mrpt::FAR_MEMORY : Mrpt::NEAR_MEMORY;
+    return tiers;
+}
+
+static PyObject *set_memory_tiers(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int near_node, far_node, leaves_far, data_far, apply;
+    if (!PyArg_ParseTuple(args, "iiiip", &near_node, &far_node, &leaves_far, &data_far, &apply))
+        return NULL;
+
+    const Mrpt::MemoryTiers tiers = memory_tiers(near_node, far_node, leaves_far, data_far);
+    bool ok = true;
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->set_memory_tiers(tiers);
+    if (apply)
+        ok = self->ptr->compact(tiers);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_MemoryError, "Unable to allocate the tiers of memory for the index");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *compress_leaves(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->compress_leaves();
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *sort_leaves(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->sort_leaves();
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *collapse_duplicates(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    int n_duplicates;
+    Py_BEGIN_ALLOW_THREADS
+    n_duplicates = self->ptr->collapse_duplicates();
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromLong(n_duplicates);
+}
+
+static PyObject *save(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    char *fn;
+    int compression = 0;
+
+    if (!PyArg_ParseTuple(args, "s|i", &fn, &compression))
+        return NULL;
+
+    if (compression && !mrpt_compress::available()) {
+        PyErr_SetString(PyExc_ValueError, "Compressed saving needs the module built with MRPT_ZSTD=1");
+        return NULL;
+    }
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = compression ? self->ptr->save_compressed(fn, compression) : self->ptr->save(fn);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "Unable to save index to file");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *save_delta(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    char *fn;
+    PyObject *o;
+
+    if (!PyArg_ParseTuple(args, "sO", &fn, &o))
+        return NULL;
+    if (Py_TYPE(o) != Py_TYPE(self) || !reinterpret_cast<mrptIndex *>(o)->ptr) {
+        PyErr_SetString(PyExc_TypeError, "The base of the delta should be a built index");
+        return NULL;
+    }
+    mrptIndex *base = reinterpret_cast<mrptIndex *>(o);
+    const ReadGuard base_guard(base != self ? base->lock : NULL);
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->save_delta(fn, *base->ptr);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "Unable to save the delta: the index was not changed from the base, "
+                                       "its data was released, or the file cannot be written");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *apply_delta(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    char *fn;
+
+    if (!PyArg_ParseTuple(args, "s", &fn) || !check_float_data(self))
+        return NULL;
+
+    bool ok;
+    const int n_old = self->ptr->size();
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->apply_delta(fn);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "Unable to apply the delta: the file is corrupted or was not made against "
+                                       "the current state of the index");
+        return NULL;
+    }
+
+    self->n_inserted += self->ptr->size() - n_old;
+    Py_RETURN_NONE;
+}
+
+static PyObject *load(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    char *fn;
+    int reorder_data = 0, map_file = 0, verify = 1;
+
+    if (!PyArg_ParseTuple(args, "s|iii", &fn, &reorder_data, &map_file, &verify) ||
+        !(reorder_data ? check_float_data(self) : check_data(self)))
+        return NULL;
+
+    bool ok;
+    self->ptr->set_verify_checksums(verify);
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->load(fn, map_file);
+    if (ok && reorder_data)
+        self->ptr->reorder_data();
+    Py_END_ALLOW_THREADS
+    release_index_buffer(self);
+
+    if (!ok) {
+        PyErr_Format(PyExc_IOError, "Unable to load index from file: %s", self->ptr->load_error());
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *to_bytes(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    std::string bytes;
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->save([&bytes](const void *data, size_t n) {
+        bytes.append(static_cast<const char *>(data), n);
+        return true;
+    });
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "Unable to save index to bytes");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return PyBytes_FromStringAndSize(bytes.data(), bytes.size());
+#else
+    return PyString_FromStringAndSize(bytes.data(), bytes.size());
+#endif
+}
+
+static PyObject *load_bytes(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    Py_buffer *buffer = new Py_buffer;
+    int reorder_data = 0, zero_copy = 0, verify = 1;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTuple(args, "y*|iii", buffer, &reorder_data, &zero_copy, &verify)) {
+#else
+    if (!PyArg_ParseTuple(args, "s*|iii", buffer, &reorder_data, &zero_copy, &verify)) {
+#endif
+        delete buffer;
+        return NULL;
+    }
+    if (!(reorder_data ? check_float_data(self) : check_data(self))) {
+        PyBuffer_Release(buffer);
+        delete buffer;
+        return NULL;
+    }
+
+    bool ok;
+    self->ptr->set_verify_checksums(verify);
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->load_from_memory(buffer->buf, buffer->len, zero_copy);
+    if (ok && reorder_data)
+        self->ptr->reorder_data();
+    Py_END_ALLOW_THREADS
+
+    // the index now uses this buffer or none
+    release_index_buffer(self);
+    if (ok && zero_copy && !reorder_data) {
+        self->index_buffer = buffer;
+    } else {
+        PyBuffer_Release(buffer);
+        delete buffer;
+    }
+
+    if (!ok) {
+        PyErr_Format(PyExc_IOError, "Unable to load index from bytes: %s", self->ptr->load_error());
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *load_async(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    char *fn;
+    int verify = 1, mmap = 0;
+
+    if (!PyArg_ParseTuple(args, "s|ii", &fn, &verify, &mmap) || !check_data(self))
+        return NULL;
+
+    bool ok;
+    self->ptr->set_verify_checksums(verify);
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->load_async(fn, mmap);
+    Py_END_ALLOW_THREADS
+    release_index_buffer(self);
+
+    if (!ok) {
+        PyErr_Format(PyExc_IOError, "Unable to load index from file: %s", self->ptr->load_error());
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+#ifndef _WIN32
+static PyObject *load_url(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    char *url;
+    int verify = 1, n_streams = 16;
+
+    if (!PyArg_ParseTuple(args, "s|ii", &url, &verify, &n_streams) || !check_data(self))
+        return NULL;
+
+    mrpt_http::RangeClient *source = new mrpt_http::RangeClient(url);
+    if (!source->valid()) {
+        delete source;
+        PyErr_SetString(PyExc_ValueError, "The URL should be http://address:port/path with an IPv4 address");
+        return NULL;
+    }
+    bool ok;
+    self->ptr->set_verify_checksums(verify);
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->load_ranges([source](uint64_t offset, void *buffer, uint64_t length) {
+        return source->read(offset, buffer, length);
+    }, n_streams);
+    Py_END_ALLOW_THREADS
+    release_index_buffer(self);
+    // load_ranges waited for the loading that read with the previous source
+    delete self->range_source;
+    self->range_source = source;
+
+    if (!ok) {
+        PyErr_Format(PyExc_IOError, "Unable to load index from URL: %s", self->ptr->load_error());
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+#endif
+
+static PyObject *wait_load(mrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->wait_load();
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_Format(PyExc_IOError, "Unable to load index from file: %s", self->ptr->load_error());
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *prefault(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->prefault();
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject *lock_memory(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int lock;
+
+    if (!PyArg_ParseTuple(args, "i", &lock))
+        return NULL;
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->lock_memory(lock);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(ok);
+}
+
+static PyObject *project(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "O", &v) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, self->ptr->projection_size()};
+    PyObject *projections = PyArray_SimpleNew(q.single ? 1 : 2, q.single ? dims + 1 : dims, NPY_FLOAT32);
+    if (!projections)
+        return NULL;
+    Map<MatrixXf> out(reinterpret_cast<float *>(PyArray_DATA(projections)), dims[1], q.n);
+
+    Py_BEGIN_ALLOW_THREADS
+    out = self->ptr->project_queries(q.matrix());
+    Py_END_ALLOW_THREADS
+
+    return projections;
+}
+
+static PyObject *ann_projected(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *v, *p;
+    int k, elect, return_distances;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "OOiii", &v, &p, &k, &elect, &return_distances) || !get_rows(v, self->dim, q))
+        return NULL;
+    if (PyArray_SIZE(reinterpret_cast<PyArrayObject *>(p)) != (npy_intp) q.n * self->ptr->projection_size()) {
+        PyErr_SetString(PyExc_ValueError, "There should be projection_size projections for each query");
+        return NULL;
+    }
+    const float *projected = reinterpret_cast<float *>(PyArray_DATA(p));
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    PyObject *nearest = PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_INT);
+    PyObject *distances = nearest && return_distances ? PyArray_SimpleNew(nd, q.single ? dims + 1 : dims, NPY_FLOAT32) : NULL;
+    if (!nearest || (return_distances && !distances)) {
+        Py_XDECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (q.single)
+        self->ptr->query_projected(q.vector(), projected, k, elect, outdata, out_distances);
+    else
+        self->ptr->query_batch_projected(q.matrix(), projected, k, elect, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!(nearest = as_labels(self, nearest))) {
+        Py_XDECREF(distances);
+        return NULL;
+    }
+    if (distances)
+        return Py_BuildValue("(NN)", nearest, distances);
+    return nearest;
+}
+
+static PyObject *same_projection(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *o;
+
+    if (!PyArg_ParseTuple(args, "O", &o))
+        return NULL;
+    if (Py_TYPE(o) != Py_TYPE(self) || !reinterpret_cast<mrptIndex *>(o)->ptr) {
+        PyErr_SetString(PyExc_TypeError, "The other index should be a built index");
+        return NULL;
+    }
+    const ReadGuard other_guard(o != reinterpret_cast<PyObject *>(self) ? reinterpret_cast<mrptIndex *>(o)->lock : NULL);
+    return PyBool_FromLong(self->ptr->same_projection(*reinterpret_cast<mrptIndex *>(o)->ptr));
+}
+
+static PyObject *share_random_matrix(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *o;
+
+    if (!PyArg_ParseTuple(args, "O", &o))
+        return NULL;
+    if (Py_TYPE(o) != Py_TYPE(self) || !reinterpret_cast<mrptIndex *>(o)->ptr) {
+        PyErr_SetString(PyExc_TypeError, "The source should be a built index");
+        return NULL;
+    }
+    const ReadGuard other_guard(o != reinterpret_cast<PyObject *>(self) ? reinterpret_cast<mrptIndex *>(o)->lock : NULL);
+
+    bool shared;
+    Py_BEGIN_ALLOW_THREADS
+    shared = self->ptr->share_random_matrix(*reinterpret_cast<mrptIndex *>(o)->ptr);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(shared);
+}
+
+static PyObject *memory_dict(const Mrpt::MemoryUsage &usage) {
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+                         "data", (unsigned long long) usage.data,
+                         "mapped_data", (unsigned long long) usage.mapped_data,
+                         "owned_data", (unsigned long long) usage.owned_data,
+                         "quantized_data", (unsigned long long) usage.quantized_data,
+                         "split_points", (unsigned long long) usage.split_points,
+                         "leaves", (unsigned long long) usage.leaves,
+                         "random_matrix", (unsigned long long) usage.random_matrix,
+                         "graph", (unsigned long long) usage.graph,
+                         "mapped_index", (unsigned long long) usage.mapped_index,
+                         "far_memory", (unsigned long long) usage.far_memory,
+                         "scratch", (unsigned long long) usage.scratch,
+                         "build_peak", (unsigned long long) usage.build_peak,
+                         "index", (unsigned long long) usage.index_bytes());
+}
+
+static PyObject *memory_usage(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    return memory_dict(self->ptr->memory_usage());
+}
+
+/*
+ * Copies an Eigen matrix, or a vector if nd is 1, into a new NumPy array of
+ * the given type with the same shape.
+ */
+template<typename Scalar, int Rows, int Cols>
+static PyObject *eigen_array(const Eigen::Matrix<Scalar, Rows, Cols> &m, int nd, int type) {
+    npy_intp dims[2] = {m.rows(), m.cols()};
+    PyObject *array = PyArray_SimpleNew(nd, dims, type);
+    if (!array)
+        return NULL;
+    // NumPy arrays are row-major
+    Eigen::Map<Eigen::Matrix<Scalar, Rows, Cols, Cols == 1 ? Eigen::ColMajor : Eigen::RowMajor>>(
+        reinterpret_cast<Scalar *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(array))), m.rows(), m.cols()) = m;
+    return array;
+}
+
+static PyObject *index_stats(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    Mrpt::IndexStats stats;
+
+    Py_BEGIN_ALLOW_THREADS
+    stats = self->ptr->stats();
+    Py_END_ALLOW_THREADS
+
+    PyObject *quantiles = PyList_New(stats.margin_quantiles.size());
+    for (size_t i = 0; i < stats.margin_quantiles.size(); ++i)
+        PyList_SetItem(quantiles, i, PyFloat_FromDouble(stats.margin_quantiles[i]));
+    return Py_BuildValue("{s:N,s:N,s:N,s:N,s:N,s:N,s:N}",
+                         "leaf_histogram", eigen_array(stats.leaf_histogram, 2, NPY_INT32),
+                         "max_leaf_size", eigen_array(stats.max_leaf_size, 1, NPY_INT32),
+                         "imbalance", eigen_array(stats.imbalance, 1, NPY_FLOAT32),
+                         "expected_leaf_size", eigen_array(stats.expected_leaf_size, 1, NPY_FLOAT32),
+                         "median_margin", eigen_array(stats.median_margin, 1, NPY_FLOAT32),
+                         "margin_quantiles", quantiles,
+                         "leaf_overlap", eigen_array(stats.leaf_overlap, 2, NPY_FLOAT32));
+}
+
+static PyObject *trees_loaded(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    return PyLong_FromLong(self->ptr->trees_loaded());
+}
+
+static PyObject *autotune(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *v;
+    int k, min_depth;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oii", &v, &k, &min_depth) || !check_data(self) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    std::vector<Mrpt::Parameters> pareto_front;
+
+    Py_BEGIN_ALLOW_THREADS
+    pareto_front = self->ptr->autotune(q.matrix(), k, min_depth);
+    Py_END_ALLOW_THREADS
+
+    PyObject *out = PyList_New(pareto_front.size());
+    for (size_t i = 0; i < pareto_front.size(); ++i) {
+        const Mrpt::Parameters &p = pareto_front[i];
+        PyList_SetItem(out, i, Py_BuildValue("(iiidd)", p.n_trees, p.depth, p.votes,
+                                             p.estimated_qtime, p.estimated_recall));
+    }
+    return out;
+}
+
+static PyObject *set_data_file(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    char *path;
+    unsigned long long extent_bytes, max_bytes;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "sKK", &path, &extent_bytes, &max_bytes) || !check_float_data(self))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->set_data_file(path, extent_bytes, max_bytes);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_IOError, "Unable to create or map the data file, or the index no longer has its data");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *insert(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *v, *labels = Py_None;
+    int upsert = 0;
+    bool ok;
+    FloatRows points;
+
+    if (!PyArg_ParseTuple(args, "O|Oi", &v, &labels, &upsert) || !check_float_data(self) ||
+        !get_rows(v, self->dim, points))
+        return NULL;
+
+    const int n_before = self->ptr->size();
+    const int64_t *new_labels = labels == Py_None ? nullptr
+                                                  : reinterpret_cast<int64_t *>(PyArray_DATA(labels));
+
+    Py_BEGIN_ALLOW_THREADS
+    if (upsert)
+        ok = self->ptr->upsert(points.matrix(), new_labels);
+    else if (new_labels)
+        ok = self->ptr->insert(points.matrix(), new_labels);
+    else
+        ok = self->ptr->insert(points.matrix());
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, new_labels ? "The points have the wrong dimension or are too many, or "
+                                                       "their labels are repeated or already used"
+                                                     : "The points have the wrong dimension or are too many");
+        return NULL;
+    }
+
+    self->n_inserted += self->ptr->size() - n_before;
+    Py_RETURN_NONE;
+}
+
+static PyObject *set_labels(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *labels;
+
+    if (!PyArg_ParseTuple(args, "O", &labels))
+        return NULL;
+
+    if (labels == Py_None) {
+        self->ptr->clear_labels();
+        Py_RETURN_NONE;
+    }
+    if (!self->ptr->set_labels(reinterpret_cast<int64_t *>(PyArray_DATA(labels)))) {
+        PyErr_SetString(PyExc_ValueError, "Two points have the same label");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *find_labels(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *labels;
+
+    if (!PyArg_ParseTuple(args, "O", &labels))
+        return NULL;
+
+    const int64_t *indata = reinterpret_cast<int64_t *>(PyArray_DATA(labels));
+    npy_intp n = PyArray_DIM(labels, 0);
+    PyObject *ids = PyArray_SimpleNew(1, &n, NPY_INT);
+    if (!ids)
+        return NULL;
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(ids)));
+    for (npy_intp i = 0; i < n; ++i)
+        outdata[i] = self->ptr->find_label(indata[i]);
+    return ids;
+}
+
+static PyObject *remove_labels(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *labels;
+    int n_removed;
+
+    if (!PyArg_ParseTuple(args, "O", &labels) || !check_data(self))
+        return NULL;
+
+    const int64_t *indata = reinterpret_cast<int64_t *>(PyArray_DATA(labels));
+    const int n = PyArray_DIM(labels, 0);
+
+    Py_BEGIN_ALLOW_THREADS
+    n_removed = self->ptr->remove_labels(indata, n);
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromLong(n_removed);
+}
+
+static PyObject *merge(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *o;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "O", &o) || !check_float_data(self))
+        return NULL;
+    if (Py_TYPE(o) != Py_TYPE(self) || !reinterpret_cast<mrptIndex *>(o)->ptr) {
+        PyErr_SetString(PyExc_TypeError, "The index merged should be a built index");
+        return NULL;
+    }
+    mrptIndex *other = reinterpret_cast<mrptIndex *>(o);
+    const ReadGuard other_guard(other != self ? other->lock : NULL);
+    if (!check_float_data(other))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->merge(*other->ptr);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The indexes differ in dimension or metric, or have too many points together");
+        return NULL;
+    }
+
+    self->n_inserted += other->n + other->n_inserted;
+    Py_RETURN_NONE;
+}
+
+static PyObject *append_trees(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *o;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "O", &o))
+        return NULL;
+    if (Py_TYPE(o) != Py_TYPE(self) || !reinterpret_cast<mrptIndex *>(o)->ptr) {
+        PyErr_SetString(PyExc_TypeError, "The trees appended should be of a built index");
+        return NULL;
+    }
+    mrptIndex *other = reinterpret_cast<mrptIndex *>(o);
+    const ReadGuard other_guard(other != self ? other->lock : NULL);
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->append_trees(*other->ptr);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The indexes differ in their points, depth, sparsity or metric, or use the "
+                        "hadamard projection, or the inner product trees do not continue those of this index");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *remove_points(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *ids;
+    bool ok;
 
-        if (return_distances) {
-            PyObject *distances = PyArray_SimpleNew(1, dims, NPY_FLOAT32);
-            float *out_distances = reinterpret_cast<float *>(PyArray_DATA(distances));
-            self->ptr->exact_knn(Eigen::Map<VectorXf>(indata, dim), k, idx, self->n, outdata, out_distances);
+    if (!PyArg_ParseTuple(args, "O", &ids) || !check_data(self))
+        return NULL;
 
-            PyObject *out_tuple = PyTuple_New(2);
-            PyTuple_SetItem(out_tuple, 0, nearest);
-            PyTuple_SetItem(out_tuple, 1, distances);
-            return out_tuple;
-        } else {
-            self->ptr->exact_knn(Eigen::Map<VectorXf>(indata, dim), k, idx, self->n, outdata);
-            return nearest;
-        }
-    } else {
-        n = PyArray_DIM(v, 0);
-        dim = PyArray_DIM(v, 1);
+    const int *indata = reinterpret_cast<int *>(PyArray_DATA(ids));
+    const int n = PyArray_DIM(ids, 0);
 
-        npy_intp dims[2] = {n, k};
-        nearest = PyArray_SimpleNew(2, dims, NPY_INT);
-        int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->remove(indata, n);
+    Py_END_ALLOW_THREADS
 
-        if (return_distances) {
-            npy_intp dims[2] = {n, k};
-            PyObject *distances = PyArray_SimpleNew(2, dims, NPY_FLOAT32);
-            float *distances_out = reinterpret_cast<float *>(PyArray_DATA(distances));
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The ids of the deleted points must be in the index");
+        return NULL;
+    }
 
-            for (int i = 0; i < n; ++i) {
-                self->ptr->exact_knn(Eigen::Map<VectorXf>(indata + i * dim, dim),
-                                     k, idx, self->n, outdata + i * k, distances_out + i * k);
-            }
-            PyObject *out_tuple = PyTuple_New(2);
-            PyTuple_SetItem(out_tuple, 0, nearest);
-            PyTuple_SetItem(out_tuple, 1, distances);
-            return out_tuple;
-        } else {
-            for (int i = 0; i < n; ++i) {
-                self->ptr->exact_knn(Eigen::Map<VectorXf>(indata + i * dim, dim),
-                                     k, idx, self->n, outdata + i * k);
-            }
-            return nearest;
-        }
+    Py_RETURN_NONE;
+}
+
+static PyObject *update(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *ids, *v;
+    bool ok;
+    FloatRows points;
+
+    if (!PyArg_ParseTuple(args, "OO", &ids, &v) || !check_float_data(self) || !get_rows(v, self->dim, points))
+        return NULL;
+
+    const int *indata = reinterpret_cast<int *>(PyArray_DATA(ids));
+    if (PyArray_DIM(ids, 0) != points.matrix().cols()) {
+        PyErr_SetString(PyExc_ValueError, "There should be a new vector for each id");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->update(indata, points.matrix());
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The ids of the updated points must be in the index, not deleted, "
+                                          "and given once");
+        return NULL;
     }
+
+    Py_RETURN_NONE;
 }
 
-static PyObject *save(mrptIndex *self, PyObject *args) {
-    char *fn;
+static PyObject *size(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    return PyLong_FromLong(self->ptr->size());
+}
 
-    if (!PyArg_ParseTuple(args, "s", &fn))
+static PyObject *change_count(mrptIndex *self) {
+    const ReadGuard guard(self->lock);
+    return PyLong_FromUnsignedLongLong(self->ptr->change_count());
+}
+
+static PyObject *reconstruct(mrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *ids;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "O", &ids))
         return NULL;
 
-    if (!self->ptr->save(fn)) {
-        PyErr_SetString(PyExc_IOError, "Unable to save index to file");
+    const int *indata = reinterpret_cast<int *>(PyArray_DATA(ids));
+    const int n = PyArray_DIM(ids, 0);
+    npy_intp dims[2] = {n, self->dim};
+    PyObject *vectors = PyArray_SimpleNew(2, dims, NPY_FLOAT32);
+    if (!vectors)
+        return NULL;
+    float *outdata = reinterpret_cast<float *>(PyArray_DATA(reinterpret_cast<PyArrayObject *>(vectors)));
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->reconstruct(indata, n, outdata);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        Py_DECREF(vectors);
+        PyErr_SetString(PyExc_ValueError, "The ids must be in the index, and the index must hold its data or a "
+                                          "quantized copy other than binary");
+        return NULL;
+    }
+    return vectors;
+}
+
+static PyObject *regrow_trees(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *tree_ids;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "O", &tree_ids))
+        return NULL;
+
+    const int *indata = reinterpret_cast<int *>(PyArray_DATA(tree_ids));
+    const int n = PyArray_DIM(tree_ids, 0);
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->regrow_trees(indata, n);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The trees must be in the index, and the index must keep its data");
         return NULL;
     }
 
     Py_RETURN_NONE;
 }
 
-static PyObject *load(mrptIndex *self, PyObject *args) {
-    char *fn;
+static PyObject *prune(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    int n_trees, depth;
+    bool ok;
 
-    if (!PyArg_ParseTuple(args, "s", &fn))
+    if (!PyArg_ParseTuple(args, "ii", &n_trees, &depth))
         return NULL;
 
-    if (!self->ptr->load(fn)) {
-        PyErr_SetString(PyExc_IOError, "Unable to load index from file");
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->prune(n_trees, depth);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "The index can only be pruned to fewer or shallower trees");
         return NULL;
     }
 
     Py_RETURN_NONE;
 }
 
+static PyObject *prune_trees(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *v;
+    int k, votes_required, min_trees, n_kept;
+    double target_recall;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "Oiidi", &v, &k, &votes_required, &target_recall, &min_trees) ||
+        !check_float_data(self) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    n_kept = self->ptr->prune_trees(q.matrix(), k, votes_required, target_recall, min_trees);
+    Py_END_ALLOW_THREADS
+
+    if (!n_kept) {
+        PyErr_SetString(PyExc_ValueError, "k, votes_required and min_trees must be in range");
+        return NULL;
+    }
+
+    return PyLong_FromLong(n_kept);
+}
+
+static PyObject *fit_memory_budget(mrptIndex *self, PyObject *args) {
+    const WriteGuard guard(self->lock);
+    PyObject *v;
+    int k, min_depth;
+    double target_recall;
+    unsigned long long budget;
+    FloatRows q;
+    Mrpt::StoragePlan plan;
+    bool ok;
+
+    if (!PyArg_ParseTuple(args, "OidKi", &v, &k, &target_recall, &budget, &min_depth) ||
+        !check_data(self) || !get_rows(v, self->dim, q))
+        return NULL;
+
+    // the index releases the data it owns, not an array of the caller, when the plan quantizes it
+    const bool owns_data = !self->ptr->memory_usage().data;
+
+    Py_BEGIN_ALLOW_THREADS
+    ok = self->ptr->fit_memory_budget(q.matrix(), k, target_recall, budget, min_depth, &plan);
+    Py_END_ALLOW_THREADS
+
+    if (!ok)
+        Py_RETURN_NONE;
+
+    if (plan.quantization != Mrpt::FLOAT32 && owns_data)
+        self->query_only = true;
+
+    const Mrpt::Parameters &p = plan.parameters;
+    PyObject *memory = memory_dict(plan.memory);
+    PyObject *out = Py_BuildValue("(iiiddiidO)", p.n_trees, p.depth, p.votes, p.estimated_qtime,
+                                  p.estimated_recall, (int) plan.quantization, (int) plan.compressed_leaves,
+                                  plan.recall, memory);
+    Py_XDECREF(memory);
+    return out;
+}
+
 static PyMethodDef MrptMethods[] = {
     {"filter_leaves_by_votes", (PyCFunction) filter_leaves_by_votes, METH_VARARGS,
             "Filters array of leaves by votes required"},
+    {"filter_leaves_by_votes_batch", (PyCFunction) filter_leaves_by_votes_batch, METH_VARARGS,
+            "Filters the leaves of many queries, given as CSR arrays, by votes required"},
     {"ann", (PyCFunction) ann, METH_VARARGS,
             "Return approximate nearest neighbors"},
+    {"ann_vector", (PyCFunction) (void (*)(void)) ann_vector, ANN_VECTOR_FLAGS,
+            "Return the approximate nearest neighbors of one vector with little call overhead"},
+    {"ann_submit", (PyCFunction) ann_submit, METH_VARARGS,
+            "Queue an ANN query, whose result is passed to a callback from another thread"},
+    {"set_async_batching", (PyCFunction) set_async_batching, METH_VARARGS,
+            "Set how many queued ANN queries are answered together, and how long to wait for them"},
+    {"async_stats", (PyCFunction) async_stats, METH_NOARGS,
+            "Return how the queued ANN queries were batched"},
+    {"ann_pages", (PyCFunction) ann_pages, METH_VARARGS,
+            "Start an ANN query answered a page at a time, and return its token and first page"},
+    {"next_page", (PyCFunction) next_page, METH_VARARGS,
+            "Return the next page of the ANN query of a token"},
+    {"close_pages", (PyCFunction) close_pages, METH_VARARGS,
+            "Drop the ANN query of a token"},
+    {"set_page_sessions", (PyCFunction) set_page_sessions, METH_VARARGS,
+            "Set how many ANN queries answered a page at a time are kept, and for how long"},
     {"ann_from_leaves", (PyCFunction) ann_from_leaves, METH_VARARGS,
             "Return approximate nearest neighbors given only leaves"},
+    {"ann_from_leaves_batch", (PyCFunction) ann_from_leaves_batch, METH_VARARGS,
+            "Return approximate nearest neighbors of many queries given their leaves as CSR arrays"},
     {"exact_search", (PyCFunction) exact_search, METH_VARARGS,
             "Return exact nearest neighbors"},
+    {"query_set", (PyCFunction) query_set, METH_VARARGS,
+            "Return the nearest neighbors of a set of query vectors"},
     {"build", (PyCFunction) build, METH_VARARGS,
             "Build the index"},
+    {"set_metrics", (PyCFunction) set_metrics, METH_VARARGS,
+            "Set whether the index keeps latency histograms of itself"},
+    {"metrics_text", (PyCFunction) metrics_text, METH_VARARGS,
+            "Return the metrics of the index in the Prometheus text format"},
+    {"set_recall_monitor", (PyCFunction) set_recall_monitor, METH_VARARGS,
+            "Start or stop estimating the recall of the queries by exact search"},
+    {"recall_estimate", (PyCFunction) recall_estimate, METH_NOARGS,
+            "Return the recall estimated by the recall monitor"},
+    {"set_prefetch", (PyCFunction) set_prefetch, METH_VARARGS,
+            "Set how candidate vectors are prefetched in queries"},
+    {"set_query_interleave", (PyCFunction) set_query_interleave, METH_VARARGS,
+            "Set how many queries of a batch count their votes in turns"},
+    {"set_batch_rerank", (PyCFunction) set_batch_rerank, METH_VARARGS,
+            "Set whether a batch of queries scores the candidates of a group by one matrix product"},
+    {"set_blocked_splits", (PyCFunction) set_blocked_splits, METH_VARARGS,
+            "Set whether queries route through the split points in blocks of a cache line"},
+    {"set_margin_votes", (PyCFunction) set_margin_votes, METH_VARARGS,
+            "Set how many votes a tree gives by the margin of a query to its splits"},
+    {"set_query_threads", (PyCFunction) set_query_threads, METH_VARARGS,
+            "Set how many threads a batch of queries is divided between"},
+    {"set_parallel_scoring", (PyCFunction) set_parallel_scoring, METH_VARARGS,
+            "Set the fewest candidates a single query scores on several threads"},
+    {"calibrate_parallel_scoring", (PyCFunction) calibrate_parallel_scoring, METH_NOARGS,
+            "Measure and set the fewest candidates a single query scores on several threads"},
+    {"set_executor", (PyCFunction) set_executor, METH_VARARGS,
+            "Run the parallel loops of the index on a thread pool or with OpenMP"},
+    {"set_build_priority", (PyCFunction) set_build_priority, METH_VARARGS,
+            "Build the trees in the background on a low-priority pool of threads"},
+    {"set_quantization", (PyCFunction) set_quantization, METH_VARARGS,
+            "Score the candidates of queries against a quantized copy of the data"},
+    {"set_projection_precision", (PyCFunction) set_projection_precision, METH_VARARGS,
+            "Project the single queries onto a rounded copy of the random matrix"},
+    {"set_leading_dimensions", (PyCFunction) set_leading_dimensions, METH_VARARGS,
+            "Score the candidates on the dimensions of the largest variance first"},
+    {"set_leaf_bounds", (PyCFunction) set_leaf_bounds, METH_VARARGS,
+            "Keep the centroids and radii of the leaves for pruning multi-probe queries"},
+    {"set_graph", (PyCFunction) set_graph, METH_VARARGS,
+            "Give the index a k-nearest-neighbor graph of the data for the queries to walk"},
+    {"build_graph", (PyCFunction) build_graph, METH_VARARGS,
+            "Build a k-nearest-neighbor graph of the data for the queries to walk"},
+    {"set_graph_walk", (PyCFunction) set_graph_walk, METH_VARARGS,
+            "Refine the neighbors found by the queries with a walk on the graph"},
+    {"set_query_planner", (PyCFunction) set_query_planner, METH_VARARGS,
+            "Choose between the trees and brute force for each query"},
+    {"calibrate_planner", (PyCFunction) calibrate_planner, METH_NOARGS,
+            "Measure the costs the query planner estimates the plans with"},
+    {"calibrate_batch", (PyCFunction) calibrate_batch, METH_VARARGS,
+            "Choose the block sizes and groups of the batch queries by timing them"},
+    {"compact", (PyCFunction) compact, METH_NOARGS,
+            "Move the trees and the random matrix into one block of memory"},
+    {"set_memory_tiers", (PyCFunction) set_memory_tiers, METH_VARARGS,
+            "Place the index in tiers of memory of NUMA nodes, now and on load"},
+    {"compress_leaves", (PyCFunction) compress_leaves, METH_NOARGS,
+            "Store the leaves as bit-packed differences of sorted ids"},
+    {"sort_leaves", (PyCFunction) sort_leaves, METH_NOARGS,
+            "Sort the ids of each leaf so that sparse votes are merged"},
+    {"collapse_duplicates", (PyCFunction) collapse_duplicates, METH_NOARGS,
+            "Store each group of identical points once in the trees"},
     {"save", (PyCFunction) save, METH_VARARGS,
             "Save the index to a file"},
     {"load", (PyCFunction) load, METH_VARARGS,
             "Load the index from a file"},
+    {"save_delta", (PyCFunction) save_delta, METH_VARARGS,
+            "Save the changes of the index since another index to a delta file"},
+    {"apply_delta", (PyCFunction) apply_delta, METH_VARARGS,
+            "Apply a delta file to the index"},
+    {"to_bytes", (PyCFunction) to_bytes, METH_NOARGS,
+            "Return the index saved into bytes"},
+    {"load_bytes", (PyCFunction) load_bytes, METH_VARARGS,
+            "Load the index from bytes returned by to_bytes"},
+    {"load_async", (PyCFunction) load_async, METH_VARARGS,
+            "Start loading the index from a file in the background"},
+#ifndef _WIN32
+    {"load_url", (PyCFunction) load_url, METH_VARARGS,
+            "Start loading the index from object storage by range GETs"},
+#endif
+    {"wait_load", (PyCFunction) wait_load, METH_NOARGS,
+            "Wait until the index started by load_async is loaded"},
+    {"prefault", (PyCFunction) prefault, METH_NOARGS,
+            "Read in the pages of a mapped index and of the data before they are queried"},
+    {"lock_memory", (PyCFunction) lock_memory, METH_VARARGS,
+            "Lock the memory the queries read in RAM"},
+    {"project", (PyCFunction) project, METH_VARARGS,
+            "Project queries onto the random vectors of the index"},
+    {"ann_projected", (PyCFunction) ann_projected, METH_VARARGS,
+            "Approximate k-nn search with the projections of the queries computed earlier"},
+    {"same_projection", (PyCFunction) same_projection, METH_VARARGS,
+            "Whether another index projects the queries onto the same random vectors"},
+    {"share_random_matrix", (PyCFunction) share_random_matrix, METH_VARARGS,
+            "Makes the index use the random matrix of another index"},
+    {"trees_loaded", (PyCFunction) trees_loaded, METH_NOARGS,
+            "Returns the number of trees the queries use"},
+    {"index_stats", (PyCFunction) index_stats, METH_NOARGS,
+            "Report the leaf sizes, split margins and leaf overlap of the trees"},
+    {"memory_usage", (PyCFunction) memory_usage, METH_NOARGS,
+            "Returns the bytes of memory the parts of the index take"},
+    {"autotune", (PyCFunction) autotune, METH_VARARGS,
+            "Estimate the recall and query time of the smaller indexes"},
+    {"append_trees", (PyCFunction) append_trees, METH_VARARGS,
+            "Append the trees of another index over the same points"},
+    {"prune", (PyCFunction) prune, METH_VARARGS,
+            "Cut the index down to fewer or shallower trees"},
+    {"prune_trees", (PyCFunction) prune_trees, METH_VARARGS,
+            "Drop the trees that add the least to the recall of validation queries"},
+    {"fit_memory_budget", (PyCFunction) fit_memory_budget, METH_VARARGS,
+            "Cut the index to the fastest configuration and storage reaching a recall within a memory budget"},
+    {"set_data_file", (PyCFunction) set_data_file, METH_VARARGS,
+            "Keep the data and the inserted points in a growing mapped data file"},
+    {"insert", (PyCFunction) insert, METH_VARARGS,
+            "Insert new points into the index"},
+    {"merge", (PyCFunction) merge, METH_VARARGS,
+            "Add the points of another index to the index"},
+    {"remove", (PyCFunction) remove_points, METH_VARARGS,
+            "Delete points from the index"},
+    {"update", (PyCFunction) update, METH_VARARGS,
+            "Replace the vectors of points of the index, keeping their ids"},
+    {"set_labels", (PyCFunction) set_labels, METH_VARARGS,
+            "Give the points 64-bit labels that the queries return instead of the ids"},
+    {"find_labels", (PyCFunction) find_labels, METH_VARARGS,
+            "Return the ids of the points with the given labels"},
+    {"remove_labels", (PyCFunction) remove_labels, METH_VARARGS,
+            "Delete the points with the given labels"},
+    {"size", (PyCFunction) size, METH_NOARGS,
+            "Return the number of points in the index, the deleted ones included"},
+    {"change_count", (PyCFunction) change_count, METH_NOARGS,
+            "Return the number of changes made to the index, for telling whether it changed"},
+    {"reconstruct", (PyCFunction) reconstruct, METH_VARARGS,
+            "Return the vectors of points given by their ids"},
+    {"regrow_trees", (PyCFunction) regrow_trees, METH_VARARGS,
+            "Grow some of the trees again with new random vectors"},
     {"get_leaves", (PyCFunction) get_leaves, METH_VARARGS,
             "Returns the leaves for a query point"},
+    {"get_leaves_batch", (PyCFunction) get_leaves_batch, METH_VARARGS,
+            "Returns the points in the leaves of each query as CSR arrays"},
+    {"ann_filtered", (PyCFunction) ann_filtered, METH_VARARGS,
+            "Return approximate nearest neighbors that pass a filter"},
+    {"ann_excluding", (PyCFunction) ann_excluding, METH_VARARGS,
+            "Return approximate nearest neighbors other than the excluded points"},
+    {"ann_early_stop", (PyCFunction) ann_early_stop, METH_VARARGS,
+            "Approximate nearest neighbor query that stops visiting trees once the neighbors settle"},
+    {"ann_confident", (PyCFunction) ann_confident, METH_VARARGS,
+            "Approximate nearest neighbor query that votes with the trees of the largest margins"},
+    {"ann_pruned", (PyCFunction) ann_pruned, METH_VARARGS,
+            "Return approximate nearest neighbors from fewer or shallower trees"},
+    {"set_attribute", (PyCFunction) set_attribute, METH_VARARGS,
+            "Attaches an integer attribute to the points"},
+    {"make_filter", (PyCFunction) make_filter, METH_VARARGS,
+            "Makes a filter for ann_filtered from a mask and attribute conditions"},
+    {"radius_search", (PyCFunction) radius_search, METH_VARARGS,
+            "Returns the approximate neighbors within a radius of each query"},
+    {"knn_graph", (PyCFunction) knn_graph, METH_VARARGS,
+            "Returns approximate k nearest neighbors of every indexed point as CSR arrays"},
     {"get_nearest_leaves", (PyCFunction) get_nearest_leaves, METH_VARARGS,
             "Returns the leaves for a query point"},
     {NULL, NULL, 0, NULL} /* Sentinel */
@@ -493,7 +3425,400 @@ static PyTypeObject MrptIndexType = {
     Mrpt_new, /* tp_new */
 };
 
+typedef struct {
+    PyObject_HEAD
+    SparseMrpt *ptr;
+    Eigen::Map<const Eigen::SparseMatrix<float>> *X;
+    PyObject *arrays[3]; // the values, column indices and row offsets of the CSR data
+    IndexLock *lock; // held as the lock of mrptIndex
+    int n;
+    int dim;
+} sparseMrptIndex;
+
+static PyObject *SparseMrpt_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    sparseMrptIndex *self;
+    self = reinterpret_cast<sparseMrptIndex *>(type->tp_alloc(type, 0));
+    if (self != NULL) {
+        self->ptr = NULL;
+        self->X = NULL;
+        self->arrays[0] = self->arrays[1] = self->arrays[2] = NULL;
+        self->lock = new (std::nothrow) IndexLock;
+        if (!self->lock) {
+            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+            return PyErr_NoMemory();
+        }
+    }
+    return reinterpret_cast<PyObject *>(self);
+}
+
+/*
+ * The index keeps the float32 values, int32 column indices and int32 row
+ * offsets of the CSR data, a point on each row, and uses them without copying.
+ */
+static int SparseMrpt_init(sparseMrptIndex *self, PyObject *args) {
+    PyObject *values, *indices, *indptr;
+    int depth, n_trees, n, dim;
+    float density;
+    unsigned int seed = 0;
+
+    if (!PyArg_ParseTuple(args, "OOOiiiif|I", &values, &indices, &indptr, &n, &dim, &depth, &n_trees, &density,
+                          &seed))
+        return -1;
+
+    self->arrays[0] = values;
+    self->arrays[1] = indices;
+    self->arrays[2] = indptr;
+    for (PyObject *array : self->arrays)
+        Py_INCREF(array);
+    self->n = n;
+    self->dim = dim;
+
+    const int *offsets = reinterpret_cast<const int *>(PyArray_DATA(indptr));
+    self->X = new Eigen::Map<const Eigen::SparseMatrix<float>>(dim, n, offsets[n], offsets,
+        reinterpret_cast<const int *>(PyArray_DATA(indices)), reinterpret_cast<const float *>(PyArray_DATA(values)));
+    self->ptr = new SparseMrpt(self->X, n_trees, depth, density, seed);
+
+    return 0;
+}
+
+static void sparse_mrpt_dealloc(sparseMrptIndex *self) {
+    delete self->ptr;
+    delete self->X;
+    for (PyObject *array : self->arrays)
+        Py_XDECREF(array);
+    delete self->lock;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+static PyObject *sparse_build(sparseMrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->grow();
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Answers the queries on the rows of a CSR matrix given as its arrays, with
+ * the approximate search if votes_required is positive and the exact one
+ * otherwise.
+ */
+static PyObject *sparse_search(sparseMrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *values, *indices, *indptr;
+    int n, k, votes_required, return_distances;
+
+    if (!PyArg_ParseTuple(args, "OOOiiii", &values, &indices, &indptr, &n, &k, &votes_required, &return_distances))
+        return NULL;
+
+    const int *offsets = reinterpret_cast<const int *>(PyArray_DATA(indptr));
+    const Eigen::Map<const Eigen::SparseMatrix<float>> Q(self->dim, n, offsets[n], offsets,
+        reinterpret_cast<const int *>(PyArray_DATA(indices)), reinterpret_cast<const float *>(PyArray_DATA(values)));
+
+    npy_intp dims[2] = {n, k};
+    PyObject *nearest = PyArray_SimpleNew(2, dims, NPY_INT);
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    PyObject *distances = return_distances ? PyArray_SimpleNew(2, dims, NPY_FLOAT32) : NULL;
+    float *out_distances = return_distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (votes_required > 0)
+        self->ptr->query_batch(Q, k, votes_required, outdata, out_distances);
+    else
+        self->ptr->exact_knn_batch(Q, k, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!return_distances)
+        return nearest;
+    PyObject *out_tuple = PyTuple_New(2);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    PyTuple_SetItem(out_tuple, 1, distances);
+    return out_tuple;
+}
+
+static PyMethodDef SparseMrptMethods[] = {
+    {"build", (PyCFunction) sparse_build, METH_NOARGS,
+            "Build the index"},
+    {"search", (PyCFunction) sparse_search, METH_VARARGS,
+            "Return approximate or exact nearest neighbors of sparse queries"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyTypeObject SparseMrptIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "mrpt.SparseMrptIndex", /*tp_name*/
+    sizeof(sparseMrptIndex), /*tp_basicsize*/
+    0, /*tp_itemsize*/
+    (destructor) sparse_mrpt_dealloc, /*tp_dealloc*/
+    0, /*tp_print*/
+    0, /*tp_getattr*/
+    0, /*tp_setattr*/
+    0, /*tp_compare*/
+    0, /*tp_repr*/
+    0, /*tp_as_number*/
+    0, /*tp_as_sequence*/
+    0, /*tp_as_mapping*/
+    0, /*tp_hash */
+    0, /*tp_call*/
+    0, /*tp_str*/
+    0, /*tp_getattro*/
+    0, /*tp_setattro*/
+    0, /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT, /*tp_flags*/
+    "Mrpt index object of sparse data", /* tp_doc */
+    0, /* tp_traverse */
+    0, /* tp_clear */
+    0, /* tp_richcompare */
+    0, /* tp_weaklistoffset */
+    0, /* tp_iter */
+    0, /* tp_iternext */
+    SparseMrptMethods, /* tp_methods */
+    0, /* tp_members */
+    0, /* tp_getset */
+    0, /* tp_base */
+    0, /* tp_dict */
+    0, /* tp_descr_get */
+    0, /* tp_descr_set */
+    0, /* tp_dictoffset */
+    (initproc) SparseMrpt_init, /* tp_init */
+    0, /* tp_alloc */
+    SparseMrpt_new, /* tp_new */
+};
+
+typedef struct {
+    PyObject_HEAD
+    BinaryMrpt *ptr;
+    PyObject *data; // the uint64 array of the codes
+    IndexLock *lock; // held as the lock of mrptIndex
+    int n;
+    int words;
+} binaryMrptIndex;
+
+static PyObject *BinaryMrpt_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    binaryMrptIndex *self;
+    self = reinterpret_cast<binaryMrptIndex *>(type->tp_alloc(type, 0));
+    if (self != NULL) {
+        self->ptr = NULL;
+        self->data = NULL;
+        self->lock = new (std::nothrow) IndexLock;
+        if (!self->lock) {
+            Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+            return PyErr_NoMemory();
+        }
+    }
+    return reinterpret_cast<PyObject *>(self);
+}
+
+/*
+ * The index keeps the C-contiguous uint64 array of the codes, a code of words
+ * words on each row, and uses it without copying.
+ */
+static int BinaryMrpt_init(binaryMrptIndex *self, PyObject *args) {
+    PyObject *data;
+    int n, bits, depth, n_trees, split_bits;
+    unsigned int seed = 0;
+
+    if (!PyArg_ParseTuple(args, "Oiiiii|I", &data, &n, &bits, &depth, &n_trees, &split_bits, &seed))
+        return -1;
+
+    self->data = data;
+    Py_INCREF(data);
+    self->n = n;
+    self->ptr = new BinaryMrpt(reinterpret_cast<const uint64_t *>(PyArray_DATA(data)), n, bits, n_trees, depth,
+                               split_bits, seed);
+    self->words = self->ptr->words();
+
+    return 0;
+}
+
+static void binary_mrpt_dealloc(binaryMrptIndex *self) {
+    delete self->ptr;
+    Py_XDECREF(self->data);
+    delete self->lock;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+static PyObject *binary_build(binaryMrptIndex *self) {
+    const WriteGuard guard(self->lock);
+    Py_BEGIN_ALLOW_THREADS
+    self->ptr->grow();
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Answers the query codes on the rows of a C-contiguous uint64 array, with the
+ * approximate search if votes_required is positive and the exact one
+ * otherwise.
+ */
+static PyObject *binary_search(binaryMrptIndex *self, PyObject *args) {
+    const ReadGuard guard(self->lock);
+    PyObject *queries;
+    int n, k, votes_required, return_distances;
+
+    if (!PyArg_ParseTuple(args, "Oiiii", &queries, &n, &k, &votes_required, &return_distances))
+        return NULL;
+
+    const uint64_t *Q = reinterpret_cast<const uint64_t *>(PyArray_DATA(queries));
+    npy_intp dims[2] = {n, k};
+    PyObject *nearest = PyArray_SimpleNew(2, dims, NPY_INT);
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    PyObject *distances = return_distances ? PyArray_SimpleNew(2, dims, NPY_FLOAT32) : NULL;
+    float *out_distances = return_distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (votes_required > 0)
+        self->ptr->query_batch(Q, n, k, votes_required, outdata, out_distances);
+    else
+        self->ptr->exact_knn_batch(Q, n, k, outdata, out_distances);
+    Py_END_ALLOW_THREADS
+
+    if (!return_distances)
+        return nearest;
+    PyObject *out_tuple = PyTuple_New(2);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    PyTuple_SetItem(out_tuple, 1, distances);
+    return out_tuple;
+}
+
+static PyMethodDef BinaryMrptMethods[] = {
+    {"build", (PyCFunction) binary_build, METH_NOARGS,
+            "Build the index"},
+    {"search", (PyCFunction) binary_search, METH_VARARGS,
+            "Return approximate or exact nearest neighbors of binary queries by Hamming distance"},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyTypeObject BinaryMrptIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "mrpt.BinaryMrptIndex", /*tp_name*/
+    sizeof(binaryMrptIndex), /*tp_basicsize*/
+    0, /*tp_itemsize*/
+    (destructor) binary_mrpt_dealloc, /*tp_dealloc*/
+    0, /*tp_print*/
+    0, /*tp_getattr*/
+    0, /*tp_setattr*/
+    0, /*tp_compare*/
+    0, /*tp_repr*/
+    0, /*tp_as_number*/
+    0, /*tp_as_sequence*/
+    0, /*tp_as_mapping*/
+    0, /*tp_hash */
+    0, /*tp_call*/
+    0, /*tp_str*/
+    0, /*tp_getattro*/
+    0, /*tp_setattro*/
+    0, /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT, /*tp_flags*/
+    "Mrpt index object of binary codes", /* tp_doc */
+    0, /* tp_traverse */
+    0, /* tp_clear */
+    0, /* tp_richcompare */
+    0, /* tp_weaklistoffset */
+    0, /* tp_iter */
+    0, /* tp_iternext */
+    BinaryMrptMethods, /* tp_methods */
+    0, /* tp_members */
+    0, /* tp_getset */
+    0, /* tp_base */
+    0, /* tp_dict */
+    0, /* tp_descr_get */
+    0, /* tp_descr_set */
+    0, /* tp_dictoffset */
+    (initproc) BinaryMrpt_init, /* tp_init */
+    0, /* tp_alloc */
+    BinaryMrpt_new, /* tp_new */
+};
+
+static PyObject *data_file_shape(PyObject *self, PyObject *args) {
+    char *file;
+
+    if (!PyArg_ParseTuple(args, "s", &file))
+        return NULL;
+
+    if (is_bvecs(file)) {
+        int n, dim;
+        if (!read_bvecs_shape(file, n, dim)) {
+            PyErr_SetString(PyExc_ValueError, "The .bvecs file cannot be read or is truncated");
+            return NULL;
+        }
+        return Py_BuildValue("(ii)", n, dim);
+    }
+
+    mrpt_data::DataFileHeader header;
+    const int has_header = read_data_header(file, header);
+    if (has_header < 0) {
+        PyErr_SetString(PyExc_ValueError, "The data file cannot be read or its header is invalid");
+        return NULL;
+    }
+    if (!has_header)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(LL)", (long long) header.n, (long long) header.dim);
+}
+
+static PyObject *exact_search_file(PyObject *self, PyObject *args) {
+    char *file;
+    PyObject *v;
+    int dim, k, return_distances, metric;
+    unsigned long long block_bytes;
+    FloatRows q;
+
+    if (!PyArg_ParseTuple(args, "sOiiiiK", &file, &v, &dim, &k, &return_distances, &metric, &block_bytes) ||
+        !get_rows(v, dim, q))
+        return NULL;
+
+    npy_intp dims[2] = {q.n, k};
+    const int nd = q.single ? 1 : 2;
+    const npy_intp *shape = q.single ? dims + 1 : dims;
+    PyObject *nearest = PyArray_SimpleNew(nd, const_cast<npy_intp *>(shape), NPY_INT);
+    if (!nearest)
+        return NULL;
+    PyObject *distances = return_distances ? PyArray_SimpleNew(nd, const_cast<npy_intp *>(shape), NPY_FLOAT32) : NULL;
+    if (return_distances && !distances) {
+        Py_DECREF(nearest);
+        return NULL;
+    }
+    int *outdata = reinterpret_cast<int *>(PyArray_DATA(nearest));
+    float *out_distances = distances ? reinterpret_cast<float *>(PyArray_DATA(distances)) : nullptr;
+
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = Mrpt::exact_knn_file(file, q.matrix(), k, outdata, out_distances, static_cast<Mrpt::Metric>(metric),
+                              block_bytes);
+    Py_END_ALLOW_THREADS
+
+    if (!ok) {
+        Py_DECREF(nearest);
+        Py_XDECREF(distances);
+        PyErr_SetString(PyExc_IOError, "Unable to read data from file, or its dimension is not that of the queries");
+        return NULL;
+    }
+    if (!return_distances)
+        return nearest;
+    PyObject *out_tuple = PyTuple_New(2);
+    PyTuple_SetItem(out_tuple, 0, nearest);
+    PyTuple_SetItem(out_tuple, 1, distances);
+    return out_tuple;
+}
+
+static PyObject *estimate_memory(PyObject *self, PyObject *args) {
+    int n, dim, n_trees, depth;
+    float density;
+
+    if (!PyArg_ParseTuple(args, "iiiif", &n, &dim, &n_trees, &depth, &density))
+        return NULL;
+    return memory_dict(Mrpt::estimate_memory(n, dim, n_trees, depth, density));
+}
+
 static PyMethodDef module_methods[] = {
+  {"data_file_shape", (PyCFunction) data_file_shape, METH_VARARGS,
+          "Return the shape in the header of a data file or of a .bvecs file, or None if it has no header"},
+  {"estimate_memory", (PyCFunction) estimate_memory, METH_VARARGS,
+          "Predict the bytes of memory of an index before it is built"},
+  {"exact_search_file", (PyCFunction) exact_search_file, METH_VARARGS,
+          "Find the exact nearest neighbors of queries in a data file in one sequential pass"},
   {NULL}	/* Sentinel */
 };
   
@@ -512,7 +3837,8 @@ static struct PyModuleDef moduledef = {
   
 PyMODINIT_FUNC PyInit_mrptlib(void) {
     PyObject *m;
-    if (PyType_Ready(&MrptIndexType) < 0)
+    if (PyType_Ready(&MrptIndexType) < 0 || PyType_Ready(&SparseMrptIndexType) < 0 ||
+        PyType_Ready(&BinaryMrptIndexType) < 0)
         return NULL;
     
     m = PyModule_Create(&moduledef);
@@ -520,18 +3846,26 @@ PyMODINIT_FUNC PyInit_mrptlib(void) {
 
     if (m == NULL)
         return NULL;
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
 
     import_array();
 
     Py_INCREF(&MrptIndexType);
     PyModule_AddObject(m, "MrptIndex", reinterpret_cast<PyObject *>(&MrptIndexType));
+    Py_INCREF(&SparseMrptIndexType);
+    PyModule_AddObject(m, "SparseMrptIndex", reinterpret_cast<PyObject *>(&SparseMrptIndexType));
+    Py_INCREF(&BinaryMrptIndexType);
+    PyModule_AddObject(m, "BinaryMrptIndex", reinterpret_cast<PyObject *>(&BinaryMrptIndexType));
 
     return m;
 }
 #else
 PyMODINIT_FUNC initmrptlib(void) {
     PyObject *m;
-    if (PyType_Ready(&MrptIndexType) < 0)
+    if (PyType_Ready(&MrptIndexType) < 0 || PyType_Ready(&SparseMrptIndexType) < 0 ||
+        PyType_Ready(&BinaryMrptIndexType) < 0)
         return;
 
     m = Py_InitModule("mrptlib", module_methods);
@@ -544,6 +3878,10 @@ PyMODINIT_FUNC initmrptlib(void) {
 
     Py_INCREF(&MrptIndexType);
     PyModule_AddObject(m, "MrptIndex", reinterpret_cast<PyObject *>(&MrptIndexType));
+    Py_INCREF(&SparseMrptIndexType);
+    PyModule_AddObject(m, "SparseMrptIndex", reinterpret_cast<PyObject *>(&SparseMrptIndexType));
+    Py_INCREF(&BinaryMrptIndexType);
+    PyModule_AddObject(m, "BinaryMrptIndex", reinterpret_cast<PyObject *>(&BinaryMrptIndexType));
 }
 #endif
 
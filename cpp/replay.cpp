@@ -0,0 +1,306 @@
+/*
+ * Replays a query log written by mrpt_server --query-log against an index, to
+ * measure it with the mix of k and votes and the arrival pattern of real
+ * traffic rather than of a synthetic benchmark. The replay is open loop: each
+ * query is issued at its logged arrival time divided by --speedup, whether or
+ * not the earlier ones have been answered, and its latency is counted from
+ * that time, so the time a query waits behind slow ones is part of it. The
+ * queries are answered by --threads worker threads with Mrpt::query.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -fopenmp -pthread -Icpp -Icpp/lib cpp/replay.cpp -o mrpt_replay
+ *
+ * The data and the index are those of mrpt_server: the data file it was built
+ * from, mapped into memory, and the index file saved by Mrpt::save. The report
+ * has a row for all the queries and one for every combination of k and votes
+ * in the log, with the offered and achieved throughput and the distribution
+ * of the latencies, as CSV or JSON.
+ *
+ * Usage: mrpt_replay [options] data index log
+ *   --dim d              dimension of a data file without a header
+ *   --mmap               map the index file instead of reading it into memory
+ *   --speedup x          replay x times faster than logged (default 1), or as
+ *                        fast as possible with 0
+ *   --threads t          number of worker threads (default the number of cores)
+ *   --limit n            replay only the first n queries of the log
+ *   --k k                search k neighbors for every query instead of the logged k
+ *   --votes v            require v votes for every query instead of the logged votes
+ *   --json               report as JSON instead of CSV
+ *   --output path        the file the report is written to, stdout by default
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Mrpt.h"
+#include "mrpt_data.h"
+#include "mrpt_mmap.h"
+#include "mrpt_querylog.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    std::string data_path, index_path, log_path, output_path;
+    int dim = 0, threads = 0, limit = 0, k = 0, votes = 0;
+    double speedup = 1;
+    bool map_index = false, json = false;
+};
+
+struct Latencies {
+    std::vector<double> latency_us, service_us;
+};
+
+/**
+* Maps the data file into memory, with or without the header of mrpt_data.h.
+* @return The data, or nullptr with error set to the reason.
+*/
+std::unique_ptr<Map<const MatrixXf>> map_data(const Options &o, std::string &error) {
+    FILE *fd = std::fopen(o.data_path.c_str(), "rb");
+    if (!fd) {
+        error = "cannot open the data file";
+        return nullptr;
+    }
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(fd, header);
+    std::fseek(fd, 0, SEEK_END);
+    const long long bytes = std::ftell(fd);
+    int64_t n = 0, dim = o.dim;
+    size_t offset = 0;
+    if (has_header > 0) {
+        n = header.n;
+        dim = header.dim;
+        offset = header.data_offset;
+    } else if (has_header == 0 && dim > 0) {
+        n = bytes / ((long long) sizeof(float) * dim);
+    }
+
+    const float *points = nullptr;
+    if (n > 0 && (long long) (offset + sizeof(float) * n * dim) <= bytes) {
+        const char *p = static_cast<const char *>(mrpt_mmap::map_file(fd, bytes));
+        points = p ? reinterpret_cast<const float *>(p + offset) : nullptr;
+    }
+    std::fclose(fd);
+    if (!points) {
+        error = has_header < 0 ? "the header of the data file is invalid" :
+                n > 0 ? "cannot map the data file" : "the dimension of the data is unknown, give it with --dim";
+        return nullptr;
+    }
+    return std::unique_ptr<Map<const MatrixXf>>(new Map<const MatrixXf>(points, dim, n));
+}
+
+double percentile(std::vector<double> values, double p) {
+    const size_t i = std::min(values.size() - 1, (size_t) (p * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+/**
+* Writes the row of a report of the queries whose latencies are in l.
+*/
+void report(FILE *out, bool json, bool &first_row, const std::string &mix, const Latencies &l, double span_s,
+            double elapsed_s) {
+    const size_t n = l.latency_us.size();
+    if (n == 0) return;
+    double mean = 0, mean_service = 0;
+    for (size_t i = 0; i < n; ++i) {
+        mean += l.latency_us[i] / n;
+        mean_service += l.service_us[i] / n;
+    }
+    const double offered = span_s > 0 ? n / span_s : 0, achieved = elapsed_s > 0 ? n / elapsed_s : 0;
+    const double p50 = percentile(l.latency_us, 0.5), p90 = percentile(l.latency_us, 0.9);
+    const double p99 = percentile(l.latency_us, 0.99), p999 = percentile(l.latency_us, 0.999);
+    const double max = *std::max_element(l.latency_us.begin(), l.latency_us.end());
+    if (json)
+        std::fprintf(out, "%s\n  {\"mix\": \"%s\", \"n\": %zu, \"offered_qps\": %.1f, \"achieved_qps\": %.1f, "
+                     "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+                     "\"max_us\": %.1f, \"mean_service_us\": %.1f}", first_row ? "" : ",", mix.c_str(), n, offered,
+                     achieved, mean, p50, p90, p99, p999, max, mean_service);
+    else
+        std::fprintf(out, "%s,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", mix.c_str(), n, offered,
+                     achieved, mean, p50, p90, p99, p999, max, mean_service);
+    first_row = false;
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--mmap") o.map_index = true;
+        else if (arg == "--json") o.json = true;
+        else if (arg == "--dim" && has_value) o.dim = std::atoi(argv[++i]);
+        else if (arg == "--speedup" && has_value) o.speedup = std::atof(argv[++i]);
+        else if (arg == "--threads" && has_value) o.threads = std::atoi(argv[++i]);
+        else if (arg == "--limit" && has_value) o.limit = std::atoi(argv[++i]);
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = std::atoi(argv[++i]);
+        else if (arg == "--output" && has_value) o.output_path = argv[++i];
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (paths.size() != 3 || o.speedup < 0 || o.threads < 0 || o.k < 0 || o.votes < 0) return false;
+    o.data_path = paths[0];
+    o.index_path = paths[1];
+    o.log_path = paths[2];
+    if (o.threads == 0) o.threads = std::max(1u, std::thread::hardware_concurrency());
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    if (!parse_options(argc, argv, o)) {
+        std::fprintf(stderr, "usage: %s [--dim d] [--mmap] [--speedup x] [--threads t] [--limit n] [--k k] "
+                     "[--votes v] [--json] [--output path] data index log\n", argv[0]);
+        return 2;
+    }
+
+    std::string error;
+    std::unique_ptr<Map<const MatrixXf>> data = map_data(o, error);
+    if (!data) {
+        std::fprintf(stderr, "%s: %s\n", o.data_path.c_str(), error.c_str());
+        return 1;
+    }
+    mrpt_querylog::QueryLogHeader header;
+    std::vector<mrpt_querylog::QueryRecord> records;
+    std::vector<float> queries;
+    if (!mrpt_querylog::read_query_log(o.log_path.c_str(), header, records, queries) || records.empty()) {
+        std::fprintf(stderr, "%s: cannot read the query log, or it is empty\n", o.log_path.c_str());
+        return 1;
+    }
+    if ((int64_t) header.dim != data->rows()) {
+        std::fprintf(stderr, "%s: the queries are of dimension %u, the data of %d\n", o.log_path.c_str(),
+                     header.dim, (int) data->rows());
+        return 1;
+    }
+    if (o.limit > 0 && o.limit < (int) records.size())
+        records.resize(o.limit);
+
+    Mrpt::IndexFileInfo info;
+    if (!Mrpt::read_file_info(o.index_path.c_str(), info) || info.n_samples != data->cols() ||
+        info.dim != data->rows()) {
+        std::fprintf(stderr, "%s: not an index of the data\n", o.index_path.c_str());
+        return 1;
+    }
+    Mrpt index(data.get(), info.n_trees, info.depth, info.density, info.seed, info.projection, info.metric);
+    if (!index.load(o.index_path.c_str(), o.map_index)) {
+        std::fprintf(stderr, "%s: cannot load the index: %s\n", o.index_path.c_str(), index.load_error());
+        return 1;
+    }
+    index.prefault();
+
+    const int n = records.size(), dim = header.dim;
+    std::vector<int> ks(n), votes(n);
+    int max_k = 1;
+    for (int i = 0; i < n; ++i) {
+        ks[i] = std::min<int>(o.k ? o.k : records[i].k, data->cols());
+        votes[i] = o.votes ? o.votes : records[i].votes_required;
+        max_k = std::max(max_k, ks[i]);
+    }
+
+    // the arrival time of each query, relative to the start of the replay
+    std::vector<Clock::duration> arrivals(n);
+    for (int i = 0; i < n; ++i) {
+        const double offset_ns = o.speedup > 0 ? (records[i].time_ns - records[0].time_ns) / o.speedup : 0;
+        arrivals[i] = std::chrono::duration_cast<Clock::duration>(std::chrono::nanoseconds((int64_t) offset_ns));
+    }
+
+    std::vector<double> latency_us(n), service_us(n);
+    std::deque<int> pending;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool done = false;
+    Clock::time_point start;
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < o.threads; ++t) {
+        workers.emplace_back([&] {
+            std::vector<int> out(max_k);
+            std::vector<float> distances(max_k);
+            for (;;) {
+                int i;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&] { return done || !pending.empty(); });
+                    if (pending.empty()) return;
+                    i = pending.front();
+                    pending.pop_front();
+                }
+                const Clock::time_point begin = Clock::now();
+                const Map<const VectorXf> q(queries.data() + (size_t) i * dim, dim);
+                index.query(q, ks[i], votes[i], out.data(), distances.data());
+                const Clock::time_point end = Clock::now();
+                latency_us[i] = std::chrono::duration<double, std::micro>(end - (start + arrivals[i])).count();
+                service_us[i] = std::chrono::duration<double, std::micro>(end - begin).count();
+            }
+        });
+    }
+
+    start = Clock::now();
+    for (int i = 0; i < n; ++i) {
+        std::this_thread::sleep_until(start + arrivals[i]);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(i);
+        }
+        ready.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    ready.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+    const double elapsed_s = std::chrono::duration<double>(Clock::now() - start).count();
+    const double span_s = std::chrono::duration<double>(arrivals[n - 1]).count();
+
+    FILE *out = o.output_path.empty() ? stdout : std::fopen(o.output_path.c_str(), "w");
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", o.output_path.c_str());
+        return 1;
+    }
+    if (o.json)
+        std::fprintf(out, "[");
+    else
+        std::fprintf(out, "mix,n,offered_qps,achieved_qps,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,"
+                     "mean_service_us\n");
+    Latencies all;
+    std::map<std::pair<int, int>, Latencies> mixes;
+    for (int i = 0; i < n; ++i) {
+        Latencies &mix = mixes[std::make_pair(ks[i], votes[i])];
+        for (Latencies *l : {&all, &mix}) {
+            l->latency_us.push_back(latency_us[i]);
+            l->service_us.push_back(service_us[i]);
+        }
+    }
+    bool first_row = true;
+    report(out, o.json, first_row, "all", all, span_s, elapsed_s);
+    for (const auto &mix : mixes) {
+        // each mix is offered over the whole replay, at its share of the traffic
+        const std::string name = "k=" + std::to_string(mix.first.first) + " votes=" +
+                                 std::to_string(mix.first.second);
+        report(out, o.json, first_row, name, mix.second, span_s, elapsed_s);
+    }
+    if (o.json)
+        std::fprintf(out, "\n]\n");
+    if (out != stdout)
+        std::fclose(out);
+    return 0;
+}
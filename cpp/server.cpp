@@ -0,0 +1,491 @@
+/*
+ * A standalone k-NN search server over HTTP for an index saved by Mrpt::save
+ * (or MRPTIndex.save) and the data file it was built from. The data file is
+ * memory mapped, and so is the index with --mmap, so several servers on one
+ * machine share them in the page cache. The queries of all the connections go
+ * through one mrpt_async::AsyncQueries, which answers the concurrent queries in
+ * batches with query_batch. With --cache, the answers to repeated queries are
+ * kept in an mrpt_cache::QueryCache and the repeats skip the index altogether.
+ *
+ * Compile with
+ *   g++ -std=c++11 -O3 -fopenmp -pthread -Icpp -Icpp/lib cpp/server.cpp -o mrpt_server
+ *
+ * The data file is a float32 file written by mrpt_convert or
+ * utils/binary_converter.py, whose dimension is given with --dim unless it has
+ * the header of mrpt_data.h. The server speaks HTTP/1.1 with keep-alive:
+ *
+ *   POST /search?k=10&votes=1&distances=1
+ *       The body holds one or more queries as raw little-endian float32
+ *       vectors of the dimension of the data. k and votes default to --k and
+ *       --votes, and distances to 0. Answers with the JSON object
+ *       {"indices": [[...], ...], "distances": [[...], ...]}, with one list per
+ *       query and -1 where fewer than k neighbors were found.
+ *   POST /reload?index=path
+ *       Loads the index at path, a file or a URL as below, by default the index of the last load,
+ *       warms it up and swaps it in. The queries running meanwhile are
+ *       answered by the old index, which is released when they are done, so
+ *       there is no downtime. The new index must have been built from the
+ *       same data.
+ *   GET /metrics
+ *       The metrics of the index (see mrpt_metrics.h) and of the server in the
+ *       text format of Prometheus.
+ *   GET /health
+ *       Answers ok once the index is loaded.
+ *
+ * The index may also be given as the http:// URL of an object in an
+ * S3-compatible object store, presigned for GET if the bucket is private, at
+ * an IPv4 address. It is then read straight into memory by parallel range
+ * GETs with Mrpt::load_ranges, without a copy on the local disk.
+ *
+ * The server uses POSIX sockets and does not build on Windows.
+ *
+ * Usage: mrpt_server [options] data index
+ *   --dim d              dimension of a data file without a header
+ *   --host address       the IPv4 address listened on (default 0.0.0.0)
+ *   --port p             the port listened on (default 8080)
+ *   --k k                number of neighbors searched for by default (default 10)
+ *   --votes v            votes required by default (default 1)
+ *   --max-batch b        largest number of queries answered together (default 256)
+ *   --max-wait-us t      how long a query may wait for a batch to fill (default 0)
+ *   --cache n            keep the answers to the last n distinct queries (default 0)
+ *   --mmap               map the index file instead of reading it into memory
+ *   --progressive        serve an index read from a URL at the start as soon as its
+ *                        split points and random matrix are read, on the trees read
+ *                        so far, without --mlock and --warmup; reloads wait for
+ *                        the whole index
+ *   --no-verify          do not check the checksums of the index file
+ *   --mlock              lock the data and the index in memory, see Mrpt::lock_memory
+ *   --warmup file        answer the queries of a float32 file, such as a sample of
+ *                        logged queries, before an index starts to serve
+ *   --query-log path     log the queries served to path (see mrpt_querylog.h), to
+ *                        be replayed by mrpt_replay
+ *   --query-log-rate r   the share of the queries logged (default 1)
+ *
+ * Every index loaded, at the start or by a reload, has its pages and those of
+ * the data faulted in by all threads, is locked with --mlock and answers the
+ * queries of --warmup before it serves, so that the first queries it gets are
+ * answered at the latency of a warm server.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Mrpt.h"
+#include "mrpt_async.h"
+#include "mrpt_cache.h"
+#include "mrpt_data.h"
+#include "mrpt_http.h"
+#include "mrpt_mmap.h"
+#include "mrpt_querylog.h"
+#include "mrpt_snapshot.h"
+
+namespace {
+
+using mrpt_http::HttpRequest;
+using mrpt_http::json_error;
+using mrpt_http::parameter;
+using mrpt_http::read_request;
+using mrpt_http::respond;
+
+struct Options {
+    std::string data_path, index_path, host = "0.0.0.0";
+    int port = 8080, dim = 0, k = 10, votes = 1, max_batch = 256, max_wait_us = 0, cache = 0;
+    bool map_index = false, verify = true, lock_memory = false, progressive = false;
+    std::string warmup_path, query_log_path;
+    double query_log_rate = 1;
+};
+
+/*
+* A loaded index, the cache of its answers and the queue of its queries,
+* replaced as a whole by a reload, which so starts with an empty cache. The
+* queue is declared last so that it is destroyed first, answering the queries
+* still pending while the index exists.
+*/
+struct Served {
+    std::string path;
+    std::unique_ptr<mrpt_http::RangeClient> source; // reads an index given as a URL, outliving its loading
+    std::unique_ptr<Mrpt> index;
+    std::unique_ptr<mrpt_cache::QueryCache> cache;
+    std::unique_ptr<mrpt_async::AsyncQueries> queries;
+};
+
+Options options;
+std::unique_ptr<Map<const MatrixXf>> data;
+std::vector<float> warmup_queries; // the queries of --warmup
+mrpt_querylog::QueryLogWriter query_log; // the log of --query-log
+mrpt_snapshot::SnapshotHandle<Served> served;
+std::mutex reload_mutex; // serializes the reloads
+std::atomic<long long> n_requests{0}, n_failed_requests{0}, n_reloads{0};
+
+/**
+* Maps the data file into memory.
+*/
+bool map_data(std::string &error) {
+    FILE *fd = std::fopen(options.data_path.c_str(), "rb");
+    if (!fd) {
+        error = "cannot open the data file";
+        return false;
+    }
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(fd, header);
+    std::fseek(fd, 0, SEEK_END);
+    const long long bytes = std::ftell(fd);
+    int64_t n = 0, dim = options.dim;
+    size_t offset = 0;
+    if (has_header > 0) {
+        n = header.n;
+        dim = header.dim;
+        offset = header.data_offset;
+    } else if (has_header == 0 && dim > 0) {
+        n = bytes / ((long long) sizeof(float) * dim);
+    }
+
+    const float *points = nullptr;
+    if (n > 0 && (long long) (offset + sizeof(float) * n * dim) <= bytes) {
+        const char *p = static_cast<const char *>(mrpt_mmap::map_file(fd, bytes));
+        points = p ? reinterpret_cast<const float *>(p + offset) : nullptr;
+    }
+    std::fclose(fd);
+    if (!points) {
+        error = has_header < 0 ? "the header of the data file is invalid" :
+                n > 0 ? "cannot map the data file" : "the dimension of the data is unknown, give it with --dim";
+        return false;
+    }
+    data.reset(new Map<const MatrixXf>(points, dim, n));
+    return true;
+}
+
+/**
+* Reads the queries of --warmup, a float32 file of the dimension of the data,
+* with or without the header of mrpt_data.h.
+*/
+bool read_warmup_queries(std::string &error) {
+    FILE *fd = std::fopen(options.warmup_path.c_str(), "rb");
+    if (!fd) {
+        error = "cannot open the warmup file";
+        return false;
+    }
+    const int64_t dim = data->rows();
+    mrpt_data::DataFileHeader header;
+    const int has_header = mrpt_data::read_header(fd, header);
+    const long long start = std::ftell(fd);
+    std::fseek(fd, 0, SEEK_END);
+    const long long bytes = std::ftell(fd) - start;
+    const int64_t n = has_header > 0 ? header.n : bytes / ((long long) sizeof(float) * dim);
+    bool ok = has_header >= 0 && (has_header == 0 || header.dim == dim) && n > 0 &&
+              (long long) sizeof(float) * n * dim <= bytes;
+    if (ok) {
+        warmup_queries.resize((size_t) n * dim);
+        ok = std::fseek(fd, start, SEEK_SET) == 0 &&
+             std::fread(warmup_queries.data(), sizeof(float) * dim, n, fd) == (size_t) n;
+    }
+    std::fclose(fd);
+    if (!ok)
+        error = "the warmup file does not hold float32 queries of the dimension of the data";
+    return ok;
+}
+
+/**
+* Loads an index file built from the data, faults in its pages and those of the data,
+* locks them with --mlock and answers the queries of --warmup.
+* @param path - The index file, or the URL of an index in object storage
+* @param progressive - Whether an index read from a URL is returned before its
+* leaves are read, see --progressive
+* @return The loaded index, or nullptr with error set to the reason if it cannot be loaded.
+*/
+std::shared_ptr<Served> load_index(const std::string &path, std::string &error, bool progressive = false) {
+    std::shared_ptr<Served> s = std::make_shared<Served>();
+    const bool remote = path.compare(0, 7, "http://") == 0;
+    if (remote)
+        s->source.reset(new mrpt_http::RangeClient(path));
+    mrpt_http::RangeClient *source = s->source.get();
+    const Mrpt::RangeReader read = [source](uint64_t offset, void *buffer, uint64_t length) {
+        return source->read(offset, buffer, length);
+    };
+
+    Mrpt::IndexFileInfo info;
+    if (remote ? !source->valid() || !Mrpt::read_file_info(read, info) : !Mrpt::read_file_info(path.c_str(), info)) {
+        error = "cannot read the header of the index file";
+        return nullptr;
+    }
+    if (info.n_samples != data->cols() || info.dim != data->rows()) {
+        error = "the index was built from data of another shape";
+        return nullptr;
+    }
+
+    s->path = path;
+    s->index.reset(new Mrpt(data.get(), info.n_trees, info.depth, info.density, info.seed, info.projection,
+                            info.metric));
+    s->index->set_verify_checksums(options.verify);
+    s->index->set_metrics(true);
+    const bool loaded = remote ? s->index->load_ranges(read) && (progressive || s->index->wait_load())
+                               : s->index->load(path.c_str(), options.map_index);
+    if (!loaded) {
+        error = std::string("cannot load the index: ") + s->index->load_error();
+        return nullptr;
+    }
+    // an index still reading its leaves serves at once, and warms up on the queries it gets
+    const bool warm_up = !remote || !progressive;
+    if (warm_up)
+        s->index->prefault();
+    if (warm_up && options.lock_memory && !s->index->lock_memory())
+        std::fprintf(stderr, "cannot lock %s in memory: %s\n", path.c_str(), std::strerror(errno));
+    if (warm_up && !warmup_queries.empty()) {
+        const int n = warmup_queries.size() / data->rows();
+        std::vector<int> out((size_t) n * options.k);
+        s->index->query_batch(Map<const MatrixXf>(warmup_queries.data(), data->rows(), n), options.k,
+                              options.votes, out.data());
+    }
+    s->cache.reset(new mrpt_cache::QueryCache(*s->index, info.dim, options.cache));
+    s->queries.reset(new mrpt_async::AsyncQueries(*s->index, info.dim, options.max_batch, options.max_wait_us));
+    return s;
+}
+
+/**
+* Answers the queries in the body of a search request.
+*/
+int search(const HttpRequest &r, std::string &out) {
+    const std::shared_ptr<Served> s = served.get();
+    const int dim = data->rows();
+    const size_t query_bytes = sizeof(float) * dim;
+    const int k = std::atoi(parameter(r.query, "k", std::to_string(options.k)).c_str());
+    const int votes = std::atoi(parameter(r.query, "votes", std::to_string(options.votes)).c_str());
+    const bool distances = parameter(r.query, "distances", "0") != "0";
+    if (r.body.empty() || r.body.size() % query_bytes) {
+        out = json_error("the body should hold float32 queries of dimension " + std::to_string(dim));
+        return 400;
+    }
+    if (k < 1 || votes < 1) {
+        out = json_error("k and votes should be positive");
+        return 400;
+    }
+
+    // the body is copied to align the queries
+    const int n = r.body.size() / query_bytes;
+    std::vector<float> queries((size_t) n * dim);
+    std::memcpy(queries.data(), r.body.data(), r.body.size());
+    if (query_log.is_open()) {
+        for (int i = 0; i < n; ++i)
+            query_log.record(queries.data() + (size_t) i * dim, k, votes);
+    }
+    // the queries the cache misses are submitted, the hits are answered at once
+    std::vector<mrpt_async::QueryResult> cached(n);
+    std::vector<std::future<mrpt_async::QueryResult>> results(n);
+    for (int i = 0; i < n; ++i) {
+        const float *q = queries.data() + (size_t) i * dim;
+        mrpt_async::QueryResult &hit = cached[i];
+        hit.indices.resize(k);
+        hit.distances.resize(distances ? k : 0);
+        if (!s->cache->lookup(q, k, votes, hit.indices.data(), distances ? hit.distances.data() : nullptr))
+            results[i] = s->queries->submit(q, k, votes, distances);
+    }
+
+    std::string indices = "{\"indices\": [", dists = "\"distances\": [";
+    char value[32];
+    for (int i = 0; i < n; ++i) {
+        if (results[i].valid()) {
+            cached[i] = results[i].get();
+            s->cache->store(queries.data() + (size_t) i * dim, k, votes, cached[i].indices.data(),
+                            distances ? cached[i].distances.data() : nullptr);
+        }
+        const mrpt_async::QueryResult &result = cached[i];
+        indices += i ? ", [" : "[";
+        dists += i ? ", [" : "[";
+        for (int j = 0; j < k; ++j) {
+            indices += (j ? ", " : "") + std::to_string(result.indices[j]);
+            if (distances) {
+                std::snprintf(value, sizeof(value), "%s%.9g", j ? ", " : "", result.distances[j]);
+                dists += value;
+            }
+        }
+        indices += "]";
+        dists += "]";
+    }
+    out = indices + "]" + (distances ? ", " + dists + "]" : "") + "}\n";
+    return 200;
+}
+
+int reload(const HttpRequest &r, std::string &out) {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    const std::string path = parameter(r.query, "index", served.get()->path);
+    std::string error;
+    served.preload([&] { return load_index(path, error); });
+    // the old index is released by the last request that uses it
+    if (!served.swap_preloaded()) {
+        std::fprintf(stderr, "reloading %s failed: %s\n", path.c_str(), error.c_str());
+        out = json_error(error);
+        return 500;
+    }
+    ++n_reloads;
+    out = "{\"index\": \"" + path + "\"}\n";
+    return 200;
+}
+
+std::string metrics() {
+    const std::shared_ptr<Served> s = served.get();
+    const mrpt_async::BatchStats batches = s->queries->stats();
+    std::string text = s->index->metrics_text("mrpt") + s->cache->prometheus_text("mrpt_server");
+    const struct { const char *name, *type, *help; long long value; } samples[] = {
+        {"mrpt_server_requests_total", "counter", "Number of requests served.", n_requests.load()},
+        {"mrpt_server_failed_requests_total", "counter", "Number of requests answered with an error.",
+         n_failed_requests.load()},
+        {"mrpt_server_reloads_total", "counter", "Number of successful reloads of the index.", n_reloads.load()},
+        {"mrpt_server_batches", "gauge", "Number of batches answered since the index was loaded.",
+         batches.n_batches},
+        {"mrpt_server_batched_queries", "gauge", "Number of queries answered since the index was loaded.",
+         batches.n_queries},
+        {"mrpt_server_full_batches", "gauge", "Number of batches of max-batch queries since the index was loaded.",
+         batches.n_full},
+    };
+    for (const auto &sample : samples) {
+        text += std::string("# HELP ") + sample.name + " " + sample.help + "\n";
+        text += std::string("# TYPE ") + sample.name + " " + sample.type + "\n";
+        text += std::string(sample.name) + " " + std::to_string(sample.value) + "\n";
+    }
+    return text;
+}
+
+void serve_connection(int socket) {
+    const int one = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::string buffer, out;
+    HttpRequest r;
+    for (;;) {
+        const int read = read_request(socket, buffer, r);
+        if (read <= 0) {
+            if (read < 0)
+                respond(socket, read == -2 ? 413 : 400, json_error("malformed request"), false);
+            break;
+        }
+
+        int status = 404;
+        const char *content_type = "application/json";
+        out = json_error("not found");
+        if (r.method == "POST" && r.path == "/search") {
+            status = search(r, out);
+        } else if (r.method == "POST" && r.path == "/reload") {
+            status = reload(r, out);
+        } else if (r.method == "GET" && r.path == "/metrics") {
+            status = 200;
+            content_type = "text/plain; version=0.0.4";
+            out = metrics();
+        } else if (r.method == "GET" && r.path == "/health") {
+            status = 200;
+            content_type = "text/plain";
+            out = "ok\n";
+        }
+        ++n_requests;
+        if (status != 200)
+            ++n_failed_requests;
+        if (!respond(socket, status, out, r.keep_alive, content_type) || !r.keep_alive)
+            break;
+    }
+    close(socket);
+}
+
+bool parse_options(int argc, char **argv, Options &o) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--mmap") o.map_index = true;
+        else if (arg == "--progressive") o.progressive = true;
+        else if (arg == "--no-verify") o.verify = false;
+        else if (arg == "--mlock") o.lock_memory = true;
+        else if (arg == "--warmup" && has_value) o.warmup_path = argv[++i];
+        else if (arg == "--query-log" && has_value) o.query_log_path = argv[++i];
+        else if (arg == "--query-log-rate" && has_value) o.query_log_rate = std::atof(argv[++i]);
+        else if (arg == "--dim" && has_value) o.dim = std::atoi(argv[++i]);
+        else if (arg == "--host" && has_value) o.host = argv[++i];
+        else if (arg == "--port" && has_value) o.port = std::atoi(argv[++i]);
+        else if (arg == "--k" && has_value) o.k = std::atoi(argv[++i]);
+        else if (arg == "--votes" && has_value) o.votes = std::atoi(argv[++i]);
+        else if (arg == "--max-batch" && has_value) o.max_batch = std::atoi(argv[++i]);
+        else if (arg == "--max-wait-us" && has_value) o.max_wait_us = std::atoi(argv[++i]);
+        else if (arg == "--cache" && has_value) o.cache = std::max(0, std::atoi(argv[++i]));
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        else paths.push_back(arg);
+    }
+    if (paths.size() != 2 || o.k < 1 || o.votes < 1 || o.port <= 0 || o.port > 65535 ||
+        !(o.query_log_rate > 0 && o.query_log_rate <= 1))
+        return false;
+    o.data_path = paths[0];
+    o.index_path = paths[1];
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    if (!parse_options(argc, argv, options)) {
+        std::fprintf(stderr, "usage: %s [--dim d] [--host address] [--port p] [--k k] [--votes v] "
+                     "[--max-batch b] [--max-wait-us t] [--cache n] [--mmap] [--progressive] [--no-verify] [--mlock] "
+                     "[--warmup file] [--query-log path] [--query-log-rate r] data index\n", argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string error;
+    if (!map_data(error)) {
+        std::fprintf(stderr, "%s: %s\n", options.data_path.c_str(), error.c_str());
+        return 1;
+    }
+    if (!options.warmup_path.empty() && !read_warmup_queries(error)) {
+        std::fprintf(stderr, "%s: %s\n", options.warmup_path.c_str(), error.c_str());
+        return 1;
+    }
+    std::shared_ptr<Served> s = load_index(options.index_path, error, options.progressive);
+    if (!s) {
+        std::fprintf(stderr, "%s: %s\n", options.index_path.c_str(), error.c_str());
+        return 1;
+    }
+    served.swap(s);
+    s.reset();
+    if (!options.query_log_path.empty() &&
+        !query_log.open(options.query_log_path.c_str(), data->rows(), options.query_log_rate)) {
+        std::fprintf(stderr, "cannot write the query log %s\n", options.query_log_path.c_str());
+        return 1;
+    }
+
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (listener < 0 || inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0) {
+        std::fprintf(stderr, "cannot listen on %s:%d: %s\n", options.host.c_str(), options.port, std::strerror(errno));
+        return 1;
+    }
+    std::fprintf(stderr, "serving %lld points of dimension %lld on %s:%d\n", (long long) data->cols(),
+                 (long long) data->rows(), options.host.c_str(), options.port);
+
+    for (;;) {
+        const int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) continue;
+            std::fprintf(stderr, "accept failed: %s\n", std::strerror(errno));
+            return 1;
+        }
+        std::thread(serve_connection, connection).detach();
+    }
+}
@@ -1,4 +1,6 @@
 import os
+import struct
+
 import numpy as np
 
 import mrptlib
@@ -7,116 +9,1821 @@ import mrptlib
 class MRPTIndex(object):
     """
     Wraps the extension module written in C++
+
+    The extension releases the GIL while it works, so several Python threads can use one index at
+    the same time, also in a free-threaded Python 3.13 or later, which it runs in without the GIL.
+    The query methods, save and save_delta only read the index and run concurrently; build, load,
+    apply_delta, insert, remove, set_quantization, set_leading_dimensions, set_leaf_bounds,
+    set_graph, build_graph, set_graph_walk, compact, autotune and the other setters modify it, and
+    wait for the methods running on the same index while the methods called meanwhile wait for them.
+    They must still not run while ann_async queries are pending.
     """
-    def __init__(self, data, depth, n_trees, projection_sparsity='auto', shape=None, mmap=False):
+    def __init__(self, data, depth, n_trees, projection_sparsity='auto', shape=None, mmap=False, seed=0,
+                 projection='gaussian', numa=False, huge_pages=False, metric='euclidean', pipelined=False):
+        """
+        Initializes an MRPT index object.
+        :param data: Input data either as a NxDim float32 numpy ndarray, or another object with the buffer protocol,
+                     or as a filepath to a binary file containing the data. An array whose rows are not
+                     contiguous in memory, such as a slice of columns of a larger array, is copied.
+                     A uint8 or int8 array, or a .bvecs file, which is mapped into memory, is 8-bit data
+                     such as SIFT descriptors: the index copies it a byte per component instead of a float,
+                     and scores the candidates on the bytes, with exact distances. The rows of the array
+                     only need to be contiguous themselves, so a strided view of a file works. 8-bit data
+                     supports the 'euclidean' metric only, and not insert, merge, reorder_data,
+                     set_quantization, set_leading_dimensions, set_leaf_bounds, the graphs, query_radius
+                     or apply_delta.
+        :param depth: The depth of the trees
+        :param n_trees: The number of trees used in the index
+        :param projection_sparsity: Expected ratio of non-zero components in a projection matrix
+        :param shape: Shape of the data as a tuple (N, dim). Needs to be specified only if loading the data from a file
+                      without a header, such as the raw output of binary_converter; the shape of a file with a
+                      header is read from it.
+        :param mmap: If true, the data is mapped into memory. Has effect only if the data is loaded from a file.
+                     The index is then built by reading the file in sequential passes, so the data does
+                     not need to fit in memory.
+        :param seed: The seed of the random projections. Builds with the same nonzero seed give the same
+                     index, and with 0 every build is random.
+        :param projection: The distribution of the nonzero components of the projection matrix, one of
+                           'gaussian', 'rademacher' or 'hadamard'. Rademacher components are +-1 and are
+                           regenerated from the seed, so saved indexes do not store the projection matrix and
+                           load faster. Hadamard projections are dense and use the fast Walsh-Hadamard transform,
+                           which projects single queries faster when dim is large. They are also regenerated
+                           from the seed, and projection_sparsity is ignored.
+        :param numa: If true, the data is spread across the NUMA nodes: a file is read, and an ndarray
+                     copied, in chunks by all OpenMP threads, so that each node holds a share of the data
+                     instead of one node holding all of it. The threads should be bound to all nodes by
+                     setting OMP_PROC_BIND=spread and OMP_PLACES=cores before the module is imported,
+                     which also pins the worker threads of the batch queries. Has no effect with mmap.
+        :param huge_pages: If true, the data read from a file or copied for numa and the large arrays of the
+                           index are backed by transparent huge pages, so the random accesses of the queries
+                           miss the TLB less often. Only a hint: normal pages are used where huge pages are
+                           unavailable. Ignored on Windows.
+        :param metric: The similarity the neighbors are searched by: 'euclidean', 'inner_product' for the
+                       largest inner products with the query, or 'cosine' for the largest cosine
+                       similarities. With the latter two, the distances returned are the similarities,
+                       the largest first, and the index cannot be quantized.
+        :param pipelined: If true, a data file is not read here but by build, by several threads in chunks
+                          while the trees are projected from the points read so far, which hides most of
+                          the read time of a large file behind the build. The data is only available
+                          after build. Has no effect with mmap or with an array; the 'inner_product'
+                          metric, build_sample, split_candidates and trees still read all of the file first.
+        :return:
+        """
+        if not isinstance(data, str):
+            data = np.asarray(data)
+            if len(data.shape) != 2 or len(data) == 0:
+                raise ValueError("The data matrix should be non-empty and two-dimensional")
+            if data.dtype not in (np.float32, np.uint8, np.int8):
+                raise ValueError("The data matrix should have type float32, uint8 or int8")
+            if data.dtype != np.float32:
+                # the index copies the rows of 8-bit data, each of them consecutive bytes
+                if data.strides[1] != 1 or data.strides[0] < data.shape[1]:
+                    data = np.ascontiguousarray(data)
+            else:
+                # the index reads the points as consecutive rows
+                data = np.require(data, requirements=['C_CONTIGUOUS', 'ALIGNED'])
+            n_samples, dim = data.shape
+        else:
+            file_shape = mrptlib.data_file_shape(data)
+            if file_shape is not None:
+                if shape is not None and tuple(shape) != file_shape:
+                    raise ValueError("The shape %s does not match the shape %s in the header of the data file"
+                                     % (tuple(shape), file_shape))
+                shape = file_shape
+            if not isinstance(shape, tuple) or len(shape) != 2:
+                raise ValueError("You must specify the shape of the data as a tuple (N, dim) "
+                                 "when loading data from a binary file without a header")
+            n_samples, dim = shape
+
+        max_depth = np.ceil(np.log2(n_samples))
+        if not 1 <= depth <= max_depth:
+            raise ValueError("Depth should be in range [1, %d]" % max_depth)
+
+        if n_trees < 1:
+            raise ValueError("Number of trees must be positive")
+
+        if projection_sparsity == 'auto':
+            projection_sparsity = 1. / np.sqrt(dim)
+        elif projection_sparsity is None:
+            projection_sparsity = 1
+        elif not 0 < projection_sparsity <= 1:
+            raise ValueError("Sparsity should be in (0, 1]")
+
+        if not 0 <= seed < 2 ** 32:
+            raise ValueError("Seed should be in range [0, 2^32)")
+
+        projections = ('gaussian', 'rademacher', 'hadamard')
+        if projection not in projections:
+            raise ValueError("Projection should be one of %s" % ', '.join(projections))
+
+        metrics = ('euclidean', 'inner_product', 'cosine')
+        if metric not in metrics:
+            raise ValueError("Metric should be one of %s" % ', '.join(metrics))
+
+        self.index = mrptlib.MrptIndex(data, n_samples, dim, depth, n_trees, projection_sparsity, mmap, seed,
+                                       projections.index(projection), numa, huge_pages, metrics.index(metric),
+                                       pipelined)
+        # the index reads a float32 array in place
+        self._data = data if not isinstance(data, str) and data.dtype == np.float32 else None
+        self.dim = dim
+        self.n_trees = n_trees
+        self.depth = depth
+        self.votes_required = 1
+        self.built = False
+        # what __reduce__ needs to open the index again in another process
+        self._source = dict(data=data if isinstance(data, str) else None, shape=(n_samples, dim),
+                            projection_sparsity=projection_sparsity, seed=seed, projection=projection, numa=numa,
+                            huge_pages=huge_pages, metric=metric)
+        self._index_file = None
+
+    def __reduce__(self):
+        """
+        Pickles the index as the path of the index file it was last saved to or loaded from, the
+        path of its data file and its parameters, so that it can be sent to the workers of
+        multiprocessing or Dask. A worker maps both files into memory with load(mmap=True), and all
+        the workers share one copy of them in the page cache instead of each getting a copy or
+        building the index again. The index must not have changed since it was saved or loaded, and
+        data given as a float32 array is pickled with it.
+        """
+        import pickle
+
+        if not self.built or self._index_file is None or self._index_file[1] != self.index.change_count():
+            raise pickle.PicklingError("Only an index saved to or loaded from a file, and not changed since, "
+                                       "can be pickled")
+        source = dict(self._source)
+        if source['data'] is None:
+            if self._data is None:
+                raise pickle.PicklingError("An index of 8-bit data is pickled only when read from a file")
+            source['data'] = self._data
+        elif not os.path.exists(source['data']):
+            raise pickle.PicklingError("The data file %s no longer exists" % source['data'])
+        return _open_pickled_index, (source, self.depth, self.n_trees, self.votes_required, self._index_file[0])
+
+    def build(self, keep_data=True, reorder_data=False, memory_limit=0, progress=None, progress_interval=1.0,
+              split_sample=0, build_sample=0, max_leaf_size=0, split_candidates=1, trees=None,
+              checkpoint_dir=None, checkpoint_trees=10):
+        """
+        Builds the MRPT index.
+        :param keep_data: If false, the data read from a file or copied for numa is released after the index is
+                          built, if the queries no longer read it: with reorder_data, or with a quantized
+                          copy set with shortlist=-1 before the build. A 'float16' copy halves the memory of
+                          the data. Without reorder_data, such an index only answers approximate queries.
+        :param reorder_data: If true, the index keeps a copy of the data in the leaf order of the first
+                             tree, which makes the linear search of the queries read memory mostly
+                             sequentially. The copy is as large as the data, but the queries no longer
+                             need the original data, so it can be released with keep_data=False.
+        :param memory_limit: The maximum number of bytes used for the random projections while the trees
+                             are built, or 0 for no limit. A limit below depth * N * 4 bytes makes the
+                             build project the trees one level at a time, using fewer threads if needed,
+                             which is slower. The limit also sets how many trees are built per pass over
+                             the data.
+        :param progress: A function called as progress(trees_built, n_trees) while the trees are built,
+                         at most once per progress_interval seconds, and once when all trees are built.
+                         It is called from a thread building the trees. By default the build is silent.
+        :param progress_interval: The least time in seconds between two calls of progress
+        :param split_sample: If positive, every node of more points is split by the median of a uniform
+                             sample of split_sample of its points, such as 100000, instead of by the exact
+                             median, which makes the build of the levels near the root faster on large data
+                             sets. The sizes of the children of such a node are then only about equal.
+        :param build_sample: If positive and less than N, the split points of the trees are computed from a
+                             uniform sample of build_sample points only, and then all the points are routed
+                             through the finished trees to fill the leaves. This makes the build several times
+                             faster on large data sets at the cost of slightly unbalanced leaves.
+        :param max_leaf_size: If positive, the largest leaf the trees may have, which bounds the candidates
+                              a query gets from each tree. The split samples are then rejected where they
+                              would leave larger leaves, and trees grown from build_sample or drifting
+                              because of inserts are grown again from all the points. Has no effect below
+                              ceil(N / 2^depth), the leaf size of trees split by exact medians.
+        :param split_candidates: If greater than 1, the random vector of each level of each tree is chosen from
+                                 this many random vectors, as the one along which a sample of the data varies
+                                 the most within the nodes of the level. The better splits reach the same recall
+                                 with fewer trees. Only for the 'gaussian' projection and the 'euclidean' and
+                                 'cosine' metrics.
+        :param trees: If given as (first, last), only the trees first, ..., last - 1 of the n_trees trees are
+                      built, the same trees as those of a full build with the same seed and parameters, so a
+                      large forest can be built in parts on separate machines. The index then has
+                      last - first trees and is saved and loaded as such; append_trees joins the parts in
+                      order. Needs a nonzero seed, and a projection other than 'hadamard'.
+        :param checkpoint_dir: If given, an existing directory to which the trees are saved in parts of
+                               checkpoint_trees trees as they are built, so that a build interrupted, for
+                               example by the preemption of a spot instance, resumes when called again with
+                               the same directory: the parts already saved there are loaded instead of built.
+                               Needs a nonzero seed, and a projection other than 'hadamard'. Not with trees.
+        :param checkpoint_trees: The number of trees in each part saved to checkpoint_dir
+        :return:
+        """
+        if checkpoint_dir is not None and (trees is not None or checkpoint_trees < 1):
+            raise ValueError("checkpoint_dir takes a positive checkpoint_trees and no trees")
+        first, last = 0, -1
+        if trees is not None:
+            first, last = trees
+            if not 0 <= first < last <= self.n_trees:
+                raise ValueError("trees should be a range (first, last) with 0 <= first < last <= %d" % self.n_trees)
+        self.index.build(keep_data, reorder_data, memory_limit, progress, progress_interval, split_sample,
+                         build_sample, max_leaf_size, split_candidates, first, last, checkpoint_dir, checkpoint_trees)
+        if trees is not None:
+            self.n_trees = last - first
+        self.built = True
+
+    def set_data_file(self, path, extent=64 << 20, max_size=1 << 40):
+        """
+        Keeps the data of the index, and the points inserted into it afterwards, in a data file with a
+        header instead of in memory. The file is mapped into memory and grows at its end as points are
+        inserted, so an insert writes only the new points instead of copying all the data. The file
+        always holds all the points of the index in order, and can be given to MRPTIndex as data, for
+        example with an index file saved at the same time; the pickled index then refers to it.
+        :param path: The data file, which is created or overwritten
+        :param extent: The bytes the mapping of the file grows by at a time
+        :param max_size: The largest size of the file in bytes, for which address space is reserved.
+                         Once the file would grow past it, the next insert moves the data into memory.
+        :return:
+        """
+        self.index.set_data_file(path, extent, max_size)
+        self._source.update(data=path, shape=None)
+        self._data = None
+
+    def insert(self, X, labels=None):
+        """
+        Inserts new points into the built index without rebuilding it. The points are routed to the
+        leaves by the existing trees and get the indices following those of the points already in the
+        index. The index keeps its own copy of all the points after the first insert, or appends them
+        to the file of set_data_file. A tree whose
+        leaves grow unbalanced, for example because the new points come from a different distribution,
+        is rebuilt during the call. Undoes the reordering of the data by reorder_data=True of build or load.
+        :param X: The new points as a matrix where each row is a point
+        :param labels: If given, the labels of the new points as in set_labels, which no point of the
+                       index may have yet. By default the new points have no labels.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot insert before building index")
+        X = np.asarray(X)
+        if X.dtype != np.float32 or len(X.shape) != 2:
+            raise ValueError("The new points should be a float32 matrix")
+
+        if labels is None:
+            self.index.insert(X)
+        else:
+            self.index.insert(X, self._labels(labels, len(X)))
+
+    def upsert(self, X, labels):
+        """
+        Inserts new points with labels as insert does, first deleting the points that already have
+        any of the labels, so that a changed item replaces its old point.
+        :param X: The new points as a matrix where each row is a point
+        :param labels: The labels of the new points as in set_labels, each at most once
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot insert before building index")
+        X = np.asarray(X)
+        if X.dtype != np.float32 or len(X.shape) != 2:
+            raise ValueError("The new points should be a float32 matrix")
+
+        self.index.insert(X, self._labels(labels, len(X)), True)
+
+    def set_labels(self, labels):
+        """
+        Gives the points labels, such as the int64 keys of the items in a database, which ann,
+        exact_search and the queries with a filter then return instead of the indices of the
+        neighbors, so that no dict or np.take is needed to map them. find_labels and remove_labels map labels back to points, through a hash
+        table of 8 bytes per point. The labels are saved with the index, deleted points lose theirs,
+        and inserted points get theirs from insert or upsert.
+        :param labels: The int64 label of every point, -1 for a point without one, or None to remove
+                       the labels. No two points may have the same label.
+        :return:
+        """
+        if labels is None:
+            self.index.set_labels(None)
+        else:
+            self.index.set_labels(self._labels(labels, self.index.size()))
+
+    def find_labels(self, labels):
+        """
+        Returns the indices of the points with the given labels.
+        :param labels: The labels of set_labels
+        :return: The index of the point with each label, or -1 if no point has it
+        """
+        return self.index.find_labels(self._labels(labels))
+
+    def remove_labels(self, labels):
+        """
+        Deletes the points with the given labels as remove does, skipping the labels no point has.
+        :param labels: The labels of set_labels of the points to delete
+        :return: The number of points deleted
+        """
+        if not self.built:
+            raise RuntimeError("Cannot delete before building index")
+        return self.index.remove_labels(self._labels(labels))
+
+    @staticmethod
+    def _labels(labels, n=None):
+        labels = np.ascontiguousarray(np.atleast_1d(labels), dtype=np.int64)
+        if len(labels.shape) != 1 or (n is not None and len(labels) != n):
+            raise ValueError("There should be a label for each of the %d points" % n if n is not None
+                             else "The labels should be a vector")
+        return labels
+
+    def merge(self, other):
+        """
+        Adds the points of another index to this one, so that indexes built separately over parts of
+        the data can be combined without building an index over all of it. The points of other are
+        inserted into the trees of this index as by insert, so the smaller index should be merged
+        into the larger one, and point i of other gets the index n + i, where n is the number of
+        points this index had. The points deleted from other are deleted here too, and its labels,
+        which this index must not use, come along. Neither index may have been built with
+        keep_data=False, and other is not changed.
+        :param other: Another built MRPTIndex with the same dimension and metric
+        :return:
+        """
+        if not self.built or not other.built:
+            raise RuntimeError("Cannot merge before building the indexes")
+
+        self.index.merge(other.index)
+
+    def append_trees(self, other):
+        """
+        Appends the trees of another index over the same data to the trees of this one, such as the
+        parts of a forest built with the trees parameter of build, appended in order, which gives the
+        index of the whole forest. The inserted points of other must be those of this index and its
+        deleted points the same. An index whose trees do not continue those of this one in the same
+        forest makes the random vectors of the joined index stored in full when it is saved, and
+        'inner_product' indexes have to continue them. other is not changed.
+        :param other: Another built MRPTIndex with the same data, depth, sparsity and metric
+        :return:
+        """
+        if not self.built or not other.built:
+            raise RuntimeError("Cannot append trees before building the indexes")
+
+        self.index.append_trees(other.index)
+        self.n_trees += other.n_trees
+
+    def remove(self, ids):
+        """
+        Deletes points from the index without rebuilding it. The queries and exact_search never return
+        deleted points, and the indices of the other points do not change. Saved indexes remember
+        the deleted points.
+        :param ids: The indices of the points to delete
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot delete before building index")
+
+        self.index.remove(np.ascontiguousarray(np.atleast_1d(ids), dtype=np.int32))
+
+    def update(self, ids, X):
+        """
+        Replaces the vectors of points of the index, keeping their indices. Each new vector is routed
+        down the trees, and its point is moved only in the trees where it lands in a different leaf,
+        so updating vectors that change a little is much cheaper than deleting and inserting them.
+        The index keeps its own copy of all the points after the first update, and the array the
+        index was constructed with is not changed. Undoes the reordering of the data by
+        reorder_data=True of build or load.
+        :param ids: The indices of the points, each at most once
+        :param X: The new vectors as a matrix where each row is the vector of the point in ids
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot update before building index")
+        X = np.asarray(X)
+        if X.dtype != np.float32 or len(X.shape) != 2:
+            raise ValueError("The new vectors should be a float32 matrix")
+
+        self.index.update(np.ascontiguousarray(np.atleast_1d(ids), dtype=np.int32), X)
+        self._data = None  # the array no longer holds the vectors of the index
+
+    def reconstruct(self, ids):
+        """
+        Returns the vectors of points of the index. A slice of the points of the float32 array the
+        index was constructed with is returned as a view of the array, without a copy. Otherwise the
+        vectors are gathered into a new array, from the data or its reordered copy, or decoded from the
+        quantized copy once the data is released: exactly up to rounding for 'float16' and 'int8', and
+        approximately for 'pq' and 'pca'.
+        :param ids: The indices of the points as an array, or a slice of the indices
+        :return: The vectors as a len(ids) x dim float32 array
+        """
+        if not self.built:
+            raise RuntimeError("Cannot reconstruct before building index")
+        if isinstance(ids, slice):
+            if self._data is not None and ids.stop is not None and 0 <= ids.stop <= len(self._data) and \
+                    (ids.start is None or ids.start >= 0) and (ids.step is None or ids.step > 0):
+                return self._data[ids]
+            ids = np.arange(*ids.indices(self.index.size()))
+        return self.index.reconstruct(np.ascontiguousarray(np.atleast_1d(ids), dtype=np.int32))
+
+    def regrow_trees(self, tree_ids):
+        """
+        Grows some of the trees again with new random vectors from all the points in the index,
+        leaving the other trees as they are. Replaces the trees that inserts have unbalanced a few
+        at a time instead of rebuilding the whole index. Needs the data, so the index must not
+        have been built with keep_data=False. Must not be called while queries are running on the
+        index.
+        :param tree_ids: The indices of the trees to grow again
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot regrow trees before building index")
+
+        self.index.regrow_trees(np.ascontiguousarray(np.atleast_1d(tree_ids), dtype=np.int32))
+
+    def prune_trees(self, Q, k, target_recall, votes_required=None, min_trees=1):
+        """
+        Drops the trees that add the least to the recall of a set of validation queries, one at a
+        time, while the estimated recall of the trees left stays at least target_recall. The recall
+        is estimated as the share of the exact k nearest neighbors of the queries that get
+        votes_required votes. Trees correlated with the others go first, so the index gets smaller
+        and its queries faster at about the same recall. Needs the data. Must not be called while
+        other methods are running on the index.
+        :param Q: The validation queries as a float32 matrix where each row is a query. They should
+                  resemble the real queries.
+        :param k: The number of neighbors the queries will search for
+        :param target_recall: The smallest estimated recall of the trees kept
+        :param votes_required: The vote threshold of the queries, by default that of ann
+        :param min_trees: The fewest trees kept
+        :return: The number of trees kept
+        """
+        if not self.built:
+            raise RuntimeError("Cannot prune trees before building index")
+        if votes_required is None:
+            votes_required = self.votes_required
+        self.n_trees = self.index.prune_trees(Q, k, votes_required, target_recall, min_trees)
+        return self.n_trees
+
+    def set_prefetch(self, distance=-1, madvise=False, sort=False):
+        """
+        Sets how the queries load the candidate vectors ahead of computing their distances.
+        Must not be called while queries are running on the index.
+        :param distance: How many candidates ahead are prefetched into the CPU cache. 0 disables
+                         prefetching and -1 chooses the distance based on the dimension of the data.
+        :param madvise: If true, the memory pages of the candidates are requested from the operating
+                        system before the distances are computed. Useful with memory mapped data that
+                        may not be resident in memory. Has no effect on Windows.
+        :param sort: If true, the candidates of a query are sorted by their index before the
+                     distances are computed, so that the data is read in order of address. Helps
+                     the readahead of memory mapped data. The order of equally distant neighbors
+                     may change.
+        :return:
+        """
+        self.index.set_prefetch(distance, madvise, sort)
+
+    def set_query_interleave(self, group_size=1, leaf_major=False):
+        """
+        Sets how many queries of a batch count their votes in turns, each prefetching the vote
+        counters of its next candidates while the others count theirs, which hides the latency of
+        the counters of large indexes. With leaf_major, the group instead counts its votes leaf by
+        leaf, reading each leaf once for all the queries that reach it, which saves memory traffic
+        when the queries of a batch are clustered. The results are the same. Must not be called
+        while queries are running on the index.
+        :param group_size: The number of queries interleaved, at most 32, or 1 to answer the queries
+                           of a batch one by one
+        :param leaf_major: Whether the votes of a group are counted leaf by leaf
+        :return:
+        """
+        self.index.set_query_interleave(group_size, leaf_major)
+
+    def set_batch_rerank(self, enable=True):
+        """
+        Sets whether a batch of queries scores the candidates of each group of queries together,
+        gathering the union of their candidates once and computing all the distances by one matrix
+        product, which pays off for offline batches whose queries share most of their candidates.
+        The groups are those of set_query_interleave, or 32 queries if it is not set, and a group
+        whose candidates overlap little is scored as usual. The neighbors are the same up to the
+        rounding of the distances. Must not be called while queries are running on the index.
+        :param enable: Whether the candidates of a group are scored together
+        :return:
+        """
+        self.index.set_batch_rerank(enable)
+
+    def set_blocked_splits(self, enable=True):
+        """
+        Sets whether the queries route through a copy of the split points laid out in blocks of
+        four levels of a tree, each in one cache line, so that a descent of a deep tree reads one
+        line per four levels. Pays off for trees of depth 12 or more whose split points do not fit
+        in the cache. The copy is kept up to date when the trees are grown, loaded, pruned or
+        regrown, and the results are the same. Must not be called while queries are running on
+        the index.
+        :param enable: Whether the queries use the blocked copy
+        :return:
+        """
+        self.index.set_blocked_splits(enable)
+
+    def set_margin_votes(self, levels=3):
+        """
+        Makes each tree vote by how far a query lies from the boundaries of its leaf: a tree whose
+        leaf the query lands deep inside gives its points up to levels votes, and one where the
+        query grazed a split a single vote, by which of levels equal shares of the margins of a
+        sample of the data the margin of the query falls in. votes_required then counts these
+        weighted votes and is best tuned again; the finer votes give more steps between the
+        candidates elected by consecutive values. Used by ann, except with max_candidates or query
+        groups, and needs to be set again after the index is built or loaded again. Must not be
+        called while queries are running on the index.
+        :param levels: The most votes of a tree, at most 16, or 1 for one vote per tree
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot set margin votes before building index")
+        self.index.set_margin_votes(levels)
+
+    def set_query_threads(self, n_threads=0):
+        """
+        Sets how many threads the batch queries, such as ann with a matrix of queries and
+        exact_search, are divided between. A single query always runs on the calling thread alone,
+        so it can be called from a thread pool of one's own. Must not be called while queries are
+        running on the index.
+        :param n_threads: The number of threads, 1 to answer batches serially on the calling
+                          thread, or 0 for the default number of OpenMP threads
+        :return:
+        """
+        if n_threads < 0:
+            raise ValueError("The number of threads must be non-negative")
+        self.index.set_query_threads(n_threads)
+
+    def set_parallel_scoring(self, min_candidates=None):
+        """
+        Sets a single query that elects at least min_candidates candidates, such as one with few
+        votes required in a dense region, to score them on the threads of set_query_threads. The
+        queries with fewer candidates are scored serially, as the threads would only add the cost
+        of starting them. Without min_candidates, the threshold is measured on the index by timing
+        samples of candidates scored both ways. The results are the same. Must not be called while
+        queries are running on the index.
+        :param min_candidates: The fewest candidates scored in parallel, 0 to score all queries
+                               serially, or None to measure the threshold
+        :return: The threshold set
+        """
+        if min_candidates is None:
+            return self.index.calibrate_parallel_scoring()
+        if min_candidates < 0:
+            raise ValueError("The number of candidates must be non-negative")
+        self.index.set_parallel_scoring(min_candidates)
+        return min_candidates
+
+    def set_executor(self, executor='openmp', n_threads=0):
+        """
+        Sets what runs the parallel work of the index: building, batch queries, knn_graph and
+        loading. Must not be called while queries are running on the index.
+        :param executor: 'openmp' for OpenMP, or 'pool' for a work-stealing pool of threads of the
+                         index's own, which needs no OpenMP; a process that forks should create
+                         its pool after forking
+        :param n_threads: The number of threads of the pool, 0 for the number of CPUs
+        :return:
+        """
+        if executor not in ('openmp', 'pool'):
+            raise ValueError("The executor must be 'openmp' or 'pool'")
+        if n_threads < 0:
+            raise ValueError("The number of threads must be non-negative")
+        self.index.set_executor(executor == 'pool', n_threads)
+
+    def set_build_priority(self, n_threads=0, niceness=10, duty_cycle=1.0):
+        """
+        Sets build and regrow_trees to build the trees in the background of a process that keeps
+        serving queries from another index, such as the previous one, which the new index replaces
+        when it is done. The build runs on a pool of threads of its own, lowered by niceness on Linux,
+        and with a duty cycle below one each thread pauses after every tree so that it works only that
+        share of the time, leaving the cores and the memory bandwidth to the queries. The trees are the
+        same as those of a build on as many threads. The memory of the build is bounded with memory_limit of build.
+        Must not be called while other methods are running on the index.
+        :param n_threads: The threads of the build, 0 to build as usual
+        :param niceness: How much lower than the calling thread the build threads run, 0 to 19
+        :param duty_cycle: The share of the time each build thread works, in (0, 1]; the build takes
+                           about 1 / duty_cycle times as long
+        :return:
+        """
+        if n_threads < 0:
+            raise ValueError("The number of threads must be non-negative")
+        if not 0 <= niceness <= 19:
+            raise ValueError("The niceness must be in range [0, 19]")
+        if not 0 < duty_cycle <= 1:
+            raise ValueError("The duty cycle must be in range (0, 1]")
+        self.index.set_build_priority(n_threads, niceness, duty_cycle)
+
+    def enable_metrics(self, enable=True):
+        """
+        Sets whether the index keeps latency histograms of its queries, builds and loads, and counts
+        its failed loads, for monitoring long-running processes. The histograms are recorded by the
+        C++ code without locks, so the queries do not need to be timed in Python. Enabling the
+        metrics resets them. Must not be called while other methods are running on the index.
+        :param enable: Whether the metrics are kept
+        :return:
+        """
+        self.index.set_metrics(enable)
+
+    def metrics(self, prefix='mrpt', labels=''):
+        """
+        Returns the metrics kept since enable_metrics in the Prometheus text exposition format, for
+        example to be served by a metrics endpoint. Can be called while queries are running.
+        :param prefix: The beginning of the names of the metrics
+        :param labels: Labels added to every sample, e.g. 'index="main"'
+        :return: The metrics as a string, empty if they are not enabled
+        """
+        return self.index.metrics_text(prefix, labels)
+
+    def enable_recall_monitor(self, sample_rate=0.01, window=1000, threads=1):
+        """
+        Starts estimating the recall of the queries while they are served: a random fraction of the
+        queries of ann is searched again exactly on a background thread, and the mean recall of the
+        last window of them is kept with the metrics, which this enables. The queries never wait for
+        the monitor; the ones sampled while it is busy are dropped. A falling recall tells that the
+        data has drifted from the trees, and the index should be rebuilt or get more trees.
+        Must not be called while other methods are running on the index.
+        :param sample_rate: The fraction of the queries checked, 0 to stop the monitor
+        :param window: The number of the last checked queries the recall is the mean of
+        :param threads: The number of threads of the exact searches, the cores left over by the queries
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot monitor the recall before building index")
+        if not 0 <= sample_rate <= 1:
+            raise ValueError("sample_rate should be in range [0, 1]")
+        if window < 1 or threads < 1:
+            raise ValueError("window and threads must be positive")
+        self.index.set_recall_monitor(sample_rate, window, threads)
+
+    def recall_estimate(self):
+        """
+        Returns the recall estimated by the monitor of enable_recall_monitor, which is also in the
+        metrics. Can be called while queries are running.
+        :return: A dict with the mean 'recall' at k of the last 'recent' queries checked, and the
+                 number of queries 'checked' and 'dropped' in all
+        """
+        return self.index.recall_estimate()
+
+    def set_quantization(self, quantization='int8', shortlist=0, subspaces=0):
+        """
+        Makes the queries score their candidates against a quantized copy of the data, and re-rank
+        only the nearest of them with the data itself. The copy takes a quarter ('int8') or a half
+        ('float16') of the memory of the data, which can then stay in a memory mapped file. With
+        'pq', product quantization, each vector is coded with one byte per subspace of the dimensions,
+        with codebooks trained by k-means. 'binary' keeps a bit per random vector of the trees, the
+        sign of the projection of a point onto it relative to the median, and ranks the candidates by
+        the number of bits that differ from those of the query, a cheap first stage whose shortlist
+        is always re-ranked with the data. 'pca' keeps the projections of the points onto the
+        principal components of the data, the directions of its largest variance, and scores the
+        candidates in the space they span. The copy is remade when the index is built, loaded or
+        reordered, and is not saved with the index. Only indexes with the 'euclidean' metric can be
+        quantized.
+        Must not be called while other methods are running on the index.
+        :param quantization: One of 'float32', which removes the copy, 'int8', 'float16', 'pq', 'binary'
+                             or 'pca'
+        :param shortlist: The number of candidates re-ranked with the data, at least k. 0 re-ranks 4 * k,
+                          and -1 re-ranks none, so the queries return the distances by the copy; not
+                          with 'binary'.
+        :param subspaces: The number of subspaces of 'pq', and bytes per vector. 0 uses dim / 8.
+                          With 'pca' the number of principal components, 0 using dim / 4.
+        :return:
+        """
+        quantizations = ('float32', 'int8', 'float16', 'pq', 'binary', 'pca')
+        if quantization not in quantizations:
+            raise ValueError("Quantization should be one of %s" % ', '.join(quantizations))
+        if shortlist < -1:
+            raise ValueError("shortlist must be at least -1")
+        if quantization == 'binary' and shortlist < 0:
+            raise ValueError("shortlist must be non-negative with 'binary'")
+        if subspaces < 0:
+            raise ValueError("subspaces must be non-negative")
+        self.index.set_quantization(quantizations.index(quantization), shortlist, subspaces)
+
+    def set_leading_dimensions(self, dimensions):
+        """
+        Makes the index keep a copy of the dimensions of the data of the largest variance, and the
+        linear search of the 'euclidean' metric score each candidate on them first:
+        once k candidates are found, one whose partial distance is already past the k-th nearest is
+        rejected without reading its vector. The neighbors found are the same, and fewer bytes are
+        read when the variance is concentrated in a few dimensions. The copy takes
+        dimensions / dim of the memory of the data, and is remade when the index is built or loaded.
+        Must not be called while other methods are running on the index.
+        :param dimensions: The number of dimensions copied, 0 to remove the copy
+        :return:
+        """
+        if dimensions < 0:
+            raise ValueError("dimensions must be non-negative")
+        self.index.set_leading_dimensions(dimensions)
+
+    def set_projection_precision(self, precision='float16'):
+        """
+        Makes the single queries project onto a copy of the random matrix rounded to half precision
+        ('float16') or to 8-bit codes with a step per row ('int8'), read in a half or a quarter of the
+        bytes of the matrix. Call it before build: the trees are then split by the projections onto
+        the rounded matrix, which the queries get too. On a built index, the queries are routed with
+        the rounded matrix against the splits of the exact one, which loses a little recall. The
+        precision is not saved with the index; set it again after loading. Only dense 'gaussian' and
+        'rademacher' projections can be rounded.
+        Must not be called while other methods are running on the index.
+        :param precision: One of 'float32', which removes the copy, 'int8' or 'float16'
+        :return:
+        """
+        precisions = {'float32': 0, 'int8': 1, 'float16': 2}
+        if precision not in precisions:
+            raise ValueError("precision should be one of 'float32', 'int8' or 'float16'")
+        self.index.set_projection_precision(precisions[precision])
+
+    def set_leaf_bounds(self, enable=True):
+        """
+        Makes the index keep the centroid of every leaf and the radius of the ball around it that
+        holds its points. The multi-probe queries of ann with max_candidates and votes_required 1
+        then search the leaves they visit nearest first, and skip the leaves that cannot hold a point
+        nearer than the k-th found so far, with the same results. This pays off most for data of low
+        intrinsic dimension. The bounds take dim + 1 floats per leaf of every tree, are kept up to date
+        by insert and are saved with the index. Only indexes with the 'euclidean' metric keep them.
+        Must not be called while other methods are running on the index.
+        :param enable: Whether the bounds are kept
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot set leaf bounds before building index")
+        self.index.set_leaf_bounds(int(bool(enable)))
+
+    def set_graph(self, indptr, neighbors):
+        """
+        Gives the index a k-nearest-neighbor graph of the data, such as the one knn_graph returns,
+        for the queries to walk after the linear search; see set_graph_walk. The graph is copied
+        into the index and is not saved with it. Points inserted later have no neighbors in it, and
+        removed points are skipped. Must not be called while other methods are running on the index.
+        :param indptr: The neighbors of point i are neighbors[indptr[i]:indptr[i + 1]], for the
+                       first len(indptr) - 1 points
+        :param neighbors: The ids of the neighbors
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot set a graph before building index")
+        indptr = np.ascontiguousarray(indptr, dtype=np.int64)
+        neighbors = np.ascontiguousarray(neighbors, dtype=np.int32)
+        self.index.set_graph(indptr, neighbors)
+
+    def build_graph(self, degree, votes_required=1):
+        """
+        Builds a k-nearest-neighbor graph of the data with knn_graph and gives it to the index as
+        set_graph does. Must not be called while other methods are running on the index.
+        :param degree: The number of neighbors of each point
+        :param votes_required: The number of leaves of a point a neighbor must share
+        :return: The number of edges of the graph
+        """
+        if not self.built:
+            raise RuntimeError("Cannot build a graph before building index")
+        return self.index.build_graph(degree, votes_required)
+
+    def set_graph_walk(self, hops, beam=0):
+        """
+        Makes the queries refine the neighbors they found by walking the graph of set_graph or
+        build_graph, as the search layer of HNSW does: the walk repeatedly takes the nearest point
+        found whose neighbors it has not scored, scores them and keeps the beam nearest points, for
+        at most hops points. At high recall a few hops find more of the true neighbors than adding
+        trees at the same cost. Queries with a deadline do not walk. Must not be called while other
+        methods are running on the index.
+        :param hops: The most points a query expands, 0 for no walk
+        :param beam: The number of nearest points kept while walking, at least k; 0 keeps k
+        :return:
+        """
+        self.index.set_graph_walk(hops, beam)
+
+    def calibrate_batch(self, k=10, votes_required=None, cache_path=None):
+        """
+        Chooses how ann answers a matrix of queries by timing the choices on this index with up to
+        1024 objects of the data as queries: the number of queries projected with one matrix
+        product, and whether the votes of groups of queries are counted in turns or leaf by leaf and
+        their candidates scored by one matrix product. The best choices depend on the caches of the
+        machine, the dimension and the number of trees. Takes about a second. Must not be called
+        while other methods are running on the index.
+        :param k: The number of neighbors of the queries timed
+        :param votes_required: The votes_required of the queries timed, by default that of autotune
+        :param cache_path: If given, a file the choices are kept in: they are read from it if it was
+                           written for an index of the same shape on as many threads, for example on
+                           an earlier load on this host, and otherwise timed and written to it
+        :return: A dict of the choices: 'block_size', 'interleave', 'leaf_major' and 'rerank'
+        """
+        if not self.built:
+            raise RuntimeError("Cannot calibrate the batches of an index that has not been built")
+        if votes_required is None:
+            votes_required = self.votes_required
+        return self.index.calibrate_batch(k, votes_required, cache_path)
+
+    def set_query_planner(self, enabled=True, calibrate=False):
+        """
+        Makes the queries choose between the trees and brute force one at a time, by estimating the
+        cost of each from the size of the index, the share of the objects that pass the filter, the
+        number of candidates votes_required elects and the speed of the kernels. Small indexes,
+        selective filters and low votes_required are then answered exactly by the scan. The
+        queries answered by brute force are counted as 'brute_force' in the stats of ann. Must not
+        be called while other methods are running on the index.
+        :param enabled: Whether the queries choose their plan
+        :param calibrate: Whether the speed of the kernels is measured on this machine, in a few
+                          milliseconds, instead of assumed
+        :return: A dict of the costs in nanoseconds the plans are estimated with if calibrate
+        """
+        if not self.built:
+            raise RuntimeError("Cannot plan the queries of an index that has not been built")
+        self.index.set_query_planner(enabled)
+        if calibrate:
+            return self.index.calibrate_planner()
+
+    def compact(self):
+        """
+        Moves the trees and the random projections of the index into one block of memory, merging
+        the inserted points into the leaves and removing the deleted points from them. The index is
+        then a few large allocations, which are freed at once when it is destroyed. The results of
+        the queries do not change; insert, remove and the other methods that change the trees copy
+        them out of the block again. Must not be called while other methods are running on the index.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot compact index before building")
+        self.index.compact()
+
+    def set_memory_tiers(self, far_node, near_node=None, leaves='near', data='far'):
+        """
+        Places the index in two tiers of memory on hosts with memory slower than the local DRAM,
+        such as a pool attached over CXL or persistent memory that shows up as a NUMA node of its
+        own. The split points and the random projections, read at every level of every tree by
+        every query, always go to near memory; the leaves and the data go where they are told. With
+        set_quantization and a negative shortlist, the quantized copy of the data stays in near
+        memory and the full vectors in far memory are read only for the shortlist. The index is
+        moved now if it is built, as by compact, and every later load places it the same way.
+        Must not be called while other methods are running on the index.
+        :param far_node: The NUMA node of far memory, or -1 for the memory of any node
+        :param near_node: The NUMA node of near memory, or None for the memory of any node
+        :param leaves: 'near' or 'far', the tier of the leaves of the trees
+        :param data: 'near' or 'far', the tier of the data, which is copied there
+        :return:
+        """
+        for name, tier in (('leaves', leaves), ('data', data)):
+            if tier not in ('near', 'far'):
+                raise ValueError("%s must be 'near' or 'far'" % name)
+        self.index.set_memory_tiers(-1 if near_node is None else near_node, far_node, leaves == 'far',
+                                    data == 'far', self.built)
+
+    def compress_leaves(self):
+        """
+        Compresses the leaves of the trees by sorting the ids of each leaf and bit-packing the
+        differences of consecutive ids, which takes about half the memory of the plain ids or less
+        for leaves of a hundred points or more. The queries unpack the leaves as they count their
+        votes and find the same candidates. insert, prune, compact and the other methods that change
+        the trees unpack the leaves again. Must not be called while other methods are running on
+        the index.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot compress leaves before building")
+        self.index.compress_leaves()
+
+    def sort_leaves(self):
+        """
+        Sorts the ids of each leaf of the trees. The queries of large indexes whose leaves hold
+        few of the points, such as those of deep trees over hundreds of millions of points, then
+        count their votes by merging the sorted leaves instead of with a counter for every point,
+        which saves each query thread a buffer the size of the data and its cache misses. The
+        candidates are the same. insert, prune, load and the other methods that change the index
+        leave the leaves unsorted for this purpose until sort_leaves is called again; compressed
+        leaves are always sorted. Must not be called while other methods are running on the index.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot sort leaves before building")
+        self.index.sort_leaves()
+
+    def collapse_duplicates(self):
+        """
+        Stores each group of identical points once in the trees, keeping the point with the
+        smallest id in the leaves and leaving its duplicates out, so that data with many copies of
+        the same vectors has smaller leaves and each vector is scored once. The queries return the
+        duplicates of a neighbor right after it, at the same distance, as long as there is room
+        among the k neighbors. insert and remove put the duplicates back into the trees, and save
+        writes them like the other points. Needs to be called again after build or load. Does
+        nothing for 8-bit data. Must not be called while other methods are running on the index.
+        :return: The number of points left out of the trees
+        """
+        if not self.built:
+            raise RuntimeError("Cannot collapse duplicates before building")
+        return self.index.collapse_duplicates()
+
+    def save(self, path, compression=0):
+        """
+        Saves the MRPT index to a file.
+        :param path: Filepath to the location of the saved index.
+        :param compression: If nonzero, the file is compressed with zstd at this level, from 1, the
+                            fastest, to 19, the smallest, in blocks compressed and decompressed by all
+                            threads, to copy the index between machines in fewer bytes. load and load_bytes
+                            decompress the file into memory; it cannot be mapped with mmap. Needs the
+                            module built with MRPT_ZSTD=1.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot save index before building")
+        if not 0 <= compression <= 22:
+            raise ValueError("compression should be a zstd level in range [0, 22]")
+        self.index.save(path, compression)
+        self._index_file = (os.path.abspath(path), self.index.change_count())
+
+    def load(self, path, reorder_data=False, mmap=False, verify=True):
+        """
+        Loads the MRPT index from a file. Raises IOError telling why if the file cannot be loaded, for
+        example because it is truncated or corrupted.
+        :param path: Filepath to the location of the index.
+        :param reorder_data: If true, keeps a copy of the data in the leaf order of the first tree, see build.
+        :param mmap: If true, the file is mapped into memory read-only and the index is used from the mapping
+                     without reading it first, so loading is fast and the pages are read as the queries need
+                     them. Processes that map the same file share one copy of it in the page cache. Only the
+                     random matrix of 'rademacher' and 'hadamard' projections is regenerated per process. Needs
+                     a file saved by this version. With reorder_data the index is copied into memory anyway.
+        :param verify: If true, the checksums of the file are checked, which reads the whole file, also
+                       when it is mapped. The sizes in the file are checked either way.
+        :return:
+        """
+        self.index.load(path, reorder_data, mmap, verify)
+        self.built = True
+        self._index_file = (os.path.abspath(path), self.index.change_count())
+
+    def save_delta(self, path, base):
+        """
+        Saves the changes of the index since base to a delta file, so that the servers holding the
+        index base was loaded from can be brought up to date with apply_delta by copying only the
+        changes: the new points and their leaves, the ids of the deleted points, and the trees that
+        were grown again by insert or regrow_trees. This index needs its data if it has new points.
+        :param path: Filepath to the delta file.
+        :param base: The MRPTIndex this one was changed from, typically the last index file copied to
+                     the servers loaded into an index over the data of its points.
+        :return:
+        """
+        if not self.built or not base.built:
+            raise RuntimeError("Cannot save a delta before building the indexes")
+        self.index.save_delta(path, base.index)
+
+    def apply_delta(self, path):
+        """
+        Applies a delta file written by save_delta, which turns this index into the index the delta
+        was saved from. The index has to be in the state of the base of the delta, loaded from the
+        same file or from it and the same earlier deltas; otherwise IOError is raised and the index
+        does not change. The new points are kept by the index as by insert.
+        :param path: Filepath to the delta file.
+        :return:
+        """
+        if not self.built:
+            raise RuntimeError("Cannot apply a delta before building or loading the index")
+        self.index.apply_delta(path)
+
+    def to_bytes(self):
+        """
+        Saves the MRPT index into bytes, in the format of the files written by save, for example to send
+        it over the network.
+        :return: The saved index as bytes.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot save index before building")
+        return self.index.to_bytes()
+
+    def load_bytes(self, data, reorder_data=False, zero_copy=False, verify=True):
+        """
+        Loads the MRPT index from bytes returned by to_bytes or read from a saved index file.
+        :param data: The saved index as bytes or another object supporting the buffer protocol, such as
+                     a bytearray, a memoryview or a numpy array.
+        :param reorder_data: If true, keeps a copy of the data in the leaf order of the first tree, see build.
+        :param zero_copy: If true, the index is used straight from data instead of being copied, like a
+                          mapped file with the mmap option of load. The index then keeps a reference to
+                          data, which must not be modified. With reorder_data the index is copied anyway.
+        :param verify: If true, the checksums of the index are checked, see load.
+        :return:
+        """
+        self.index.load_bytes(data, reorder_data, zero_copy, verify)
+        self.built = True
+
+    def load_async(self, path, verify=True, mmap=False):
+        """
+        Starts loading the MRPT index from a file in the background and returns once the index can answer
+        queries. The trees are loaded in parallel, and until all of them are loaded the queries use the ones
+        loaded so far, with lower recall. Use load_progress to follow the loading and wait_load to wait for it.
+        :param path: Filepath to the location of the index.
+        :param verify: If true, the checksums of the file are checked once all the trees are loaded, and
+                       wait_load raises IOError if they do not match.
+        :param mmap: If true, the file is mapped into memory as by load, and opened in a time independent
+                     of its size: the trees are checked one at a time in the background, and their pages
+                     are read as the queries first need them. A job that runs only a few queries then
+                     starts at once and reads only the parts of the index it uses, but with verify the
+                     whole file is still read in the background for the checksums.
+        :return:
+        """
+        self.index.load_async(path, verify, mmap)
+        self.built = True
+        self._index_file = (os.path.abspath(path), self.index.change_count())
+
+    def load_url(self, url, verify=True, streams=16):
+        """
+        Starts loading the MRPT index from an index file in object storage, such as an S3-compatible
+        store, without downloading it to the local disk first, and returns once the index can answer
+        queries. The header and the split points are read first, by range GETs in parallel, and the
+        leaves are then read in the background as by load_async, whose load_progress and wait_load
+        follow the loading. Not available on Windows.
+        :param url: The http:// URL of the file, with an IPv4 address, presigned for GET if the bucket is
+                    private. HTTPS is not supported.
+        :param verify: If true, the checksums of the file are checked once all the trees are read, and
+                       wait_load raises IOError if they do not match.
+        :param streams: The most range GETs in flight at once
+        :return:
+        """
+        self.index.load_url(url, verify, streams)
+        self.built = True
+        self._index_file = None
+
+    def load_progress(self):
+        """
+        Returns the progress of load_async.
+        :return: The number of trees the queries use and the number of trees in the index.
+        """
+        return self.index.trees_loaded(), self.n_trees
+
+    def wait_load(self):
+        """
+        Waits until the loading started by load_async has finished, and raises IOError if it failed.
+        :return:
+        """
+        self.index.wait_load()
+
+    def share_random_matrix(self, source):
+        """
+        Makes the index use the random matrix of another index instead of a copy of its own. Indexes
+        built with the same parameters and seed have the same random matrix, so many small indexes,
+        such as one per tenant, can keep a single copy of it between them. The matrix stays alive as
+        long as any index uses it, and an index that is rebuilt or loaded again gets its own.
+        :param source: Another built MRPTIndex with the same dimension, n_trees, depth, density,
+                       projection, metric and seed
+        :return: True if the matrix is shared, False if the random matrices of the indexes differ
+        """
+        if not self.built or not source.built:
+            raise RuntimeError("Cannot share the random matrix before building the indexes")
+        return self.index.share_random_matrix(source.index)
+
+    def stats(self):
+        """
+        Reports the shape of the trees, for diagnosing degenerate trees whose large leaves blow up
+        the candidates of the queries, for example after a rebuild that lost recall or speed. The
+        trees and samples are divided between the threads, and the report takes at most a few
+        seconds. Can be called while the index is queried.
+        :return: A dict of: leaf_histogram, an n_trees x (depth + 2) array of the number of leaves of
+                 each tree by size, column 0 for the empty leaves and column b for the sizes in
+                 [2^(b-1), 2^b); max_leaf_size, the largest leaf of each tree; imbalance, the
+                 largest leaf over the size of a balanced leaf, high for trees split by heavily tied
+                 projections; expected_leaf_size, the mean size of the leaf of an object, which the
+                 candidates of the queries grow with; and, with the data, median_margin, the median
+                 distance of a sample of the data to the split points of each tree, margin_quantiles,
+                 the 10th, 25th, 50th, 75th and 90th percentiles of these margins over all trees, and
+                 leaf_overlap, an n_trees x n_trees array of the mean Jaccard similarity of the
+                 leaves of a sampled object in two trees, high for trees that add few new candidates.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot report the trees of an index that has not been built")
+        return self.index.index_stats()
+
+    def memory_usage(self):
+        """
+        Reports the memory the parts of the index take. Can be called while the index is queried.
+        :return: A dict of bytes: data for the array the index reads in place, mapped_data for a
+                 data file mapped with mmap, owned_data for the copies of the data the index keeps,
+                 quantized_data, split_points, leaves, random_matrix (counted also when shared with
+                 other indexes), graph for the graph of set_graph or build_graph, mapped_index for the part of the index mapped from a file by load,
+                 scratch for the working memory each querying thread keeps, and index for the total
+                 of the index itself without the data array and the scratch. build_peak is 0.
+        """
+        return self.index.memory_usage()
+
+    @staticmethod
+    def estimate_memory(n_samples, dim, depth, n_trees, projection_sparsity='auto', projection='gaussian'):
+        """
+        Predicts the memory of an index before building it, for the default parameters of build.
+        :param n_samples: The number of points
+        :param dim: The dimension of the points
+        :param depth: The depth of the trees
+        :param n_trees: The number of trees
+        :param projection_sparsity: As in the constructor
+        :param projection: As in the constructor
+        :return: A dict with the keys of memory_usage, where build_peak is the most memory the build
+                 takes at once besides the data
+        """
+        if projection_sparsity is None or projection == 'hadamard':
+            projection_sparsity = 1
+        elif projection_sparsity == 'auto':
+            projection_sparsity = 1. / np.sqrt(dim)
+        return mrptlib.estimate_memory(n_samples, dim, n_trees, depth, projection_sparsity)
+
+    def prefault(self):
+        """
+        Reads in every page of the index file mapped by load with mmap and of the data the queries
+        read, so that the first queries do not wait for the disk. Can run while the index is queried.
+        :return:
+        """
+        self.index.prefault()
+
+    def lock_memory(self, lock=True):
+        """
+        Locks the memory the queries read in RAM, so that it is not paged out: the data, or its
+        reordered or quantized copy, and the index file mapped by load with mmap, or the trees moved
+        into one block by compact. The pages are faulted in. The memory of later changes to the
+        index is not locked. The locked memory counts against the RLIMIT_MEMLOCK limit of the process.
+        Not supported on Windows.
+        :param lock: If false, the memory is unlocked instead
+        :return: True if all of the memory was locked or unlocked
+        """
+        return self.index.lock_memory(lock)
+
+    def warmup(self, Q=None, k=10, votes_required=None, lock=False):
+        """
+        Makes the index ready to answer queries at steady-state latency: faults in the pages the
+        queries read with prefault, locks them with lock_memory if asked, and answers a sample of
+        queries, such as logged ones, discarding the answers, so that the caches and the working
+        memory of the querying threads are warm too.
+        :param Q: The queries replayed as a matrix with one query per row, or None to replay none
+        :param k: The number of neighbors the replayed queries search for
+        :param votes_required: As in ann
+        :param lock: If true, the memory is locked with lock_memory
+        :return: False if the memory could not be locked, otherwise True
+        """
+        self.prefault()
+        locked = self.lock_memory() if lock else True
+        if Q is not None:
+            if not self.built:
+                raise RuntimeError("Cannot query before building index")
+            self.ann(np.asarray(Q, dtype=np.float32), k, votes_required)
+        return locked
+
+    def autotune(self, Q, k, target_recall=None, min_depth=None):
+        """
+        Measures the recall and estimates the query time of every index with fewer or shallower trees
+        that can be cut from this one, and every votes_required, on a set of test queries. If
+        target_recall is given, the index is then pruned to the fastest configuration estimated to
+        reach it, and its votes_required becomes the default of ann.
+        :param Q: The test queries as a matrix where each row is a query. They should resemble the real
+                  queries but not be points of the data.
+        :param k: The number of neighbors the queries will search for
+        :param target_recall: The recall the pruned index should reach, or None to only measure
+        :param min_depth: The smallest depth considered, by default half of the depth of the index.
+                          Tuning is slower the smaller it is.
+        :return: The Pareto front of the configurations as a list of dicts with keys n_trees, depth,
+                 votes_required, estimated_qtime (in seconds) and estimated_recall, sorted by time.
+                 The configurations missing from it are both slower and less accurate than some
+                 configuration in it.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot tune before building index")
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32 or len(Q.shape) != 2:
+            raise ValueError("The test queries should be a float32 matrix")
+        if min_depth is None:
+            min_depth = max(1, self.depth // 2)
+        if not 1 <= min_depth <= self.depth:
+            raise ValueError("min_depth should be in range [1, %d]" % self.depth)
+
+        keys = ('n_trees', 'depth', 'votes_required', 'estimated_qtime', 'estimated_recall')
+        pareto_front = [dict(zip(keys, p)) for p in self.index.autotune(Q, k, min_depth)]
+        if target_recall is None:
+            return pareto_front
+
+        reaching = [p for p in pareto_front if p['estimated_recall'] >= target_recall]
+        if not reaching:
+            raise ValueError("No configuration reaches recall %g, the best reaches %g" %
+                             (target_recall, pareto_front[-1]['estimated_recall']))
+        best = reaching[0]
+        self.index.prune(best['n_trees'], best['depth'])
+        self.n_trees, self.depth, self.votes_required = best['n_trees'], best['depth'], best['votes_required']
+        return pareto_front
+
+    def fit_memory_budget(self, Q, k, target_recall, memory_budget, min_depth=None):
+        """
+        Cuts the index down to the fastest configuration of autotune that reaches target_recall and
+        fits in memory_budget bytes together with the data its queries read, and picks how the data
+        and the leaves are stored: the data kept, then also the leaves compressed, then a 'float16'
+        and lastly an 'int8' copy of the data scored without re-ranking, each with plain and then
+        compressed leaves. The recall of the quantized copies is measured on the test queries. The
+        index is then pruned, quantized and compressed as planned, and its votes_required becomes
+        the default of ann. With a quantized copy, a data file the index owns is released, and a
+        data array can be dropped by the caller. Build the index with more and deeper trees than
+        needed, since it is only cut down. Must not be called while other methods are running on
+        the index.
+        :param Q: The test queries as a matrix where each row is a query, as for autotune
+        :param k: The number of neighbors the queries will search for
+        :param target_recall: The recall the queries should reach
+        :param memory_budget: The bytes the index and the data its queries read may take
+        :param min_depth: The smallest depth considered, by default half of the depth of the index
+        :return: A dict with the keys n_trees, depth, votes_required, estimated_qtime and
+                 estimated_recall of autotune, quantization ('float32', 'float16' or 'int8'),
+                 compressed_leaves, recall and memory, the predicted memory with the keys of
+                 memory_usage where data is the data the queries read
+        """
+        if not self.built:
+            raise RuntimeError("Cannot tune before building index")
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32 or len(Q.shape) != 2:
+            raise ValueError("The test queries should be a float32 matrix")
+        if min_depth is None:
+            min_depth = max(1, self.depth // 2)
+        if not 1 <= min_depth <= self.depth:
+            raise ValueError("min_depth should be in range [1, %d]" % self.depth)
+        if memory_budget < 0:
+            raise ValueError("The memory budget must be non-negative")
+
+        plan = self.index.fit_memory_budget(Q, k, target_recall, int(memory_budget), min_depth)
+        if plan is None:
+            raise ValueError("No configuration reaches recall %g in %d bytes" % (target_recall, memory_budget))
+        keys = ('n_trees', 'depth', 'votes_required', 'estimated_qtime', 'estimated_recall', 'quantization',
+                'compressed_leaves', 'recall', 'memory')
+        plan = dict(zip(keys, plan))
+        plan['quantization'] = ('float32', 'int8', 'float16')[plan['quantization']]
+        plan['compressed_leaves'] = bool(plan['compressed_leaves'])
+        self.n_trees, self.depth, self.votes_required = plan['n_trees'], plan['depth'], plan['votes_required']
+        return plan
+
+    def ann(self, q, k, votes_required=None, return_distances=False, max_candidates=0, return_stats=False,
+            max_distances=0, time_budget=0, out=None, out_distances=None, return_votes=False, target_candidates=0,
+            return_confidence=False):
+        """
+        The MRPT approximate nearest neighbor query.
+        :param q: The query object, i.e. the vector whose nearest neighbors are searched for. If q is a
+                  matrix, each row is a query and the queries are answered in parallel. Any float32
+                  array or object with the buffer protocol is accepted, and slices of larger arrays
+                  whose rows are contiguous are read in place.
+        :param k: The number of neighbors the user wants the query to return
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+                               By default the value chosen by autotune, or 1.
+        :param return_distances: Whether the distances are also returned
+        :param max_candidates: If positive, the query visits several leaves in each tree, in the order
+                               of how close the query is to the splits leading to them, until the
+                               visited leaves hold at least this many objects. Reaches the same recall
+                               with fewer trees. If 0, the query visits one leaf per tree.
+        :param return_stats: Whether a dict of counters summed over the queries is also returned:
+                             the number of 'queries', the objects 'touched' by a vote, the
+                             candidates 'elected' to the linear search, the 'fallbacks' in which
+                             fewer than k objects got votes_required votes, the queries 'truncated'
+                             by a budget, those answered by 'brute_force' by the planner of
+                             set_query_planner or for a selective filter, and the time in nanoseconds spent in 'projection_ns',
+                             'routing_ns', 'voting_ns' and 'search_ns'.
+        :param max_distances: If positive, at most this many candidates, at least k, are scored by the
+                              linear search, those with the most votes. Bounds the latency of a query.
+        :param time_budget: If positive, the time in seconds a query may take: the linear search, which
+                            scores the candidates in decreasing order of votes, stops when it is over
+                            and the nearest neighbors found so far are returned.
+        :param out: If given, the neighbors are written into this int32 array instead of a new one, and
+                    it is returned. It must be C-contiguous and have the shape of the result, (k,) for
+                    a single query and (n, k) for n queries. Reusing the arrays makes repeated queries
+                    allocation-free.
+        :param out_distances: Like out, a float32 array for the distances. Implies return_distances.
+        :param return_votes: Whether the votes of the neighbors, the number of trees in which each
+                             shares a leaf with the query, are also returned, as int32 in the shape
+                             of the neighbors and 0 where there is no neighbor. Features for
+                             re-ranking the neighbors. Cannot be used with max_candidates.
+        :param target_candidates: If positive, votes_required is ignored and chosen for each query
+                                  instead, as the most votes that at least this many objects get, and
+                                  every query scores this many candidates, those with the most votes,
+                                  so that the latency varies less. Cannot be used with the other limits or return_votes.
+        :param return_confidence: Whether a dict of signals of how hard each query was is also returned, for
+                                  sending only the hard queries to a second pass with more trees or
+                                  max_candidates: the objects 'voted' for and the candidates 'elected', the
+                                  'vote_concentration', the mean votes of the neighbors over the most an
+                                  object can get, low when the trees disagree, and the 'distance_gap'
+                                  between the (k + 1)th nearest candidate and the kth, -1 if there is no
+                                  (k + 1)th. Scalars for a single query, arrays for a matrix. Cannot be
+                                  used with max_candidates, the other limits or return_votes.
+        :return: If return_distances is false, returns a vector of indices of the approximate
+                 nearest neighbors in the original input data for the corresponding query.
+                 Otherwise, returns a tuple where the first element contains the nearest
+                 neighbors and the second element contains their distances to the query.
+                 With return_votes, the votes are appended after the distances.
+                 With max_distances or time_budget, whether each query was cut short by them is
+                 appended to the returned tuple, as a bool or a bool vector, and with return_stats
+                 the dict of counters is appended after it, and then the dict of return_confidence.
+                 If the points have labels, see
+                 set_labels, the neighbors are returned as a new int64 array of their labels instead.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+
+        if max_candidates < 0:
+            raise ValueError("max_candidates must be non-negative")
+        if max_distances < 0 or time_budget < 0:
+            raise ValueError("max_distances and time_budget must be non-negative")
+        if target_candidates < 0:
+            raise ValueError("target_candidates must be non-negative")
+        if votes_required is None:
+            votes_required = self.votes_required
+        if out_distances is not None:
+            return_distances = True
+
+        return self.index.ann(q, k, votes_required, return_distances, max_candidates, return_stats,
+                              max_distances, time_budget, out, out_distances, return_votes, target_candidates,
+                              return_confidence)
+
+    def vector_query(self, k, votes_required=None, return_distances=False):
+        """
+        Returns a function answering single queries like ann with fixed k, votes_required and
+        return_distances, for serving one query at a time at a high rate. The arguments are checked
+        once here, and the function calls the extension directly with its arguments passed as a C
+        array, without the checks and the argument parsing of ann on every call. A C-contiguous
+        float32 vector is queried in place.
+        :param k: The number of neighbors the queries return
+        :param votes_required: As in ann, by default the value chosen by autotune, or 1
+        :param return_distances: Whether the function also returns the distances
+        :return: A function f(q, out=None) returning what ann(q, k, votes_required, return_distances,
+                 out=out) returns for a vector q. out is an int32 array of shape (k,) for the neighbors,
+                 or None for a new one.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        if votes_required is None:
+            votes_required = self.votes_required
+        if k < 1 or votes_required < 1:
+            raise ValueError("k and votes_required must be positive")
+        ann_vector = self.index.ann_vector
+        return_distances = bool(return_distances)
+
+        def query(q, out=None):
+            return ann_vector(q, k, votes_required, return_distances, out)
+        return query
+
+    def ann_pruned(self, q, k, n_trees, depth, votes_required=None, return_distances=False):
+        """
+        The approximate nearest neighbor query of the smaller index that prune would cut from this one:
+        only the first n_trees trees are used, each down to the given depth. A single index can so
+        answer queries with different tradeoffs of time and recall, such as the configurations
+        returned by autotune, without pruning copies of it.
+        :param q: The query or queries, as in ann
+        :param k: The number of neighbors the user wants the query to return
+        :param n_trees: The number of trees used, in the range [1, n_trees of the index]
+        :param depth: The depth the trees are used to, in the range [1, depth of the index]
+        :param votes_required: The number of votes an object has to get to be included in the linear search
+                               part of the query. By default the value chosen by autotune, or 1.
+        :param return_distances: Whether the distances are also returned
+        :return: As in ann without the budgets and statistics
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if not 1 <= n_trees <= self.n_trees:
+            raise ValueError("n_trees should be in range [1, %d]" % self.n_trees)
+        if not 1 <= depth <= self.depth:
+            raise ValueError("depth should be in range [1, %d]" % self.depth)
+        if votes_required is None:
+            votes_required = self.votes_required
+
+        return self.index.ann_pruned(q, k, votes_required, n_trees, depth, return_distances)
+
+    def ann_early_stop(self, q, k, patience, votes_required=None, max_trees=0, return_distances=False):
+        """
+        The approximate nearest neighbor query that visits the trees one at a time, scoring the
+        candidates elected by each tree right away, and stops once the k nearest found so far have
+        not changed for patience trees in a row. Easy queries so visit far fewer trees than hard
+        ones, which visit at most max_trees.
+        :param q: The query or queries, as in ann
+        :param k: The number of neighbors the user wants the query to return
+        :param patience: The number of trees in a row that leave the k nearest unchanged after which
+                         a query stops
+        :param votes_required: The number of votes an object has to get to be included in the linear search
+                               part of the query. By default the value chosen by autotune, or 1.
+        :param max_trees: The most trees a query visits, or 0 for all of them
+        :param return_distances: Whether the distances are also returned
+        :return: As in ann without the budgets and statistics
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if patience < 1 or max_trees < 0:
+            raise ValueError("patience should be positive and max_trees non-negative")
+        if votes_required is None:
+            votes_required = self.votes_required
+
+        return self.index.ann_early_stop(q, k, votes_required, patience, max_trees, return_distances)
+
+    def ann_confident(self, q, k, n_trees, votes_required=None, return_distances=False):
+        """
+        The approximate nearest neighbor query that votes only with the n_trees trees most confident
+        of the leaf of the query: those where its projections lie the farthest from the split
+        points they were compared with. The trees where a query grazed a split are the likeliest
+        to have put it in the wrong leaf, so leaving them out saves their votes and their noisy
+        candidates. Each query chooses its own trees.
+        :param q: The query or queries, as in ann
+        :param k: The number of neighbors the user wants the query to return
+        :param n_trees: The number of trees that vote, in the range [1, n_trees of the index]
+        :param votes_required: The number of votes an object has to get to be included in the linear search
+                               part of the query. By default the value chosen by autotune, or 1.
+        :param return_distances: Whether the distances are also returned
+        :return: As in ann without the budgets and statistics
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if not 1 <= n_trees <= self.n_trees:
+            raise ValueError("n_trees should be in range [1, %d]" % self.n_trees)
+        if votes_required is None:
+            votes_required = self.votes_required
+
+        return self.index.ann_confident(q, k, votes_required, n_trees, return_distances)
+
+    def set_attribute(self, name, values):
+        """
+        Attaches an integer attribute, such as a category, to the indexed points, for make_filter to
+        make filters by. Setting an attribute again replaces its values. The attributes are not saved
+        with the index.
+        :param name: The name of the attribute
+        :param values: The value of every point, an integer vector with an element per point
+        """
+        if not self.built:
+            raise RuntimeError("Cannot set attributes before building index")
+        self.index.set_attribute(name, np.ascontiguousarray(values, dtype=np.int32))
+
+    def make_filter(self, mask=None, where=()):
+        """
+        Makes a filter for ann_filtered passed by the points that pass all of the given conditions.
+        A filter stays valid until points are inserted into the index, which never pass it.
+        :param mask: If given, a bool vector with an element per point telling which may be returned
+        :param where: Conditions on the attributes set with set_attribute as (name, op, value) tuples,
+                      op being one of '==', '!=', '<', '<=', '>' and '>='; for example
+                      [('category', '==', 3), ('in_stock', '==', 1)]
+        :return: The filter, an opaque object
+        """
+        if not self.built:
+            raise RuntimeError("Cannot make filters before building index")
+        ops = ['==', '!=', '<', '<=', '>', '>=']
+        conditions = []
+        for name, op, value in where:
+            if op not in ops:
+                raise ValueError("Unknown comparison %s" % op)
+            conditions.append((name, ops.index(op), int(value)))
+        if mask is not None:
+            mask = np.ascontiguousarray(mask, dtype=np.bool_)
+        return self.index.make_filter(mask, conditions)
+
+    def ann_filtered(self, q, k, filter, votes_required=None, return_distances=False):
+        """
+        The approximate nearest neighbor query of ann restricted to the points that pass a filter. The
+        points that do not pass are skipped while the votes are counted, so the k neighbors are found
+        among those that do. A selective filter is searched by brute force, which finds the exact
+        nearest neighbors among the points that pass it.
+        :param q: The query object, or a matrix where each row is a query
+        :param k: The number of neighbors the user wants the query to return
+        :param filter: The points that may be returned, made with make_filter
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+                               By default the value chosen by autotune, or 1.
+        :param return_distances: Whether the distances are also returned
+        :return: The neighbors as ann returns them, -1 if fewer than k points are found
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if votes_required is None:
+            votes_required = self.votes_required
+        return self.index.ann_filtered(q, filter, k, votes_required, return_distances)
+
+    def _query_rows(self, Q):
+        """
+        Returns the queries Q as a matrix with a query on each row, mapping a data file into memory
+        so that only the rows read are paged in.
+        """
+        if isinstance(Q, str):
+            shape = mrptlib.data_file_shape(Q)
+            offset = 64 if shape is not None else 0
+            if shape is None:
+                shape = (os.path.getsize(Q) // (4 * self.dim), self.dim)
+            return np.memmap(Q, dtype=np.float32, mode='r', offset=offset, shape=shape)
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32 or Q.ndim != 2:
+            raise ValueError("The query matrix should be two-dimensional and have type float32")
+        return Q
+
+    def ann_chunks(self, Q, k, votes_required=None, return_distances=False, chunk_size=65536):
+        """
+        Answers a large batch of queries a chunk at a time, without holding all the queries or all
+        the results in memory: the queries of each chunk are read from Q, answered in parallel as by
+        ann, and yielded before the next chunk is read.
+        :param Q: The queries as a float32 matrix with a query on each row, such as a numpy.memmap,
+                  or the path of a float32 data file, with the header of binary_converter or raw
+                  rows of the dimension of the index, which is mapped into memory
+        :param k: The number of neighbors of each query
+        :param votes_required: As in ann
+        :param return_distances: Whether the distances are also yielded
+        :param chunk_size: The number of queries of a chunk
+        :return: A generator of (first, neighbors) for each chunk, or (first, neighbors, distances)
+                 if return_distances is true, where first is the row of the first query of the chunk
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        if chunk_size < 1:
+            raise ValueError("The chunk size must be positive")
+        Q = self._query_rows(Q)
+        for first in range(0, len(Q), chunk_size):
+            result = self.ann(np.ascontiguousarray(Q[first:first + chunk_size]), k, votes_required,
+                              return_distances)
+            yield (first,) + result if return_distances else (first, result)
+
+    def ann_to_file(self, Q, k, path, votes_required=None, distances_path=None, chunk_size=65536):
+        """
+        Answers a large batch of queries a chunk at a time like ann_chunks, and writes the neighbors,
+        and optionally the distances, to files as raw row-major arrays with k columns. The results are
+        double buffered: a chunk is written by a background thread while the next one is answered,
+        so the output overlaps the queries and the memory holds at most two chunks of results.
+        :param Q: The queries, as in ann_chunks
+        :param k: The number of neighbors of each query
+        :param path: The file of the neighbors, int32, or int64 labels if the points have them
+        :param votes_required: As in ann
+        :param distances_path: If given, the file of the float32 distances
+        :param chunk_size: The number of queries of a chunk
+        :return: The number of queries answered
+        """
+        import threading
+        try:
+            import queue
+        except ImportError:
+            import Queue as queue
+
+        chunks = queue.Queue(maxsize=1)
+        errors = []
+
+        def write():
+            try:
+                with open(path, 'wb') as ids_file, \
+                        (open(distances_path, 'wb') if distances_path else open(os.devnull, 'wb')) as dist_file:
+                    while True:
+                        chunk = chunks.get()
+                        if chunk is None:
+                            break
+                        ids_file.write(chunk[0].tobytes())
+                        if distances_path:
+                            dist_file.write(chunk[1].tobytes())
+            except Exception as e:
+                errors.append(e)
+                # keep taking the chunks so that the queries are not blocked
+                while chunks.get() is not None:
+                    pass
+
+        writer = threading.Thread(target=write)
+        writer.daemon = True
+        writer.start()
+        n = 0
+        try:
+            for chunk in self.ann_chunks(Q, k, votes_required, distances_path is not None, chunk_size):
+                if errors:
+                    break
+                chunks.put(chunk[1:])
+                n += len(chunk[1])
+        finally:
+            chunks.put(None)
+            writer.join()
+        if errors:
+            raise errors[0]
+        return n
+
+    def ann_excluding(self, q, k, exclude, votes_required=None, return_distances=False):
+        """
+        The approximate nearest neighbor query of ann that never returns the excluded points, such as
+        the indexed point the query was made from and the items already seen. The excluded points get
+        no votes, so k other neighbors are found at the cost of a query for k, without querying for
+        more and dropping them.
+        :param q: The query object, or a matrix where each row is a query
+        :param k: The number of neighbors the user wants the query to return
+        :param exclude: The points not returned, by their labels if they have them and their ids
+                        otherwise: a sequence of them for a single query, or a sequence of such
+                        sequences, one for each row of a matrix of queries
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+                               By default the value chosen by autotune, or 1.
+        :param return_distances: Whether the distances are also returned
+        :return: The neighbors as ann returns them, -1 if fewer than k points are found
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if votes_required is None:
+            votes_required = self.votes_required
+        lists = [exclude] if q.ndim == 1 else list(exclude)
+        if len(lists) != (1 if q.ndim == 1 else len(q)):
+            raise ValueError("There should be a list of excluded points for each query")
+        lists = [np.asarray(ids, dtype=np.int64).ravel() for ids in lists]
+        indptr = np.zeros(len(lists) + 1, dtype=np.int64)
+        indptr[1:] = np.cumsum([len(ids) for ids in lists])
+        excluded = np.ascontiguousarray(np.concatenate(lists) if lists else np.zeros(0), dtype=np.int64)
+        return self.index.ann_excluding(q, indptr, excluded, k, votes_required, return_distances)
+
+    def project(self, q):
+        """
+        Projects queries onto the random vectors of the index, for ann_projected of this index and of
+        the other indexes with the same projection (see same_projection).
+        :param q: The query object, or a matrix where each row is a query
+        :return: The projections, a float32 vector, or a matrix with a row for each query
+        """
+        if not self.built:
+            raise RuntimeError("Cannot project before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        return self.index.project(q)
+
+    def ann_projected(self, q, projections, k, votes_required=None, return_distances=False):
+        """
+        The approximate nearest neighbor query of ann with the projections of the queries computed
+        earlier by project, of this index or of another one with the same_projection, so that
+        queries searched in many such indexes, such as the partitions of the data by tenant or by
+        time, are projected once. See also ann_many.
+        :param q: The query object, or a matrix where each row is a query
+        :param projections: The projections of q returned by project
+        :param k: The number of neighbors the user wants the query to return
+        :param votes_required: See ann
+        :param return_distances: Whether the distances are also returned
+        :return: The neighbors as ann returns them
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if votes_required is None:
+            votes_required = self.votes_required
+        projections = np.ascontiguousarray(projections, dtype=np.float32)
+        return self.index.ann_projected(q, projections, k, votes_required, return_distances)
+
+    def same_projection(self, other):
         """
-        Initializes an MRPT index object.
-        :param data: Input data either as a NxDim numpy ndarray or as a filepath to a binary file containing the data
-        :param depth: The depth of the trees
-        :param n_trees: The number of trees used in the index
-        :param projection_sparsity: Expected ratio of non-zero components in a projection matrix
-        :param shape: Shape of the data as a tuple (N, dim). Needs to be specified only if loading the data from a file.
-        :param mmap: If true, the data is mapped into memory. Has effect only if the data is loaded from a file.
-        :return:
+        Returns whether another index projects the queries onto the same random vectors as this one,
+        which is the case for indexes built with the same dimension, n_trees, depth, density,
+        projection, metric and nonzero seed, so that the projections of one can be used by the other.
+        :param other: Another built MRPTIndex
+        :return: True if the projections of the indexes are the same
         """
-        if isinstance(data, np.ndarray):
-            if len(data) == 0 or len(data.shape) != 2:
-                raise ValueError("The data matrix should be non-empty and two-dimensional")
-            if data.dtype != np.float32:
-                raise ValueError("The data matrix should have type float32")
-            if not data.flags['C_CONTIGUOUS'] or not data.flags['ALIGNED']:
-                raise ValueError("The data matrix has to be C_CONTIGUOUS and ALIGNED")
-            n_samples, dim = data.shape
-        elif isinstance(data, str):
-            if not isinstance(shape, tuple) or len(shape) != 2:
-                raise ValueError("You must specify the shape of the data as a tuple (N, dim) "
-                                 "when loading data from a binary file")
-            n_samples, dim = shape
-        else:
-            raise ValueError("Data must be either an ndarray or a filepath")
+        if not self.built or not other.built:
+            raise RuntimeError("Cannot compare the projections before building the indexes")
+        return self.index.same_projection(other.index)
 
-        max_depth = np.ceil(np.log2(n_samples))
-        if not 1 <= depth <= max_depth:
-            raise ValueError("Depth should be in range [1, %d]" % max_depth)
+    def ann_async(self, q, k, votes_required=None, return_distances=False, loop=None):
+        """
+        Starts an approximate nearest neighbor query without blocking, for use in an asyncio event
+        loop: await index.ann_async(q, k). The queries are answered by a thread of their own, which
+        answers the queries submitted concurrently together, like a matrix of queries given to ann.
+        :param q: The query vector
+        :param k: The number of neighbors the user wants the query to return
+        :param votes_required: See ann
+        :param return_distances: Whether the distances are also returned
+        :param loop: The event loop the result is delivered in, by default the current one
+        :return: An asyncio future of the result ann would return for the same arguments. Cancelling
+                 it does not stop the query.
+        """
+        import asyncio
 
-        if n_trees < 1:
-            raise ValueError("Number of trees must be positive")
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32 or q.shape != (self.dim,):
+            raise ValueError("The query should be a float32 vector of dimension %d" % self.dim)
+        if votes_required is None:
+            votes_required = self.votes_required
+        if loop is None:
+            loop = asyncio.get_event_loop()
 
-        if projection_sparsity == 'auto':
-            projection_sparsity = 1. / np.sqrt(dim)
-        elif projection_sparsity is None:
-            projection_sparsity = 1
-        elif not 0 < projection_sparsity <= 1:
-            raise ValueError("Sparsity should be in (0, 1]")
+        future = loop.create_future()
 
-        if mmap and os.name == 'nt':
-            raise ValueError("Memory mapping is not available on Windows")
+        def deliver(nearest, distances):
+            if not future.cancelled():
+                future.set_result((nearest, distances) if return_distances else nearest)
 
-        self.index = mrptlib.MrptIndex(data, n_samples, dim, depth, n_trees, projection_sparsity, mmap)
-        self.built = False
+        # called on the thread answering the query
+        def done(nearest, distances):
+            loop.call_soon_threadsafe(deliver, nearest, distances)
 
-    def build(self,keep_data=True):
-        """
-        Builds the MRPT index.
-        :return:
-        """
-        self.index.build(keep_data)
-        self.built = True
+        self.index.ann_submit(q, k, votes_required, return_distances, done)
+        return future
 
-    def save(self, path):
+    def set_async_batching(self, max_batch=256, max_wait=0.0):
         """
-        Saves the MRPT index to a file.
-        :param path: Filepath to the location of the saved index.
+        Sets how the queries of ann_async are batched. The queries waiting when the previous batch is
+        answered are answered together, so the batches grow with the load without delaying any query.
+        Waits for the pending queries of ann_async.
+        :param max_batch: The largest number of queries answered together
+        :param max_wait: How long in seconds to wait for a batch to fill once a query is waiting.
+                         Trades latency for throughput when the load is light.
         :return:
         """
-        if not self.built:
-            raise RuntimeError("Cannot save index before building")
-        self.index.save(path)
+        if max_batch < 1 or max_wait < 0:
+            raise ValueError("max_batch must be positive and max_wait non-negative")
+        self.index.set_async_batching(max_batch, int(max_wait * 1e6))
 
-    def load(self, path):
+    def async_stats(self):
         """
-        Loads the MRPT index from a file.
-        :param path: Filepath to the location of the index.
-        :return:
+        Returns how the queries of ann_async were batched since the last set_async_batching.
+        :return: A dict with the number of 'batches', the 'queries' answered in them and the
+                 'full_batches' of max_batch queries.
         """
-        self.index.load(path)
-        self.built = True
+        return self.index.async_stats()
 
-    def ann(self, q, k, votes_required=1, return_distances=False):
+    def ann_pages(self, q, k, votes_required=None, return_distances=False):
         """
-        The MRPT approximate nearest neighbor query.
-        :param q: The query object, i.e. the vector whose nearest neighbors are searched for
-        :param k: The number of neighbors the user wants the query to return
-        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+        Starts an approximate nearest neighbor query whose results are taken a page at a time, such as
+        the results of a search shown 20 at a time. The candidates elected for the query are scored
+        once and kept for the later pages, which next_page then takes without repeating the search,
+        visiting more leaves of the trees only when the candidates run out. The first page holds the
+        neighbors ann returns for the same k when the trees elect at least k candidates.
+        :param q: The query vector
+        :param k: The number of neighbors in the first page
+        :param votes_required: See ann
         :param return_distances: Whether the distances are also returned
-        :return: If return_distances is false, returns a vector of indices of the approximate
-                 nearest neighbors in the original input data for the corresponding query.
-                 Otherwise, returns a tuple where the first element contains the nearest
-                 neighbors and the second element contains their distances to the query.
+        :return: A token for next_page, and the first page as ann would return it
         """
         if not self.built:
             raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
         if q.dtype != np.float32:
-            raise ValueError("The query matrix should have type float32")
+            raise ValueError("The query should have type float32")
+        if votes_required is None:
+            votes_required = self.votes_required
 
-        return self.index.ann(q, k, votes_required, return_distances)
+        return self.index.ann_pages(q, k, votes_required, return_distances)
 
-    def exact_search(self, Q, k, return_distances=False):
+    def next_page(self, token, k, return_distances=False):
+        """
+        Returns the next page of the results of a query started by ann_pages, in order of distance.
+        A page for which more leaves were visited may hold neighbors nearer than those of the earlier
+        pages, which did not see them.
+        :param token: The token returned by ann_pages
+        :param k: The number of neighbors in the page
+        :param return_distances: Whether the distances are also returned
+        :return: As ann, with fewer than k neighbors at the end of the results. Raises a KeyError if
+                 no page of the query has been asked for within the time to live of set_page_sessions,
+                 or the index has changed since the query was started.
+        """
+        return self.index.next_page(token, k, return_distances)
+
+    def close_pages(self, token):
+        """
+        Drops the results of a query started by ann_pages before their time to live runs out, for
+        example when the user leaves them.
+        :param token: The token returned by ann_pages
+        :return:
+        """
+        self.index.close_pages(token)
+
+    def set_page_sessions(self, capacity=1024, ttl=60.0):
+        """
+        Sets how the queries of ann_pages are kept. Drops the queries kept so far.
+        :param capacity: The most queries kept, the least recently used being dropped to make room
+        :param ttl: How long in seconds a query is kept after its last page
+        :return:
+        """
+        if capacity < 1 or ttl <= 0:
+            raise ValueError("capacity and ttl must be positive")
+        self.index.set_page_sessions(capacity, int(ttl * 1000))
+
+    def exact_search(self, Q, k, return_distances=False, out=None, out_distances=None):
         """
         Performs an exact nearest neighbor query for several queries in parallel. The queries are
         given as a numpy matrix where each row contains a query. Useful for measuring accuracy.
         :param Q: The query object, i.e. the vector whose nearest neighbors are searched for
         :param k: The number of neighbors the user wants the query to return
         :param return_distances: Whether the distances are also returned
+        :param out: If given, the int32 array the neighbors are written into, see ann
+        :param out_distances: If given, the float32 array the distances are written into. Implies
+                              return_distances.
         :return: If return_distances is false, returns a vector of indices of the exact
                  nearest neighbors in the original input data for the corresponding query.
                  Otherwise, returns a tuple where the first element contains the nearest
                  neighbors and the second element contains their distances to the query.
+                 The neighbors are labels if the points have them, as in ann.
+        """
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        if out_distances is not None:
+            return_distances = True
+
+        return self.index.exact_search(Q, k, return_distances, out, out_distances)
+
+    def query_set(self, Q, k, votes_required=1, aggregation='min', return_distances=False):
+        """
+        Finds the k nearest neighbors of a set of query vectors, such as the items of a session,
+        without querying them one by one: the set is projected at once, a tree votes for the
+        objects sharing a leaf with any of its vectors, and each candidate elected is scored once
+        against all the vectors. The objects are ranked by their distance to the nearest vector of
+        the set, or by their mean distance to the vectors.
+        :param Q: The query vectors as a float32 matrix with a vector on each row
+        :param k: The number of neighbors the user wants the query to return
+        :param votes_required: The number of trees in which an object must share a leaf with a
+                               vector of the set to be scored, as in ann
+        :param aggregation: 'min' or 'mean', how the distances to the vectors are combined
+        :param return_distances: Whether the combined distances are also returned
+        :return: The neighbors of the set, -1 where fewer are found, and their distances if
+                 return_distances is true. The neighbors are labels if the points have them.
         """
+        if not self.built:
+            raise RuntimeError("Cannot query an index that has not been built")
+        if aggregation not in ('min', 'mean'):
+            raise ValueError("The aggregation should be 'min' or 'mean'")
+        Q = np.asarray(Q)
         if Q.dtype != np.float32:
             raise ValueError("The query matrix should have type float32")
+        if Q.ndim != 2 or not len(Q):
+            raise ValueError("The query vectors should be the rows of a non-empty matrix")
 
-        return self.index.exact_search(Q, k, return_distances)
+        return self.index.query_set(Q, k, votes_required, aggregation == 'mean', return_distances)
 
     def get_leaves(self, Q):
         """
@@ -126,10 +1833,67 @@ class MRPTIndex(object):
         """
         if not self.built:
             raise RuntimeError("Cannot query before building index")
+        Q = np.asarray(Q)
         if Q.dtype != np.float32:
             raise ValueError("The query matrix should have type float32")
         return self.index.get_leaves(Q)
 
+    def get_leaves_batch(self, Q):
+        """
+        Gets the points in the leaves of every tree for each of several queries, in one call that
+        divides the queries between the threads.
+        :param Q: The queries as a matrix where each row is a query
+        :return: A tuple (indptr, indices) in the layout of a CSR matrix: the points in the leaves of
+                 query i are indices[indptr[i]:indptr[i + 1]], a point once per tree whose leaf holds
+                 it, as get_leaves returns them. indptr is int64 and indices int32, and
+                 scipy.sparse.csr_matrix((np.ones(len(indices)), indices, indptr)) counts the votes.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32 or len(Q.shape) != 2:
+            raise ValueError("The query matrix should be a float32 matrix")
+        return self.index.get_leaves_batch(Q)
+
+    def query_radius(self, q, radius, votes_required=1, return_distances=False):
+        """
+        Gets the approximate neighbors within a distance of a query, or of each of several queries,
+        instead of a fixed number of nearest neighbors. The candidates are elected by votes as in ann
+        and all those within radius are returned, in no particular order.
+        :param q: The query object, or a matrix where each row is a query
+        :param radius: The largest distance of a neighbor. With the inner product and cosine metrics the
+                       smallest inner product or cosine similarity of a neighbor.
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+        :param return_distances: Whether the distances are also returned
+        :return: For a single query the indices of its neighbors. For several queries a tuple
+                 (indptr, indices) in the layout of a CSR matrix, the neighbors of query i being
+                 indices[indptr[i]:indptr[i + 1]]. With return_distances a tuple of these and the
+                 distances of the neighbors, laid out as the indices.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
+        if q.dtype != np.float32:
+            raise ValueError("The query matrix should have type float32")
+        return self.index.radius_search(q, radius, votes_required, return_distances)
+
+    def knn_graph(self, k, votes_required=1, return_distances=False):
+        """
+        Gets approximate k nearest neighbors of every indexed point, the edges of a k-nearest-neighbor
+        graph of the data, by comparing the points that share leaves instead of querying each point.
+        With votes_required=1 the leaves are joined with themselves and each distance computed is
+        shared by both points of the pair.
+        :param k: The number of neighbors of each point
+        :param votes_required: The number of leaves of a point a neighbor must share
+        :param return_distances: Whether the distances are also returned
+        :return: A tuple (indptr, indices) in the layout of a CSR matrix: the neighbors of point i are
+                 indices[indptr[i]:indptr[i + 1]] in ascending order of distance, at most k and
+                 never i itself. With return_distances the matching distances follow as a third array.
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        return self.index.knn_graph(k, votes_required, return_distances)
+
     def exact_nn_from_leaves(self, Q, leaves, k):
         """
         Gets the coordinates for the set of k nearest from the
@@ -141,6 +1905,7 @@ class MRPTIndex(object):
         """
         if not self.built:
             raise RuntimeError("Cannot query before building index")
+        Q = np.asarray(Q)
         if Q.dtype != np.float32:
             raise ValueError("The query matrix should have type float32")
         return self.index.get_nearest_leaves(Q, leaves, len(leaves), k)
@@ -158,6 +1923,7 @@ class MRPTIndex(object):
         """
         if not self.built:
             raise RuntimeError("Cannot query before building index")
+        q = np.asarray(q)
         if q.dtype != np.float32:
             raise ValueError("The query matrix should have type float32")
         return self.index.ann_from_leaves(q, leaves, len(leaves), k, votes_required, return_distances)
@@ -166,3 +1932,522 @@ class MRPTIndex(object):
         if not self.built:
             raise RuntimeError("Cannot get voted leaves before building index")
         return self.index.filter_leaves_by_votes(leaves,len(leaves),votes_required)
+
+    def ann_from_leaves_batch(self, Q, indptr, leaves, k, votes_required=1, return_distances=False):
+        """
+        Gets the k approximate nearest neighbors of each of several queries from candidate leaves of
+        its own, as ann_from_leaves does for one query, in one call that divides the queries between
+        the threads.
+        :param Q: The queries as a matrix where each row is a query
+        :param indptr: The candidates of query i are leaves[indptr[i]:indptr[i + 1]]
+        :param leaves: The candidate leaf indices of all the queries, as get_leaves_batch returns them
+        :param k: The number of neighbors searched for
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+        :param return_distances: Whether the distances are also returned
+        :return: A matrix with a row of k indices for each query, and the matching matrix of
+                 distances if return_distances is True
+        """
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        Q = np.asarray(Q)
+        if Q.dtype != np.float32 or len(Q.shape) != 2:
+            raise ValueError("The query matrix should be a float32 matrix")
+        indptr = np.ascontiguousarray(indptr, dtype=np.int64)
+        leaves = np.ascontiguousarray(leaves, dtype=np.int32)
+        return self.index.ann_from_leaves_batch(Q, indptr, leaves, k, votes_required, return_distances)
+
+    def filter_leaves_by_votes_batch(self, indptr, leaves, votes_required=1):
+        """
+        Filters the candidate leaves of each of several queries by votes, as filter_leaves_by_votes
+        does for one query, in one call that divides the queries between the threads.
+        :param indptr: The candidates of query i are leaves[indptr[i]:indptr[i + 1]]
+        :param leaves: The candidate leaf indices of all the queries, as get_leaves_batch returns them
+        :param votes_required: The number of times a candidate must appear among those of its query
+        :return: A tuple (indptr, indices) in the same layout, with the candidates kept for each query
+        """
+        if not self.built:
+            raise RuntimeError("Cannot get voted leaves before building index")
+        indptr = np.ascontiguousarray(indptr, dtype=np.int64)
+        leaves = np.ascontiguousarray(leaves, dtype=np.int32)
+        return self.index.filter_leaves_by_votes_batch(indptr, leaves, votes_required)
+
+
+def ann_many(indexes, q, k, votes_required=None, return_distances=False):
+    """
+    Answers the same approximate nearest neighbor queries in several indexes, such as the partitions
+    of the data by tenant or by time, projecting the queries only once for all the indexes with the
+    same projection (see MRPTIndex.same_projection), for example those built with one seed. The
+    indexes then only route, vote and score the candidates.
+    :param indexes: The built MRPTIndex objects
+    :param q: The query object, or a matrix where each row is a query
+    :param k: The number of neighbors the user wants each index to return
+    :param votes_required: See MRPTIndex.ann; by default the value of each index
+    :param return_distances: Whether the distances are also returned
+    :return: A list of the neighbors each index returns, as MRPTIndex.ann returns them
+    """
+    projected = []
+    results = []
+    for index in indexes:
+        projections = next((p for source, p in projected if source.same_projection(index)), None)
+        if projections is None:
+            projections = index.project(q)
+            projected.append((index, projections))
+        results.append(index.ann_projected(q, projections, k, votes_required, return_distances))
+    return results
+
+
+def exact_search_file(path, Q, k, metric='euclidean', return_distances=False, block_bytes=256 << 20):
+    """
+    Finds the exact nearest neighbors of queries among the points of a float32 data file without
+    loading it into memory, for ground truth over data larger than the memory. The file is read
+    once from start to end, in blocks read in the background while the block before is scored
+    against all the queries with all threads.
+    :param path: A data file as written by binary_converter, or a raw float32 file of the rows only
+    :param Q: The query object, or a matrix where each row is a query, of the dimension of the file
+    :param k: The number of neighbors the user wants each query to return
+    :param metric: 'euclidean', 'inner_product' or 'cosine', as in the constructor of MRPTIndex
+    :param return_distances: Whether the distances are also returned
+    :param block_bytes: The bytes of a block; two blocks are held in memory at once
+    :return: The indices of the neighbors as the rows of the file, and their distances with
+             return_distances, as in MRPTIndex.exact_search
+    """
+    metrics = ('euclidean', 'inner_product', 'cosine')
+    if metric not in metrics:
+        raise ValueError("Metric should be one of %s" % ', '.join(metrics))
+    Q = np.asarray(Q)
+    if Q.dtype != np.float32:
+        raise ValueError("The query matrix should have type float32")
+    return mrptlib.exact_search_file(path, Q, Q.shape[-1], k, return_distances, metrics.index(metric),
+                                     block_bytes)
+
+
+def _open_pickled_index(source, depth, n_trees, votes_required, index_path):
+    """
+    Opens an index pickled by MRPTIndex.__reduce__, mapping its data file and its index file into
+    memory. A compressed index file cannot be mapped, and is read into memory instead.
+    """
+    source = dict(source)
+    data, shape = source.pop('data'), source.pop('shape')
+    index = MRPTIndex(data, depth, n_trees, shape=shape, mmap=True, **source)
+    try:
+        index.load(index_path, mmap=True, verify=False)
+    except IOError:
+        index.load(index_path, verify=False)
+    index.votes_required = votes_required
+    return index
+
+
+class MRPTBuilder(object):
+    """
+    Builds an MRPTIndex from data that arrives in chunks, such as the batches of a Spark or Arrow
+    pipeline, without ever holding all of it in one array. Each chunk given to add_chunk is
+    appended to a scratch data file, and finish maps the file into memory and builds the index
+    from it with a bounded memory for the projections, so only one chunk at a time is in Python
+    memory.
+    """
+
+    def __init__(self, depth, n_trees, path=None, dir=None, mmap=True, **kwargs):
+        """
+        :param depth: The depth of the trees
+        :param n_trees: The number of trees used in the index
+        :param path: The data file the chunks are written to, which is kept after finish. By default
+                     a scratch file is created in dir and removed by finish, or by close.
+        :param dir: The directory of the scratch file, by default the directory of temporary files
+        :param mmap: If true, the index maps the file into memory, so the data does not need to fit
+                     in memory. Otherwise it reads the file into memory.
+        :param kwargs: The other arguments of MRPTIndex, such as projection_sparsity, seed or metric
+        """
+        import tempfile
+
+        if path is None:
+            fd, path = tempfile.mkstemp(suffix='.bin', prefix='mrpt-', dir=dir)
+            self._file = os.fdopen(fd, 'w+b')
+            self._scratch = True
+        else:
+            self._file = open(path, 'w+b')
+            self._scratch = False
+        self.path = path
+        self.depth = depth
+        self.n_trees = n_trees
+        self.mmap = mmap
+        self._kwargs = kwargs
+        self.n = 0
+        self.dim = None
+        # the header is written again by finish, when the number of points is known
+        self._file.write(_data_file_header(0, 0))
+
+    def add_chunk(self, chunk):
+        """
+        Appends the points of a chunk to the data.
+        :param chunk: The points as a two-dimensional array, or any object numpy converts to one, with a
+                      point on each row. A chunk of another type than float32 is converted one chunk at
+                      a time.
+        :return:
+        """
+        if self._file is None:
+            raise RuntimeError("The builder has already finished")
+        chunk = np.ascontiguousarray(chunk, dtype=np.float32)
+        if len(chunk.shape) != 2:
+            raise ValueError("A chunk should be two-dimensional")
+        if self.dim is None:
+            self.dim = chunk.shape[1]
+        elif chunk.shape[1] != self.dim:
+            raise ValueError("The chunks should have %d columns" % self.dim)
+        self._file.write(memoryview(chunk).cast('B'))
+        self.n += chunk.shape[0]
+
+    def add_chunks(self, chunks):
+        """
+        Appends the points of every chunk of an iterable, as add_chunk does for one chunk.
+        :param chunks: An iterable of chunks, such as a generator, which is consumed one chunk at a time
+        :return:
+        """
+        for chunk in chunks:
+            self.add_chunk(chunk)
+
+    def finish(self, memory_limit=0, **kwargs):
+        """
+        Builds the index from the chunks added.
+        :param memory_limit: The maximum number of bytes used for the random projections while the trees
+                             are built, as for MRPTIndex.build, or 0 for no limit.
+        :param kwargs: The other arguments of MRPTIndex.build
+        :return: The built MRPTIndex
+        """
+        if self._file is None:
+            raise RuntimeError("The builder has already finished")
+        if self.n == 0:
+            self.close()
+            raise ValueError("No points were added")
+        self._file.seek(0)
+        self._file.write(_data_file_header(self.n, self.dim))
+        self._file.close()
+        self._file = None
+        try:
+            index = MRPTIndex(self.path, self.depth, self.n_trees, mmap=self.mmap, **self._kwargs)
+            index.build(memory_limit=memory_limit, **kwargs)
+        finally:
+            # a mapped file stays readable after it is removed, except on Windows
+            if self._scratch:
+                try:
+                    os.remove(self.path)
+                except OSError:
+                    pass
+        return index
+
+    def close(self):
+        """
+        Discards the chunks added, removing the scratch file, without building an index.
+        :return:
+        """
+        if self._file is not None:
+            self._file.close()
+            self._file = None
+            if self._scratch:
+                os.remove(self.path)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+
+def _data_file_header(n, dim):
+    """
+    Returns the header of 64 bytes of a data file of n float32 points of dimension dim, as in
+    cpp/mrpt_data.h.
+    """
+    return struct.pack('<8sIIqqQ24x', b'MRPTDATA', 1, 0, n, dim, 64)
+
+
+class IndexHandle(object):
+    """
+    Swaps the MRPTIndex a server queries without restarting it. Queries take the current index with
+    get and keep using it until they are done, so after a swap the new queries go to the new index
+    while those in flight finish on the old one, which is freed once nothing refers to it. The next
+    index can be loaded and prefaulted in the background with preload while the current one serves.
+    """
+
+    def __init__(self, index=None):
+        self.index = index
+        self._loader = None
+        self._preloaded = None
+        self._error = None
+
+    def get(self):
+        """
+        Returns the current index.
+        """
+        return self.index
+
+    def swap(self, index):
+        """
+        Makes index the current index.
+        :return: The previous index.
+        """
+        previous, self.index = self.index, index
+        return previous
+
+    def preload(self, load):
+        """
+        Starts building the next index in a background thread. A preload that was not swapped in is
+        waited for and discarded.
+        :param load: A function that constructs an MRPTIndex, loads it and returns it. The index is
+                     then prefaulted.
+        :return:
+        """
+        import threading
+
+        self.wait_preload()
+        self._preloaded = self._error = None
+
+        def run():
+            try:
+                index = load()
+                index.prefault()
+                self._preloaded = index
+            except Exception as e:
+                self._error = e
+
+        self._loader = threading.Thread(target=run)
+        self._loader.daemon = True
+        self._loader.start()
+
+    def wait_preload(self):
+        """
+        Waits for the index started by preload.
+        :return: True if it was built, false if it failed or none was started.
+        """
+        if self._loader is not None:
+            self._loader.join()
+            self._loader = None
+        return self._preloaded is not None
+
+    def swap_preloaded(self):
+        """
+        Waits for the index started by preload and makes it the current index. Raises the exception
+        of the preload if it failed, leaving the current index in place.
+        :return: The previous index.
+        """
+        if not self.wait_preload():
+            error, self._error = self._error, None
+            raise error if error is not None else RuntimeError("No index was preloaded")
+        index, self._preloaded = self._preloaded, None
+        return self.swap(index)
+
+
+class SparseMRPTIndex(object):
+    """
+    An index of sparse data, such as TF-IDF or hashed feature vectors, given as a scipy.sparse
+    matrix with a point on each row. The data and the queries are never made dense: the trees
+    project them with sparse random vectors, and the candidates are scored with sparse dot
+    products. The queries are safe to run concurrently; build must not overlap with other calls.
+    """
+    def __init__(self, data, depth, n_trees, projection_sparsity='auto', seed=0):
+        """
+        Initializes an MRPT index object of sparse data.
+        :param data: A scipy.sparse matrix, converted to CSR with float32 values if needed
+        :param depth: The depth of the trees; should be in the range [1, log2(N)]
+        :param n_trees: The number of trees used in the index
+        :param projection_sparsity: Expected ratio of non-zero components in a random vector. The
+                                    default 'auto' makes a random vector share about three
+                                    dimensions with an average point, but at least 1 / sqrt(dim).
+        :param seed: The seed of the random projections. If 0, every build is random.
+        :return:
+        """
+        data = self._csr(data)
+        n_samples, dim = data.shape
+        if n_samples == 0:
+            raise ValueError("The data matrix should be non-empty")
+
+        max_depth = np.ceil(np.log2(n_samples))
+        if not 1 <= depth <= max_depth:
+            raise ValueError("Depth should be in range [1, %d]" % max_depth)
+
+        if n_trees < 1:
+            raise ValueError("Number of trees must be positive")
+
+        if projection_sparsity == 'auto':
+            projection_sparsity = min(1., max(1. / np.sqrt(dim), 3. * n_samples / max(1, data.nnz)))
+        elif not 0 < projection_sparsity <= 1:
+            raise ValueError("Sparsity should be in (0, 1]")
+
+        if not 0 <= seed < 2 ** 32:
+            raise ValueError("Seed should be in range [0, 2^32)")
+
+        self.index = mrptlib.SparseMrptIndex(data.data, data.indices, data.indptr, n_samples, dim, depth,
+                                             n_trees, projection_sparsity, seed)
+        self.dim = dim
+        self.built = False
+
+    @staticmethod
+    def _csr(X):
+        """
+        Returns X as a CSR matrix with float32 values, int32 indices and the indices of each row
+        sorted and without duplicates.
+        """
+        X = X.tocsr()
+        if X.dtype != np.float32:
+            X = X.astype(np.float32)
+        if X.indices.dtype != np.int32 or X.indptr.dtype != np.int32:
+            X = X.copy()
+            X.indices = X.indices.astype(np.int32)
+            X.indptr = X.indptr.astype(np.int32)
+        if not X.has_canonical_format:
+            X = X.copy()
+            X.sum_duplicates()
+        return X
+
+    def build(self):
+        """
+        Builds the index.
+        :return:
+        """
+        if self.built:
+            raise RuntimeError("The index has already been built")
+        self.index.build()
+        self.built = True
+
+    def _search(self, Q, k, votes_required, return_distances):
+        Q = self._csr(Q)
+        if Q.shape[1] != self.dim:
+            raise ValueError("The queries should have %d columns" % self.dim)
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        return self.index.search(Q.data, Q.indices, Q.indptr, Q.shape[0], k, votes_required, return_distances)
+
+    def ann(self, Q, k, votes_required=1, return_distances=False):
+        """
+        Finds the k approximate nearest neighbors of each query.
+        :param Q: The queries as a scipy.sparse matrix with a query on each row
+        :param k: The number of nearest neighbors to be returned
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+        :param return_distances: Whether the distances are also returned
+        :return: An array of shape (n_queries, k) of the indices of the neighbors, or a tuple of it and
+                 the array of their distances to the queries if return_distances is true.
+        """
+        if votes_required < 1:
+            raise ValueError("votes_required must be positive")
+        return self._search(Q, k, votes_required, return_distances)
+
+    def exact_search(self, Q, k, return_distances=False):
+        """
+        Finds the exact k nearest neighbors of each query.
+        :param Q: The queries as a scipy.sparse matrix with a query on each row
+        :param k: The number of nearest neighbors to be returned
+        :param return_distances: Whether the distances are also returned
+        :return: As in ann
+        """
+        return self._search(Q, k, 0, return_distances)
+
+
+class BinaryMRPTIndex(object):
+    """
+    An index of binary codes, such as image hashes, searched by Hamming distance. The codes are
+    kept packed, a bit per bit instead of a float32, and the trees split them by sampled bits.
+    The queries are safe to run concurrently; build must not overlap with other calls.
+    """
+    def __init__(self, data, depth, n_trees, bits=None, split_bits=1, seed=0):
+        """
+        Initializes an MRPT index object of binary codes.
+        :param data: The codes as a two-dimensional array with a code on each row, packed into uint8
+                     bytes as by numpy.packbits, or into uint64 words. The rows are padded with zero
+                     bits to whole 64-bit words, which copies them unless they already are; otherwise
+                     the index reads the array in place.
+        :param depth: The depth of the trees; should be in the range [1, log2(N)]
+        :param n_trees: The number of trees used in the index
+        :param bits: The number of bits of a code, by default all bits of a row. The bits of a row
+                     past it must be zero.
+        :param split_bits: The number of random bits a tree splits the codes by at each level:
+                           1 samples a bit, and more split by the number of bits set among a random
+                           half of them minus among the other half.
+        :param seed: The seed of the random bits. If 0, every build is random.
+        :return:
+        """
+        data = self._words(data)
+        n_samples = len(data)
+        if n_samples == 0:
+            raise ValueError("The data matrix should be non-empty")
+        if bits is None:
+            bits = 64 * data.shape[1]
+        if not 1 <= bits <= 64 * data.shape[1]:
+            raise ValueError("bits should be in range [1, %d]" % (64 * data.shape[1]))
+
+        max_depth = np.ceil(np.log2(n_samples))
+        if not 1 <= depth <= max_depth:
+            raise ValueError("Depth should be in range [1, %d]" % max_depth)
+
+        if n_trees < 1:
+            raise ValueError("Number of trees must be positive")
+
+        if not 1 <= split_bits <= bits:
+            raise ValueError("split_bits should be in range [1, %d]" % bits)
+
+        if not 0 <= seed < 2 ** 32:
+            raise ValueError("Seed should be in range [0, 2^32)")
+
+        self.index = mrptlib.BinaryMrptIndex(data, n_samples, bits, depth, n_trees, split_bits, seed)
+        self._data = data  # the index reads the array in place
+        self.words = data.shape[1]
+        self.built = False
+
+    @staticmethod
+    def _words(X):
+        """
+        Returns the codes on the rows of X as a C-contiguous uint64 array, padding the rows of bytes
+        with zeros to whole words.
+        """
+        X = np.asarray(X)
+        if len(X.shape) != 2:
+            raise ValueError("The codes should be a two-dimensional array")
+        if X.dtype == np.uint64:
+            return np.require(X, requirements=['C_CONTIGUOUS', 'ALIGNED'])
+        if X.dtype not in (np.uint8, np.int8):
+            raise ValueError("The codes should be packed into uint8 or uint64")
+        X = X.view(np.uint8)
+        padding = -X.shape[1] % 8
+        if padding:
+            X = np.hstack([X, np.zeros((len(X), padding), dtype=np.uint8)])
+        return np.ascontiguousarray(X).view(np.uint64)
+
+    def build(self):
+        """
+        Builds the index.
+        :return:
+        """
+        if self.built:
+            raise RuntimeError("The index has already been built")
+        self.index.build()
+        self.built = True
+
+    def _search(self, Q, k, votes_required, return_distances):
+        Q = self._words(np.atleast_2d(Q))
+        if Q.shape[1] != self.words:
+            raise ValueError("The queries should be codes of the same length as the data")
+        if not self.built:
+            raise RuntimeError("Cannot query before building index")
+        return self.index.search(Q, len(Q), k, votes_required, return_distances)
+
+    def ann(self, Q, k, votes_required=1, return_distances=False):
+        """
+        Finds the k approximate nearest neighbors of each query by Hamming distance.
+        :param Q: The query codes, packed like the data, a code on each row
+        :param k: The number of nearest neighbors to be returned
+        :param votes_required: The number of votes an object has to get to be included in the linear search part of the query.
+        :param return_distances: Whether the Hamming distances are also returned
+        :return: An array of shape (n_queries, k) of the indices of the neighbors, or a tuple of it and
+                 the float32 array of their distances to the queries if return_distances is true.
+        """
+        if votes_required < 1:
+            raise ValueError("votes_required must be positive")
+        return self._search(Q, k, votes_required, return_distances)
+
+    def exact_search(self, Q, k, return_distances=False):
+        """
+        Finds the exact k nearest neighbors of each query by Hamming distance.
+        :param Q: The query codes, packed like the data, a code on each row
+        :param k: The number of nearest neighbors to be returned
+        :param return_distances: Whether the distances are also returned
+        :return: As in ann
+        """
+        return self._search(Q, k, 0, return_distances)
@@ -4,11 +4,26 @@ import setuptools
 import numpy
 from setuptools import Extension
 
+# The distance kernels pick the instruction set at runtime, so by default the
+# module is built for a generic CPU and can be shipped to any machine. Set
+# MRPT_NATIVE=1 to tune the whole module for the building machine instead.
 # Not all CPUs have march as a tuning parameter
+import os
 import platform
-cputune, libraries, llvm = ['-march=native'], [], []
-if platform.machine() == 'ppc64le':
-    cputune = ['-mcpu=native']
+cputune, libraries, llvm = [], [], []
+# Set MRPT_OPENMP=0 to build without OpenMP, for processes that fork after
+# using the module; the index then runs its parallel loops serially unless it
+# is given a thread pool with set_executor.
+openmp_compile, openmp_link = ['-fopenmp'], ['-lgomp']
+if os.environ.get('MRPT_OPENMP', '1') == '0':
+    openmp_compile, openmp_link = ['-Wno-unknown-pragmas'], []
+# Set MRPT_ZSTD=1 to build with zstd, which MRPTIndex.save(compression=...)
+# needs to write compressed index files and load to read them.
+zstd_macros, zstd_libraries = [], []
+if os.environ.get('MRPT_ZSTD', '0') == '1':
+    zstd_macros, zstd_libraries = [('MRPT_ZSTD', '1')], ['zstd']
+if os.environ.get('MRPT_NATIVE', '0') == '1':
+    cputune = ['-mcpu=native'] if platform.machine() == 'ppc64le' else ['-march=native']
 if platform.system() == 'Darwin':
     llvm += ['-L/usr/local/opt/llvm/lib']
 if platform.system() == 'Windows':
@@ -31,9 +46,10 @@ setuptools.setup(
                 'cpp/mrptmodule.cpp',
             ],
             extra_compile_args=['-std=c++11', '-O3', '-ffast-math', '-s',
-                                '-fno-rtti', '-fopenmp', '-DNDEBUG'] + cputune,
-            libraries=libraries,
-            extra_link_args=['-lgomp'] + llvm,
+                                '-fno-rtti', '-DNDEBUG'] + openmp_compile + cputune,
+            libraries=libraries + zstd_libraries,
+            define_macros=zstd_macros,
+            extra_link_args=openmp_link + llvm,
             include_dirs=['cpp/lib', numpy.get_include()]
         )
     ]
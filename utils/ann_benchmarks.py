@@ -0,0 +1,310 @@
+"""
+Runs MRPTIndex by the protocol of ann-benchmarks (https://github.com/erikbern/ann-benchmarks), so that
+new features can be compared with the other engines on the same data sets and plots. The MRPT class
+is an algorithm wrapper with the interface of ann_benchmarks.algorithms.base.BaseANN, which
+ann-benchmarks runs itself when the module is copied into ann_benchmarks/algorithms/mrpt/ with the
+definitions of config_yml(). The module also runs the protocol by itself on a data set file of
+ann-benchmarks and writes the results as HDF5 files that its plotting scripts read:
+
+    python utils/ann_benchmarks.py --count 10 --batch sift-128-euclidean.hdf5 results/
+
+Each run of an algorithm with one set of query arguments is written to
+results/<dataset>/<count>/<algorithm>[-batch]/<name>.hdf5, with the build time, the index size,
+the time of every query and the neighbors and distances it returned.
+"""
+import os
+import re
+import time
+import numpy as np
+
+from mrpt import MRPTIndex
+
+try:
+    from ann_benchmarks.algorithms.base.module import BaseANN
+except ImportError:
+    try:
+        from ann_benchmarks.algorithms.base import BaseANN
+    except ImportError:
+        BaseANN = object
+
+# the distances of ann-benchmarks and the metrics that rank by them in the same order
+METRICS = {'euclidean': 'euclidean', 'angular': 'cosine'}
+
+# the parameter grids of the definitions and of run: the indexes built, and the query arguments
+# of each, the votes required for the fixed indexes and the target recalls for the autotuned ones
+GRID = {
+    'n_trees': [10, 20, 50, 100, 200],
+    'depth': [8, 10, 12, 14],
+    'votes_required': [1, 2, 3, 4, 5, 7, 10, 15, 20],
+}
+AUTOTUNED_GRID = {
+    'n_trees': [100, 400],
+    'target_recall': [0.5, 0.6, 0.7, 0.8, 0.85, 0.9, 0.925, 0.95, 0.97, 0.98, 0.99, 0.995],
+}
+
+
+class MRPT(BaseANN):
+    """
+    An index built with n_trees trees of the given depth, queried with the votes_required of
+    set_query_arguments. With depth None, the index is instead built with the depth autotune
+    suggests and tuned on a sample of the data, and set_query_arguments takes the recall to reach:
+    the queries then use the fastest configuration of trees, depth and votes estimated to reach it,
+    with ann_pruned on the one index.
+    """
+    def __init__(self, metric, n_trees, depth=None, count=10, tune_queries=1000, seed=1):
+        """
+        :param metric: The distance of the data set, 'euclidean' or 'angular'
+        :param n_trees: The number of trees of the index
+        :param depth: The depth of the trees, or None to autotune
+        :param count: The number of neighbors the index is tuned for
+        :param tune_queries: The number of points of the data autotune is run with
+        :param seed: The seed of the random projections and of the tuning sample
+        """
+        if metric not in METRICS:
+            raise ValueError("Metric should be one of %s" % ', '.join(METRICS))
+        self.metric = metric
+        self.n_trees = n_trees
+        self.depth = depth
+        self.count = count
+        self.tune_queries = tune_queries
+        self.seed = seed
+        self.index = None
+        self.votes_required = 1
+        self.pareto_front = None
+        self.configuration = None  # the (n_trees, depth, votes_required) of an autotuned index
+        self.name = 'MRPT(n_trees=%d, depth=%s)' % (n_trees, 'auto' if depth is None else depth)
+        self.res = None
+
+    def fit(self, X):
+        """
+        Builds the index of the rows of X.
+        :param X: The data as a float32 matrix with one point per row
+        :return:
+        """
+        X = np.ascontiguousarray(X, dtype=np.float32)
+        depth = self.depth
+        if depth is None:
+            # leaves of about 2^5 points, the deepest autotune considers usefully
+            depth = int(max(1, min(np.ceil(np.log2(len(X))), np.log2(len(X)) - 5)))
+        self.index = MRPTIndex(X, depth, self.n_trees, seed=self.seed, metric=METRICS[self.metric])
+        self.index.build()
+
+        if self.depth is None:
+            # the tuning queries are points of the data perturbed a little, so that they are not indexed
+            rng = np.random.RandomState(self.seed)
+            sample = X[rng.choice(len(X), min(self.tune_queries, len(X)), replace=False)]
+            scale = 0.01 * np.std(X, axis=0)
+            Q = (sample + scale * rng.standard_normal(sample.shape)).astype(np.float32)
+            self.pareto_front = self.index.autotune(Q, self.count)
+
+    def set_query_arguments(self, argument):
+        """
+        :param argument: The votes_required of a fixed index, or the target recall of an autotuned one
+        :return:
+        """
+        if self.pareto_front is None:
+            self.votes_required = argument
+            self.name = 'MRPT(n_trees=%d, depth=%d, votes_required=%d)' % (self.n_trees, self.depth, argument)
+            return
+        reaching = [p for p in self.pareto_front if p['estimated_recall'] >= argument]
+        best = reaching[0] if reaching else self.pareto_front[-1]
+        self.configuration = (best['n_trees'], best['depth'], best['votes_required'])
+        self.name = 'MRPT(target_recall=%g, n_trees=%d, depth=%d, votes_required=%d)' % (
+            (argument,) + self.configuration)
+
+    def _ann(self, q, n):
+        if self.configuration is None:
+            return self.index.ann(q, n, self.votes_required)
+        n_trees, depth, votes_required = self.configuration
+        return self.index.ann_pruned(q, n, n_trees, depth, votes_required)
+
+    def query(self, q, n):
+        """
+        :return: The indices of the n approximate nearest neighbors of the vector q
+        """
+        neighbors = self._ann(np.ascontiguousarray(q, dtype=np.float32), n)
+        return neighbors[neighbors >= 0]
+
+    def batch_query(self, X, n):
+        """
+        Answers the rows of X in parallel, for get_batch_results.
+        """
+        self.res = self._ann(np.ascontiguousarray(X, dtype=np.float32), n)
+
+    def get_batch_results(self):
+        return [row[row >= 0] for row in self.res]
+
+    def get_memory_usage(self):
+        """
+        :return: The memory of the index in kB, without the data
+        """
+        return self.index.memory_usage()['index'] / 1024.
+
+    def __str__(self):
+        return self.name
+
+
+def config_yml():
+    """
+    Returns the definitions of the algorithm for the config.yml of ann-benchmarks, in its
+    ann_benchmarks/algorithms/mrpt/ directory next to this module renamed module.py.
+    """
+    def run_group(name, args, query_args):
+        return ('      %s:\n        args: %s\n        query_args: [%s]\n'
+                % (name, args, query_args))
+
+    text = ('float:\n  any:\n  - base_args: [\'@metric\']\n    constructor: MRPT\n    disabled: false\n'
+            '    docker_tag: ann-benchmarks-mrpt\n    module: ann_benchmarks.algorithms.mrpt\n'
+            '    name: mrpt\n    run_groups:\n')
+    text += run_group('fixed', '[%s, %s]' % (GRID['n_trees'], GRID['depth']), GRID['votes_required'])
+    text += run_group('autotuned', '[%s, null]' % AUTOTUNED_GRID['n_trees'], AUTOTUNED_GRID['target_recall'])
+    return text
+
+
+def _distances(X, q, neighbors, metric):
+    points = X[neighbors]
+    if metric == 'euclidean':
+        return np.sqrt(np.sum((points - q) ** 2, axis=1))
+    norms = np.linalg.norm(points, axis=1) * np.linalg.norm(q)
+    return 1 - points.dot(q) / np.maximum(norms, 1e-30)
+
+
+def write_result(path, algo, attrs, times, neighbors, distances):
+    """
+    Writes a run as a result file of ann-benchmarks.
+    :param path: The path of the file
+    :param algo: The algorithm wrapper the run used
+    :param attrs: The attributes of the file: build_time, index_size, algo, dataset, count,
+                  distance, run_count, batch_mode and best_search_time
+    :param times: The time of each query in seconds
+    :param neighbors: The neighbors of each query, padded with -1 to count
+    :param distances: Their distances to the query, padded with inf
+    :return:
+    """
+    import h5py
+
+    directory = os.path.dirname(path)
+    if directory and not os.path.isdir(directory):
+        os.makedirs(directory)
+    with h5py.File(path, 'w') as f:
+        for key, value in attrs.items():
+            f.attrs[key] = value
+        f.attrs['name'] = str(algo)
+        f.attrs['type'] = 'knn'
+        f.attrs['candidates'] = 0
+        f.attrs['expect_extra'] = False
+        f.create_dataset('times', data=np.asarray(times, dtype=np.float64))
+        f.create_dataset('neighbors', data=np.asarray(neighbors, dtype=np.int64))
+        f.create_dataset('distances', data=np.asarray(distances, dtype=np.float64))
+
+
+def run(dataset_path, results_dir, count=10, batch=False, run_count=1, autotuned=True, fixed=True,
+        grid=None, autotuned_grid=None, max_queries=0):
+    """
+    Runs the parameter grids on a data set of ann-benchmarks like its runner: every index is built
+    once and queried with each of its query arguments, the queries are answered run_count times and
+    the fastest run is kept, and a result file is written for every query argument.
+    :param dataset_path: The HDF5 file of the data set, with train, test and neighbors
+    :param results_dir: The results directory of ann-benchmarks the files are written under
+    :param count: The number of neighbors searched for
+    :param batch: If true, the queries are answered together by batch_query, and every query is given
+                  the mean time of the batch
+    :param run_count: The number of times the queries are answered
+    :param autotuned: Whether the autotuned indexes are run
+    :param fixed: Whether the indexes of fixed depth are run
+    :param grid: The grid of the fixed indexes, by default GRID
+    :param autotuned_grid: The grid of the autotuned indexes, by default AUTOTUNED_GRID
+    :param max_queries: If positive, only this many test queries are answered
+    :return: A list of (name, build_time, queries per second, recall) of the runs, for a quick look
+    """
+    import h5py
+
+    grid = grid or GRID
+    autotuned_grid = autotuned_grid or AUTOTUNED_GRID
+    with h5py.File(dataset_path, 'r') as f:
+        distance = f.attrs['distance']
+        if isinstance(distance, bytes):
+            distance = distance.decode()
+        X = np.ascontiguousarray(f['train'], dtype=np.float32)
+        Q = np.ascontiguousarray(f['test'], dtype=np.float32)
+        truth = np.asarray(f['neighbors'])[:, :count]
+    if max_queries > 0:
+        Q, truth = Q[:max_queries], truth[:max_queries]
+    dataset = re.sub(r'\.hdf5$', '', os.path.basename(dataset_path))
+
+    indexes = []
+    if fixed:
+        indexes += [((t, d), grid['votes_required']) for t in grid['n_trees'] for d in grid['depth']
+                    if 2 ** d < len(X)]
+    if autotuned:
+        indexes += [((t, None), autotuned_grid['target_recall']) for t in autotuned_grid['n_trees']]
+
+    summary = []
+    for (n_trees, depth), query_arguments in indexes:
+        algo = MRPT(distance, n_trees, depth, count=count)
+        start = time.time()
+        algo.fit(X)
+        build_time = time.time() - start
+        index_size = algo.get_memory_usage()
+
+        for argument in query_arguments:
+            algo.set_query_arguments(argument)
+            best_time, times, results = float('inf'), None, None
+            for _ in range(run_count):
+                if batch:
+                    start = time.time()
+                    algo.batch_query(Q, count)
+                    run_results = algo.get_batch_results()
+                    total = time.time() - start
+                    run_times = [total / len(Q)] * len(Q)
+                else:
+                    run_times, run_results = [], []
+                    for q in Q:
+                        start = time.time()
+                        run_results.append(algo.query(q, count))
+                        run_times.append(time.time() - start)
+                    total = sum(run_times)
+                if total < best_time:
+                    best_time, times, results = total, run_times, run_results
+
+            neighbors = np.full((len(Q), count), -1, dtype=np.int64)
+            distances = np.full((len(Q), count), np.inf)
+            for i, found in enumerate(results):
+                neighbors[i, :len(found)] = found
+                distances[i, :len(found)] = _distances(X, Q[i], found, distance)
+            attrs = {'build_time': build_time, 'index_size': index_size, 'algo': 'mrpt', 'dataset': dataset,
+                     'count': count, 'distance': distance, 'run_count': run_count, 'batch_mode': batch,
+                     'best_search_time': best_time / len(Q)}
+            file_name = re.sub(r'[^\w.=-]+', '_', str(algo)).strip('_') + '.hdf5'
+            path = os.path.join(results_dir, dataset, str(count), 'mrpt-batch' if batch else 'mrpt', file_name)
+            write_result(path, algo, attrs, times, neighbors, distances)
+
+            recall = np.mean([len(np.intersect1d(found, t)) / float(count) for found, t in zip(results, truth)])
+            summary.append((str(algo), build_time, len(Q) / best_time, recall))
+    return summary
+
+
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(description='Runs MRPTIndex by the protocol of ann-benchmarks.')
+    parser.add_argument('dataset', nargs='?', help='an HDF5 data set of ann-benchmarks')
+    parser.add_argument('results', nargs='?', default='results', help='the results directory')
+    parser.add_argument('--count', type=int, default=10, help='the number of neighbors searched for')
+    parser.add_argument('--batch', action='store_true', help='answer the queries in batches')
+    parser.add_argument('--runs', type=int, default=1, help='the number of runs of the queries')
+    parser.add_argument('--max-queries', type=int, default=0, help='answer only this many queries')
+    parser.add_argument('--fixed-only', action='store_true', help='run only the indexes of fixed depth')
+    parser.add_argument('--autotuned-only', action='store_true', help='run only the autotuned indexes')
+    parser.add_argument('--config', action='store_true', help='print the definitions for config.yml and exit')
+    args = parser.parse_args()
+
+    if args.config:
+        print(config_yml())
+    elif args.dataset is None:
+        parser.error('the data set is required')
+    else:
+        for name, build_time, qps, recall in run(args.dataset, args.results, args.count, args.batch, args.runs,
+                                                 not args.fixed_only, not args.autotuned_only,
+                                                 max_queries=args.max_queries):
+            print('%s: build %.1f s, %.0f queries/s, recall %.3f' % (name, build_time, qps, recall))
@@ -1,3 +1,7 @@
+"""
+Converters of data sets into the raw float32 files MRPTIndex reads. For large data sets,
+cpp/binary_converter.cpp converts text, fvecs, bvecs and HDF5 files much faster.
+"""
 import os
 import array
 import struct